@@ -0,0 +1,421 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "common/typedefs.h"
+#include "common/thread_pool.h"
+
+#include "engine/timer.h"
+
+#include "scene/dynamic_bvh.h"
+#include "scene/frustum_culler.h"
+
+#include <DirectXMath.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+
+struct BenchmarkSettings {
+	BenchmarkSettings()
+		: Objects(100000u),
+		  Queries(1000u),
+		  Threads(0u) {
+	}
+
+	uint Objects;
+	uint Queries;
+	/** The number of worker threads for the async rebuild. 0 means one less than the number of hardware threads */
+	uint Threads;
+};
+
+struct Object {
+	DirectX::XMFLOAT3 Min;
+	DirectX::XMFLOAT3 Max;
+	uint Proxy;
+	bool Alive;
+};
+
+enum class QueryType {
+	FRUSTUM,
+	SPHERE,
+	AABB,
+	RAY
+};
+
+static const QueryType kQueryTypes[] = {QueryType::FRUSTUM, QueryType::SPHERE, QueryType::AABB, QueryType::RAY};
+
+const char *GetQueryTypeName(QueryType type) {
+	switch (type) {
+	case QueryType::FRUSTUM:
+		return "frustum";
+	case QueryType::SPHERE:
+		return "sphere";
+	case QueryType::AABB:
+		return "aabb";
+	default:
+		return "ray";
+	}
+}
+
+/** The parameters of a single query of any type */
+struct Query {
+	Scene::Frustum Frustum;
+	DirectX::XMFLOAT3 Point;
+	DirectX::XMFLOAT3 Vector;
+	float Scalar;
+};
+
+void PrintUsage() {
+	printf("Usage: BVHBenchmark [-objects <count>] [-queries <count>] [-threads <count>]\n\n"
+	       "    -objects    The number of objects in the tree. Defaults to 100000\n"
+	       "    -queries    The number of queries of each type. Defaults to 1000\n"
+	       "    -threads    The number of worker threads for the async rebuild. Defaults to one less than the number of hardware threads\n");
+}
+
+/** A model-sized box somewhere in a 2000 unit cube. A few of them are huge, like the terrain of a real scene */
+void RandomBox(std::mt19937 &generator, Object *object) {
+	std::uniform_real_distribution<float> position(-1000.0f, 1000.0f);
+	std::uniform_real_distribution<float> size(0.5f, 20.0f);
+	std::uniform_int_distribution<uint> huge(0u, 999u);
+
+	float scale = huge(generator) == 0u ? 50.0f : 1.0f;
+	DirectX::XMFLOAT3 center(position(generator), position(generator), position(generator));
+	DirectX::XMFLOAT3 extent(size(generator) * scale, size(generator) * scale, size(generator) * scale);
+
+	object->Min = DirectX::XMFLOAT3(center.x - extent.x, center.y - extent.y, center.z - extent.z);
+	object->Max = DirectX::XMFLOAT3(center.x + extent.x, center.y + extent.y, center.z + extent.z);
+}
+
+void MoveBox(std::mt19937 &generator, float distance, Object *object) {
+	std::uniform_real_distribution<float> offset(-distance, distance);
+	float x = offset(generator);
+	float y = offset(generator);
+	float z = offset(generator);
+
+	object->Min = DirectX::XMFLOAT3(object->Min.x + x, object->Min.y + y, object->Min.z + z);
+	object->Max = DirectX::XMFLOAT3(object->Max.x + x, object->Max.y + y, object->Max.z + z);
+}
+
+Query RandomQuery(std::mt19937 &generator, QueryType type) {
+	std::uniform_real_distribution<float> position(-1000.0f, 1000.0f);
+	std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+	std::uniform_real_distribution<float> size(5.0f, 100.0f);
+
+	Query query;
+	query.Point = DirectX::XMFLOAT3(position(generator), position(generator), position(generator));
+	query.Vector = DirectX::XMFLOAT3(unit(generator), unit(generator), unit(generator));
+	query.Scalar = size(generator);
+
+	if (type == QueryType::FRUSTUM) {
+		// A camera somewhere in the scene, looking in a random direction. Reversed depth, like the demos
+		DirectX::XMMATRIX view = DirectX::XMMatrixLookToLH(DirectX::XMLoadFloat3(&query.Point), DirectX::XMLoadFloat3(&query.Vector), DirectX::XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f));
+		DirectX::XMMATRIX proj = DirectX::XMMatrixPerspectiveFovLH(0.25f * DirectX::XM_PI, 16.0f / 9.0f, 500.0f, 0.1f);
+		query.Frustum = Scene::ExtractFrustum(view * proj);
+	} else if (type == QueryType::RAY) {
+		query.Scalar *= 20.0f;
+	}
+
+	return query;
+}
+
+void RunQuery(const Scene::DynamicBVH &bvh, QueryType type, const Query &query, std::vector<uint> *out_results) {
+	out_results->clear();
+	switch (type) {
+	case QueryType::FRUSTUM:
+		bvh.QueryFrustum(query.Frustum, out_results);
+		break;
+	case QueryType::SPHERE:
+		bvh.QuerySphere(query.Point, query.Scalar, out_results);
+		break;
+	case QueryType::AABB:
+		bvh.QueryAABB(DirectX::XMFLOAT3(query.Point.x - query.Scalar, query.Point.y - query.Scalar, query.Point.z - query.Scalar),
+		              DirectX::XMFLOAT3(query.Point.x + query.Scalar, query.Point.y + query.Scalar, query.Point.z + query.Scalar), out_results);
+		break;
+	case QueryType::RAY:
+		bvh.QueryRay(query.Point, query.Vector, query.Scalar, out_results);
+		break;
+	}
+}
+
+/**
+ * The brute force version of each query
+ *
+ * @param margin    Will be filled with how far the object is from the edge of the query. Results with
+ *                  a tiny margin can legitimately differ between the two
+ */
+bool ReferenceQuery(QueryType type, const Query &query, const Object &object, double *margin) {
+	*margin = 1.0e30;
+
+	switch (type) {
+	case QueryType::FRUSTUM:
+		// Test the 'positive vertex' of the box, in double precision
+		for (uint p = 0; p < 6; ++p) {
+			const DirectX::XMFLOAT4 &plane = query.Frustum.Planes[p];
+			double x = plane.x >= 0.0f ? object.Max.x : object.Min.x;
+			double y = plane.y >= 0.0f ? object.Max.y : object.Min.y;
+			double z = plane.z >= 0.0f ? object.Max.z : object.Min.z;
+
+			double distance = plane.x * x + plane.y * y + plane.z * z + plane.w;
+			*margin = std::min(*margin, std::fabs(distance));
+			if (distance < 0.0) {
+				return false;
+			}
+		}
+		return true;
+	case QueryType::SPHERE:
+		{
+			double distanceSquared = 0.0;
+			const float *center = &query.Point.x;
+			const float *aabbMin = &object.Min.x;
+			const float *aabbMax = &object.Max.x;
+			for (uint i = 0; i < 3; ++i) {
+				double clamped = std::min(std::max(static_cast<double>(center[i]), static_cast<double>(aabbMin[i])), static_cast<double>(aabbMax[i]));
+				distanceSquared += (center[i] - clamped) * (center[i] - clamped);
+			}
+			*margin = std::fabs(std::sqrt(distanceSquared) - query.Scalar);
+			return distanceSquared <= static_cast<double>(query.Scalar) * query.Scalar;
+		}
+	case QueryType::AABB:
+		return !(object.Min.x > query.Point.x + query.Scalar || object.Max.x < query.Point.x - query.Scalar ||
+		         object.Min.y > query.Point.y + query.Scalar || object.Max.y < query.Point.y - query.Scalar ||
+		         object.Min.z > query.Point.z + query.Scalar || object.Max.z < query.Point.z - query.Scalar);
+	default:
+		{
+			DirectX::XMFLOAT3 inverseDirection(1.0f / query.Vector.x, 1.0f / query.Vector.y, 1.0f / query.Vector.z);
+			return Scene::DynamicBVH::RayIntersectsAABB(query.Point, inverseDirection, query.Scalar, object.Min, object.Max);
+		}
+	}
+}
+
+/** Returns the number of objects where the tree and the brute force query disagree, ignoring objects right on the edge */
+uint CountMismatches(QueryType type, const Query &query, const std::vector<Object> &objects, std::vector<uint> &results, std::vector<bool> &scratch) {
+	uint mismatches = 0u;
+
+	scratch.assign(objects.size(), false);
+	for (auto iter = results.begin(); iter != results.end(); ++iter) {
+		if (scratch[*iter] || !objects[*iter].Alive) {
+			// Reported twice, or reported after being destroyed
+			++mismatches;
+		}
+		scratch[*iter] = true;
+	}
+
+	for (uint i = 0; i < objects.size(); ++i) {
+		if (!objects[i].Alive) {
+			continue;
+		}
+
+		double margin;
+		bool expected = ReferenceQuery(type, query, objects[i], &margin);
+		if (expected != scratch[i] && margin > 1.0e-3) {
+			++mismatches;
+		}
+	}
+
+	return mismatches;
+}
+
+/** Runs every query type against the tree and the brute force reference. Returns the total number of mismatches */
+uint CheckQueries(const char *stage, const Scene::DynamicBVH &bvh, const std::vector<Object> &objects, const std::vector<std::vector<Query> > &queries) {
+	std::vector<uint> results;
+	std::vector<bool> scratch;
+	uint totalMismatches = 0u;
+
+	for (uint t = 0; t < sizeof(kQueryTypes) / sizeof(kQueryTypes[0]); ++t) {
+		QueryType type = kQueryTypes[t];
+
+		uint mismatches = 0u;
+		for (auto iter = queries[t].begin(); iter != queries[t].end(); ++iter) {
+			RunQuery(bvh, type, *iter, &results);
+			mismatches += CountMismatches(type, *iter, objects, results, scratch);
+		}
+
+		if (mismatches != 0u) {
+			printf("  %-28s %-8s %u mismatches\n", stage, GetQueryTypeName(type), mismatches);
+		}
+		totalMismatches += mismatches;
+	}
+
+	return totalMismatches;
+}
+
+void PrintTreeStats(const char *stage, double milliseconds, const Scene::DynamicBVH &bvh) {
+	printf("  %-28s %12.3f %10d %14.1f %12u\n", stage, milliseconds, bvh.GetHeight(), bvh.GetSurfaceAreaRatio(), bvh.GetRotationCount());
+}
+
+/**
+ * A headless benchmark and self-check of Scene::DynamicBVH. Every query is checked against a
+ * brute force loop over all the objects, after each way of building or changing the tree.
+ * Exits with 1 if any of them disagree
+ */
+int main(int argc, char *argv[]) {
+	BenchmarkSettings settings;
+
+	for (int i = 1; i < argc; ++i) {
+		if (i + 1 >= argc) {
+			PrintUsage();
+			return 1;
+		}
+
+		uint value = static_cast<uint>(atoi(argv[i + 1]));
+		if (strcmp(argv[i], "-objects") == 0) {
+			settings.Objects = value;
+		} else if (strcmp(argv[i], "-queries") == 0) {
+			settings.Queries = value;
+		} else if (strcmp(argv[i], "-threads") == 0) {
+			settings.Threads = value;
+		} else {
+			PrintUsage();
+			return 1;
+		}
+		++i;
+	}
+
+	if (settings.Objects == 0u || settings.Queries == 0u) {
+		printf("Settings out of range. Objects and queries must be at least 1\n\n");
+		PrintUsage();
+		return 1;
+	}
+
+	Common::ThreadPool threadPool(settings.Threads);
+	std::mt19937 generator(1234u);
+	Engine::Timer timer;
+	uint mismatches = 0u;
+
+	std::vector<Object> objects(settings.Objects);
+	for (auto iter = objects.begin(); iter != objects.end(); ++iter) {
+		RandomBox(generator, &(*iter));
+		iter->Alive = true;
+	}
+
+	std::vector<std::vector<Query> > queries(sizeof(kQueryTypes) / sizeof(kQueryTypes[0]));
+	for (uint t = 0; t < queries.size(); ++t) {
+		for (uint i = 0; i < settings.Queries; ++i) {
+			queries[t].push_back(RandomQuery(generator, kQueryTypes[t]));
+		}
+	}
+
+	printf("%u objects. %u queries of each type. %u worker threads\n\n", settings.Objects, settings.Queries, threadPool.GetThreadCount());
+	printf("  %-28s %12s %10s %14s %12s\n", "Tree", "Time (ms)", "Height", "Area ratio", "Rotations");
+
+	Scene::DynamicBVH bvh;
+
+	// Build by inserting one at a time
+	timer.Start();
+	for (uint i = 0; i < objects.size(); ++i) {
+		objects[i].Proxy = bvh.CreateProxy(objects[i].Min, objects[i].Max, i);
+	}
+	PrintTreeStats("Incremental insert", timer.GetTime(), bvh);
+	mismatches += CheckQueries("Incremental insert", bvh, objects, queries);
+
+	// Then as a whole
+	timer.Start();
+	bvh.Rebuild();
+	PrintTreeStats("SAH build", timer.GetTime(), bvh);
+	mismatches += CheckQueries("SAH build", bvh, objects, queries);
+
+	// Nudge a tenth of the objects, like a frame of a mostly static scene
+	for (uint i = 0; i < objects.size(); i += 10u) {
+		MoveBox(generator, 5.0f, &objects[i]);
+		bvh.MoveProxy(objects[i].Proxy, objects[i].Min, objects[i].Max);
+	}
+	timer.Start();
+	bvh.Refit();
+	PrintTreeStats("Refit, 10% moved", timer.GetTime(), bvh);
+	mismatches += CheckQueries("Refit, 10% moved", bvh, objects, queries);
+
+	// Move everything a long way
+	for (auto iter = objects.begin(); iter != objects.end(); ++iter) {
+		MoveBox(generator, 200.0f, &(*iter));
+		bvh.MoveProxy(iter->Proxy, iter->Min, iter->Max);
+	}
+	timer.Start();
+	bvh.Refit();
+	PrintTreeStats("Refit, all moved", timer.GetTime(), bvh);
+	mismatches += CheckQueries("Refit, all moved", bvh, objects, queries);
+
+	// Rebuild in the background, while the scene keeps changing
+	timer.Start();
+	bvh.RebuildAsync(&threadPool);
+	double startMilliseconds = timer.GetTime();
+	for (uint i = 0; i < objects.size(); i += 7u) {
+		if (i % 2u == 0u) {
+			MoveBox(generator, 50.0f, &objects[i]);
+			bvh.MoveProxy(objects[i].Proxy, objects[i].Min, objects[i].Max);
+		} else {
+			bvh.DestroyProxy(objects[i].Proxy);
+			objects[i].Alive = false;
+		}
+	}
+	for (uint i = 0; i < settings.Objects / 20u; ++i) {
+		Object object;
+		RandomBox(generator, &object);
+		object.Alive = true;
+		object.Proxy = bvh.CreateProxy(object.Min, object.Max, static_cast<uint>(objects.size()));
+		objects.push_back(object);
+	}
+	bvh.Refit();
+	timer.Start();
+	bvh.FinishRebuild(true);
+	PrintTreeStats("Async rebuild (+ patching)", startMilliseconds + timer.GetTime(), bvh);
+	mismatches += CheckQueries("Async rebuild", bvh, objects, queries);
+
+	// And throw half of it away
+	timer.Start();
+	for (uint i = 0; i < objects.size(); i += 2u) {
+		if (objects[i].Alive) {
+			bvh.DestroyProxy(objects[i].Proxy);
+			objects[i].Alive = false;
+		}
+	}
+	PrintTreeStats("Destroy half", timer.GetTime(), bvh);
+	mismatches += CheckQueries("Destroy half", bvh, objects, queries);
+
+	// Query times, against the brute force loop
+	bvh.Rebuild();
+	printf("\n  %-28s %12s %14s %12s\n", "Query (average)", "Tree (us)", "Brute (us)", "Results");
+
+	std::vector<uint> results;
+	for (uint t = 0; t < queries.size(); ++t) {
+		QueryType type = kQueryTypes[t];
+
+		uint64 resultCount = 0u;
+		timer.Start();
+		for (auto iter = queries[t].begin(); iter != queries[t].end(); ++iter) {
+			RunQuery(bvh, type, *iter, &results);
+			resultCount += results.size();
+		}
+		double treeMicroseconds = timer.GetTime() * 1000.0 / settings.Queries;
+
+		uint64 bruteCount = 0u;
+		timer.Start();
+		for (auto iter = queries[t].begin(); iter != queries[t].end(); ++iter) {
+			for (auto objectIter = objects.begin(); objectIter != objects.end(); ++objectIter) {
+				double margin;
+				if (objectIter->Alive && ReferenceQuery(type, *iter, *objectIter, &margin)) {
+					++bruteCount;
+				}
+			}
+		}
+		double bruteMicroseconds = timer.GetTime() * 1000.0 / settings.Queries;
+
+		printf("  %-28s %12.2f %14.2f %12.1f\n", GetQueryTypeName(type), treeMicroseconds, bruteMicroseconds, static_cast<double>(resultCount) / settings.Queries);
+	}
+
+	printf("\n  Area ratio: The summed surface area of the internal nodes over that of the root. Lower means cheaper queries\n");
+
+	if (mismatches != 0u) {
+		printf("\nFAILED: %u mismatches\n", mismatches);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,608 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "capture_analyzer/capture_analyzer.h"
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <cstring>
+#include <cstdlib>
+
+
+namespace CaptureAnalyzer {
+
+using CommandCaptureFormat::CaptureRecordType;
+
+const char *GetBindCategoryName(BindCategory category) {
+	switch (category) {
+	case BindCategory::SHADER: return "Shader";
+	case BindCategory::VERTEX_BUFFER: return "Vertex buffer";
+	case BindCategory::INDEX_BUFFER: return "Index buffer";
+	case BindCategory::VS_SHADER_RESOURCE: return "VS shader resource";
+	case BindCategory::PS_SHADER_RESOURCE: return "PS shader resource";
+	case BindCategory::PS_SAMPLER: return "PS sampler";
+	case BindCategory::VS_CONSTANT_BUFFER: return "VS constant buffer";
+	case BindCategory::PS_CONSTANT_BUFFER: return "PS constant buffer";
+	case BindCategory::BLEND_STATE: return "Blend state";
+	case BindCategory::RASTERIZER_STATE: return "Rasterizer state";
+	case BindCategory::DEPTH_STENCIL_STATE: return "Depth stencil state";
+	default: return "Unknown";
+	}
+}
+
+CaptureStats::CaptureStats()
+	: Maps(0u),
+	  BytesMapped(0ull),
+	  BufferUpdates(0u),
+	  BytesUpdated(0ull),
+	  Draws(0u),
+	  IndicesSubmitted(0ull),
+	  InstancesSubmitted(0ull),
+	  Packets(0u) {
+	memset(Categories, 0, sizeof(Categories));
+}
+
+
+/** A bounds checked reader over the record stream */
+class StreamReader {
+public:
+	StreamReader(const std::vector<byte> &stream)
+		: m_stream(stream),
+		  m_offset(0u),
+		  m_overrun(false) {
+	}
+
+private:
+	const std::vector<byte> &m_stream;
+	size_t m_offset;
+	bool m_overrun;
+
+public:
+	inline bool AtEnd() const { return m_offset >= m_stream.size(); }
+	inline bool Overrun() const { return m_overrun; }
+	inline size_t GetOffset() const { return m_offset; }
+
+	template <typename T>
+	T Read() {
+		T value = T();
+		if (m_offset + sizeof(T) > m_stream.size()) {
+			m_overrun = true;
+			m_offset = m_stream.size();
+			return value;
+		}
+
+		memcpy(&value, &m_stream[m_offset], sizeof(T));
+		m_offset += sizeof(T);
+		return value;
+	}
+};
+
+
+/** Tracks the bound state while walking the stream, and gathers the statistics */
+class StateTracker {
+public:
+	StateTracker(CaptureStats *stats)
+		: m_stats(stats),
+		  m_pipelineStateChanged(false),
+		  m_currentGroupSize(0u) {
+	}
+
+private:
+	CaptureStats *m_stats;
+	std::map<uint32, BindValue> m_state;
+
+	bool m_pipelineStateChanged;
+	uint m_currentGroupSize;
+
+public:
+	/** Records a bind of 'values.size()' consecutive slots */
+	void Bind(BindCategory category, uint startSlot, const std::vector<BindValue> &values) {
+		CategoryStats &categoryStats = m_stats->Categories[static_cast<uint>(category)];
+		++categoryStats.Binds;
+
+		uint redundantSlots = 0u;
+		for (uint i = 0; i < values.size(); ++i) {
+			++categoryStats.SlotBinds;
+
+			uint32 slotKey = MakeSlotKey(category, startSlot + i);
+			auto iter = m_state.find(slotKey);
+			if (iter != m_state.end() && iter->second == values[i]) {
+				++redundantSlots;
+				continue;
+			}
+
+			m_state[slotKey] = values[i];
+			if (IsPipelineState(category)) {
+				m_pipelineStateChanged = true;
+			}
+		}
+
+		categoryStats.RedundantSlotBinds += redundantSlots;
+		if (redundantSlots == values.size()) {
+			++categoryStats.RedundantBinds;
+		}
+	}
+
+	/** Sets the value of a slot if nothing has been bound to it yet. Used for the starting state of a submit */
+	void Seed(BindCategory category, uint slot, const BindValue &value) {
+		uint32 slotKey = MakeSlotKey(category, slot);
+		if (m_state.find(slotKey) == m_state.end()) {
+			m_state[slotKey] = value;
+		}
+	}
+
+	void Draw() {
+		if (m_pipelineStateChanged && m_currentGroupSize > 0u) {
+			m_stats->DrawsPerStateGroup.push_back(m_currentGroupSize);
+			m_currentGroupSize = 0u;
+		}
+		m_pipelineStateChanged = false;
+		++m_currentGroupSize;
+	}
+
+	void Finish() {
+		if (m_currentGroupSize > 0u) {
+			m_stats->DrawsPerStateGroup.push_back(m_currentGroupSize);
+			m_currentGroupSize = 0u;
+		}
+	}
+
+	StateSnapshot GetPipelineSnapshot() const {
+		StateSnapshot snapshot;
+		for (auto iter = m_state.begin(); iter != m_state.end(); ++iter) {
+			if (IsPipelineState(GetSlotKeyCategory(iter->first))) {
+				snapshot.push_back(*iter);
+			}
+		}
+
+		return snapshot;
+	}
+};
+
+
+bool Capture::Load(const char *filePath, std::string *out_error) {
+	std::ifstream fin(filePath, std::ios::in | std::ios::binary);
+	if (!fin) {
+		*out_error = std::string("Unable to open ") + filePath;
+		return false;
+	}
+
+	fin.read(reinterpret_cast<char *>(&m_header), sizeof(m_header));
+	if (!fin || m_header.Magic != CommandCaptureFormat::kMagic) {
+		*out_error = std::string(filePath) + " is not a command capture file";
+		return false;
+	}
+	if (m_header.Version != CommandCaptureFormat::kVersion) {
+		std::ostringstream stream;
+		stream << "Unsupported capture version " << m_header.Version << ". Expected version " << CommandCaptureFormat::kVersion;
+		*out_error = stream.str();
+		return false;
+	}
+
+	std::vector<byte> recordStream(m_header.StreamSize);
+	if (m_header.StreamSize > 0u) {
+		fin.read(reinterpret_cast<char *>(&recordStream[0]), m_header.StreamSize);
+		if (!fin) {
+			*out_error = "The capture file is truncated";
+			return false;
+		}
+	}
+
+	return ParseStream(recordStream, out_error);
+}
+
+bool Capture::ParseStream(const std::vector<byte> &recordStream, std::string *out_error) {
+	m_stats = CaptureStats();
+	m_submits.clear();
+
+	StreamReader reader(recordStream);
+	StateTracker tracker(&m_stats);
+
+	CapturedSubmit *currentSubmit = nullptr;
+	std::vector<BindValue> values;
+
+	uint recordCount = 0u;
+	while (!reader.AtEnd()) {
+		size_t recordOffset = reader.GetOffset();
+		CaptureRecordType type = static_cast<CaptureRecordType>(reader.Read<uint8>());
+		++recordCount;
+		values.clear();
+
+		switch (type) {
+		case CaptureRecordType::BEGIN_SUBMIT:
+		{
+			uint32 shader = reader.Read<uint32>();
+			// The GraphicsState doesn't track the strides / offsets / format of the buffers,
+			// so they can't be seeded. They'll be picked up from the binds instead
+			reader.Read<uint32>();
+			reader.Read<uint32>();
+			reader.Read<uint32>();
+			uint8 blendState = reader.Read<uint8>();
+			uint8 rasterizerState = reader.Read<uint8>();
+			uint8 depthStencilState = reader.Read<uint8>();
+
+			// Binds seen earlier in the stream are more reliable than what the bucket assumes, so only seed unknown slots
+			tracker.Seed(BindCategory::SHADER, 0u, BindValue(shader));
+			tracker.Seed(BindCategory::BLEND_STATE, 0u, BindValue(blendState, 0xFFFFFFFF));
+			tracker.Seed(BindCategory::RASTERIZER_STATE, 0u, BindValue(rasterizerState));
+			tracker.Seed(BindCategory::DEPTH_STENCIL_STATE, 0u, BindValue(depthStencilState));
+
+			m_submits.push_back(CapturedSubmit());
+			currentSubmit = &m_submits.back();
+			currentSubmit->InitialState = tracker.GetPipelineSnapshot();
+			break;
+		}
+		case CaptureRecordType::END_SUBMIT:
+			currentSubmit = nullptr;
+			break;
+		case CaptureRecordType::PACKET:
+		{
+			uint64 key = reader.Read<uint64>();
+			++m_stats.Packets;
+			if (currentSubmit != nullptr) {
+				CapturedPacket packet;
+				packet.Key = key;
+				packet.FirstDraw = static_cast<uint>(currentSubmit->Draws.size());
+				packet.DrawCount = 0u;
+				currentSubmit->Packets.push_back(packet);
+			}
+			break;
+		}
+		case CaptureRecordType::SET_SHADER:
+			values.push_back(BindValue(reader.Read<uint32>()));
+			tracker.Bind(BindCategory::SHADER, 0u, values);
+			break;
+		case CaptureRecordType::SET_VERTEX_BUFFERS:
+		{
+			uint startSlot = reader.Read<uint8>();
+			uint count = reader.Read<uint8>();
+			for (uint i = 0; i < count; ++i) {
+				uint32 buffer = reader.Read<uint32>();
+				uint32 stride = reader.Read<uint32>();
+				uint32 offset = reader.Read<uint32>();
+				values.push_back(BindValue(buffer, stride, offset));
+			}
+			tracker.Bind(BindCategory::VERTEX_BUFFER, startSlot, values);
+			break;
+		}
+		case CaptureRecordType::SET_INDEX_BUFFER:
+		{
+			uint32 buffer = reader.Read<uint32>();
+			uint32 format = reader.Read<uint32>();
+			uint32 offset = reader.Read<uint32>();
+			values.push_back(BindValue(buffer, format, offset));
+			tracker.Bind(BindCategory::INDEX_BUFFER, 0u, values);
+			break;
+		}
+		case CaptureRecordType::SET_VS_SHADER_RESOURCES:
+		case CaptureRecordType::SET_PS_SHADER_RESOURCES:
+		case CaptureRecordType::SET_PS_SAMPLERS:
+		case CaptureRecordType::SET_VS_CONSTANT_BUFFERS:
+		case CaptureRecordType::SET_PS_CONSTANT_BUFFERS:
+		{
+			BindCategory category;
+			switch (type) {
+			case CaptureRecordType::SET_VS_SHADER_RESOURCES: category = BindCategory::VS_SHADER_RESOURCE; break;
+			case CaptureRecordType::SET_PS_SHADER_RESOURCES: category = BindCategory::PS_SHADER_RESOURCE; break;
+			case CaptureRecordType::SET_PS_SAMPLERS: category = BindCategory::PS_SAMPLER; break;
+			case CaptureRecordType::SET_VS_CONSTANT_BUFFERS: category = BindCategory::VS_CONSTANT_BUFFER; break;
+			default: category = BindCategory::PS_CONSTANT_BUFFER; break;
+			}
+
+			uint startSlot = reader.Read<uint8>();
+			uint count = reader.Read<uint8>();
+			for (uint i = 0; i < count; ++i) {
+				// Whole constant buffer binds get an empty window, so they never compare equal to a range bind
+				values.push_back(BindValue(reader.Read<uint32>()));
+			}
+			tracker.Bind(category, startSlot, values);
+			break;
+		}
+		case CaptureRecordType::SET_VS_CONSTANT_BUFFER_RANGES:
+		case CaptureRecordType::SET_PS_CONSTANT_BUFFER_RANGES:
+		{
+			BindCategory category = type == CaptureRecordType::SET_VS_CONSTANT_BUFFER_RANGES ? BindCategory::VS_CONSTANT_BUFFER : BindCategory::PS_CONSTANT_BUFFER;
+
+			uint startSlot = reader.Read<uint8>();
+			uint count = reader.Read<uint8>();
+			for (uint i = 0; i < count; ++i) {
+				uint32 buffer = reader.Read<uint32>();
+				uint32 firstConstant = reader.Read<uint32>();
+				uint32 numConstants = reader.Read<uint32>();
+				values.push_back(BindValue(buffer, firstConstant, numConstants));
+			}
+			tracker.Bind(category, startSlot, values);
+			break;
+		}
+		case CaptureRecordType::SET_BLEND_STATE:
+		{
+			uint8 state = reader.Read<uint8>();
+			uint32 sampleMask = reader.Read<uint32>();
+			values.push_back(BindValue(state, sampleMask));
+			tracker.Bind(BindCategory::BLEND_STATE, 0u, values);
+			break;
+		}
+		case CaptureRecordType::SET_RASTERIZER_STATE:
+			values.push_back(BindValue(reader.Read<uint8>()));
+			tracker.Bind(BindCategory::RASTERIZER_STATE, 0u, values);
+			break;
+		case CaptureRecordType::SET_DEPTH_STENCIL_STATE:
+		{
+			uint8 state = reader.Read<uint8>();
+			uint32 stencilRef = reader.Read<uint32>();
+			values.push_back(BindValue(state, stencilRef));
+			tracker.Bind(BindCategory::DEPTH_STENCIL_STATE, 0u, values);
+			break;
+		}
+		case CaptureRecordType::MAP:
+		{
+			reader.Read<uint32>();
+			reader.Read<uint8>();
+			uint32 bytesToWrite = reader.Read<uint32>();
+
+			++m_stats.Maps;
+			m_stats.BytesMapped += bytesToWrite;
+			break;
+		}
+		case CaptureRecordType::UPDATE_BUFFER:
+		{
+			reader.Read<uint32>();
+			reader.Read<uint32>();
+			uint32 byteSize = reader.Read<uint32>();
+
+			++m_stats.BufferUpdates;
+			m_stats.BytesUpdated += byteSize;
+			break;
+		}
+		case CaptureRecordType::COPY_BUFFER:
+			// GPU side copies don't upload anything
+			for (uint i = 0; i < 5u; ++i) {
+				reader.Read<uint32>();
+			}
+			break;
+		case CaptureRecordType::DRAW:
+		case CaptureRecordType::DRAW_INDEXED:
+		case CaptureRecordType::DRAW_INDEXED_INSTANCED:
+		{
+			if (type == CaptureRecordType::DRAW) {
+				reader.Read<uint32>();
+			} else if (type == CaptureRecordType::DRAW_INDEXED) {
+				m_stats.IndicesSubmitted += reader.Read<uint32>();
+			} else {
+				uint64 indexCount = reader.Read<uint32>();
+				uint64 instanceCount = reader.Read<uint32>();
+				m_stats.IndicesSubmitted += indexCount * instanceCount;
+				m_stats.InstancesSubmitted += instanceCount;
+			}
+
+			++m_stats.Draws;
+			tracker.Draw();
+
+			if (currentSubmit != nullptr && !currentSubmit->Packets.empty()) {
+				currentSubmit->Draws.push_back(tracker.GetPipelineSnapshot());
+				++currentSubmit->Packets.back().DrawCount;
+			}
+			break;
+		}
+		default:
+		{
+			std::ostringstream stream;
+			stream << "Unknown record type " << static_cast<uint>(type) << " at offset " << recordOffset;
+			*out_error = stream.str();
+			return false;
+		}
+		}
+
+		if (reader.Overrun()) {
+			std::ostringstream stream;
+			stream << "The record at offset " << recordOffset << " is truncated";
+			*out_error = stream.str();
+			return false;
+		}
+	}
+
+	tracker.Finish();
+
+	if (recordCount != m_header.RecordCount) {
+		std::ostringstream stream;
+		stream << "The header says there are " << m_header.RecordCount << " records, but the stream has " << recordCount;
+		*out_error = stream.str();
+		return false;
+	}
+
+	return true;
+}
+
+
+bool SortKeyLayout::Parse(const std::string &description, std::string *out_error) {
+	m_fields.clear();
+	m_sourceFields.clear();
+
+	uint totalBits = 0u;
+	std::istringstream stream(description);
+	std::string token;
+	while (std::getline(stream, token, ',')) {
+		size_t colon = token.find(':');
+		if (colon == std::string::npos || colon == 0u) {
+			*out_error = "Sort key fields must be written as 'Name:Bits'. Got '" + token + "'";
+			return false;
+		}
+
+		SortKeyLayoutField field;
+		field.Name = token.substr(0u, colon);
+		field.Bits = static_cast<uint>(atoi(token.c_str() + colon + 1u));
+		field.Shift = 0u;
+		if (field.Bits == 0u || field.Bits > 64u) {
+			*out_error = "The sort key field '" + field.Name + "' must be between 1 and 64 bits wide";
+			return false;
+		}
+
+		totalBits += field.Bits;
+		m_fields.push_back(field);
+	}
+
+	if (m_fields.empty()) {
+		*out_error = "The sort key layout is empty";
+		return false;
+	}
+	if (totalBits > 64u) {
+		*out_error = "The sort key layout doesn't fit in 64 bits";
+		return false;
+	}
+
+	// Pack the fields down from the most significant bit, the same as Graphics::SortKeyFirstField / SortKeyNextField
+	uint shift = 64u;
+	for (uint i = 0; i < m_fields.size(); ++i) {
+		shift -= m_fields[i].Bits;
+		m_fields[i].Shift = shift;
+		m_sourceFields.push_back(i);
+	}
+
+	return true;
+}
+
+SortKeyLayout SortKeyLayout::Reorder(const std::vector<uint> &fieldOrder) const {
+	SortKeyLayout layout;
+
+	uint shift = 64u;
+	for (uint i = 0; i < fieldOrder.size(); ++i) {
+		SortKeyLayoutField field = m_fields[fieldOrder[i]];
+		shift -= field.Bits;
+		field.Shift = shift;
+
+		layout.m_fields.push_back(field);
+		layout.m_sourceFields.push_back(fieldOrder[i]);
+	}
+
+	return layout;
+}
+
+bool SortKeyLayout::ParseFieldOrder(const std::string &fieldNames, std::vector<uint> *out_fieldOrder, std::string *out_error) const {
+	out_fieldOrder->clear();
+
+	std::istringstream stream(fieldNames);
+	std::string name;
+	while (std::getline(stream, name, ',')) {
+		uint index = 0u;
+		while (index < m_fields.size() && m_fields[index].Name != name) {
+			++index;
+		}
+
+		if (index == m_fields.size()) {
+			*out_error = "The sort key layout doesn't have a field named '" + name + "'";
+			return false;
+		}
+		if (std::find(out_fieldOrder->begin(), out_fieldOrder->end(), index) != out_fieldOrder->end()) {
+			*out_error = "The sort key field '" + name + "' is used more than once";
+			return false;
+		}
+
+		out_fieldOrder->push_back(index);
+	}
+
+	if (out_fieldOrder->empty()) {
+		*out_error = "The field order is empty";
+		return false;
+	}
+
+	return true;
+}
+
+std::string SortKeyLayout::ToString() const {
+	std::ostringstream stream;
+	for (uint i = 0; i < m_fields.size(); ++i) {
+		if (i > 0u) {
+			stream << ",";
+		}
+		stream << m_fields[i].Name << ":" << m_fields[i].Bits;
+	}
+
+	return stream.str();
+}
+
+uint64 SortKeyLayout::Remap(const SortKeyLayout &sourceLayout, uint64 key) const {
+	uint64 newKey = 0ull;
+	for (uint i = 0; i < m_fields.size(); ++i) {
+		newKey |= sourceLayout.DecodeField(key, m_sourceFields[i]) << m_fields[i].Shift;
+	}
+
+	return newKey;
+}
+
+
+ReplayResult::ReplayResult() {
+	memset(Changes, 0, sizeof(Changes));
+}
+
+uint ReplayResult::Total() const {
+	uint total = 0u;
+	for (uint i = 0; i < kNumBindCategories; ++i) {
+		total += Changes[i];
+	}
+
+	return total;
+}
+
+/** Adds the number of slots that differ between two snapshots to 'result' */
+static void CountChanges(const StateSnapshot &from, const StateSnapshot &to, ReplayResult *result) {
+	auto fromIter = from.begin();
+	auto toIter = to.begin();
+
+	// Both snapshots are sorted by slot key, so walk them in lock step
+	while (toIter != to.end()) {
+		if (fromIter == from.end() || toIter->first < fromIter->first) {
+			// Newly bound slot
+			++result->Changes[static_cast<uint>(GetSlotKeyCategory(toIter->first))];
+			++toIter;
+		} else if (fromIter->first < toIter->first) {
+			// Slots are never unbound in the captured stream, so the new state doesn't need to touch it
+			++fromIter;
+		} else {
+			if (fromIter->second != toIter->second) {
+				++result->Changes[static_cast<uint>(GetSlotKeyCategory(toIter->first))];
+			}
+			++fromIter;
+			++toIter;
+		}
+	}
+}
+
+ReplayResult ReplaySubmits(const Capture &capture, const SortKeyLayout &sourceLayout, const SortKeyLayout &newLayout, int submitIndex) {
+	ReplayResult result;
+
+	const std::vector<CapturedSubmit> &submits = capture.GetSubmits();
+	std::vector<std::pair<uint64, uint> > order;
+
+	for (uint i = 0; i < submits.size(); ++i) {
+		if (submitIndex >= 0 && static_cast<uint>(submitIndex) != i) {
+			continue;
+		}
+		const CapturedSubmit &submit = submits[i];
+
+		order.clear();
+		for (uint j = 0; j < submit.Packets.size(); ++j) {
+			order.push_back(std::make_pair(newLayout.Remap(sourceLayout, submit.Packets[j].Key), j));
+		}
+		// The second element is the captured position, so ties keep the captured order
+		std::sort(order.begin(), order.end());
+
+		const StateSnapshot *previous = &submit.InitialState;
+		for (uint j = 0; j < order.size(); ++j) {
+			const CapturedPacket &packet = submit.Packets[order[j].second];
+			for (uint k = 0; k < packet.DrawCount; ++k) {
+				const StateSnapshot &current = submit.Draws[packet.FirstDraw + k];
+				CountChanges(*previous, current, &result);
+				previous = &current;
+			}
+		}
+	}
+
+	return result;
+}
+
+} // End of namespace CaptureAnalyzer
@@ -0,0 +1,228 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "common/typedefs.h"
+
+#include "graphics/command_capture_format.h"
+
+#include <string>
+#include <vector>
+#include <utility>
+
+
+/**
+ * Offline analysis of the command stream captures written by Graphics::CommandCapture
+ *
+ * Everything in here only works on the captured data. It doesn't depend on D3D or
+ * Windows, so it builds and runs on any platform with a C++11 compiler
+ */
+namespace CaptureAnalyzer {
+
+/** The kinds of state a bind can change. Multi-slot binds are tracked per slot */
+enum class BindCategory {
+	SHADER,
+	VERTEX_BUFFER,
+	INDEX_BUFFER,
+	VS_SHADER_RESOURCE,
+	PS_SHADER_RESOURCE,
+	PS_SAMPLER,
+	VS_CONSTANT_BUFFER,
+	PS_CONSTANT_BUFFER,
+	BLEND_STATE,
+	RASTERIZER_STATE,
+	DEPTH_STENCIL_STATE,
+	COUNT
+};
+
+static const uint kNumBindCategories = static_cast<uint>(BindCategory::COUNT);
+
+const char *GetBindCategoryName(BindCategory category);
+
+/**
+ * Constant buffer binds hold per-object data, so they are expected to change every draw.
+ * They are left out of the state groups and of the sort key replays
+ */
+inline bool IsPipelineState(BindCategory category) {
+	return category != BindCategory::VS_CONSTANT_BUFFER && category != BindCategory::PS_CONSTANT_BUFFER;
+}
+
+/** The value bound to a single slot. IE. {buffer, stride, offset} for a vertex buffer */
+struct BindValue {
+	BindValue()
+		: Resource(0u), A(0u), B(0u) {
+	}
+	BindValue(uint32 resource, uint32 a = 0u, uint32 b = 0u)
+		: Resource(resource), A(a), B(b) {
+	}
+
+	uint32 Resource;
+	uint32 A;
+	uint32 B;
+
+	inline bool operator==(const BindValue &rhs) const { return Resource == rhs.Resource && A == rhs.A && B == rhs.B; }
+	inline bool operator!=(const BindValue &rhs) const { return !(*this == rhs); }
+};
+
+/** Identifies a single slot of a BindCategory */
+inline uint32 MakeSlotKey(BindCategory category, uint slot) { return (static_cast<uint32>(category) << 8u) | slot; }
+inline BindCategory GetSlotKeyCategory(uint32 slotKey) { return static_cast<BindCategory>(slotKey >> 8u); }
+
+/** The pipeline state bound at a point in the stream, sorted by slot key. Unbound slots are left out */
+typedef std::vector<std::pair<uint32, BindValue> > StateSnapshot;
+
+struct CapturedPacket {
+	uint64 Key;
+	/** Index into CapturedSubmit::Draws */
+	uint FirstDraw;
+	uint DrawCount;
+};
+
+/** All the packets executed by one CommandBucket::Submit() */
+struct CapturedSubmit {
+	/** The pipeline state when the submit started */
+	StateSnapshot InitialState;
+	std::vector<CapturedPacket> Packets;
+	/** The pipeline state at each draw of the submit, in execution order */
+	std::vector<StateSnapshot> Draws;
+};
+
+struct CategoryStats {
+	/** The number of bind calls */
+	uint Binds;
+	/** The number of bind calls that didn't change any of their slots */
+	uint RedundantBinds;
+	/** The number of slots bound */
+	uint SlotBinds;
+	/** The number of slots that were bound to the value they already had */
+	uint RedundantSlotBinds;
+};
+
+struct CaptureStats {
+	CaptureStats();
+
+	CategoryStats Categories[kNumBindCategories];
+
+	uint Maps;
+	uint64 BytesMapped;
+	uint BufferUpdates;
+	uint64 BytesUpdated;
+
+	uint Draws;
+	uint64 IndicesSubmitted;
+	uint64 InstancesSubmitted;
+
+	/** The number of draws in each run of draws that had no pipeline state change between them */
+	std::vector<uint> DrawsPerStateGroup;
+
+	uint Packets;
+};
+
+class Capture {
+public:
+	/**
+	 * Loads and analyzes a capture file
+	 *
+	 * @param filePath     The file to load
+	 * @param out_error    Filled with a description of the problem if loading fails
+	 * @return             True if the file was loaded successfully
+	 */
+	bool Load(const char *filePath, std::string *out_error);
+
+private:
+	CommandCaptureFormat::CaptureFileHeader m_header;
+	CaptureStats m_stats;
+	std::vector<CapturedSubmit> m_submits;
+
+public:
+	inline const CommandCaptureFormat::CaptureFileHeader &GetHeader() const { return m_header; }
+	inline const CaptureStats &GetStats() const { return m_stats; }
+	inline const std::vector<CapturedSubmit> &GetSubmits() const { return m_submits; }
+
+private:
+	bool ParseStream(const std::vector<byte> &stream, std::string *out_error);
+};
+
+
+struct SortKeyLayoutField {
+	std::string Name;
+	uint Bits;
+	/** The shift of the field. Fields are packed from the most significant bit down */
+	uint Shift;
+};
+
+/**
+ * A description of the bit fields of a sort key. See Graphics::SortKeyField
+ *
+ * The text form is a comma separated list of 'Name:Bits' from the most significant
+ * field to the least. IE. "Layer:4,MaterialShader:8,Material:12,Depth:10"
+ */
+class SortKeyLayout {
+public:
+	bool Parse(const std::string &description, std::string *out_error);
+	/**
+	 * Creates a new layout from a subset of the fields of this layout, in a new order
+	 *
+	 * @param fieldOrder    The indices of the fields to use, from the most significant field to the least
+	 * @return              The new layout
+	 */
+	SortKeyLayout Reorder(const std::vector<uint> &fieldOrder) const;
+	/**
+	 * Parses a comma separated list of field names into indices for Reorder()
+	 *
+	 * @return    True if all the names were found and none were repeated
+	 */
+	bool ParseFieldOrder(const std::string &fieldNames, std::vector<uint> *out_fieldOrder, std::string *out_error) const;
+
+private:
+	std::vector<SortKeyLayoutField> m_fields;
+	/** For reordered layouts, the index of each field in the original layout */
+	std::vector<uint> m_sourceFields;
+
+public:
+	inline const std::vector<SortKeyLayoutField> &GetFields() const { return m_fields; }
+	std::string ToString() const;
+
+	inline uint64 DecodeField(uint64 key, uint field) const {
+		const SortKeyLayoutField &f = m_fields[field];
+		uint64 mask = f.Bits == 64u ? ~0ull : (1ull << f.Bits) - 1ull;
+		return (key >> f.Shift) & mask;
+	}
+	/**
+	 * Re-encodes a key of the layout this layout was created from with Reorder()
+	 *
+	 * @param sourceLayout    The layout Reorder() was called on
+	 * @param key             A key in sourceLayout
+	 * @return                The key in this layout
+	 */
+	uint64 Remap(const SortKeyLayout &sourceLayout, uint64 key) const;
+};
+
+
+/** The number of pipeline state changes needed to execute a sequence of draws */
+struct ReplayResult {
+	ReplayResult();
+
+	uint Changes[kNumBindCategories];
+
+	uint Total() const;
+};
+
+/**
+ * Re-executes the packets of the captured submits in a new order and counts the pipeline
+ * state changes that would be needed, assuming redundant binds are filtered. Packets keep
+ * their internal draw order, and ties keep the captured order.
+ *
+ * @param capture         The capture
+ * @param sourceLayout    The layout the keys were captured with
+ * @param newLayout       The layout to sort by. Created with sourceLayout.Reorder(). Pass sourceLayout to replay the captured order
+ * @param submitIndex     The submit to replay, or -1 to replay all of them
+ * @return                The state changes per category
+ */
+ReplayResult ReplaySubmits(const Capture &capture, const SortKeyLayout &sourceLayout, const SortKeyLayout &newLayout, int submitIndex);
+
+} // End of namespace CaptureAnalyzer
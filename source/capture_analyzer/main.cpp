@@ -0,0 +1,238 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "capture_analyzer/capture_analyzer.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+
+
+// The layout of PBRDemo::GBufferSortKeyGenerator
+static const char *kDefaultSortKeyLayout = "Layer:4,MaterialShader:8,Material:12,VertexBuffer:10,IndexBuffer:10,Subset:10,Depth:10";
+// Searching every ordering gets expensive quickly. 8 fields is 40320 replays
+static const uint kMaxSearchFields = 8u;
+
+void PrintUsage() {
+	std::cerr << "Usage: CaptureAnalyzer [-layout <Name:Bits,...>] [-reorder <Name,...>] [-search] [-submit <index>] <capture filePath>" << std::endl << std::endl <<
+	             "    -layout     The layout of the captured sort keys, from the most significant field to the least" << std::endl <<
+	             "                Defaults to " << kDefaultSortKeyLayout << std::endl <<
+	             "    -reorder    Replays the packets sorted by the layout fields in a new order, and reports the" << std::endl <<
+	             "                difference in state changes. Fields that are left out are dropped from the key" << std::endl <<
+	             "    -search     Replays every ordering of the layout fields and reports the best ones" << std::endl <<
+	             "    -submit     Only replay the given CommandBucket::Submit(). By default, all submits are replayed" << std::endl;
+}
+
+void PrintBindStats(const CaptureAnalyzer::CaptureStats &stats) {
+	std::cout << "State changes by type" << std::endl;
+	std::cout << "  " << std::left << std::setw(22) << "Type" << std::right <<
+	             std::setw(10) << "Binds" << std::setw(12) << "Redundant" << std::setw(8) << "%" <<
+	             std::setw(12) << "Slots" << std::setw(12) << "Redundant" << std::setw(8) << "%" << std::endl;
+
+	uint totalBinds = 0u;
+	uint totalRedundantBinds = 0u;
+	uint totalSlots = 0u;
+	uint totalRedundantSlots = 0u;
+	for (uint i = 0; i < CaptureAnalyzer::kNumBindCategories; ++i) {
+		const CaptureAnalyzer::CategoryStats &category = stats.Categories[i];
+		totalBinds += category.Binds;
+		totalRedundantBinds += category.RedundantBinds;
+		totalSlots += category.SlotBinds;
+		totalRedundantSlots += category.RedundantSlotBinds;
+
+		if (category.Binds == 0u) {
+			continue;
+		}
+
+		std::cout << "  " << std::left << std::setw(22) << CaptureAnalyzer::GetBindCategoryName(static_cast<CaptureAnalyzer::BindCategory>(i)) << std::right <<
+		             std::setw(10) << category.Binds << std::setw(12) << category.RedundantBinds << std::setw(7) << std::fixed << std::setprecision(1) << (100.0 * category.RedundantBinds / category.Binds) << "%" <<
+		             std::setw(12) << category.SlotBinds << std::setw(12) << category.RedundantSlotBinds << std::setw(7) << (100.0 * category.RedundantSlotBinds / category.SlotBinds) << "%" << std::endl;
+	}
+
+	std::cout << "  " << std::left << std::setw(22) << "Total" << std::right <<
+	             std::setw(10) << totalBinds << std::setw(12) << totalRedundantBinds << std::setw(7) << (totalBinds > 0u ? 100.0 * totalRedundantBinds / totalBinds : 0.0) << "%" <<
+	             std::setw(12) << totalSlots << std::setw(12) << totalRedundantSlots << std::setw(7) << (totalSlots > 0u ? 100.0 * totalRedundantSlots / totalSlots : 0.0) << "%" << std::endl << std::endl;
+}
+
+void PrintStateGroups(const CaptureAnalyzer::CaptureStats &stats) {
+	const std::vector<uint> &groups = stats.DrawsPerStateGroup;
+	if (groups.empty()) {
+		return;
+	}
+
+	uint maxGroupSize = *std::max_element(groups.begin(), groups.end());
+
+	// Power of two buckets. 1, 2-3, 4-7, ...
+	std::vector<uint> histogram;
+	for (uint i = 0; i < groups.size(); ++i) {
+		uint bucket = 0u;
+		while ((2u << bucket) <= groups[i]) {
+			++bucket;
+		}
+		if (bucket >= histogram.size()) {
+			histogram.resize(bucket + 1u, 0u);
+		}
+		++histogram[bucket];
+	}
+
+	std::cout << "Draws per state group (constant buffer binds are ignored)" << std::endl;
+	std::cout << "  Groups: " << groups.size() << "    Average: " << std::fixed << std::setprecision(2) << static_cast<double>(stats.Draws) / groups.size() << "    Max: " << maxGroupSize << std::endl;
+	for (uint i = 0; i < histogram.size(); ++i) {
+		uint low = 1u << i;
+		uint high = (2u << i) - 1u;
+
+		std::cout << "  " << std::setw(6) << low << " - " << std::left << std::setw(6) << high << std::right << std::setw(8) << histogram[i] << std::endl;
+	}
+	std::cout << std::endl;
+}
+
+void PrintReplay(const char *label, const CaptureAnalyzer::ReplayResult &result, const CaptureAnalyzer::ReplayResult &baseline) {
+	std::cout << "  " << label << std::endl;
+	for (uint i = 0; i < CaptureAnalyzer::kNumBindCategories; ++i) {
+		if (result.Changes[i] == 0u && baseline.Changes[i] == 0u) {
+			continue;
+		}
+
+		int difference = static_cast<int>(result.Changes[i]) - static_cast<int>(baseline.Changes[i]);
+		std::cout << "    " << std::left << std::setw(22) << CaptureAnalyzer::GetBindCategoryName(static_cast<CaptureAnalyzer::BindCategory>(i)) << std::right <<
+		             std::setw(10) << result.Changes[i] << std::setw(10) << std::showpos << difference << std::noshowpos << std::endl;
+	}
+
+	int difference = static_cast<int>(result.Total()) - static_cast<int>(baseline.Total());
+	std::cout << "    " << std::left << std::setw(22) << "Total" << std::right << std::setw(10) << result.Total() << std::setw(10) << std::showpos << difference << std::noshowpos << std::endl;
+}
+
+/**
+ * Analyzes a command stream capture written by Graphics::CaptureRenderBackend
+ */
+int main(int argc, char *argv[]) {
+	if (argc < 2) {
+		PrintUsage();
+		return 1;
+	}
+
+	std::string layoutDescription = kDefaultSortKeyLayout;
+	std::string reorderDescription;
+	bool search = false;
+	int submitIndex = -1;
+
+	// Parse the command line arguments
+	for (int i = 1; i < argc - 1; ++i) {
+		if (strcmp(argv[i], "-layout") == 0) {
+			if (++i >= argc - 1) {
+				std::cerr << "-layout requires an argument" << std::endl;
+				return 1;
+			}
+			layoutDescription = argv[i];
+		} else if (strcmp(argv[i], "-reorder") == 0) {
+			if (++i >= argc - 1) {
+				std::cerr << "-reorder requires an argument" << std::endl;
+				return 1;
+			}
+			reorderDescription = argv[i];
+		} else if (strcmp(argv[i], "-search") == 0) {
+			search = true;
+		} else if (strcmp(argv[i], "-submit") == 0) {
+			if (++i >= argc - 1) {
+				std::cerr << "-submit requires an argument" << std::endl;
+				return 1;
+			}
+			submitIndex = atoi(argv[i]);
+		} else {
+			std::cerr << "Unknown argument " << argv[i] << std::endl;
+			PrintUsage();
+			return 1;
+		}
+	}
+
+	std::string error;
+	CaptureAnalyzer::Capture capture;
+	if (!capture.Load(argv[argc - 1], &error)) {
+		std::cerr << error << std::endl;
+		return 1;
+	}
+
+	CaptureAnalyzer::SortKeyLayout layout;
+	if (!layout.Parse(layoutDescription, &error)) {
+		std::cerr << error << std::endl;
+		return 1;
+	}
+
+	const CaptureAnalyzer::CaptureStats &stats = capture.GetStats();
+	const std::vector<CaptureAnalyzer::CapturedSubmit> &submits = capture.GetSubmits();
+
+	if (submitIndex >= static_cast<int>(submits.size())) {
+		std::cerr << "The capture only has " << submits.size() << " submits" << std::endl;
+		return 1;
+	}
+
+	// Summary
+	std::cout << "Capture: " << argv[argc - 1] << std::endl;
+	std::cout << "  Records: " << capture.GetHeader().RecordCount << "    Stream size: " << capture.GetHeader().StreamSize << " bytes    Resources: " << capture.GetHeader().ResourceCount << std::endl;
+	std::cout << "  Draws: " << stats.Draws << "    Indices: " << stats.IndicesSubmitted << "    Instances: " << stats.InstancesSubmitted << std::endl;
+	std::cout << "  Maps: " << stats.Maps << "    Bytes mapped: " << stats.BytesMapped << std::endl;
+	std::cout << "  Buffer updates: " << stats.BufferUpdates << "    Bytes updated: " << stats.BytesUpdated << std::endl;
+	std::cout << "  Packets: " << stats.Packets << std::endl << std::endl;
+
+	for (uint i = 0; i < submits.size(); ++i) {
+		std::cout << "  Submit " << i << ": " << submits[i].Packets.size() << " packets, " << submits[i].Draws.size() << " draws" << std::endl;
+	}
+	std::cout << std::endl;
+
+	PrintBindStats(stats);
+	PrintStateGroups(stats);
+
+	// Sort key replays
+	CaptureAnalyzer::ReplayResult baseline = CaptureAnalyzer::ReplaySubmits(capture, layout, layout, submitIndex);
+
+	std::cout << "Pipeline state changes needed with redundant binds filtered" << std::endl;
+	PrintReplay(("Captured order (" + layout.ToString() + ")").c_str(), baseline, baseline);
+
+	if (!reorderDescription.empty()) {
+		std::vector<uint> fieldOrder;
+		if (!layout.ParseFieldOrder(reorderDescription, &fieldOrder, &error)) {
+			std::cerr << error << std::endl;
+			return 1;
+		}
+
+		CaptureAnalyzer::SortKeyLayout newLayout = layout.Reorder(fieldOrder);
+		CaptureAnalyzer::ReplayResult result = CaptureAnalyzer::ReplaySubmits(capture, layout, newLayout, submitIndex);
+		PrintReplay(("Reordered (" + newLayout.ToString() + ")").c_str(), result, baseline);
+	}
+
+	if (search) {
+		uint numFields = static_cast<uint>(layout.GetFields().size());
+		if (numFields > kMaxSearchFields) {
+			std::cerr << "-search supports at most " << kMaxSearchFields << " fields" << std::endl;
+			return 1;
+		}
+
+		std::vector<uint> fieldOrder(numFields);
+		for (uint i = 0; i < numFields; ++i) {
+			fieldOrder[i] = i;
+		}
+
+		std::vector<std::pair<uint, std::vector<uint> > > results;
+		do {
+			CaptureAnalyzer::ReplayResult result = CaptureAnalyzer::ReplaySubmits(capture, layout, layout.Reorder(fieldOrder), submitIndex);
+			results.push_back(std::make_pair(result.Total(), fieldOrder));
+		} while (std::next_permutation(fieldOrder.begin(), fieldOrder.end()));
+
+		std::stable_sort(results.begin(), results.end(), [](const std::pair<uint, std::vector<uint> > &lhs, const std::pair<uint, std::vector<uint> > &rhs) {
+			return lhs.first < rhs.first;
+		});
+
+		std::cout << std::endl << "  Best field orders out of " << results.size() << std::endl;
+		for (uint i = 0; i < results.size() && i < 5u; ++i) {
+			int difference = static_cast<int>(results[i].first) - static_cast<int>(baseline.Total());
+			std::cout << "    " << std::setw(10) << results[i].first << std::setw(10) << std::showpos << difference << std::noshowpos << "    " << layout.Reorder(results[i].second).ToString() << std::endl;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,433 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "common/typedefs.h"
+
+#include "engine/timer.h"
+
+#include "graphics/capture_render_backend.h"
+#include "graphics/command_bucket.h"
+#include "graphics/commands.h"
+#include "graphics/graphics_state.h"
+#include "graphics/recording_render_backend.h"
+#include "graphics/sort_key.h"
+
+#include "capture_analyzer/capture_analyzer.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+
+static const uint kMaxDraws = 65536u;
+static const uint kMaxShaders = 256u;
+static const uint kMaxMaterials = 4096u;
+static const uint kMaxMeshes = 4096u;
+
+static const char *kCaptureFile = "capture_analyzer_benchmark.hcap";
+static const wchar *kCaptureFileW = L"capture_analyzer_benchmark.hcap";
+
+typedef Graphics::CommandBucket<uint64, kMaxDraws> Bucket;
+
+// The layout the draws are captured with. The draw index keeps every key unique, so the order is fully defined
+typedef Graphics::SortKeyFirstField<8> ShaderField;
+typedef Graphics::SortKeyNextField<ShaderField, 12> MaterialField;
+typedef Graphics::SortKeyNextField<MaterialField, 12> MeshField;
+typedef Graphics::SortKeyNextField<MeshField, 32> DrawField;
+
+static const char *kCapturedLayout = "Shader:8,Material:12,Mesh:12,Draw:32";
+
+// The same fields with the draw index first. IE. the order the draws were issued in
+typedef Graphics::SortKeyFirstField<32> DrawFirstDrawField;
+typedef Graphics::SortKeyNextField<DrawFirstDrawField, 8> DrawFirstShaderField;
+typedef Graphics::SortKeyNextField<DrawFirstShaderField, 12> DrawFirstMaterialField;
+typedef Graphics::SortKeyNextField<DrawFirstMaterialField, 12> DrawFirstMeshField;
+
+static const char *kDrawFirstFieldOrder = "Draw,Shader,Material,Mesh";
+
+struct BenchmarkSettings {
+	BenchmarkSettings()
+		: Draws(4000u),
+		  Shaders(8u),
+		  Materials(64u),
+		  Meshes(128u),
+		  RedundantBinds(100u) {
+	}
+
+	uint Draws;
+	uint Shaders;
+	uint Materials;
+	uint Meshes;
+	/** The number of times the per-frame constant buffer is re-bound to the same slot before the submits */
+	uint RedundantBinds;
+};
+
+struct SceneDraw {
+	uint Shader;
+	uint Material;
+	uint Mesh;
+};
+
+/**
+ * Tracks the draws a pipeline state bind came before, so the state groups of the analyzer can be checked.
+ * Constant buffer binds are left out, the same as CaptureAnalyzer::IsPipelineState()
+ */
+class GroupCheckingBackend : public Graphics::RecordingRenderBackend {
+public:
+	GroupCheckingBackend()
+		: m_pipelineStateChanged(false),
+		  m_draws(0u),
+		  m_stateGroups(0u) {
+	}
+
+private:
+	bool m_pipelineStateChanged;
+	uint m_draws;
+	uint m_stateGroups;
+
+public:
+	/** Returns the number of runs of draws with no pipeline state bind between them */
+	inline uint GetStateGroupCount() const { return m_stateGroups; }
+
+	void SetMaterialShader(Graphics::MaterialShader *shader) {
+		RecordingRenderBackend::SetMaterialShader(shader);
+		m_pipelineStateChanged = true;
+	}
+	void SetVertexBuffers(uint startSlot, uint count, ID3D11Buffer * const *buffers, const uint *strides, const uint *offsets) {
+		RecordingRenderBackend::SetVertexBuffers(startSlot, count, buffers, strides, offsets);
+		m_pipelineStateChanged = true;
+	}
+	void SetIndexBuffer(ID3D11Buffer *buffer, DXGI_FORMAT format, uint offset) {
+		RecordingRenderBackend::SetIndexBuffer(buffer, format, offset);
+		m_pipelineStateChanged = true;
+	}
+	void SetPSShaderResources(uint startSlot, uint count, ID3D11ShaderResourceView * const *srvs) {
+		RecordingRenderBackend::SetPSShaderResources(startSlot, count, srvs);
+		m_pipelineStateChanged = true;
+	}
+	void SetBlendState(Graphics::BlendState state, const float blendFactor[4], uint sampleMask) {
+		RecordingRenderBackend::SetBlendState(state, blendFactor, sampleMask);
+		m_pipelineStateChanged = true;
+	}
+	void SetRasterizerState(Graphics::RasterizerState state) {
+		RecordingRenderBackend::SetRasterizerState(state);
+		m_pipelineStateChanged = true;
+	}
+	void SetDepthStencilState(Graphics::DepthStencilState state, uint stencilRef) {
+		RecordingRenderBackend::SetDepthStencilState(state, stencilRef);
+		m_pipelineStateChanged = true;
+	}
+
+	void DrawIndexed(uint indexCount, uint indexStart, int vertexStart) {
+		RecordingRenderBackend::DrawIndexed(indexCount, indexStart, vertexStart);
+		if (m_draws == 0u || m_pipelineStateChanged) {
+			++m_stateGroups;
+		}
+		m_pipelineStateChanged = false;
+		++m_draws;
+	}
+};
+
+void PrintUsage() {
+	printf("Usage: CaptureAnalyzerBenchmark [-draws <count>] [-shaders <count>] [-materials <count>] [-meshes <count>] [-redundant <count>]\n\n"
+	       "    Records a capture of a random scene submitted through a CommandBucket on a CaptureRenderBackend,\n"
+	       "    loads it back with CaptureAnalyzer, and checks the analyzer's bind counts, redundant binds, state\n"
+	       "    groups and sort key replays against what the RecordingRenderBackend saw live.\n");
+}
+
+inline Graphics::MaterialShader *GetFakeShader(uint shader) {
+	return reinterpret_cast<Graphics::MaterialShader *>(static_cast<uintptr_t>(0x100000u + shader) << 4u);
+}
+inline ID3D11ShaderResourceView *GetFakeTexture(uint material) {
+	return reinterpret_cast<ID3D11ShaderResourceView *>(static_cast<uintptr_t>(0x200000u + material) << 4u);
+}
+inline ID3D11Buffer *GetFakeVertexBuffer(uint mesh) {
+	return reinterpret_cast<ID3D11Buffer *>(static_cast<uintptr_t>(0x300000u + mesh) << 4u);
+}
+inline ID3D11Buffer *GetFakeIndexBuffer(uint mesh) {
+	return reinterpret_cast<ID3D11Buffer *>(static_cast<uintptr_t>(0x400000u + mesh) << 4u);
+}
+inline ID3D11Buffer *GetFakeConstantBuffer(uint draw) {
+	return reinterpret_cast<ID3D11Buffer *>(static_cast<uintptr_t>(0x500000u + draw) << 4u);
+}
+
+/**
+ * Adds a packet of a per-object constant buffer bind followed by the draw
+ *
+ * @param bucket    The bucket to add the packet to
+ * @param key       The sort key of the packet
+ * @param index     The index of the draw. Picks its constant buffer
+ * @param draw      The draw
+ */
+void AddDraw(Bucket *bucket, uint64 key, uint index, const SceneDraw &draw) {
+	auto bindCommand = bucket->AddCommand<Graphics::Commands::BindConstantBufferToVS>(key);
+	bindCommand->SetConstantBuffer(GetFakeConstantBuffer(index), 1u);
+
+	auto drawCommand = bucket->AppendCommand<Graphics::Commands::DrawIndexed>(bindCommand);
+	drawCommand->SetMaterialShader(GetFakeShader(draw.Shader));
+	drawCommand->SetVertexBuffer(GetFakeVertexBuffer(draw.Mesh), 32u);
+	drawCommand->SetIndexBuffer(GetFakeIndexBuffer(draw.Mesh), DXGI_FORMAT_R32_UINT);
+	drawCommand->SetTextureSRV(GetFakeTexture(draw.Material), 0u);
+	// Every other material is double sided
+	drawCommand->SetRasterizerState(draw.Material % 2u == 0u ? Graphics::RasterizerState::CULL_BACKFACES : Graphics::RasterizerState::NO_CULL);
+	drawCommand->SetIndexCount(3u * (draw.Mesh + 1u));
+	drawCommand->SetIndexStart(0u);
+	drawCommand->SetVertexStart(0);
+}
+
+inline uint64 GetCapturedKey(uint index, const SceneDraw &draw) {
+	return ShaderField::Encode(draw.Shader) | MaterialField::Encode(draw.Material) | MeshField::Encode(draw.Mesh) | DrawField::Encode(index);
+}
+inline uint64 GetDrawFirstKey(uint index, const SceneDraw &draw) {
+	return DrawFirstDrawField::Encode(index) | DrawFirstShaderField::Encode(draw.Shader) | DrawFirstMaterialField::Encode(draw.Material) | DrawFirstMeshField::Encode(draw.Mesh);
+}
+
+/**
+ * Submits the draws once on a fresh backend and state
+ *
+ * @param draws        The draws
+ * @param drawFirst    If true, the draws are keyed by their index. Otherwise they are keyed by the captured layout
+ * @return             The binds the backend saw
+ */
+Graphics::RenderBackendStats SubmitLive(const std::vector<SceneDraw> &draws, bool drawFirst) {
+	Bucket *bucket = new Bucket(64u * 1024u);
+	for (uint i = 0; i < draws.size(); ++i) {
+		AddDraw(bucket, drawFirst ? GetDrawFirstKey(i, draws[i]) : GetCapturedKey(i, draws[i]), i, draws[i]);
+	}
+
+	Graphics::RecordingRenderBackend backend;
+	Graphics::GraphicsState state;
+	bucket->Submit(&backend, &state);
+	bucket->Clear();
+	delete bucket;
+
+	return backend.GetStats();
+}
+
+/** Returns the live bind count of a category. The SRV and constant buffer stats of RenderBackendStats cover both stages */
+uint GetLiveBinds(const Graphics::RenderBackendStats &stats, CaptureAnalyzer::BindCategory category) {
+	switch (category) {
+	case CaptureAnalyzer::BindCategory::SHADER: return stats.ShaderBinds;
+	case CaptureAnalyzer::BindCategory::VERTEX_BUFFER: return stats.VertexBufferBinds;
+	case CaptureAnalyzer::BindCategory::INDEX_BUFFER: return stats.IndexBufferBinds;
+	case CaptureAnalyzer::BindCategory::VS_SHADER_RESOURCE: return 0u;
+	case CaptureAnalyzer::BindCategory::PS_SHADER_RESOURCE: return stats.ShaderResourceBinds;
+	case CaptureAnalyzer::BindCategory::PS_SAMPLER: return stats.SamplerBinds;
+	case CaptureAnalyzer::BindCategory::VS_CONSTANT_BUFFER: return stats.ConstantBufferBinds;
+	case CaptureAnalyzer::BindCategory::PS_CONSTANT_BUFFER: return 0u;
+	case CaptureAnalyzer::BindCategory::BLEND_STATE: return stats.BlendStateChanges;
+	case CaptureAnalyzer::BindCategory::RASTERIZER_STATE: return stats.RasterizerStateChanges;
+	case CaptureAnalyzer::BindCategory::DEPTH_STENCIL_STATE: return stats.DepthStencilStateChanges;
+	default: return 0u;
+	}
+}
+
+/** Returns true if the replayed changes match the binds of a live submit of the same order, category by category */
+bool MatchesLiveSubmit(const CaptureAnalyzer::ReplayResult &replay, const Graphics::RenderBackendStats &live) {
+	for (uint i = 0; i < CaptureAnalyzer::kNumBindCategories; ++i) {
+		CaptureAnalyzer::BindCategory category = static_cast<CaptureAnalyzer::BindCategory>(i);
+		if (CaptureAnalyzer::IsPipelineState(category) && replay.Changes[i] != GetLiveBinds(live, category)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+uint GetLivePipelineBinds(const Graphics::RenderBackendStats &stats) {
+	return stats.TotalBinds() - stats.ConstantBufferBinds;
+}
+
+/**
+ * A headless check of the capture analyzer. Exits with 1 if the capture can't be written or loaded, if the
+ * analyzer's draws, packets or per-category binds don't match what the backend saw live, if it finds redundant
+ * binds where there weren't any or misses the ones there were, if its state groups don't match the live
+ * pipeline binds, or if replaying the capture in its own order or in issue order doesn't give the binds of
+ * a live submit in that order
+ */
+int main(int argc, char *argv[]) {
+	BenchmarkSettings settings;
+
+	for (int i = 1; i < argc; ++i) {
+		if (i + 1 >= argc) {
+			PrintUsage();
+			return 1;
+		}
+
+		uint value = static_cast<uint>(atoi(argv[i + 1]));
+		if (strcmp(argv[i], "-draws") == 0) {
+			settings.Draws = value;
+		} else if (strcmp(argv[i], "-shaders") == 0) {
+			settings.Shaders = value;
+		} else if (strcmp(argv[i], "-materials") == 0) {
+			settings.Materials = value;
+		} else if (strcmp(argv[i], "-meshes") == 0) {
+			settings.Meshes = value;
+		} else if (strcmp(argv[i], "-redundant") == 0) {
+			settings.RedundantBinds = value;
+		} else {
+			PrintUsage();
+			return 1;
+		}
+		++i;
+	}
+
+	if (settings.Draws == 0u || settings.Draws > kMaxDraws ||
+	    settings.Shaders == 0u || settings.Shaders > kMaxShaders ||
+	    settings.Materials == 0u || settings.Materials > kMaxMaterials ||
+	    settings.Meshes == 0u || settings.Meshes > kMaxMeshes) {
+		printf("Settings out of range. Draws must be in [1, %u], shaders in [1, %u], materials in [1, %u], and meshes in [1, %u]\n\n", kMaxDraws, kMaxShaders, kMaxMaterials, kMaxMeshes);
+		PrintUsage();
+		return 1;
+	}
+
+	std::mt19937 random(1337u);
+	std::uniform_int_distribution<uint> shaderDistribution(0u, settings.Shaders - 1u);
+	std::uniform_int_distribution<uint> materialDistribution(0u, settings.Materials - 1u);
+	std::uniform_int_distribution<uint> meshDistribution(0u, settings.Meshes - 1u);
+
+	std::vector<SceneDraw> draws(settings.Draws);
+	for (auto iter = draws.begin(); iter != draws.end(); ++iter) {
+		iter->Shader = shaderDistribution(random);
+		iter->Material = materialDistribution(random);
+		iter->Mesh = meshDistribution(random);
+	}
+
+	// Record the capture. The scene is submitted twice with the same GraphicsState, so the second submit starts
+	// from the state the first one left bound
+	GroupCheckingBackend liveBackend;
+	Graphics::CaptureRenderBackend captureBackend(&liveBackend);
+	Bucket *bucket = new Bucket(64u * 1024u);
+	Graphics::GraphicsState state;
+	Engine::Timer timer;
+
+	captureBackend.BeginCapture();
+
+	ID3D11Buffer *frameConstantBuffer = GetFakeConstantBuffer(kMaxDraws);
+	for (uint i = 0; i <= settings.RedundantBinds; ++i) {
+		captureBackend.SetVSConstantBuffers(0u, 1u, &frameConstantBuffer);
+	}
+
+	const uint kSubmits = 2u;
+	for (uint submit = 0; submit < kSubmits; ++submit) {
+		for (uint i = 0; i < settings.Draws; ++i) {
+			AddDraw(bucket, GetCapturedKey(i, draws[i]), i, draws[i]);
+		}
+		bucket->Submit(&captureBackend, &state, captureBackend.GetCapture());
+		bucket->Clear();
+	}
+	delete bucket;
+
+	bool written = captureBackend.EndCapture(kCaptureFileW);
+
+	CaptureAnalyzer::Capture capture;
+	std::string error;
+	timer.Start();
+	bool loaded = written && capture.Load(kCaptureFile, &error);
+	double loadMilliseconds = timer.GetTime();
+	remove(kCaptureFile);
+
+	if (!loaded) {
+		printf("\nFAILED: The capture couldn't be %s. %s\n", written ? "loaded" : "written", error.c_str());
+		return 1;
+	}
+
+	const Graphics::RenderBackendStats &live = liveBackend.GetStats();
+	const CaptureAnalyzer::CaptureStats &stats = capture.GetStats();
+
+	bool drawsMatch = stats.Draws == live.DrawCalls && stats.IndicesSubmitted == live.IndicesSubmitted;
+	bool packetsMatch = capture.GetSubmits().size() == kSubmits && stats.Packets == kSubmits * settings.Draws;
+	for (auto iter = capture.GetSubmits().begin(); iter != capture.GetSubmits().end(); ++iter) {
+		packetsMatch = packetsMatch && iter->Packets.size() == settings.Draws && iter->Draws.size() == settings.Draws;
+	}
+
+	printf("%u draws of %u shaders, %u materials and %u meshes, submitted %u times. Loaded in %.2f ms\n\n",
+	       settings.Draws, settings.Shaders, settings.Materials, settings.Meshes, kSubmits, loadMilliseconds);
+	printf("  %-22s %10s %10s %10s\n", "Category", "Live", "Captured", "Redundant");
+
+	bool bindsMatch = true;
+	bool redundantMatch = true;
+	for (uint i = 0; i < CaptureAnalyzer::kNumBindCategories; ++i) {
+		CaptureAnalyzer::BindCategory category = static_cast<CaptureAnalyzer::BindCategory>(i);
+		const CaptureAnalyzer::CategoryStats &categoryStats = stats.Categories[i];
+		uint liveBinds = GetLiveBinds(live, category);
+
+		// CommandBucket filters the pipeline state, so only the frame constant buffer re-binds should be redundant
+		uint expectedRedundant = category == CaptureAnalyzer::BindCategory::VS_CONSTANT_BUFFER ? settings.RedundantBinds : 0u;
+
+		bindsMatch = bindsMatch && categoryStats.Binds == liveBinds;
+		redundantMatch = redundantMatch && categoryStats.RedundantBinds == expectedRedundant;
+
+		printf("  %-22s %10u %10u %10u\n", CaptureAnalyzer::GetBindCategoryName(category), liveBinds, categoryStats.Binds, categoryStats.RedundantBinds);
+	}
+
+	uint groupedDraws = 0u;
+	for (auto iter = stats.DrawsPerStateGroup.begin(); iter != stats.DrawsPerStateGroup.end(); ++iter) {
+		groupedDraws += *iter;
+	}
+	bool groupsMatch = groupedDraws == stats.Draws && stats.DrawsPerStateGroup.size() == liveBackend.GetStateGroupCount();
+
+	// Replay the first submit in its own order, and in the order the draws were issued
+	CaptureAnalyzer::SortKeyLayout capturedLayout;
+	CaptureAnalyzer::SortKeyLayout drawFirstLayout;
+	std::vector<uint> fieldOrder;
+	if (!capturedLayout.Parse(kCapturedLayout, &error) || !capturedLayout.ParseFieldOrder(kDrawFirstFieldOrder, &fieldOrder, &error)) {
+		printf("\nFAILED: The sort key layout couldn't be parsed. %s\n", error.c_str());
+		return 1;
+	}
+	drawFirstLayout = capturedLayout.Reorder(fieldOrder);
+
+	timer.Start();
+	CaptureAnalyzer::ReplayResult capturedReplay = CaptureAnalyzer::ReplaySubmits(capture, capturedLayout, capturedLayout, 0);
+	CaptureAnalyzer::ReplayResult drawFirstReplay = CaptureAnalyzer::ReplaySubmits(capture, capturedLayout, drawFirstLayout, 0);
+	double replayMilliseconds = timer.GetTime();
+
+	Graphics::RenderBackendStats capturedLive = SubmitLive(draws, false);
+	Graphics::RenderBackendStats drawFirstLive = SubmitLive(draws, true);
+	bool capturedReplayMatches = MatchesLiveSubmit(capturedReplay, capturedLive);
+	bool drawFirstReplayMatches = MatchesLiveSubmit(drawFirstReplay, drawFirstLive);
+
+	printf("\n  Draws:                 %u live, %u captured\n", live.DrawCalls, stats.Draws);
+	printf("  Packets:               %u in %u submits\n", stats.Packets, static_cast<uint>(capture.GetSubmits().size()));
+	printf("  State groups:          %u live, %u captured\n", liveBackend.GetStateGroupCount(), static_cast<uint>(stats.DrawsPerStateGroup.size()));
+	printf("  Replayed state changes, in %.2f ms:\n", replayMilliseconds);
+	printf("    %-20s %10u live, %10u replayed\n", kCapturedLayout, GetLivePipelineBinds(capturedLive), capturedReplay.Total());
+	printf("    %-20s %10u live, %10u replayed\n", drawFirstLayout.ToString().c_str(), GetLivePipelineBinds(drawFirstLive), drawFirstReplay.Total());
+
+	if (!drawsMatch) {
+		printf("\nFAILED: The captured draws don't match the live draws\n");
+		return 1;
+	}
+	if (!packetsMatch) {
+		printf("\nFAILED: The capture doesn't have a packet and a draw for every draw of every submit\n");
+		return 1;
+	}
+	if (!bindsMatch) {
+		printf("\nFAILED: The captured binds don't match the live binds\n");
+		return 1;
+	}
+	if (!redundantMatch) {
+		printf("\nFAILED: The analyzer found redundant binds that weren't there, or missed %u that were\n", settings.RedundantBinds);
+		return 1;
+	}
+	if (!groupsMatch) {
+		printf("\nFAILED: The state groups don't cover the draws, or don't match the live pipeline binds\n");
+		return 1;
+	}
+	if (!capturedReplayMatches) {
+		printf("\nFAILED: Replaying the capture in its own order doesn't match a live submit\n");
+		return 1;
+	}
+	if (!drawFirstReplayMatches) {
+		printf("\nFAILED: Replaying the capture in issue order doesn't match a live submit in that order\n");
+		return 1;
+	}
+
+	return 0;
+}
@@ -30,11 +30,14 @@ ClusterCulling::ClusterCulling(HINSTANCE hinstance)
 	  m_globalWorldTransform(DirectX::XMMatrixIdentity()),
 	  m_camera(0.0f, 0.45f * DirectX::XM_PI, 100.0f),
 	  m_showConsole(false),
-	  m_instanceBuffer(nullptr),
+	  m_instanceTransforms(nullptr),
 	  m_sceneLoaded(false),
 	  m_sceneIsSetup(false),
 	  m_sceneScaleFactor(0.0f),
 	  m_modelInstanceThreshold(100u),
+	  m_instanceEncoding(Scene::InstanceEncoding::AFFINE_3X4),
+	  m_numDepthSlices(64u),
+	  m_nearSliceDepth(5.0f),
 	  m_lightCullingPlanesNeedUpdate(true),
 	  m_vsync(false),
 	  m_wireframe(false),
@@ -47,17 +50,23 @@ ClusterCulling::ClusterCulling(HINSTANCE hinstance)
 	  m_debugObjectInputLayout(nullptr),
 	  m_pointLightBuffer(nullptr),
 	  m_spotLightBuffer(nullptr),
+	  m_clusterLightRangeBuffer(nullptr),
+	  m_clusterLightIndexBuffer(nullptr),
 	  m_gbufferVertexShader(nullptr),
 	  m_fullscreenTriangleVertexShader(nullptr),
 	  m_tiledCullFinalGatherComputeShader(nullptr),
-	  m_postProcessPixelShader(nullptr) {
+	  m_postProcessPixelShader(nullptr),
+	  m_renderBackend(nullptr) {
 }
 
 void ClusterCulling::Shutdown() {
 	// Release in the opposite order we initialized in
 	delete m_pointLightBuffer;
 	delete m_spotLightBuffer;
-	delete m_instanceBuffer;
+	delete m_renderBackend;
+	delete m_clusterLightRangeBuffer;
+	delete m_clusterLightIndexBuffer;
+	delete m_instanceTransforms;
 	delete(m_instancedGBufferVertexShader);
 	delete(m_fullscreenTriangleVertexShader);
 	delete(m_tiledCullFinalGatherComputeShader);
@@ -90,15 +99,7 @@ void ClusterCulling::OnResize() {
 	// We swap near and far clip because we are using 1 - depth in our depth buffer
 	m_camera.UpdateProjectionMatrix((float)m_clientWidth, (float)m_clientHeight, m_farClip, m_nearClip);
 
-	// Resize the culling planes
-	uint numClusters_X = (m_clientWidth + COMPUTE_SHADER_TILE_GROUP_DIM - 1) / COMPUTE_SHADER_TILE_GROUP_DIM;
-	uint numClusters_Y = (m_clientHeight + COMPUTE_SHADER_TILE_GROUP_DIM - 1) / COMPUTE_SHADER_TILE_GROUP_DIM;
-	uint numClusters_Z = 64u;
-
-	m_lightCullingPlanes_X.resize(numClusters_X + 1);
-	m_lightCullingPlanes_Y.resize(numClusters_Y + 1);
-	m_lightCullingPlanes_Z.resize(numClusters_Z + 1);
-
+	// Resize the cluster grid
 	UpdateLightCullingPlanes();
 
 	// Release the gBuffers
@@ -50,6 +50,14 @@ void ClusterCulling::DrawFrame(double deltaTime) {
 			m_cameraPanFactor = range * 0.0002857f;
 			m_cameraScrollFactor = range * 0.0002857f;
 
+			// The instances are static, so they're only transformed and uploaded once
+			for (auto iter = m_instancedModels.begin(); iter != m_instancedModels.end(); ++iter) {
+				m_instancedModelStarts.push_back(m_instanceTransforms->GetSize());
+				for (auto transformIter = iter->second->begin(); transformIter != iter->second->end(); ++transformIter) {
+					m_instanceTransforms->Add(*transformIter);
+				}
+			}
+
 			m_sceneIsSetup = true;
 		}
 		RenderMainPass();
@@ -123,45 +131,19 @@ void ClusterCulling::RenderMainPass() {
 
 	// Draw instanced models
 	if (m_instancedModels.size() > 0) {
-		DirectX::XMVECTOR *instanceBuffer = m_instanceBuffer->MapDiscard(m_immediateContext);
-		std::vector<uint> offsets;
-		uint bufferOffset = 0;
-		for (auto iter = m_instancedModels.begin(); iter != m_instancedModels.end(); ++iter) {
-			assert(bufferOffset < static_cast<uint>(m_instanceBuffer->NumElements()));
-
-			// In the future when we support more complicated instancing, this could be something like:
-			//
-			// uint offset = bufferOffset;
-			// std::vector<DirectX::XMVECTOR, Common::AllocatorAligned16<DirectX::XMVECTOR> > instanceVectors = iter->second.InstanceVectors();
-			// for (auto vectorIter = instanceVectors.begin(); vectorIter != instanceVectors.end(); ++vectorIter) {
-			//     instanceBuffer[bufferOffset++] = *vectorIter;
-			// }
-			// 
-			// offsetAndLengths.emplace_back(offset);
-
-			uint offset = bufferOffset;
-			for (auto instanceIter = iter->second->begin(); instanceIter != iter->second->end(); ++instanceIter) {
-				DirectX::XMMATRIX columnOrderMatrix = DirectX::XMMatrixTranspose(m_globalWorldTransform * (*instanceIter));
-				instanceBuffer[bufferOffset++] = columnOrderMatrix.r[0];
-				instanceBuffer[bufferOffset++] = columnOrderMatrix.r[1];
-				instanceBuffer[bufferOffset++] = columnOrderMatrix.r[2];
-			}
-
-			offsets.emplace_back(offset);
-		}
-
-		m_instanceBuffer->Unmap(m_immediateContext);
+		// Only the instances that changed since last frame are transformed and uploaded
+		m_instanceTransforms->Update(m_immediateContext);
 
 		// Set the vertex shader and bind the instance buffer to it
 		m_instancedGBufferVertexShader->BindToPipeline(m_immediateContext);
-		ID3D11ShaderResourceView *srv = m_instanceBuffer->GetShaderResource();
+		ID3D11ShaderResourceView *srv = m_instanceTransforms->GetShaderResource();
 		m_immediateContext->VSSetShaderResources(0, 1, &srv);
 
 		// Set the vertex shader frame constants
 		SetInstancedGBufferVertexShaderFrameConstants(DirectX::XMMatrixTranspose(viewProj));
 
 		for (uint i = 0; i < m_instancedModels.size(); ++i) {
-			SetInstancedGBufferVertexShaderObjectConstants(offsets[i]);
+			SetInstancedGBufferVertexShaderObjectConstants(m_instanceTransforms->GetStartVector(m_instancedModelStarts[i]));
 
 			m_instancedModels[i].first->DrawInstancedSubset(m_immediateContext, static_cast<uint>(m_instancedModels[i].second->size()), &m_materialShaderManager);
 		}
@@ -193,7 +175,7 @@ void ClusterCulling::RenderMainPass() {
 	}
 
 	// Assign lights to clusters
-
+	CalculateClusterLights();
 
 	// Set light buffers
 	SetLightBuffers();
@@ -239,6 +221,8 @@ void ClusterCulling::RenderMainPass() {
 		ID3D11ShaderResourceView *srv = m_spotLightBuffer->GetShaderResource();
 		m_immediateContext->CSSetShaderResources(5, 1, &srv);
 	}
+	ID3D11ShaderResourceView *clusterSRVs[2] = {m_clusterLightRangeBuffer->GetShaderResource(), m_clusterLightIndexBuffer->GetShaderResource()};
+	m_immediateContext->CSSetShaderResources(6, 2, clusterSRVs);
 
 	// Dispatch
 	uint dispatchWidth = (m_clientWidth + COMPUTE_SHADER_TILE_GROUP_DIM - 1) / COMPUTE_SHADER_TILE_GROUP_DIM;
@@ -265,6 +249,7 @@ void ClusterCulling::SetGBufferVertexShaderObjectConstants(DirectX::XMMATRIX &wo
 void ClusterCulling::SetInstancedGBufferVertexShaderFrameConstants(DirectX::XMMATRIX &viewProjMatrix) {
 	InstancedGBufferVertexShaderFrameConstants vertexShaderFrameConstants;
 	vertexShaderFrameConstants.ViewProj = viewProjMatrix;
+	vertexShaderFrameConstants.InstanceEncoding = static_cast<uint>(m_instanceTransforms->GetEncoding());
 
 	m_instancedGBufferVertexShader->SetPerFrameConstants(m_immediateContext, &vertexShaderFrameConstants, 0u);
 }
@@ -287,121 +272,85 @@ void ClusterCulling::SetTiledCullFinalGatherShaderConstants(DirectX::XMMATRIX &w
 	computeShaderFrameConstants.CameraClipPlanes.x = m_nearClip;
 	computeShaderFrameConstants.CameraClipPlanes.y = m_farClip;
 	computeShaderFrameConstants.NumSpotLightsToDraw = m_numSpotLightsToDraw;
+	computeShaderFrameConstants.DepthSliceScale = m_depthSlicing.GetScale();
+	computeShaderFrameConstants.DepthSliceBias = m_depthSlicing.GetBias();
+	computeShaderFrameConstants.NumDepthSlices = m_depthSlicing.GetSliceCount();
 	
 	m_tiledCullFinalGatherComputeShader->SetPerFrameConstants(m_immediateContext, &computeShaderFrameConstants, 0u);
 }
 
 void ClusterCulling::UpdateLightCullingPlanes() {
-	const Common::float2 tileScale(float(m_clientWidth) / float(2u * COMPUTE_SHADER_TILE_GROUP_DIM), float(m_clientHeight) / float(2u * COMPUTE_SHADER_TILE_GROUP_DIM));
-	
-	DirectX::XMFLOAT4X4 projMatrix;
-	DirectX::XMStoreFloat4x4(&projMatrix, m_camera.GetProj());
-
-	const Common::float4 c4(0.0f, 0.0f, 1.0f, 0.0f);
-
-	for (uint x = 0; x < m_lightCullingPlanes_X.size() - 1; x+=2) {
-		float tileBiasX = tileScale.X - x;
-
-		// Now work out composite projection matrix
-		// Relevant matrix columns for this tile frusta
-		Common::float4 c1(projMatrix._11 * tileScale.X, 0.0f, tileBiasX, 0.0f);
+	m_depthSlicing.SetLogarithmic(m_nearClip, m_farClip, m_numDepthSlices, m_nearSliceDepth);
 
-		m_lightCullingPlanes_X[x] = c4 + c1;
-		m_lightCullingPlanes_X[x] /= Common::float3(m_lightCullingPlanes_X[x].X, m_lightCullingPlanes_X[x].Y, m_lightCullingPlanes_X[x].Z).Length();
+	m_clusterLightAssigner.SetGrid(m_camera.GetProj(), m_clientWidth, m_clientHeight, COMPUTE_SHADER_TILE_GROUP_DIM, m_depthSlicing.GetSliceDepths(), m_numDepthSlices);
+}
 
-		m_lightCullingPlanes_X[x + 1] = c4 - c1;
-		m_lightCullingPlanes_X[x + 1] /= Common::float3(m_lightCullingPlanes_X[x + 1].X, m_lightCullingPlanes_X[x + 1].Y, m_lightCullingPlanes_X[x + 1].Z).Length();
+void ClusterCulling::CalculateClusterLights() {
+	// The shader scales the light positions with gWorldView, but not the ranges, so the BVHs scale the ranges back.
+	// The BVHs only have to be rebuilt when the lights changed
+	float radiusScale = 1.0f / m_sceneScaleFactor;
+	if (!m_dirtyPointLights.IsEmpty()) {
+		m_pointLightBVH.Build(m_packedPointLights.empty() ? nullptr : &m_packedPointLights.front(), m_numPointLightsToDraw, &m_threadPool, radiusScale);
 	}
-
-	for (uint y = 0; y < m_lightCullingPlanes_Y.size() - 1; y+=2) {
-		float tileBiasY = tileScale.Y - y;
-
-		// Now work out composite projection matrix
-		// Relevant matrix columns for this tile frusta
-		Common::float4 c2(0.0f, -projMatrix._22 * tileScale.Y, tileBiasY, 0.0f);
-
-		m_lightCullingPlanes_Y[y] = c4 - c2;
-		m_lightCullingPlanes_Y[y] /= Common::float3(m_lightCullingPlanes_Y[y].X, m_lightCullingPlanes_Y[y].Y, m_lightCullingPlanes_Y[y].Z).Length();
-
-		m_lightCullingPlanes_Y[y + 1] = c4 + c2;
-		m_lightCullingPlanes_Y[y + 1] /=  Common::float3(m_lightCullingPlanes_Y[y + 1].X, m_lightCullingPlanes_Y[y + 1].Y, m_lightCullingPlanes_Y[y + 1].Z).Length();
+	if (!m_dirtySpotLights.IsEmpty()) {
+		m_spotLightBVH.Build(m_packedSpotLights.empty() ? nullptr : &m_packedSpotLights.front(), m_numSpotLightsToDraw, &m_threadPool, radiusScale);
 	}
 
-	m_lightCullingPlanes_Z[0] = Common::float4(0.0f, 0.0f, 1.0f, 0.0f);
-	for (uint z = 1; z < m_lightCullingPlanes_Z.size(); ++z) {
-		m_lightCullingPlanes_Z[z] = Common::float4(0.0f, 0.0f, 1.0f, GetLinearDepthFromClusterId(z));
+	// Upload the lights in the BVH order, so the lights of a cluster are close together in the buffers.
+	// Only the lights that changed, or changed places, are written and uploaded
+	m_shaderPointLights.resize(m_numPointLightsToDraw);
+	m_pointLightBVH.Gather(m_packedPointLights.empty() ? nullptr : &m_packedPointLights.front(), m_dirtyPointLights, m_shaderPointLights.empty() ? nullptr : &m_shaderPointLights.front(), &m_dirtyShaderPointLights);
+	m_dirtyPointLights.Clear();
+	m_shaderSpotLights.resize(m_numSpotLightsToDraw);
+	m_spotLightBVH.Gather(m_packedSpotLights.empty() ? nullptr : &m_packedSpotLights.front(), m_dirtySpotLights, m_shaderSpotLights.empty() ? nullptr : &m_shaderSpotLights.front(), &m_dirtyShaderSpotLights);
+	m_dirtySpotLights.Clear();
+
+	// The shader puts the lights in view space with gWorldView, so we do the same
+	DirectX::XMMATRIX worldView = m_globalWorldTransform * m_camera.GetView();
+	uint indexCount = m_clusterLightAssigner.AssignLights(worldView, 
+	                                                      m_shaderPointLights.empty() ? nullptr : &m_shaderPointLights.front(), m_numPointLightsToDraw,
+	                                                      m_shaderSpotLights.empty() ? nullptr : &m_shaderSpotLights.front(), m_numSpotLightsToDraw,
+	                                                      &m_threadPool, &m_pointLightBVH, &m_spotLightBVH);
+
+	// Make sure the cluster buffers are big enough
+	uint clusterCount = m_clusterLightAssigner.GetClusterCount();
+	if (m_clusterLightRangeBuffer == nullptr || m_clusterLightRangeBuffer->NumElements() != (int)clusterCount) {
+		delete m_clusterLightRangeBuffer;
+		m_clusterLightRangeBuffer = new Graphics::StructuredBuffer<Scene::ClusterLightRange>(m_device, clusterCount, D3D11_BIND_SHADER_RESOURCE, true);
 	}
-}
-
-#define DEPTH_CLUSTER_CALC_SCALE 8.740867046f
-#define DEPTH_CLUSTER_CALC_BIAS -20.29566477f
-
-uint ClusterCulling::GetDepthClusterId(float linearDepth) {
-	return static_cast<uint>(std::max(std::log2(linearDepth) * DEPTH_CLUSTER_CALC_SCALE + DEPTH_CLUSTER_CALC_BIAS, 0.0f));
-}
-
-float ClusterCulling::GetLinearDepthFromClusterId(uint clusterId) {
-	return std::pow(2, ((float)clusterId - DEPTH_CLUSTER_CALC_BIAS) / DEPTH_CLUSTER_CALC_SCALE);
-}
-
-void ClusterCulling::CalculateClusterLights() {
-	// Iterate over each point light
-	for (uint i = 0; i < m_pointLights.size(); ++i) {
-		Scene::PointLight light = m_pointLights[i];
-
-		// Get the 'cube' of clusters that surround the light
-		DirectX::XMFLOAT3 position = light.GetPosition();
-		DirectX::XMStoreFloat3(&position, DirectX::XMVector4Transform(DirectX::XMLoadFloat3(&position), m_camera.GetView()));
-
-		// Iterate over z
-		for (int z = 0; z < position.z - light.GetRange(); ++z) {
+	if (m_clusterLightIndexBuffer == nullptr || m_clusterLightIndexBuffer->NumElements() < (int)indexCount) {
+		// Grow with some slack, so moving lights don't cause a new buffer every frame
+		uint capacity = std::max(indexCount + indexCount / 2u, 1024u);
 
-		}
+		delete m_clusterLightIndexBuffer;
+		m_clusterLightIndexBuffer = new Graphics::StructuredBuffer<uint>(m_device, capacity, D3D11_BIND_SHADER_RESOURCE, true);
 	}
-
-	//for (int z = z0; z <= z1; z++) {
-	//    float4 z_light = light;
-	//    if (z != center_z) {           // Use original in the middle, shrunken sphere otherwise
-	//        const ZPlane &plane = (z < center_z)? z_planes[z + 1] : -z_planes[z];
-	//        z_light = project_to_plane(z_light, plane);
-	//    }
-	//    for (int y = y0; y < y1; y++) {
-	//        float3 y_light = z_light;
-	//        if (y != center_y) {      // Use original in the middle, shrunken sphere otherwise
-	//            const YPlane &plane = (y < center_y)? y_planes[y + 1] : -y_planes[y];
-	//            y_light = project_to_plane(y_light, plane);
-	//        }
-	//        int x = x0;               // Scan from left until with hit the sphere
-	//        do { ++x; } while (x < x1 && GetDistance(x_planes[x], y_light_pos) >= y_light_radius);
-	//
-	//        int xs = x1;              // Scan from right until with hit the sphere
-	//        do { --xs; } while (xs >= x && -GetDistance(x_planes[xs], y_light_pos) >= y_light_radius);
-	//
-	//        for (--x; x <= xs; x++)   // Fill in the clusters in the range
-	//            light_lists.AddPointLight(base_cluster + x, light_index);
-	//    }
-	//}
 }
 
 void ClusterCulling::SetLightBuffers() {
+	// Only the lights that changed since the last frame. If nothing moved, nothing is uploaded
+	m_renderBackend->ResetStats();
 	if (m_numPointLightsToDraw > 0) {
-		assert(m_pointLightBuffer->NumElements() >= (int)m_numPointLightsToDraw);
-
-		Scene::ShaderPointLight *pointLightArray = m_pointLightBuffer->MapDiscard(m_immediateContext);
-		for (unsigned int i = 0; i < m_numPointLightsToDraw; ++i) {
-			pointLightArray[i] = m_pointLights[i].GetShaderPackedLight();
-		}
-		m_pointLightBuffer->Unmap(m_immediateContext);
+		assert(m_pointLightBuffer->GetCapacity() >= m_numPointLightsToDraw);
+		m_pointLightBuffer->Upload(&m_shaderPointLights.front(), &m_dirtyShaderPointLights);
 	}
 
 	if (m_numSpotLightsToDraw > 0) {
-		assert(m_spotLightBuffer->NumElements() >= (int)m_numSpotLightsToDraw);
+		assert(m_spotLightBuffer->GetCapacity() >= m_numSpotLightsToDraw);
+		m_spotLightBuffer->Upload(&m_shaderSpotLights.front(), &m_dirtyShaderSpotLights);
+	}
 
-		Scene::ShaderSpotLight *spotLightArray = m_spotLightBuffer->MapDiscard(m_immediateContext);
-		for (unsigned int i = 0; i < m_numSpotLightsToDraw; ++i) {
-			spotLightArray[i] = m_spotLights[i].GetShaderPackedLight();
-		}
-		m_spotLightBuffer->Unmap(m_immediateContext);
+	// The lights of each cluster
+	const std::vector<Scene::ClusterLightRange> &clusterRanges = m_clusterLightAssigner.GetClusterRanges();
+	Scene::ClusterLightRange *rangeArray = m_clusterLightRangeBuffer->MapDiscard(m_immediateContext);
+	memcpy(rangeArray, &clusterRanges.front(), clusterRanges.size() * sizeof(Scene::ClusterLightRange));
+	m_clusterLightRangeBuffer->Unmap(m_immediateContext);
+
+	const std::vector<uint> &lightIndices = m_clusterLightAssigner.GetLightIndices();
+	if (!lightIndices.empty()) {
+		uint *indexArray = m_clusterLightIndexBuffer->MapDiscard(m_immediateContext);
+		memcpy(indexArray, &lightIndices.front(), lightIndices.size() * sizeof(uint));
+		m_clusterLightIndexBuffer->Unmap(m_immediateContext);
 	}
 }
 
@@ -440,7 +389,11 @@ void ClusterCulling::RenderHUD() {
 
 	m_spriteRenderer.Begin(m_immediateContext, Graphics::SpriteRenderer::Point);
 	std::wstring output;
-	fastformat::write(output, L"FPS: ", m_fps, L"\nFrame Time: ", m_frameTime, L" (ms)");
+	fastformat::write(output, L"FPS: ", m_fps, L"\nFrame Time: ", m_frameTime, L" (ms)",
+	                  L"\nBinned Lights: ", m_clusterLightAssigner.GetBinnedLightCount(),
+	                  L"\nCluster Light Indices: ", m_clusterLightAssigner.GetLightIndices().size(),
+	                  L"\nLight KB Uploaded: ", m_renderBackend->GetStats().BytesUploaded / 1024ull,
+	                  L"\nLog Depth Slices: ", m_depthSlicing.GetNearSliceDepth(), L" to ", m_depthSlicing.GetFarSliceDepth());
 	
 	DirectX::XMFLOAT4X4 transform {1, 0, 0, 0,
 	                               0, 1, 0, 0,
@@ -13,10 +13,16 @@
 #include "common/vector.h"
 #include "common/allocator_16_byte_aligned.h"
 #include "common/math.h"
+#include "common/thread_pool.h"
+#include "common/dirty_range_list.h"
 
 #include "scene/camera.h"
 #include "scene/lights.h"
-#include "scene/light_animator.h"
+#include "scene/light_animation_system.h"
+#include "scene/instance_transform_store.h"
+#include "scene/cluster_light_assigner.h"
+#include "scene/cluster_depth_slicing.h"
+#include "scene/light_bvh.h"
 
 #include "engine/texture_manager.h"
 #include "engine/model_manager.h"
@@ -25,6 +31,8 @@
 
 #include "graphics/texture2d.h"
 #include "graphics/structured_buffer.h"
+#include "graphics/staged_structured_buffer.h"
+#include "graphics/d3d11_render_backend.h"
 #include "graphics/device_states.h"
 #include "graphics/sprite_renderer.h"
 #include "graphics/sprite_font.h"
@@ -48,8 +56,6 @@ public:
 	ClusterCulling(HINSTANCE hinstance);
 
 private:
-	static const uint kMaxInstanceVectorsPerFrame = 5000;
-
 	float m_nearClip;
 	float m_farClip;
 
@@ -69,7 +75,9 @@ private:
 	std::vector<std::pair<Scene::Model *, DirectX::XMMATRIX>, Common::Allocator16ByteAligned<std::pair<Scene::Model *, DirectX::XMMATRIX> > > m_models;
 	std::vector<std::pair<Scene::Model *, std::vector<DirectX::XMMATRIX, Common::Allocator16ByteAligned<DirectX::XMMATRIX> > *> > m_instancedModels;
 
-	Graphics::StructuredBuffer<DirectX::XMVECTOR> *m_instanceBuffer;
+	Scene::InstanceTransformStore *m_instanceTransforms;
+	/** The index of the first instance of each of m_instancedModels in m_instanceTransforms */
+	std::vector<uint> m_instancedModelStarts;
 
 	std::vector<Scene::ModelToLoad *> m_modelsToLoad;
 	std::atomic<bool> m_sceneLoaded;
@@ -78,17 +86,39 @@ private:
 
 	float m_sceneScaleFactor;
 	uint m_modelInstanceThreshold;
+	Scene::InstanceEncoding m_instanceEncoding;
 
 	Scene::DirectionalLight m_directionalLight;
+	/** The lights as they were loaded. The animated positions and directions only live in the packed lights */
 	std::vector<Scene::PointLight> m_pointLights;
-	std::vector<Scene::PointLightAnimator> m_pointLightAnimators;
 	std::vector<Scene::SpotLight> m_spotLights;
-	std::vector<Scene::SpotLightAnimator> m_spotLightAnimators;
-
-	std::vector<Common::float4> m_lightCullingPlanes_X;
-	std::vector<Common::float4> m_lightCullingPlanes_Y;
-	std::vector<Common::float4> m_lightCullingPlanes_Z;
+	/** Moves the lights with a velocity, and writes them straight into the packed lights */
+	Scene::LightAnimationSystem m_lightAnimation;
+
+	/** The first m_numPointLightsToDraw / m_numSpotLightsToDraw lights, packed the way the shaders read them. Packed once, when the scene is loaded */
+	std::vector<Scene::ShaderPointLight> m_packedPointLights;
+	std::vector<Scene::ShaderSpotLight> m_packedSpotLights;
+	/** The packed lights that changed since the last frame. Anything that edits a packed light has to mark it here */
+	Common::DirtyRangeList m_dirtyPointLights;
+	Common::DirtyRangeList m_dirtySpotLights;
+	/** Rebuilt from the packed lights whenever they change. Their sorted order keeps lights that are near each other together */
+	Scene::LightBVH m_pointLightBVH;
+	Scene::LightBVH m_spotLightBVH;
+	/** The packed lights, in the BVH order. These are the ones that are clustered and uploaded */
+	std::vector<Scene::ShaderPointLight> m_shaderPointLights;
+	std::vector<Scene::ShaderSpotLight> m_shaderSpotLights;
+	/** The shader lights that changed since the last upload */
+	Common::DirtyRangeList m_dirtyShaderPointLights;
+	Common::DirtyRangeList m_dirtyShaderSpotLights;
+
+	/** The cluster grid, and the lights in each cluster */
+	Scene::ClusterLightAssigner m_clusterLightAssigner;
+	Scene::ClusterDepthSlicing m_depthSlicing;
+	uint m_numDepthSlices;
+	/** The end of the first depth slice */
+	float m_nearSliceDepth;
 	bool m_lightCullingPlanesNeedUpdate;
+	Common::ThreadPool m_threadPool;
 
 	bool m_vsync;
 	bool m_wireframe;
@@ -122,14 +152,22 @@ private:
 
 	// Shader Buffers
 	// We assume there is only one directional light. Therefore, it is stored in a cbuffer
-	Graphics::StructuredBuffer<Scene::ShaderPointLight> *m_pointLightBuffer;
-	Graphics::StructuredBuffer<Scene::ShaderSpotLight> *m_spotLightBuffer;
+	/** Only the lights that changed are uploaded */
+	Graphics::StagedStructuredBuffer *m_pointLightBuffer;
+	Graphics::StagedStructuredBuffer *m_spotLightBuffer;
+	/** One ClusterLightRange per cluster, indexing into m_clusterLightIndexBuffer */
+	Graphics::StructuredBuffer<Scene::ClusterLightRange> *m_clusterLightRangeBuffer;
+	/** The compact list of the lights of every cluster. Grows as needed */
+	Graphics::StructuredBuffer<uint> *m_clusterLightIndexBuffer;
 
 	Graphics::BlendStateManager m_blendStateManager;
 	Graphics::DepthStencilStateManager m_depthStencilStateManager;
 	Graphics::RasterizerStateManager m_rasterizerStateManager;
 	Graphics::SamplerStateManager m_samplerStateManager;
 
+	/** Only used for the light uploads, so they can be counted */
+	Graphics::D3D11RenderBackend *m_renderBackend;
+
 	Graphics::SpriteRenderer m_spriteRenderer;
 	Graphics::SpriteFont m_timesNewRoman12Font;
 	Graphics::SpriteFont m_courierNew10Font;
@@ -177,12 +215,12 @@ private:
 
 	void SetRenderGBuffersPixelShaderConstants(DirectX::XMMATRIX &invViewProjMatrix, uint gBufferId);
 
+	/** Sets up the depth slices and the cluster grid for the current camera and screen size */
 	void UpdateLightCullingPlanes();
-	uint GetDepthClusterId(float linearDepth);
-	float GetLinearDepthFromClusterId(uint clusterId);
+	/** Packs the lights for the shaders, and assigns them to the clusters */
 	void CalculateClusterLights();
 
-	/** Maps the point light StructuredBuffer and the spot light Structured buffer to the pixel shader */
+	/** Uploads the packed lights, and the lights of each cluster, to their StructuredBuffers */
 	void SetLightBuffers();
 };
 
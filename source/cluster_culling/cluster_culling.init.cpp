@@ -66,16 +66,9 @@ bool ClusterCulling::Initialize(LPCTSTR mainWndCaption, uint32 screenWidth, uint
 
 	LoadShaders();
 
-	m_instanceBuffer = new Graphics::StructuredBuffer<DirectX::XMVECTOR>(m_device, kMaxInstanceVectorsPerFrame, D3D11_BIND_SHADER_RESOURCE, true);
-
-	// Create light buffers
-	// This has to be done after the Engine has been Initialized so we have a valid m_device
-	if (m_pointLights.size() > 0) {
-		m_pointLightBuffer = new Graphics::StructuredBuffer<Scene::ShaderPointLight>(m_device, static_cast<uint>(m_pointLights.size()), D3D11_BIND_SHADER_RESOURCE, true);
-	}
-	if (m_spotLights.size() > 0) {
-		m_spotLightBuffer = new Graphics::StructuredBuffer<Scene::ShaderSpotLight>(m_device, static_cast<uint>(m_spotLights.size()), D3D11_BIND_SHADER_RESOURCE, true);
-	}
+	// The instances are added once the scene has finished loading
+	m_instanceTransforms = new Scene::InstanceTransformStore(m_device, Scene::InstanceTransformStore::kDefaultInitialCapacity, m_instanceEncoding);
+	m_instanceTransforms->SetGlobalTransform(m_globalWorldTransform);
 
 	m_spriteRenderer.Initialize(m_device);
 	m_timesNewRoman12Font.Initialize(L"Times New Roman", 12, Graphics::SpriteFont::Regular, true, m_device);
@@ -89,6 +82,16 @@ bool ClusterCulling::Initialize(LPCTSTR mainWndCaption, uint32 screenWidth, uint
 	m_rasterizerStateManager.Initialize(m_device);
 	m_samplerStateManager.Initialize(m_device);
 
+	// Create light buffers
+	// This has to be done after the Engine has been Initialized so we have a valid m_device
+	m_renderBackend = new Graphics::D3D11RenderBackend(m_device, m_immediateContext, &m_blendStateManager, &m_rasterizerStateManager, &m_depthStencilStateManager);
+	if (m_pointLights.size() > 0) {
+		m_pointLightBuffer = new Graphics::StagedStructuredBuffer(m_renderBackend, sizeof(Scene::ShaderPointLight), static_cast<uint>(m_pointLights.size()));
+	}
+	if (m_spotLights.size() > 0) {
+		m_spotLightBuffer = new Graphics::StagedStructuredBuffer(m_renderBackend, sizeof(Scene::ShaderSpotLight), static_cast<uint>(m_spotLights.size()));
+	}
+
 	return true;
 }
 
@@ -108,9 +111,12 @@ void ClusterCulling::LoadSceneJson() {
 
 	m_nearClip = root.get("NearClip", m_nearClip).asSingle();
 	m_farClip = root.get("FarClip", m_farClip).asSingle();
+	m_numDepthSlices = root.get("DepthSlices", m_numDepthSlices).asUInt();
+	m_nearSliceDepth = root.get("NearSliceDepth", m_nearSliceDepth).asSingle();
 	m_sceneScaleFactor = root.get("SceneScaleFactor", 1.0).asSingle();
 	m_globalWorldTransform = DirectX::XMMatrixScaling(m_sceneScaleFactor, m_sceneScaleFactor, m_sceneScaleFactor);
 	m_modelInstanceThreshold = root.get("ModelInstanceThreshold", m_modelInstanceThreshold).asUInt();
+	m_instanceEncoding = Scene::ParseInstanceEncodingFromString(root.get("InstanceEncoding", Scene::GetInstanceEncodingName(m_instanceEncoding)).asString(), m_instanceEncoding);
 
 	Json::Value materials = root["Materials"];
 	std::unordered_map<std::string, Scene::ModelToLoadMaterial> materialMap;
@@ -215,11 +221,11 @@ void ClusterCulling::LoadSceneJson() {
 
 			// All three values must exist for a linear velocity to be valid
 			if (!pointLights[i]["LinearVelocity"].isNull() && !pointLights[i]["AABB_min"].isNull() && !pointLights[i]["AABB_max"]) {
-				m_pointLightAnimators.emplace_back(DirectX::XMFLOAT3(pointLights[i]["LinearVelocity"][0u].asSingle(), pointLights[i]["LinearVelocity"][1u].asSingle(), pointLights[i]["LinearVelocity"][2u].asSingle()),
-				                                   DirectX::XMFLOAT3(pointLights[i]["AABB_min"][0u].asSingle(), pointLights[i]["AABB_min"][1u].asSingle(), pointLights[i]["AABB_min"][2u].asSingle()),
-				                                   DirectX::XMFLOAT3(pointLights[i]["AABB_max"][0u].asSingle(), pointLights[i]["AABB_max"][1u].asSingle(), pointLights[i]["AABB_max"][2u].asSingle()),
-				                                   &m_pointLights,
-				                                   static_cast<uint>(m_pointLights.size()) - 1u);
+				m_lightAnimation.AddPointLight(static_cast<uint>(m_pointLights.size()) - 1u,
+				                               m_pointLights.back().GetPosition(),
+				                               DirectX::XMFLOAT3(pointLights[i]["LinearVelocity"][0u].asSingle(), pointLights[i]["LinearVelocity"][1u].asSingle(), pointLights[i]["LinearVelocity"][2u].asSingle()),
+				                               DirectX::XMFLOAT3(pointLights[i]["AABB_min"][0u].asSingle(), pointLights[i]["AABB_min"][1u].asSingle(), pointLights[i]["AABB_min"][2u].asSingle()),
+				                               DirectX::XMFLOAT3(pointLights[i]["AABB_max"][0u].asSingle(), pointLights[i]["AABB_max"][1u].asSingle(), pointLights[i]["AABB_max"][2u].asSingle()));
 			}
 
 			m_numPointLightsToDraw++;
@@ -259,11 +265,11 @@ void ClusterCulling::LoadSceneJson() {
 				// Only create an animator if there is non-zero velocity
 				if (linearVelocityMin.x != 0.0f || linearVelocityMin.y != 0.0f || linearVelocityMin.z != 0.0f ||
 					linearVelocityMax.x != 0.0f || linearVelocityMax.y != 0.0f || linearVelocityMax.z != 0.0f) {
-					m_pointLightAnimators.emplace_back(DirectX::XMFLOAT3(Common::RandF(linearVelocityMin.x, linearVelocityMax.x), Common::RandF(linearVelocityMin.y, linearVelocityMax.y), Common::RandF(linearVelocityMin.z, linearVelocityMax.z)),
-					                                   AABB_min,
-					                                   AABB_max,
-					                                   &m_pointLights,
-					                                   static_cast<uint>(m_pointLights.size()) - 1u);
+					m_lightAnimation.AddPointLight(static_cast<uint>(m_pointLights.size()) - 1u,
+					                               m_pointLights.back().GetPosition(),
+					                               DirectX::XMFLOAT3(Common::RandF(linearVelocityMin.x, linearVelocityMax.x), Common::RandF(linearVelocityMin.y, linearVelocityMax.y), Common::RandF(linearVelocityMin.z, linearVelocityMax.z)),
+					                               AABB_min,
+					                               AABB_max);
 				}
 			}
 		}
@@ -312,12 +318,13 @@ void ClusterCulling::LoadSceneJson() {
 
 			// Only create an animator if one of the velocities is non-zero
 			if (linearVelocity.x != 0.0f || linearVelocity.y != 0.0f || linearVelocity.z != 0.0f || angularVelocity.x != 0.0f || angularVelocity.y != 0.0f || angularVelocity.z != 0.0f) {
-				m_spotLightAnimators.emplace_back(linearVelocity,
-				                                  AABB_min,
-				                                  AABB_max,
-				                                  angularVelocity,
-				                                  &m_spotLights,
-				                                  static_cast<uint>(m_spotLights.size()) - 1u);
+				m_lightAnimation.AddSpotLight(static_cast<uint>(m_spotLights.size()) - 1u,
+				                              m_spotLights.back().GetPosition(),
+				                              m_spotLights.back().GetDirection(),
+				                              linearVelocity,
+				                              AABB_min,
+				                              AABB_max,
+				                              angularVelocity);
 			}
 
 			m_numSpotLightsToDraw++;
@@ -375,16 +382,29 @@ void ClusterCulling::LoadSceneJson() {
 					linearVelocityMax.x != 0.0f || linearVelocityMax.y != 0.0f || linearVelocityMax.z != 0.0f ||
 					angularVelocityMin.x != 0.0f || angularVelocityMin.y != 0.0f || angularVelocityMin.z != 0.0f ||
 					angularVelocityMax.x != 0.0f || angularVelocityMax.y != 0.0f || angularVelocityMax.z != 0.0f) {
-					m_spotLightAnimators.emplace_back(DirectX::XMFLOAT3(Common::RandF(linearVelocityMin.x, linearVelocityMax.x), Common::RandF(linearVelocityMin.y, linearVelocityMax.y), Common::RandF(linearVelocityMin.z, linearVelocityMax.z)),
-					                                  AABB_min,
-					                                  AABB_max,
-					                                  DirectX::XMFLOAT3(Common::RandF(angularVelocityMin.x, angularVelocityMax.x), Common::RandF(angularVelocityMin.y, angularVelocityMax.y), Common::RandF(angularVelocityMin.z, angularVelocityMax.z)),
-					                                  &m_spotLights,
-					                                  static_cast<uint>(m_spotLights.size()) - 1u);
+					m_lightAnimation.AddSpotLight(static_cast<uint>(m_spotLights.size()) - 1u,
+					                              m_spotLights.back().GetPosition(),
+					                              m_spotLights.back().GetDirection(),
+					                              DirectX::XMFLOAT3(Common::RandF(linearVelocityMin.x, linearVelocityMax.x), Common::RandF(linearVelocityMin.y, linearVelocityMax.y), Common::RandF(linearVelocityMin.z, linearVelocityMax.z)),
+					                              AABB_min,
+					                              AABB_max,
+					                              DirectX::XMFLOAT3(Common::RandF(angularVelocityMin.x, angularVelocityMax.x), Common::RandF(angularVelocityMin.y, angularVelocityMax.y), Common::RandF(angularVelocityMin.z, angularVelocityMax.z)));
 				}
 			}
 		}
 	}
+
+	// Pack the lights once. From here on, the light animation moves the packed lights directly
+	m_packedPointLights.resize(m_numPointLightsToDraw);
+	for (uint i = 0; i < m_numPointLightsToDraw; ++i) {
+		m_packedPointLights[i] = m_pointLights[i].GetShaderPackedLight();
+	}
+	m_packedSpotLights.resize(m_numSpotLightsToDraw);
+	for (uint i = 0; i < m_numSpotLightsToDraw; ++i) {
+		m_packedSpotLights[i] = m_spotLights[i].GetShaderPackedLight();
+	}
+	m_dirtyPointLights.Add(0u, m_numPointLightsToDraw);
+	m_dirtySpotLights.Add(0u, m_numSpotLightsToDraw);
 }
 
 void TW_CALL GetDirectionalLightColorCallback(void *value, void *clientData) {
@@ -11,13 +11,10 @@ namespace ClusterCulling {
 
 void ClusterCulling::Update() {
 	if (m_animateLights) {
-		for (auto iter = m_pointLightAnimators.begin(); iter != m_pointLightAnimators.end(); ++iter) {
-			iter->AnimateLight(m_updatePeriod);
-		}
-
-		for (auto iter = m_spotLightAnimators.begin(); iter != m_spotLightAnimators.end(); ++iter) {
-			iter->AnimateLight(m_updatePeriod);
-		}
+		m_lightAnimation.Update(m_updatePeriod,
+		                        m_packedPointLights.empty() ? nullptr : &m_packedPointLights.front(), static_cast<uint>(m_packedPointLights.size()),
+		                        m_packedSpotLights.empty() ? nullptr : &m_packedSpotLights.front(), static_cast<uint>(m_packedSpotLights.size()),
+		                        &m_threadPool, &m_dirtyPointLights, &m_dirtySpotLights);
 	}
 }
 
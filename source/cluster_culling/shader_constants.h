@@ -22,6 +22,8 @@ struct GBufferVertexShaderObjectConstants {
 
 struct InstancedGBufferVertexShaderFrameConstants {
 	DirectX::XMMATRIX ViewProj;
+	/** A Scene::InstanceEncoding */
+	uint InstanceEncoding;
 };
 
 struct InstancedGBufferVertexShaderObjectConstants {
@@ -43,6 +45,12 @@ struct TiledCullFinalGatherComputeShaderFrameConstants {
 	DirectX::XMFLOAT2 CameraClipPlanes;
 	uint NumSpotLightsToDraw;
 	uint pad;
+
+	/** See Scene::ClusterDepthSlicing */
+	float DepthSliceScale;
+	float DepthSliceBias;
+	uint NumDepthSlices;
+	uint pad2;
 };
 
 
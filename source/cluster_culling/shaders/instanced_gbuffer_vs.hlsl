@@ -6,12 +6,12 @@
 
 #include "types.hlsli"
 #include "graphics/shaders/hlsl_util.hlsli"
+#include "graphics/shaders/instance_encoding.hlsli"
 
 
-#define NUM_VECTORS_PER_INSTANCE 3u
-
 cbuffer cbPerFrame : register(b0) {
 	float4x4 gViewProjMatrix;
+	uint gInstanceEncoding;
 }
 
 cbuffer cbPerObject : register(b1) {
@@ -24,13 +24,7 @@ StructuredBuffer<float4> gInstanceBuffer : register(t0);
 GBufferShaderPixelIn InstancedGBufferVS(InstancedVertexIn input) {
 	GBufferShaderPixelIn output;
 
-	uint worldMatrixOffset = input.instanceId * NUM_VECTORS_PER_INSTANCE + gStartVector;
-
-	float4 c0 = gInstanceBuffer[worldMatrixOffset];
-	float4 c1 = gInstanceBuffer[worldMatrixOffset + 1];
-	float4 c2 = gInstanceBuffer[worldMatrixOffset + 2];
-
-	float4x4 world = CreateMatrixFromCols(c0, c1, c2, float4(0.0f, 0.0f, 0.0f, 1.0f));
+	float4x4 world = LoadInstanceTransform(gInstanceBuffer, gInstanceEncoding, gStartVector, input.instanceId);
 	float4x4 worldViewProj = mul(world, gViewProjMatrix);
 
 	output.positionClip = mul(float4(input.position, 1.0f), worldViewProj);
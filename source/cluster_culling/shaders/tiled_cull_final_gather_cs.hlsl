@@ -29,6 +29,10 @@ cbuffer cbPerFrame : register(b0) {
 
 	float2 gCameraClipPlanes : packoffset(c15);
 	uint gNumSpotLightsToDraw : packoffset(c15.z);
+
+	float gDepthSliceScale : packoffset(c16.x);
+	float gDepthSliceBias : packoffset(c16.y);
+	uint gNumDepthSlices : packoffset(c16.z);
 }
 
 #ifdef MSAA_
@@ -45,19 +49,11 @@ cbuffer cbPerFrame : register(b0) {
 
 StructuredBuffer<PointLight> gPointLights : register(t4);
 StructuredBuffer<SpotLight> gSpotLights : register(t5);
+StructuredBuffer<ClusterLightRange> gClusterLightRanges : register(t6);
+StructuredBuffer<uint> gClusterLightIndices : register(t7);
 
 RWTexture2D<float4> gOutputBuffer : register(u0);
 
-groupshared uint sMinZ;
-groupshared uint sMaxZ;
-
-// Light list for the tile
-groupshared uint sTilePointLightIndices[MAX_LIGHTS_PER_TILE];
-groupshared uint sTileNumPointLights;
-groupshared uint sTileSpotLightIndices[MAX_LIGHTS_PER_TILE];
-groupshared uint sTileNumSpotLights;
-
-
 [numthreads(COMPUTE_SHADER_TILE_GROUP_DIM, COMPUTE_SHADER_TILE_GROUP_DIM, 1)]
 void ComputeShaderTileCS(uint3 groupId : SV_GroupID,
                          uint groupIndex : SV_GroupIndex,
@@ -84,118 +80,10 @@ void ComputeShaderTileCS(uint3 groupId : SV_GroupID,
 
 	float3 positionWS = PositionFromDepth(zw, (pixelCoord + 0.5f) / gbufferDim, gInvViewProjection);
 
-	// Work out Z bounds for our samples
-    float minZSample = min(gCameraClipPlanes.y, linearZ);
-    float maxZSample = max(gCameraClipPlanes.x, linearZ);
-
-	// Initialize shared memory light list and Z bounds
-	if (groupIndex == 0) {
-		sTileNumPointLights = 0;
-		sTileNumSpotLights = 0;
-		sMinZ = 0x7F7FFFFF;      // Max float
-		sMaxZ = 0;
-	}
-
-	GroupMemoryBarrierWithGroupSync();
-	
-	if(maxZSample >= minZSample) {
-        InterlockedMin(sMinZ, asuint(minZSample));
-        InterlockedMax(sMaxZ, asuint(maxZSample));
-    }
-
-	GroupMemoryBarrierWithGroupSync();
-
-	float minTileZ = asfloat(sMinZ);
-	float maxTileZ = asfloat(sMaxZ);
-	
-	// NOTE: This is all uniform per-tile (i.e. no need to do it per-thread) but fairly inexpensive
-	// We could just precompute the frusta planes for each tile and dump them into a constant buffer...
-	// They don't change unless the projection matrix changes since we're doing it in view space.
-	// Then we only need to compute the near/far ones here tightened to our actual geometry.
-	// The overhead of group synchronization/LDS or global memory lookup is probably as much as this
-	// little bit of math anyways, but worth testing.
-
-	// Work out scale/bias from [0, 1]
-	float2 tileScale = gbufferDim * rcp(float(2 * COMPUTE_SHADER_TILE_GROUP_DIM));
-	float2 tileBias = tileScale - float2(groupId.xy);
-
-	// Now work out composite projection matrix
-	// Relevant matrix columns for this tile frusta
-	float4 c1 = float4(gProjection._11 * tileScale.x, 0.0f, tileBias.x, 0.0f);
-	float4 c2 = float4(0.0f, -gProjection._22 * tileScale.y, tileBias.y, 0.0f);
-	float4 c4 = float4(0.0f, 0.0f, 1.0f, 0.0f);
-
-	// Derive frustum planes
-	float4 frustumPlanes[6];
-
-	// Sides
-	frustumPlanes[0] = c4 - c1;
-	frustumPlanes[1] = c4 + c1;
-	frustumPlanes[2] = c4 - c2;
-	frustumPlanes[3] = c4 + c2;
-
-	// Near/far
-	frustumPlanes[4] = float4(0.0f, 0.0f,  1.0f, -minTileZ);
-	frustumPlanes[5] = float4(0.0f, 0.0f, -1.0f,  maxTileZ);
-	
-	// Normalize frustum planes (near/far already normalized)
-	[unroll] 
-	for (uint i = 0; i < 4; ++i) {
-		frustumPlanes[i] *= rcp(length(frustumPlanes[i].xyz));
-	}
-	
-	// Cull lights for this tile
-	uint lightIndex;
-	// Point lights
-	for (lightIndex = groupIndex; lightIndex < gNumPointLightsToDraw; lightIndex += COMPUTE_SHADER_TILE_GROUP_SIZE) {
-		PointLight light = gPointLights[lightIndex];
-		float3 lightPosition = mul(float4(light.Position, 1.0f), gWorldView).xyz;
-
-		// Cull PointLight sphere vs tile frustum
-		bool inFrustum = true;
-		[unroll] 
-		for (uint i = 0; i < 6; ++i) {
-			float d = dot(frustumPlanes[i], float4(lightPosition, 1.0f));
-			inFrustum = inFrustum && (d >= -light.Range);
-		}
-
-		[branch] 
-		if (inFrustum) {
-			// Append light to list
-			// Compaction might be better if we expect a lot of lights
-			uint listIndex;
-			InterlockedAdd(sTileNumPointLights, 1, listIndex);
-			sTilePointLightIndices[listIndex] = lightIndex;
-		}
-	}
-	// Spotlights
-	for (lightIndex = groupIndex; lightIndex < gNumSpotLightsToDraw; lightIndex += COMPUTE_SHADER_TILE_GROUP_SIZE) {
-		SpotLight light = gSpotLights[lightIndex];
-		float3 lightPosition = mul(float4(light.Position, 1.0f), gWorldView).xyz;
-				
-		// Cull SpotLight sphere vs tile frustum
-		// TODO: Actually do cone vs tile frustum culling
-		bool inFrustum = true;
-		[unroll] 
-		for (uint i = 0; i < 6; ++i) {
-			float d = dot(frustumPlanes[i], float4(lightPosition, 1.0f));
-			inFrustum = inFrustum && (d >= -light.Range);
-		}
-
-		[branch] 
-		if (inFrustum) {
-			// Append light to list
-			// Compaction might be better if we expect a lot of lights
-			uint listIndex;
-			InterlockedAdd(sTileNumSpotLights, 1, listIndex);
-			sTileSpotLightIndices[listIndex] = lightIndex;
-		}
-	}
-
-	GroupMemoryBarrierWithGroupSync();
-	
-	uint numPointLights = sTileNumPointLights;
-	uint numSpotLights = sTileNumSpotLights;
+	// Find the cluster of the pixel. The lights were assigned to the clusters on the CPU
+	uint slice = min((uint)max(log2(linearZ) * gDepthSliceScale + gDepthSliceBias, 0.0f), gNumDepthSlices - 1);
+	uint2 numClusters = ((uint2)gbufferDim + COMPUTE_SHADER_TILE_GROUP_DIM - 1) / COMPUTE_SHADER_TILE_GROUP_DIM;
+	ClusterLightRange cluster = gClusterLightRanges[groupId.x + numClusters.x * (groupId.y + numClusters.y * slice)];
 
 	// Only process onscreen pixels (tiles can span screen edges)
 	[branch]
@@ -244,15 +132,17 @@ void ComputeShaderTileCS(uint3 groupId : SV_GroupID,
 			// Accumulate directional contribution
 			AccumulateCookTorranceDirectionalLight(gDirectionalLight, surfProps, toEye, outColor);
 
-			for (lightIndex = 0; lightIndex < numPointLights; ++lightIndex) {
-				PointLight light = gPointLights[sTilePointLightIndices[lightIndex]];
+			uint lightIndexEnd = cluster.Offset + cluster.PointLightCount;
+			for (lightIndex = cluster.Offset; lightIndex < lightIndexEnd; ++lightIndex) {
+				PointLight light = gPointLights[gClusterLightIndices[lightIndex]];
 				
 				// Accumulate point light contribution
 				AccumulateCookTorrancePointLight(light, surfProps, toEye, outColor);
 			}
 
-			for (lightIndex = 0; lightIndex < numSpotLights; ++lightIndex) {
-				SpotLight light = gSpotLights[sTileSpotLightIndices[lightIndex]];
+			lightIndexEnd += cluster.SpotLightCount;
+			for (; lightIndex < lightIndexEnd; ++lightIndex) {
+				SpotLight light = gSpotLights[gClusterLightIndices[lightIndex]];
 				
 				// Accumulate point light contribution
 				AccumulateCookTorranceSpotLight(light, surfProps, toEye, outColor);
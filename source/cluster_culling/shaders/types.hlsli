@@ -37,4 +37,12 @@ struct CalculatedTrianglePixelIn {
 	float2 texCoord      : TEXCOORD;
 };
 
+// The lights of one cluster. Matches Scene::ClusterLightRange
+// The point lights are gClusterLightIndices[Offset, Offset + PointLightCount), and the spot lights follow them
+struct ClusterLightRange {
+	uint Offset;
+	uint PointLightCount;
+	uint SpotLightCount;
+};
+
 #endif
@@ -0,0 +1,760 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "common/typedefs.h"
+#include "common/thread_pool.h"
+
+#include "engine/timer.h"
+
+#include "scene/cluster_light_assigner.h"
+#include "scene/cluster_depth_slicing.h"
+#include "scene/lights.h"
+
+#include <DirectXMath.h>
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+
+static const uint kScreenWidth = 1920u;
+static const uint kScreenHeight = 1080u;
+static const uint kTileSize = 16u;
+static const uint kSliceCount = 64u;
+static const float kNearClip = 0.1f;
+static const float kFarClip = 5000.0f;
+/** The end of the first slice of the default slicing */
+static const float kNearSliceDepth = 1.0f;
+static const uint kDepthSampleCount = 8192u;
+static const float kFieldOfView = 0.25f * DirectX::XM_PI;
+
+struct BenchmarkSettings {
+	BenchmarkSettings()
+		: Lights(0u),
+		  SpotPercent(25u),
+		  Frames(10u),
+		  Verify(64u),
+		  Threads(0u) {
+	}
+
+	/** 0 means 1000, 10000 and 100000 */
+	uint Lights;
+	uint SpotPercent;
+	uint Frames;
+	/** The number of lights checked against brute force, per frame */
+	uint Verify;
+	/** The number of worker threads for the parallel runs. 0 means one less than the number of hardware threads */
+	uint Threads;
+};
+
+struct Result {
+	uint Lights;
+	double SerialMilliseconds;
+	double ParallelMilliseconds;
+	double IndicesPerFrame;
+	double AssignedPerVerifiedLight;
+	double ExactPerVerifiedLight;
+	uint CheckedLights;
+	uint Mismatches;
+	uint ThreadMismatches;
+};
+
+struct AutoTuneResult {
+	double DefaultCost;
+	double TunedCost;
+	double DefaultLightsPerPixel;
+	double TunedLightsPerPixel;
+	double NearSliceDepth;
+	double FarSliceDepth;
+	double TuneMilliseconds;
+};
+
+void PrintUsage() {
+	printf("Usage: ClusterLightBenchmark [-lights <count>] [-spots <percent>] [-frames <count>] [-verify <count>] [-threads <count>]\n\n"
+	       "    -lights     The number of lights. Defaults to running 1000, 10000 and 100000\n"
+	       "    -spots      The percentage of the lights that are spot lights. Defaults to 25\n"
+	       "    -frames     The number of frames to average over. The camera moves every frame. Defaults to 10\n"
+	       "    -verify     The number of lights per frame that are checked against brute force. Defaults to 64\n"
+	       "    -threads    The number of worker threads for the parallel runs. Defaults to one less than the number of hardware threads\n");
+}
+
+/** Lights scattered over a 2000 x 2000 unit city, up to 100 units above the ground */
+void CreateLights(uint lightCount, uint spotPercent, std::vector<Scene::ShaderPointLight> *out_pointLights, std::vector<Scene::ShaderSpotLight> *out_spotLights) {
+	std::mt19937 generator(lightCount);
+	std::uniform_real_distribution<float> position(-1000.0f, 1000.0f);
+	std::uniform_real_distribution<float> height(0.0f, 100.0f);
+	std::uniform_real_distribution<float> range(2.0f, 25.0f);
+	std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+	std::uniform_real_distribution<float> coneAngle(0.1f, 1.3f);
+
+	uint spotLightCount = lightCount * spotPercent / 100u;
+	out_pointLights->clear();
+	out_spotLights->clear();
+
+	for (uint i = 0; i < lightCount - spotLightCount; ++i) {
+		float lightRange = range(generator);
+		out_pointLights->push_back(Scene::ShaderPointLight(DirectX::XMFLOAT3(1.0f, 1.0f, 1.0f), DirectX::XMFLOAT3(position(generator), height(generator), position(generator)), lightRange, 1.0f / lightRange));
+	}
+	for (uint i = 0; i < spotLightCount; ++i) {
+		float lightRange = range(generator) * 2.0f;
+
+		DirectX::XMFLOAT3 direction;
+		DirectX::XMStoreFloat3(&direction, DirectX::XMVector3Normalize(DirectX::XMVectorSet(unit(generator), unit(generator) - 1.0f, unit(generator), 0.0f)));
+
+		out_spotLights->push_back(Scene::ShaderSpotLight(DirectX::XMFLOAT3(1.0f, 1.0f, 1.0f), DirectX::XMFLOAT3(position(generator), height(generator), position(generator)), lightRange, 1.0f / lightRange,
+		                                                 direction, std::cos(coneAngle(generator)), 1.0f));
+	}
+}
+
+/** Reversed depth, like the demos */
+DirectX::XMMATRIX CreateProjection() {
+	return DirectX::XMMatrixPerspectiveFovLH(kFieldOfView, float(kScreenWidth) / float(kScreenHeight), kFarClip, kNearClip);
+}
+
+/** The camera wanders around the middle of the city, and turns */
+DirectX::XMMATRIX CreateView(uint frame) {
+	float angle = frame * 0.6f;
+	DirectX::XMVECTOR eye = DirectX::XMVectorSet(300.0f * std::sin(frame * 0.13f), 20.0f + 10.0f * std::sin(frame * 0.5f), 300.0f * std::cos(frame * 0.07f), 1.0f);
+	DirectX::XMVECTOR forward = DirectX::XMVector3Normalize(DirectX::XMVectorSet(std::sin(angle), -0.1f, std::cos(angle), 0.0f));
+
+	return DirectX::XMMatrixLookToLH(eye, forward, DirectX::XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f));
+}
+
+
+/** The independent description of the grid the brute force checks use. Everything in double precision */
+struct BruteForceGrid {
+	double ScaleX;
+	double ScaleY;
+	uint ClusterCountX;
+	uint ClusterCountY;
+	double SliceDepths[kSliceCount + 1u];
+
+	/** Fills in the 8 corners of a cluster. Bit 0 of the corner index picks the right side, bit 1 the bottom, bit 2 the far side */
+	void GetCorners(uint x, uint y, uint slice, double corners[8][3]) const {
+		for (uint i = 0; i < 8u; ++i) {
+			double depth = SliceDepths[slice + ((i & 4u) != 0u ? 1u : 0u)];
+			double ndcX = 2.0 * double((x + ((i & 1u) != 0u ? 1u : 0u)) * kTileSize) / kScreenWidth - 1.0;
+			double ndcY = 1.0 - 2.0 * double((y + ((i & 2u) != 0u ? 1u : 0u)) * kTileSize) / kScreenHeight;
+
+			corners[i][0] = ndcX / ScaleX * depth;
+			corners[i][1] = ndcY / ScaleY * depth;
+			corners[i][2] = depth;
+		}
+	}
+
+	/** Returns false if the point is outside of the grid */
+	bool FindCluster(const double point[3], uint *out_x, uint *out_y, uint *out_slice) const {
+		if (point[2] < SliceDepths[0] || point[2] >= SliceDepths[kSliceCount]) {
+			return false;
+		}
+
+		double pixelX = (point[0] / point[2] * ScaleX + 1.0) * 0.5 * kScreenWidth;
+		double pixelY = (1.0 - point[1] / point[2] * ScaleY) * 0.5 * kScreenHeight;
+		if (pixelX < 0.0 || pixelY < 0.0 || pixelX >= ClusterCountX * kTileSize || pixelY >= ClusterCountY * kTileSize) {
+			return false;
+		}
+
+		*out_x = static_cast<uint>(pixelX) / kTileSize;
+		*out_y = static_cast<uint>(pixelY) / kTileSize;
+		*out_slice = 0u;
+		while (point[2] >= SliceDepths[*out_slice + 1u]) {
+			++*out_slice;
+		}
+		return true;
+	}
+};
+
+double Dot(const double *a, const double *b) {
+	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+/** The distance from a point to a segment */
+double DistanceToSegment(const double *point, const double *start, const double *end) {
+	double edge[3] = {end[0] - start[0], end[1] - start[1], end[2] - start[2]};
+	double toPoint[3] = {point[0] - start[0], point[1] - start[1], point[2] - start[2]};
+	double t = std::min(std::max(Dot(toPoint, edge) / Dot(edge, edge), 0.0), 1.0);
+	double offset[3] = {toPoint[0] - edge[0] * t, toPoint[1] - edge[1] * t, toPoint[2] - edge[2] * t};
+	return std::sqrt(Dot(offset, offset));
+}
+
+/**
+ * The exact distance from a point to a cluster. The cluster is a convex hexahedron, so the closest
+ * point is inside of it, on one of its 6 faces, on one of its 12 edges, or one of its 8 corners
+ */
+double DistanceToCluster(const double *point, const double corners[8][3]) {
+	// The 4 corners of each face
+	static const uint kFaces[6][4] = {{0, 2, 6, 4}, {1, 3, 7, 5}, {0, 1, 5, 4}, {2, 3, 7, 6}, {0, 1, 3, 2}, {4, 5, 7, 6}};
+
+	double centroid[3] = {0.0, 0.0, 0.0};
+	for (uint i = 0; i < 8u; ++i) {
+		for (uint axis = 0; axis < 3u; ++axis) {
+			centroid[axis] += corners[i][axis] / 8.0;
+		}
+	}
+
+	// Inward facing planes
+	double planes[6][4];
+	for (uint face = 0; face < 6u; ++face) {
+		const double *a = corners[kFaces[face][0]];
+		const double *b = corners[kFaces[face][1]];
+		const double *c = corners[kFaces[face][3]];
+		double ab[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+		double ac[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+		double normal[3] = {ab[1] * ac[2] - ab[2] * ac[1], ab[2] * ac[0] - ab[0] * ac[2], ab[0] * ac[1] - ab[1] * ac[0]};
+		double length = std::sqrt(Dot(normal, normal));
+		for (uint axis = 0; axis < 3u; ++axis) {
+			planes[face][axis] = normal[axis] / length;
+		}
+		planes[face][3] = -Dot(planes[face], a);
+		if (Dot(planes[face], centroid) + planes[face][3] < 0.0) {
+			for (uint i = 0; i < 4u; ++i) {
+				planes[face][i] = -planes[face][i];
+			}
+		}
+	}
+
+	bool inside = true;
+	for (uint face = 0; face < 6u; ++face) {
+		inside = inside && Dot(planes[face], point) + planes[face][3] >= 0.0;
+	}
+	if (inside) {
+		return 0.0;
+	}
+
+	double distance = DBL_MAX;
+	for (uint face = 0; face < 6u; ++face) {
+		double faceDistance = Dot(planes[face], point) + planes[face][3];
+		double projected[3] = {point[0] - planes[face][0] * faceDistance, point[1] - planes[face][1] * faceDistance, point[2] - planes[face][2] * faceDistance};
+
+		bool onFace = true;
+		for (uint other = 0; other < 6u; ++other) {
+			onFace = onFace && (other == face || Dot(planes[other], projected) + planes[other][3] >= -1.0e-9);
+		}
+		if (onFace) {
+			distance = std::min(distance, std::fabs(faceDistance));
+		}
+	}
+	for (uint i = 0; i < 8u; ++i) {
+		for (uint axis = 0; axis < 3u; ++axis) {
+			uint neighbor = i | (1u << axis);
+			if (neighbor != i) {
+				distance = std::min(distance, DistanceToSegment(point, corners[i], corners[neighbor]));
+			}
+		}
+	}
+
+	return distance;
+}
+
+/** Returns true if the cluster list has the light in it */
+bool ClusterHasLight(const Scene::ClusterLightAssigner &assigner, uint cluster, uint light, bool spotLight) {
+	const Scene::ClusterLightRange &range = assigner.GetClusterRanges()[cluster];
+	uint begin = range.Offset + (spotLight ? range.PointLightCount : 0u);
+	uint end = begin + (spotLight ? range.SpotLightCount : range.PointLightCount);
+
+	const std::vector<uint> &indices = assigner.GetLightIndices();
+	return std::binary_search(indices.begin() + begin, indices.begin() + end, light);
+}
+
+/**
+ * Checks the clusters of a point light against brute force. Every cluster within the range of the light
+ * has to have the light in it
+ *
+ * @param out_exact    Incremented by the number of clusters within the range of the light
+ * @return             The number of clusters that are missing the light
+ */
+uint CheckPointLight(const Scene::ClusterLightAssigner &assigner, const BruteForceGrid &grid, const double *center, double radius, uint light, uint *out_exact) {
+	uint missing = 0u;
+	for (uint slice = 0; slice < kSliceCount; ++slice) {
+		if (grid.SliceDepths[slice] > center[2] + radius || grid.SliceDepths[slice + 1u] < center[2] - radius) {
+			continue;
+		}
+
+		for (uint y = 0; y < grid.ClusterCountY; ++y) {
+			for (uint x = 0; x < grid.ClusterCountX; ++x) {
+				double corners[8][3];
+				grid.GetCorners(x, y, slice, corners);
+
+				// Quick reject with the bounds of the cluster
+				bool outside = false;
+				for (uint axis = 0; axis < 3u; ++axis) {
+					double minimum = DBL_MAX;
+					double maximum = -DBL_MAX;
+					for (uint i = 0; i < 8u; ++i) {
+						minimum = std::min(minimum, corners[i][axis]);
+						maximum = std::max(maximum, corners[i][axis]);
+					}
+					outside = outside || center[axis] + radius < minimum || center[axis] - radius > maximum;
+				}
+				if (outside) {
+					continue;
+				}
+
+				// Leave a little room for the float precision of the assigner
+				if (DistanceToCluster(center, corners) > radius * (1.0 - 1.0e-5) - 1.0e-4) {
+					continue;
+				}
+
+				++*out_exact;
+				if (!ClusterHasLight(assigner, assigner.GetClusterIndex(x, y, slice), light, false)) {
+					if (missing < 5u) {
+						printf("Point light %u touches cluster (%u, %u, %u), but isn't in its list\n", light, x, y, slice);
+					}
+					++missing;
+				}
+			}
+		}
+	}
+
+	return missing;
+}
+
+/**
+ * Checks the clusters of a spot light against brute force. Random points inside the cone, and on its
+ * surface, have to land in clusters that have the light in them
+ *
+ * @param out_exact    Incremented by the number of distinct clusters the points land in
+ * @return             The number of clusters that are missing the light
+ */
+uint CheckSpotLight(const Scene::ClusterLightAssigner &assigner, const BruteForceGrid &grid, const double *apex, const double *direction, double range, double cosAngle,
+                    uint light, std::mt19937 &generator, uint *out_exact) {
+	std::uniform_real_distribution<double> unit(-1.0, 1.0);
+
+	// A basis around the direction, for the points on the surface
+	double side[3] = {-direction[2], 0.0, direction[0]};
+	if (Dot(side, side) < 1.0e-6) {
+		side[0] = 1.0;
+	}
+	double sideLength = std::sqrt(Dot(side, side));
+	for (uint axis = 0; axis < 3u; ++axis) {
+		side[axis] /= sideLength;
+	}
+	double up[3] = {direction[1] * side[2] - direction[2] * side[1], direction[2] * side[0] - direction[0] * side[2], direction[0] * side[1] - direction[1] * side[0]};
+
+	std::vector<uint> found;
+	uint missing = 0u;
+	for (uint sample = 0; sample < 4096u; ++sample) {
+		double point[3];
+		if (sample % 2u == 0u) {
+			// Inside of the cone
+			double offset[3] = {unit(generator), unit(generator), unit(generator)};
+			double lengthSquared = Dot(offset, offset);
+			if (lengthSquared > 1.0 || lengthSquared < 1.0e-12 || Dot(offset, direction) < cosAngle * std::sqrt(lengthSquared)) {
+				continue;
+			}
+			for (uint axis = 0; axis < 3u; ++axis) {
+				point[axis] = apex[axis] + offset[axis] * range;
+			}
+		} else {
+			// On the side of the cone, or on the cap
+			double around = unit(generator) * DirectX::XM_PI;
+			double distance = (unit(generator) * 0.5 + 0.5) * range;
+			double cosOffAxis = sample % 4u == 1u ? cosAngle : 1.0 - (unit(generator) * 0.5 + 0.5) * (1.0 - cosAngle);
+			double sinOffAxis = std::sqrt(std::max(1.0 - cosOffAxis * cosOffAxis, 0.0));
+			if (sample % 4u == 3u) {
+				distance = range;
+			}
+			for (uint axis = 0; axis < 3u; ++axis) {
+				point[axis] = apex[axis] + distance * (direction[axis] * cosOffAxis + sinOffAxis * (std::cos(around) * side[axis] + std::sin(around) * up[axis]));
+			}
+		}
+
+		uint x;
+		uint y;
+		uint slice;
+		if (!grid.FindCluster(point, &x, &y, &slice)) {
+			continue;
+		}
+
+		uint cluster = assigner.GetClusterIndex(x, y, slice);
+		if (std::find(found.begin(), found.end(), cluster) != found.end()) {
+			continue;
+		}
+		found.push_back(cluster);
+
+		if (!ClusterHasLight(assigner, cluster, light, true)) {
+			if (missing < 5u) {
+				printf("Spot light %u reaches (%f, %f, %f) in cluster (%u, %u, %u), but isn't in its list\n", light, point[0], point[1], point[2], x, y, slice);
+			}
+			++missing;
+		}
+	}
+
+	*out_exact += static_cast<uint>(found.size());
+	return missing;
+}
+
+Result RunBenchmark(uint lightCount, const BenchmarkSettings &settings, Common::ThreadPool *threadPool) {
+	std::vector<Scene::ShaderPointLight> pointLights;
+	std::vector<Scene::ShaderSpotLight> spotLights;
+	CreateLights(lightCount, settings.SpotPercent, &pointLights, &spotLights);
+	uint pointLightCount = static_cast<uint>(pointLights.size());
+	uint spotLightCount = static_cast<uint>(spotLights.size());
+	const Scene::ShaderPointLight *pointLightData = pointLightCount > 0u ? &pointLights[0] : nullptr;
+	const Scene::ShaderSpotLight *spotLightData = spotLightCount > 0u ? &spotLights[0] : nullptr;
+
+	DirectX::XMMATRIX projection = CreateProjection();
+	Scene::ClusterDepthSlicing slicing;
+	slicing.SetLogarithmic(kNearClip, kFarClip, kSliceCount, kNearSliceDepth);
+	const float *sliceDepths = slicing.GetSliceDepths();
+
+	Scene::ClusterLightAssigner assigner;
+	assigner.SetGrid(projection, kScreenWidth, kScreenHeight, kTileSize, sliceDepths, kSliceCount);
+	Scene::ClusterLightAssigner parallelAssigner;
+	parallelAssigner.SetGrid(projection, kScreenWidth, kScreenHeight, kTileSize, sliceDepths, kSliceCount);
+
+	BruteForceGrid grid;
+	DirectX::XMFLOAT4X4 proj;
+	DirectX::XMStoreFloat4x4(&proj, projection);
+	grid.ScaleX = proj.m[0][0];
+	grid.ScaleY = proj.m[1][1];
+	grid.ClusterCountX = (kScreenWidth + kTileSize - 1u) / kTileSize;
+	grid.ClusterCountY = (kScreenHeight + kTileSize - 1u) / kTileSize;
+	for (uint i = 0; i <= kSliceCount; ++i) {
+		grid.SliceDepths[i] = sliceDepths[i];
+	}
+
+	Result result;
+	memset(&result, 0, sizeof(Result));
+	result.Lights = lightCount;
+
+	Engine::Timer timer;
+	uint64 indexTotal = 0u;
+	uint64 assignedTotal = 0u;
+	uint64 exactTotal = 0u;
+	for (uint frame = 0; frame < settings.Frames; ++frame) {
+		DirectX::XMMATRIX view = CreateView(frame);
+
+		timer.Start();
+		indexTotal += assigner.AssignLights(view, pointLightData, pointLightCount, spotLightData, spotLightCount);
+		result.SerialMilliseconds += timer.GetTime();
+
+		timer.Start();
+		parallelAssigner.AssignLights(view, pointLightData, pointLightCount, spotLightData, spotLightCount, threadPool);
+		result.ParallelMilliseconds += timer.GetTime();
+
+		// The thread count can't change the result
+		const std::vector<Scene::ClusterLightRange> &ranges = assigner.GetClusterRanges();
+		const std::vector<Scene::ClusterLightRange> &parallelRanges = parallelAssigner.GetClusterRanges();
+		bool sameRanges = ranges.size() == parallelRanges.size() && (ranges.empty() || memcmp(&ranges[0], &parallelRanges[0], ranges.size() * sizeof(Scene::ClusterLightRange)) == 0);
+		result.ThreadMismatches += sameRanges && assigner.GetLightIndices() == parallelAssigner.GetLightIndices() ? 0u : 1u;
+
+		// Pick the lights to check, and count the clusters they were assigned to
+		std::mt19937 generator(frame);
+		std::uniform_int_distribution<uint> pick(0u, lightCount - 1u);
+		std::vector<uint> verifyLights;
+		std::vector<uint> verifySlot(lightCount, ~0u);
+		for (uint i = 0; i < settings.Verify; ++i) {
+			uint light = pick(generator);
+			if (verifySlot[light] == ~0u) {
+				verifySlot[light] = static_cast<uint>(verifyLights.size());
+				verifyLights.push_back(light);
+			}
+		}
+		for (uint cluster = 0; cluster < ranges.size(); ++cluster) {
+			const Scene::ClusterLightRange &range = ranges[cluster];
+			for (uint i = 0; i < range.PointLightCount + range.SpotLightCount; ++i) {
+				uint light = assigner.GetLightIndices()[range.Offset + i] + (i < range.PointLightCount ? 0u : pointLightCount);
+				assignedTotal += verifySlot[light] != ~0u ? 1u : 0u;
+			}
+		}
+
+		DirectX::XMFLOAT4X4 viewMatrix;
+		DirectX::XMStoreFloat4x4(&viewMatrix, view);
+		for (auto iter = verifyLights.begin(); iter != verifyLights.end(); ++iter) {
+			// The light, in view space
+			const DirectX::XMFLOAT3 &position = *iter < pointLightCount ? pointLights[*iter].Position : spotLights[*iter - pointLightCount].Position;
+			double viewPosition[3];
+			for (uint axis = 0; axis < 3u; ++axis) {
+				viewPosition[axis] = position.x * viewMatrix.m[0][axis] + position.y * viewMatrix.m[1][axis] + position.z * viewMatrix.m[2][axis] + viewMatrix.m[3][axis];
+			}
+
+			uint exact = 0u;
+			if (*iter < pointLightCount) {
+				result.Mismatches += CheckPointLight(assigner, grid, viewPosition, pointLights[*iter].Range, *iter, &exact);
+			} else {
+				const Scene::ShaderSpotLight &light = spotLights[*iter - pointLightCount];
+				double viewDirection[3];
+				for (uint axis = 0; axis < 3u; ++axis) {
+					viewDirection[axis] = light.Direction.x * viewMatrix.m[0][axis] + light.Direction.y * viewMatrix.m[1][axis] + light.Direction.z * viewMatrix.m[2][axis];
+				}
+				result.Mismatches += CheckSpotLight(assigner, grid, viewPosition, viewDirection, light.Range, light.CosOuterConeAngle, *iter - pointLightCount, generator, &exact);
+			}
+			exactTotal += exact;
+			++result.CheckedLights;
+		}
+	}
+
+	result.SerialMilliseconds /= settings.Frames;
+	result.ParallelMilliseconds /= settings.Frames;
+	result.IndicesPerFrame = static_cast<double>(indexTotal) / settings.Frames;
+	result.AssignedPerVerifiedLight = result.CheckedLights > 0u ? static_cast<double>(assignedTotal) / result.CheckedLights : 0.0;
+	result.ExactPerVerifiedLight = result.CheckedLights > 0u ? static_cast<double>(exactTotal) / result.CheckedLights : 0.0;
+
+	return result;
+}
+
+/**
+ * Checks that the slice depth bounds match the shader formula, for a few cameras and slice counts,
+ * and that the old hard coded scale and bias come out of the matching settings
+ *
+ * @return    The number of failed checks
+ */
+uint CheckSlicing() {
+	struct SlicingCase {
+		float NearClip;
+		float FarClip;
+		uint SliceCount;
+		float NearSliceDepth;
+		float FarSliceDepth;
+	};
+	static const SlicingCase kCases[] = {{0.1f, 5000.0f, 64u, 1.0f, 0.0f},
+	                                     {0.1f, 5000.0f, 64u, 0.1f, 0.0f},
+	                                     {1.0f, 100.0f, 16u, 5.0f, 0.0f},
+	                                     {0.5f, 20000.0f, 128u, 10.0f, 2000.0f},
+	                                     {0.1f, 1000.0f, 2u, 3.0f, 0.0f},
+	                                     {0.1f, 1000.0f, 1u, 3.0f, 0.0f}};
+
+	uint failures = 0u;
+	for (uint c = 0; c < sizeof(kCases) / sizeof(kCases[0]); ++c) {
+		const SlicingCase &slicingCase = kCases[c];
+		Scene::ClusterDepthSlicing slicing;
+		slicing.SetLogarithmic(slicingCase.NearClip, slicingCase.FarClip, slicingCase.SliceCount, slicingCase.NearSliceDepth, slicingCase.FarSliceDepth);
+
+		bool ok = slicing.GetSliceDepth(0u) == slicingCase.NearClip && slicing.GetSliceDepth(slicingCase.SliceCount) == slicingCase.FarClip &&
+		          slicing.GetSlice(slicingCase.NearClip * 0.5f) == 0u && slicing.GetSlice(slicingCase.FarClip * 2.0f) == slicingCase.SliceCount - 1u;
+		for (uint i = 1u; i < slicingCase.SliceCount; ++i) {
+			float bound = slicing.GetSliceDepth(i);
+			ok = ok && bound >= slicing.GetSliceDepth(i - 1u);
+			ok = ok && slicing.GetSlice(bound * 1.0001f) == i && slicing.GetSlice(bound * 0.9999f) == i - 1u;
+		}
+		if (!ok) {
+			printf("Slicing case %u: the slice bounds don't match the slice formula\n", c);
+			++failures;
+		}
+	}
+
+	// The old constants: 63 logarithmic slices from 2^(21.29566477 / 8.740867046) to 2^(84.29566477 / 8.740867046)
+	Scene::ClusterDepthSlicing legacy;
+	legacy.SetLogarithmic(0.1f, 5000.0f, 64u, std::exp2(21.29566477f / 8.740867046f), std::exp2(84.29566477f / 8.740867046f));
+	if (std::fabs(legacy.GetScale() - 8.740867046f) > 1.0e-3f || std::fabs(legacy.GetBias() + 20.29566477f) > 1.0e-3f) {
+		printf("The old depth slicing constants came out as %f, %f\n", legacy.GetScale(), legacy.GetBias());
+		++failures;
+	}
+
+	return failures;
+}
+
+/**
+ * Samples the visible surfaces. The city is a flat ground plane, so each sample is a ray through a
+ * random pixel, hitting the ground. Pixels that see the sky are skipped
+ */
+void SampleSurfaces(DirectX::CXMMATRIX view, DirectX::CXMMATRIX projection, uint frame, std::vector<Scene::DepthSample> *out_samples) {
+	DirectX::XMFLOAT4X4 projMatrix;
+	DirectX::XMStoreFloat4x4(&projMatrix, projection);
+	DirectX::XMFLOAT4X4 invView;
+	DirectX::XMStoreFloat4x4(&invView, DirectX::XMMatrixInverse(nullptr, view));
+
+	std::mt19937 generator(frame);
+	std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+
+	out_samples->clear();
+	for (uint i = 0; i < kDepthSampleCount; ++i) {
+		Scene::DepthSample sample;
+		sample.NdcX = unit(generator);
+		sample.NdcY = unit(generator);
+
+		// A view space ray with a z of 1, so the distance along it is the view depth
+		float worldRayY = sample.NdcX / projMatrix.m[0][0] * invView.m[0][1] + sample.NdcY / projMatrix.m[1][1] * invView.m[1][1] + invView.m[2][1];
+		if (worldRayY >= 0.0f) {
+			continue;
+		}
+
+		sample.Depth = -invView.m[3][1] / worldRayY;
+		if (sample.Depth <= kFarClip) {
+			out_samples->push_back(sample);
+		}
+	}
+}
+
+/** Returns the average number of lights in the clusters of the samples */
+double MeasureLightsPerPixel(const Scene::ClusterLightAssigner &assigner, const Scene::ClusterDepthSlicing &slicing, const std::vector<Scene::DepthSample> &samples) {
+	uint64 lights = 0u;
+	for (auto iter = samples.begin(); iter != samples.end(); ++iter) {
+		uint x = std::min(static_cast<uint>((iter->NdcX * 0.5f + 0.5f) * kScreenWidth) / kTileSize, assigner.GetClusterCountX() - 1u);
+		uint y = std::min(static_cast<uint>((0.5f - iter->NdcY * 0.5f) * kScreenHeight) / kTileSize, assigner.GetClusterCountY() - 1u);
+		const Scene::ClusterLightRange &range = assigner.GetClusterRanges()[assigner.GetClusterIndex(x, y, slicing.GetSlice(iter->Depth))];
+		lights += range.PointLightCount + range.SpotLightCount;
+	}
+
+	return samples.empty() ? 0.0 : static_cast<double>(lights) / samples.size();
+}
+
+/**
+ * Compares the default slicing with the auto-tuned one, on the same lights and camera path as RunBenchmark().
+ * The slicing is tuned from scratch every frame
+ */
+AutoTuneResult RunAutoTune(uint lightCount, const BenchmarkSettings &settings, Common::ThreadPool *threadPool) {
+	std::vector<Scene::ShaderPointLight> pointLights;
+	std::vector<Scene::ShaderSpotLight> spotLights;
+	CreateLights(lightCount, settings.SpotPercent, &pointLights, &spotLights);
+	uint pointLightCount = static_cast<uint>(pointLights.size());
+	uint spotLightCount = static_cast<uint>(spotLights.size());
+	const Scene::ShaderPointLight *pointLightData = pointLightCount > 0u ? &pointLights[0] : nullptr;
+	const Scene::ShaderSpotLight *spotLightData = spotLightCount > 0u ? &spotLights[0] : nullptr;
+
+	DirectX::XMMATRIX projection = CreateProjection();
+	Scene::ClusterDepthSlicing defaultSlicing;
+	defaultSlicing.SetLogarithmic(kNearClip, kFarClip, kSliceCount, kNearSliceDepth);
+	Scene::ClusterLightAssigner defaultAssigner;
+	defaultAssigner.SetGrid(projection, kScreenWidth, kScreenHeight, kTileSize, defaultSlicing.GetSliceDepths(), kSliceCount);
+
+	AutoTuneResult result;
+	memset(&result, 0, sizeof(AutoTuneResult));
+
+	Engine::Timer timer;
+	std::vector<Scene::DepthInterval> intervals;
+	std::vector<Scene::DepthSample> samples;
+	for (uint frame = 0; frame < settings.Frames; ++frame) {
+		DirectX::XMMATRIX view = CreateView(frame);
+		defaultSlicing.CalculateLightIntervals(view, projection, pointLightData, pointLightCount, spotLightData, spotLightCount,
+		                                       defaultAssigner.GetClusterCountX(), defaultAssigner.GetClusterCountY(), &intervals);
+		SampleSurfaces(view, projection, frame, &samples);
+		const Scene::DepthSample *sampleData = samples.empty() ? nullptr : &samples[0];
+		uint sampleCount = static_cast<uint>(samples.size());
+
+		Scene::ClusterDepthSlicing tunedSlicing = defaultSlicing;
+		timer.Start();
+		tunedSlicing.AutoTune(sampleData, sampleCount, &intervals[0], lightCount, 0.0f);
+		result.TuneMilliseconds += timer.GetTime();
+
+		result.DefaultCost += defaultSlicing.CalculateCost(sampleData, sampleCount, &intervals[0], lightCount);
+		result.TunedCost += tunedSlicing.CalculateCost(sampleData, sampleCount, &intervals[0], lightCount);
+		result.NearSliceDepth += tunedSlicing.GetNearSliceDepth();
+		result.FarSliceDepth += tunedSlicing.GetFarSliceDepth();
+
+		Scene::ClusterLightAssigner tunedAssigner;
+		tunedAssigner.SetGrid(projection, kScreenWidth, kScreenHeight, kTileSize, tunedSlicing.GetSliceDepths(), kSliceCount);
+
+		defaultAssigner.AssignLights(view, pointLightData, pointLightCount, spotLightData, spotLightCount, threadPool);
+		tunedAssigner.AssignLights(view, pointLightData, pointLightCount, spotLightData, spotLightCount, threadPool);
+		result.DefaultLightsPerPixel += MeasureLightsPerPixel(defaultAssigner, defaultSlicing, samples);
+		result.TunedLightsPerPixel += MeasureLightsPerPixel(tunedAssigner, tunedSlicing, samples);
+	}
+
+	result.DefaultCost /= settings.Frames;
+	result.TunedCost /= settings.Frames;
+	result.DefaultLightsPerPixel /= settings.Frames;
+	result.TunedLightsPerPixel /= settings.Frames;
+	result.NearSliceDepth /= settings.Frames;
+	result.FarSliceDepth /= settings.Frames;
+	result.TuneMilliseconds /= settings.Frames;
+
+	return result;
+}
+
+/**
+ * A headless benchmark and self-check of the CPU clustered light assignment in Scene::ClusterLightAssigner.
+ * Bins 1k to 100k point and spot lights into a 1920 x 1080 grid of 16 x 16 pixel tiles and 64 depth slices,
+ * with one thread and with the thread pool. Checks a sample of the lights against brute force: an exact
+ * sphere vs cluster distance for point lights, and random points in the cone for spot lights. Then checks
+ * the depth slicing of Scene::ClusterDepthSlicing, and compares auto-tuned slicing with the default. Exits
+ * with 1 if a light is missing from a cluster it reaches, if the thread count changes the result, if the
+ * slice bounds don't match the slice formula, or if auto-tuning makes the lights per pixel worse
+ */
+int main(int argc, char *argv[]) {
+	BenchmarkSettings settings;
+
+	for (int i = 1; i < argc; ++i) {
+		if (i + 1 >= argc) {
+			PrintUsage();
+			return 1;
+		}
+
+		uint value = static_cast<uint>(atoi(argv[i + 1]));
+		if (strcmp(argv[i], "-lights") == 0) {
+			settings.Lights = value;
+		} else if (strcmp(argv[i], "-spots") == 0) {
+			settings.SpotPercent = value;
+		} else if (strcmp(argv[i], "-frames") == 0) {
+			settings.Frames = value;
+		} else if (strcmp(argv[i], "-verify") == 0) {
+			settings.Verify = value;
+		} else if (strcmp(argv[i], "-threads") == 0) {
+			settings.Threads = value;
+		} else {
+			PrintUsage();
+			return 1;
+		}
+		++i;
+	}
+
+	if (settings.SpotPercent > 100u || settings.Frames == 0u) {
+		printf("Settings out of range. Spots must be in [0, 100], and frames at least 1\n\n");
+		PrintUsage();
+		return 1;
+	}
+
+	std::vector<uint> lightCounts;
+	if (settings.Lights != 0u) {
+		lightCounts.push_back(settings.Lights);
+	} else {
+		lightCounts.push_back(1000u);
+		lightCounts.push_back(10000u);
+		lightCounts.push_back(100000u);
+	}
+
+	Common::ThreadPool threadPool(settings.Threads);
+
+	uint slicingFailures = CheckSlicing();
+
+	printf("Grid: %u x %u pixels in %u x %u tiles, %u slices from %.1f to %.0f, logarithmic past %.0f. %u%% spot lights. Average over %u frames, %u worker threads\n\n",
+	       kScreenWidth, kScreenHeight, kTileSize, kTileSize, kSliceCount, kNearClip, kFarClip, kNearSliceDepth, settings.SpotPercent, settings.Frames, threadPool.GetThreadCount());
+	printf("      Lights    1 thread (ms)    Pool (ms)    Light indices    Clusters per checked light (assigned / brute force)\n");
+
+	uint mismatches = 0u;
+	uint threadMismatches = 0u;
+	uint checkedLights = 0u;
+	for (auto iter = lightCounts.begin(); iter != lightCounts.end(); ++iter) {
+		Result result = RunBenchmark(*iter, settings, &threadPool);
+		printf("  %10u %16.3f %12.3f %16.0f %25.1f / %.1f\n", result.Lights, result.SerialMilliseconds, result.ParallelMilliseconds, result.IndicesPerFrame,
+		       result.AssignedPerVerifiedLight, result.ExactPerVerifiedLight);
+
+		mismatches += result.Mismatches;
+		threadMismatches += result.ThreadMismatches;
+		checkedLights += result.CheckedLights;
+	}
+	printf("\n  Checked %u lights against brute force. %u frames differed between 1 thread and the pool\n", checkedLights, threadMismatches);
+
+	// Auto-tuned depth slicing. The cost is the estimate AutoTune() minimizes, and the lights per pixel are measured from the assigned clusters
+	printf("\nAuto-tuned depth slicing, against the default\n\n");
+	printf("      Lights    Log slices (tuned)    Cost (default / tuned)    Lights per pixel (default / tuned)    Tune (ms)\n");
+
+	uint worseSlicings = 0u;
+	for (auto iter = lightCounts.begin(); iter != lightCounts.end(); ++iter) {
+		AutoTuneResult result = RunAutoTune(*iter, settings, &threadPool);
+		printf("  %10u %9.1f to %-7.0f %11.2f / %-11.2f %18.2f / %-15.2f %11.3f\n", *iter, result.NearSliceDepth, result.FarSliceDepth, result.DefaultCost, result.TunedCost,
+		       result.DefaultLightsPerPixel, result.TunedLightsPerPixel, result.TuneMilliseconds);
+
+		worseSlicings += result.TunedCost > result.DefaultCost || result.TunedLightsPerPixel > result.DefaultLightsPerPixel ? 1u : 0u;
+	}
+
+	if (mismatches != 0u || threadMismatches != 0u) {
+		printf("\nFAILED: %u clusters are missing a light that reaches them\n", mismatches);
+		return 1;
+	}
+	if (slicingFailures != 0u || worseSlicings != 0u) {
+		printf("\nFAILED: %u depth slicing checks failed, and auto-tuning made %u light counts worse\n", slicingFailures, worseSlicings);
+		return 1;
+	}
+
+	return 0;
+}
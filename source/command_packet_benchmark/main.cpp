@@ -0,0 +1,385 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "common/typedefs.h"
+
+#include "engine/timer.h"
+
+#include "graphics/command_bucket.h"
+#include "graphics/commands.h"
+#include "graphics/graphics_state.h"
+#include "graphics/recording_render_backend.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+
+static const uint kMaxPackets = 65536u;
+/** The most binds a packet can have in front of its draw, so the draw still fits in CommandBucket::kMaxPacketSize */
+static const uint kMaxBindsPerPacket = 4u;
+/** The command index is packed into the low bits of the fake buffer handles, under the packet index */
+static const uint kCommandIndexBits = 8u;
+/** The most commands the oversized packets check appends before giving up. Far more than kMaxPacketSize fits */
+static const uint kMaxProbedCommands = 1u << kCommandIndexBits;
+/**
+ * The default budget for building, submitting and clearing a packet, in nanoseconds, on the fastest frame. It's several
+ * times what an optimized build needs, so only real regressions trip it. Pass -budget 0 to turn it off, IE. for Debug builds
+ */
+static const uint kDefaultPacketBudget = 2000u;
+
+typedef Graphics::CommandBucket<uint64, kMaxPackets> Bucket;
+
+struct BenchmarkSettings {
+	BenchmarkSettings()
+		: Packets(20000u),
+		  Binds(3u),
+		  Frames(20u),
+		  PacketBudget(kDefaultPacketBudget) {
+	}
+
+	uint Packets;
+	/** The number of BindConstantBufferToVS commands in front of the draw of each packet */
+	uint Binds;
+	uint Frames;
+	/** In nanoseconds per packet. 0 turns the budget off */
+	uint PacketBudget;
+};
+
+/** The sequence of commands a backend was asked to execute. Each entry is (packet << kCommandIndexBits) | command index */
+typedef std::vector<uint> CommandSequence;
+
+/**
+ * Records the packet and the index within the packet of every executed command. The binds carry both in
+ * their fake buffer handle, and the draws carry the packet in their index start
+ */
+class PacketCheckingBackend : public Graphics::RecordingRenderBackend {
+public:
+	PacketCheckingBackend(uint bindsPerPacket)
+		: m_bindsPerPacket(bindsPerPacket) {
+	}
+
+private:
+	uint m_bindsPerPacket;
+	CommandSequence m_sequence;
+
+public:
+	inline const CommandSequence &GetSequence() const { return m_sequence; }
+	inline void ClearSequence() { m_sequence.clear(); }
+
+	void SetVSConstantBuffers(uint startSlot, uint count, ID3D11Buffer * const *buffers) {
+		RecordingRenderBackend::SetVSConstantBuffers(startSlot, count, buffers);
+		m_sequence.push_back(static_cast<uint>(reinterpret_cast<uintptr_t>(buffers[0]) >> 4u));
+	}
+
+	void DrawIndexed(uint indexCount, uint indexStart, int vertexStart) {
+		RecordingRenderBackend::DrawIndexed(indexCount, indexStart, vertexStart);
+		m_sequence.push_back((indexStart << kCommandIndexBits) | m_bindsPerPacket);
+	}
+};
+
+struct FrameResult {
+	double FastestBuildMilliseconds;
+	double FastestSubmitMilliseconds;
+	double FastestClearMilliseconds;
+	double FastestFrameMilliseconds;
+	/** From the first command of each packet to the end of its draw, averaged over the packets */
+	double AveragePacketBytes;
+	/** The number of packets whose commands weren't laid out back to back */
+	uint ScatteredPackets;
+};
+
+void PrintUsage() {
+	printf("Usage: CommandPacketBenchmark [-packets <count>] [-binds <count>] [-frames <count>] [-budget <ns>]\n\n"
+	       "    Fills a CommandBucket with packets of constant buffer binds followed by a draw, in random key order,\n"
+	       "    and times building, submitting and clearing them on a RecordingRenderBackend. Checks that the packets\n"
+	       "    execute in key order with their commands in order, and that a packet that would outgrow\n"
+	       "    kMaxPacketSize is refused without breaking it.\n"
+	       "    Fails if the fastest frame takes longer than -budget nanoseconds per packet.\n");
+}
+
+inline ID3D11Buffer *GetFakeConstantBuffer(uint packet, uint command) {
+	return reinterpret_cast<ID3D11Buffer *>(static_cast<uintptr_t>((packet << kCommandIndexBits) | command) << 4u);
+}
+
+/**
+ * Adds a packet of 'binds' BindConstantBufferToVS commands followed by a DrawIndexed
+ *
+ * @param bucket          The bucket to add the packet to
+ * @param key             The sort key of the packet
+ * @param packet          The index of the packet. Carried by the commands so the backend can tell them apart
+ * @param binds           The number of binds in front of the draw
+ * @param out_scattered   [Optional] Set to true if the commands of the packet aren't laid out back to back
+ * @return                The number of bytes from the first command of the packet to the end of its draw
+ */
+size_t AddPacket(Bucket *bucket, uint64 key, uint packet, uint binds, bool *out_scattered) {
+	auto bindCommand = bucket->AddCommand<Graphics::Commands::BindConstantBufferToVS>(key);
+	bindCommand->SetConstantBuffer(GetFakeConstantBuffer(packet, 0u), 0u);
+	byte *packetStart = reinterpret_cast<byte *>(bindCommand) - sizeof(Graphics::CommandHeader);
+	byte *lastCommandEnd = reinterpret_cast<byte *>(bindCommand) + sizeof(Graphics::Commands::BindConstantBufferToVS);
+	void *lastCommand = bindCommand;
+
+	bool scattered = false;
+	for (uint i = 1; i < binds; ++i) {
+		auto appendedBind = bucket->AppendCommand<Graphics::Commands::BindConstantBufferToVS>(lastCommand);
+		appendedBind->SetConstantBuffer(GetFakeConstantBuffer(packet, i), i);
+
+		// The header of the next command goes right after the last one, give or take alignment
+		byte *header = reinterpret_cast<byte *>(appendedBind) - sizeof(Graphics::CommandHeader);
+		scattered = scattered || header < lastCommandEnd || header >= lastCommandEnd + 16u;
+		lastCommandEnd = reinterpret_cast<byte *>(appendedBind) + sizeof(Graphics::Commands::BindConstantBufferToVS);
+		lastCommand = appendedBind;
+	}
+
+	auto drawCommand = bucket->AppendCommand<Graphics::Commands::DrawIndexed>(lastCommand);
+	drawCommand->SetMaterialShader(reinterpret_cast<Graphics::MaterialShader *>(static_cast<uintptr_t>(0x10u)));
+	drawCommand->SetVertexBuffer(reinterpret_cast<ID3D11Buffer *>(static_cast<uintptr_t>(0x20u)), 32u);
+	drawCommand->SetIndexBuffer(reinterpret_cast<ID3D11Buffer *>(static_cast<uintptr_t>(0x30u)), DXGI_FORMAT_R32_UINT);
+	drawCommand->SetIndexCount(3u);
+	drawCommand->SetIndexStart(packet);
+	drawCommand->SetVertexStart(0);
+
+	byte *drawHeader = reinterpret_cast<byte *>(drawCommand) - sizeof(Graphics::CommandHeader);
+	scattered = scattered || drawHeader < lastCommandEnd || drawHeader >= lastCommandEnd + 16u;
+	if (out_scattered != nullptr) {
+		*out_scattered = scattered;
+	}
+
+	return reinterpret_cast<byte *>(drawCommand) + sizeof(Graphics::Commands::DrawIndexed) - packetStart;
+}
+
+/** Builds the sequence the packets should execute in. IE. packet by packet in key order, and command by command within a packet */
+CommandSequence GetExpectedSequence(const std::vector<uint64> &keys, uint commandsPerPacket) {
+	std::vector<std::pair<uint64, uint> > order(keys.size());
+	for (uint i = 0; i < keys.size(); ++i) {
+		order[i] = std::make_pair(keys[i], i);
+	}
+	std::sort(order.begin(), order.end());
+
+	CommandSequence sequence;
+	for (auto iter = order.begin(); iter != order.end(); ++iter) {
+		for (uint i = 0; i < commandsPerPacket; ++i) {
+			sequence.push_back((iter->second << kCommandIndexBits) | i);
+		}
+	}
+
+	return sequence;
+}
+
+FrameResult RunFrames(Bucket *bucket, const std::vector<uint64> &keys, const BenchmarkSettings &settings) {
+	FrameResult result;
+	result.FastestBuildMilliseconds = 0.0;
+	result.FastestSubmitMilliseconds = 0.0;
+	result.FastestClearMilliseconds = 0.0;
+	result.FastestFrameMilliseconds = 0.0;
+	result.AveragePacketBytes = 0.0;
+	result.ScatteredPackets = 0u;
+
+	Graphics::RecordingRenderBackend backend;
+	Engine::Timer timer;
+
+	for (uint frame = 0; frame < settings.Frames; ++frame) {
+		size_t packetBytes = 0u;
+		uint scatteredPackets = 0u;
+
+		timer.Start();
+		for (uint i = 0; i < settings.Packets; ++i) {
+			bool scattered;
+			packetBytes += AddPacket(bucket, keys[i], i, settings.Binds, &scattered);
+			scatteredPackets += scattered ? 1u : 0u;
+		}
+		double buildMilliseconds = timer.GetTime();
+
+		Graphics::GraphicsState state;
+		timer.Start();
+		bucket->Submit(&backend, &state);
+		double submitMilliseconds = timer.GetTime();
+
+		timer.Start();
+		bucket->Clear();
+		double clearMilliseconds = timer.GetTime();
+
+		double frameMilliseconds = buildMilliseconds + submitMilliseconds + clearMilliseconds;
+		if (frame == 0u || frameMilliseconds < result.FastestFrameMilliseconds) {
+			result.FastestBuildMilliseconds = buildMilliseconds;
+			result.FastestSubmitMilliseconds = submitMilliseconds;
+			result.FastestClearMilliseconds = clearMilliseconds;
+			result.FastestFrameMilliseconds = frameMilliseconds;
+		}
+		result.AveragePacketBytes = static_cast<double>(packetBytes) / settings.Packets;
+		result.ScatteredPackets = std::max(result.ScatteredPackets, scatteredPackets);
+	}
+
+	return result;
+}
+
+/**
+ * Fills packets until AppendCommand() refuses a command, in a bucket whose pages only fit a single packet,
+ * then submits them all
+ *
+ * @param packets           The number of packets to fill
+ * @param out_appended      Will be filled with the number of commands each packet ended up with
+ * @param out_packetBytes   Will be filled with the size of the largest packet
+ * @return                  True if every packet refused a command before growing past kMaxPacketSize, and
+ *                          the packets then executed with every command that was accepted, in order
+ */
+bool CheckOversizedPackets(uint packets, std::vector<uint> *out_appended, size_t *out_packetBytes) {
+	Bucket *bucket = new Bucket(0u);
+	PacketCheckingBackend backend(0u);
+
+	bool refused = true;
+	*out_packetBytes = 0u;
+	out_appended->assign(packets, 0u);
+	std::vector<uint64> keys(packets);
+	for (uint packet = 0; packet < packets; ++packet) {
+		// Reverse order, so the packets are executed in a different order than they were laid out
+		keys[packet] = packets - packet;
+
+		auto command = bucket->AddCommand<Graphics::Commands::BindConstantBufferToVS>(keys[packet]);
+		command->SetConstantBuffer(GetFakeConstantBuffer(packet, 0u), 0u);
+		byte *packetStart = reinterpret_cast<byte *>(command) - sizeof(Graphics::CommandHeader);
+		byte *packetEnd = reinterpret_cast<byte *>(command) + sizeof(Graphics::Commands::BindConstantBufferToVS);
+		uint commandCount = 1u;
+
+		for (;;) {
+			auto appended = bucket->AppendCommand<Graphics::Commands::BindConstantBufferToVS>(command);
+			if (appended == nullptr) {
+				break;
+			}
+			if (commandCount == kMaxProbedCommands - 1u) {
+				refused = false;
+				break;
+			}
+
+			appended->SetConstantBuffer(GetFakeConstantBuffer(packet, commandCount), commandCount);
+			packetEnd = reinterpret_cast<byte *>(appended) + sizeof(Graphics::Commands::BindConstantBufferToVS);
+			command = appended;
+			++commandCount;
+		}
+
+		(*out_appended)[packet] = commandCount;
+		*out_packetBytes = std::max(*out_packetBytes, static_cast<size_t>(packetEnd - packetStart));
+	}
+
+	Graphics::GraphicsState state;
+	bucket->Submit(&backend, &state);
+
+	CommandSequence expected;
+	for (uint i = packets; i-- > 0u;) {
+		for (uint j = 0; j < (*out_appended)[i]; ++j) {
+			expected.push_back((i << kCommandIndexBits) | j);
+		}
+	}
+
+	bucket->Clear();
+	delete bucket;
+
+	return refused && *out_packetBytes <= Bucket::kMaxPacketSize && backend.GetSequence() == expected;
+}
+
+/**
+ * A headless benchmark of command packets. Exits with 1 if the packets don't execute in key order with their
+ * commands in order, if their commands aren't laid out back to back, if AppendCommand() lets a packet grow
+ * past kMaxPacketSize or breaks the packet it refuses, or if the fastest frame took longer than the budget
+ */
+int main(int argc, char *argv[]) {
+	BenchmarkSettings settings;
+
+	for (int i = 1; i < argc; ++i) {
+		if (i + 1 >= argc) {
+			PrintUsage();
+			return 1;
+		}
+
+		uint value = static_cast<uint>(atoi(argv[i + 1]));
+		if (strcmp(argv[i], "-packets") == 0) {
+			settings.Packets = value;
+		} else if (strcmp(argv[i], "-binds") == 0) {
+			settings.Binds = value;
+		} else if (strcmp(argv[i], "-frames") == 0) {
+			settings.Frames = value;
+		} else if (strcmp(argv[i], "-budget") == 0) {
+			settings.PacketBudget = value;
+		} else {
+			PrintUsage();
+			return 1;
+		}
+		++i;
+	}
+
+	if (settings.Packets == 0u || settings.Packets > kMaxPackets || settings.Binds == 0u || settings.Binds > kMaxBindsPerPacket || settings.Frames == 0u) {
+		printf("Settings out of range. Packets must be in [1, %u], binds in [1, %u], and frames at least 1\n\n", kMaxPackets, kMaxBindsPerPacket);
+		PrintUsage();
+		return 1;
+	}
+
+	std::mt19937 random(1337u);
+	std::vector<uint64> keys(settings.Packets);
+	for (uint i = 0; i < settings.Packets; ++i) {
+		keys[i] = i;
+	}
+	std::shuffle(keys.begin(), keys.end(), random);
+
+	Bucket *bucket = new Bucket(64u * 1024u);
+
+	// Check the execution order once, on a backend that records it
+	PacketCheckingBackend checkingBackend(settings.Binds);
+	for (uint i = 0; i < settings.Packets; ++i) {
+		AddPacket(bucket, keys[i], i, settings.Binds, nullptr);
+	}
+	Graphics::GraphicsState state;
+	bucket->Submit(&checkingBackend, &state);
+	bucket->Clear();
+	bool orderVerified = checkingBackend.GetSequence() == GetExpectedSequence(keys, settings.Binds + 1u);
+
+	FrameResult frames = RunFrames(bucket, keys, settings);
+	delete bucket;
+
+	std::vector<uint> oversizedCommandCounts;
+	size_t oversizedPacketBytes;
+	bool oversizedRefused = CheckOversizedPackets(16u, &oversizedCommandCounts, &oversizedPacketBytes);
+
+	printf("%u packets of %u binds and a draw, %u frames\n\n", settings.Packets, settings.Binds, settings.Frames);
+	printf("  Execution order:     %s\n", orderVerified ? "verified" : "MISMATCH");
+	printf("  Scattered packets:   %u\n", frames.ScatteredPackets);
+	printf("  Packet size:         %.1f bytes, %.1f bytes per command\n", frames.AveragePacketBytes, frames.AveragePacketBytes / (settings.Binds + 1u));
+	printf("  Oversized packets:   %s. Capped at %u commands, %u bytes of %u\n", oversizedRefused ? "refused" : "NOT REFUSED",
+	       oversizedCommandCounts.front(), static_cast<uint>(oversizedPacketBytes), static_cast<uint>(Bucket::kMaxPacketSize));
+
+	double nanosecondsPerPacket = 1.0e6 / settings.Packets;
+	printf("\n  %-8s %12s\n", "Fastest", "ns/packet");
+	printf("  %-8s %12.1f\n", "Build", frames.FastestBuildMilliseconds * nanosecondsPerPacket);
+	printf("  %-8s %12.1f\n", "Submit", frames.FastestSubmitMilliseconds * nanosecondsPerPacket);
+	printf("  %-8s %12.1f\n", "Clear", frames.FastestClearMilliseconds * nanosecondsPerPacket);
+	printf("  %-8s %12.1f\n", "Frame", frames.FastestFrameMilliseconds * nanosecondsPerPacket);
+
+	double fastestFrame = frames.FastestFrameMilliseconds * nanosecondsPerPacket;
+	if (settings.PacketBudget > 0u) {
+		printf("\n  Budget: %u ns per packet\n", settings.PacketBudget);
+	}
+
+	if (!orderVerified) {
+		printf("\nFAILED: The packets didn't execute in key order, with their commands in order\n");
+		return 1;
+	}
+	if (frames.ScatteredPackets > 0u) {
+		printf("\nFAILED: The commands of %u packets weren't laid out back to back\n", frames.ScatteredPackets);
+		return 1;
+	}
+	if (!oversizedRefused) {
+		printf("\nFAILED: AppendCommand() didn't refuse a command that would outgrow the packet, or broke the packet it refused\n");
+		return 1;
+	}
+	if (settings.PacketBudget > 0u && fastestFrame > settings.PacketBudget) {
+		printf("\nFAILED: The fastest frame took longer than the budget of %u ns per packet\n", settings.PacketBudget);
+		return 1;
+	}
+
+	return 0;
+}
@@ -15,6 +15,8 @@
 
 #pragma once
 
+#include "common/linear_allocator.h"
+
 #include <stddef.h>  // Required for size_t and ptrdiff_t and NULL
 #include <new>       // Required for placement new and std::bad_alloc
 #include <stdexcept> // Required for std::length_error
@@ -106,7 +108,7 @@ public:
 			throw std::length_error("Mallocator<T>::allocate() - Integer overflow.");
 		}
 
-		void *const pv = _aligned_malloc(n * sizeof(T), 16);
+		void *const pv = AlignedMalloc(n * sizeof(T), 16);
 
 		// Allocators should throw std::bad_alloc in the case of memory allocation failure.
 		if (pv == NULL) {
@@ -117,7 +119,7 @@ public:
 	}
 
 	void deallocate(T *const p, const size_t n) const {
-		_aligned_free(p);
+		AlignedFree(p);
 	}
 
 
@@ -0,0 +1,91 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "common/typedefs.h"
+#include "common/halfling_sys.h"
+
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+
+namespace Common {
+
+/**
+ * Hands out dense ids for a family of objects. IE. 0, 1, 2, 3...
+ *
+ * Each Tag type gets its own counter, so ids of different resource types
+ * don't eat into each other's range. An id stays valid until it is given
+ * back with Release(). After that, Next() hands it out again, smallest
+ * first, so the ids stay below the number of objects alive at once rather
+ * than growing with every object ever created.
+ *
+ * The ids are meant to be used as small, hash-free keys. IE. for sort keys
+ * or as indices into flat arrays
+ *
+ * @tparam Tag    Any type. Only used to pick the counter
+ */
+template <typename Tag>
+class DenseIdGenerator {
+private:
+	static std::mutex s_lock;
+	static uint32 s_nextId;
+	/** A min-heap of the ids that have been released */
+	static std::vector<uint32> s_freeIds;
+
+public:
+	/** Returns the smallest free id. Thread safe */
+	static inline uint32 Next() {
+		std::lock_guard<std::mutex> guard(s_lock);
+
+		if (s_freeIds.empty()) {
+			return s_nextId++;
+		}
+
+		std::pop_heap(s_freeIds.begin(), s_freeIds.end(), std::greater<uint32>());
+		uint32 id = s_freeIds.back();
+		s_freeIds.pop_back();
+
+		return id;
+	}
+
+	/**
+	 * Gives an id back, so Next() can hand it out again. Thread safe
+	 *
+	 * @param id    An id returned by Next() that hasn't been released yet
+	 */
+	static inline void Release(uint32 id) {
+		std::lock_guard<std::mutex> guard(s_lock);
+
+		AssertMsg(id < s_nextId, "Id " << id << " was never handed out");
+		s_freeIds.push_back(id);
+		std::push_heap(s_freeIds.begin(), s_freeIds.end(), std::greater<uint32>());
+	}
+
+	/** Returns one more than the largest id handed out so far. IE. the size a flat array indexed by id needs */
+	static inline uint32 Count() {
+		std::lock_guard<std::mutex> guard(s_lock);
+		return s_nextId;
+	}
+
+	/** Returns the number of ids that are handed out and not released */
+	static inline uint32 LiveCount() {
+		std::lock_guard<std::mutex> guard(s_lock);
+		return s_nextId - static_cast<uint32>(s_freeIds.size());
+	}
+};
+
+template <typename Tag>
+std::mutex DenseIdGenerator<Tag>::s_lock;
+template <typename Tag>
+uint32 DenseIdGenerator<Tag>::s_nextId(0u);
+template <typename Tag>
+std::vector<uint32> DenseIdGenerator<Tag>::s_freeIds;
+
+} // End of namespace Common
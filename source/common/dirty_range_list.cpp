@@ -0,0 +1,81 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "common/dirty_range_list.h"
+
+#include <algorithm>
+
+
+namespace Common {
+
+DirtyRangeList::DirtyRangeList()
+	: m_isCoalesced(true) {
+}
+
+void DirtyRangeList::Add(uint begin, uint end) {
+	if (begin >= end) {
+		return;
+	}
+
+	if (!m_ranges.empty()) {
+		DirtyRange &last = m_ranges.back();
+		if (begin >= last.Begin && begin <= last.End) {
+			// Extend the last range. The list stays coalesced if it was
+			last.End = std::max(last.End, end);
+			return;
+		}
+		m_isCoalesced = m_isCoalesced && begin > last.End;
+	}
+
+	DirtyRange range;
+	range.Begin = begin;
+	range.End = end;
+	m_ranges.push_back(range);
+}
+
+void DirtyRangeList::Add(const DirtyRangeList &other) {
+	for (auto iter = other.m_ranges.begin(); iter != other.m_ranges.end(); ++iter) {
+		Add(iter->Begin, iter->End);
+	}
+}
+
+void DirtyRangeList::Coalesce(uint maxGap) {
+	if (m_ranges.empty()) {
+		return;
+	}
+
+	if (!m_isCoalesced) {
+		std::sort(m_ranges.begin(), m_ranges.end(), [](const DirtyRange &a, const DirtyRange &b) { return a.Begin < b.Begin; });
+	} else if (maxGap == 0u) {
+		// Already sorted, and nothing touches
+		return;
+	}
+
+	// Merge in place
+	uint last = 0u;
+	for (uint i = 1u; i < m_ranges.size(); ++i) {
+		const DirtyRange &range = m_ranges[i];
+		if (range.Begin <= m_ranges[last].End || range.Begin - m_ranges[last].End <= maxGap) {
+			m_ranges[last].End = std::max(m_ranges[last].End, range.End);
+		} else {
+			m_ranges[++last] = range;
+		}
+	}
+	m_ranges.resize(last + 1u);
+
+	m_isCoalesced = true;
+}
+
+uint DirtyRangeList::GetElementCount() const {
+	uint count = 0u;
+	for (auto iter = m_ranges.begin(); iter != m_ranges.end(); ++iter) {
+		count += iter->End - iter->Begin;
+	}
+
+	return count;
+}
+
+} // End of namespace Common
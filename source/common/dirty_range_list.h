@@ -0,0 +1,59 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "common/typedefs.h"
+
+#include <vector>
+
+
+namespace Common {
+
+/** The elements [Begin, End) of an array */
+struct DirtyRange {
+	uint Begin;
+	uint End;
+};
+
+/**
+ * The ranges of an array that have changed, and have to be uploaded again
+ *
+ * Ranges can be added in any order, and can overlap. Adding ranges in ascending order,
+ * IE. while walking an array, extends the last range where possible, so it stays cheap.
+ * Coalesce() sorts the ranges, and merges the ones that overlap or are close together.
+ */
+class DirtyRangeList {
+public:
+	DirtyRangeList();
+
+private:
+	std::vector<DirtyRange> m_ranges;
+	/** The ranges are in ascending order, and don't touch or overlap */
+	bool m_isCoalesced;
+
+public:
+	/** Marks the elements [begin, end) as dirty. Empty ranges are ignored */
+	void Add(uint begin, uint end);
+	inline void Add(uint index) { Add(index, index + 1u); }
+	/** Marks every range of another list as dirty */
+	void Add(const DirtyRangeList &other);
+	/**
+	 * Sorts the ranges, and merges the ones that overlap, touch, or are separated by at most maxGap clean elements
+	 *
+	 * @param maxGap    [Optional] The largest number of clean elements between two ranges that are merged
+	 */
+	void Coalesce(uint maxGap = 0u);
+	inline void Clear() { m_ranges.clear(); m_isCoalesced = true; }
+
+	inline bool IsEmpty() const { return m_ranges.empty(); }
+	inline uint GetRangeCount() const { return static_cast<uint>(m_ranges.size()); }
+	inline const std::vector<DirtyRange> &GetRanges() const { return m_ranges; }
+	/** Returns the number of elements in the ranges. Elements in more than one range are counted more than once, unless the list is coalesced */
+	uint GetElementCount() const;
+};
+
+} // End of namespace Common
@@ -0,0 +1,152 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "common/frame_allocator.h"
+
+#include <cassert>
+#include <malloc.h>
+#include <new>
+
+
+namespace Common {
+
+__declspec(thread) FrameAllocator::ThreadCache FrameAllocator::t_threadCache = {0ull, nullptr};
+std::atomic<uint64> FrameAllocator::s_nextAllocatorId(1ull);
+
+FrameAllocator::FrameAllocator(size_t pageSize, uint initialPageCount)
+		: m_id(s_nextAllocatorId.fetch_add(1ull)),
+		  m_pageSize(pageSize),
+		  m_totalPages(0u),
+		  m_totalOversizedBlocks(0u) {
+	m_freePages.reserve(initialPageCount);
+	for (uint i = 0; i < initialPageCount; ++i) {
+		m_freePages.push_back(AcquirePage());
+	}
+}
+
+FrameAllocator::~FrameAllocator() {
+	Reset();
+
+	for (auto iter = m_freePages.begin(); iter != m_freePages.end(); ++iter) {
+		_aligned_free(*iter);
+	}
+	for (auto iter = m_freeOversizedBlocks.begin(); iter != m_freeOversizedBlocks.end(); ++iter) {
+		_aligned_free(iter->Data);
+	}
+	for (auto iter = m_arenas.begin(); iter != m_arenas.end(); ++iter) {
+		delete *iter;
+	}
+}
+
+void FrameAllocator::Reset() {
+	std::lock_guard<std::mutex> guard(m_lock);
+
+	for (auto iter = m_arenas.begin(); iter != m_arenas.end(); ++iter) {
+		Arena *arena = *iter;
+
+		m_freePages.insert(m_freePages.end(), arena->Pages.begin(), arena->Pages.end());
+		arena->Pages.clear();
+
+		// Force the next allocation down the slow path, so the arena picks up a fresh page
+		arena->Current = nullptr;
+		arena->End = nullptr;
+	}
+
+	m_freeOversizedBlocks.insert(m_freeOversizedBlocks.end(), m_oversizedBlocks.begin(), m_oversizedBlocks.end());
+	m_oversizedBlocks.clear();
+}
+
+FrameAllocator::Arena *FrameAllocator::GetThreadArena() {
+	std::thread::id thisThread = std::this_thread::get_id();
+
+	std::lock_guard<std::mutex> guard(m_lock);
+
+	Arena *arena = nullptr;
+	for (auto iter = m_arenas.begin(); iter != m_arenas.end(); ++iter) {
+		if ((*iter)->Thread == thisThread) {
+			arena = *iter;
+			break;
+		}
+	}
+
+	if (arena == nullptr) {
+		arena = new Arena;
+		arena->Thread = thisThread;
+		arena->Current = nullptr;
+		arena->End = nullptr;
+
+		m_arenas.push_back(arena);
+	}
+
+	t_threadCache.AllocatorId = m_id;
+	t_threadCache.CachedArena = arena;
+
+	return arena;
+}
+
+void *FrameAllocator::AllocateSlow(Arena *arena, size_t size, size_t alignment) {
+	assert((alignment & (alignment - 1u)) == 0u);
+
+	std::lock_guard<std::mutex> guard(m_lock);
+
+	size_t requiredSize = size + alignment - 1u;
+
+	if (requiredSize > m_pageSize) {
+		// Look for the smallest recycled block that is big enough
+		auto bestFit = m_freeOversizedBlocks.end();
+		for (auto iter = m_freeOversizedBlocks.begin(); iter != m_freeOversizedBlocks.end(); ++iter) {
+			if (iter->Size >= requiredSize && (bestFit == m_freeOversizedBlocks.end() || iter->Size < bestFit->Size)) {
+				bestFit = iter;
+			}
+		}
+
+		Block block;
+		if (bestFit != m_freeOversizedBlocks.end()) {
+			block = *bestFit;
+			*bestFit = m_freeOversizedBlocks.back();
+			m_freeOversizedBlocks.pop_back();
+		} else {
+			block.Size = requiredSize;
+			block.Data = static_cast<byte *>(_aligned_malloc(requiredSize, kDefaultAlignment));
+			if (block.Data == nullptr) {
+				throw std::bad_alloc();
+			}
+			m_totalOversizedBlocks.fetch_add(1u);
+		}
+
+		m_oversizedBlocks.push_back(block);
+
+		return AlignPointer(block.Data, alignment);
+	}
+
+	// Move the arena to a new page. The rest of the old page is wasted
+	byte *page;
+	if (m_freePages.empty()) {
+		page = AcquirePage();
+	} else {
+		page = m_freePages.back();
+		m_freePages.pop_back();
+	}
+	arena->Pages.push_back(page);
+
+	byte *userPtr = AlignPointer(page, alignment);
+	arena->Current = userPtr + size;
+	arena->End = page + m_pageSize;
+
+	return userPtr;
+}
+
+byte *FrameAllocator::AcquirePage() {
+	byte *page = static_cast<byte *>(_aligned_malloc(m_pageSize, kDefaultAlignment));
+	if (page == nullptr) {
+		throw std::bad_alloc();
+	}
+
+	m_totalPages.fetch_add(1u);
+	return page;
+}
+
+} // End of namespace Common
@@ -0,0 +1,135 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "common/typedefs.h"
+#include "common/linear_allocator.h"
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+
+namespace Common {
+
+/**
+ * A thread safe, frame scoped allocator for transient data. IE. command packets,
+ * visible object lists, etc.
+ *
+ * Every thread that allocates gets its own arena, so the common path is a lock-free
+ * pointer bump. Arenas take fixed-size pages from a backing store that is shared by
+ * all the threads. The store is only locked when an arena runs out of room.
+ *
+ * Reset() hands every page back to the store at the end of the frame. Pages are never
+ * released to the OS until the allocator is destroyed, so in steady state a frame
+ * makes no OS calls at all.
+ *
+ * Allocations that don't fit in a page are served from separate blocks. They are
+ * recycled across frames the same way as pages. Each one takes the smallest free block
+ * that fits, so a frame that repeats the last frame's allocations reuses all of its blocks.
+ */
+class FrameAllocator {
+public:
+	/**
+	 * @param pageSize            The size of the pages handed out to the thread arenas
+	 * @param initialPageCount    The number of pages to allocate up front
+	 */
+	FrameAllocator(size_t pageSize = 64u * 1024u, uint initialPageCount = 0u);
+	~FrameAllocator();
+
+	static const size_t kDefaultAlignment = LinearAllocator::kDefaultAlignment;
+
+private:
+	struct Arena {
+		std::thread::id Thread;
+		byte *Current;
+		byte *End;
+		/** The pages this arena took from the store since the last Reset() */
+		std::vector<byte *> Pages;
+	};
+
+	struct Block {
+		byte *Data;
+		size_t Size;
+	};
+
+	struct ThreadCache {
+		uint64 AllocatorId;
+		Arena *CachedArena;
+	};
+
+	/** The arena the calling thread used last. Saves a lock and a search on every allocation */
+	static __declspec(thread) ThreadCache t_threadCache;
+	static std::atomic<uint64> s_nextAllocatorId;
+
+	/** Unique for every instance, so a stale thread cache can't match an allocator created at the same address */
+	uint64 m_id;
+	size_t m_pageSize;
+
+	std::mutex m_lock;
+	std::vector<Arena *> m_arenas;
+	std::vector<byte *> m_freePages;
+	std::vector<Block> m_oversizedBlocks;
+	std::vector<Block> m_freeOversizedBlocks;
+	/** Atomic, so they can be read while other threads allocate */
+	std::atomic<uint> m_totalPages;
+	std::atomic<uint> m_totalOversizedBlocks;
+
+public:
+	/**
+	 * Allocates a block of memory from the calling thread's arena. The memory is valid until the next Reset()
+	 *
+	 * @param size         The size of the block in bytes
+	 * @param alignment    The alignment of the block. Must be a power of two
+	 * @return             The block
+	 */
+	inline void *Allocate(size_t size, size_t alignment = kDefaultAlignment) {
+		Arena *arena = t_threadCache.AllocatorId == m_id ? t_threadCache.CachedArena : GetThreadArena();
+
+		byte *userPtr = AlignPointer(arena->Current, alignment);
+		if (userPtr + size <= arena->End) {
+			arena->Current = userPtr + size;
+			return userPtr;
+		}
+
+		return AllocateSlow(arena, size, alignment);
+	}
+
+	template <typename T>
+	inline T *Allocate(size_t count = 1u) {
+		return static_cast<T *>(Allocate(sizeof(T) * count, std::alignment_of<T>::value > kDefaultAlignment ? std::alignment_of<T>::value : kDefaultAlignment));
+	}
+
+	/**
+	 * Frees every allocation made since the last Reset(), on all threads
+	 *
+	 * NOTE: No other thread may allocate while Reset() is running
+	 */
+	void Reset();
+
+	/** Returns the number of pages that have been requested from the OS */
+	inline uint GetTotalPageCount() const { return m_totalPages.load(); }
+	/** Returns the number of blocks for allocations bigger than a page that have been requested from the OS */
+	inline uint GetTotalOversizedBlockCount() const { return m_totalOversizedBlocks.load(); }
+	inline size_t GetPageSize() const { return m_pageSize; }
+
+private:
+	/** Finds or creates the arena of the calling thread, and caches it */
+	Arena *GetThreadArena();
+	/** Serves allocations that didn't fit in the rest of the arena's current page */
+	void *AllocateSlow(Arena *arena, size_t size, size_t alignment);
+
+	byte *AcquirePage();
+
+	// Not implemented
+	FrameAllocator(const FrameAllocator &);
+	FrameAllocator &operator=(const FrameAllocator &);
+};
+
+} // End of namespace Common
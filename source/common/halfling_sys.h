@@ -8,6 +8,8 @@
 
 #include "common/typedefs.h"
 
+#if defined(_WIN32)
+
 // Only include the base windows libraries
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
@@ -39,3 +41,25 @@
 			DebugBreak();                                                                                                                        \
 		}                                                                                                                                        \
 	} while (false)
+
+#else
+
+// There's no one to ask on the headless builds (IE. the Linux build farm), so print the message and abort
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+#define ZeroMemory(destination, length) std::memset((destination), 0, (length))
+
+#define AssertMsg(condition, message)                                                                                                            \
+	do {                                                                                                                                         \
+		if (!(condition)) {                                                                                                                      \
+			std::wstringstream debugStream;                                                                                                      \
+			debugStream << "Assertion `" #condition "` failed in " << __FILE__  << " line " << __LINE__ << ": " << message << std::endl;         \
+			std::wcerr << debugStream.str();                                                                                                     \
+			std::abort();                                                                                                                        \
+		}                                                                                                                                        \
+	} while (false)
+
+#endif
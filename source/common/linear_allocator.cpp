@@ -6,52 +6,132 @@
 
 #include "common/linear_allocator.h"
 
+#include <cassert>
+#include <new>
+
 
 namespace Common {
 
 LinearAllocator::LinearAllocator(size_t pageSize)
 		: m_pageSize(pageSize),
-		  m_numPages(1u) {
-	m_currentPage = m_firstPage = new Page(pageSize);
-	m_current = reinterpret_cast<byte *>(m_currentPage->Data);
+		  m_numPages(1u),
+		  m_oversizedPages(nullptr),
+		  m_freeOversizedPages(nullptr) {
+	m_currentPage = m_firstPage = CreatePage(pageSize);
+	m_current = m_currentPage->Data;
 	m_end = m_current + m_pageSize;
 }
 
 LinearAllocator::~LinearAllocator() {
-	Page *currentPage = m_firstPage;
-	Page *pageToDelete;
+	DestroyPages(m_firstPage);
+	DestroyPages(m_oversizedPages);
+	DestroyPages(m_freeOversizedPages);
+}
+
+void *LinearAllocator::Allocate(size_t size, size_t alignment) {
+	assert((alignment & (alignment - 1u)) == 0u);
+
+	// Allocations that can't fit in a page, even at the worst case alignment, get their own block
+	if (size + alignment - 1u > m_pageSize) {
+		return AllocateOversized(size, alignment);
+	}
+
+	byte *userPtr = AlignPointer(m_current, alignment);
+	if (userPtr + size > m_end) {
+		MoveToNextPage();
+		userPtr = AlignPointer(m_current, alignment);
+	}
+
+	m_current = userPtr + size;
+
+	return userPtr;
+}
+
+void LinearAllocator::EnsureContiguous(size_t size) {
+	assert(size <= m_pageSize);
+
+	if (m_current + size > m_end) {
+		MoveToNextPage();
+	}
+}
+
+void LinearAllocator::Reset() {
+	m_currentPage = m_firstPage;
+	m_current = m_currentPage->Data;
+	m_end = m_current + m_pageSize;
+
+	// Move the oversized blocks to the free list
+	while (m_oversizedPages != nullptr) {
+		Page *page = m_oversizedPages;
+		m_oversizedPages = page->NextPage;
+
+		page->NextPage = m_freeOversizedPages;
+		m_freeOversizedPages = page;
+	}
+}
 
-	do {
-		pageToDelete = currentPage;
-		currentPage = currentPage->NextPage;
+void LinearAllocator::MoveToNextPage() {
+	// Check if we already have a new page allocated
+	if (m_currentPage->NextPage != nullptr) {
+		m_currentPage = m_currentPage->NextPage;
+	} else {
+		// Allocate a new page
+		Page *newPage = CreatePage(m_pageSize);
 
+		m_currentPage->NextPage = newPage;
+		m_currentPage = newPage;
+
+		++m_numPages;
+	}
+
+	m_current = m_currentPage->Data;
+	m_end = m_current + m_pageSize;
+}
+
+LinearAllocator::Page *LinearAllocator::CreatePage(size_t size) {
+	Page *page = new Page;
+	page->NextPage = nullptr;
+	page->Size = size;
+	page->Data = static_cast<byte *>(AlignedMalloc(size, kDefaultAlignment));
+	if (page->Data == nullptr) {
+		delete page;
+		throw std::bad_alloc();
+	}
+
+	return page;
+}
+
+void LinearAllocator::DestroyPages(Page *firstPage) {
+	while (firstPage != nullptr) {
+		Page *pageToDelete = firstPage;
+		firstPage = firstPage->NextPage;
+
+		AlignedFree(pageToDelete->Data);
 		delete pageToDelete;
-	} while (currentPage != nullptr);
-}
-
-void *LinearAllocator::Allocate(size_t size) {
-    if (m_current + size >= m_end) {
-		// Check if we already have a new page allocated
-		if (m_currentPage->NextPage != nullptr) {
-			m_currentPage = m_currentPage->NextPage;
-		} else {
-			// Allocate a new page;
-			Page *newPage = new Page(m_pageSize);
-
-			m_currentPage->NextPage = newPage;
-			m_currentPage = newPage;
-
-			++m_numPages;
-		}
-        
-        m_current = reinterpret_cast<byte *>(m_currentPage->Data);
-        m_end = m_current + m_pageSize;
-    }
-    
-    void* userPtr = m_current;
-    m_current += size;
-    
-    return userPtr;
+	}
+}
+
+void *LinearAllocator::AllocateOversized(size_t size, size_t alignment) {
+	size_t requiredSize = size + alignment - 1u;
+
+	// Look for a free block that is big enough
+	Page **link = &m_freeOversizedPages;
+	while (*link != nullptr && (*link)->Size < requiredSize) {
+		link = &(*link)->NextPage;
+	}
+
+	Page *page;
+	if (*link != nullptr) {
+		page = *link;
+		*link = page->NextPage;
+	} else {
+		page = CreatePage(requiredSize);
+	}
+
+	page->NextPage = m_oversizedPages;
+	m_oversizedPages = page;
+
+	return AlignPointer(page->Data, alignment);
 }
 
 } // End of namespace Common
@@ -8,42 +8,119 @@
 
 #include "common/typedefs.h"
 
+#include <cstddef>
+#include <cstdlib>
+
+#if defined(_MSC_VER)
+	#include <malloc.h>
+#endif
+
 
 namespace Common {
 
+/**
+ * A simple bump allocator. Memory is handed out linearly from a list of pages
+ * and is only freed all at once, with Reset(). Pages are kept around after a
+ * Reset(), so in steady state no memory is requested from the OS.
+ *
+ * Allocations that are too large to fit in a page are served from separate
+ * blocks. These are also kept after a Reset() and re-used for later oversized
+ * allocations.
+ *
+ * NOTE: The allocator is *not* thread safe. See Common::FrameAllocator for that
+ */
 class LinearAllocator {
 public:
-    LinearAllocator(size_t pageSize);
+	LinearAllocator(size_t pageSize);
 	~LinearAllocator();
 
+	static const size_t kDefaultAlignment = 16u;
+
 private:
-    struct Page {
-        Page(size_t pageSize)
-            : NextPage(nullptr),
-              Data(::operator new(pageSize)) {
-        }
-    
-        Page *NextPage;
-        void *Data;
-    };
-
-    size_t m_pageSize;
-    
+	struct Page {
+		Page *NextPage;
+		byte *Data;
+		size_t Size;
+	};
+
+	size_t m_pageSize;
 	uint m_numPages;
 
-    Page *m_firstPage;
-    Page *m_currentPage;
-    
-    byte *m_end;
-    byte *m_current;
-    
+	Page *m_firstPage;
+	Page *m_currentPage;
+
+	/** Oversized blocks in use since the last Reset() */
+	Page *m_oversizedPages;
+	/** Oversized blocks that can be re-used */
+	Page *m_freeOversizedPages;
+
+	byte *m_end;
+	byte *m_current;
+
 public:
-    void *Allocate(size_t size);
-    inline void Reset() {  
-		m_currentPage = m_firstPage; 
-		m_current = reinterpret_cast<byte *>(m_currentPage->Data);
-		m_end = m_current + m_pageSize;
-	}
+	/**
+	 * Allocates a block of memory. The memory is valid until the next Reset()
+	 *
+	 * @param size         The size of the block in bytes
+	 * @param alignment    The alignment of the block. Must be a power of two
+	 * @return             The block
+	 */
+	void *Allocate(size_t size, size_t alignment = kDefaultAlignment);
+	/**
+	 * Makes sure the next 'size' bytes of allocations come from the same page, so that
+	 * they are laid out contiguously. Moves to the next page if needed.
+	 *
+	 * @param size    The number of bytes. Must not be larger than the page size
+	 */
+	void EnsureContiguous(size_t size);
+	/** Frees all the allocations at once. The memory is kept for re-use */
+	void Reset();
+
+	inline uint GetNumPages() const { return m_numPages; }
+
+private:
+	void MoveToNextPage();
+
+	static Page *CreatePage(size_t size);
+	static void DestroyPages(Page *firstPage);
+
+	void *AllocateOversized(size_t size, size_t alignment);
+
+	// Not implemented
+	LinearAllocator(const LinearAllocator &);
+	LinearAllocator &operator=(const LinearAllocator &);
 };
 
+/** Rounds 'pointer' up to the next multiple of 'alignment'. 'alignment' must be a power of two */
+inline byte *AlignPointer(byte *pointer, size_t alignment) {
+	return reinterpret_cast<byte *>((reinterpret_cast<size_t>(pointer) + (alignment - 1u)) & ~(alignment - 1u));
+}
+
+/**
+ * Allocates a block of memory aligned to 'alignment'. IE. _aligned_malloc(), on every platform
+ * The block must be freed with AlignedFree()
+ *
+ * @param size         The size of the block in bytes
+ * @param alignment    The alignment of the block. Must be a power of two
+ * @return             The block, or nullptr if the allocation failed
+ */
+inline void *AlignedMalloc(size_t size, size_t alignment) {
+	#if defined(_MSC_VER)
+		return _aligned_malloc(size, alignment);
+	#else
+		// posix_memalign() can't align to less than a pointer
+		void *block = nullptr;
+		return posix_memalign(&block, alignment < sizeof(void *) ? sizeof(void *) : alignment, size) == 0 ? block : nullptr;
+	#endif
+}
+
+/** Frees a block allocated with AlignedMalloc() */
+inline void AlignedFree(void *block) {
+	#if defined(_MSC_VER)
+		_aligned_free(block);
+	#else
+		free(block);
+	#endif
+}
+
 } // End of namespace Common
@@ -0,0 +1,102 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "common/radix_sort.h"
+
+#include "common/thread_pool.h"
+
+#include <algorithm>
+#include <cstring>
+
+
+namespace Common {
+
+RadixSorter::RadixSorter() {
+}
+
+void RadixSorter::SortPairs(uint32 *keys, uint32 *values, uint count, uint keyBits, ThreadPool *threadPool) {
+	if (count < 2u) {
+		return;
+	}
+
+	uint chunkCount = (count + kChunkSize - 1u) / kChunkSize;
+	m_scratchKeys.resize(count);
+	m_scratchValues.resize(count);
+	m_chunkHistograms.resize(chunkCount * kBucketCount);
+
+	uint32 *sourceKeys = keys;
+	uint32 *sourceValues = values;
+	uint32 *destKeys = &m_scratchKeys[0];
+	uint32 *destValues = &m_scratchValues[0];
+
+	for (uint shift = 0u; shift < keyBits; shift += kDigitBits) {
+		// Count the digits of each chunk
+		auto countChunks = [&](uint firstChunk, uint endChunk) {
+			for (uint chunk = firstChunk; chunk < endChunk; ++chunk) {
+				uint *histogram = &m_chunkHistograms[chunk * kBucketCount];
+				memset(histogram, 0, kBucketCount * sizeof(uint));
+
+				uint end = std::min((chunk + 1u) * kChunkSize, count);
+				for (uint i = chunk * kChunkSize; i < end; ++i) {
+					++histogram[(sourceKeys[i] >> shift) & (kBucketCount - 1u)];
+				}
+			}
+		};
+		if (threadPool != nullptr && chunkCount > 1u) {
+			threadPool->ParallelFor(chunkCount, 1u, countChunks);
+		} else {
+			countChunks(0u, chunkCount);
+		}
+
+		// Turn the counts into offsets. Digit major, so the chunks of a digit are in order, which keeps the sort stable
+		uint offset = 0u;
+		bool singleDigit = false;
+		for (uint digit = 0u; digit < kBucketCount; ++digit) {
+			uint digitStart = offset;
+			for (uint chunk = 0u; chunk < chunkCount; ++chunk) {
+				uint &entry = m_chunkHistograms[chunk * kBucketCount + digit];
+				uint digitCount = entry;
+				entry = offset;
+				offset += digitCount;
+			}
+			singleDigit = singleDigit || offset - digitStart == count;
+		}
+		if (singleDigit) {
+			// Every key has the same digit. The pass wouldn't change anything
+			continue;
+		}
+
+		// Scatter
+		auto scatterChunks = [&](uint firstChunk, uint endChunk) {
+			for (uint chunk = firstChunk; chunk < endChunk; ++chunk) {
+				uint *offsets = &m_chunkHistograms[chunk * kBucketCount];
+
+				uint end = std::min((chunk + 1u) * kChunkSize, count);
+				for (uint i = chunk * kChunkSize; i < end; ++i) {
+					uint destination = offsets[(sourceKeys[i] >> shift) & (kBucketCount - 1u)]++;
+					destKeys[destination] = sourceKeys[i];
+					destValues[destination] = sourceValues[i];
+				}
+			}
+		};
+		if (threadPool != nullptr && chunkCount > 1u) {
+			threadPool->ParallelFor(chunkCount, 1u, scatterChunks);
+		} else {
+			scatterChunks(0u, chunkCount);
+		}
+
+		std::swap(sourceKeys, destKeys);
+		std::swap(sourceValues, destValues);
+	}
+
+	// An odd number of passes leaves the result in the scratch memory
+	if (sourceKeys != keys) {
+		memcpy(keys, sourceKeys, count * sizeof(uint32));
+		memcpy(values, sourceValues, count * sizeof(uint32));
+	}
+}
+
+} // End of namespace Common
@@ -0,0 +1,64 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "common/typedefs.h"
+
+#include <vector>
+
+
+namespace Common {
+
+class ThreadPool;
+
+/**
+ * Sorts (key, value) pairs by their key, with an LSD radix sort
+ *
+ * Each pass sorts on 8 bits of the key. The pairs are split into fixed size chunks. Every chunk
+ * counts its digits, the counts are turned into an offset per (digit, chunk), and then every chunk
+ * scatters its pairs to its offsets. The chunks can count and scatter in parallel, and since the
+ * chunks don't depend on the thread count, neither does the result. The sort is stable.
+ *
+ * Passes where every key has the same digit are skipped, so keys that only use their low bits
+ * don't pay for the high ones.
+ *
+ * The scratch memory is kept between sorts, so sorting every frame doesn't allocate.
+ */
+class RadixSorter {
+public:
+	RadixSorter();
+
+	/** The number of key bits sorted by each pass */
+	static const uint kDigitBits = 8u;
+	static const uint kBucketCount = 1u << kDigitBits;
+	/** The number of pairs in each chunk */
+	static const uint kChunkSize = 16384u;
+
+private:
+	std::vector<uint32> m_scratchKeys;
+	std::vector<uint32> m_scratchValues;
+	/** kBucketCount entries per chunk. First the digit counts, then the offsets */
+	std::vector<uint> m_chunkHistograms;
+
+public:
+	/**
+	 * Sorts the pairs, in place
+	 *
+	 * @param keys          The keys
+	 * @param values        The values. values[i] moves with keys[i]
+	 * @param count         The number of pairs
+	 * @param keyBits       [Optional] The number of low bits of the keys to sort on. The rest are ignored
+	 * @param threadPool    [Optional] If not nullptr, the chunks are counted and scattered in parallel
+	 */
+	void SortPairs(uint32 *keys, uint32 *values, uint count, uint keyBits = 32u, ThreadPool *threadPool = nullptr);
+
+private:
+	RadixSorter(const RadixSorter &);               // Not implemented
+	RadixSorter &operator=(const RadixSorter &);    // Not implemented
+};
+
+} // End of namespace Common
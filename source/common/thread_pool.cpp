@@ -0,0 +1,138 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "common/thread_pool.h"
+
+#include <algorithm>
+
+
+namespace Common {
+
+ThreadPool::ThreadPool(uint threadCount)
+		: m_shutdown(false) {
+	if (threadCount == 0u) {
+		uint hardwareThreads = std::thread::hardware_concurrency();
+		threadCount = hardwareThreads > 1u ? hardwareThreads - 1u : 0u;
+	}
+
+	m_threads.reserve(threadCount);
+	for (uint i = 0; i < threadCount; ++i) {
+		m_threads.push_back(std::thread(&ThreadPool::WorkerMain, this));
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_shutdown = true;
+	}
+	m_taskAvailable.notify_all();
+
+	for (auto iter = m_threads.begin(); iter != m_threads.end(); ++iter) {
+		iter->join();
+	}
+}
+
+void ThreadPool::ParallelFor(uint count, uint chunkSize, const std::function<void(uint, uint)> &function) {
+	if (count == 0u) {
+		return;
+	}
+
+	chunkSize = std::max(chunkSize, 1u);
+	uint chunkCount = (count + chunkSize - 1u) / chunkSize;
+
+	// Not worth waking anyone up for. Still one call per chunk, since callers can index per chunk data by begin / chunkSize
+	if (chunkCount == 1u || m_threads.empty()) {
+		for (uint begin = 0u; begin < count; begin += chunkSize) {
+			function(begin, std::min(begin + chunkSize, count));
+		}
+		return;
+	}
+
+	// The helper tasks can still be in the queue after we return, so the job is shared with them
+	std::shared_ptr<ParallelForJob> job = std::make_shared<ParallelForJob>();
+	job->Function = function;
+	job->Count = count;
+	job->ChunkSize = chunkSize;
+	job->ChunkCount = chunkCount;
+	job->NextChunk.store(0u, std::memory_order_relaxed);
+	job->ChunksDone.store(0u, std::memory_order_relaxed);
+
+	uint helperCount = std::min(static_cast<uint>(m_threads.size()), chunkCount - 1u);
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		for (uint i = 0; i < helperCount; ++i) {
+			m_tasks.push_back([job]() {
+				RunChunks(job.get());
+			});
+		}
+	}
+	if (helperCount == 1u) {
+		m_taskAvailable.notify_one();
+	} else {
+		m_taskAvailable.notify_all();
+	}
+
+	RunChunks(job.get());
+
+	// Wait for the chunks the helpers are still running
+	while (job->ChunksDone.load(std::memory_order_acquire) < chunkCount) {
+		std::this_thread::yield();
+	}
+}
+
+void ThreadPool::Enqueue(const std::function<void()> &task) {
+	if (m_threads.empty()) {
+		task();
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_tasks.push_back(task);
+	}
+	m_taskAvailable.notify_one();
+}
+
+void ThreadPool::WorkerMain() {
+	for (;;) {
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(m_lock);
+			while (!m_shutdown && m_tasks.empty()) {
+				m_taskAvailable.wait(lock);
+			}
+			if (m_tasks.empty()) {
+				// Shutting down, and there's nothing left to do
+				return;
+			}
+
+			task = m_tasks.front();
+			m_tasks.pop_front();
+		}
+
+		task();
+	}
+}
+
+uint ThreadPool::RunChunks(ParallelForJob *job) {
+	uint chunksRun = 0u;
+	for (;;) {
+		uint chunk = job->NextChunk.fetch_add(1u, std::memory_order_relaxed);
+		if (chunk >= job->ChunkCount) {
+			return chunksRun;
+		}
+
+		uint begin = chunk * job->ChunkSize;
+		uint end = std::min(begin + job->ChunkSize, job->Count);
+		job->Function(begin, end);
+
+		job->ChunksDone.fetch_add(1u, std::memory_order_release);
+		++chunksRun;
+	}
+}
+
+} // End of namespace Common
@@ -0,0 +1,88 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "common/typedefs.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace Common {
+
+/**
+ * A fixed set of worker threads for data parallel work (culling, transform updates, etc.)
+ * and the odd long running background job (IE. rebuilding an acceleration structure)
+ *
+ * ParallelFor() splits a range into chunks. The workers and the calling thread take chunks
+ * until there are none left, so the call still makes progress if every worker is busy with
+ * a background job.
+ */
+class ThreadPool {
+public:
+	/**
+	 * @param threadCount    The number of worker threads. 0 means one less than the number of hardware threads,
+	 *                       since the thread calling ParallelFor() works as well
+	 */
+	ThreadPool(uint threadCount = 0u);
+	~ThreadPool();
+
+private:
+	struct ParallelForJob {
+		std::function<void(uint, uint)> Function;
+		uint Count;
+		uint ChunkSize;
+		uint ChunkCount;
+		std::atomic<uint> NextChunk;
+		std::atomic<uint> ChunksDone;
+	};
+
+	std::vector<std::thread> m_threads;
+
+	std::mutex m_lock;
+	std::condition_variable m_taskAvailable;
+	std::deque<std::function<void()> > m_tasks;
+	bool m_shutdown;
+
+public:
+	/** Returns the number of worker threads, not counting the calling thread */
+	inline uint GetThreadCount() const { return static_cast<uint>(m_threads.size()); }
+
+	/**
+	 * Calls 'function' for every chunk of [0, count) and waits for all of them to finish.
+	 * Chunks can run in any order, and on any thread, including the calling one
+	 *
+	 * @param count        The size of the range
+	 * @param chunkSize    The number of elements in each chunk. The last chunk may be smaller
+	 * @param function     Called as function(begin, end) for each chunk
+	 */
+	void ParallelFor(uint count, uint chunkSize, const std::function<void(uint, uint)> &function);
+	/**
+	 * Queues a task to run on a worker thread. Returns immediately. The caller is responsible for
+	 * finding out when the task has finished. IE. with an std::atomic flag that the task sets
+	 *
+	 * If the pool has no worker threads, the task is run before Enqueue() returns
+	 */
+	void Enqueue(const std::function<void()> &task);
+
+private:
+	void WorkerMain();
+	/** Runs chunks of the job until there are none left. Returns the number of chunks run */
+	static uint RunChunks(ParallelForJob *job);
+
+	// Not implemented
+	ThreadPool(const ThreadPool &);
+	ThreadPool &operator=(const ThreadPool &);
+};
+
+} // End of namespace Common
@@ -17,8 +17,13 @@ typedef unsigned int uint32;
 typedef signed int int32;
 typedef unsigned int uint;
 
-typedef __int64             int64;
-typedef unsigned __int64    uint64;
+#if defined(_MSC_VER)
+	typedef __int64             int64;
+	typedef unsigned __int64    uint64;
+#else
+	typedef long long           int64;
+	typedef unsigned long long  uint64;
+#endif
 
 typedef wchar_t wchar;
 
@@ -0,0 +1,410 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "common/typedefs.h"
+
+#include "engine/timer.h"
+
+#include "graphics/command_bucket.h"
+#include "graphics/commands.h"
+#include "graphics/constant_ring_buffer.h"
+#include "graphics/instance_stream.h"
+#include "graphics/recording_render_backend.h"
+#include "graphics/sort_key.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+
+// The same layout as PBRDemo::GBufferSortKeyGenerator, without the layer
+typedef Graphics::SortKeyFirstField<8> ShaderField;
+typedef Graphics::SortKeyNextField<ShaderField, 12> MaterialField;
+typedef Graphics::SortKeyNextField<MaterialField, 10> VertexBufferField;
+typedef Graphics::SortKeyNextField<VertexBufferField, 10> IndexBufferField;
+typedef Graphics::SortKeyNextField<IndexBufferField, 10> SubsetField;
+typedef Graphics::SortKeyNextField<SubsetField, 10> DepthField;
+
+static const uint kMaxCommands = 65536u;
+static const uint kSubsetsPerMesh = 4u;
+static const uint kIndicesPerSubset = 300u;
+static const uint kVertexStride = 44u;
+static const uint kInstanceStreamSlot = 1u;
+static const uint kInstanceOffsetSlot = 1u;
+
+typedef Graphics::CommandBucket<uint64, kMaxCommands> Bucket;
+
+struct BenchmarkSettings {
+	BenchmarkSettings()
+		: Draws(20000u),
+		  Meshes(100u),
+		  Materials(16u),
+		  Shaders(4u),
+		  PlainDraws(10u),
+		  Frames(10u) {
+	}
+
+	uint Draws;
+	uint Meshes;
+	uint Materials;
+	uint Shaders;
+	/** The percentage of the draws that are plain DrawIndexed commands, which break up the runs */
+	uint PlainDraws;
+	uint Frames;
+};
+
+/** A generated draw. Everything but the object index and the depth follows from the prefix of the key */
+struct GeneratedDraw {
+	uint64 Key;
+	bool Instanceable;
+	Graphics::MaterialShader *Shader;
+	ID3D11Buffer *VertexBuffer;
+	ID3D11Buffer *IndexBuffer;
+	ID3D11ShaderResourceView *Texture;
+	uint IndexStart;
+};
+
+struct ConfigResult {
+	uint Commands;
+	uint ExpectedDraws;
+	uint ExpectedMerged;
+	/** The counts of the last frame */
+	uint Draws;
+	uint Merged;
+	uint64 Instances;
+	/** The number of frames with the wrong counts */
+	uint WrongCountFrames;
+	uint WrongInstances;
+	uint MissingInstances;
+	double SubmitMilliseconds;
+};
+
+/**
+ * A RecordingRenderBackend that follows the instance stream and the instance offset of every instanced draw.
+ * It reads the object indices the draw would fetch, and checks that each of them is a draw with the same
+ * state as the one that's bound
+ */
+class MergeCheckingBackend : public Graphics::RecordingRenderBackend {
+public:
+	MergeCheckingBackend(bool supportsOffsets, const std::vector<GeneratedDraw> &draws)
+		: RecordingRenderBackend(supportsOffsets, supportsOffsets),
+		  m_draws(draws),
+		  m_instanceStream(nullptr),
+		  m_instanceOffset(nullptr),
+		  m_vertexBuffer(nullptr),
+		  m_shader(nullptr),
+		  m_wrongInstances(0u) {
+	}
+
+private:
+	const std::vector<GeneratedDraw> &m_draws;
+
+	std::unordered_map<ID3D11ShaderResourceView *, ID3D11Buffer *> m_shaderResourceBuffers;
+	const uint *m_instanceStream;
+	const uint *m_instanceOffset;
+	ID3D11Buffer *m_vertexBuffer;
+	Graphics::MaterialShader *m_shader;
+
+	/** The number of times each object was drawn this frame */
+	std::vector<uint> m_drawCounts;
+	uint m_wrongInstances;
+
+public:
+	void BeginFrame() {
+		m_drawCounts.assign(m_draws.size(), 0u);
+		m_wrongInstances = 0u;
+	}
+	/** Returns the number of instances that fetched an object with different state, or an object that isn't instanceable */
+	inline uint GetWrongInstanceCount() const { return m_wrongInstances; }
+	/** Returns the number of instanceable objects that weren't drawn exactly once */
+	uint GetMissingInstanceCount() const {
+		uint missing = 0u;
+		for (uint i = 0; i < m_draws.size(); ++i) {
+			missing += m_draws[i].Instanceable && m_drawCounts[i] != 1u ? 1u : 0u;
+		}
+
+		return missing;
+	}
+
+	ID3D11ShaderResourceView *CreateBufferShaderResource(ID3D11Buffer *buffer) {
+		ID3D11ShaderResourceView *shaderResource = RecordingRenderBackend::CreateBufferShaderResource(buffer);
+		m_shaderResourceBuffers[shaderResource] = buffer;
+		return shaderResource;
+	}
+	void ReleaseShaderResource(ID3D11ShaderResourceView *shaderResource) {
+		m_shaderResourceBuffers.erase(shaderResource);
+		RecordingRenderBackend::ReleaseShaderResource(shaderResource);
+	}
+
+	void SetMaterialShader(Graphics::MaterialShader *shader) {
+		RecordingRenderBackend::SetMaterialShader(shader);
+		m_shader = shader;
+	}
+	void SetVertexBuffers(uint startSlot, uint count, ID3D11Buffer * const *buffers, const uint *strides, const uint *offsets) {
+		RecordingRenderBackend::SetVertexBuffers(startSlot, count, buffers, strides, offsets);
+		m_vertexBuffer = buffers[0];
+	}
+	void SetVSShaderResources(uint startSlot, uint count, ID3D11ShaderResourceView * const *srvs) {
+		RecordingRenderBackend::SetVSShaderResources(startSlot, count, srvs);
+		if (startSlot == kInstanceStreamSlot) {
+			m_instanceStream = reinterpret_cast<const uint *>(GetBufferData(m_shaderResourceBuffers[srvs[0]]));
+		}
+	}
+	void SetVSConstantBuffers(uint startSlot, uint count, ID3D11Buffer * const *buffers) {
+		RecordingRenderBackend::SetVSConstantBuffers(startSlot, count, buffers);
+		if (startSlot == kInstanceOffsetSlot) {
+			m_instanceOffset = reinterpret_cast<const uint *>(GetBufferData(buffers[0]));
+		}
+	}
+	void SetVSConstantBufferRanges(uint startSlot, uint count, ID3D11Buffer * const *buffers, const uint *firstConstants, const uint *numConstants) {
+		RecordingRenderBackend::SetVSConstantBufferRanges(startSlot, count, buffers, firstConstants, numConstants);
+		if (startSlot == kInstanceOffsetSlot) {
+			m_instanceOffset = reinterpret_cast<const uint *>(GetBufferData(buffers[0]) + firstConstants[0] * 16u);
+		}
+	}
+
+	void DrawIndexedInstanced(uint indexCountPerInstance, uint instanceCount, uint indexStart, int vertexStart, uint instanceStart) {
+		RecordingRenderBackend::DrawIndexedInstanced(indexCountPerInstance, instanceCount, indexStart, vertexStart, instanceStart);
+
+		// The shader adds the instance offset to SV_InstanceID, and fetches the object index from the stream
+		const uint *objects = m_instanceStream + m_instanceOffset[0] + instanceStart;
+		for (uint i = 0; i < instanceCount; ++i) {
+			uint object = objects[i];
+			if (object >= m_draws.size()) {
+				++m_wrongInstances;
+				continue;
+			}
+
+			const GeneratedDraw &draw = m_draws[object];
+			if (!draw.Instanceable || draw.Shader != m_shader || draw.VertexBuffer != m_vertexBuffer || draw.IndexStart != indexStart) {
+				++m_wrongInstances;
+			}
+			++m_drawCounts[object];
+		}
+	}
+
+private:
+	// Not implemented
+	MergeCheckingBackend(const MergeCheckingBackend &other);
+};
+
+void PrintUsage() {
+	printf("Usage: DrawMergeBenchmark [-draws <count>] [-meshes <count>] [-materials <count>] [-shaders <count>] [-plain <percent>] [-frames <count>]\n\n"
+	       "    Submits DrawIndexedInstanceable commands, mixed with plain DrawIndexed commands, through a CommandBucket\n"
+	       "    and checks how many draws the merge pass saves against a count of the runs in the sorted keys.\n");
+}
+
+/** Returns the part of a key that decides the state of a draw. IE. everything but the depth */
+inline uint64 GetStatePrefix(uint64 key) {
+	return key & ~DepthField::kMask;
+}
+
+/**
+ * Counts the draws the bucket should issue, and how many draws merging should save. Works from the sorted
+ * keys alone: every run of instanceable draws with the same state prefix is one draw
+ */
+void CountExpectedDraws(const std::vector<GeneratedDraw> &draws, uint *out_draws, uint *out_merged) {
+	std::vector<std::pair<uint64, bool> > keys(draws.size());
+	for (uint i = 0; i < draws.size(); ++i) {
+		keys[i] = std::make_pair(draws[i].Key, draws[i].Instanceable);
+	}
+	std::sort(keys.begin(), keys.end());
+
+	*out_draws = 0u;
+	*out_merged = 0u;
+	for (uint i = 0; i < keys.size(); ++i) {
+		bool continuesRun = i > 0u && keys[i].second && keys[i - 1u].second && GetStatePrefix(keys[i].first) == GetStatePrefix(keys[i - 1u].first);
+		if (continuesRun) {
+			++*out_merged;
+		} else {
+			++*out_draws;
+		}
+	}
+}
+
+/**
+ * Submits the draws every frame, with and without constant buffer offsets
+ *
+ * @param draws             The draws
+ * @param supportsOffsets   What the backend reports for constant buffer offsets and NO_OVERWRITE maps of shader resource buffers
+ * @param frames            The number of frames to submit
+ */
+ConfigResult RunConfig(const std::vector<GeneratedDraw> &draws, bool supportsOffsets, uint frames) {
+	MergeCheckingBackend backend(supportsOffsets, draws);
+	Bucket *bucket = new Bucket(64u * 1024u);
+	Graphics::InstanceStream instanceStream(&backend, sizeof(uint));
+	// Each merged draw takes a 256 byte window of the ring
+	Graphics::ConstantRingBuffer instanceOffsetRing(&backend, kMaxCommands * 256u);
+	bucket->SetInstanceStream(&instanceStream, kInstanceStreamSlot, &instanceOffsetRing);
+
+	ConfigResult result;
+	result.Commands = static_cast<uint>(draws.size());
+	CountExpectedDraws(draws, &result.ExpectedDraws, &result.ExpectedMerged);
+	result.WrongCountFrames = 0u;
+	result.WrongInstances = 0u;
+	result.MissingInstances = 0u;
+	result.SubmitMilliseconds = 0.0;
+
+	Engine::Timer timer;
+	for (uint frame = 0; frame < frames; ++frame) {
+		for (uint i = 0; i < draws.size(); ++i) {
+			const GeneratedDraw &draw = draws[i];
+
+			if (draw.Instanceable) {
+				auto command = bucket->AddCommand<Graphics::Commands::DrawIndexedInstanceable>(draw.Key);
+				command->SetMaterialShader(draw.Shader);
+				command->SetVertexBuffer(draw.VertexBuffer, kVertexStride);
+				command->SetIndexBuffer(draw.IndexBuffer, DXGI_FORMAT_R32_UINT);
+				command->SetTextureSRV(draw.Texture, 0u);
+				command->SetIndexCount(kIndicesPerSubset);
+				command->SetIndexStart(draw.IndexStart);
+				command->SetInstanceOffsetSlot(kInstanceOffsetSlot);
+				command->SetObjectIndex(i);
+			} else {
+				auto command = bucket->AddCommand<Graphics::Commands::DrawIndexed>(draw.Key);
+				command->SetMaterialShader(draw.Shader);
+				command->SetVertexBuffer(draw.VertexBuffer, kVertexStride);
+				command->SetIndexBuffer(draw.IndexBuffer, DXGI_FORMAT_R32_UINT);
+				command->SetTextureSRV(draw.Texture, 0u);
+				command->SetIndexCount(kIndicesPerSubset);
+				command->SetIndexStart(draw.IndexStart);
+			}
+		}
+
+		Graphics::GraphicsState state;
+		backend.ResetStats();
+		backend.BeginFrame();
+
+		timer.Start();
+		instanceStream.BeginFrame();
+		bucket->Submit(&backend, &state);
+		instanceStream.EndFrame();
+		result.SubmitMilliseconds += timer.GetTime();
+
+		bucket->Clear();
+
+		const Graphics::RenderBackendStats &stats = backend.GetStats();
+		result.Draws = stats.DrawCalls;
+		result.Merged = bucket->GetMergedDrawCount();
+		result.Instances = stats.InstancesSubmitted;
+		if (result.Draws != result.ExpectedDraws || result.Merged != result.ExpectedMerged) {
+			++result.WrongCountFrames;
+		}
+		result.WrongInstances = std::max(result.WrongInstances, backend.GetWrongInstanceCount());
+		result.MissingInstances = std::max(result.MissingInstances, backend.GetMissingInstanceCount());
+	}
+
+	delete bucket;
+
+	result.SubmitMilliseconds /= frames;
+	return result;
+}
+
+void PrintRow(const char *label, const ConfigResult &result) {
+	printf("  %-18s %10u %10u %10u %10u %10u %14.1f\n", label, result.Commands, result.Draws, result.ExpectedDraws, result.Merged, result.ExpectedMerged,
+	       result.SubmitMilliseconds * 1.0e6 / std::max(result.Commands, 1u));
+}
+
+/**
+ * A headless benchmark of the draw merging of CommandBucket. Exits with 1 if a frame merges more or fewer
+ * draws than there are in the runs of the sorted keys, if an instanced draw fetches an object with different
+ * state, or if an object isn't drawn exactly once
+ */
+int main(int argc, char *argv[]) {
+	BenchmarkSettings settings;
+
+	for (int i = 1; i < argc; ++i) {
+		if (i + 1 >= argc) {
+			PrintUsage();
+			return 1;
+		}
+
+		uint value = static_cast<uint>(atoi(argv[i + 1]));
+		if (strcmp(argv[i], "-draws") == 0) {
+			settings.Draws = value;
+		} else if (strcmp(argv[i], "-meshes") == 0) {
+			settings.Meshes = value;
+		} else if (strcmp(argv[i], "-materials") == 0) {
+			settings.Materials = value;
+		} else if (strcmp(argv[i], "-shaders") == 0) {
+			settings.Shaders = value;
+		} else if (strcmp(argv[i], "-plain") == 0) {
+			settings.PlainDraws = value;
+		} else if (strcmp(argv[i], "-frames") == 0) {
+			settings.Frames = value;
+		} else {
+			PrintUsage();
+			return 1;
+		}
+		++i;
+	}
+
+	// The sort key fields limit the shaders, materials and meshes, and the bucket the draws
+	if (settings.Draws == 0u || settings.Draws > kMaxCommands || settings.Meshes == 0u || settings.Meshes > 1024u || settings.Materials == 0u || settings.Materials > 4096u ||
+	    settings.Shaders == 0u || settings.Shaders > 256u || settings.PlainDraws > 100u || settings.Frames == 0u) {
+		printf("Settings out of range. Draws must be in [1, %u], meshes in [1, 1024], materials in [1, 4096], shaders in [1, 256], plain in [0, 100], and frames at least 1\n\n", kMaxCommands);
+		PrintUsage();
+		return 1;
+	}
+
+	std::mt19937 random(1337u);
+	std::uniform_int_distribution<uint> meshDistribution(0u, settings.Meshes - 1u);
+	std::uniform_int_distribution<uint> subsetDistribution(0u, kSubsetsPerMesh - 1u);
+	std::uniform_int_distribution<uint> materialDistribution(0u, settings.Materials - 1u);
+	std::uniform_int_distribution<uint> percentDistribution(0u, 99u);
+	std::uniform_int_distribution<uint> depthDistribution(0u, static_cast<uint>(DepthField::kMaxValue / 2u));
+
+	// Nothing is ever dereferenced by the backend, so fake handles are enough
+	std::vector<GeneratedDraw> draws(settings.Draws);
+	for (uint i = 0; i < settings.Draws; ++i) {
+		GeneratedDraw &draw = draws[i];
+		uint mesh = meshDistribution(random);
+		uint subset = subsetDistribution(random);
+		uint material = materialDistribution(random);
+		uint shader = material % settings.Shaders;
+		draw.Instanceable = percentDistribution(random) >= settings.PlainDraws;
+
+		draw.Shader = reinterpret_cast<Graphics::MaterialShader *>(static_cast<uintptr_t>(16u + shader * 16u));
+		draw.VertexBuffer = reinterpret_cast<ID3D11Buffer *>(static_cast<uintptr_t>(0x100000u + mesh * 32u));
+		draw.IndexBuffer = reinterpret_cast<ID3D11Buffer *>(static_cast<uintptr_t>(0x100000u + mesh * 32u + 16u));
+		draw.Texture = reinterpret_cast<ID3D11ShaderResourceView *>(static_cast<uintptr_t>(0x10000u + material * 16u));
+		draw.IndexStart = subset * kIndicesPerSubset;
+
+		// Instanceable draws get even depths and plain ones odd, so a plain draw never ties with an instanceable one.
+		// The order of the two types is then fixed, and so are the runs
+		uint depth = depthDistribution(random) * 2u + (draw.Instanceable ? 0u : 1u);
+		draw.Key = ShaderField::Encode(shader) | MaterialField::Encode(material) | VertexBufferField::Encode(mesh) | IndexBufferField::Encode(mesh) |
+		           SubsetField::Encode(subset) | DepthField::Encode(depth);
+	}
+
+	ConfigResult offsetsResult = RunConfig(draws, true, settings.Frames);
+	ConfigResult fallbackResult = RunConfig(draws, false, settings.Frames);
+
+	printf("Scene: %u draws (%u%% plain), %u meshes with %u subsets, %u materials, %u shaders. Average over %u frames\n\n",
+	       settings.Draws, settings.PlainDraws, settings.Meshes, kSubsetsPerMesh, settings.Materials, settings.Shaders, settings.Frames);
+	printf("  %-18s %10s %10s %10s %10s %10s %14s\n", "", "Commands", "Draws", "Expected", "Merged", "Expected", "Submit (ns)");
+	PrintRow("Constant offsets", offsetsResult);
+	PrintRow("Discard fallback", fallbackResult);
+	printf("\n  Submit: Sorting, merging and executing the commands on a RecordingRenderBackend, per command\n");
+
+	uint wrongCountFrames = offsetsResult.WrongCountFrames + fallbackResult.WrongCountFrames;
+	uint wrongInstances = offsetsResult.WrongInstances + fallbackResult.WrongInstances;
+	uint missingInstances = offsetsResult.MissingInstances + fallbackResult.MissingInstances;
+	if (wrongCountFrames > 0u) {
+		printf("\nFAILED: %u frames issued a different number of draws, or merged a different number, than expected\n", wrongCountFrames);
+		return 1;
+	}
+	if (wrongInstances > 0u || missingInstances > 0u) {
+		printf("\nFAILED: %u instances fetched an object with the wrong state, and %u objects weren't drawn exactly once\n", wrongInstances, missingInstances);
+		return 1;
+	}
+
+	return 0;
+}
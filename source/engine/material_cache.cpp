@@ -6,14 +6,31 @@
 
 #include "engine/material_cache.h"
 
+#include "common/dense_id_generator.h"
+
 
 namespace Engine {
 
+MaterialCache::~MaterialCache() {
+	for (auto iter = m_materialCache.begin(); iter != m_materialCache.end(); ++iter) {
+		Common::DenseIdGenerator<Scene::Material>::Release(iter->Id);
+	}
+}
+
 const Scene::Material *MaterialCache::getMaterial(Graphics::MaterialShader *shader, std::vector<ID3D11ShaderResourceView *> &textureSRVs, std::vector<ID3D11SamplerState *> &textureSamplers) {
 	// Lock the cache
 	std::lock_guard<std::mutex> guard(m_cacheLock);
 
-	return &(*(m_materialCache.emplace(shader, textureSRVs, textureSamplers).first));
+	Scene::Material material(shader, textureSRVs, textureSamplers);
+
+	auto iter = m_materialCache.find(material);
+	if (iter != m_materialCache.end()) {
+		return &(*iter);
+	}
+
+	// Only new materials get an id, so the ids stay dense
+	material.Id = Common::DenseIdGenerator<Scene::Material>::Next();
+	return &(*(m_materialCache.insert(std::move(material)).first));
 
 	// The mutex will unlock when 'guard' goes out of scope and destructs
 }
@@ -20,6 +20,8 @@ private:
 	std::mutex m_cacheLock;
 
 public:
+	~MaterialCache();
+
 	const Scene::Material *getMaterial(Graphics::MaterialShader *shader, std::vector<ID3D11ShaderResourceView *> &textureSRVs, std::vector<ID3D11SamplerState *> &textureSamplers);
 };
 
@@ -8,29 +8,53 @@
 
 #include "common/halfling_sys.h"
 
+#if !defined(_WIN32)
+	#include <chrono>
+#endif
+
 
 namespace Engine {
 
+// The headless builds don't have QueryPerformanceCounter(), so they count the nanoseconds of the steady clock instead
+static inline int64 GetPerformanceFrequency() {
+	#if defined(_WIN32)
+		int64 frequency;
+		QueryPerformanceFrequency((LARGE_INTEGER *)&frequency);
+		return frequency;
+	#else
+		return 1000000000ll;
+	#endif
+}
+
+static inline int64 GetPerformanceCount() {
+	#if defined(_WIN32)
+		int64 count;
+		QueryPerformanceCounter((LARGE_INTEGER *)&count);
+		return count;
+	#else
+		return static_cast<int64>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+	#endif
+}
+
 Timer::Timer(int64 performanceCounterFreq) 
 		: m_milliSecondsPerCount(0.0),
 		  m_accumulatedTicks(0),
 		  m_startCount(0),
 		  m_isRunning(false) {
 	if (performanceCounterFreq == 0) {
-		QueryPerformanceFrequency((LARGE_INTEGER *)&performanceCounterFreq);
+		performanceCounterFreq = GetPerformanceFrequency();
 	}
 	m_milliSecondsPerCount = 1000.0 / (double)performanceCounterFreq;
 }
 
 void Timer::Start() {
-	QueryPerformanceCounter((LARGE_INTEGER *)&m_startCount);
+	m_startCount = GetPerformanceCount();
 
 	m_isRunning = true;
 }
 
 void Timer::Stop() {
-	int64 currCount;
-	QueryPerformanceCounter((LARGE_INTEGER *)&currCount);
+	int64 currCount = GetPerformanceCount();
 
 	m_accumulatedTicks = currCount - m_startCount;
 
@@ -42,8 +66,7 @@ double Timer::GetTime() {
 		return (double)m_accumulatedTicks * m_milliSecondsPerCount;
 	}
 
-	int64 currCount;
-	QueryPerformanceCounter((LARGE_INTEGER *)&currCount);
+	int64 currCount = GetPerformanceCount();
 
 	return (double)(currCount - m_startCount) * m_milliSecondsPerCount;
 
@@ -0,0 +1,301 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "common/typedefs.h"
+#include "common/frame_allocator.h"
+#include "common/thread_pool.h"
+
+#include "engine/timer.h"
+
+#include <malloc.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+
+/** The number of allocations each ParallelFor() chunk makes */
+static const uint kChunkSize = 256u;
+/** One in this many allocations is bigger than a page */
+static const uint kOversizedInterval = 1000u;
+
+struct BenchmarkSettings {
+	BenchmarkSettings()
+		: Allocations(100000u),
+		  PageSize(64u),
+		  Frames(50u),
+		  Threads(0u) {
+	}
+
+	uint Allocations;
+	/** In KB */
+	uint PageSize;
+	uint Frames;
+	/** The number of worker threads for the parallel runs. 0 means one less than the number of hardware threads */
+	uint Threads;
+};
+
+/** One allocation of a frame. Every frame makes the same ones, in the same order */
+struct Request {
+	uint Size;
+	uint Alignment;
+};
+
+struct CheckResult {
+	uint Misaligned;
+	uint Overwritten;
+	uint Pages;
+	uint OversizedBlocks;
+	/** The pages after the first frame. A frame that repeats the last one's allocations shouldn't need any more */
+	uint FirstFramePages;
+	uint FirstFrameOversizedBlocks;
+};
+
+void PrintUsage() {
+	printf("Usage: FrameAllocatorBenchmark [-allocations <count>] [-pagesize <KB>] [-frames <count>] [-threads <count>]\n\n"
+	       "    -allocations    The number of allocations per frame. Defaults to 100000\n"
+	       "    -pagesize       The page size of the allocator, in KB. Defaults to 64\n"
+	       "    -frames         The number of frames to run. Defaults to 50\n"
+	       "    -threads        The number of worker threads for the parallel runs. Defaults to one less than the number of hardware threads\n");
+}
+
+/** Mostly small allocations with mixed alignments, the way command packets and visible lists look, and the odd one bigger than a page */
+void CreateRequests(uint count, size_t pageSize, std::vector<Request> *out_requests) {
+	std::mt19937 generator(1234u);
+	std::uniform_int_distribution<uint> smallSize(1u, 256u);
+	std::uniform_int_distribution<uint> alignmentShift(2u, 8u);
+	std::uniform_int_distribution<uint> oversizedSize(static_cast<uint>(pageSize) + 1u, static_cast<uint>(pageSize) * 4u);
+
+	out_requests->resize(count);
+	for (uint i = 0; i < count; ++i) {
+		Request &request = (*out_requests)[i];
+		request.Alignment = 1u << alignmentShift(generator);
+		request.Size = (i % kOversizedInterval) == kOversizedInterval - 1u ? oversizedSize(generator) : smallSize(generator);
+	}
+}
+
+/** The byte that allocation i is filled with */
+inline byte GetTag(uint i) {
+	return static_cast<byte>((i * 2654435761u) >> 24u);
+}
+
+/** Makes allocations [begin, end), checks their alignment, and fills them with their tags */
+uint AllocateRange(Common::FrameAllocator *allocator, const std::vector<Request> &requests, uint begin, uint end, std::vector<byte *> *out_blocks) {
+	uint misaligned = 0u;
+	for (uint i = begin; i < end; ++i) {
+		byte *block = static_cast<byte *>(allocator->Allocate(requests[i].Size, requests[i].Alignment));
+		misaligned += (reinterpret_cast<size_t>(block) & (requests[i].Alignment - 1u)) != 0u ? 1u : 0u;
+
+		memset(block, GetTag(i), requests[i].Size);
+		(*out_blocks)[i] = block;
+	}
+
+	return misaligned;
+}
+
+/** Returns the number of allocations that don't hold their tag any more, IE. another allocation overlapped them */
+uint CountOverwritten(const std::vector<Request> &requests, const std::vector<byte *> &blocks) {
+	uint overwritten = 0u;
+	for (uint i = 0; i < requests.size(); ++i) {
+		byte tag = GetTag(i);
+		for (uint j = 0; j < requests[i].Size; ++j) {
+			if (blocks[i][j] != tag) {
+				++overwritten;
+				break;
+			}
+		}
+	}
+
+	return overwritten;
+}
+
+/**
+ * Runs the frames, checking every allocation. Without a thread pool, the frames are made on the calling
+ * thread. With one, the chunks of a frame are spread over the workers, so the allocations of a frame
+ * come from several arenas at once, and are checked on the calling thread afterwards
+ */
+CheckResult RunChecks(const std::vector<Request> &requests, const BenchmarkSettings &settings, Common::ThreadPool *threadPool) {
+	Common::FrameAllocator allocator(settings.PageSize * 1024u);
+	std::vector<byte *> blocks(requests.size());
+	uint requestCount = static_cast<uint>(requests.size());
+
+	CheckResult result;
+	memset(&result, 0, sizeof(CheckResult));
+
+	for (uint frame = 0; frame < settings.Frames; ++frame) {
+		if (threadPool == nullptr) {
+			result.Misaligned += AllocateRange(&allocator, requests, 0u, requestCount, &blocks);
+		} else {
+			std::vector<uint> chunkMisaligned((requestCount + kChunkSize - 1u) / kChunkSize, 0u);
+			threadPool->ParallelFor(requestCount, kChunkSize, [&](uint begin, uint end) {
+				chunkMisaligned[begin / kChunkSize] = AllocateRange(&allocator, requests, begin, end, &blocks);
+			});
+			for (auto iter = chunkMisaligned.begin(); iter != chunkMisaligned.end(); ++iter) {
+				result.Misaligned += *iter;
+			}
+		}
+
+		result.Overwritten += CountOverwritten(requests, blocks);
+		allocator.Reset();
+
+		if (frame == 0u) {
+			result.FirstFramePages = allocator.GetTotalPageCount();
+			result.FirstFrameOversizedBlocks = allocator.GetTotalOversizedBlockCount();
+		}
+	}
+
+	result.Pages = allocator.GetTotalPageCount();
+	result.OversizedBlocks = allocator.GetTotalOversizedBlockCount();
+
+	return result;
+}
+
+/** Returns the average milliseconds per frame of making the allocations with a FrameAllocator, and freeing them with Reset() */
+double TimeFrameAllocator(const std::vector<Request> &requests, const BenchmarkSettings &settings, Common::ThreadPool *threadPool) {
+	Common::FrameAllocator allocator(settings.PageSize * 1024u);
+	uint requestCount = static_cast<uint>(requests.size());
+
+	auto allocateRange = [&](uint begin, uint end) {
+		for (uint i = begin; i < end; ++i) {
+			byte *block = static_cast<byte *>(allocator.Allocate(requests[i].Size, requests[i].Alignment));
+			block[0] = static_cast<byte>(i);
+		}
+	};
+
+	// Warm up the pages, so the timing is of the steady state
+	allocateRange(0u, requestCount);
+	allocator.Reset();
+
+	Engine::Timer timer;
+	timer.Start();
+	for (uint frame = 0; frame < settings.Frames; ++frame) {
+		if (threadPool == nullptr) {
+			allocateRange(0u, requestCount);
+		} else {
+			threadPool->ParallelFor(requestCount, kChunkSize, allocateRange);
+		}
+		allocator.Reset();
+	}
+
+	return timer.GetTime() / settings.Frames;
+}
+
+/** The same as TimeFrameAllocator(), with an _aligned_malloc() and _aligned_free() per allocation */
+double TimeMalloc(const std::vector<Request> &requests, const BenchmarkSettings &settings, Common::ThreadPool *threadPool) {
+	std::vector<byte *> blocks(requests.size());
+	uint requestCount = static_cast<uint>(requests.size());
+
+	auto allocateRange = [&](uint begin, uint end) {
+		for (uint i = begin; i < end; ++i) {
+			blocks[i] = static_cast<byte *>(_aligned_malloc(requests[i].Size, requests[i].Alignment));
+			blocks[i][0] = static_cast<byte>(i);
+		}
+	};
+	auto freeRange = [&](uint begin, uint end) {
+		for (uint i = begin; i < end; ++i) {
+			_aligned_free(blocks[i]);
+		}
+	};
+
+	Engine::Timer timer;
+	timer.Start();
+	for (uint frame = 0; frame < settings.Frames; ++frame) {
+		if (threadPool == nullptr) {
+			allocateRange(0u, requestCount);
+			freeRange(0u, requestCount);
+		} else {
+			threadPool->ParallelFor(requestCount, kChunkSize, allocateRange);
+			threadPool->ParallelFor(requestCount, kChunkSize, freeRange);
+		}
+	}
+
+	return timer.GetTime() / settings.Frames;
+}
+
+/**
+ * A headless benchmark and self-check of Common::FrameAllocator. Every frame makes the same mix of small
+ * allocations with alignments from 4 to 256 bytes, and the odd one bigger than a page, from one thread and
+ * from the thread pool. Each allocation is filled with its own tag and checked at the end of the frame.
+ * Then the same frames are timed against _aligned_malloc() / _aligned_free(). Exits with 1 if an allocation
+ * is misaligned or overlaps another one, if the frames after the first one need new pages or blocks on one
+ * thread, or if the pool's page count grows with the number of frames, IE. pages aren't recycled
+ */
+int main(int argc, char *argv[]) {
+	BenchmarkSettings settings;
+
+	for (int i = 1; i < argc; ++i) {
+		if (i + 1 >= argc) {
+			PrintUsage();
+			return 1;
+		}
+
+		uint value = static_cast<uint>(atoi(argv[i + 1]));
+		if (strcmp(argv[i], "-allocations") == 0) {
+			settings.Allocations = value;
+		} else if (strcmp(argv[i], "-pagesize") == 0) {
+			settings.PageSize = value;
+		} else if (strcmp(argv[i], "-frames") == 0) {
+			settings.Frames = value;
+		} else if (strcmp(argv[i], "-threads") == 0) {
+			settings.Threads = value;
+		} else {
+			PrintUsage();
+			return 1;
+		}
+		++i;
+	}
+
+	if (settings.Allocations == 0u || settings.PageSize == 0u || settings.Frames < 2u) {
+		printf("Settings out of range. Allocations and page size must be at least 1, and frames at least 2\n\n");
+		PrintUsage();
+		return 1;
+	}
+
+	std::vector<Request> requests;
+	CreateRequests(settings.Allocations, settings.PageSize * 1024u, &requests);
+
+	Common::ThreadPool threadPool(settings.Threads);
+
+	printf("%u allocations per frame, 1 in %u bigger than a page. %u KB pages. %u frames, %u worker threads\n\n",
+	       settings.Allocations, kOversizedInterval, settings.PageSize, settings.Frames, threadPool.GetThreadCount());
+
+	CheckResult serial = RunChecks(requests, settings, nullptr);
+	CheckResult parallel = RunChecks(requests, settings, &threadPool);
+
+	double serialMilliseconds = TimeFrameAllocator(requests, settings, nullptr);
+	double parallelMilliseconds = TimeFrameAllocator(requests, settings, &threadPool);
+	double serialMallocMilliseconds = TimeMalloc(requests, settings, nullptr);
+	double parallelMallocMilliseconds = TimeMalloc(requests, settings, &threadPool);
+
+	printf("              FrameAllocator (ms)    _aligned_malloc (ms)    Speedup    Pages (first frame / last)    Oversized blocks (first frame / last)\n");
+	printf("  1 thread %18.3f %23.3f %10.1fx %14u / %-14u %18u / %u\n", serialMilliseconds, serialMallocMilliseconds, serialMallocMilliseconds / serialMilliseconds,
+	       serial.FirstFramePages, serial.Pages, serial.FirstFrameOversizedBlocks, serial.OversizedBlocks);
+	printf("  Pool     %18.3f %23.3f %10.1fx %14u / %-14u %18u / %u\n", parallelMilliseconds, parallelMallocMilliseconds, parallelMallocMilliseconds / parallelMilliseconds,
+	       parallel.FirstFramePages, parallel.Pages, parallel.FirstFrameOversizedBlocks, parallel.OversizedBlocks);
+	printf("\n  %u misaligned and %u overwritten allocations\n", serial.Misaligned + parallel.Misaligned, serial.Overwritten + parallel.Overwritten);
+
+	if (serial.Misaligned + parallel.Misaligned != 0u || serial.Overwritten + parallel.Overwritten != 0u) {
+		printf("\nFAILED: Allocations are misaligned, or overlap\n");
+		return 1;
+	}
+	if (serial.Pages != serial.FirstFramePages || serial.OversizedBlocks != serial.FirstFrameOversizedBlocks) {
+		printf("\nFAILED: Repeating the first frame's allocations on one thread needed more memory\n");
+		return 1;
+	}
+
+	// Which thread gets which chunk changes every frame, so each arena can waste a little more or less of
+	// its last page. Without recycling, the pool would need new pages for every frame
+	uint arenaCount = threadPool.GetThreadCount() + 1u;
+	if (parallel.Pages > serial.Pages * 2u + arenaCount || parallel.OversizedBlocks > serial.OversizedBlocks * 2u) {
+		printf("\nFAILED: The pool's memory grew with the number of frames\n");
+		return 1;
+	}
+
+	return 0;
+}
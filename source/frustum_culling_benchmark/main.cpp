@@ -0,0 +1,240 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "common/typedefs.h"
+#include "common/thread_pool.h"
+
+#include "engine/timer.h"
+
+#include "scene/frustum_culler.h"
+
+#include <DirectXMath.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+
+static const uint kDefaultBoxCounts[] = {10000u, 100000u, 1000000u};
+static const Scene::CullingPath kPaths[] = {Scene::CullingPath::SCALAR, Scene::CullingPath::SSE, Scene::CullingPath::AVX};
+
+struct BenchmarkSettings {
+	BenchmarkSettings()
+		: Frames(50u),
+		  Threads(0u) {
+	}
+
+	std::vector<uint> BoxCounts;
+	uint Frames;
+	/** The number of worker threads for the parallel runs. 0 means one less than the number of hardware threads */
+	uint Threads;
+};
+
+struct Box {
+	DirectX::XMFLOAT3 Min;
+	DirectX::XMFLOAT3 Max;
+};
+
+void PrintUsage() {
+	printf("Usage: FrustumCullingBenchmark [-boxes <count>] [-frames <count>] [-threads <count>]\n\n"
+	       "    -boxes      The number of boxes. Can be given more than once. Defaults to 10000, 100000 and 1000000\n"
+	       "    -frames     The number of frames to average over. The camera turns a little every frame. Defaults to 50\n"
+	       "    -threads    The number of worker threads for the parallel runs. Defaults to one less than the number of hardware threads\n");
+}
+
+/**
+ * A model-sized box somewhere in a 2000 unit cube. A few of them are huge, like the terrain
+ * or the building of a real scene
+ */
+Box RandomBox(std::mt19937 &generator) {
+	std::uniform_real_distribution<float> position(-1000.0f, 1000.0f);
+	std::uniform_real_distribution<float> size(0.5f, 20.0f);
+	std::uniform_int_distribution<uint> huge(0u, 999u);
+
+	float scale = huge(generator) == 0u ? 50.0f : 1.0f;
+	DirectX::XMFLOAT3 center(position(generator), position(generator), position(generator));
+	DirectX::XMFLOAT3 extent(size(generator) * scale, size(generator) * scale, size(generator) * scale);
+
+	Box box;
+	box.Min = DirectX::XMFLOAT3(center.x - extent.x, center.y - extent.y, center.z - extent.z);
+	box.Max = DirectX::XMFLOAT3(center.x + extent.x, center.y + extent.y, center.z + extent.z);
+	return box;
+}
+
+/** The camera of a frame. It sits in the middle of the boxes and turns around the y axis */
+Scene::Frustum FrameFrustum(uint frame) {
+	float angle = frame * 0.05f;
+	DirectX::XMMATRIX view = DirectX::XMMatrixLookToLH(DirectX::XMVectorSet(0.0f, 0.0f, 0.0f, 1.0f), DirectX::XMVectorSet(std::sin(angle), 0.1f, std::cos(angle), 0.0f), DirectX::XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f));
+	// Reversed depth, like the demos
+	DirectX::XMMATRIX proj = DirectX::XMMatrixPerspectiveFovLH(0.25f * DirectX::XM_PI, 16.0f / 9.0f, 1500.0f, 0.1f);
+
+	return Scene::ExtractFrustum(view * proj);
+}
+
+/**
+ * An independent reference. Tests the 'positive vertex' of each box, the corner furthest
+ * along the plane normal, in double precision
+ *
+ * @param margin    Will be filled with the smallest distance of a positive vertex from a plane. Results
+ *                  with a tiny margin can legitimately differ between float implementations
+ */
+bool ReferenceIsVisible(const Scene::Frustum &frustum, const Box &box, double *margin) {
+	*margin = 1.0e30;
+	for (uint p = 0; p < 6; ++p) {
+		const DirectX::XMFLOAT4 &plane = frustum.Planes[p];
+		double x = plane.x >= 0.0f ? box.Max.x : box.Min.x;
+		double y = plane.y >= 0.0f ? box.Max.y : box.Min.y;
+		double z = plane.z >= 0.0f ? box.Max.z : box.Min.z;
+
+		double distance = plane.x * x + plane.y * y + plane.z * z + plane.w;
+		*margin = std::min(*margin, std::fabs(distance));
+		if (distance < 0.0) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/** Returns the number of boxes where 'visible' disagrees with the reference, ignoring boxes that touch a plane */
+uint CountMismatches(const Scene::Frustum &frustum, const std::vector<Box> &boxes, const std::vector<uint> &visible) {
+	std::vector<bool> isVisible(boxes.size(), false);
+	for (auto iter = visible.begin(); iter != visible.end(); ++iter) {
+		isVisible[*iter] = true;
+	}
+
+	uint mismatches = 0u;
+	for (uint i = 0; i < boxes.size(); ++i) {
+		double margin;
+		bool expected = ReferenceIsVisible(frustum, boxes[i], &margin);
+		if (expected != isVisible[i] && margin > 1.0e-3) {
+			++mismatches;
+		}
+	}
+
+	return mismatches;
+}
+
+/**
+ * A headless benchmark and self-check of Scene::FrustumCuller. Every path is checked against a
+ * reference implementation, and against the scalar path. Exits with 1 if any of them disagree
+ */
+int main(int argc, char *argv[]) {
+	BenchmarkSettings settings;
+
+	for (int i = 1; i < argc; ++i) {
+		if (i + 1 >= argc) {
+			PrintUsage();
+			return 1;
+		}
+
+		uint value = static_cast<uint>(atoi(argv[i + 1]));
+		if (strcmp(argv[i], "-boxes") == 0) {
+			settings.BoxCounts.push_back(value);
+		} else if (strcmp(argv[i], "-frames") == 0) {
+			settings.Frames = value;
+		} else if (strcmp(argv[i], "-threads") == 0) {
+			settings.Threads = value;
+		} else {
+			PrintUsage();
+			return 1;
+		}
+		++i;
+	}
+
+	if (settings.BoxCounts.empty()) {
+		settings.BoxCounts.assign(kDefaultBoxCounts, kDefaultBoxCounts + sizeof(kDefaultBoxCounts) / sizeof(kDefaultBoxCounts[0]));
+	}
+	if (settings.Frames == 0u || std::find(settings.BoxCounts.begin(), settings.BoxCounts.end(), 0u) != settings.BoxCounts.end()) {
+		printf("Settings out of range. Boxes and frames must be at least 1\n\n");
+		PrintUsage();
+		return 1;
+	}
+
+	Common::ThreadPool threadPool(settings.Threads);
+	Scene::CullingPath fastestPath = Scene::FrustumCuller::GetFastestSupportedPath();
+
+	printf("Average over %u frames. %u worker threads. Fastest supported path: %s\n\n", settings.Frames, threadPool.GetThreadCount(), Scene::GetCullingPathName(fastestPath));
+	printf("  %10s %8s %10s %14s %14s %14s %14s %12s\n", "Boxes", "Path", "Visible", "1 thread (ms)", "MBoxes / s", "Parallel (ms)", "MBoxes / s", "Mismatches");
+
+	bool failed = false;
+	for (auto countIter = settings.BoxCounts.begin(); countIter != settings.BoxCounts.end(); ++countIter) {
+		uint boxCount = *countIter;
+
+		std::mt19937 generator(1234u);
+		std::vector<Box> boxes(boxCount);
+		Scene::FrustumCuller culler(boxCount);
+		for (uint i = 0; i < boxCount; ++i) {
+			boxes[i] = RandomBox(generator);
+			culler.Add(boxes[i].Min, boxes[i].Max);
+		}
+
+		// Every path has to give exactly the same list as the scalar path, on every frame
+		std::vector<std::vector<uint> > scalarResults(settings.Frames);
+		culler.SetPath(Scene::CullingPath::SCALAR);
+		for (uint frame = 0; frame < settings.Frames; ++frame) {
+			culler.Cull(FrameFrustum(frame), &scalarResults[frame]);
+		}
+
+		std::vector<uint> visible;
+		for (uint i = 0; i < sizeof(kPaths) / sizeof(kPaths[0]); ++i) {
+			if (kPaths[i] == Scene::CullingPath::AVX && fastestPath != Scene::CullingPath::AVX) {
+				printf("  %10u %8s %10s\n", boxCount, Scene::GetCullingPathName(kPaths[i]), "(not supported)");
+				continue;
+			}
+			culler.SetPath(kPaths[i]);
+
+			Engine::Timer timer;
+			uint64 visibleTotal = 0u;
+			uint mismatches = 0u;
+
+			timer.Start();
+			for (uint frame = 0; frame < settings.Frames; ++frame) {
+				visibleTotal += culler.Cull(FrameFrustum(frame), &visible);
+			}
+			double singleMilliseconds = timer.GetTime() / settings.Frames;
+			mismatches += CountMismatches(FrameFrustum(settings.Frames - 1u), boxes, visible);
+
+			timer.Start();
+			for (uint frame = 0; frame < settings.Frames; ++frame) {
+				culler.Cull(FrameFrustum(frame), &visible, &threadPool);
+				if (visible != scalarResults[frame]) {
+					++mismatches;
+				}
+			}
+			double parallelMilliseconds = timer.GetTime() / settings.Frames;
+
+			for (uint frame = 0; frame < settings.Frames; ++frame) {
+				culler.Cull(FrameFrustum(frame), &visible);
+				if (visible != scalarResults[frame]) {
+					++mismatches;
+				}
+			}
+
+			failed = failed || mismatches != 0u;
+			printf("  %10u %8s %10u %14.3f %14.1f %14.3f %14.1f %12u\n", boxCount, Scene::GetCullingPathName(kPaths[i]),
+			       static_cast<uint>(visibleTotal / settings.Frames),
+			       singleMilliseconds, boxCount / (singleMilliseconds * 1000.0),
+			       parallelMilliseconds, boxCount / (parallelMilliseconds * 1000.0),
+			       mismatches);
+		}
+	}
+
+	printf("\n  Visible:    The average number of visible boxes per frame\n"
+	       "  Mismatches: Boxes that disagree with the reference on the last frame, plus frames where the\n"
+	       "              visible list differs from the scalar path. Should always be 0\n");
+
+	if (failed) {
+		printf("\nFAILED\n");
+		return 1;
+	}
+
+	return 0;
+}
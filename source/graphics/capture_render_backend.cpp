@@ -0,0 +1,209 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "graphics/capture_render_backend.h"
+
+
+namespace Graphics {
+
+using CommandCaptureFormat::CaptureRecordType;
+
+bool CaptureRenderBackend::EndCapture(const wchar *filePath) {
+	m_capturing = false;
+	return m_capture.WriteToFile(filePath);
+}
+
+void CaptureRenderBackend::SetMaterialShader(MaterialShader *shader) {
+	m_backend->SetMaterialShader(shader);
+
+	if (m_capturing) {
+		m_capture.BeginRecord(CaptureRecordType::SET_SHADER);
+		m_capture.WriteResource(shader);
+	}
+}
+
+void CaptureRenderBackend::SetVertexBuffers(uint startSlot, uint count, ID3D11Buffer * const *buffers, const uint *strides, const uint *offsets) {
+	m_backend->SetVertexBuffers(startSlot, count, buffers, strides, offsets);
+
+	if (m_capturing) {
+		m_capture.BeginRecord(CaptureRecordType::SET_VERTEX_BUFFERS);
+		m_capture.Write(static_cast<uint8>(startSlot));
+		m_capture.Write(static_cast<uint8>(count));
+		for (uint i = 0; i < count; ++i) {
+			m_capture.WriteResource(buffers[i]);
+			m_capture.Write(static_cast<uint32>(strides[i]));
+			m_capture.Write(static_cast<uint32>(offsets[i]));
+		}
+	}
+}
+
+void CaptureRenderBackend::SetIndexBuffer(ID3D11Buffer *buffer, DXGI_FORMAT format, uint offset) {
+	m_backend->SetIndexBuffer(buffer, format, offset);
+
+	if (m_capturing) {
+		m_capture.BeginRecord(CaptureRecordType::SET_INDEX_BUFFER);
+		m_capture.WriteResource(buffer);
+		m_capture.Write(static_cast<uint32>(format));
+		m_capture.Write(static_cast<uint32>(offset));
+	}
+}
+
+void CaptureRenderBackend::SetVSShaderResources(uint startSlot, uint count, ID3D11ShaderResourceView * const *srvs) {
+	m_backend->SetVSShaderResources(startSlot, count, srvs);
+	RecordResources(CaptureRecordType::SET_VS_SHADER_RESOURCES, startSlot, count, reinterpret_cast<const void * const *>(srvs));
+}
+
+void CaptureRenderBackend::SetPSShaderResources(uint startSlot, uint count, ID3D11ShaderResourceView * const *srvs) {
+	m_backend->SetPSShaderResources(startSlot, count, srvs);
+	RecordResources(CaptureRecordType::SET_PS_SHADER_RESOURCES, startSlot, count, reinterpret_cast<const void * const *>(srvs));
+}
+
+void CaptureRenderBackend::SetPSSamplers(uint startSlot, uint count, ID3D11SamplerState * const *samplers) {
+	m_backend->SetPSSamplers(startSlot, count, samplers);
+	RecordResources(CaptureRecordType::SET_PS_SAMPLERS, startSlot, count, reinterpret_cast<const void * const *>(samplers));
+}
+
+void CaptureRenderBackend::SetVSConstantBuffers(uint startSlot, uint count, ID3D11Buffer * const *buffers) {
+	m_backend->SetVSConstantBuffers(startSlot, count, buffers);
+	RecordResources(CaptureRecordType::SET_VS_CONSTANT_BUFFERS, startSlot, count, reinterpret_cast<const void * const *>(buffers));
+}
+
+void CaptureRenderBackend::SetPSConstantBuffers(uint startSlot, uint count, ID3D11Buffer * const *buffers) {
+	m_backend->SetPSConstantBuffers(startSlot, count, buffers);
+	RecordResources(CaptureRecordType::SET_PS_CONSTANT_BUFFERS, startSlot, count, reinterpret_cast<const void * const *>(buffers));
+}
+
+void CaptureRenderBackend::SetVSConstantBufferRanges(uint startSlot, uint count, ID3D11Buffer * const *buffers, const uint *firstConstants, const uint *numConstants) {
+	m_backend->SetVSConstantBufferRanges(startSlot, count, buffers, firstConstants, numConstants);
+	RecordConstantBufferRanges(CaptureRecordType::SET_VS_CONSTANT_BUFFER_RANGES, startSlot, count, buffers, firstConstants, numConstants);
+}
+
+void CaptureRenderBackend::SetPSConstantBufferRanges(uint startSlot, uint count, ID3D11Buffer * const *buffers, const uint *firstConstants, const uint *numConstants) {
+	m_backend->SetPSConstantBufferRanges(startSlot, count, buffers, firstConstants, numConstants);
+	RecordConstantBufferRanges(CaptureRecordType::SET_PS_CONSTANT_BUFFER_RANGES, startSlot, count, buffers, firstConstants, numConstants);
+}
+
+void CaptureRenderBackend::SetBlendState(BlendState state, const float blendFactor[4], uint sampleMask) {
+	m_backend->SetBlendState(state, blendFactor, sampleMask);
+
+	if (m_capturing) {
+		m_capture.BeginRecord(CaptureRecordType::SET_BLEND_STATE);
+		m_capture.Write(static_cast<uint8>(state));
+		m_capture.Write(static_cast<uint32>(sampleMask));
+	}
+}
+
+void CaptureRenderBackend::SetRasterizerState(RasterizerState state) {
+	m_backend->SetRasterizerState(state);
+
+	if (m_capturing) {
+		m_capture.BeginRecord(CaptureRecordType::SET_RASTERIZER_STATE);
+		m_capture.Write(static_cast<uint8>(state));
+	}
+}
+
+void CaptureRenderBackend::SetDepthStencilState(DepthStencilState state, uint stencilRef) {
+	m_backend->SetDepthStencilState(state, stencilRef);
+
+	if (m_capturing) {
+		m_capture.BeginRecord(CaptureRecordType::SET_DEPTH_STENCIL_STATE);
+		m_capture.Write(static_cast<uint8>(state));
+		m_capture.Write(static_cast<uint32>(stencilRef));
+	}
+}
+
+void *CaptureRenderBackend::Map(ID3D11Buffer *buffer, D3D11_MAP mapType, size_t bytesToWrite) {
+	if (m_capturing) {
+		m_capture.BeginRecord(CaptureRecordType::MAP);
+		m_capture.WriteResource(buffer);
+		m_capture.Write(static_cast<uint8>(mapType));
+		m_capture.Write(static_cast<uint32>(bytesToWrite));
+	}
+
+	return m_backend->Map(buffer, mapType, bytesToWrite);
+}
+
+void CaptureRenderBackend::UpdateBuffer(ID3D11Buffer *buffer, uint byteOffset, uint byteSize, const void *data) {
+	m_backend->UpdateBuffer(buffer, byteOffset, byteSize, data);
+
+	if (m_capturing) {
+		m_capture.BeginRecord(CaptureRecordType::UPDATE_BUFFER);
+		m_capture.WriteResource(buffer);
+		m_capture.Write(static_cast<uint32>(byteOffset));
+		m_capture.Write(static_cast<uint32>(byteSize));
+	}
+}
+
+void CaptureRenderBackend::CopyBuffer(ID3D11Buffer *dest, uint destOffset, ID3D11Buffer *source, uint sourceOffset, uint byteSize) {
+	m_backend->CopyBuffer(dest, destOffset, source, sourceOffset, byteSize);
+
+	if (m_capturing) {
+		m_capture.BeginRecord(CaptureRecordType::COPY_BUFFER);
+		m_capture.WriteResource(dest);
+		m_capture.Write(static_cast<uint32>(destOffset));
+		m_capture.WriteResource(source);
+		m_capture.Write(static_cast<uint32>(sourceOffset));
+		m_capture.Write(static_cast<uint32>(byteSize));
+	}
+}
+
+void CaptureRenderBackend::Draw(uint vertexCount, uint vertexStart) {
+	m_backend->Draw(vertexCount, vertexStart);
+
+	if (m_capturing) {
+		m_capture.BeginRecord(CaptureRecordType::DRAW);
+		m_capture.Write(static_cast<uint32>(vertexCount));
+	}
+}
+
+void CaptureRenderBackend::DrawIndexed(uint indexCount, uint indexStart, int vertexStart) {
+	m_backend->DrawIndexed(indexCount, indexStart, vertexStart);
+
+	if (m_capturing) {
+		m_capture.BeginRecord(CaptureRecordType::DRAW_INDEXED);
+		m_capture.Write(static_cast<uint32>(indexCount));
+	}
+}
+
+void CaptureRenderBackend::DrawIndexedInstanced(uint indexCountPerInstance, uint instanceCount, uint indexStart, int vertexStart, uint instanceStart) {
+	m_backend->DrawIndexedInstanced(indexCountPerInstance, instanceCount, indexStart, vertexStart, instanceStart);
+
+	if (m_capturing) {
+		m_capture.BeginRecord(CaptureRecordType::DRAW_INDEXED_INSTANCED);
+		m_capture.Write(static_cast<uint32>(indexCountPerInstance));
+		m_capture.Write(static_cast<uint32>(instanceCount));
+	}
+}
+
+void CaptureRenderBackend::RecordResources(CaptureRecordType type, uint startSlot, uint count, const void * const *resources) {
+	if (!m_capturing) {
+		return;
+	}
+
+	m_capture.BeginRecord(type);
+	m_capture.Write(static_cast<uint8>(startSlot));
+	m_capture.Write(static_cast<uint8>(count));
+	for (uint i = 0; i < count; ++i) {
+		m_capture.WriteResource(resources[i]);
+	}
+}
+
+void CaptureRenderBackend::RecordConstantBufferRanges(CaptureRecordType type, uint startSlot, uint count, ID3D11Buffer * const *buffers, const uint *firstConstants, const uint *numConstants) {
+	if (!m_capturing) {
+		return;
+	}
+
+	m_capture.BeginRecord(type);
+	m_capture.Write(static_cast<uint8>(startSlot));
+	m_capture.Write(static_cast<uint8>(count));
+	for (uint i = 0; i < count; ++i) {
+		m_capture.WriteResource(buffers[i]);
+		m_capture.Write(static_cast<uint32>(firstConstants[i]));
+		m_capture.Write(static_cast<uint32>(numConstants[i]));
+	}
+}
+
+} // End of namespace Graphics
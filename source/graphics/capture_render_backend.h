@@ -0,0 +1,104 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "graphics/render_backend.h"
+#include "graphics/command_capture.h"
+
+
+namespace Graphics {
+
+/**
+ * A RenderBackend that wraps another backend. Every call is forwarded to the wrapped
+ * backend, and while a capture is active, it is also recorded into a CommandCapture.
+ *
+ * The intended use is to swap this in for a single frame:
+ *
+ *     captureBackend->BeginCapture();
+ *     bucket.Submit(captureBackend, &state, captureBackend->GetCapture());
+ *     captureBackend->EndCapture(L"frame.hcap");
+ *
+ * The statistics are kept by the wrapped backend. This backend's own stats stay empty.
+ * The resulting file can be inspected with the CaptureAnalyzer tool.
+ */
+class CaptureRenderBackend : public RenderBackend {
+public:
+	/** @param backend    The backend to forward all the calls to */
+	CaptureRenderBackend(RenderBackend *backend)
+		: m_backend(backend),
+		  m_capturing(false) {
+	}
+
+private:
+	RenderBackend *m_backend;
+	CommandCapture m_capture;
+	bool m_capturing;
+
+public:
+	/** Throws away any previous capture and starts recording */
+	inline void BeginCapture() {
+		m_capture.Clear();
+		m_capturing = true;
+	}
+	/**
+	 * Stops recording and writes the capture to a file
+	 *
+	 * @param filePath    The path of the file to create
+	 * @return            True if the file was written successfully
+	 */
+	bool EndCapture(const wchar *filePath);
+
+	inline bool IsCapturing() const { return m_capturing; }
+	/** Returns the capture being recorded, or nullptr if there isn't an active capture. Pass this to CommandBucket::Submit() */
+	inline CommandCapture *GetCapture() { return m_capturing ? &m_capture : nullptr; }
+	inline RenderBackend *GetWrappedBackend() { return m_backend; }
+
+	inline bool SupportsConstantBufferOffsets() const { return m_backend->SupportsConstantBufferOffsets(); }
+	inline bool SupportsNoOverwriteShaderResourceBuffers() const { return m_backend->SupportsNoOverwriteShaderResourceBuffers(); }
+
+	inline ID3D11Buffer *CreateBuffer(const D3D11_BUFFER_DESC &desc, const void *initialData) { return m_backend->CreateBuffer(desc, initialData); }
+	inline void ReleaseBuffer(ID3D11Buffer *buffer) { m_backend->ReleaseBuffer(buffer); }
+	inline ID3D11ShaderResourceView *CreateBufferShaderResource(ID3D11Buffer *buffer) { return m_backend->CreateBufferShaderResource(buffer); }
+	inline void ReleaseShaderResource(ID3D11ShaderResourceView *shaderResource) { m_backend->ReleaseShaderResource(shaderResource); }
+
+	void SetMaterialShader(MaterialShader *shader);
+
+	void SetVertexBuffers(uint startSlot, uint count, ID3D11Buffer * const *buffers, const uint *strides, const uint *offsets);
+	void SetIndexBuffer(ID3D11Buffer *buffer, DXGI_FORMAT format, uint offset);
+
+	void SetVSShaderResources(uint startSlot, uint count, ID3D11ShaderResourceView * const *srvs);
+	void SetPSShaderResources(uint startSlot, uint count, ID3D11ShaderResourceView * const *srvs);
+	void SetPSSamplers(uint startSlot, uint count, ID3D11SamplerState * const *samplers);
+	void SetVSConstantBuffers(uint startSlot, uint count, ID3D11Buffer * const *buffers);
+	void SetPSConstantBuffers(uint startSlot, uint count, ID3D11Buffer * const *buffers);
+	void SetVSConstantBufferRanges(uint startSlot, uint count, ID3D11Buffer * const *buffers, const uint *firstConstants, const uint *numConstants);
+	void SetPSConstantBufferRanges(uint startSlot, uint count, ID3D11Buffer * const *buffers, const uint *firstConstants, const uint *numConstants);
+
+	void SetBlendState(BlendState state, const float blendFactor[4], uint sampleMask);
+	void SetRasterizerState(RasterizerState state);
+	void SetDepthStencilState(DepthStencilState state, uint stencilRef);
+
+	void *Map(ID3D11Buffer *buffer, D3D11_MAP mapType, size_t bytesToWrite);
+	inline void Unmap(ID3D11Buffer *buffer) { m_backend->Unmap(buffer); }
+	void UpdateBuffer(ID3D11Buffer *buffer, uint byteOffset, uint byteSize, const void *data);
+	void CopyBuffer(ID3D11Buffer *dest, uint destOffset, ID3D11Buffer *source, uint sourceOffset, uint byteSize);
+
+	inline ID3D11Query *CreateFence() { return m_backend->CreateFence(); }
+	inline void ReleaseFence(ID3D11Query *fence) { m_backend->ReleaseFence(fence); }
+	inline void IssueFence(ID3D11Query *fence) { m_backend->IssueFence(fence); }
+	inline bool IsFenceComplete(ID3D11Query *fence) { return m_backend->IsFenceComplete(fence); }
+
+	void Draw(uint vertexCount, uint vertexStart);
+	void DrawIndexed(uint indexCount, uint indexStart, int vertexStart);
+	void DrawIndexedInstanced(uint indexCountPerInstance, uint instanceCount, uint indexStart, int vertexStart, uint instanceStart);
+
+private:
+	void RecordResources(CommandCaptureFormat::CaptureRecordType type, uint startSlot, uint count, const void * const *resources);
+	void RecordConstantBufferRanges(CommandCaptureFormat::CaptureRecordType type, uint startSlot, uint count, ID3D11Buffer * const *buffers, const uint *firstConstants, const uint *numConstants);
+};
+
+} // End of namespace Graphics
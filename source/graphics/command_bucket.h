@@ -9,38 +9,31 @@
 #include "common/halfling_sys.h"
 #include "common/linear_allocator.h"
 
-struct ID3D11Device;
-struct ID3D11DeviceContext;
+#include "graphics/render_backend.h"
+#include "graphics/command_capture.h"
+#include "graphics/command_packet.h"
+#include "graphics/commands.h"
+#include "graphics/constant_ring_buffer.h"
+#include "graphics/instance_stream.h"
 
+#include <algorithm>
+#include <type_traits>
 
-namespace Graphics {
-
-struct GraphicsState;
-
-typedef void (*CommandExecuteFunctionPtr)(ID3D11Device *device, ID3D11DeviceContext *context, 
-                                          BlendStateManager *blendStateManager, RasterizerStateManager *rasterizerStateManager, DepthStencilStateManager *depthStencilStateManager, 
-                                          GraphicsState *currentGraphicsState, 
-                                          const void *data);
-typedef void (*CommandDisposeFunctionPtr)(const void *data);
 
-struct CommandNode {
-	CommandNode *NextNode;
-	CommandExecuteFunctionPtr ExecuteFunction;
-	CommandDisposeFunctionPtr DisposeFunction;
-};
+namespace Graphics {
 
 template <typename SortKeyType>
 struct CommandPacket {
 	CommandPacket()
 		: Key(),
-		FirstNode(nullptr) {}
+		FirstCommand(nullptr) {}
 
-	CommandPacket(SortKeyType key, CommandNode *node)
+	CommandPacket(SortKeyType key, CommandHeader *command)
 		: Key(key),
-		FirstNode(node) {}
+		FirstCommand(command) {}
 
 	SortKeyType Key;
-	CommandNode *FirstNode;
+	CommandHeader *FirstCommand;
 };
 
 template <typename SortKeyType>
@@ -55,6 +48,21 @@ bool CommandSortFunction(CommandPacket<SortKeyType> const& lhs, CommandPacket<So
  *
  * NOTE: Commands can be grouped into 'packets' using AppendCommand(). The packet as
  * a whole will be sorted, but the order inside the packet will be preserved.
+ *
+ * Each command is stored as an 8 byte CommandHeader followed by the command data. The
+ * commands of a packet are laid out back to back in the same page, and are executed
+ * through the static dispatch table, g_commandDispatchTable.
+ *
+ * If an instance stream is set with SetInstanceStream(), Submit() will merge runs of
+ * consecutive DrawIndexedInstanceable commands with identical state into a single
+ * instanced draw. See Commands::DrawIndexedInstanceable. The stream grows as needed, so
+ * there's no limit on the number of DrawIndexedInstanceable commands. The instance offsets
+ * of the runs are sub-allocated from a ConstantRingBuffer, so a frame maps the ring once,
+ * rather than a constant buffer per draw
+ *
+ * NOTE: Constant buffer windows are bound on 256 byte boundaries, so every run takes a whole
+ *       256 byte window of the ring. Give the bucket a ring of its own, so a frame with many
+ *       runs can't use up the ring that the per-object constants are allocated from
  */
 template <typename SortKeyType, size_t Size>
 class CommandBucket { 
@@ -69,17 +77,66 @@ public:
 	 * NOTE: T must have operator< implemented in order for the sort to function properly
      */
     CommandBucket(size_t allocatorPageSize) 
-        : m_allocator(allocatorPageSize),
-          m_nextFreeCommand(0u) {
+        : m_allocator(std::max(allocatorPageSize, kMaxPacketSize + kPacketAlignmentSlack)),
+          m_nextFreeCommand(0u),
+          m_instanceStream(nullptr),
+          m_instanceStreamSlot(0u),
+          m_instanceOffsetRing(nullptr),
+          m_numInstanceableCommands(0u),
+          m_numDisposableCommands(0u),
+          m_mergedDrawCount(0u),
+          m_packetStart(nullptr),
+          m_lastCommand(nullptr),
+          m_lastCommandEnd(nullptr) {
     }
+
+	/** The maximum size of a packet, including the command headers. Packets never straddle a page */
+	static const size_t kMaxPacketSize = 512u;
+	/** The most bytes that aligning the first command of a packet can skip */
+	static const size_t kPacketAlignmentSlack = 32u;
     
 private:
     Common::LinearAllocator m_allocator;
 
 	CommandPacket<SortKeyType> m_commands[Size];
     uint m_nextFreeCommand;
+
+	InstanceStream *m_instanceStream;
+	uint m_instanceStreamSlot;
+	ConstantRingBuffer *m_instanceOffsetRing;
+	uint m_numInstanceableCommands;
+	uint m_numDisposableCommands;
+	uint m_mergedDrawCount;
+
+	byte *m_packetStart;
+	CommandHeader *m_lastCommand;
+	/** The end of the data of the last command */
+	byte *m_lastCommandEnd;
     
 public:
+	/**
+	 * Sets the stream that the merge pass gathers object indices into. The stream must have an element
+	 * size of sizeof(uint), and be between BeginFrame() and EndFrame() when Submit() is called.
+	 * Submit() binds the window it wrote to the vertex shader at 'vsSlot'
+	 *
+	 * The instance offset of each merged draw is written to 'instanceOffsetRing'. Submit() calls the ring's
+	 * BeginFrame() and EndFrame() around the merge pass, so the ring must not be mapped when Submit() is called.
+	 * The ring should only be used for the offsets. Each run takes 256 bytes, so a ring of Size * 256 bytes
+	 * always has room for a Submit(), and the rest of the ring lets the GPU lag behind without a wait
+	 *
+	 * @param instanceStream        The stream to gather object indices into
+	 * @param vsSlot                The vertex shader resource slot to bind the stream to
+	 * @param instanceOffsetRing    The ring to write the instance offsets of the merged draws to
+	 */
+	inline void SetInstanceStream(InstanceStream *instanceStream, uint vsSlot, ConstantRingBuffer *instanceOffsetRing) { 
+		AssertMsg(instanceStream == nullptr || instanceStream->GetElementSize() == sizeof(uint), "The instance stream must hold uints");
+		m_instanceStream = instanceStream; 
+		m_instanceStreamSlot = vsSlot;
+		m_instanceOffsetRing = instanceOffsetRing;
+	}
+	/** Returns the number of draws that were saved by merging during the last Submit() */
+	inline uint GetMergedDrawCount() const { return m_mergedDrawCount; }
+
     /**
      * Allocates a new command
 	 * 
@@ -89,55 +146,107 @@ public:
      */
     template <typename U>
 	U *AddCommand(SortKeyType key) {
-		CommandNode *node = AllocateCommand<U>();
+		AssertMsg(m_nextFreeCommand < Size, "The CommandBucket is full");
 
-		// Store key and pointer to the node
+		// Start the packet on a page that has room for the whole packet, so it can be laid out contiguously
+		m_allocator.EnsureContiguous(kMaxPacketSize + kPacketAlignmentSlack);
+
+		CommandHeader *header = AllocateCommand<U>();
+		m_packetStart = reinterpret_cast<byte *>(header);
+
+		// Store key and pointer to the header
 		// TODO: Atomic this:
 		uint currentPos = m_nextFreeCommand++;
 		m_commands[currentPos].Key = key;
-		m_commands[currentPos].FirstNode = node;
+		m_commands[currentPos].FirstCommand = header;
 
-		return new(GetCommandData(node)) U;
+		if (std::is_same<U, Commands::DrawIndexedInstanceable>::value) {
+			++m_numInstanceableCommands;
+		}
+
+		return new(header->GetData()) U;
 	}
 
 	/**
 	 * Allocates a new command and appends it to the end of an existing command. The new command 'packet' is sorted as a whole
 	 * entity and will execute the internal commands in the order they were added.
+	 *
+	 * Only kMaxPacketSize bytes of a packet are guaranteed to be in the same page, and the commands of a
+	 * packet are chained with 32 bit offsets, so a command that would make the packet larger is refused.
+	 * The packet is left as it was, and can still be submitted. Callers that build packets of varying
+	 * size must check for nullptr
 	 * 
 	 * @tparam U                 The type of the command to create. U must derive from 'CommandBase'
 	 * @param  previousCommand   The command to append the new command to
-	 * @return                   The newly allocated command
+	 * @return                   The newly allocated command, or nullptr if the packet would be larger than kMaxPacketSize
 	 */
 	template <typename U>
 	U *AppendCommand(void *previousCommand) {
-		CommandNode *newNode = AllocateCommand<U>();
+		CommandHeader *previousHeader = reinterpret_cast<CommandHeader *>(reinterpret_cast<byte *>(previousCommand) - sizeof(CommandHeader));
+		// The commands of a packet are laid out back to back, so we can only append to the newest command
+		AssertMsg(previousHeader == m_lastCommand && previousHeader->IsLastInPacket(), "Commands can only be appended to the last Command created");
 
-		CommandNode *previousNode = reinterpret_cast<CommandNode *>(reinterpret_cast<byte *>(previousCommand) - sizeof(CommandNode));
-		// Make sure this command hasn't already been appended to
-		AssertMsg(previousNode->NextNode == nullptr, "This Command has already had another command appended to it. Only append to the last Command created");
-		previousNode->NextNode = newNode;
+		if (GetCommandEnd<U>(m_lastCommandEnd) > m_packetStart + kMaxPacketSize) {
+			return nullptr;
+		}
+
+		CommandHeader *newHeader = AllocateCommand<U>();
 
-		return new(GetCommandData(newNode)) U;
+		previousHeader->NextOffset = static_cast<uint32>(reinterpret_cast<byte *>(newHeader) - reinterpret_cast<byte *>(previousHeader));
+		previousHeader->Flags &= ~CommandHeader::kLastInPacket;
+
+		return new(newHeader->GetData()) U;
 	}
 
 	/**
 	 * Sorts all the command packets and executes them in the sorted order
 	 *
-	 * @param device     The device to use for executing the commands
-	 * @param context    the context to use for executing the commands
+	 * @param backend                The backend to use for executing the commands
+	 * @param currentGraphicsState   The state currently bound to the pipeline. Used to filter redundant state changes
+	 * @param capture                [Optional] If not nullptr, the submit and the sort key of each executed packet are recorded
+	 *                               into the capture. Use together with a CaptureRenderBackend so the binds and draws are recorded too
 	 */
-	void Submit(ID3D11Device *device, ID3D11DeviceContext *context, BlendStateManager *blendStateManager, RasterizerStateManager *rasterizerStateManager, DepthStencilStateManager *depthStencilStateManager, GraphicsState *currentGraphicsState) {
+	void Submit(RenderBackend *backend, GraphicsState *currentGraphicsState, CommandCapture *capture = nullptr) {
 		// Sort the commands
 		std::sort(m_commands, m_commands + m_nextFreeCommand, CommandSortFunction<SortKeyType>);
 
+		if (capture != nullptr) {
+			capture->BeginSubmit(currentGraphicsState);
+		}
+
+		// Merge runs of identical draws into instanced draws
+		m_mergedDrawCount = 0u;
+		if (m_numInstanceableCommands > 0u) {
+			MergeInstanceableDraws(backend);
+		}
+
 		// Execute the commands
+		const uint16 instanceableTypeId = CommandTypeId<Commands::DrawIndexedInstanceable>::kValue;
 		for (uint i = 0; i < m_nextFreeCommand; ++i) {
-			CommandNode *node = m_commands[i].FirstNode;
+			CommandHeader *header = m_commands[i].FirstCommand;
+
+			if (capture != nullptr) {
+				capture->RecordPacket(static_cast<uint64>(m_commands[i].Key));
+			}
 
-			do {
-				node->ExecuteFunction(device, context, blendStateManager, rasterizerStateManager, depthStencilStateManager, currentGraphicsState, GetCommandData(node));
-				node = node->NextNode;
-			} while (node != nullptr);
+			if (header->TypeId == instanceableTypeId) {
+				// The first command of a merged run draws the whole run, so skip the rest
+				Commands::DrawIndexedInstanceable::Execute(backend, currentGraphicsState, header->GetData());
+				i += reinterpret_cast<Commands::DrawIndexedInstanceable *>(header->GetData())->GetInstanceCount() - 1u;
+				continue;
+			}
+
+			for (;;) {
+				g_commandDispatchTable[header->TypeId].Execute(backend, currentGraphicsState, header->GetData());
+				if (header->IsLastInPacket()) {
+					break;
+				}
+				header = header->GetNext();
+			}
+		}
+
+		if (capture != nullptr) {
+			capture->EndSubmit();
 		}
 	}
 
@@ -145,45 +254,142 @@ public:
 	 * Clears the bucket of all commands        
 	 */
 	void Clear() {
-		// Dispose the commands
-		for (uint i = 0; i < m_nextFreeCommand; ++i) {
-			CommandNode *node = m_commands[i].FirstNode;
+		// Dispose the commands. Trivially destructible commands don't need it, so
+		// if all the commands are trivially destructible, we can skip the walk entirely
+		if (m_numDisposableCommands > 0u) {
+			for (uint i = 0; i < m_nextFreeCommand; ++i) {
+				CommandHeader *header = m_commands[i].FirstCommand;
 
-			do {
-				node->DisposeFunction(GetCommandData(node));
-				node = node->NextNode;
-			} while (node != nullptr);
+				for (;;) {
+					CommandDisposeFunctionPtr dispose = g_commandDispatchTable[header->TypeId].Dispose;
+					if (dispose != nullptr) {
+						dispose(header->GetData());
+					}
+					if (header->IsLastInPacket()) {
+						break;
+					}
+					header = header->GetNext();
+				}
+			}
 		}
 
 		m_allocator.Reset();
 		m_nextFreeCommand = 0u;
+		m_numInstanceableCommands = 0u;
+		m_numDisposableCommands = 0u;
+		m_packetStart = nullptr;
+		m_lastCommand = nullptr;
+		m_lastCommandEnd = nullptr;
 	}
     
 private:
-    /**
-     * A helper function to allocate a new CommandNode and initialize it
-     *
-     * @return        
-     */
-    template <typename U>
-	CommandNode *AllocateCommand() {
-		// We have to allocate enough room to fit all of the data of U. 
-		CommandNode *newNode = reinterpret_cast<CommandNode *>(m_allocator.Allocate(sizeof(CommandNode) + sizeof(U)));
-		newNode->NextNode = nullptr;
-		newNode->ExecuteFunction = &U::Execute;
-		newNode->DisposeFunction = &U::Dispose;
-
-		return newNode;
+	/**
+	 * Finds runs of consecutive DrawIndexedInstanceable commands that can be merged, gathers
+	 * their object indices into the instance stream, and stores the instance range of each
+	 * run in the first command of the run, along with the ring window holding its start.
+	 *
+	 * @param backend    The backend to bind the instance stream with
+	 */
+	void MergeInstanceableDraws(RenderBackend *backend) {
+		AssertMsg(m_instanceStream != nullptr && m_instanceOffsetRing != nullptr, "DrawIndexedInstanceable commands require an instance stream and an instance offset ring. Call SetInstanceStream()");
+
+		InstanceStreamAllocation allocation = m_instanceStream->Map(m_numInstanceableCommands);
+		m_instanceOffsetRing->BeginFrame();
+		uint *stream = static_cast<uint *>(allocation.Data);
+		uint nextInstance = 0u;
+
+		const uint16 instanceableTypeId = CommandTypeId<Commands::DrawIndexedInstanceable>::kValue;
+
+		uint i = 0u;
+		while (i < m_nextFreeCommand) {
+			CommandHeader *header = m_commands[i].FirstCommand;
+			if (header->TypeId != instanceableTypeId) {
+				++i;
+				continue;
+			}
+			AssertMsg(header->IsLastInPacket(), "DrawIndexedInstanceable must be the only command in its packet");
+
+			Commands::DrawIndexedInstanceable *first = reinterpret_cast<Commands::DrawIndexedInstanceable *>(header->GetData());
+
+			// Find the end of the run
+			uint runEnd = i + 1u;
+			while (runEnd < m_nextFreeCommand) {
+				CommandHeader *nextHeader = m_commands[runEnd].FirstCommand;
+				if (nextHeader->TypeId != instanceableTypeId ||
+				    !first->CanMergeWith(*reinterpret_cast<Commands::DrawIndexedInstanceable *>(nextHeader->GetData()))) {
+					break;
+				}
+				AssertMsg(nextHeader->IsLastInPacket(), "DrawIndexedInstanceable must be the only command in its packet");
+
+				++runEnd;
+			}
+
+			// Gather the object indices
+			uint instanceCount = runEnd - i;
+			uint instanceStart = allocation.FirstElement + nextInstance;
+			first->SetInstanceRange(instanceStart, instanceCount, m_instanceOffsetRing->Allocate(instanceStart));
+			for (uint j = i; j < runEnd; ++j) {
+				stream[nextInstance++] = reinterpret_cast<Commands::DrawIndexedInstanceable *>(m_commands[j].FirstCommand->GetData())->GetObjectIndex();
+			}
+
+			m_mergedDrawCount += instanceCount - 1u;
+			i = runEnd;
+		}
+
+		m_instanceStream->Unmap();
+		m_instanceOffsetRing->EndFrame();
+
+		// The stream may have moved to a new buffer to make room, so the window is bound here rather than by the caller
+		backend->SetVSShaderResources(m_instanceStreamSlot, 1u, &allocation.ShaderResource);
 	}
 
 	/**
-	 * A helper function to get the data for a command
+	 * A helper function to allocate a new command and initialize its header
 	 *
-	 * @param node    The CommandNode that is the header for the data
-	 * @return        The data for the command
+	 * The data always starts directly after the 8 byte header. For commands that need 16 byte
+	 * alignment, the header is pushed forward 8 bytes within a 16 byte aligned block
+	 *
+	 * @return    The header of the new command
+	 */
+	template <typename U>
+	CommandHeader *AllocateCommand() {
+		static_assert(std::alignment_of<U>::value <= 16u, "Commands can't need more than 16 byte alignment");
+		// AddCommand() only makes sure that kMaxPacketSize bytes are left in the page, so a bigger command would run past its end
+		static_assert(sizeof(CommandHeader) + sizeof(U) + 16u <= kMaxPacketSize, "The command is too big to fit in a packet. Split it, or point to the data instead");
+
+		CommandHeader *header;
+		if (std::alignment_of<U>::value > sizeof(CommandHeader)) {
+			byte *block = reinterpret_cast<byte *>(m_allocator.Allocate(16u + sizeof(U), 16u));
+			header = reinterpret_cast<CommandHeader *>(block + 16u - sizeof(CommandHeader));
+		} else {
+			header = reinterpret_cast<CommandHeader *>(m_allocator.Allocate(sizeof(CommandHeader) + sizeof(U), sizeof(CommandHeader)));
+		}
+
+		header->TypeId = CommandTypeId<U>::kValue;
+		header->Flags = CommandHeader::kLastInPacket;
+		header->NextOffset = 0u;
+
+		if (!std::is_trivially_destructible<U>::value) {
+			++m_numDisposableCommands;
+		}
+
+		m_lastCommand = header;
+		m_lastCommandEnd = reinterpret_cast<byte *>(header->GetData()) + sizeof(U);
+		return header;
+	}
+
+	/**
+	 * Returns where the data of a command would end, if AllocateCommand() placed it after 'current' in the same page
+	 *
+	 * @param current    The end of the last allocation
 	 */
-	inline static void *GetCommandData(CommandNode *node) {
-		return reinterpret_cast<byte *>(node) + sizeof(CommandNode);
+	template <typename U>
+	static byte *GetCommandEnd(byte *current) {
+		if (std::alignment_of<U>::value > sizeof(CommandHeader)) {
+			return Common::AlignPointer(current, 16u) + 16u + sizeof(U);
+		}
+
+		return Common::AlignPointer(current, sizeof(CommandHeader)) + sizeof(CommandHeader) + sizeof(U);
 	}
 };
 
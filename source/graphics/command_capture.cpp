@@ -0,0 +1,79 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "graphics/command_capture.h"
+
+#include "graphics/graphics_state.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+
+namespace Graphics {
+
+void CommandCapture::Clear() {
+	m_stream.clear();
+	m_recordCount = 0u;
+	m_resourceIds.clear();
+}
+
+bool CommandCapture::WriteToFile(const wchar *filePath) const {
+	#if defined(_MSC_VER)
+		std::ofstream fout(filePath, std::ios::out | std::ios::binary);
+	#else
+		// Only MSVC's streams take wide paths
+		std::string narrowPath(std::wcstombs(nullptr, filePath, 0u), '\0');
+		std::wcstombs(&narrowPath[0], filePath, narrowPath.size());
+		std::ofstream fout(narrowPath.c_str(), std::ios::out | std::ios::binary);
+	#endif
+	if (!fout) {
+		return false;
+	}
+
+	CommandCaptureFormat::CaptureFileHeader header;
+	header.Magic = CommandCaptureFormat::kMagic;
+	header.Version = CommandCaptureFormat::kVersion;
+	header.RecordCount = m_recordCount;
+	header.StreamSize = static_cast<uint32>(m_stream.size());
+	header.ResourceCount = static_cast<uint32>(m_resourceIds.size());
+
+	fout.write(reinterpret_cast<const char *>(&header), sizeof(header));
+	if (!m_stream.empty()) {
+		fout.write(reinterpret_cast<const char *>(&m_stream[0]), m_stream.size());
+	}
+
+	return fout.good();
+}
+
+void CommandCapture::BeginSubmit(const GraphicsState *currentGraphicsState) {
+	BeginRecord(CommandCaptureFormat::CaptureRecordType::BEGIN_SUBMIT);
+	WriteResource(currentGraphicsState->MaterialShader);
+	WriteResource(currentGraphicsState->VertexBuffers[0]);
+	WriteResource(currentGraphicsState->VertexBuffers[1]);
+	WriteResource(currentGraphicsState->IndexBuffer);
+	Write(static_cast<uint8>(currentGraphicsState->BlendState));
+	Write(static_cast<uint8>(currentGraphicsState->RasterizerState));
+	Write(static_cast<uint8>(currentGraphicsState->DepthStencilState));
+}
+
+uint32 CommandCapture::GetResourceId(const void *resource) {
+	if (resource == nullptr) {
+		return 0u;
+	}
+
+	auto iter = m_resourceIds.find(resource);
+	if (iter != m_resourceIds.end()) {
+		return iter->second;
+	}
+
+	uint32 id = static_cast<uint32>(m_resourceIds.size()) + 1u;
+	m_resourceIds[resource] = id;
+
+	return id;
+}
+
+} // End of namespace Graphics
@@ -0,0 +1,90 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "common/typedefs.h"
+
+#include "graphics/command_capture_format.h"
+
+#include <unordered_map>
+#include <vector>
+#include <cstring>
+
+
+namespace Graphics {
+
+struct GraphicsState;
+
+/**
+ * Records a stream of binds, maps, and draws into memory, so it can be written to
+ * a capture file and analyzed offline. See command_capture_format.h for the format
+ * and CaptureRenderBackend for how the stream is fed.
+ *
+ * Pointers are replaced with dense ids in the order they are first seen, so the file
+ * is compact and two captures of the same scene can be compared.
+ */
+class CommandCapture {
+public:
+	CommandCapture()
+		: m_recordCount(0u) {
+	}
+
+private:
+	std::vector<byte> m_stream;
+	uint32 m_recordCount;
+	std::unordered_map<const void *, uint32> m_resourceIds;
+
+public:
+	/** Throws away everything recorded so far */
+	void Clear();
+	/**
+	 * Writes the capture to a file
+	 *
+	 * @param filePath    The path of the file to create
+	 * @return            True if the file was written successfully
+	 */
+	bool WriteToFile(const wchar *filePath) const;
+
+	inline uint32 GetRecordCount() const { return m_recordCount; }
+	inline size_t GetStreamSize() const { return m_stream.size(); }
+
+	/**
+	 * Records the start of a CommandBucket::Submit()
+	 *
+	 * @param currentGraphicsState    The state the bucket will filter its binds against
+	 */
+	void BeginSubmit(const GraphicsState *currentGraphicsState);
+	inline void EndSubmit() { BeginRecord(CommandCaptureFormat::CaptureRecordType::END_SUBMIT); }
+	/**
+	 * Records that a command packet is about to execute
+	 *
+	 * @param sortKey    The key of the packet, widened to 64 bits
+	 */
+	inline void RecordPacket(uint64 sortKey) {
+		BeginRecord(CommandCaptureFormat::CaptureRecordType::PACKET);
+		Write(sortKey);
+	}
+
+	// Stream writing
+	inline void BeginRecord(CommandCaptureFormat::CaptureRecordType type) {
+		++m_recordCount;
+		m_stream.push_back(static_cast<byte>(type));
+	}
+	template <typename T>
+	inline void Write(T value) {
+		size_t offset = m_stream.size();
+		m_stream.resize(offset + sizeof(T));
+		memcpy(&m_stream[offset], &value, sizeof(T));
+	}
+	inline void WriteResource(const void *resource) { Write(GetResourceId(resource)); }
+
+private:
+	/** Returns the dense id of a resource, assigning a new one if it hasn't been seen before. nullptr is always 0 */
+	uint32 GetResourceId(const void *resource);
+};
+
+} // End of namespace Graphics
@@ -0,0 +1,105 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "common/typedefs.h"
+
+
+/**
+ * The on-disk format of a command stream capture. See Graphics::CommandCapture
+ *
+ * This header is shared by the engine and the offline capture analyzer, so it must
+ * stay free of any D3D / Windows dependencies.
+ *
+ * A capture file is a CaptureFileHeader followed by a tightly packed stream of records.
+ * Every record starts with a one byte CaptureRecordType, followed by its payload. All
+ * values are little endian and unaligned.
+ *
+ * Resources (buffers, views, samplers, shaders) are written as dense capture ids rather
+ * than pointers. Id 0 is always nullptr. The fixed function states are written as the
+ * value of their Graphics::*State enum.
+ */
+namespace CommandCaptureFormat {
+
+static const uint32 kMagic = 0x50414348u; // 'HCAP'
+static const uint32 kVersion = 3u;
+
+struct CaptureFileHeader {
+	uint32 Magic;
+	uint32 Version;
+	/** The number of records in the stream */
+	uint32 RecordCount;
+	/** The size of the record stream, in bytes */
+	uint32 StreamSize;
+	/** The number of distinct resource ids used in the stream, not counting nullptr */
+	uint32 ResourceCount;
+};
+
+/**
+ * The record types and their payloads
+ *
+ * Payload notation: 'u8' / 'u32' / 'u64' are little endian integers. 'n' is the count of
+ * the record's preceding 'count' field
+ */
+enum class CaptureRecordType : uint8 {
+	/**
+	 * A CommandBucket::Submit() started. The payload is the GraphicsState the bucket
+	 * starts filtering against:
+	 * u32 shader, u32 vertexBuffer0, u32 vertexBuffer1, u32 indexBuffer, u8 blendState, u8 rasterizerState, u8 depthStencilState
+	 */
+	BEGIN_SUBMIT,
+	/** A CommandBucket::Submit() finished. No payload */
+	END_SUBMIT,
+	/** A command packet is about to execute. u64 sortKey */
+	PACKET,
+
+	/** u32 shader */
+	SET_SHADER,
+	/** u8 startSlot, u8 count, n * (u32 buffer, u32 stride, u32 offset) */
+	SET_VERTEX_BUFFERS,
+	/** u32 buffer, u32 format, u32 offset */
+	SET_INDEX_BUFFER,
+	/** u8 startSlot, u8 count, n * u32 srv */
+	SET_VS_SHADER_RESOURCES,
+	/** u8 startSlot, u8 count, n * u32 srv */
+	SET_PS_SHADER_RESOURCES,
+	/** u8 startSlot, u8 count, n * u32 sampler */
+	SET_PS_SAMPLERS,
+	/** u8 startSlot, u8 count, n * u32 buffer */
+	SET_VS_CONSTANT_BUFFERS,
+	/** u8 startSlot, u8 count, n * u32 buffer */
+	SET_PS_CONSTANT_BUFFERS,
+	/** u8 startSlot, u8 count, n * (u32 buffer, u32 firstConstant, u32 numConstants) */
+	SET_VS_CONSTANT_BUFFER_RANGES,
+	/** u8 startSlot, u8 count, n * (u32 buffer, u32 firstConstant, u32 numConstants) */
+	SET_PS_CONSTANT_BUFFER_RANGES,
+
+	/** u8 state, u32 sampleMask */
+	SET_BLEND_STATE,
+	/** u8 state */
+	SET_RASTERIZER_STATE,
+	/** u8 state, u32 stencilRef */
+	SET_DEPTH_STENCIL_STATE,
+
+	/** u32 buffer, u8 mapType, u32 bytesToWrite */
+	MAP,
+	/** u32 buffer, u32 byteOffset, u32 byteSize */
+	UPDATE_BUFFER,
+	/** u32 destBuffer, u32 destOffset, u32 sourceBuffer, u32 sourceOffset, u32 byteSize */
+	COPY_BUFFER,
+
+	/** u32 vertexCount */
+	DRAW,
+	/** u32 indexCount */
+	DRAW_INDEXED,
+	/** u32 indexCountPerInstance, u32 instanceCount */
+	DRAW_INDEXED_INSTANCED,
+
+	COUNT
+};
+
+} // End of namespace CommandCaptureFormat
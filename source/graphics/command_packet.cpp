@@ -0,0 +1,31 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "graphics/command_packet.h"
+
+#include "common/halfling_sys.h"
+
+#include <atomic>
+
+
+namespace Graphics {
+
+// Both are zero-initialized before any dynamic initialization runs, so command
+// types can safely register themselves from static initializers in other translation units
+CommandDispatchEntry g_commandDispatchTable[kMaxCommandTypes];
+static std::atomic<uint> s_numCommandTypes;
+
+uint16 RegisterCommandType(CommandExecuteFunctionPtr executeFunction, CommandDisposeFunctionPtr disposeFunction) {
+	uint typeId = s_numCommandTypes.fetch_add(1u);
+	AssertMsg(typeId < kMaxCommandTypes, "Too many command types. Increase kMaxCommandTypes");
+
+	g_commandDispatchTable[typeId].Execute = executeFunction;
+	g_commandDispatchTable[typeId].Dispose = disposeFunction;
+
+	return static_cast<uint16>(typeId);
+}
+
+} // End of namespace Graphics
@@ -0,0 +1,80 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "common/typedefs.h"
+
+#include <type_traits>
+
+
+namespace Graphics {
+
+class RenderBackend;
+struct GraphicsState;
+
+typedef void (*CommandExecuteFunctionPtr)(RenderBackend *backend, GraphicsState *currentGraphicsState, const void *data);
+typedef void (*CommandDisposeFunctionPtr)(const void *data);
+
+/**
+ * The header in front of every command in a CommandBucket. The command data follows
+ * the header in the same allocation, and the commands of a packet are laid out back
+ * to back, so a whole packet can be walked without any pointer chasing
+ */
+struct CommandHeader {
+	/** Index into the command dispatch table. See CommandTypeId */
+	uint16 TypeId;
+	/** CommandHeader::kLastInPacket, etc. */
+	uint16 Flags;
+	/** The offset from the start of this header to the header of the next command in the packet, in bytes */
+	uint32 NextOffset;
+
+	static const uint16 kLastInPacket = 1u << 0u;
+
+	/** The command data always starts directly after the header */
+	inline void *GetData() { return reinterpret_cast<byte *>(this) + sizeof(CommandHeader); }
+	inline bool IsLastInPacket() const { return (Flags & kLastInPacket) != 0u; }
+	inline CommandHeader *GetNext() { return reinterpret_cast<CommandHeader *>(reinterpret_cast<byte *>(this) + NextOffset); }
+};
+
+static_assert(sizeof(CommandHeader) == 8u, "CommandHeader should pack into 8 bytes");
+
+struct CommandDispatchEntry {
+	CommandExecuteFunctionPtr Execute;
+	/** nullptr for commands that are trivially destructible */
+	CommandDisposeFunctionPtr Dispose;
+};
+
+static const uint kMaxCommandTypes = 256u;
+
+/** The static dispatch table, indexed by CommandHeader::TypeId */
+extern CommandDispatchEntry g_commandDispatchTable[kMaxCommandTypes];
+
+/**
+ * Adds a command type to the dispatch table
+ *
+ * @param executeFunction    The function that executes the command
+ * @param disposeFunction    The function that disposes the command. nullptr if the command doesn't need to be disposed
+ * @return                   The type id of the command
+ */
+uint16 RegisterCommandType(CommandExecuteFunctionPtr executeFunction, CommandDisposeFunctionPtr disposeFunction);
+
+/**
+ * Assigns every command type a small id in the dispatch table. The ids are assigned 
+ * during static initialization, the first time a command type is used with a CommandBucket
+ *
+ * Commands that are trivially destructible don't get a dispose function, so CommandBucket::Clear()
+ * can skip them entirely
+ */
+template <typename U>
+struct CommandTypeId {
+	static const uint16 kValue;
+};
+
+template <typename U>
+const uint16 CommandTypeId<U>::kValue = RegisterCommandType(&U::Execute, std::is_trivially_destructible<U>::value ? nullptr : &U::Dispose);
+
+} // End of namespace Graphics
@@ -6,20 +6,20 @@
 
 #include "graphics/commands.h"
 
-#include "graphics/d3d_util.h"
 #include "graphics/graphics_state.h"
+#include "graphics/render_backend.h"
 
-#include <d3d11.h>
+#include <cstring>
 
 
 namespace Graphics {
 
 namespace Commands {
 
-void DrawCommandBase::CheckAndSubmitChangedState(ID3D11Device *device, ID3D11DeviceContext *context, BlendStateManager *blendStateManager, RasterizerStateManager *rasterizerStateManager, DepthStencilStateManager *depthStencilStateManager, GraphicsState *currentGraphicsState) const {
+void DrawCommandBase::CheckAndSubmitChangedState(RenderBackend *backend, GraphicsState *currentGraphicsState) const {
 	// Check material shader
 	if (currentGraphicsState->MaterialShader != m_materialShader) {
-		m_materialShader->BindToPipeline(context);
+		backend->SetMaterialShader(m_materialShader);
 
 		// Update the current graphics state
 		currentGraphicsState->MaterialShader = m_materialShader;
@@ -28,13 +28,13 @@ void DrawCommandBase::CheckAndSubmitChangedState(ID3D11Device *device, ID3D11Dev
 	// Check vertex buffers
 	if (m_numVertexBuffers == 1 && currentGraphicsState->VertexBuffers[0] != m_vertexBuffers[0]) {
 		uint offsets = 0;
-		context->IASetVertexBuffers(0, 1u, m_vertexBuffers, m_vertexBufferStrides, &offsets);
+		backend->SetVertexBuffers(0, 1u, m_vertexBuffers, m_vertexBufferStrides, &offsets);
 
 		// Update the current graphics state
 		currentGraphicsState->VertexBuffers[0] = m_vertexBuffers[0];
 	} else if (m_numVertexBuffers == 2 && (currentGraphicsState->VertexBuffers[0] != m_vertexBuffers[0] || currentGraphicsState->VertexBuffers[1] != m_vertexBuffers[1])) {
 		uint offsets[] = {0, 0};
-		context->IASetVertexBuffers(0, 2u, m_vertexBuffers, m_vertexBufferStrides, offsets);
+		backend->SetVertexBuffers(0, 2u, m_vertexBuffers, m_vertexBufferStrides, offsets);
 
 		// Update the current graphics state
 		memcpy(currentGraphicsState->VertexBuffers, m_vertexBuffers, sizeof(ID3D11Buffer *) * 2ull);
@@ -42,30 +42,27 @@ void DrawCommandBase::CheckAndSubmitChangedState(ID3D11Device *device, ID3D11Dev
 
 	// Check index buffer
 	if (m_indexBuffer != currentGraphicsState->IndexBuffer) {
-		context->IASetIndexBuffer(m_indexBuffer, m_indexBufferFormat, 0u);
+		backend->SetIndexBuffer(m_indexBuffer, m_indexBufferFormat, 0u);
 
 		// Update the current graphics state
 		currentGraphicsState->IndexBuffer = m_indexBuffer;
 	}
 
-	// TODO: Do an element by element search and replace. Preferably optimizing to as few calls as possible (by grouping textures into an array)
-	if (m_textureSRVs.size() != 0 && (currentGraphicsState->TextureSRVs.size() == 0 || m_textureSRVs.begin()->second != currentGraphicsState->TextureSRVs.begin()->second)) {
-		for (auto iter = m_textureSRVs.begin(); iter != m_textureSRVs.end(); ++iter) {
-			context->PSSetShaderResources(iter->first, 1u, &iter->second);
-		}
-
-		// Update the current graphics state
-		currentGraphicsState->TextureSRVs = m_textureSRVs;
+	// Check texture SRVs
+	// Only the slots that differ are re-bound, and contiguous slots are grouped into a single call
+	uint32 changedSRVs = currentGraphicsState->TextureSRVs.GetChangedSlots(m_textureSRVs);
+	if (changedSRVs != 0u) {
+		currentGraphicsState->TextureSRVs.BindSlots(m_textureSRVs, changedSRVs, [backend](uint startSlot, uint count, ID3D11ShaderResourceView * const *srvs) {
+			backend->SetPSShaderResources(startSlot, count, srvs);
+		});
 	}
 
-	// TODO: Do an element by element search and replace. Preferably optimizing to as few calls as possible (by grouping samplers into an array)
-	if (m_textureSamplers.size() != 0 && (currentGraphicsState->TextureSamplers.size() == 0 || m_textureSamplers.begin()->second != currentGraphicsState->TextureSamplers.begin()->second)) {
-		for (auto iter = m_textureSamplers.begin(); iter != m_textureSamplers.end(); ++iter) {
-			context->PSSetSamplers(iter->first, 1u, &iter->second);
-		}
-
-		// Update the current graphics state
-		currentGraphicsState->TextureSamplers = m_textureSamplers;
+	// Check texture samplers
+	uint32 changedSamplers = currentGraphicsState->TextureSamplers.GetChangedSlots(m_textureSamplers);
+	if (changedSamplers != 0u) {
+		currentGraphicsState->TextureSamplers.BindSlots(m_textureSamplers, changedSamplers, [backend](uint startSlot, uint count, ID3D11SamplerState * const *samplers) {
+			backend->SetPSSamplers(startSlot, count, samplers);
+		});
 	}
 
 	// Check blend state
@@ -75,7 +72,7 @@ void DrawCommandBase::CheckAndSubmitChangedState(ID3D11Device *device, ID3D11Dev
 		m_blendFactor[2] != currentGraphicsState->BlendFactor[2] ||
 		m_blendFactor[3] != currentGraphicsState->BlendFactor[3] ||
 		m_sampleMask != currentGraphicsState->SampleMask) {
-		context->OMSetBlendState(blendStateManager->GetD3DState(m_blendState), m_blendFactor, m_sampleMask);
+		backend->SetBlendState(m_blendState, m_blendFactor, m_sampleMask);
 
 		// Update the current graphics state
 		currentGraphicsState->BlendState = m_blendState;
@@ -85,7 +82,7 @@ void DrawCommandBase::CheckAndSubmitChangedState(ID3D11Device *device, ID3D11Dev
 
 	// Check rasterizer state
 	if (m_rasterizerState != currentGraphicsState->RasterizerState) {
-		context->RSSetState(rasterizerStateManager->GetD3DState(m_rasterizerState));
+		backend->SetRasterizerState(m_rasterizerState);
 
 		// Update the current graphics state
 		currentGraphicsState->RasterizerState = m_rasterizerState;
@@ -93,18 +90,34 @@ void DrawCommandBase::CheckAndSubmitChangedState(ID3D11Device *device, ID3D11Dev
 
 	// Check depth stencil state
 	if (m_depthStencilState != currentGraphicsState->DepthStencilState) {
-		context->OMSetDepthStencilState(depthStencilStateManager->GetD3DState(m_depthStencilState), 0u);
+		backend->SetDepthStencilState(m_depthStencilState, 0u);
 
 		// Update the current graphics state
 		currentGraphicsState->DepthStencilState = m_depthStencilState;
 	}
 }
 
-void Draw::Execute(ID3D11Device *device, ID3D11DeviceContext *context, BlendStateManager *blendStateManager, RasterizerStateManager *rasterizerStateManager, DepthStencilStateManager *depthStencilStateManager, GraphicsState *currentGraphicsState, const void *data) {
+bool DrawCommandBase::HasSameState(const DrawCommandBase &other) const {
+	return m_materialShader == other.m_materialShader &&
+	       m_numVertexBuffers == other.m_numVertexBuffers &&
+	       memcmp(m_vertexBuffers, other.m_vertexBuffers, sizeof(ID3D11Buffer *) * m_numVertexBuffers) == 0 &&
+	       memcmp(m_vertexBufferStrides, other.m_vertexBufferStrides, sizeof(uint) * m_numVertexBuffers) == 0 &&
+	       m_indexBuffer == other.m_indexBuffer &&
+	       m_indexBufferFormat == other.m_indexBufferFormat &&
+	       m_textureSRVs.IsEqual(other.m_textureSRVs) &&
+	       m_textureSamplers.IsEqual(other.m_textureSamplers) &&
+	       m_blendState == other.m_blendState &&
+	       memcmp(m_blendFactor, other.m_blendFactor, sizeof(float) * 4ull) == 0 &&
+	       m_sampleMask == other.m_sampleMask &&
+	       m_rasterizerState == other.m_rasterizerState &&
+	       m_depthStencilState == other.m_depthStencilState;
+}
+
+void Draw::Execute(RenderBackend *backend, GraphicsState *currentGraphicsState, const void *data) {
 	const Draw *command = reinterpret_cast<const Draw *>(data);
 
-	command->CheckAndSubmitChangedState(device, context, blendStateManager, rasterizerStateManager, depthStencilStateManager, currentGraphicsState);
-	context->Draw(command->m_vertexCount, command->m_vertexStart);
+	command->CheckAndSubmitChangedState(backend, currentGraphicsState);
+	backend->Draw(command->m_vertexCount, command->m_vertexStart);
 }
 
 void Draw::Dispose(const void *data) {
@@ -113,11 +126,11 @@ void Draw::Dispose(const void *data) {
 	command->~Draw();
 }
 
-void DrawIndexed::Execute(ID3D11Device *device, ID3D11DeviceContext *context, BlendStateManager *blendStateManager, RasterizerStateManager *rasterizerStateManager, DepthStencilStateManager *depthStencilStateManager, GraphicsState *currentGraphicsState, const void *data) {
+void DrawIndexed::Execute(RenderBackend *backend, GraphicsState *currentGraphicsState, const void *data) {
 	const DrawIndexed *command = reinterpret_cast<const DrawIndexed *>(data);
 
-	command->CheckAndSubmitChangedState(device, context, blendStateManager, rasterizerStateManager, depthStencilStateManager, currentGraphicsState);
-	context->DrawIndexed(command->m_indexCount, command->m_indexStart, command->m_vertexStart);
+	command->CheckAndSubmitChangedState(backend, currentGraphicsState);
+	backend->DrawIndexed(command->m_indexCount, command->m_indexStart, command->m_vertexStart);
 }
 
 void DrawIndexed::Dispose(const void *data) {
@@ -126,11 +139,11 @@ void DrawIndexed::Dispose(const void *data) {
 	command->~DrawIndexed();
 }
 
-void DrawIndexedInstanced::Execute(ID3D11Device *device, ID3D11DeviceContext *context, BlendStateManager *blendStateManager, RasterizerStateManager *rasterizerStateManager, DepthStencilStateManager *depthStencilStateManager, GraphicsState *currentGraphicsState, const void *data) {
+void DrawIndexedInstanced::Execute(RenderBackend *backend, GraphicsState *currentGraphicsState, const void *data) {
 	const DrawIndexedInstanced *command = reinterpret_cast<const DrawIndexedInstanced *>(data);
 
-	command->CheckAndSubmitChangedState(device, context, blendStateManager, rasterizerStateManager, depthStencilStateManager, currentGraphicsState);
-	context->DrawIndexedInstanced(command->m_indexCountPerInstance, command->m_instanceCount, command->m_indexStart, command->m_vertexStart, command->m_instanceStart);
+	command->CheckAndSubmitChangedState(backend, currentGraphicsState);
+	backend->DrawIndexedInstanced(command->m_indexCountPerInstance, command->m_instanceCount, command->m_indexStart, command->m_vertexStart, command->m_instanceStart);
 }
 
 void DrawIndexedInstanced::Dispose(const void *data) {
@@ -139,26 +152,100 @@ void DrawIndexedInstanced::Dispose(const void *data) {
 	command->~DrawIndexedInstanced();
 }
 
-void BindConstantBufferToVS::Execute(ID3D11Device *device, ID3D11DeviceContext *context, BlendStateManager *blendStateManager, RasterizerStateManager *rasterizerStateManager, DepthStencilStateManager *depthStencilStateManager, GraphicsState *currentGraphicsState, const void *data) {
+/** Uploads the fallback data of an allocation with a discard map. Only used if the backend doesn't support constant buffer offsets */
+static inline void UploadFallbackData(RenderBackend *backend, const ConstantBufferAllocation &allocation) {
+	size_t size = allocation.NumConstants * 16u;
+
+	void *mappedData = backend->Map(allocation.Buffer, D3D11_MAP_WRITE_DISCARD, size);
+	memcpy(mappedData, allocation.FallbackData, size);
+	backend->Unmap(allocation.Buffer);
+}
+
+/** Binds a ConstantRingBuffer window to the vertex shader */
+static inline void BindVSConstantBufferRange(RenderBackend *backend, uint slot, const ConstantBufferAllocation &allocation) {
+	if (allocation.FallbackData) {
+		UploadFallbackData(backend, allocation);
+		backend->SetVSConstantBuffers(slot, 1u, &allocation.Buffer);
+	} else {
+		backend->SetVSConstantBufferRanges(slot, 1u, &allocation.Buffer, &allocation.FirstConstant, &allocation.NumConstants);
+	}
+}
+
+bool DrawIndexedInstanceable::CanMergeWith(const DrawIndexedInstanceable &other) const {
+	return m_indexCount == other.m_indexCount &&
+	       m_indexStart == other.m_indexStart &&
+	       m_vertexStart == other.m_vertexStart &&
+	       m_instanceOffsetSlot == other.m_instanceOffsetSlot &&
+	       HasSameState(other);
+}
+
+void DrawIndexedInstanceable::Execute(RenderBackend *backend, GraphicsState *currentGraphicsState, const void *data) {
+	const DrawIndexedInstanceable *command = reinterpret_cast<const DrawIndexedInstanceable *>(data);
+
+	// The merge pass has to have run before we can be executed
+	assert(command->m_instanceCount > 0u);
+	assert(command->m_instanceOffset.Buffer != nullptr);
+
+	command->CheckAndSubmitChangedState(backend, currentGraphicsState);
+
+	// Tell the vertex shader where our instances start in the instance stream
+	BindVSConstantBufferRange(backend, command->m_instanceOffsetSlot, command->m_instanceOffset);
+
+	backend->DrawIndexedInstanced(command->m_indexCount, command->m_instanceCount, command->m_indexStart, command->m_vertexStart, 0u);
+}
+
+void DrawIndexedInstanceable::Dispose(const void *data) {
+	const DrawIndexedInstanceable *command = reinterpret_cast<const DrawIndexedInstanceable *>(data);
+
+	command->~DrawIndexedInstanceable();
+}
+
+void BindConstantBufferToVS::Execute(RenderBackend *backend, GraphicsState *currentGraphicsState, const void *data) {
 	const BindConstantBufferToVS *command = reinterpret_cast<const BindConstantBufferToVS *>(data);
 	
-	context->VSSetConstantBuffers(command->m_slot, 1u, &command->m_constantBuffer);
+	backend->SetVSConstantBuffers(command->m_slot, 1u, &command->m_constantBuffer);
 }
 
 void BindConstantBufferToVS::Dispose(const void *data) {
 	// No Op since class is a POS
 }
 
-void BindConstantBufferToPS::Execute(ID3D11Device *device, ID3D11DeviceContext *context, BlendStateManager *blendStateManager, RasterizerStateManager *rasterizerStateManager, DepthStencilStateManager *depthStencilStateManager, GraphicsState *currentGraphicsState, const void *data) {
+void BindConstantBufferToPS::Execute(RenderBackend *backend, GraphicsState *currentGraphicsState, const void *data) {
 	const BindConstantBufferToPS *command = reinterpret_cast<const BindConstantBufferToPS *>(data);
 
-	context->PSSetConstantBuffers(command->m_slot, 1u, &command->m_constantBuffer);
+	backend->SetPSConstantBuffers(command->m_slot, 1u, &command->m_constantBuffer);
 }
 
 void BindConstantBufferToPS::Dispose(const void *data) {
 	// No Op since class is a POS
 }
 
+void BindConstantBufferRangeToVS::Execute(RenderBackend *backend, GraphicsState *currentGraphicsState, const void *data) {
+	const BindConstantBufferRangeToVS *command = reinterpret_cast<const BindConstantBufferRangeToVS *>(data);
+
+	BindVSConstantBufferRange(backend, command->m_slot, command->m_allocation);
+}
+
+void BindConstantBufferRangeToVS::Dispose(const void *data) {
+	// No Op since class is a POS
+}
+
+void BindConstantBufferRangeToPS::Execute(RenderBackend *backend, GraphicsState *currentGraphicsState, const void *data) {
+	const BindConstantBufferRangeToPS *command = reinterpret_cast<const BindConstantBufferRangeToPS *>(data);
+	const ConstantBufferAllocation &allocation = command->m_allocation;
+
+	if (allocation.FallbackData) {
+		UploadFallbackData(backend, allocation);
+		backend->SetPSConstantBuffers(command->m_slot, 1u, &allocation.Buffer);
+	} else {
+		backend->SetPSConstantBufferRanges(command->m_slot, 1u, &allocation.Buffer, &allocation.FirstConstant, &allocation.NumConstants);
+	}
+}
+
+void BindConstantBufferRangeToPS::Dispose(const void *data) {
+	// No Op since class is a POS
+}
+
 } // End of namespace Commands
 
 } // End of namespace Graphics
@@ -8,18 +8,16 @@
 
 #include "common/typedefs.h"
 
+#include "graphics/constant_ring_buffer.h"
+#include "graphics/d3d11_types.h"
 #include "graphics/device_states.h"
-#include "graphics/d3d_util.h"
 #include "graphics/graphics_state.h"
-
-#include <d3d11.h>
+#include "graphics/render_backend.h"
 
 #include <cassert>
-#include <map>
+#include <cstring>
 
 
-struct ID3D11Device;
-struct ID3D11DeviceContext;
 struct ID3D11InputLayout;
 struct ID3D11Buffer;
 
@@ -28,19 +26,18 @@ namespace Graphics {
 
 namespace Commands {
 
+/**
+ * The base of all commands
+ *
+ * Derived must implement:
+ *     static void Execute(RenderBackend *backend, GraphicsState *currentGraphicsState, const void *data);
+ *     static void Dispose(const void *data);
+ *
+ * CommandBucket calls them through the static dispatch table. See CommandTypeId. 
+ * Dispose() is never called for commands that are trivially destructible
+ */
 template <typename Derived>
 class CommandBase {
-public:
-	static void Execute(ID3D11Device *device, ID3D11DeviceContext *context, 
-	                    BlendStateManager *blendStateManager, RasterizerStateManager *rasterizerStateManager, DepthStencilStateManager *depthStencilStateManager, 
-	                    GraphicsState *currentGraphicsState, 
-	                    const void *data) {
-		static_cast<Derived *>(this)->Execute(device, context, data);
-	}
-
-	static void Dispose(const void *data) {
-		static_cast<Derived *>(this)->Dispose(data);
-	}
 };
 
 class DrawCommandBase {
@@ -76,8 +73,9 @@ protected:
 	ID3D11Buffer *m_indexBuffer;
 	DXGI_FORMAT m_indexBufferFormat;
 
-	std::map<uint, ID3D11ShaderResourceView *> m_textureSRVs;
-	std::map<uint, ID3D11SamplerState *> m_textureSamplers;
+	// Stored inline with an occupancy mask so that creating a command never hits the heap
+	TextureSRVSlots m_textureSRVs;
+	TextureSamplerSlots m_textureSamplers;
 
 	BlendState m_blendState;
 	float m_blendFactor[4];
@@ -121,8 +119,17 @@ public:
 		m_indexBufferFormat = format;
 	}
 
-	inline void SetTextureSRV(ID3D11ShaderResourceView *srv, uint slot) { m_textureSRVs[slot] = srv; }
-	inline void SetTextureSampler(ID3D11SamplerState *sampler, uint slot) { m_textureSamplers[slot] = sampler; }
+	/**
+	 * Sets the texture SRV / sampler at a slot. Only slots below kMaxTextureSlots can be set. Higher slots
+	 * are refused, and have to be bound directly through the RenderBackend
+	 *
+	 * @return    False if the slot is kMaxTextureSlots or higher, and nothing was set
+	 */
+	inline bool SetTextureSRV(ID3D11ShaderResourceView *srv, uint slot) { return m_textureSRVs.Set(srv, slot); }
+	inline bool SetTextureSampler(ID3D11SamplerState *sampler, uint slot) { return m_textureSamplers.Set(sampler, slot); }
+	/** Replaces all the texture SRV slots at once. IE. with a set that was built ahead of time */
+	inline void SetTextureSRVs(const TextureSRVSlots &srvs) { m_textureSRVs = srvs; }
+	inline void SetTextureSamplers(const TextureSamplerSlots &samplers) { m_textureSamplers = samplers; }
 
 	inline void SetBlendState(BlendState blendState, float *blendFactor, uint sampleMask) {
 		m_blendState = blendState;
@@ -138,9 +145,9 @@ public:
 	inline void SetDepthStencilState(DepthStencilState depthStencilState) { m_depthStencilState = depthStencilState; }
 
 protected:
-	void CheckAndSubmitChangedState(ID3D11Device *device, ID3D11DeviceContext *context, 
-	                                BlendStateManager *blendStateManager, RasterizerStateManager *rasterizerStateManager, DepthStencilStateManager *depthStencilStateManager, 
-	                                GraphicsState *currentGraphicsState) const;
+	void CheckAndSubmitChangedState(RenderBackend *backend, GraphicsState *currentGraphicsState) const;
+	/** Returns true if executing 'other' after this command would cause no state changes */
+	bool HasSameState(const DrawCommandBase &other) const;
 };
 
 
@@ -159,10 +166,7 @@ public:
 	inline void SetVertexCount(uint vertexCount) { m_vertexCount = vertexCount; }
 	inline void SetVertexStart(uint vertexStart) { m_vertexStart = vertexStart; }
 
-	static void Execute(ID3D11Device *device, ID3D11DeviceContext *context, 
-	                    BlendStateManager *blendStateManager, RasterizerStateManager *rasterizerStateManager, DepthStencilStateManager *depthStencilStateManager, 
-	                    GraphicsState *currentGraphicsState, 
-	                    const void *data);
+	static void Execute(RenderBackend *backend, GraphicsState *currentGraphicsState, const void *data);
 
 	static void Dispose(const void *data);
 };
@@ -186,16 +190,13 @@ public:
 	inline void SetIndexStart(uint indexStart) { m_indexStart = indexStart; }
 	inline void SetVertexStart(uint vertexStart) { m_vertexStart = vertexStart; }
 
-	static void Execute(ID3D11Device *device, ID3D11DeviceContext *context,
-	                    BlendStateManager *blendStateManager, RasterizerStateManager *rasterizerStateManager, DepthStencilStateManager *depthStencilStateManager,
-	                    GraphicsState *currentGraphicsState,
-	                    const void *data);
+	static void Execute(RenderBackend *backend, GraphicsState *currentGraphicsState, const void *data);
 
 	static void Dispose(const void *data);
 };
 
 
-class DrawIndexedInstanced : public CommandBase<DrawIndexed>, public DrawCommandBase {
+class DrawIndexedInstanced : public CommandBase<DrawIndexedInstanced>, public DrawCommandBase {
 public:
 	DrawIndexedInstanced()
 		: m_indexCountPerInstance(0u),
@@ -222,10 +223,76 @@ public:
 	inline void SetIndexStart(uint indexStart) { m_indexStart = indexStart; }
 	inline void SetVertexStart(uint vertexStart) { m_vertexStart = vertexStart; }
 
-	static void Execute(ID3D11Device *device, ID3D11DeviceContext *context,
-	                    BlendStateManager *blendStateManager, RasterizerStateManager *rasterizerStateManager, DepthStencilStateManager *depthStencilStateManager,
-	                    GraphicsState *currentGraphicsState,
-	                    const void *data);
+	static void Execute(RenderBackend *backend, GraphicsState *currentGraphicsState, const void *data);
+
+	static void Dispose(const void *data);
+};
+
+/**
+ * An indexed draw of a single object whose per-object data lives in a persistent GPU buffer
+ * (IE. a PersistentStructuredBuffer of world matrices) at 'objectIndex'.
+ *
+ * The command always draws through an instanced vertex shader that reads its object index
+ * from a StructuredBuffer<uint> instance stream, starting at the instance offset stored in
+ * the first uint of the constant buffer at 'instanceOffsetSlot'. When CommandBucket::Submit()
+ * finds a run of these commands (after sorting) that only differ by their object index, it
+ * gathers the indices into the bucket's instance stream and issues a single DrawIndexedInstanced
+ * for the whole run. The instance offset of each run is written to a window of the bucket's
+ * ConstantRingBuffer, so the runs don't each need a discard map of a constant buffer.
+ *
+ * Since only the index is streamed, the per-object data itself is only uploaded when it changes.
+ *
+ * NOTE: This command must be the only command in its packet. IE. Don't append to it, and don't
+ *       append it to other commands.
+ */
+class DrawIndexedInstanceable : public CommandBase<DrawIndexedInstanceable>, public DrawCommandBase {
+public:
+	DrawIndexedInstanceable()
+		: m_indexCount(0u),
+		  m_indexStart(0u),
+		  m_vertexStart(0u),
+		  m_instanceOffsetSlot(0u),
+		  m_objectIndex(0u),
+		  m_instanceStart(0u),
+		  m_instanceCount(0u) {
+	}
+
+private:
+	uint m_indexCount;
+	uint m_indexStart;
+	uint m_vertexStart;
+
+	uint m_instanceOffsetSlot;
+
+	// The index of the object's data in the persistent per-object buffer
+	uint m_objectIndex;
+
+	// Filled in by the CommandBucket merge pass
+	uint m_instanceStart;
+	uint m_instanceCount;
+	ConstantBufferAllocation m_instanceOffset;
+
+public:
+	inline void SetIndexCount(uint indexCount) { m_indexCount = indexCount; }
+	inline void SetIndexStart(uint indexStart) { m_indexStart = indexStart; }
+	inline void SetVertexStart(uint vertexStart) { m_vertexStart = vertexStart; }
+	/** Sets the vertex shader constant buffer slot that the instance offset is bound to */
+	inline void SetInstanceOffsetSlot(uint slot) { m_instanceOffsetSlot = slot; }
+	inline void SetObjectIndex(uint objectIndex) { m_objectIndex = objectIndex; }
+
+	inline void SetInstanceRange(uint instanceStart, uint instanceCount, const ConstantBufferAllocation &instanceOffset) {
+		m_instanceStart = instanceStart;
+		m_instanceCount = instanceCount;
+		m_instanceOffset = instanceOffset;
+	}
+	inline uint GetInstanceStart() const { return m_instanceStart; }
+	inline uint GetInstanceCount() const { return m_instanceCount; }
+	inline uint GetObjectIndex() const { return m_objectIndex; }
+
+	/** Returns true if 'other' can be drawn as another instance of this command */
+	bool CanMergeWith(const DrawIndexedInstanceable &other) const;
+
+	static void Execute(RenderBackend *backend, GraphicsState *currentGraphicsState, const void *data);
 
 	static void Dispose(const void *data);
 };
@@ -245,28 +312,22 @@ public:
 	inline void SetConstantBuffer(ID3D11Buffer *buffer) { m_constantBuffer = buffer; }
 	inline void SetData(T &data) { m_constantBufferData = data; }
 
-	static void Execute(ID3D11Device *device, ID3D11DeviceContext *context,
-	                    BlendStateManager *blendStateManager, RasterizerStateManager *rasterizerStateManager, DepthStencilStateManager *depthStencilStateManager,
-	                    GraphicsState *currentGraphicsState,
-	                    const void *data);
+	static void Execute(RenderBackend *backend, GraphicsState *currentGraphicsState, const void *data);
 
 	static void Dispose(const void *data);
 };
 
 template <typename T>
-void Graphics::Commands::MapDataToConstantBuffer<T>::Execute(ID3D11Device *device, ID3D11DeviceContext *context, BlendStateManager *blendStateManager, RasterizerStateManager *rasterizerStateManager, DepthStencilStateManager *depthStencilStateManager, GraphicsState *currentGraphicsState, const void *data) {
+void Graphics::Commands::MapDataToConstantBuffer<T>::Execute(RenderBackend *backend, GraphicsState *currentGraphicsState, const void *data) {
 	const MapDataToConstantBuffer *command = reinterpret_cast<const MapDataToConstantBuffer *>(data);
 
 	// Make sure the buffer even exists
 	assert(command->m_constantBuffer != nullptr);
 
-	// Map the data
-	D3D11_MAPPED_SUBRESOURCE mappedResource;
-
 	// Lock the constant buffer so it can be written to.
-	HR(context->Map(command->m_constantBuffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &mappedResource));
-	memcpy(mappedResource.pData, &command->m_constantBufferData, sizeof(command->m_constantBufferData));
-	context->Unmap(command->m_constantBuffer, 0);
+	void *mappedData = backend->Map(command->m_constantBuffer, D3D11_MAP_WRITE_DISCARD, sizeof(command->m_constantBufferData));
+	memcpy(mappedData, &command->m_constantBufferData, sizeof(command->m_constantBufferData));
+	backend->Unmap(command->m_constantBuffer);
 }
 
 template <typename T>
@@ -288,10 +349,7 @@ private:
 public:
 	inline void SetConstantBuffer(ID3D11Buffer *buffer, uint slot) { m_constantBuffer = buffer; m_slot = slot; }
 
-	static void Execute(ID3D11Device *device, ID3D11DeviceContext *context,
-	                    BlendStateManager *blendStateManager, RasterizerStateManager *rasterizerStateManager, DepthStencilStateManager *depthStencilStateManager,
-	                    GraphicsState *currentGraphicsState,
-	                    const void *data);
+	static void Execute(RenderBackend *backend, GraphicsState *currentGraphicsState, const void *data);
 
 	static void Dispose(const void *data);
 };
@@ -310,10 +368,50 @@ private:
 public:
 	inline void SetConstantBuffer(ID3D11Buffer *buffer, uint slot) { m_constantBuffer = buffer; m_slot = slot; }
 
-	static void Execute(ID3D11Device *device, ID3D11DeviceContext *context,
-	                    BlendStateManager *blendStateManager, RasterizerStateManager *rasterizerStateManager, DepthStencilStateManager *depthStencilStateManager,
-	                    GraphicsState *currentGraphicsState,
-	                    const void *data);
+	static void Execute(RenderBackend *backend, GraphicsState *currentGraphicsState, const void *data);
+
+	static void Dispose(const void *data);
+};
+
+/**
+ * Binds a window of a ConstantRingBuffer to a VS slot
+ *
+ * If the backend doesn't support constant buffer offsets, the allocation's
+ * fallback data is uploaded with a discard map and the whole buffer is bound instead
+ */
+class BindConstantBufferRangeToVS : public CommandBase<BindConstantBufferRangeToVS> {
+public:
+	BindConstantBufferRangeToVS()
+		: m_slot(0u) {
+	}
+
+private:
+	ConstantBufferAllocation m_allocation;
+	uint m_slot;
+
+public:
+	inline void SetAllocation(const ConstantBufferAllocation &allocation, uint slot) { m_allocation = allocation; m_slot = slot; }
+
+	static void Execute(RenderBackend *backend, GraphicsState *currentGraphicsState, const void *data);
+
+	static void Dispose(const void *data);
+};
+
+/** The PS equivalent of BindConstantBufferRangeToVS */
+class BindConstantBufferRangeToPS : public CommandBase<BindConstantBufferRangeToPS> {
+public:
+	BindConstantBufferRangeToPS()
+		: m_slot(0u) {
+	}
+
+private:
+	ConstantBufferAllocation m_allocation;
+	uint m_slot;
+
+public:
+	inline void SetAllocation(const ConstantBufferAllocation &allocation, uint slot) { m_allocation = allocation; m_slot = slot; }
+
+	static void Execute(RenderBackend *backend, GraphicsState *currentGraphicsState, const void *data);
 
 	static void Dispose(const void *data);
 };
@@ -0,0 +1,183 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "graphics/constant_ring_buffer.h"
+
+#include "common/halfling_sys.h"
+
+#include <cstring>
+
+
+namespace Graphics {
+
+ConstantRingBuffer::ConstantRingBuffer(RenderBackend *backend, uint sizeInBytes, uint maxAllocationSize)
+		: m_backend(backend),
+		  m_useOffsets(backend->SupportsConstantBufferOffsets()),
+		  m_size((sizeInBytes + kAlignment - 1u) & ~(kAlignment - 1u)),
+		  m_maxAllocationSize((maxAllocationSize + kAlignment - 1u) & ~(kAlignment - 1u)),
+		  m_buffer(nullptr),
+		  m_mappedData(nullptr),
+		  m_hasBeenMapped(false),
+		  m_head(0u),
+		  m_bytesInUse(0u),
+		  m_frameSize(0u),
+		  m_frameUploadSize(0u),
+		  m_unfencedFrameSize(0u) {
+	D3D11_BUFFER_DESC desc;
+	desc.Usage = D3D11_USAGE_DYNAMIC;
+	desc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+	desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+	desc.MiscFlags = 0u;
+	desc.StructureByteStride = 0u;
+
+	if (m_useOffsets) {
+		desc.ByteWidth = m_size;
+	} else {
+		// The fallback path uploads one allocation at a time
+		desc.ByteWidth = m_maxAllocationSize;
+		m_fallbackData.resize(m_size);
+	}
+
+	m_buffer = m_backend->CreateBuffer(desc, nullptr);
+}
+
+ConstantRingBuffer::~ConstantRingBuffer() {
+	AssertMsg(m_mappedData == nullptr, "The ring is destroyed in the middle of a frame");
+
+	for (auto iter = m_framesInFlight.begin(); iter != m_framesInFlight.end(); ++iter) {
+		m_backend->ReleaseFence(iter->Fence);
+	}
+	for (auto iter = m_freeFences.begin(); iter != m_freeFences.end(); ++iter) {
+		m_backend->ReleaseFence(*iter);
+	}
+
+	m_backend->ReleaseBuffer(m_buffer);
+}
+
+void ConstantRingBuffer::BeginFrame() {
+	AssertMsg(m_mappedData == nullptr, "BeginFrame() was called twice without an EndFrame()");
+
+	m_frameSize = 0u;
+	m_frameUploadSize = 0u;
+
+	if (!m_useOffsets) {
+		// The CPU copy is consumed by Submit() within the same frame, so there's nothing to fence
+		m_head = 0u;
+		m_mappedData = &m_fallbackData.front();
+		return;
+	}
+
+	// The draws that read the previous frame's region have been submitted by now, so we can fence them
+	if (m_unfencedFrameSize != 0u) {
+		FrameMarker marker;
+		if (m_freeFences.empty()) {
+			marker.Fence = m_backend->CreateFence();
+		} else {
+			marker.Fence = m_freeFences.back();
+			m_freeFences.pop_back();
+		}
+		marker.Size = m_unfencedFrameSize;
+
+		m_backend->IssueFence(marker.Fence);
+		m_framesInFlight.push_back(marker);
+
+		m_unfencedFrameSize = 0u;
+	}
+
+	while (RetireOldestFrame(false)) {
+		// Keep retiring until we hit a frame the GPU is still using
+	}
+
+	// The very first map of a dynamic buffer has to be a discard. Afterwards, the fences
+	// guarantee we never write over data the GPU could be reading
+	m_mappedData = static_cast<byte *>(m_backend->Map(m_buffer, m_hasBeenMapped ? D3D11_MAP_WRITE_NO_OVERWRITE : D3D11_MAP_WRITE_DISCARD, 0u));
+	m_hasBeenMapped = true;
+}
+
+ConstantBufferAllocation ConstantRingBuffer::Allocate(const void *data, uint size) {
+	AssertMsg(m_mappedData != nullptr, "Allocate() must be called between BeginFrame() and EndFrame()");
+	AssertMsg(size <= m_maxAllocationSize, "Allocation of " << size << " bytes is larger than the max allocation size of " << m_maxAllocationSize);
+
+	uint alignedSize = (size + kAlignment - 1u) & ~(kAlignment - 1u);
+
+	// Skip to the start of the ring if the allocation doesn't fit at the end
+	uint padding = 0u;
+	if (m_head + alignedSize > m_size) {
+		padding = m_size - m_head;
+	}
+
+	if (m_useOffsets) {
+		// Wait for the GPU to free up enough space
+		while (m_bytesInUse + padding + alignedSize > m_size) {
+			bool retired = RetireOldestFrame(true);
+			AssertMsg(retired, "A single frame allocated more than the " << m_size << " bytes of the constant ring buffer");
+			if (!retired) {
+				return ConstantBufferAllocation();
+			}
+		}
+	} else {
+		AssertMsg(padding == 0u, "A single frame allocated more than the " << m_size << " bytes of the constant ring buffer");
+		if (padding != 0u) {
+			return ConstantBufferAllocation();
+		}
+	}
+
+	m_head = (m_head + padding) % m_size;
+	m_bytesInUse += padding + alignedSize;
+	m_frameSize += padding + alignedSize;
+	m_frameUploadSize += size;
+
+	memcpy(m_mappedData + m_head, data, size);
+
+	ConstantBufferAllocation allocation;
+	allocation.Buffer = m_buffer;
+	allocation.FirstConstant = m_head / 16u;
+	allocation.NumConstants = alignedSize / 16u;
+	allocation.FallbackData = m_useOffsets ? nullptr : m_mappedData + m_head;
+
+	m_head += alignedSize;
+
+	return allocation;
+}
+
+void ConstantRingBuffer::EndFrame() {
+	AssertMsg(m_mappedData != nullptr, "EndFrame() was called without a BeginFrame()");
+	m_mappedData = nullptr;
+
+	if (!m_useOffsets) {
+		return;
+	}
+
+	m_backend->Unmap(m_buffer);
+	m_backend->RecordUpload(m_frameUploadSize);
+
+	// The draws that use this frame's allocations haven't been submitted yet. 
+	// So the fence is issued at the start of the next frame
+	m_unfencedFrameSize = m_frameSize;
+}
+
+bool ConstantRingBuffer::RetireOldestFrame(bool wait) {
+	if (m_framesInFlight.empty()) {
+		return false;
+	}
+
+	FrameMarker &marker = m_framesInFlight.front();
+	if (wait) {
+		while (!m_backend->IsFenceComplete(marker.Fence)) {
+			// Spin
+		}
+	} else if (!m_backend->IsFenceComplete(marker.Fence)) {
+		return false;
+	}
+
+	m_bytesInUse -= marker.Size;
+	m_freeFences.push_back(marker.Fence);
+	m_framesInFlight.pop_front();
+
+	return true;
+}
+
+} // End of namespace Graphics
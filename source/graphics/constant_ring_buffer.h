@@ -0,0 +1,135 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "common/typedefs.h"
+
+#include "graphics/d3d11_types.h"
+#include "graphics/render_backend.h"
+
+#include <deque>
+#include <vector>
+
+
+namespace Graphics {
+
+/** A window into a ConstantRingBuffer, as returned by ConstantRingBuffer::Allocate() */
+struct ConstantBufferAllocation {
+	ConstantBufferAllocation()
+		: Buffer(nullptr),
+		  FirstConstant(0u),
+		  NumConstants(0u),
+		  FallbackData(nullptr) {
+	}
+
+	ID3D11Buffer *Buffer;
+	/** The offset of the window, in 16 byte constants */
+	uint FirstConstant;
+	/** The size of the window, in 16 byte constants */
+	uint NumConstants;
+	/** 
+	 * If the backend doesn't support constant buffer offsets, this points to a CPU copy of the data.
+	 * It has to be uploaded to Buffer with a discard map before the buffer is bound.
+	 * nullptr otherwise
+	 */
+	const void *FallbackData;
+};
+
+/**
+ * A large dynamic constant buffer that per-object constants are sub-allocated from
+ *
+ * Instead of a WRITE_DISCARD map of a tiny constant buffer for every draw, the ring is mapped
+ * once per frame with WRITE_NO_OVERWRITE and the windows are bound with Set*ConstantBufferRanges().
+ * Every frame's region is fenced, so the ring knows when the GPU is done with it and it can be
+ * written over again.
+ *
+ * If the backend doesn't support constant buffer offsets, the data is kept in a CPU-side copy
+ * and uploaded to a small constant buffer with a discard map when the allocation is bound.
+ *
+ * Usage:
+ *     ring.BeginFrame();
+ *     ConstantBufferAllocation allocation = ring.Allocate(data);
+ *     ... Add a BindConstantBufferRangeToVS command with 'allocation'
+ *     ring.EndFrame();
+ *     bucket.Submit(...);
+ *
+ * EndFrame() must be called before any of the allocations are used in a draw, since the ring is mapped in between
+ */
+class ConstantRingBuffer {
+public:
+	/**
+	 * @param backend              The backend to create and map the buffers with
+	 * @param sizeInBytes          The size of the ring. It must be able to hold every allocation of a frame
+	 * @param maxAllocationSize    The largest allocation that will be made. Only used to size the buffer of the fallback path
+	 */
+	ConstantRingBuffer(RenderBackend *backend, uint sizeInBytes, uint maxAllocationSize = 4096u);
+	~ConstantRingBuffer();
+
+private:
+	/** Constant buffer windows must start and end on 16 constant (256 byte) boundaries */
+	static const uint kAlignment = 256u;
+
+	struct FrameMarker {
+		ID3D11Query *Fence;
+		/** The number of bytes the frame used, including any padding at the wrap point */
+		uint Size;
+	};
+
+	RenderBackend *m_backend;
+	bool m_useOffsets;
+
+	uint m_size;
+	uint m_maxAllocationSize;
+
+	ID3D11Buffer *m_buffer;
+	byte *m_mappedData;
+	bool m_hasBeenMapped;
+
+	/** CPU-side storage for the fallback path */
+	std::vector<byte> m_fallbackData;
+
+	uint m_head;
+	/** The number of bytes still in use by frames in flight, including the current one */
+	uint m_bytesInUse;
+	uint m_frameSize;
+	uint m_frameUploadSize;
+	/** The size of the last frame. Its fence is issued in the next BeginFrame() */
+	uint m_unfencedFrameSize;
+
+	std::deque<FrameMarker> m_framesInFlight;
+	std::vector<ID3D11Query *> m_freeFences;
+
+public:
+	/** Fences the previous frame, retires the frames the GPU has finished with, and maps the ring */
+	void BeginFrame();
+	/**
+	 * Copies data into the ring
+	 *
+	 * If the ring is full of data that is still in flight, this will block until the GPU catches up
+	 *
+	 * @param data    The data to copy
+	 * @param size    The size of the data in bytes
+	 * @return        The window the data was written to
+	 */
+	ConstantBufferAllocation Allocate(const void *data, uint size);
+	template <typename T>
+	inline ConstantBufferAllocation Allocate(const T &data) { return Allocate(&data, sizeof(T)); }
+	/** Unmaps the ring */
+	void EndFrame();
+
+	inline bool UsesOffsets() const { return m_useOffsets; }
+
+private:
+	/** Returns true if a frame was retired */
+	bool RetireOldestFrame(bool wait);
+
+	// Not implemented
+	ConstantRingBuffer(const ConstantRingBuffer &);
+	ConstantRingBuffer &operator=(const ConstantRingBuffer &);
+};
+
+} // End of namespace Graphics
@@ -0,0 +1,227 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "graphics/d3d11_render_backend.h"
+
+#include "graphics/d3d_util.h"
+#include "graphics/shader.h"
+
+
+namespace Graphics {
+
+D3D11RenderBackend::D3D11RenderBackend(ID3D11Device *device, ID3D11DeviceContext *context,
+                                       BlendStateManager *blendStateManager, RasterizerStateManager *rasterizerStateManager, DepthStencilStateManager *depthStencilStateManager)
+		: m_device(device),
+		  m_context(context),
+		  m_context1(nullptr),
+		  m_supportsNoOverwriteShaderResourceBuffers(false),
+		  m_blendStateManager(blendStateManager),
+		  m_rasterizerStateManager(rasterizerStateManager),
+		  m_depthStencilStateManager(depthStencilStateManager) {
+	// Constant buffer offsets need the D3D11.1 runtime *and* driver support
+	D3D11_FEATURE_DATA_D3D11_OPTIONS options;
+	if (SUCCEEDED(m_device->CheckFeatureSupport(D3D11_FEATURE_D3D11_OPTIONS, &options, sizeof(options)))) {
+		if (options.ConstantBufferOffsetting && options.MapNoOverwriteOnDynamicConstantBuffer) {
+			if (FAILED(m_context->QueryInterface(__uuidof(ID3D11DeviceContext1), reinterpret_cast<void **>(&m_context1)))) {
+				m_context1 = nullptr;
+			}
+		}
+		m_supportsNoOverwriteShaderResourceBuffers = options.MapNoOverwriteOnDynamicBufferSRV != FALSE;
+	}
+}
+
+D3D11RenderBackend::~D3D11RenderBackend() {
+	ReleaseCOM(m_context1);
+}
+
+ID3D11Buffer *D3D11RenderBackend::CreateBuffer(const D3D11_BUFFER_DESC &desc, const void *initialData) {
+	D3D11_SUBRESOURCE_DATA initData;
+	initData.pSysMem = initialData;
+	initData.SysMemPitch = 0u;
+	initData.SysMemSlicePitch = 0u;
+
+	ID3D11Buffer *buffer;
+	HR(m_device->CreateBuffer(&desc, initialData ? &initData : nullptr, &buffer));
+
+	++m_stats.BuffersCreated;
+	if (initialData) {
+		m_stats.BytesUploaded += desc.ByteWidth;
+	}
+
+	return buffer;
+}
+
+void D3D11RenderBackend::ReleaseBuffer(ID3D11Buffer *buffer) {
+	ReleaseCOM(buffer);
+}
+
+ID3D11ShaderResourceView *D3D11RenderBackend::CreateBufferShaderResource(ID3D11Buffer *buffer) {
+	ID3D11ShaderResourceView *shaderResource;
+	HR(m_device->CreateShaderResourceView(buffer, nullptr, &shaderResource));
+
+	return shaderResource;
+}
+
+void D3D11RenderBackend::ReleaseShaderResource(ID3D11ShaderResourceView *shaderResource) {
+	ReleaseCOM(shaderResource);
+}
+
+void D3D11RenderBackend::SetMaterialShader(MaterialShader *shader) {
+	if (shader == nullptr) {
+		m_context->PSSetShader(nullptr, nullptr, 0u);
+	} else {
+		shader->BindToPipeline(m_context);
+	}
+	++m_stats.ShaderBinds;
+}
+
+void D3D11RenderBackend::SetVertexBuffers(uint startSlot, uint count, ID3D11Buffer * const *buffers, const uint *strides, const uint *offsets) {
+	m_context->IASetVertexBuffers(startSlot, count, buffers, strides, offsets);
+	++m_stats.VertexBufferBinds;
+}
+
+void D3D11RenderBackend::SetIndexBuffer(ID3D11Buffer *buffer, DXGI_FORMAT format, uint offset) {
+	m_context->IASetIndexBuffer(buffer, format, offset);
+	++m_stats.IndexBufferBinds;
+}
+
+void D3D11RenderBackend::SetVSShaderResources(uint startSlot, uint count, ID3D11ShaderResourceView * const *srvs) {
+	m_context->VSSetShaderResources(startSlot, count, srvs);
+	++m_stats.ShaderResourceBinds;
+}
+
+void D3D11RenderBackend::SetPSShaderResources(uint startSlot, uint count, ID3D11ShaderResourceView * const *srvs) {
+	m_context->PSSetShaderResources(startSlot, count, srvs);
+	++m_stats.ShaderResourceBinds;
+}
+
+void D3D11RenderBackend::SetPSSamplers(uint startSlot, uint count, ID3D11SamplerState * const *samplers) {
+	m_context->PSSetSamplers(startSlot, count, samplers);
+	++m_stats.SamplerBinds;
+}
+
+void D3D11RenderBackend::SetVSConstantBuffers(uint startSlot, uint count, ID3D11Buffer * const *buffers) {
+	m_context->VSSetConstantBuffers(startSlot, count, buffers);
+	++m_stats.ConstantBufferBinds;
+}
+
+void D3D11RenderBackend::SetPSConstantBuffers(uint startSlot, uint count, ID3D11Buffer * const *buffers) {
+	m_context->PSSetConstantBuffers(startSlot, count, buffers);
+	++m_stats.ConstantBufferBinds;
+}
+
+void D3D11RenderBackend::SetVSConstantBufferRanges(uint startSlot, uint count, ID3D11Buffer * const *buffers, const uint *firstConstants, const uint *numConstants) {
+	m_context1->VSSetConstantBuffers1(startSlot, count, buffers, firstConstants, numConstants);
+	++m_stats.ConstantBufferBinds;
+}
+
+void D3D11RenderBackend::SetPSConstantBufferRanges(uint startSlot, uint count, ID3D11Buffer * const *buffers, const uint *firstConstants, const uint *numConstants) {
+	m_context1->PSSetConstantBuffers1(startSlot, count, buffers, firstConstants, numConstants);
+	++m_stats.ConstantBufferBinds;
+}
+
+void D3D11RenderBackend::SetBlendState(BlendState state, const float blendFactor[4], uint sampleMask) {
+	m_context->OMSetBlendState(m_blendStateManager->GetD3DState(state), blendFactor, sampleMask);
+	++m_stats.BlendStateChanges;
+}
+
+void D3D11RenderBackend::SetRasterizerState(RasterizerState state) {
+	m_context->RSSetState(m_rasterizerStateManager->GetD3DState(state));
+	++m_stats.RasterizerStateChanges;
+}
+
+void D3D11RenderBackend::SetDepthStencilState(DepthStencilState state, uint stencilRef) {
+	m_context->OMSetDepthStencilState(m_depthStencilStateManager->GetD3DState(state), stencilRef);
+	++m_stats.DepthStencilStateChanges;
+}
+
+void *D3D11RenderBackend::Map(ID3D11Buffer *buffer, D3D11_MAP mapType, size_t bytesToWrite) {
+	D3D11_MAPPED_SUBRESOURCE mappedResource;
+	HR(m_context->Map(buffer, 0, mapType, 0, &mappedResource));
+
+	++m_stats.Maps;
+	m_stats.DiscardMaps += mapType == D3D11_MAP_WRITE_DISCARD ? 1u : 0u;
+	m_stats.BytesUploaded += bytesToWrite;
+
+	return mappedResource.pData;
+}
+
+void D3D11RenderBackend::Unmap(ID3D11Buffer *buffer) {
+	m_context->Unmap(buffer, 0);
+}
+
+void D3D11RenderBackend::UpdateBuffer(ID3D11Buffer *buffer, uint byteOffset, uint byteSize, const void *data) {
+	D3D11_BOX box;
+	box.left = byteOffset;
+	box.right = byteOffset + byteSize;
+	box.top = 0u;
+	box.bottom = 1u;
+	box.front = 0u;
+	box.back = 1u;
+
+	m_context->UpdateSubresource(buffer, 0, &box, data, 0, 0);
+
+	++m_stats.BufferUpdates;
+	m_stats.BytesUploaded += byteSize;
+}
+
+void D3D11RenderBackend::CopyBuffer(ID3D11Buffer *dest, uint destOffset, ID3D11Buffer *source, uint sourceOffset, uint byteSize) {
+	D3D11_BOX box;
+	box.left = sourceOffset;
+	box.right = sourceOffset + byteSize;
+	box.top = 0u;
+	box.bottom = 1u;
+	box.front = 0u;
+	box.back = 1u;
+
+	m_context->CopySubresourceRegion(dest, 0, destOffset, 0, 0, source, 0, &box);
+
+	++m_stats.BufferCopies;
+}
+
+ID3D11Query *D3D11RenderBackend::CreateFence() {
+	D3D11_QUERY_DESC desc;
+	desc.Query = D3D11_QUERY_EVENT;
+	desc.MiscFlags = 0u;
+
+	ID3D11Query *fence;
+	HR(m_device->CreateQuery(&desc, &fence));
+
+	return fence;
+}
+
+void D3D11RenderBackend::ReleaseFence(ID3D11Query *fence) {
+	ReleaseCOM(fence);
+}
+
+void D3D11RenderBackend::IssueFence(ID3D11Query *fence) {
+	m_context->End(fence);
+}
+
+bool D3D11RenderBackend::IsFenceComplete(ID3D11Query *fence) {
+	BOOL complete = FALSE;
+	return m_context->GetData(fence, &complete, sizeof(complete), 0u) == S_OK && complete;
+}
+
+void D3D11RenderBackend::Draw(uint vertexCount, uint vertexStart) {
+	m_context->Draw(vertexCount, vertexStart);
+	++m_stats.DrawCalls;
+}
+
+void D3D11RenderBackend::DrawIndexed(uint indexCount, uint indexStart, int vertexStart) {
+	m_context->DrawIndexed(indexCount, indexStart, vertexStart);
+	++m_stats.DrawCalls;
+	m_stats.IndicesSubmitted += indexCount;
+}
+
+void D3D11RenderBackend::DrawIndexedInstanced(uint indexCountPerInstance, uint instanceCount, uint indexStart, int vertexStart, uint instanceStart) {
+	m_context->DrawIndexedInstanced(indexCountPerInstance, instanceCount, indexStart, vertexStart, instanceStart);
+	++m_stats.DrawCalls;
+	m_stats.IndicesSubmitted += static_cast<uint64>(indexCountPerInstance) * instanceCount;
+	m_stats.InstancesSubmitted += instanceCount;
+}
+
+} // End of namespace Graphics
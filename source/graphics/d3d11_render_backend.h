@@ -0,0 +1,85 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "graphics/render_backend.h"
+
+#include <d3d11_1.h>
+
+
+namespace Graphics {
+
+/** 
+ * A RenderBackend that forwards everything to a D3D11 device and immediate context 
+ *
+ * Constant buffer offsets are used if the runtime is D3D11.1 or later and the driver 
+ * supports both offsetting and NO_OVERWRITE maps of dynamic constant buffers
+ *
+ * NO_OVERWRITE maps of dynamic shader resource buffers also need a D3D11.1 runtime and driver
+ */
+class D3D11RenderBackend : public RenderBackend {
+public:
+	D3D11RenderBackend(ID3D11Device *device, ID3D11DeviceContext *context, 
+	                   BlendStateManager *blendStateManager, RasterizerStateManager *rasterizerStateManager, DepthStencilStateManager *depthStencilStateManager);
+	~D3D11RenderBackend();
+
+private:
+	ID3D11Device *m_device;
+	ID3D11DeviceContext *m_context;
+	/** The D3D11.1 interface of m_context. nullptr if constant buffer offsets aren't supported */
+	ID3D11DeviceContext1 *m_context1;
+	bool m_supportsNoOverwriteShaderResourceBuffers;
+
+	BlendStateManager *m_blendStateManager;
+	RasterizerStateManager *m_rasterizerStateManager;
+	DepthStencilStateManager *m_depthStencilStateManager;
+
+public:
+	inline ID3D11Device *GetDevice() { return m_device; }
+	inline ID3D11DeviceContext *GetContext() { return m_context; }
+
+	inline bool SupportsConstantBufferOffsets() const { return m_context1 != nullptr; }
+	inline bool SupportsNoOverwriteShaderResourceBuffers() const { return m_supportsNoOverwriteShaderResourceBuffers; }
+
+	ID3D11Buffer *CreateBuffer(const D3D11_BUFFER_DESC &desc, const void *initialData);
+	void ReleaseBuffer(ID3D11Buffer *buffer);
+	ID3D11ShaderResourceView *CreateBufferShaderResource(ID3D11Buffer *buffer);
+	void ReleaseShaderResource(ID3D11ShaderResourceView *shaderResource);
+
+	void SetMaterialShader(MaterialShader *shader);
+
+	void SetVertexBuffers(uint startSlot, uint count, ID3D11Buffer * const *buffers, const uint *strides, const uint *offsets);
+	void SetIndexBuffer(ID3D11Buffer *buffer, DXGI_FORMAT format, uint offset);
+
+	void SetVSShaderResources(uint startSlot, uint count, ID3D11ShaderResourceView * const *srvs);
+	void SetPSShaderResources(uint startSlot, uint count, ID3D11ShaderResourceView * const *srvs);
+	void SetPSSamplers(uint startSlot, uint count, ID3D11SamplerState * const *samplers);
+	void SetVSConstantBuffers(uint startSlot, uint count, ID3D11Buffer * const *buffers);
+	void SetPSConstantBuffers(uint startSlot, uint count, ID3D11Buffer * const *buffers);
+	void SetVSConstantBufferRanges(uint startSlot, uint count, ID3D11Buffer * const *buffers, const uint *firstConstants, const uint *numConstants);
+	void SetPSConstantBufferRanges(uint startSlot, uint count, ID3D11Buffer * const *buffers, const uint *firstConstants, const uint *numConstants);
+
+	void SetBlendState(BlendState state, const float blendFactor[4], uint sampleMask);
+	void SetRasterizerState(RasterizerState state);
+	void SetDepthStencilState(DepthStencilState state, uint stencilRef);
+
+	void *Map(ID3D11Buffer *buffer, D3D11_MAP mapType, size_t bytesToWrite);
+	void Unmap(ID3D11Buffer *buffer);
+	void UpdateBuffer(ID3D11Buffer *buffer, uint byteOffset, uint byteSize, const void *data);
+	void CopyBuffer(ID3D11Buffer *dest, uint destOffset, ID3D11Buffer *source, uint sourceOffset, uint byteSize);
+
+	ID3D11Query *CreateFence();
+	void ReleaseFence(ID3D11Query *fence);
+	void IssueFence(ID3D11Query *fence);
+	bool IsFenceComplete(ID3D11Query *fence);
+
+	void Draw(uint vertexCount, uint vertexStart);
+	void DrawIndexed(uint indexCount, uint indexStart, int vertexStart);
+	void DrawIndexedInstanced(uint indexCountPerInstance, uint instanceCount, uint indexStart, int vertexStart, uint instanceStart);
+};
+
+} // End of namespace Graphics
@@ -0,0 +1,103 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+// The D3D11 types that the RenderBackend interface and the headless backends use
+//
+// On Windows, this is just d3d11.h. Everywhere else, IE. the Linux build farm, there
+// is no Windows SDK. The D3D objects are only ever passed around as opaque handles
+// there, so they're forward declared. The handful of descs and enums that the
+// command and upload paths fill in are declared with the same names and values
+// as d3d11.h, so the code that uses them is the same on every platform.
+//
+// Only add to the non-Windows half what the headless code needs. Anything that
+// actually talks to D3D belongs in a D3D11-only file, like D3D11RenderBackend
+
+#if defined(_WIN32)
+
+#include <d3d11.h>
+
+#else
+
+// Handles
+struct ID3D11Device;
+struct ID3D11DeviceContext;
+struct ID3D11Buffer;
+struct ID3D11ShaderResourceView;
+struct ID3D11UnorderedAccessView;
+struct ID3D11SamplerState;
+struct ID3D11BlendState;
+struct ID3D11RasterizerState;
+struct ID3D11DepthStencilState;
+struct ID3D11InputLayout;
+struct ID3D11VertexShader;
+struct ID3D11PixelShader;
+struct ID3D11ComputeShader;
+struct ID3D11Query;
+
+// Descs that are only passed by value or pointer in declarations
+struct D3D11_BLEND_DESC;
+struct D3D11_RASTERIZER_DESC;
+struct D3D11_DEPTH_STENCIL_DESC;
+struct D3D11_SAMPLER_DESC;
+struct D3D11_INPUT_ELEMENT_DESC;
+
+typedef long HRESULT;
+
+#define D3D11_COMMONSHADER_SAMPLER_SLOT_COUNT (16)
+
+enum DXGI_FORMAT {
+	DXGI_FORMAT_UNKNOWN = 0,
+	DXGI_FORMAT_R32G32B32A32_FLOAT = 2,
+	DXGI_FORMAT_R32_FLOAT = 41,
+	DXGI_FORMAT_R32_UINT = 42,
+	DXGI_FORMAT_R16_UINT = 57
+};
+
+enum D3D11_USAGE {
+	D3D11_USAGE_DEFAULT = 0,
+	D3D11_USAGE_IMMUTABLE = 1,
+	D3D11_USAGE_DYNAMIC = 2,
+	D3D11_USAGE_STAGING = 3
+};
+
+enum D3D11_BIND_FLAG {
+	D3D11_BIND_VERTEX_BUFFER = 0x1L,
+	D3D11_BIND_INDEX_BUFFER = 0x2L,
+	D3D11_BIND_CONSTANT_BUFFER = 0x4L,
+	D3D11_BIND_SHADER_RESOURCE = 0x8L,
+	D3D11_BIND_UNORDERED_ACCESS = 0x80L
+};
+
+enum D3D11_CPU_ACCESS_FLAG {
+	D3D11_CPU_ACCESS_WRITE = 0x10000L,
+	D3D11_CPU_ACCESS_READ = 0x20000L
+};
+
+enum D3D11_RESOURCE_MISC_FLAG {
+	D3D11_RESOURCE_MISC_BUFFER_ALLOW_RAW_VIEWS = 0x20L,
+	D3D11_RESOURCE_MISC_BUFFER_STRUCTURED = 0x40L
+};
+
+enum D3D11_MAP {
+	D3D11_MAP_READ = 1,
+	D3D11_MAP_WRITE = 2,
+	D3D11_MAP_READ_WRITE = 3,
+	D3D11_MAP_WRITE_DISCARD = 4,
+	D3D11_MAP_WRITE_NO_OVERWRITE = 5
+};
+
+struct D3D11_BUFFER_DESC {
+	unsigned int ByteWidth;
+	D3D11_USAGE Usage;
+	unsigned int BindFlags;
+	unsigned int CPUAccessFlags;
+	unsigned int MiscFlags;
+	unsigned int StructureByteStride;
+};
+
+#endif
@@ -177,6 +177,7 @@ void RasterizerStateManager::Initialize(ID3D11Device *device) {
 	HR(device->CreateRasterizerState(&NoCullNoMSDesc(), &m_noCullNoMS));
 	HR(device->CreateRasterizerState(&NoCullScissorDesc(), &m_noCullScissor));
 	HR(device->CreateRasterizerState(&WireframeDesc(), &m_wireframe));
+	HR(device->CreateRasterizerState(&ShadowMapDesc(), &m_shadowMap));
 }
 
 RasterizerStateManager::~RasterizerStateManager() {
@@ -188,6 +189,7 @@ RasterizerStateManager::~RasterizerStateManager() {
 	ReleaseCOM(m_noCullNoMS);
 	ReleaseCOM(m_noCullScissor);
 	ReleaseCOM(m_wireframe);
+	ReleaseCOM(m_shadowMap);
 }
 
 D3D11_RASTERIZER_DESC RasterizerStateManager::NoCullDesc() {
@@ -326,6 +328,26 @@ D3D11_RASTERIZER_DESC RasterizerStateManager::WireframeDesc() {
 	return rastDesc;
 }
 
+D3D11_RASTERIZER_DESC RasterizerStateManager::ShadowMapDesc() {
+	D3D11_RASTERIZER_DESC rastDesc;
+
+	// The bias pushes the casters' depth away from the light to keep the receivers
+	// from shadowing themselves. Depth clip is off so casters between the light and
+	// the near plane of a tight cascade are clamped onto it, instead of dropped
+	rastDesc.AntialiasedLineEnable = false;
+	rastDesc.CullMode = D3D11_CULL_BACK;
+	rastDesc.DepthBias = 100;
+	rastDesc.DepthBiasClamp = 0.0f;
+	rastDesc.DepthClipEnable = false;
+	rastDesc.FillMode = D3D11_FILL_SOLID;
+	rastDesc.FrontCounterClockwise = false;
+	rastDesc.MultisampleEnable = false;
+	rastDesc.ScissorEnable = false;
+	rastDesc.SlopeScaledDepthBias = 2.0f;
+
+	return rastDesc;
+}
+
 void DepthStencilStateManager::Initialize(ID3D11Device *device) {
 	HR(device->CreateDepthStencilState(&DepthDisabledDesc(), &m_depthDisabled));
 	HR(device->CreateDepthStencilState(&DepthEnabledDesc(), &m_depthEnabled));
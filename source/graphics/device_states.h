@@ -15,7 +15,7 @@
 
 #pragma once
 
-#include <d3d11.h>
+#include "graphics/d3d11_types.h"
 
 namespace Graphics {
 
@@ -92,7 +92,8 @@ enum class  RasterizerState {
 	CULL_FRONTFACES_SCISSOR,
 	NO_CULL_NO_MS,
 	NO_CULL_SCISSOR,
-	WIREFRAME
+	WIREFRAME,
+	SHADOW_MAP
 };
 
 class RasterizerStateManager {
@@ -108,6 +109,7 @@ private:
 	ID3D11RasterizerState *m_noCullNoMS;
 	ID3D11RasterizerState *m_noCullScissor;
 	ID3D11RasterizerState *m_wireframe;
+	ID3D11RasterizerState *m_shadowMap;
 
 public:
 	void Initialize(ID3D11Device *device);
@@ -130,6 +132,8 @@ public:
 			return m_noCullScissor;
 		case Graphics::RasterizerState::WIREFRAME:
 			return m_wireframe;
+		case Graphics::RasterizerState::SHADOW_MAP:
+			return m_shadowMap;
 		default:
 			return nullptr;
 		}
@@ -143,6 +147,7 @@ public:
 	inline ID3D11RasterizerState *NoCullNoMS() { return m_noCullNoMS; };
 	inline ID3D11RasterizerState *NoCullScissor() { return m_noCullScissor; };
 	inline ID3D11RasterizerState *Wireframe() { return m_wireframe; };
+	inline ID3D11RasterizerState *ShadowMap() { return m_shadowMap; };
 
 	static D3D11_RASTERIZER_DESC NoCullDesc();
 	static D3D11_RASTERIZER_DESC FrontFaceCullDesc();
@@ -152,6 +157,7 @@ public:
 	static D3D11_RASTERIZER_DESC NoCullNoMSDesc();
 	static D3D11_RASTERIZER_DESC NoCullScissorDesc();
 	static D3D11_RASTERIZER_DESC WireframeDesc();
+	static D3D11_RASTERIZER_DESC ShadowMapDesc();
 };
 
 
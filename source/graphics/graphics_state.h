@@ -6,13 +6,145 @@
 
 #pragma once
 
-#include "graphics/shader.h"
+#include "common/typedefs.h"
 
-#include <map>
+#include "graphics/d3d11_types.h"
+#include "graphics/device_states.h"
+#include "graphics/shader_fwd.h"
+
+#if defined(_MSC_VER)
+	#include <intrin.h>
+#endif
+
+#include <cassert>
+#include <cstring>
 
 
 namespace Graphics {
 
+// The maximum number of texture SRV / sampler slots that are tracked per draw
+// This matches D3D11_COMMONSHADER_SAMPLER_SLOT_COUNT, so the occupancy mask fits in a uint32
+// D3D11 allows SRVs up to slot 127, but the draw commands only bind textures below this slot.
+// Resources at higher slots have to be bound directly through the RenderBackend
+static const uint kMaxTextureSlots = 16u;
+
+/**
+ * A fixed size array of resource bindings with an occupancy bitmask
+ *
+ * Bit N of Mask is set if slot N has been assigned. This lets us store the bindings
+ * inline (no heap allocations per draw command) and diff two sets of bindings
+ * with a few mask operations and per-slot compares.
+ */
+template <typename T, uint Size>
+struct ResourceSlots {
+	static_assert(Size <= 32u, "The occupancy mask only has 32 bits");
+
+	ResourceSlots()
+		: Mask(0u) {
+		memset(Slots, 0, sizeof(Slots));
+	}
+
+	T *Slots[Size];
+	uint32 Mask;
+
+	/**
+	 * Assigns a resource to a slot
+	 *
+	 * Slots at or above Size are refused in every build, rather than written past the end of the array
+	 *
+	 * @param resource    The resource to bind
+	 * @param slot        The slot to bind it to. Must be less than Size
+	 * @return            False if the slot is out of range, and nothing was assigned
+	 */
+	inline bool Set(T *resource, uint slot) {
+		assert(slot < Size);
+		if (slot >= Size) {
+			return false;
+		}
+
+		Slots[slot] = resource;
+		Mask |= (1u << slot);
+		return true;
+	}
+
+	inline bool IsEmpty() const { return Mask == 0u; }
+
+	/** Returns true if both arrays have the same slots occupied with the same resources */
+	inline bool IsEqual(const ResourceSlots<T, Size> &rhs) const {
+		return Mask == rhs.Mask && GetChangedSlots(rhs) == 0u;
+	}
+
+	/**
+	 * Returns a mask of the slots in 'requested' that differ from the slots in this array
+	 *
+	 * @param requested    The bindings we would like to have bound
+	 * @return             A bitmask with bit N set if slot N needs to be re-bound
+	 */
+	inline uint32 GetChangedSlots(const ResourceSlots<T, Size> &requested) const {
+		// Any slot that isn't currently bound has to be bound
+		uint32 changed = requested.Mask & ~Mask;
+
+		// For the slots that overlap, compare the actual resources
+		uint32 overlap = requested.Mask & Mask;
+		while (overlap != 0u) {
+			// Isolate the lowest set bit
+			uint32 bit = overlap & (~overlap + 1u);
+			overlap ^= bit;
+
+			uint slot = LowestSetBit(bit);
+			if (Slots[slot] != requested.Slots[slot]) {
+				changed |= bit;
+			}
+		}
+
+		return changed;
+	}
+
+	/**
+	 * Binds the slots in 'changedMask' using 'bindFunction', grouping contiguous slots
+	 * into a single call. The bound resources are then recorded in this array.
+	 *
+	 * @param requested       The bindings we would like to have bound
+	 * @param changedMask     The slots to bind. Usually the result of GetChangedSlots()
+	 * @param bindFunction    A functor with the signature void(uint startSlot, uint count, T * const *resources)
+	 */
+	template <typename BindFunction>
+	inline void BindSlots(const ResourceSlots<T, Size> &requested, uint32 changedMask, BindFunction bindFunction) {
+		while (changedMask != 0u) {
+			uint start = LowestSetBit(changedMask);
+
+			// Count the run of contiguous set bits starting at 'start'
+			uint32 run = changedMask >> start;
+			uint count = (run == 0xFFFFFFFF) ? 32u : LowestSetBit(~run);
+
+			bindFunction(start, count, &requested.Slots[start]);
+			memcpy(&Slots[start], &requested.Slots[start], sizeof(T *) * count);
+
+			// Clear the bits we just bound
+			uint32 runMask = (count == 32u) ? 0xFFFFFFFF : (((1u << count) - 1u) << start);
+			changedMask &= ~runMask;
+		}
+
+		Mask |= requested.Mask;
+	}
+
+private:
+	static inline uint LowestSetBit(uint32 value) {
+		assert(value != 0u);
+
+		#if defined(_MSC_VER)
+			unsigned long index;
+			_BitScanForward(&index, value);
+			return static_cast<uint>(index);
+		#else
+			return static_cast<uint>(__builtin_ctz(value));
+		#endif
+	}
+};
+
+typedef ResourceSlots<ID3D11ShaderResourceView, kMaxTextureSlots> TextureSRVSlots;
+typedef ResourceSlots<ID3D11SamplerState, kMaxTextureSlots> TextureSamplerSlots;
+
 struct GraphicsState {
 	GraphicsState()
 			: MaterialShader(nullptr),
@@ -31,18 +163,19 @@ struct GraphicsState {
 		BlendFactor[3] = 1.0f;
 	}
 
-	MaterialShader *MaterialShader;
+	// The members are named after their types, so the types have to be qualified. GCC rejects the unqualified version
+	Graphics::MaterialShader *MaterialShader;
 	ID3D11Buffer *VertexBuffers[2];
 	ID3D11Buffer *IndexBuffer;
 
-	std::map<uint, ID3D11ShaderResourceView *> TextureSRVs;
-	std::map<uint, ID3D11SamplerState *> TextureSamplers;
+	TextureSRVSlots TextureSRVs;
+	TextureSamplerSlots TextureSamplers;
 
-	BlendState BlendState;
+	Graphics::BlendState BlendState;
 	float BlendFactor[4];
 	uint SampleMask;
-	RasterizerState RasterizerState;
-	DepthStencilState DepthStencilState;
+	Graphics::RasterizerState RasterizerState;
+	Graphics::DepthStencilState DepthStencilState;
 };
 
 
@@ -0,0 +1,261 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "graphics/instance_stream.h"
+
+#include "common/halfling_sys.h"
+
+#include <algorithm>
+#include <cstring>
+
+
+namespace Graphics {
+
+InstanceStream::InstanceStream(RenderBackend *backend, uint elementSize, uint initialCapacity, uint framesInFlight)
+		: m_backend(backend),
+		  m_useNoOverwrite(backend->SupportsNoOverwriteShaderResourceBuffers()),
+		  m_elementSize(elementSize),
+		  m_framesInFlightLimit(std::max(framesInFlight, 1u)),
+		  m_buffer(nullptr),
+		  m_shaderResource(nullptr),
+		  m_capacity(0u),
+		  m_needsDiscard(true),
+		  m_isMapped(false),
+		  m_inFrame(false),
+		  m_head(0u),
+		  m_elementsInUse(0u),
+		  m_frameSize(0u),
+		  m_unfencedFrameSize(0u),
+		  m_hasUnfencedFrame(false),
+		  m_growCount(0u),
+		  m_stallCount(0u) {
+	AssertMsg(elementSize > 0u && elementSize % 4u == 0u, "The element size of a structured buffer must be a multiple of 4 bytes");
+
+	CreateBuffer(std::max(initialCapacity, 1u));
+}
+
+InstanceStream::~InstanceStream() {
+	AssertMsg(!m_isMapped, "The stream is destroyed while it's mapped");
+
+	for (auto iter = m_framesInFlight.begin(); iter != m_framesInFlight.end(); ++iter) {
+		m_backend->ReleaseFence(iter->Fence);
+	}
+	for (auto iter = m_freeFences.begin(); iter != m_freeFences.end(); ++iter) {
+		m_backend->ReleaseFence(*iter);
+	}
+	for (auto iter = m_retiredBuffers.begin(); iter != m_retiredBuffers.end(); ++iter) {
+		m_backend->ReleaseShaderResource(iter->ShaderResource);
+		m_backend->ReleaseBuffer(iter->Buffer);
+	}
+
+	m_backend->ReleaseShaderResource(m_shaderResource);
+	m_backend->ReleaseBuffer(m_buffer);
+}
+
+void InstanceStream::BeginFrame() {
+	AssertMsg(!m_inFrame, "BeginFrame() was called twice without an EndFrame()");
+
+	// Every draw that could reference a buffer we grew out of was submitted last frame.
+	// D3D keeps the resources alive until the GPU is done with them, so we can let go of them now
+	for (auto iter = m_retiredBuffers.begin(); iter != m_retiredBuffers.end(); ++iter) {
+		m_backend->ReleaseShaderResource(iter->ShaderResource);
+		m_backend->ReleaseBuffer(iter->Buffer);
+	}
+	m_retiredBuffers.clear();
+
+	m_inFrame = true;
+	m_frameSize = 0u;
+
+	if (!m_useNoOverwrite) {
+		// Discard maps rename the buffer, so there's nothing to fence
+		return;
+	}
+
+	// The draws that read the previous frame's region have been submitted by now, so we can fence them
+	if (m_hasUnfencedFrame) {
+		FrameMarker marker;
+		if (m_freeFences.empty()) {
+			marker.Fence = m_backend->CreateFence();
+		} else {
+			marker.Fence = m_freeFences.back();
+			m_freeFences.pop_back();
+		}
+		marker.Size = m_unfencedFrameSize;
+
+		m_backend->IssueFence(marker.Fence);
+		m_framesInFlight.push_back(marker);
+
+		m_unfencedFrameSize = 0u;
+		m_hasUnfencedFrame = false;
+	}
+
+	while (RetireOldestFrame(false)) {
+		// Keep retiring until we hit a frame the GPU is still using
+	}
+
+	// The ring is only sized for m_framesInFlightLimit frames, including this one
+	while (m_framesInFlight.size() >= m_framesInFlightLimit) {
+		RetireOldestFrame(true);
+		++m_stallCount;
+	}
+}
+
+InstanceStreamAllocation InstanceStream::Map(uint elementCount) {
+	AssertMsg(m_inFrame, "Map() must be called between BeginFrame() and EndFrame()");
+	AssertMsg(!m_isMapped, "Map() was called twice without an Unmap()");
+
+	if (!m_useNoOverwrite) {
+		// Every map is a discard of the start of the buffer
+		if (elementCount > m_capacity) {
+			Grow(elementCount);
+		}
+		m_head = 0u;
+		m_needsDiscard = true;
+	} else {
+		// If this frame needs more than its share of the ring, the next frames would have to wait for the GPU. So grow now
+		uint64 frameNeeds = static_cast<uint64>(m_frameSize + elementCount) * m_framesInFlightLimit;
+		if (frameNeeds > m_capacity) {
+			Grow(static_cast<uint>(std::min<uint64>(frameNeeds, 0xFFFFFFFFull / m_elementSize)));
+		}
+
+		// Skip to the start of the ring if the window doesn't fit at the end
+		uint padding = 0u;
+		if (m_head + elementCount > m_capacity) {
+			padding = m_capacity - m_head;
+		}
+
+		// Wait for the GPU to free up enough space
+		while (m_elementsInUse + padding + elementCount > m_capacity) {
+			if (RetireOldestFrame(false)) {
+				continue;
+			}
+			if (m_framesInFlight.empty()) {
+				// The padding at the wrap point made us run out of room
+				Grow(m_capacity);
+				padding = 0u;
+				break;
+			}
+
+			RetireOldestFrame(true);
+			++m_stallCount;
+		}
+
+		m_head = (m_head + padding) % m_capacity;
+		m_elementsInUse += padding + elementCount;
+		m_frameSize += padding + elementCount;
+	}
+
+	InstanceStreamAllocation allocation;
+	allocation.Buffer = m_buffer;
+	allocation.ShaderResource = m_shaderResource;
+	allocation.FirstElement = m_head;
+	allocation.NumElements = elementCount;
+
+	if (elementCount == 0u) {
+		return allocation;
+	}
+
+	// The first map of a buffer has to be a discard. Afterwards, the fences
+	// guarantee we never write over data the GPU could be reading
+	byte *mappedData = static_cast<byte *>(m_backend->Map(m_buffer, m_needsDiscard ? D3D11_MAP_WRITE_DISCARD : D3D11_MAP_WRITE_NO_OVERWRITE, elementCount * m_elementSize));
+	m_needsDiscard = false;
+	m_isMapped = true;
+
+	allocation.Data = mappedData + m_head * m_elementSize;
+	m_head += elementCount;
+
+	return allocation;
+}
+
+void InstanceStream::Unmap() {
+	if (!m_isMapped) {
+		// Empty windows aren't mapped
+		return;
+	}
+
+	m_backend->Unmap(m_buffer);
+	m_isMapped = false;
+}
+
+InstanceStreamAllocation InstanceStream::Write(const void *data, uint elementCount) {
+	InstanceStreamAllocation allocation = Map(elementCount);
+	if (allocation.Data != nullptr) {
+		memcpy(allocation.Data, data, elementCount * m_elementSize);
+	}
+	Unmap();
+
+	return allocation;
+}
+
+void InstanceStream::EndFrame() {
+	AssertMsg(m_inFrame, "EndFrame() was called without a BeginFrame()");
+	AssertMsg(!m_isMapped, "EndFrame() was called while the stream is mapped");
+	m_inFrame = false;
+
+	// The draws that use this frame's windows may not have been submitted yet.
+	// So the fence is issued at the start of the next frame
+	m_unfencedFrameSize = m_frameSize;
+	m_hasUnfencedFrame = m_useNoOverwrite;
+}
+
+void InstanceStream::CreateBuffer(uint capacity) {
+	D3D11_BUFFER_DESC desc;
+	desc.Usage = D3D11_USAGE_DYNAMIC;
+	desc.ByteWidth = capacity * m_elementSize;
+	desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+	desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+	desc.MiscFlags = D3D11_RESOURCE_MISC_BUFFER_STRUCTURED;
+	desc.StructureByteStride = m_elementSize;
+
+	m_buffer = m_backend->CreateBuffer(desc, nullptr);
+	m_shaderResource = m_backend->CreateBufferShaderResource(m_buffer);
+	m_capacity = capacity;
+	m_needsDiscard = true;
+}
+
+void InstanceStream::Grow(uint minCapacity) {
+	// The windows that were already handed out this frame still point at the old buffer
+	RetiredBuffer retired;
+	retired.Buffer = m_buffer;
+	retired.ShaderResource = m_shaderResource;
+	m_retiredBuffers.push_back(retired);
+
+	uint doubled = m_capacity <= 0x7FFFFFFFu ? m_capacity * 2u : m_capacity;
+	CreateBuffer(std::max(doubled, minCapacity));
+	++m_growCount;
+
+	// None of the frames in flight use the new buffer. They're still fenced, so the
+	// number of frames the CPU can run ahead stays limited
+	for (auto iter = m_framesInFlight.begin(); iter != m_framesInFlight.end(); ++iter) {
+		iter->Size = 0u;
+	}
+	m_head = 0u;
+	m_elementsInUse = 0u;
+	m_frameSize = 0u;
+}
+
+bool InstanceStream::RetireOldestFrame(bool wait) {
+	if (m_framesInFlight.empty()) {
+		return false;
+	}
+
+	FrameMarker &marker = m_framesInFlight.front();
+	if (wait) {
+		while (!m_backend->IsFenceComplete(marker.Fence)) {
+			// Spin
+		}
+	} else if (!m_backend->IsFenceComplete(marker.Fence)) {
+		return false;
+	}
+
+	m_elementsInUse -= marker.Size;
+	m_freeFences.push_back(marker.Fence);
+	m_framesInFlight.pop_front();
+
+	return true;
+}
+
+} // End of namespace Graphics
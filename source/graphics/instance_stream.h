@@ -0,0 +1,170 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "common/typedefs.h"
+
+#include "graphics/d3d11_types.h"
+#include "graphics/render_backend.h"
+
+#include <deque>
+#include <vector>
+
+
+namespace Graphics {
+
+/** A window into an InstanceStream, as returned by InstanceStream::Map() */
+struct InstanceStreamAllocation {
+	InstanceStreamAllocation()
+		: Buffer(nullptr),
+		  ShaderResource(nullptr),
+		  FirstElement(0u),
+		  NumElements(0u),
+		  Data(nullptr) {
+	}
+
+	/** The buffer the window is in. The stream may move to a new buffer when it grows, so always bind this one */
+	ID3D11Buffer *Buffer;
+	ID3D11ShaderResourceView *ShaderResource;
+	/** The offset of the window, in elements */
+	uint FirstElement;
+	/** The size of the window, in elements */
+	uint NumElements;
+	/** Where to write the elements. Only valid until the matching Unmap() */
+	void *Data;
+};
+
+/**
+ * A dynamic structured buffer that per-frame instance data is streamed through
+ *
+ * The buffer is used as a ring that holds the data of up to 'framesInFlight' frames. Every Map()
+ * sub-allocates a fresh window with a WRITE_NO_OVERWRITE map, so several models can stream their
+ * instances into the same buffer in one frame, and none of them touch data the GPU could still be
+ * reading. Every frame's region is fenced, the same way as ConstantRingBuffer.
+ *
+ * The stream never runs out of space. If a frame needs more than its share of the ring, the stream
+ * moves to a buffer that's at least twice as large. The windows that were already handed out stay
+ * valid until the end of the frame. BeginFrame() also waits for the oldest frame if there
+ * are already 'framesInFlight' frames queued, so the CPU can't run further ahead than the ring is sized for.
+ *
+ * If the backend doesn't support NO_OVERWRITE maps of shader resource buffers, every Map() is a
+ * WRITE_DISCARD of the start of the buffer. The window is then only valid until the next Map(), so
+ * the draws that use it have to be issued before then.
+ *
+ * Usage:
+ *     stream.BeginFrame();
+ *     InstanceStreamAllocation allocation = stream.Map(instanceCount);
+ *     ... Write instanceCount elements to allocation.Data
+ *     stream.Unmap();
+ *     ... Bind allocation.ShaderResource and draw, using allocation.FirstElement as the first instance
+ *     stream.EndFrame();
+ */
+class InstanceStream {
+public:
+	/**
+	 * @param backend            The backend to create and map the buffers with
+	 * @param elementSize        The size of one element in bytes. IE. the stride of the StructuredBuffer in the shader
+	 * @param initialCapacity    The number of elements the ring starts with
+	 * @param framesInFlight     The number of frames the ring holds before the CPU has to wait for the GPU
+	 */
+	InstanceStream(RenderBackend *backend, uint elementSize, uint initialCapacity = kDefaultInitialCapacity, uint framesInFlight = kDefaultFramesInFlight);
+	~InstanceStream();
+
+	static const uint kDefaultInitialCapacity = 4096u;
+	static const uint kDefaultFramesInFlight = 3u;
+
+private:
+	struct FrameMarker {
+		ID3D11Query *Fence;
+		/** The number of elements the frame used in the current buffer, including any padding at the wrap point */
+		uint Size;
+	};
+
+	/** A buffer the stream has grown out of. The windows handed out before the growth still use it, so it's released in the next BeginFrame() */
+	struct RetiredBuffer {
+		ID3D11Buffer *Buffer;
+		ID3D11ShaderResourceView *ShaderResource;
+	};
+
+	RenderBackend *m_backend;
+	bool m_useNoOverwrite;
+
+	uint m_elementSize;
+	uint m_framesInFlightLimit;
+
+	ID3D11Buffer *m_buffer;
+	ID3D11ShaderResourceView *m_shaderResource;
+	uint m_capacity;
+	/** The next map of m_buffer has to be a discard. IE. It's never been mapped */
+	bool m_needsDiscard;
+	bool m_isMapped;
+	bool m_inFrame;
+
+	uint m_head;
+	/** The number of elements still in use by frames in flight, including the current one */
+	uint m_elementsInUse;
+	uint m_frameSize;
+	/** The size of the last frame. Its fence is issued in the next BeginFrame() */
+	uint m_unfencedFrameSize;
+	bool m_hasUnfencedFrame;
+
+	std::deque<FrameMarker> m_framesInFlight;
+	std::vector<ID3D11Query *> m_freeFences;
+	std::vector<RetiredBuffer> m_retiredBuffers;
+
+	uint m_growCount;
+	uint m_stallCount;
+
+public:
+	/** Fences the previous frame, retires the frames the GPU has finished with, and waits if too many frames are queued */
+	void BeginFrame();
+	/**
+	 * Maps a window of the stream for writing
+	 *
+	 * Grows the stream if the window doesn't fit. If the ring is full of older frames that are
+	 * still in flight, this will block until the GPU catches up
+	 *
+	 * @param elementCount    The number of elements to write
+	 * @return                The window
+	 */
+	InstanceStreamAllocation Map(uint elementCount);
+	/** Unmaps the window returned by the last Map() */
+	void Unmap();
+	/**
+	 * Copies data into a new window of the stream
+	 *
+	 * @param data            The elements to copy
+	 * @param elementCount    The number of elements
+	 * @return                The window the data was written to
+	 */
+	InstanceStreamAllocation Write(const void *data, uint elementCount);
+	void EndFrame();
+
+	inline uint GetCapacity() const { return m_capacity; }
+	inline uint GetElementSize() const { return m_elementSize; }
+	inline uint GetFramesInFlightLimit() const { return m_framesInFlightLimit; }
+	inline bool UsesNoOverwrite() const { return m_useNoOverwrite; }
+	/** Returns the buffer the next window will be allocated from */
+	inline ID3D11Buffer *GetBuffer() const { return m_buffer; }
+	/** Returns the number of times the stream has moved to a larger buffer */
+	inline uint GetGrowCount() const { return m_growCount; }
+	/** Returns the number of times the CPU had to wait for the GPU to free up space */
+	inline uint GetStallCount() const { return m_stallCount; }
+
+private:
+	void CreateBuffer(uint capacity);
+	/** Moves to a buffer that can hold at least 'minCapacity' elements */
+	void Grow(uint minCapacity);
+	/** Returns true if a frame was retired */
+	bool RetireOldestFrame(bool wait);
+
+	// Not implemented
+	InstanceStream(const InstanceStream &);
+	InstanceStream &operator=(const InstanceStream &);
+};
+
+} // End of namespace Graphics
@@ -0,0 +1,162 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "common/dirty_range_list.h"
+#include "common/halfling_sys.h"
+
+#include "graphics/d3d11_types.h"
+#include "graphics/render_backend.h"
+
+#include <vector>
+
+
+namespace Graphics {
+
+/**
+ * A structured buffer whose elements live on the GPU across frames
+ *
+ * The buffer keeps a CPU copy of every element. Elements are only uploaded when
+ * they are added or changed, so the per-frame cost of Upload() scales with the number
+ * of elements that changed, rather than the total number of elements. The changed
+ * elements are tracked in a Common::DirtyRangeList, and ranges that are close together
+ * are coalesced into a single UpdateBuffer() call.
+ *
+ * Typical use is per-object data that rarely changes, IE. the world matrices of static
+ * objects. The shader indexes the buffer with a per-object or per-instance index.
+ *
+ * NOTE: T must have exactly the same size/layout as the shader structure
+ */
+template <typename T>
+class PersistentStructuredBuffer {
+public:
+	/**
+	 * @param backend     The backend to create the buffer with, and to upload with
+	 * @param capacity    The maximum number of elements
+	 */
+	PersistentStructuredBuffer(RenderBackend *backend, uint capacity);
+	~PersistentStructuredBuffer();
+
+	/**
+	 * Dirty ranges separated by at most this many clean elements are uploaded as one range.
+	 * Re-uploading a few clean elements is cheaper than another UpdateBuffer() call
+	 */
+	static const uint kMaxCoalesceGap = 4u;
+
+private:
+	RenderBackend *m_backend;
+	uint m_capacity;
+	ID3D11Buffer *m_buffer;
+	ID3D11ShaderResourceView *m_shaderResource;
+
+	std::vector<T> m_elements;
+	Common::DirtyRangeList m_dirtyRanges;
+
+public:
+	inline ID3D11Buffer *GetBuffer() { return m_buffer; }
+	inline ID3D11ShaderResourceView *GetShaderResource() { return m_shaderResource; }
+
+	inline uint GetCapacity() const { return m_capacity; }
+	inline uint GetSize() const { return static_cast<uint>(m_elements.size()); }
+	/** Returns the elements that were added or changed since the last Upload(). They aren't coalesced until Upload() */
+	inline const Common::DirtyRangeList &GetDirtyRanges() const { return m_dirtyRanges; }
+
+	/**
+	 * Appends a new element. It will be uploaded by the next Upload()
+	 *
+	 * @param value    The value of the element
+	 * @return         The index of the new element
+	 */
+	uint Add(const T &value);
+	/**
+	 * Changes the value of an element. It will be uploaded by the next Upload()
+	 *
+	 * @param index    The index of the element, as returned by Add()
+	 * @param value    The new value
+	 */
+	void Set(uint index, const T &value);
+	inline const T &Get(uint index) const { return m_elements[index]; }
+
+	/**
+	 * Uploads all the elements that were added or changed since the last Upload()
+	 *
+	 * @return    The number of UpdateBuffer() calls that were made
+	 */
+	uint Upload();
+
+private:
+	// Not implemented
+	PersistentStructuredBuffer(const PersistentStructuredBuffer &);
+	PersistentStructuredBuffer &operator=(const PersistentStructuredBuffer &);
+};
+
+
+template <typename T>
+PersistentStructuredBuffer<T>::PersistentStructuredBuffer(RenderBackend *backend, uint capacity)
+		: m_backend(backend),
+		  m_capacity(capacity),
+		  m_buffer(nullptr),
+		  m_shaderResource(nullptr) {
+	m_elements.reserve(capacity);
+
+	D3D11_BUFFER_DESC desc;
+	desc.Usage = D3D11_USAGE_DEFAULT;
+	desc.ByteWidth = sizeof(T) * capacity;
+	desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+	desc.CPUAccessFlags = 0;
+	desc.MiscFlags = D3D11_RESOURCE_MISC_BUFFER_STRUCTURED;
+	desc.StructureByteStride = sizeof(T);
+
+	m_buffer = m_backend->CreateBuffer(desc, nullptr);
+	m_shaderResource = m_backend->CreateBufferShaderResource(m_buffer);
+}
+
+template <typename T>
+PersistentStructuredBuffer<T>::~PersistentStructuredBuffer() {
+	m_backend->ReleaseShaderResource(m_shaderResource);
+	m_backend->ReleaseBuffer(m_buffer);
+}
+
+template <typename T>
+uint PersistentStructuredBuffer<T>::Add(const T &value) {
+	AssertMsg(m_elements.size() < m_capacity, "The PersistentStructuredBuffer is full. Capacity: " << m_capacity);
+
+	uint index = static_cast<uint>(m_elements.size());
+	m_elements.push_back(value);
+	m_dirtyRanges.Add(index);
+
+	return index;
+}
+
+template <typename T>
+void PersistentStructuredBuffer<T>::Set(uint index, const T &value) {
+	AssertMsg(index < m_elements.size(), "Element " << index << " hasn't been added to the PersistentStructuredBuffer");
+
+	m_elements[index] = value;
+	m_dirtyRanges.Add(index);
+}
+
+template <typename T>
+uint PersistentStructuredBuffer<T>::Upload() {
+	if (m_dirtyRanges.IsEmpty()) {
+		return 0u;
+	}
+
+	m_dirtyRanges.Coalesce(kMaxCoalesceGap);
+
+	const std::vector<Common::DirtyRange> &ranges = m_dirtyRanges.GetRanges();
+	for (auto iter = ranges.begin(); iter != ranges.end(); ++iter) {
+		m_backend->UpdateBuffer(m_buffer, iter->Begin * sizeof(T), (iter->End - iter->Begin) * sizeof(T), &m_elements[iter->Begin]);
+	}
+
+	uint updateCount = m_dirtyRanges.GetRangeCount();
+	m_dirtyRanges.Clear();
+
+	return updateCount;
+}
+
+} // End of namespace Graphics
@@ -0,0 +1,99 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "graphics/recording_render_backend.h"
+
+#include <cassert>
+
+
+namespace Graphics {
+
+RecordingRenderBackend::~RecordingRenderBackend() {
+	for (auto iter = m_bufferData.begin(); iter != m_bufferData.end(); ++iter) {
+		delete[] reinterpret_cast<byte *>(iter->first);
+	}
+}
+
+const byte *RecordingRenderBackend::GetBufferData(ID3D11Buffer *buffer, size_t *out_size) const {
+	auto iter = m_bufferData.find(buffer);
+	if (iter == m_bufferData.end()) {
+		return nullptr;
+	}
+
+	if (out_size) {
+		*out_size = iter->second.size();
+	}
+	return iter->second.empty() ? nullptr : &iter->second.front();
+}
+
+ID3D11Buffer *RecordingRenderBackend::CreateBuffer(const D3D11_BUFFER_DESC &desc, const void *initialData) {
+	// Allocate a single byte so every buffer gets a unique handle
+	ID3D11Buffer *handle = reinterpret_cast<ID3D11Buffer *>(new byte[1]);
+
+	std::vector<byte> &data = m_bufferData[handle];
+	data.resize(desc.ByteWidth, 0);
+	if (initialData) {
+		memcpy(&data.front(), initialData, desc.ByteWidth);
+		m_stats.BytesUploaded += desc.ByteWidth;
+	}
+
+	++m_stats.BuffersCreated;
+
+	return handle;
+}
+
+void RecordingRenderBackend::ReleaseBuffer(ID3D11Buffer *buffer) {
+	auto iter = m_bufferData.find(buffer);
+	assert(iter != m_bufferData.end());
+
+	m_bufferData.erase(iter);
+	delete[] reinterpret_cast<byte *>(buffer);
+}
+
+void *RecordingRenderBackend::Map(ID3D11Buffer *buffer, D3D11_MAP mapType, size_t bytesToWrite) {
+	++m_stats.Maps;
+	m_stats.DiscardMaps += mapType == D3D11_MAP_WRITE_DISCARD ? 1u : 0u;
+	m_stats.BytesUploaded += bytesToWrite;
+
+	auto iter = m_bufferData.find(buffer);
+	if (iter != m_bufferData.end()) {
+		assert(bytesToWrite <= iter->second.size());
+		return iter->second.empty() ? nullptr : &iter->second.front();
+	}
+
+	// The buffer wasn't created by us. Give the caller some scratch memory to write into
+	if (m_scratch.size() < bytesToWrite) {
+		m_scratch.resize(bytesToWrite);
+	}
+	return m_scratch.empty() ? nullptr : &m_scratch.front();
+}
+
+void RecordingRenderBackend::UpdateBuffer(ID3D11Buffer *buffer, uint byteOffset, uint byteSize, const void *data) {
+	++m_stats.BufferUpdates;
+	m_stats.BytesUploaded += byteSize;
+
+	// Updates of buffers we didn't create are only counted
+	auto iter = m_bufferData.find(buffer);
+	if (iter != m_bufferData.end()) {
+		assert(byteOffset + byteSize <= iter->second.size());
+		memcpy(&iter->second[byteOffset], data, byteSize);
+	}
+}
+
+void RecordingRenderBackend::CopyBuffer(ID3D11Buffer *dest, uint destOffset, ID3D11Buffer *source, uint sourceOffset, uint byteSize) {
+	++m_stats.BufferCopies;
+
+	// Copies between buffers we didn't create are only counted
+	auto destIter = m_bufferData.find(dest);
+	auto sourceIter = m_bufferData.find(source);
+	if (destIter != m_bufferData.end() && sourceIter != m_bufferData.end()) {
+		assert(destOffset + byteSize <= destIter->second.size());
+		assert(sourceOffset + byteSize <= sourceIter->second.size());
+		memcpy(&destIter->second[destOffset], &sourceIter->second[sourceOffset], byteSize);
+	}
+}
+
+} // End of namespace Graphics
@@ -0,0 +1,111 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "graphics/render_backend.h"
+
+#include <unordered_map>
+#include <vector>
+
+
+namespace Graphics {
+
+/**
+ * A null RenderBackend. It never touches a GPU; it only counts the binds, maps, draws,
+ * and uploads that would have been sent. This lets CommandBucket and the Commands run
+ * headless for benchmarking and regression testing.
+ *
+ * Buffers created through the backend get a block of CPU memory as their backing store,
+ * so Map() returns real memory and uploads can be inspected with GetBufferData().
+ * Buffers created elsewhere (IE. directly through an ID3D11Device) are mapped into
+ * a shared scratch block.
+ *
+ * Fences complete as soon as they're issued, since there isn't a GPU to wait on.
+ *
+ * NOTE: The ID3D11Buffer, ID3D11ShaderResourceView, and ID3D11Query pointers handed out by CreateBuffer(),
+ *       CreateBufferShaderResource(), and CreateFence() are opaque handles. They must never be passed to D3D.
+ */
+class RecordingRenderBackend : public RenderBackend {
+public:
+	/**
+	 * @param supportsConstantBufferOffsets              What SupportsConstantBufferOffsets() should report. Lets both
+	 *                                                   constant upload paths be exercised without a GPU
+	 * @param supportsNoOverwriteShaderResourceBuffers    What SupportsNoOverwriteShaderResourceBuffers() should report
+	 */
+	RecordingRenderBackend(bool supportsConstantBufferOffsets = true, bool supportsNoOverwriteShaderResourceBuffers = true) 
+		: m_supportsConstantBufferOffsets(supportsConstantBufferOffsets),
+		  m_supportsNoOverwriteShaderResourceBuffers(supportsNoOverwriteShaderResourceBuffers) {
+	}
+	~RecordingRenderBackend();
+
+private:
+	bool m_supportsConstantBufferOffsets;
+	bool m_supportsNoOverwriteShaderResourceBuffers;
+
+	std::unordered_map<ID3D11Buffer *, std::vector<byte> > m_bufferData;
+	std::vector<byte> m_scratch;
+
+public:
+	/**
+	 * Returns the CPU-side contents of a buffer created with CreateBuffer()
+	 *
+	 * @param buffer         The buffer
+	 * @param out_size       [Optional] Will be filled with the size of the buffer in bytes
+	 * @return               The buffer contents, or nullptr if the buffer wasn't created by this backend
+	 */
+	const byte *GetBufferData(ID3D11Buffer *buffer, size_t *out_size = nullptr) const;
+
+	inline bool SupportsConstantBufferOffsets() const { return m_supportsConstantBufferOffsets; }
+	inline bool SupportsNoOverwriteShaderResourceBuffers() const { return m_supportsNoOverwriteShaderResourceBuffers; }
+
+	ID3D11Buffer *CreateBuffer(const D3D11_BUFFER_DESC &desc, const void *initialData);
+	void ReleaseBuffer(ID3D11Buffer *buffer);
+	inline ID3D11ShaderResourceView *CreateBufferShaderResource(ID3D11Buffer *buffer) { return reinterpret_cast<ID3D11ShaderResourceView *>(new byte[1]); }
+	inline void ReleaseShaderResource(ID3D11ShaderResourceView *shaderResource) { delete[] reinterpret_cast<byte *>(shaderResource); }
+
+	inline void SetMaterialShader(MaterialShader *shader) { ++m_stats.ShaderBinds; }
+
+	inline void SetVertexBuffers(uint startSlot, uint count, ID3D11Buffer * const *buffers, const uint *strides, const uint *offsets) { ++m_stats.VertexBufferBinds; }
+	inline void SetIndexBuffer(ID3D11Buffer *buffer, DXGI_FORMAT format, uint offset) { ++m_stats.IndexBufferBinds; }
+
+	inline void SetVSShaderResources(uint startSlot, uint count, ID3D11ShaderResourceView * const *srvs) { ++m_stats.ShaderResourceBinds; }
+	inline void SetPSShaderResources(uint startSlot, uint count, ID3D11ShaderResourceView * const *srvs) { ++m_stats.ShaderResourceBinds; }
+	inline void SetPSSamplers(uint startSlot, uint count, ID3D11SamplerState * const *samplers) { ++m_stats.SamplerBinds; }
+	inline void SetVSConstantBuffers(uint startSlot, uint count, ID3D11Buffer * const *buffers) { ++m_stats.ConstantBufferBinds; }
+	inline void SetPSConstantBuffers(uint startSlot, uint count, ID3D11Buffer * const *buffers) { ++m_stats.ConstantBufferBinds; }
+	inline void SetVSConstantBufferRanges(uint startSlot, uint count, ID3D11Buffer * const *buffers, const uint *firstConstants, const uint *numConstants) { ++m_stats.ConstantBufferBinds; }
+	inline void SetPSConstantBufferRanges(uint startSlot, uint count, ID3D11Buffer * const *buffers, const uint *firstConstants, const uint *numConstants) { ++m_stats.ConstantBufferBinds; }
+
+	inline void SetBlendState(BlendState state, const float blendFactor[4], uint sampleMask) { ++m_stats.BlendStateChanges; }
+	inline void SetRasterizerState(RasterizerState state) { ++m_stats.RasterizerStateChanges; }
+	inline void SetDepthStencilState(DepthStencilState state, uint stencilRef) { ++m_stats.DepthStencilStateChanges; }
+
+	void *Map(ID3D11Buffer *buffer, D3D11_MAP mapType, size_t bytesToWrite);
+	inline void Unmap(ID3D11Buffer *buffer) {}
+	void UpdateBuffer(ID3D11Buffer *buffer, uint byteOffset, uint byteSize, const void *data);
+	void CopyBuffer(ID3D11Buffer *dest, uint destOffset, ID3D11Buffer *source, uint sourceOffset, uint byteSize);
+
+	inline ID3D11Query *CreateFence() { return reinterpret_cast<ID3D11Query *>(new byte[1]); }
+	inline void ReleaseFence(ID3D11Query *fence) { delete[] reinterpret_cast<byte *>(fence); }
+	inline void IssueFence(ID3D11Query *fence) {}
+	inline bool IsFenceComplete(ID3D11Query *fence) { return true; }
+
+	inline void Draw(uint vertexCount, uint vertexStart) { 
+		++m_stats.DrawCalls; 
+	}
+	inline void DrawIndexed(uint indexCount, uint indexStart, int vertexStart) {
+		++m_stats.DrawCalls;
+		m_stats.IndicesSubmitted += indexCount;
+	}
+	inline void DrawIndexedInstanced(uint indexCountPerInstance, uint instanceCount, uint indexStart, int vertexStart, uint instanceStart) {
+		++m_stats.DrawCalls;
+		m_stats.IndicesSubmitted += static_cast<uint64>(indexCountPerInstance) * instanceCount;
+		m_stats.InstancesSubmitted += instanceCount;
+	}
+};
+
+} // End of namespace Graphics
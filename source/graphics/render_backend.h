@@ -0,0 +1,180 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "common/typedefs.h"
+
+#include "graphics/d3d11_types.h"
+#include "graphics/device_states.h"
+#include "graphics/shader_fwd.h"
+
+#include <cstring>
+
+
+namespace Graphics {
+
+/** Counters for the API traffic that goes through a RenderBackend */
+struct RenderBackendStats {
+	RenderBackendStats() {
+		Reset();
+	}
+
+	uint ShaderBinds;
+	uint VertexBufferBinds;
+	uint IndexBufferBinds;
+	uint ShaderResourceBinds;
+	uint SamplerBinds;
+	uint ConstantBufferBinds;
+	uint BlendStateChanges;
+	uint RasterizerStateChanges;
+	uint DepthStencilStateChanges;
+
+	uint Maps;
+	/** The Maps that were WRITE_DISCARD. Each one makes the driver rename the buffer */
+	uint DiscardMaps;
+	uint BufferUpdates;
+	uint64 BytesUploaded;
+
+	uint BuffersCreated;
+	uint BufferCopies;
+
+	uint DrawCalls;
+	uint64 IndicesSubmitted;
+	uint64 InstancesSubmitted;
+
+	inline void Reset() { memset(this, 0, sizeof(RenderBackendStats)); }
+
+	/** Returns the total number of state binds of any type */
+	inline uint TotalBinds() const {
+		return ShaderBinds + VertexBufferBinds + IndexBufferBinds + ShaderResourceBinds + SamplerBinds + ConstantBufferBinds +
+		       BlendStateChanges + RasterizerStateChanges + DepthStencilStateChanges;
+	}
+};
+
+/**
+ * A thin abstraction over the device and immediate context used by the command
+ * execution paths (CommandBucket, the Commands, and buffer uploads).
+ *
+ * D3D11RenderBackend forwards everything to D3D. RecordingRenderBackend doesn't
+ * touch a GPU at all. It only records what *would* have been sent, so the hot loops
+ * can be profiled and tested headless.
+ *
+ * Both implementations keep a RenderBackendStats, so the same counters can be shown
+ * in the HUD of the demos.
+ */
+class RenderBackend {
+public:
+	virtual ~RenderBackend() {}
+
+protected:
+	RenderBackendStats m_stats;
+
+public:
+	inline const RenderBackendStats &GetStats() const { return m_stats; }
+	inline void ResetStats() { m_stats.Reset(); }
+
+	// Capabilities
+	/**
+	 * Returns true if constant buffers can be bound at an offset with Set*ConstantBufferRanges(),
+	 * and dynamic constant buffers can be mapped with D3D11_MAP_WRITE_NO_OVERWRITE
+	 */
+	virtual bool SupportsConstantBufferOffsets() const = 0;
+	/** Returns true if dynamic buffers that are bound as shader resources can be mapped with D3D11_MAP_WRITE_NO_OVERWRITE */
+	virtual bool SupportsNoOverwriteShaderResourceBuffers() const = 0;
+
+	// Resource creation
+	virtual ID3D11Buffer *CreateBuffer(const D3D11_BUFFER_DESC &desc, const void *initialData) = 0;
+	virtual void ReleaseBuffer(ID3D11Buffer *buffer) = 0;
+	/** Creates a view of the whole of a structured buffer */
+	virtual ID3D11ShaderResourceView *CreateBufferShaderResource(ID3D11Buffer *buffer) = 0;
+	virtual void ReleaseShaderResource(ID3D11ShaderResourceView *shaderResource) = 0;
+
+	// Shaders
+	/** Binds the pixel shader of the material. nullptr unbinds it, for depth only passes */
+	virtual void SetMaterialShader(MaterialShader *shader) = 0;
+
+	// Input assembler
+	virtual void SetVertexBuffers(uint startSlot, uint count, ID3D11Buffer * const *buffers, const uint *strides, const uint *offsets) = 0;
+	virtual void SetIndexBuffer(ID3D11Buffer *buffer, DXGI_FORMAT format, uint offset) = 0;
+
+	// Resource binding
+	virtual void SetVSShaderResources(uint startSlot, uint count, ID3D11ShaderResourceView * const *srvs) = 0;
+	virtual void SetPSShaderResources(uint startSlot, uint count, ID3D11ShaderResourceView * const *srvs) = 0;
+	virtual void SetPSSamplers(uint startSlot, uint count, ID3D11SamplerState * const *samplers) = 0;
+	virtual void SetVSConstantBuffers(uint startSlot, uint count, ID3D11Buffer * const *buffers) = 0;
+	virtual void SetPSConstantBuffers(uint startSlot, uint count, ID3D11Buffer * const *buffers) = 0;
+	/**
+	 * Binds windows of constant buffers. IE. VSSetConstantBuffers1()
+	 * Only valid if SupportsConstantBufferOffsets() returns true
+	 *
+	 * @param startSlot         The first slot to bind to
+	 * @param count             The number of buffers
+	 * @param buffers           The buffers
+	 * @param firstConstants    The offset of each window, in 16 byte constants. Must be a multiple of 16
+	 * @param numConstants      The size of each window, in 16 byte constants. Must be a multiple of 16
+	 */
+	virtual void SetVSConstantBufferRanges(uint startSlot, uint count, ID3D11Buffer * const *buffers, const uint *firstConstants, const uint *numConstants) = 0;
+	virtual void SetPSConstantBufferRanges(uint startSlot, uint count, ID3D11Buffer * const *buffers, const uint *firstConstants, const uint *numConstants) = 0;
+
+	// Fixed function state
+	virtual void SetBlendState(BlendState state, const float blendFactor[4], uint sampleMask) = 0;
+	virtual void SetRasterizerState(RasterizerState state) = 0;
+	virtual void SetDepthStencilState(DepthStencilState state, uint stencilRef) = 0;
+
+	// Buffer uploads
+	/**
+	 * Maps a buffer so it can be written to by the CPU
+	 *
+	 * @param buffer         The buffer to map
+	 * @param mapType        The D3D11 map type. IE. D3D11_MAP_WRITE_DISCARD
+	 * @param bytesToWrite   The number of bytes the caller will write. Used for the upload statistics
+	 * @return               A pointer to the mapped memory
+	 */
+	virtual void *Map(ID3D11Buffer *buffer, D3D11_MAP mapType, size_t bytesToWrite) = 0;
+	virtual void Unmap(ID3D11Buffer *buffer) = 0;
+	/**
+	 * Copies data into a range of a D3D11_USAGE_DEFAULT buffer. IE. UpdateSubresource()
+	 *
+	 * @param buffer        The buffer to update
+	 * @param byteOffset    The offset of the range to update, in bytes
+	 * @param byteSize      The size of the range, in bytes
+	 * @param data          The data to copy into the range
+	 */
+	virtual void UpdateBuffer(ID3D11Buffer *buffer, uint byteOffset, uint byteSize, const void *data) = 0;
+	/**
+	 * Copies a range of one buffer into another on the GPU. IE. CopySubresourceRegion()
+	 * The destination must be a D3D11_USAGE_DEFAULT buffer. The source can be immutable
+	 *
+	 * @param dest            The buffer to copy into
+	 * @param destOffset      The offset in 'dest' to copy to, in bytes
+	 * @param source          The buffer to copy from
+	 * @param sourceOffset    The offset in 'source' to copy from, in bytes
+	 * @param byteSize        The number of bytes to copy
+	 */
+	virtual void CopyBuffer(ID3D11Buffer *dest, uint destOffset, ID3D11Buffer *source, uint sourceOffset, uint byteSize) = 0;
+	/**
+	 * Adds to the upload statistics. For buffers that are mapped once and then sub-allocated,
+	 * where the number of bytes written isn't known at Map() time
+	 */
+	inline void RecordUpload(size_t bytesWritten) { m_stats.BytesUploaded += bytesWritten; }
+
+	// Fences
+	// Fences are D3D11_QUERY_EVENT queries. They complete when the GPU has finished
+	// all the work that was submitted before IssueFence() was called
+	virtual ID3D11Query *CreateFence() = 0;
+	virtual void ReleaseFence(ID3D11Query *fence) = 0;
+	virtual void IssueFence(ID3D11Query *fence) = 0;
+	/** Returns true if the GPU has passed the fence. Doesn't block */
+	virtual bool IsFenceComplete(ID3D11Query *fence) = 0;
+
+	// Draws
+	virtual void Draw(uint vertexCount, uint vertexStart) = 0;
+	virtual void DrawIndexed(uint indexCount, uint indexStart, int vertexStart) = 0;
+	virtual void DrawIndexedInstanced(uint indexCountPerInstance, uint instanceCount, uint indexStart, int vertexStart, uint instanceStart) = 0;
+};
+
+} // End of namespace Graphics
@@ -7,8 +7,10 @@
 #pragma once
 
 #include "common/typedefs.h"
+#include "common/dense_id_generator.h"
 
 #include "graphics/d3d_util.h"
+#include "graphics/shader_fwd.h"
 
 #include <d3d11.h>
 
@@ -25,7 +27,8 @@ protected:
 	BaseShader(ID3D11Device *device, bool hasPerFrameBuffer, bool hasPerObjectBuffer)
 			: m_d3dShader(nullptr),
 			  m_perFrameConstantBuffer(nullptr), 
-			  m_perObjectConstantBuffer(nullptr) {
+			  m_perObjectConstantBuffer(nullptr),
+			  m_id(Common::DenseIdGenerator<ShaderType>::Next()) {
 		// Create the two buffers
 		D3D11_BUFFER_DESC bufferDesc;
 		bufferDesc.Usage = D3D11_USAGE_DYNAMIC;
@@ -48,6 +51,7 @@ protected:
 
 public:
 	virtual ~BaseShader() {
+		Common::DenseIdGenerator<ShaderType>::Release(m_id);
 		ReleaseCOM(m_perObjectConstantBuffer);
 		ReleaseCOM(m_perFrameConstantBuffer);
 		ReleaseCOM(m_d3dShader);
@@ -57,8 +61,11 @@ protected:
 	ShaderType *m_d3dShader;
 	ID3D11Buffer *m_perFrameConstantBuffer;
 	ID3D11Buffer *m_perObjectConstantBuffer;
+	/** A dense id, unique among the live shaders of the same stage */
+	uint32 m_id;
 
 public:
+	inline uint32 GetId() const { return m_id; }
 	inline ID3D11Buffer *GetPerFrameConstantBuffer() { return m_perFrameConstantBuffer; }
 	inline ID3D11Buffer *GetPerObjectConstantBuffer() { return m_perObjectConstantBuffer; }
 	virtual inline void BindToPipeline(ID3D11DeviceContext *context) = 0;
@@ -0,0 +1,23 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+
+namespace Graphics {
+
+// Forward declarations of the shaders, for the headers that only pass them around by pointer.
+// IE. the RenderBackend interface and the commands. graphics/shader.h pulls in the D3D11 shader
+// loading code, so including it would keep those headers from building headless
+
+struct DefaultShaderConstantType;
+
+template <typename PerFrameType, typename PerObjectType>
+class PixelShader;
+
+typedef PixelShader<DefaultShaderConstantType, DefaultShaderConstantType> MaterialShader;
+
+} // End of namespace Graphics
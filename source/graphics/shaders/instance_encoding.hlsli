@@ -0,0 +1,71 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#ifndef INSTANCE_ENCODING_SHADER_H
+#define INSTANCE_ENCODING_SHADER_H
+
+// Decoders for the instance transforms packed by Scene::PackInstanceTransforms()
+// The values must match Scene::InstanceEncoding
+#define INSTANCE_ENCODING_AFFINE_3X4 0
+#define INSTANCE_ENCODING_QUAT_SCALE_TRANSLATION 1
+#define INSTANCE_ENCODING_QUAT_SCALE_TRANSLATION_HALF 2
+
+
+// The first three columns of the world matrix
+float4x4 DecodeAffine3x4(float4 c0, float4 c1, float4 c2) {
+	return float4x4(c0.x, c1.x, c2.x, 0.0f,
+	                c0.y, c1.y, c2.y, 0.0f,
+	                c0.z, c1.z, c2.z, 0.0f,
+	                c0.w, c1.w, c2.w, 1.0f);
+}
+
+// A rotation quaternion, and the translation in xyz with the uniform scale in w
+// Matches DirectX::XMMatrixRotationQuaternion()
+float4x4 DecodeQuatScaleTranslation(float4 q, float4 translationScale) {
+	float3 q2 = q.xyz * 2.0f;
+	float xx = q.x * q2.x;
+	float yy = q.y * q2.y;
+	float zz = q.z * q2.z;
+	float xy = q.x * q2.y;
+	float xz = q.x * q2.z;
+	float yz = q.y * q2.z;
+	float wx = q.w * q2.x;
+	float wy = q.w * q2.y;
+	float wz = q.w * q2.z;
+
+	float s = translationScale.w;
+	return float4x4((1.0f - yy - zz) * s, (xy + wz) * s,        (xz - wy) * s,        0.0f,
+	                (xy - wz) * s,        (1.0f - xx - zz) * s, (yz + wx) * s,        0.0f,
+	                (xz + wy) * s,        (yz - wx) * s,        (1.0f - xx - yy) * s, 0.0f,
+	                translationScale.xyz,                                             1.0f);
+}
+
+// The same as DecodeQuatScaleTranslation(), packed as 8 halfs
+// The quaternion xyzw are in packed.xy, the translation xyz and scale are in packed.zw. Low half first
+float4x4 DecodeQuatScaleTranslationHalf(uint4 packed) {
+	float4 q = float4(f16tof32(packed.xy), f16tof32(packed.xy >> 16)).xzyw;
+	float4 translationScale = float4(f16tof32(packed.zw), f16tof32(packed.zw >> 16)).xzyw;
+
+	return DecodeQuatScaleTranslation(q, translationScale);
+}
+
+// Reads the world matrix of an instance from an instance buffer
+//
+// instanceIndex is relative to the first instance of the draw. startVector is the index of the first float4 of the draw
+float4x4 LoadInstanceTransform(StructuredBuffer<float4> instanceBuffer, uint encoding, uint startVector, uint instanceIndex) {
+	[branch]
+	if (encoding == INSTANCE_ENCODING_QUAT_SCALE_TRANSLATION_HALF) {
+		return DecodeQuatScaleTranslationHalf(asuint(instanceBuffer[startVector + instanceIndex]));
+	} else if (encoding == INSTANCE_ENCODING_QUAT_SCALE_TRANSLATION) {
+		uint offset = startVector + instanceIndex * 2u;
+		return DecodeQuatScaleTranslation(instanceBuffer[offset], instanceBuffer[offset + 1u]);
+	} else {
+		uint offset = startVector + instanceIndex * 3u;
+		return DecodeAffine3x4(instanceBuffer[offset], instanceBuffer[offset + 1u], instanceBuffer[offset + 2u]);
+	}
+}
+
+#endif
@@ -0,0 +1,81 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "common/typedefs.h"
+#include "common/halfling_sys.h"
+
+
+namespace Graphics {
+
+/**
+ * A single bit field of a 64 bit command sort key
+ *
+ * Layouts are normally built with SortKeyFirstField and SortKeyNextField,
+ * so the shifts are computed by the compiler instead of by hand:
+ *
+ *     typedef SortKeyFirstField<4> Pass;
+ *     typedef SortKeyNextField<Pass, 12> Shader;
+ *     typedef SortKeyNextField<Shader, 16> Depth;
+ *
+ *     uint64 key = Pass::Encode(pass) | Shader::Encode(shaderId) | Depth::EncodeUnorm(depth);
+ *
+ * @tparam Shift    The bit offset of the LSB of the field
+ * @tparam Bits     The width of the field
+ */
+template <uint Shift, uint Bits>
+struct SortKeyField {
+	static_assert(Bits > 0u && Bits <= 64u, "A sort key field must be between 1 and 64 bits wide");
+	static_assert(Shift + Bits <= 64u, "The sort key field doesn't fit in 64 bits");
+
+	static const uint kShift = Shift;
+	static const uint kBits = Bits;
+	static const uint64 kMaxValue = Bits == 64u ? ~0ull : (1ull << (Bits % 64u)) - 1ull;
+	static const uint64 kMask = kMaxValue << Shift;
+
+	/**
+	 * Moves a value into the position of the field
+	 *
+	 * Values that don't fit are asserted on and then truncated
+	 */
+	static inline uint64 Encode(uint64 value) {
+		AssertMsg(value <= kMaxValue, "Value " << value << " doesn't fit in a " << Bits << " bit sort key field");
+		return (value & kMaxValue) << Shift;
+	}
+
+	/**
+	 * Quantizes a value in the range [0, 1] to the full range of the field
+	 * and moves it into position. Values outside the range are clamped
+	 *
+	 * NOTE: The scale is done in double, and the result is clamped rather than masked. A float can't hold
+	 *       the max value of fields of 24 bits or more, so 1.0 would round up to 2^Bits and wrap to 0
+	 */
+	static inline uint64 EncodeUnorm(float value) {
+		value = value < 0.0f ? 0.0f : (value > 1.0f ? 1.0f : value);
+		double scaled = static_cast<double>(value) * static_cast<double>(kMaxValue) + 0.5;
+		uint64 quantized = scaled >= static_cast<double>(kMaxValue) ? kMaxValue : static_cast<uint64>(scaled);
+		return quantized << Shift;
+	}
+
+	/** Extracts the value of the field from a key */
+	static inline uint64 Decode(uint64 key) {
+		return (key & kMask) >> Shift;
+	}
+};
+
+/** The field occupying the most significant bits of the key */
+template <uint Bits>
+struct SortKeyFirstField : public SortKeyField<64u - Bits, Bits> {
+};
+
+/** The field directly below PreviousField */
+template <typename PreviousField, uint Bits>
+struct SortKeyNextField : public SortKeyField<PreviousField::kShift - Bits, Bits> {
+	static_assert(PreviousField::kShift >= Bits, "The sort key layout doesn't fit in 64 bits");
+};
+
+} // End of namespace Graphics
@@ -0,0 +1,94 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "graphics/staged_structured_buffer.h"
+
+#include "common/dirty_range_list.h"
+#include "common/halfling_sys.h"
+
+#include "graphics/render_backend.h"
+
+#include <algorithm>
+#include <cstring>
+
+
+namespace Graphics {
+
+StagedStructuredBuffer::StagedStructuredBuffer(RenderBackend *backend, uint elementSize, uint capacity, uint framesInFlight)
+		: m_backend(backend),
+		  m_elementSize(elementSize),
+		  m_capacity(std::max(capacity, 1u)),
+		  m_buffer(nullptr),
+		  m_shaderResource(nullptr),
+		  m_staging(backend, elementSize, std::max(capacity, 1u), framesInFlight),
+		  m_lastUploadElementCount(0u),
+		  m_lastUploadCopyCount(0u) {
+	D3D11_BUFFER_DESC desc;
+	desc.Usage = D3D11_USAGE_DEFAULT;
+	desc.ByteWidth = m_capacity * m_elementSize;
+	desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+	desc.CPUAccessFlags = 0;
+	desc.MiscFlags = D3D11_RESOURCE_MISC_BUFFER_STRUCTURED;
+	desc.StructureByteStride = m_elementSize;
+
+	m_buffer = m_backend->CreateBuffer(desc, nullptr);
+	m_shaderResource = m_backend->CreateBufferShaderResource(m_buffer);
+}
+
+StagedStructuredBuffer::~StagedStructuredBuffer() {
+	m_backend->ReleaseShaderResource(m_shaderResource);
+	m_backend->ReleaseBuffer(m_buffer);
+}
+
+uint StagedStructuredBuffer::Upload(const void *elements, Common::DirtyRangeList *dirtyRanges) {
+	m_lastUploadElementCount = 0u;
+	m_lastUploadCopyCount = 0u;
+	if (dirtyRanges->IsEmpty()) {
+		return 0u;
+	}
+
+	// Scattered ranges are merged until there are few enough copies
+	uint maxGap = kMaxCoalesceGap;
+	dirtyRanges->Coalesce(maxGap);
+	while (dirtyRanges->GetRangeCount() > kMaxCopies) {
+		maxGap *= 2u;
+		dirtyRanges->Coalesce(maxGap);
+	}
+
+	const std::vector<Common::DirtyRange> &ranges = dirtyRanges->GetRanges();
+	AssertMsg(ranges.back().End <= m_capacity, "A dirty range ends at " << ranges.back().End << ", past the capacity of " << m_capacity);
+
+	uint elementCount = dirtyRanges->GetElementCount();
+
+	// Stage every range back to back, with one map
+	m_staging.BeginFrame();
+	InstanceStreamAllocation allocation = m_staging.Map(elementCount);
+	byte *stagingData = static_cast<byte *>(allocation.Data);
+	uint stagingOffset = 0u;
+	for (auto iter = ranges.begin(); iter != ranges.end(); ++iter) {
+		uint rangeSize = (iter->End - iter->Begin) * m_elementSize;
+		memcpy(stagingData + stagingOffset, static_cast<const byte *>(elements) + iter->Begin * m_elementSize, rangeSize);
+		stagingOffset += rangeSize;
+	}
+	m_staging.Unmap();
+
+	// Then copy each range into place
+	stagingOffset = allocation.FirstElement * m_elementSize;
+	for (auto iter = ranges.begin(); iter != ranges.end(); ++iter) {
+		uint rangeSize = (iter->End - iter->Begin) * m_elementSize;
+		m_backend->CopyBuffer(m_buffer, iter->Begin * m_elementSize, allocation.Buffer, stagingOffset, rangeSize);
+		stagingOffset += rangeSize;
+	}
+	m_staging.EndFrame();
+
+	m_lastUploadElementCount = elementCount;
+	m_lastUploadCopyCount = static_cast<uint>(ranges.size());
+	dirtyRanges->Clear();
+
+	return m_lastUploadCopyCount;
+}
+
+} // End of namespace Graphics
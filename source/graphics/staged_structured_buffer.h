@@ -0,0 +1,89 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "common/typedefs.h"
+
+#include "graphics/d3d11_types.h"
+#include "graphics/instance_stream.h"
+
+
+namespace Common {
+class DirtyRangeList;
+}
+
+namespace Graphics {
+
+class RenderBackend;
+
+/**
+ * A structured buffer whose elements stay on the GPU across frames, and only the ranges that changed are uploaded
+ *
+ * The caller keeps the elements in an array with the shader layout, and marks the ranges of it that change
+ * in a Common::DirtyRangeList. Upload() writes the dirty ranges, back to back, into a window of an InstanceStream,
+ * with a single WRITE_NO_OVERWRITE map, and then copies each range into place on the GPU. The stream is fenced,
+ * so the window is never written while the GPU could still be copying from it.
+ *
+ * Ranges that are close together are coalesced, so scattered changes become a few larger copies, rather than
+ * a copy per element. If there are still more than kMaxCopies ranges, the gap is doubled until there aren't.
+ *
+ * If nothing was marked, Upload() doesn't touch the backend at all, so buffers that don't change cost nothing.
+ */
+class StagedStructuredBuffer {
+public:
+	/**
+	 * @param backend           The backend to create, map, and copy the buffers with
+	 * @param elementSize       The size of one element in bytes. IE. the stride of the StructuredBuffer in the shader
+	 * @param capacity          The number of elements
+	 * @param framesInFlight    [Optional] The number of uploads the staging ring holds before the CPU has to wait for the GPU
+	 */
+	StagedStructuredBuffer(RenderBackend *backend, uint elementSize, uint capacity, uint framesInFlight = InstanceStream::kDefaultFramesInFlight);
+	~StagedStructuredBuffer();
+
+	/** Dirty ranges separated by at most this many clean elements are uploaded as one range */
+	static const uint kMaxCoalesceGap = 8u;
+	/** The most copies a single Upload() makes */
+	static const uint kMaxCopies = 64u;
+
+private:
+	RenderBackend *m_backend;
+	uint m_elementSize;
+	uint m_capacity;
+
+	ID3D11Buffer *m_buffer;
+	ID3D11ShaderResourceView *m_shaderResource;
+
+	InstanceStream m_staging;
+
+	uint m_lastUploadElementCount;
+	uint m_lastUploadCopyCount;
+
+public:
+	inline ID3D11Buffer *GetBuffer() const { return m_buffer; }
+	inline ID3D11ShaderResourceView *GetShaderResource() const { return m_shaderResource; }
+	inline uint GetCapacity() const { return m_capacity; }
+	inline uint GetElementSize() const { return m_elementSize; }
+	/** Returns the number of elements the last Upload() sent, including the clean elements between coalesced ranges */
+	inline uint GetLastUploadElementCount() const { return m_lastUploadElementCount; }
+	inline uint GetLastUploadCopyCount() const { return m_lastUploadCopyCount; }
+
+	/**
+	 * Uploads the dirty ranges of the elements, and clears the ranges
+	 *
+	 * @param elements       The elements, with the same layout as the shader structure. Only the dirty ranges are read
+	 * @param dirtyRanges    The ranges of elements that changed since the last Upload(). Every range has to be inside of the capacity
+	 * @return               The number of copies that were made
+	 */
+	uint Upload(const void *elements, Common::DirtyRangeList *dirtyRanges);
+
+private:
+	// Not implemented
+	StagedStructuredBuffer(const StagedStructuredBuffer &);
+	StagedStructuredBuffer &operator=(const StagedStructuredBuffer &);
+};
+
+} // End of namespace Graphics
@@ -23,6 +23,7 @@
 #pragma once
 
 #include "graphics/d3d_util.h"
+#include "graphics/render_backend.h"
 
 #include <d3d11.h>
 #include <vector>
@@ -57,6 +58,10 @@ public:
 	T *MapDiscard(ID3D11DeviceContext *d3dDeviceContext);
 	void Unmap(ID3D11DeviceContext *d3dDeviceContext);
 
+	// Same as above, but goes through a RenderBackend so the upload is counted
+	T *MapDiscard(RenderBackend *backend);
+	void Unmap(RenderBackend *backend);
+
 private:
 	// Not implemented
 	StructuredBuffer(const StructuredBuffer &);
@@ -106,6 +111,16 @@ void StructuredBuffer<T>::Unmap(ID3D11DeviceContext *d3dDeviceContext) {
 	d3dDeviceContext->Unmap(mBuffer, 0);
 }
 
+template <typename T>
+T *StructuredBuffer<T>::MapDiscard(RenderBackend *backend) {
+	return static_cast<T *>(backend->Map(mBuffer, D3D11_MAP_WRITE_DISCARD, sizeof(T) * m_numElements));
+}
+
+template <typename T>
+void StructuredBuffer<T>::Unmap(RenderBackend *backend) {
+	backend->Unmap(mBuffer);
+}
+
 
 // TODO: Constant buffers
 
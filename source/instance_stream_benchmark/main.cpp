@@ -0,0 +1,488 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "common/typedefs.h"
+
+#include "engine/timer.h"
+
+#include "graphics/instance_stream.h"
+#include "graphics/recording_render_backend.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+
+static const uint kMaxWindowsPerFrame = 1024u;
+static const uint kMaxWindowElements = 65536u;
+static const uint kMaxFramesInFlight = 16u;
+/** How much bigger the frame in the middle of the growth run is than the others */
+static const uint kGrowthSpikeFactor = 8u;
+/** How much bigger the windows of the single window run are than the usual frame */
+static const uint kWrapWindowFactor = 2u;
+/**
+ * The default budget for mapping, filling and unmapping a window, in nanoseconds, on the fastest frame. It's several
+ * times what an optimized build needs, so only real regressions trip it. Pass -budget 0 to turn it off, IE. for Debug builds
+ */
+static const uint kDefaultWindowBudget = 2000u;
+
+struct BenchmarkSettings {
+	BenchmarkSettings()
+		: Frames(600u),
+		  Windows(8u),
+		  MaxWindowElements(64u),
+		  InitialCapacity(256u),
+		  FramesInFlight(Graphics::InstanceStream::kDefaultFramesInFlight),
+		  WindowBudget(kDefaultWindowBudget) {
+	}
+
+	uint Frames;
+	/** The number of windows mapped every frame */
+	uint Windows;
+	/** Windows are between 1 and this many elements */
+	uint MaxWindowElements;
+	uint InitialCapacity;
+	uint FramesInFlight;
+	/** In nanoseconds per window. 0 turns the budget off */
+	uint WindowBudget;
+};
+
+/**
+ * A RecordingRenderBackend with a pretend GPU that runs 'lag' frames behind the CPU. A fence completes once
+ * 'lag' more fences have been issued after it. Spinning on a fence that isn't complete makes the GPU catch up
+ * to it, and counts as a wait
+ */
+class LaggingRenderBackend : public Graphics::RecordingRenderBackend {
+public:
+	LaggingRenderBackend(uint lag, bool supportsNoOverwrite)
+		: RecordingRenderBackend(true, supportsNoOverwrite),
+		  m_lag(lag),
+		  m_issuedFences(0u),
+		  m_completedFences(0u),
+		  m_spinningFence(nullptr),
+		  m_spins(0u),
+		  m_waits(0u),
+		  m_lastMapType(D3D11_MAP_WRITE_DISCARD) {
+	}
+
+	/** The number of polls in a row of the same fence that count as the CPU waiting on it */
+	static const uint kSpinsPerWait = 16u;
+
+private:
+	uint m_lag;
+	std::unordered_map<ID3D11Query *, uint> m_fenceIndices;
+	uint m_issuedFences;
+	/** Every fence issued before this one is complete */
+	uint m_completedFences;
+
+	ID3D11Query *m_spinningFence;
+	uint m_spins;
+	uint m_waits;
+
+	D3D11_MAP m_lastMapType;
+
+public:
+	inline uint GetIssuedFenceCount() const { return m_issuedFences; }
+	/** Returns the number of issued fences the GPU hasn't reached yet */
+	inline uint GetFencesInFlight() const { return m_issuedFences - m_completedFences; }
+	inline uint GetWaitCount() const { return m_waits; }
+	inline D3D11_MAP GetLastMapType() const { return m_lastMapType; }
+	/** Returns true if the GPU has finished with the work before the fence with the given index */
+	inline bool IsFenceIndexComplete(uint fenceIndex) const { return fenceIndex < m_completedFences; }
+
+	void IssueFence(ID3D11Query *fence) {
+		RecordingRenderBackend::IssueFence(fence);
+		m_fenceIndices[fence] = m_issuedFences++;
+		m_completedFences = std::max(m_completedFences, m_issuedFences > m_lag ? m_issuedFences - m_lag : 0u);
+		m_spinningFence = nullptr;
+	}
+
+	bool IsFenceComplete(ID3D11Query *fence) {
+		uint fenceIndex = m_fenceIndices[fence];
+		if (IsFenceIndexComplete(fenceIndex)) {
+			return true;
+		}
+
+		m_spins = fence == m_spinningFence ? m_spins + 1u : 1u;
+		m_spinningFence = fence;
+		if (m_spins < kSpinsPerWait) {
+			return false;
+		}
+
+		m_completedFences = fenceIndex + 1u;
+		m_spinningFence = nullptr;
+		++m_waits;
+		return true;
+	}
+
+	void *Map(ID3D11Buffer *buffer, D3D11_MAP mapType, size_t bytesToWrite) {
+		m_lastMapType = mapType;
+		return RecordingRenderBackend::Map(buffer, mapType, bytesToWrite);
+	}
+};
+
+struct StreamRun {
+	uint Lag;
+	bool NoOverwrite;
+	/** The frame that maps kGrowthSpikeFactor times the usual number of windows, or -1 for none */
+	int SpikeFrame;
+	/**
+	 * If true, every frame maps a single window of up to kWrapWindowFactor times the usual frame. The padding
+	 * at the wrap point is then a big part of the ring, so Map() has to wait for the GPU to free the start of it
+	 */
+	bool SingleWindow;
+};
+
+struct StreamResult {
+	uint Windows;
+	uint Wraps;
+	uint Grows;
+	uint Stalls;
+	/** The number of times the backend saw the CPU spin on a fence */
+	uint Waits;
+	/** The most fences in flight right after BeginFrame() */
+	uint MaxFencesInFlight;
+	uint Capacity;
+	/** The capacity right before and right after the spike frame */
+	uint PreSpikeCapacity;
+	uint SpikeCapacity;
+	/** The number of times the stream grew during the spike frame */
+	uint SpikeGrows;
+	/** The number of elements mapped in the biggest frame */
+	uint MaxFrameElements;
+
+	/** Windows that were mapped with NO_OVERWRITE over a window the GPU could still be reading */
+	uint Overlaps;
+	/** Windows that ran past the end of their buffer */
+	uint OutOfBounds;
+	/** Windows whose data changed before the GPU was done with them */
+	uint Corruptions;
+	/** Buffers the stream grew out of that were still alive after the next BeginFrame() */
+	uint UnreleasedBuffers;
+	/** Maps that weren't a discard of the start of the buffer, when NO_OVERWRITE isn't supported */
+	uint BadFallbackMaps;
+
+	double FastestFrameNanosecondsPerWindow;
+};
+
+/** A window of a frame the GPU may still be reading */
+struct TrackedWindow {
+	ID3D11Buffer *Buffer;
+	uint FirstElement;
+	uint NumElements;
+	uint Tag;
+	/** The index of the fence issued after the window's frame, or kUnfenced */
+	uint Fence;
+};
+
+static const uint kUnfenced = 0xFFFFFFFFu;
+
+void PrintUsage() {
+	printf("Usage: InstanceStreamBenchmark [-frames <count>] [-windows <count>] [-elements <count>] [-capacity <count>] [-inflight <count>] [-budget <ns>]\n\n"
+	       "    Streams random windows of instance data through an InstanceStream on a RecordingRenderBackend whose\n"
+	       "    fences complete some frames late. Checks that the ring wraps without writing over a window the GPU\n"
+	       "    could still be reading, that the CPU waits on the fences instead of running too far ahead, and that\n"
+	       "    the stream grows for a frame that doesn't fit while keeping the windows it already handed out.\n"
+	       "    Fails if the fastest frame takes longer than -budget nanoseconds per window.\n");
+}
+
+inline bool Overlaps(const TrackedWindow &window, ID3D11Buffer *buffer, uint firstElement, uint numElements) {
+	return window.Buffer == buffer && window.FirstElement < firstElement + numElements && firstElement < window.FirstElement + window.NumElements;
+}
+
+/** Returns true if every element of the window still holds its tag */
+bool IsIntact(const LaggingRenderBackend &backend, const TrackedWindow &window) {
+	const uint *data = reinterpret_cast<const uint *>(backend.GetBufferData(window.Buffer));
+	if (data == nullptr) {
+		return false;
+	}
+
+	for (uint i = 0; i < window.NumElements; ++i) {
+		if (data[window.FirstElement + i] != window.Tag) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Streams random windows through a new InstanceStream, checking every window against the ones the GPU could still be reading
+ *
+ * @param run         The backend and load to run with
+ * @param settings    The benchmark settings
+ * @return            The result
+ */
+StreamResult RunStream(const StreamRun &run, const BenchmarkSettings &settings) {
+	StreamResult result;
+	memset(&result, 0, sizeof(StreamResult));
+
+	LaggingRenderBackend backend(run.Lag, run.NoOverwrite);
+	Graphics::InstanceStream *stream = new Graphics::InstanceStream(&backend, sizeof(uint), settings.InitialCapacity, settings.FramesInFlight);
+
+	std::mt19937 random(1337u);
+	uint maxWindowElements = run.SingleWindow ? settings.Windows * settings.MaxWindowElements * kWrapWindowFactor : settings.MaxWindowElements;
+	std::uniform_int_distribution<uint> elementDistribution(1u, maxWindowElements);
+
+	std::vector<TrackedWindow> windows;
+	std::vector<ID3D11Buffer *> retiredBuffers;
+	uint nextTag = 1u;
+	ID3D11Buffer *lastBuffer = nullptr;
+	uint lastFirstElement = 0u;
+	Engine::Timer timer;
+
+	for (uint frame = 0; frame < settings.Frames; ++frame) {
+		uint issuedFences = backend.GetIssuedFenceCount();
+		stream->BeginFrame();
+
+		// The windows of the last frame are covered by the fence BeginFrame() just issued
+		if (backend.GetIssuedFenceCount() > issuedFences) {
+			for (auto iter = windows.begin(); iter != windows.end(); ++iter) {
+				if (iter->Fence == kUnfenced) {
+					iter->Fence = backend.GetIssuedFenceCount() - 1u;
+				}
+			}
+		}
+		result.MaxFencesInFlight = std::max(result.MaxFencesInFlight, backend.GetFencesInFlight());
+
+		for (auto iter = retiredBuffers.begin(); iter != retiredBuffers.end(); ++iter) {
+			result.UnreleasedBuffers += backend.GetBufferData(*iter) != nullptr ? 1u : 0u;
+		}
+		retiredBuffers.clear();
+
+		// Forget the windows in buffers the stream has let go of
+		windows.erase(std::remove_if(windows.begin(), windows.end(), [&](const TrackedWindow &window) {
+			return window.Buffer != stream->GetBuffer();
+		}), windows.end());
+
+		uint windowCount = run.SingleWindow ? 1u : settings.Windows;
+		if (static_cast<int>(frame) == run.SpikeFrame) {
+			windowCount *= kGrowthSpikeFactor;
+		}
+		uint growCount = stream->GetGrowCount();
+		uint capacity = stream->GetCapacity();
+		uint frameElements = 0u;
+		double frameMilliseconds = 0.0;
+
+		for (uint i = 0; i < windowCount; ++i) {
+			uint elementCount = elementDistribution(random);
+			uint tag = nextTag++;
+
+			timer.Start();
+			Graphics::InstanceStreamAllocation allocation = stream->Map(elementCount);
+			frameMilliseconds += timer.GetTime();
+
+			// Forget the windows the GPU is done with. Map() may have just waited for some of them
+			windows.erase(std::remove_if(windows.begin(), windows.end(), [&](const TrackedWindow &window) {
+				return window.Fence != kUnfenced && backend.IsFenceIndexComplete(window.Fence);
+			}), windows.end());
+
+			size_t bufferBytes = 0u;
+			backend.GetBufferData(allocation.Buffer, &bufferBytes);
+			if (static_cast<size_t>(allocation.FirstElement + elementCount) * sizeof(uint) > bufferBytes) {
+				stream->Unmap();
+				++result.OutOfBounds;
+				continue;
+			}
+
+			timer.Start();
+			uint *data = static_cast<uint *>(allocation.Data);
+			for (uint j = 0; j < elementCount; ++j) {
+				data[j] = tag;
+			}
+			stream->Unmap();
+			frameMilliseconds += timer.GetTime();
+
+			result.Wraps += allocation.Buffer == lastBuffer && allocation.FirstElement < lastFirstElement ? 1u : 0u;
+			lastBuffer = allocation.Buffer;
+			lastFirstElement = allocation.FirstElement;
+
+			if (!run.NoOverwrite) {
+				// Every map is a discard, so the window is only valid until the next map
+				result.BadFallbackMaps += backend.GetLastMapType() != D3D11_MAP_WRITE_DISCARD || allocation.FirstElement != 0u ? 1u : 0u;
+				windows.clear();
+			} else if (backend.GetLastMapType() == D3D11_MAP_WRITE_NO_OVERWRITE) {
+				for (auto iter = windows.begin(); iter != windows.end(); ++iter) {
+					result.Overlaps += Overlaps(*iter, allocation.Buffer, allocation.FirstElement, elementCount) ? 1u : 0u;
+				}
+			}
+
+			TrackedWindow window = {allocation.Buffer, allocation.FirstElement, elementCount, tag, kUnfenced};
+			windows.push_back(window);
+			frameElements += elementCount;
+		}
+
+		stream->EndFrame();
+
+		// Everything still tracked could be read by the GPU, including the windows of this frame in a buffer the stream grew out of
+		for (auto iter = windows.begin(); iter != windows.end(); ++iter) {
+			result.Corruptions += IsIntact(backend, *iter) ? 0u : 1u;
+		}
+
+		if (stream->GetGrowCount() > growCount) {
+			for (auto iter = windows.begin(); iter != windows.end(); ++iter) {
+				if (iter->Buffer != stream->GetBuffer() && std::find(retiredBuffers.begin(), retiredBuffers.end(), iter->Buffer) == retiredBuffers.end()) {
+					retiredBuffers.push_back(iter->Buffer);
+				}
+			}
+		}
+		if (static_cast<int>(frame) == run.SpikeFrame) {
+			result.PreSpikeCapacity = capacity;
+			result.SpikeCapacity = stream->GetCapacity();
+			result.SpikeGrows = stream->GetGrowCount() - growCount;
+		}
+
+		double nanosecondsPerWindow = frameMilliseconds * 1.0e6 / windowCount;
+		if (frame == 0u || nanosecondsPerWindow < result.FastestFrameNanosecondsPerWindow) {
+			result.FastestFrameNanosecondsPerWindow = nanosecondsPerWindow;
+		}
+		result.Windows += windowCount;
+		result.MaxFrameElements = std::max(result.MaxFrameElements, frameElements);
+	}
+
+	result.Grows = stream->GetGrowCount();
+	result.Stalls = stream->GetStallCount();
+	result.Waits = backend.GetWaitCount();
+	result.Capacity = stream->GetCapacity();
+
+	delete stream;
+	return result;
+}
+
+/** Returns true if none of the checks that apply to every run failed */
+bool IsSafe(const StreamResult &result) {
+	return result.Overlaps == 0u && result.OutOfBounds == 0u && result.Corruptions == 0u && result.UnreleasedBuffers == 0u && result.BadFallbackMaps == 0u;
+}
+
+void PrintResult(const char *name, const StreamRun &run, const StreamResult &result) {
+	printf("  %-12s %4u %8u %6u %6u %6u %6u %9u %9u %s\n", name, run.Lag, result.Capacity, result.Wraps, result.Grows, result.Stalls, result.Waits,
+	       result.MaxFencesInFlight, result.Overlaps + result.OutOfBounds + result.Corruptions + result.UnreleasedBuffers + result.BadFallbackMaps,
+	       IsSafe(result) ? "" : "UNSAFE");
+}
+
+/**
+ * A headless benchmark of InstanceStream. Exits with 1 if a window is mapped over one the GPU could still be reading,
+ * runs past its buffer or loses its data, if the ring never wraps, if the CPU runs more frames ahead than the stream
+ * allows or its waits don't match the stalls the stream reports, if the stream doesn't grow to fit a frame that's too
+ * big or keeps the buffer it grew out of, if it grows far beyond what the frames need, if the fallback path maps
+ * anything but discards of the start of the buffer, or if the fastest frame took longer than the budget
+ */
+int main(int argc, char *argv[]) {
+	BenchmarkSettings settings;
+
+	for (int i = 1; i < argc; ++i) {
+		if (i + 1 >= argc) {
+			PrintUsage();
+			return 1;
+		}
+
+		uint value = static_cast<uint>(atoi(argv[i + 1]));
+		if (strcmp(argv[i], "-frames") == 0) {
+			settings.Frames = value;
+		} else if (strcmp(argv[i], "-windows") == 0) {
+			settings.Windows = value;
+		} else if (strcmp(argv[i], "-elements") == 0) {
+			settings.MaxWindowElements = value;
+		} else if (strcmp(argv[i], "-capacity") == 0) {
+			settings.InitialCapacity = value;
+		} else if (strcmp(argv[i], "-inflight") == 0) {
+			settings.FramesInFlight = value;
+		} else if (strcmp(argv[i], "-budget") == 0) {
+			settings.WindowBudget = value;
+		} else {
+			PrintUsage();
+			return 1;
+		}
+		++i;
+	}
+
+	if (settings.Frames < 2u || settings.Windows == 0u || settings.Windows > kMaxWindowsPerFrame ||
+	    settings.MaxWindowElements == 0u || settings.MaxWindowElements > kMaxWindowElements ||
+	    settings.InitialCapacity == 0u || settings.FramesInFlight < 2u || settings.FramesInFlight > kMaxFramesInFlight) {
+		printf("Settings out of range. Frames must be at least 2, windows in [1, %u], elements in [1, %u], capacity at least 1, and frames in flight in [2, %u]\n\n",
+		       kMaxWindowsPerFrame, kMaxWindowElements, kMaxFramesInFlight);
+		PrintUsage();
+		return 1;
+	}
+
+	// The GPU keeps up as well as the ring allows, so the ring should wrap without waiting on every frame
+	StreamRun wraparoundRun = {settings.FramesInFlight - 1u, true, -1, false};
+	// The same, with one big window per frame
+	StreamRun bigWindowRun = {settings.FramesInFlight - 1u, true, -1, true};
+	// The GPU falls further behind than the ring allows, so the CPU has to wait
+	StreamRun fenceWaitRun = {settings.FramesInFlight + 2u, true, -1, false};
+	// One frame is much bigger than the rest, so the stream has to grow in the middle of it
+	StreamRun growthRun = {settings.FramesInFlight - 1u, true, static_cast<int>(settings.Frames / 2u), false};
+	// No NO_OVERWRITE maps of shader resource buffers. IE. D3D 11.0
+	StreamRun fallbackRun = {0u, false, -1, false};
+
+	StreamResult wraparound = RunStream(wraparoundRun, settings);
+	StreamResult bigWindow = RunStream(bigWindowRun, settings);
+	StreamResult fenceWait = RunStream(fenceWaitRun, settings);
+	StreamResult growth = RunStream(growthRun, settings);
+	StreamResult fallback = RunStream(fallbackRun, settings);
+
+	printf("%u frames of %u windows of up to %u elements, %u frames in flight, starting at %u elements\n\n",
+	       settings.Frames, settings.Windows, settings.MaxWindowElements, settings.FramesInFlight, settings.InitialCapacity);
+	printf("  %-12s %4s %8s %6s %6s %6s %6s %9s %9s\n", "Run", "Lag", "Capacity", "Wraps", "Grows", "Stalls", "Waits", "In flight", "Failures");
+	PrintResult("Wraparound", wraparoundRun, wraparound);
+	PrintResult("Big windows", bigWindowRun, bigWindow);
+	PrintResult("Fence waits", fenceWaitRun, fenceWait);
+	PrintResult("Growth", growthRun, growth);
+	PrintResult("Fallback", fallbackRun, fallback);
+
+	printf("\n  Growth spike:  %u elements, grew from %u to %u elements\n", growth.MaxFrameElements, growth.PreSpikeCapacity, growth.SpikeCapacity);
+	printf("  Fastest frame: %.1f ns per window\n", wraparound.FastestFrameNanosecondsPerWindow);
+	if (settings.WindowBudget > 0u) {
+		printf("  Budget: %u ns per window\n", settings.WindowBudget);
+	}
+
+	// The ring only has to hold the frames in flight, so doubling past the biggest frame's share is the most it should grow
+	uint maxWraparoundCapacity = std::max(settings.InitialCapacity, 4u * settings.FramesInFlight * wraparound.MaxFrameElements);
+
+	const StreamResult *runs[] = {&wraparound, &bigWindow, &fenceWait, &growth, &fallback};
+	for (uint i = 0; i < sizeof(runs) / sizeof(runs[0]); ++i) {
+		if (!IsSafe(*runs[i])) {
+			printf("\nFAILED: A window was mapped over one the GPU could still be reading, ran past its buffer, or lost its data,\n"
+			       "        a buffer the stream grew out of wasn't released, or the fallback mapped something other than a discard\n");
+			return 1;
+		}
+		if (runs[i]->MaxFencesInFlight >= settings.FramesInFlight || runs[i]->Stalls != runs[i]->Waits) {
+			printf("\nFAILED: The CPU ran more than %u frames ahead of the GPU, or its waits on the fences don't match the stalls\n", settings.FramesInFlight - 1u);
+			return 1;
+		}
+	}
+	if (wraparound.Wraps == 0u || bigWindow.Wraps == 0u) {
+		printf("\nFAILED: The ring never wrapped\n");
+		return 1;
+	}
+	if (wraparound.Capacity > maxWraparoundCapacity) {
+		printf("\nFAILED: The stream grew to %u elements, more than the %u its frames need\n", wraparound.Capacity, maxWraparoundCapacity);
+		return 1;
+	}
+	if (fenceWait.Stalls == 0u) {
+		printf("\nFAILED: The CPU never waited for a GPU that was %u frames behind\n", fenceWaitRun.Lag);
+		return 1;
+	}
+	if (growth.SpikeGrows == 0u || static_cast<uint64>(growth.SpikeCapacity) < 2ull * growth.PreSpikeCapacity) {
+		printf("\nFAILED: The stream didn't at least double its %u elements for a frame of %u elements\n", growth.PreSpikeCapacity, growth.MaxFrameElements);
+		return 1;
+	}
+	if (fallback.Stalls != 0u || fallback.Waits != 0u) {
+		printf("\nFAILED: The fallback waited on fences it shouldn't have issued\n");
+		return 1;
+	}
+	if (settings.WindowBudget > 0u && wraparound.FastestFrameNanosecondsPerWindow > settings.WindowBudget) {
+		printf("\nFAILED: The fastest frame took longer than the budget of %u ns per window\n", settings.WindowBudget);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,324 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "common/typedefs.h"
+#include "common/allocator_16_byte_aligned.h"
+
+#include "engine/timer.h"
+
+#include "scene/instance_encoding.h"
+#include "scene/instance_transform_store.h"
+
+#include <DirectXMath.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+
+typedef std::vector<DirectX::XMMATRIX, Common::Allocator16ByteAligned<DirectX::XMMATRIX> > MatrixList;
+typedef std::vector<DirectX::XMVECTOR, Common::Allocator16ByteAligned<DirectX::XMVECTOR> > VectorList;
+
+static const uint kDefaultInstanceCounts[] = {10000u, 100000u, 1000000u};
+static const Scene::InstanceEncoding kEncodings[] = {Scene::InstanceEncoding::AFFINE_3X4, Scene::InstanceEncoding::QUAT_SCALE_TRANSLATION, Scene::InstanceEncoding::QUAT_SCALE_TRANSLATION_HALF};
+// The old instance buffer layout. 3 float4 per instance
+static const uint kVectorsPerInstance = 3u;
+
+struct BenchmarkSettings {
+	BenchmarkSettings()
+		: Frames(50u),
+		  ChangedPerMille(10u) {
+	}
+
+	std::vector<uint> InstanceCounts;
+	uint Frames;
+	/** How many instances out of every 1000 move each frame in the dynamic run */
+	uint ChangedPerMille;
+};
+
+struct BenchmarkResult {
+	double PerFrameMilliseconds;
+	double FullUpdateMilliseconds;
+	double StaticFrameMilliseconds;
+	double DynamicFrameMilliseconds;
+	double DynamicUploadCalls;
+	double DynamicBytesUploaded;
+	float MaxError;
+};
+
+struct EncodingResult {
+	double FullUpdateMilliseconds;
+	/** The largest difference of an element of the rotation, divided by the scale */
+	float MaxRotationError;
+	/** The largest relative difference of the scale */
+	float MaxScaleError;
+	/** The largest difference of the translation, relative to its length */
+	float MaxTranslationError;
+};
+
+void PrintUsage() {
+	printf("Usage: InstanceTransformBenchmark [-instances <count>] [-frames <count>] [-changed <per mille>]\n\n"
+	       "    -instances    The number of instances. Can be given more than once. Defaults to 10000, 100000 and 1000000\n"
+	       "    -frames       The number of frames to average over. Defaults to 50\n"
+	       "    -changed      How many instances out of every 1000 move each frame in the dynamic run. Defaults to 10\n");
+}
+
+DirectX::XMMATRIX RandomTransform(std::mt19937 &generator) {
+	std::uniform_real_distribution<float> angle(0.0f, DirectX::XM_2PI);
+	std::uniform_real_distribution<float> scale(0.5f, 2.0f);
+	std::uniform_real_distribution<float> position(-1000.0f, 1000.0f);
+
+	float uniformScale = scale(generator);
+	return DirectX::XMMatrixScaling(uniformScale, uniformScale, uniformScale) *
+	       DirectX::XMMatrixRotationRollPitchYaw(angle(generator), angle(generator), angle(generator)) *
+	       DirectX::XMMatrixTranslation(position(generator), position(generator), position(generator));
+}
+
+/**
+ * What ClusterCulling::RenderMainPass() used to do every frame. Transform every instance
+ * one at a time, and write all of them to the instance buffer
+ */
+void TransformAllInstances(const MatrixList &transforms, DirectX::CXMMATRIX globalTransform, VectorList *output) {
+	DirectX::XMVECTOR *instanceBuffer = &(*output)[0];
+
+	uint bufferOffset = 0;
+	for (auto iter = transforms.begin(); iter != transforms.end(); ++iter) {
+		DirectX::XMMATRIX columnOrderMatrix = DirectX::XMMatrixTranspose(globalTransform * (*iter));
+		instanceBuffer[bufferOffset++] = columnOrderMatrix.r[0];
+		instanceBuffer[bufferOffset++] = columnOrderMatrix.r[1];
+		instanceBuffer[bufferOffset++] = columnOrderMatrix.r[2];
+	}
+}
+
+float MaxDifference(const VectorList &expected, const Scene::InstanceTransformStore &store) {
+	float maxError = 0.0f;
+	for (uint i = 0; i < store.GetSize(); ++i) {
+		const DirectX::XMVECTOR *actual = store.GetShaderVectors(i);
+		for (uint j = 0; j < kVectorsPerInstance; ++j) {
+			DirectX::XMFLOAT4 a;
+			DirectX::XMFLOAT4 b;
+			DirectX::XMStoreFloat4(&a, actual[j]);
+			DirectX::XMStoreFloat4(&b, expected[i * kVectorsPerInstance + j]);
+
+			maxError = std::max(maxError, std::max(std::max(std::fabs(a.x - b.x), std::fabs(a.y - b.y)), std::max(std::fabs(a.z - b.z), std::fabs(a.w - b.w))));
+		}
+	}
+
+	return maxError;
+}
+
+BenchmarkResult RunBenchmark(uint instanceCount, const BenchmarkSettings &settings) {
+	BenchmarkResult result;
+	std::mt19937 generator(1234u);
+
+	// Half as many extra transforms as instances, to move the instances to in the dynamic run
+	MatrixList transforms(instanceCount);
+	MatrixList newTransforms(instanceCount / 2u + 1u);
+	for (uint i = 0; i < instanceCount; ++i) {
+		transforms[i] = RandomTransform(generator);
+	}
+	for (uint i = 0; i < newTransforms.size(); ++i) {
+		newTransforms[i] = RandomTransform(generator);
+	}
+
+	DirectX::XMMATRIX globalTransform = DirectX::XMMatrixScaling(0.01f, 0.01f, 0.01f);
+	VectorList instanceBuffer(instanceCount * kVectorsPerInstance);
+
+	Engine::Timer timer;
+
+	// Every instance, every frame
+	timer.Start();
+	for (uint frame = 0; frame < settings.Frames; ++frame) {
+		TransformAllInstances(transforms, globalTransform, &instanceBuffer);
+	}
+	result.PerFrameMilliseconds = timer.GetTime() / settings.Frames;
+
+	// The store. The first Update() transforms everything
+	Scene::InstanceTransformStore store(nullptr, instanceCount);
+	store.SetGlobalTransform(globalTransform);
+	for (uint i = 0; i < instanceCount; ++i) {
+		store.Add(transforms[i]);
+	}
+	store.Update(nullptr);
+
+	// Changing the global transform dirties every instance, so this times the SIMD path on its own
+	timer.Start();
+	for (uint frame = 0; frame < settings.Frames; ++frame) {
+		store.SetGlobalTransform(globalTransform);
+		store.Update(nullptr);
+	}
+	result.FullUpdateMilliseconds = timer.GetTime() / settings.Frames;
+	result.MaxError = MaxDifference(instanceBuffer, store);
+
+	// Nothing moves
+	timer.Start();
+	for (uint frame = 0; frame < settings.Frames; ++frame) {
+		store.Update(nullptr);
+	}
+	result.StaticFrameMilliseconds = timer.GetTime() / settings.Frames;
+
+	// A few random instances move every frame
+	uint changedPerFrame = std::max(1u, static_cast<uint>(static_cast<uint64>(instanceCount) * settings.ChangedPerMille / 1000u));
+	std::uniform_int_distribution<uint> instanceDistribution(0u, instanceCount - 1u);
+	std::vector<uint> changedInstances(changedPerFrame * settings.Frames);
+	for (uint i = 0; i < changedInstances.size(); ++i) {
+		changedInstances[i] = instanceDistribution(generator);
+	}
+
+	uint64 uploadCalls = 0u;
+	uint64 bytesUploaded = 0u;
+	timer.Start();
+	for (uint frame = 0; frame < settings.Frames; ++frame) {
+		for (uint i = 0; i < changedPerFrame; ++i) {
+			uint instance = changedInstances[frame * changedPerFrame + i];
+			store.Set(instance, newTransforms[instance / 2u]);
+		}
+		store.Update(nullptr);
+
+		uploadCalls += store.GetLastUpdateStats().UploadCalls;
+		bytesUploaded += store.GetLastUpdateStats().BytesUploaded;
+	}
+	result.DynamicFrameMilliseconds = timer.GetTime() / settings.Frames;
+	result.DynamicUploadCalls = static_cast<double>(uploadCalls) / settings.Frames;
+	result.DynamicBytesUploaded = static_cast<double>(bytesUploaded) / settings.Frames;
+
+	// Check the partial updates against a full recompute
+	for (uint i = 0; i < changedInstances.size(); ++i) {
+		transforms[changedInstances[i]] = newTransforms[changedInstances[i] / 2u];
+	}
+	TransformAllInstances(transforms, globalTransform, &instanceBuffer);
+	result.MaxError = std::max(result.MaxError, MaxDifference(instanceBuffer, store));
+
+	return result;
+}
+
+/**
+ * Packs the instances with an encoding, and measures how far the decoded transforms are from the originals
+ */
+EncodingResult RunEncodingBenchmark(uint instanceCount, Scene::InstanceEncoding encoding, const BenchmarkSettings &settings) {
+	EncodingResult result;
+	std::mt19937 generator(1234u);
+
+	DirectX::XMMATRIX globalTransform = DirectX::XMMatrixScaling(0.01f, 0.01f, 0.01f);
+
+	MatrixList transforms(instanceCount);
+	Scene::InstanceTransformStore store(nullptr, instanceCount, encoding);
+	store.SetGlobalTransform(globalTransform);
+	for (uint i = 0; i < instanceCount; ++i) {
+		transforms[i] = RandomTransform(generator);
+		store.Add(transforms[i]);
+	}
+	store.Update(nullptr);
+
+	Engine::Timer timer;
+	timer.Start();
+	for (uint frame = 0; frame < settings.Frames; ++frame) {
+		store.SetGlobalTransform(globalTransform);
+		store.Update(nullptr);
+	}
+	result.FullUpdateMilliseconds = timer.GetTime() / settings.Frames;
+
+	result.MaxRotationError = 0.0f;
+	result.MaxScaleError = 0.0f;
+	result.MaxTranslationError = 0.0f;
+	for (uint i = 0; i < instanceCount; ++i) {
+		DirectX::XMFLOAT4X4 expected;
+		DirectX::XMFLOAT4X4 actual;
+		DirectX::XMStoreFloat4x4(&expected, globalTransform * transforms[i]);
+		DirectX::XMStoreFloat4x4(&actual, Scene::UnpackInstanceTransform(encoding, store.GetShaderVectors(i)));
+
+		float expectedScale = std::sqrt(expected.m[0][0] * expected.m[0][0] + expected.m[0][1] * expected.m[0][1] + expected.m[0][2] * expected.m[0][2]);
+		float actualScale = std::sqrt(actual.m[0][0] * actual.m[0][0] + actual.m[0][1] * actual.m[0][1] + actual.m[0][2] * actual.m[0][2]);
+		result.MaxScaleError = std::max(result.MaxScaleError, std::fabs(actualScale - expectedScale) / expectedScale);
+
+		for (uint row = 0; row < 3; ++row) {
+			for (uint column = 0; column < 3; ++column) {
+				result.MaxRotationError = std::max(result.MaxRotationError, std::fabs(actual.m[row][column] / actualScale - expected.m[row][column] / expectedScale));
+			}
+		}
+
+		float translationLength = std::sqrt(expected.m[3][0] * expected.m[3][0] + expected.m[3][1] * expected.m[3][1] + expected.m[3][2] * expected.m[3][2]);
+		float translationError = std::sqrt((actual.m[3][0] - expected.m[3][0]) * (actual.m[3][0] - expected.m[3][0]) +
+		                                   (actual.m[3][1] - expected.m[3][1]) * (actual.m[3][1] - expected.m[3][1]) +
+		                                   (actual.m[3][2] - expected.m[3][2]) * (actual.m[3][2] - expected.m[3][2]));
+		result.MaxTranslationError = std::max(result.MaxTranslationError, translationError / std::max(translationLength, 1.0e-6f));
+	}
+
+	return result;
+}
+
+/**
+ * A headless benchmark of Scene::InstanceTransformStore, against transforming
+ * and uploading every instance every frame
+ */
+int main(int argc, char *argv[]) {
+	BenchmarkSettings settings;
+
+	for (int i = 1; i < argc; ++i) {
+		if (i + 1 >= argc) {
+			PrintUsage();
+			return 1;
+		}
+
+		uint value = static_cast<uint>(atoi(argv[i + 1]));
+		if (strcmp(argv[i], "-instances") == 0) {
+			settings.InstanceCounts.push_back(value);
+		} else if (strcmp(argv[i], "-frames") == 0) {
+			settings.Frames = value;
+		} else if (strcmp(argv[i], "-changed") == 0) {
+			settings.ChangedPerMille = value;
+		} else {
+			PrintUsage();
+			return 1;
+		}
+		++i;
+	}
+
+	if (settings.InstanceCounts.empty()) {
+		settings.InstanceCounts.assign(kDefaultInstanceCounts, kDefaultInstanceCounts + sizeof(kDefaultInstanceCounts) / sizeof(kDefaultInstanceCounts[0]));
+	}
+	if (settings.Frames == 0u || settings.ChangedPerMille > 1000u || std::find(settings.InstanceCounts.begin(), settings.InstanceCounts.end(), 0u) != settings.InstanceCounts.end()) {
+		printf("Settings out of range. Instances and frames must be at least 1, and changed must be in [0, 1000]\n\n");
+		PrintUsage();
+		return 1;
+	}
+
+	printf("Average over %u frames. %.1f%% of the instances move each frame in the dynamic run\n\n", settings.Frames, settings.ChangedPerMille / 10.0f);
+	printf("  %10s %14s %14s %14s %14s %12s %12s %12s %10s\n", "Instances", "Every (ms)", "Full (ms)", "Static (ms)", "Dynamic (ms)", "Every (KB)", "Dyn. (KB)", "Dyn. calls", "Max error");
+
+	for (auto iter = settings.InstanceCounts.begin(); iter != settings.InstanceCounts.end(); ++iter) {
+		BenchmarkResult result = RunBenchmark(*iter, settings);
+
+		double everyFrameKilobytes = static_cast<double>(*iter) * kVectorsPerInstance * sizeof(DirectX::XMVECTOR) / 1024.0;
+		printf("  %10u %14.3f %14.3f %14.4f %14.3f %12.1f %12.1f %12.1f %10g\n", *iter,
+		       result.PerFrameMilliseconds, result.FullUpdateMilliseconds, result.StaticFrameMilliseconds, result.DynamicFrameMilliseconds,
+		       everyFrameKilobytes, result.DynamicBytesUploaded / 1024.0, result.DynamicUploadCalls, result.MaxError);
+	}
+
+	uint encodingInstanceCount = settings.InstanceCounts.front();
+	printf("\nEncodings, %u instances\n\n", encodingInstanceCount);
+	printf("  %-28s %8s %14s %14s %14s %14s %14s\n", "Encoding", "Bytes", "Full (ms)", "Every (KB)", "Rotation err", "Scale err", "Transl. err");
+	for (uint i = 0; i < sizeof(kEncodings) / sizeof(kEncodings[0]); ++i) {
+		EncodingResult result = RunEncodingBenchmark(encodingInstanceCount, kEncodings[i], settings);
+
+		uint instanceBytes = Scene::GetInstanceEncodingVectorCount(kEncodings[i]) * sizeof(DirectX::XMVECTOR);
+		printf("  %-28s %8u %14.3f %14.1f %14g %14g %14g\n", Scene::GetInstanceEncodingName(kEncodings[i]), instanceBytes,
+		       result.FullUpdateMilliseconds, static_cast<double>(encodingInstanceCount) * instanceBytes / 1024.0,
+		       result.MaxRotationError, result.MaxScaleError, result.MaxTranslationError);
+	}
+
+	printf("\n  Every:   Transform and upload every instance every frame, one at a time\n"
+	       "  Full:    The store, after the global transform changes. Every instance is transformed, 4 at a time\n"
+	       "  Static:  The store, when nothing moves\n"
+	       "  Dynamic: The store, when some instances move\n"
+	       "  Errors are the largest difference between the decoded transforms and the originals, over all the instances\n");
+
+	return 0;
+}
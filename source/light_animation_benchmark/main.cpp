@@ -0,0 +1,311 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "common/typedefs.h"
+#include "common/thread_pool.h"
+
+#include "engine/timer.h"
+
+#include "scene/light_animation_system.h"
+#include "scene/light_animator.h"
+#include "scene/lights.h"
+
+#include <DirectXMath.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+
+/** The update period of the demos, in seconds */
+static const double kUpdatePeriod = 1.0 / 30.0;
+/** The largest difference allowed between the directions of the two paths. DirectXMath may sum the rotation in another order */
+static const float kDirectionTolerance = 1.0e-6f;
+
+struct BenchmarkSettings {
+	BenchmarkSettings()
+		: Lights(0u),
+		  SpotPercent(25u),
+		  Frames(60u),
+		  Threads(0u) {
+	}
+
+	/** 0 means 10000, 100000, and 1000000 */
+	uint Lights;
+	uint SpotPercent;
+	uint Frames;
+	/** The number of worker threads for the parallel runs. 0 means one less than the number of hardware threads */
+	uint Threads;
+};
+
+struct Result {
+	uint Lights;
+	double AnimatorMilliseconds;
+	double SerialMilliseconds;
+	double ParallelMilliseconds;
+	/** The shader lights whose position or direction doesn't match the animators */
+	uint AnimatorMismatches;
+	/** The frames where the shader arrays of the serial and the parallel update, or of two parallel updates, differ */
+	uint ThreadMismatches;
+};
+
+/** The starting state of one animated light */
+struct LightMotion {
+	DirectX::XMFLOAT3 Position;
+	DirectX::XMFLOAT3 Direction;
+	DirectX::XMFLOAT3 Velocity;
+	DirectX::XMFLOAT3 NegativeBounds;
+	DirectX::XMFLOAT3 PositiveBounds;
+	DirectX::XMFLOAT3 AngularVelocity;
+};
+
+void PrintUsage() {
+	printf("Usage: LightAnimationBenchmark [-lights <count>] [-spots <percent>] [-frames <count>] [-threads <count>]\n\n"
+	       "    -lights     The number of lights. Defaults to running 10000, 100000, and 1000000\n"
+	       "    -spots      The percentage of the lights that are spot lights. Defaults to 25\n"
+	       "    -frames     The number of updates to run. Defaults to 60\n"
+	       "    -threads    The number of worker threads for the parallel runs. Defaults to one less than the number of hardware threads\n");
+}
+
+/**
+ * Lights bouncing around in boxes scattered over a 2000 x 2000 unit city. One in eight doesn't move, and half
+ * of the spot lights spin. The lights start inside of their boxes, like the ones in the demo scenes
+ */
+void CreateMotions(uint count, uint seed, bool spotLights, std::vector<LightMotion> *out_motions) {
+	std::mt19937 generator(seed);
+	std::uniform_real_distribution<float> center(-1000.0f, 1000.0f);
+	std::uniform_real_distribution<float> extent(5.0f, 50.0f);
+	std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+	std::uniform_real_distribution<float> fraction(0.0f, 1.0f);
+
+	out_motions->resize(count);
+	for (uint i = 0; i < count; ++i) {
+		LightMotion &motion = (*out_motions)[i];
+
+		DirectX::XMFLOAT3 boxCenter(center(generator), extent(generator), center(generator));
+		DirectX::XMFLOAT3 boxExtent(extent(generator), extent(generator) * 0.5f, extent(generator));
+		motion.NegativeBounds = DirectX::XMFLOAT3(boxCenter.x - boxExtent.x, boxCenter.y - boxExtent.y, boxCenter.z - boxExtent.z);
+		motion.PositiveBounds = DirectX::XMFLOAT3(boxCenter.x + boxExtent.x, boxCenter.y + boxExtent.y, boxCenter.z + boxExtent.z);
+		motion.Position = DirectX::XMFLOAT3(boxCenter.x + boxExtent.x * unit(generator), boxCenter.y + boxExtent.y * unit(generator), boxCenter.z + boxExtent.z * unit(generator));
+
+		bool moving = i % 8u != 0u;
+		motion.Velocity = moving ? DirectX::XMFLOAT3(20.0f * unit(generator), 5.0f * unit(generator), 20.0f * unit(generator)) : DirectX::XMFLOAT3(0.0f, 0.0f, 0.0f);
+
+		DirectX::XMStoreFloat3(&motion.Direction, DirectX::XMVector3Normalize(DirectX::XMVectorSet(unit(generator), unit(generator) - 1.0f, unit(generator), 0.0f)));
+		bool spinning = spotLights && fraction(generator) < 0.5f;
+		motion.AngularVelocity = spinning ? DirectX::XMFLOAT3(0.02f * unit(generator), 0.05f * unit(generator), 0.02f * unit(generator)) : DirectX::XMFLOAT3(0.0f, 0.0f, 0.0f);
+	}
+}
+
+/** Returns the number of shader lights whose positions differ, or whose directions differ by more than the tolerance */
+uint CountMismatches(const std::vector<Scene::ShaderPointLight> &expectedPoints, const std::vector<Scene::ShaderPointLight> &points,
+                     const std::vector<Scene::ShaderSpotLight> &expectedSpots, const std::vector<Scene::ShaderSpotLight> &spots) {
+	uint mismatches = 0u;
+	for (uint i = 0; i < expectedPoints.size(); ++i) {
+		mismatches += memcmp(&expectedPoints[i].Position, &points[i].Position, sizeof(DirectX::XMFLOAT3)) == 0 ? 0u : 1u;
+	}
+	for (uint i = 0; i < expectedSpots.size(); ++i) {
+		const DirectX::XMFLOAT3 &a = expectedSpots[i].Direction;
+		const DirectX::XMFLOAT3 &b = spots[i].Direction;
+		bool sameDirection = std::abs(a.x - b.x) <= kDirectionTolerance && std::abs(a.y - b.y) <= kDirectionTolerance && std::abs(a.z - b.z) <= kDirectionTolerance;
+		mismatches += memcmp(&expectedSpots[i].Position, &spots[i].Position, sizeof(DirectX::XMFLOAT3)) == 0 && sameDirection ? 0u : 1u;
+	}
+
+	return mismatches;
+}
+
+/** Returns true if the shader arrays are the same, to the bit */
+template <typename LightType>
+bool SameLights(const std::vector<LightType> &a, const std::vector<LightType> &b) {
+	return a.size() == b.size() && (a.empty() || memcmp(&a[0], &b[0], a.size() * sizeof(LightType)) == 0);
+}
+
+Result RunBenchmark(uint lightCount, const BenchmarkSettings &settings, Common::ThreadPool *threadPool) {
+	uint spotLightCount = lightCount * settings.SpotPercent / 100u;
+	uint pointLightCount = lightCount - spotLightCount;
+
+	std::vector<LightMotion> pointMotions;
+	std::vector<LightMotion> spotMotions;
+	CreateMotions(pointLightCount, lightCount, false, &pointMotions);
+	CreateMotions(spotLightCount, lightCount + 1u, true, &spotMotions);
+
+	// The old path: a light object and an animator per light, packed into the shader arrays after the update, like the demos did
+	std::vector<Scene::PointLight> pointLights;
+	std::vector<Scene::SpotLight> spotLights;
+	std::vector<Scene::PointLightAnimator> pointLightAnimators;
+	std::vector<Scene::SpotLightAnimator> spotLightAnimators;
+	pointLights.reserve(pointLightCount);
+	spotLights.reserve(spotLightCount);
+	pointLightAnimators.reserve(pointLightCount);
+	spotLightAnimators.reserve(spotLightCount);
+
+	// The new path, serial, and in parallel twice, to check that a run is repeatable
+	Scene::LightAnimationSystem serialSystem;
+	Scene::LightAnimationSystem parallelSystem;
+	Scene::LightAnimationSystem repeatSystem;
+
+	for (uint i = 0; i < pointLightCount; ++i) {
+		const LightMotion &motion = pointMotions[i];
+		pointLights.push_back(Scene::PointLight(DirectX::XMFLOAT3(1.0f, 0.8f, 0.6f), motion.Position, 800.0f, 15.0f));
+		pointLightAnimators.push_back(Scene::PointLightAnimator(motion.Velocity, motion.NegativeBounds, motion.PositiveBounds, &pointLights, i));
+
+		serialSystem.AddPointLight(i, motion.Position, motion.Velocity, motion.NegativeBounds, motion.PositiveBounds);
+		parallelSystem.AddPointLight(i, motion.Position, motion.Velocity, motion.NegativeBounds, motion.PositiveBounds);
+		repeatSystem.AddPointLight(i, motion.Position, motion.Velocity, motion.NegativeBounds, motion.PositiveBounds);
+	}
+	for (uint i = 0; i < spotLightCount; ++i) {
+		const LightMotion &motion = spotMotions[i];
+		spotLights.push_back(Scene::SpotLight(DirectX::XMFLOAT3(1.0f, 1.0f, 1.0f), motion.Position, 1200.0f, 30.0f, motion.Direction, 0.6f, 0.1f));
+		spotLightAnimators.push_back(Scene::SpotLightAnimator(motion.Velocity, motion.NegativeBounds, motion.PositiveBounds, motion.AngularVelocity, &spotLights, i));
+
+		serialSystem.AddSpotLight(i, motion.Position, motion.Direction, motion.Velocity, motion.NegativeBounds, motion.PositiveBounds, motion.AngularVelocity);
+		parallelSystem.AddSpotLight(i, motion.Position, motion.Direction, motion.Velocity, motion.NegativeBounds, motion.PositiveBounds, motion.AngularVelocity);
+		repeatSystem.AddSpotLight(i, motion.Position, motion.Direction, motion.Velocity, motion.NegativeBounds, motion.PositiveBounds, motion.AngularVelocity);
+	}
+
+	// Every path starts from the same packed lights
+	std::vector<Scene::ShaderPointLight> animatorPointLights(pointLightCount);
+	std::vector<Scene::ShaderSpotLight> animatorSpotLights(spotLightCount);
+	for (uint i = 0; i < pointLightCount; ++i) {
+		animatorPointLights[i] = pointLights[i].GetShaderPackedLight();
+	}
+	for (uint i = 0; i < spotLightCount; ++i) {
+		animatorSpotLights[i] = spotLights[i].GetShaderPackedLight();
+	}
+	std::vector<Scene::ShaderPointLight> serialPointLights(animatorPointLights);
+	std::vector<Scene::ShaderSpotLight> serialSpotLights(animatorSpotLights);
+	std::vector<Scene::ShaderPointLight> parallelPointLights(animatorPointLights);
+	std::vector<Scene::ShaderSpotLight> parallelSpotLights(animatorSpotLights);
+	std::vector<Scene::ShaderPointLight> repeatPointLights(animatorPointLights);
+	std::vector<Scene::ShaderSpotLight> repeatSpotLights(animatorSpotLights);
+	Scene::ShaderPointLight *serialPointData = pointLightCount > 0u ? &serialPointLights[0] : nullptr;
+	Scene::ShaderSpotLight *serialSpotData = spotLightCount > 0u ? &serialSpotLights[0] : nullptr;
+	Scene::ShaderPointLight *parallelPointData = pointLightCount > 0u ? &parallelPointLights[0] : nullptr;
+	Scene::ShaderSpotLight *parallelSpotData = spotLightCount > 0u ? &parallelSpotLights[0] : nullptr;
+	Scene::ShaderPointLight *repeatPointData = pointLightCount > 0u ? &repeatPointLights[0] : nullptr;
+	Scene::ShaderSpotLight *repeatSpotData = spotLightCount > 0u ? &repeatSpotLights[0] : nullptr;
+
+	Result result;
+	memset(&result, 0, sizeof(Result));
+	result.Lights = lightCount;
+
+	Engine::Timer timer;
+	for (uint frame = 0; frame < settings.Frames; ++frame) {
+		timer.Start();
+		for (auto iter = pointLightAnimators.begin(); iter != pointLightAnimators.end(); ++iter) {
+			iter->AnimateLight(kUpdatePeriod);
+		}
+		for (auto iter = spotLightAnimators.begin(); iter != spotLightAnimators.end(); ++iter) {
+			iter->AnimateLight(kUpdatePeriod);
+		}
+		for (uint i = 0; i < pointLightCount; ++i) {
+			animatorPointLights[i] = pointLights[i].GetShaderPackedLight();
+		}
+		for (uint i = 0; i < spotLightCount; ++i) {
+			animatorSpotLights[i] = spotLights[i].GetShaderPackedLight();
+		}
+		result.AnimatorMilliseconds += timer.GetTime();
+
+		timer.Start();
+		serialSystem.Update(kUpdatePeriod, serialPointData, pointLightCount, serialSpotData, spotLightCount);
+		result.SerialMilliseconds += timer.GetTime();
+
+		timer.Start();
+		parallelSystem.Update(kUpdatePeriod, parallelPointData, pointLightCount, parallelSpotData, spotLightCount, threadPool);
+		result.ParallelMilliseconds += timer.GetTime();
+
+		repeatSystem.Update(kUpdatePeriod, repeatPointData, pointLightCount, repeatSpotData, spotLightCount, threadPool);
+
+		// The thread count and the run can't change anything
+		bool sameAsSerial = SameLights(serialPointLights, parallelPointLights) && SameLights(serialSpotLights, parallelSpotLights);
+		bool sameAsRepeat = SameLights(repeatPointLights, parallelPointLights) && SameLights(repeatSpotLights, parallelSpotLights);
+		result.ThreadMismatches += sameAsSerial && sameAsRepeat ? 0u : 1u;
+	}
+
+	// Compare at the end, so every bounce has had a chance to happen
+	result.AnimatorMismatches = CountMismatches(animatorPointLights, serialPointLights, animatorSpotLights, serialSpotLights);
+
+	result.AnimatorMilliseconds /= settings.Frames;
+	result.SerialMilliseconds /= settings.Frames;
+	result.ParallelMilliseconds /= settings.Frames;
+
+	return result;
+}
+
+/**
+ * A headless benchmark and self-check of the SoA light animation in Scene::LightAnimationSystem. Animates 10k, 100k,
+ * and 1M point and spot lights bouncing around in boxes, with the old per light PointLightAnimator and SpotLightAnimator,
+ * followed by packing the lights into the shader arrays, and with LightAnimationSystem, which writes into the shader
+ * arrays directly, on one thread and on the thread pool. Exits with 1 if the positions don't match the animators to
+ * the bit, if the directions differ by more than the tolerance, or if the thread count or the run changes the result
+ */
+int main(int argc, char *argv[]) {
+	BenchmarkSettings settings;
+
+	for (int i = 1; i < argc; ++i) {
+		if (i + 1 >= argc) {
+			PrintUsage();
+			return 1;
+		}
+
+		uint value = static_cast<uint>(atoi(argv[i + 1]));
+		if (strcmp(argv[i], "-lights") == 0) {
+			settings.Lights = value;
+		} else if (strcmp(argv[i], "-spots") == 0) {
+			settings.SpotPercent = value;
+		} else if (strcmp(argv[i], "-frames") == 0) {
+			settings.Frames = value;
+		} else if (strcmp(argv[i], "-threads") == 0) {
+			settings.Threads = value;
+		} else {
+			PrintUsage();
+			return 1;
+		}
+		++i;
+	}
+
+	if (settings.SpotPercent > 100u || settings.Frames == 0u) {
+		printf("Settings out of range. Spots must be in [0, 100], and frames at least 1\n\n");
+		PrintUsage();
+		return 1;
+	}
+
+	std::vector<uint> lightCounts;
+	if (settings.Lights != 0u) {
+		lightCounts.push_back(settings.Lights);
+	} else {
+		lightCounts.push_back(10000u);
+		lightCounts.push_back(100000u);
+		lightCounts.push_back(1000000u);
+	}
+
+	Common::ThreadPool threadPool(settings.Threads);
+
+	printf("%u%% spot lights. Average over %u updates, %u worker threads\n\n", settings.SpotPercent, settings.Frames, threadPool.GetThreadCount());
+	printf("      Lights    Animators + pack (ms)    SoA, 1 thread (ms)    SoA, pool (ms)\n");
+
+	uint animatorMismatches = 0u;
+	uint threadMismatches = 0u;
+	for (auto iter = lightCounts.begin(); iter != lightCounts.end(); ++iter) {
+		Result result = RunBenchmark(*iter, settings, &threadPool);
+		printf("  %10u %24.3f %21.3f %17.3f\n", result.Lights, result.AnimatorMilliseconds, result.SerialMilliseconds, result.ParallelMilliseconds);
+
+		animatorMismatches += result.AnimatorMismatches;
+		threadMismatches += result.ThreadMismatches;
+	}
+	printf("\n  %u lights differed from the animators, and %u updates between 1 thread and the pool\n", animatorMismatches, threadMismatches);
+
+	if (animatorMismatches != 0u || threadMismatches != 0u) {
+		printf("\nFAILED: the SoA animation doesn't match the animators, or the thread count changed the result\n");
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,580 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "common/typedefs.h"
+#include "common/radix_sort.h"
+#include "common/thread_pool.h"
+
+#include "engine/timer.h"
+
+#include "scene/cluster_depth_slicing.h"
+#include "scene/cluster_light_assigner.h"
+#include "scene/light_bvh.h"
+#include "scene/lights.h"
+
+#include <DirectXMath.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+
+static const uint kScreenWidth = 1920u;
+static const uint kScreenHeight = 1080u;
+static const uint kTileSize = 16u;
+static const uint kSliceCount = 64u;
+static const float kNearClip = 0.1f;
+static const float kFarClip = 5000.0f;
+static const float kNearSliceDepth = 1.0f;
+static const float kFieldOfView = 0.25f * DirectX::XM_PI;
+/** The size of a GPU cache line, for the fetch coherence numbers */
+static const uint kCacheLineSize = 64u;
+
+struct BenchmarkSettings {
+	BenchmarkSettings()
+		: Lights(0u),
+		  SpotPercent(25u),
+		  Frames(5u),
+		  Threads(0u) {
+	}
+
+	/** 0 means 100000 and 1000000 */
+	uint Lights;
+	uint SpotPercent;
+	uint Frames;
+	/** The number of worker threads for the parallel runs. 0 means one less than the number of hardware threads */
+	uint Threads;
+};
+
+struct Result {
+	uint Lights;
+	double BuildMilliseconds;
+	double GatherMilliseconds;
+	double BVHAssignMilliseconds;
+	double FlatAssignMilliseconds;
+	double VisibleLights;
+	double IndicesPerFrame;
+	/** The average number of distinct cache lines of the light buffers that the lights of a cluster touch */
+	double InputOrderCacheLines;
+	double MortonOrderCacheLines;
+	uint BVHFailures;
+	uint AssignMismatches;
+	/** The (cluster, light) pairs of lights outside of the grid, that the flat binning conservatively added and the BVH culled */
+	uint CulledPairs;
+	uint ThreadMismatches;
+};
+
+void PrintUsage() {
+	printf("Usage: LightBVHBenchmark [-lights <count>] [-spots <percent>] [-frames <count>] [-threads <count>]\n\n"
+	       "    -lights     The number of lights. Defaults to running 100000 and 1000000\n"
+	       "    -spots      The percentage of the lights that are spot lights. Defaults to 25\n"
+	       "    -frames     The number of frames to average over. The camera moves every frame. Defaults to 5\n"
+	       "    -threads    The number of worker threads for the parallel runs. Defaults to one less than the number of hardware threads\n");
+}
+
+/** Lights scattered over a 2000 x 2000 unit city, up to 100 units above the ground, in random order */
+void CreateLights(uint lightCount, uint spotPercent, std::vector<Scene::ShaderPointLight> *out_pointLights, std::vector<Scene::ShaderSpotLight> *out_spotLights) {
+	std::mt19937 generator(lightCount);
+	std::uniform_real_distribution<float> position(-1000.0f, 1000.0f);
+	std::uniform_real_distribution<float> height(0.0f, 100.0f);
+	std::uniform_real_distribution<float> range(2.0f, 25.0f);
+	std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+	std::uniform_real_distribution<float> coneAngle(0.1f, 1.3f);
+
+	uint spotLightCount = lightCount * spotPercent / 100u;
+	out_pointLights->clear();
+	out_spotLights->clear();
+
+	for (uint i = 0; i < lightCount - spotLightCount; ++i) {
+		float lightRange = range(generator);
+		out_pointLights->push_back(Scene::ShaderPointLight(DirectX::XMFLOAT3(1.0f, 1.0f, 1.0f), DirectX::XMFLOAT3(position(generator), height(generator), position(generator)), lightRange, 1.0f / lightRange));
+	}
+	for (uint i = 0; i < spotLightCount; ++i) {
+		float lightRange = range(generator) * 2.0f;
+
+		DirectX::XMFLOAT3 direction;
+		DirectX::XMStoreFloat3(&direction, DirectX::XMVector3Normalize(DirectX::XMVectorSet(unit(generator), unit(generator) - 1.0f, unit(generator), 0.0f)));
+
+		out_spotLights->push_back(Scene::ShaderSpotLight(DirectX::XMFLOAT3(1.0f, 1.0f, 1.0f), DirectX::XMFLOAT3(position(generator), height(generator), position(generator)), lightRange, 1.0f / lightRange,
+		                                                 direction, std::cos(coneAngle(generator)), 1.0f));
+	}
+}
+
+/** Reversed depth, like the demos */
+DirectX::XMMATRIX CreateProjection() {
+	return DirectX::XMMatrixPerspectiveFovLH(kFieldOfView, float(kScreenWidth) / float(kScreenHeight), kFarClip, kNearClip);
+}
+
+/** The camera wanders around the middle of the city, and turns */
+DirectX::XMMATRIX CreateView(uint frame) {
+	float angle = frame * 0.6f;
+	DirectX::XMVECTOR eye = DirectX::XMVectorSet(300.0f * std::sin(frame * 0.13f), 20.0f + 10.0f * std::sin(frame * 0.5f), 300.0f * std::cos(frame * 0.07f), 1.0f);
+	DirectX::XMVECTOR forward = DirectX::XMVector3Normalize(DirectX::XMVectorSet(std::sin(angle), -0.1f, std::cos(angle), 0.0f));
+
+	return DirectX::XMMatrixLookToLH(eye, forward, DirectX::XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f));
+}
+
+/**
+ * Checks the radix sort against std::stable_sort, for counts around the chunk size, and for full and partial keys
+ *
+ * @return    The number of failed checks
+ */
+uint CheckRadixSort(Common::ThreadPool *threadPool) {
+	static const uint kCounts[] = {0u, 1u, 2u, 1000u, Common::RadixSorter::kChunkSize - 1u, Common::RadixSorter::kChunkSize, Common::RadixSorter::kChunkSize + 1u, 100000u};
+	static const uint kKeyBits[] = {32u, 30u, 8u};
+
+	Common::RadixSorter sorter;
+	std::mt19937 generator(5489u);
+	uint failures = 0u;
+	for (uint c = 0; c < sizeof(kCounts) / sizeof(kCounts[0]); ++c) {
+		for (uint b = 0; b < sizeof(kKeyBits) / sizeof(kKeyBits[0]); ++b) {
+			uint count = kCounts[c];
+			uint32 mask = kKeyBits[b] == 32u ? ~0u : (1u << kKeyBits[b]) - 1u;
+
+			// Few distinct keys, so the stability is tested too
+			std::vector<std::pair<uint32, uint32> > expected(count);
+			std::vector<uint32> keys(count);
+			std::vector<uint32> values(count);
+			for (uint i = 0; i < count; ++i) {
+				keys[i] = (i % 3u == 0u ? static_cast<uint32>(generator()) : static_cast<uint32>(generator() % 64u)) & mask;
+				values[i] = i;
+				expected[i] = std::make_pair(keys[i], i);
+			}
+			std::stable_sort(expected.begin(), expected.end(), [](const std::pair<uint32, uint32> &a, const std::pair<uint32, uint32> &b) { return a.first < b.first; });
+
+			std::vector<uint32> parallelKeys = keys;
+			std::vector<uint32> parallelValues = values;
+			if (count > 0u) {
+				sorter.SortPairs(&keys[0], &values[0], count, kKeyBits[b]);
+				sorter.SortPairs(&parallelKeys[0], &parallelValues[0], count, kKeyBits[b], threadPool);
+			}
+
+			bool ok = keys == parallelKeys && values == parallelValues;
+			for (uint i = 0; i < count && ok; ++i) {
+				ok = keys[i] == expected[i].first && values[i] == expected[i].second;
+			}
+			if (!ok) {
+				printf("Radix sort of %u keys with %u bits doesn't match std::stable_sort\n", count, kKeyBits[b]);
+				++failures;
+			}
+		}
+	}
+
+	return failures;
+}
+
+/** Returns true if box a contains box b */
+bool Contains(const DirectX::XMFLOAT3 &aMin, const DirectX::XMFLOAT3 &aMax, const DirectX::XMFLOAT3 &bMin, const DirectX::XMFLOAT3 &bMax) {
+	return aMin.x <= bMin.x && aMin.y <= bMin.y && aMin.z <= bMin.z && aMax.x >= bMax.x && aMax.y >= bMax.y && aMax.z >= bMax.z;
+}
+
+/** The bounding sphere of a point light */
+DirectX::XMFLOAT4 GetBoundingSphere(const Scene::ShaderPointLight &light) {
+	return DirectX::XMFLOAT4(light.Position.x, light.Position.y, light.Position.z, light.Range);
+}
+
+/** The bounding sphere of a spot light. The sphere through the apex and the rim of the cap for narrow cones, the one around the rim for wide ones */
+DirectX::XMFLOAT4 GetBoundingSphere(const Scene::ShaderSpotLight &light) {
+	double cosAngle = light.CosOuterConeAngle;
+	double radius = light.Range;
+	double distance = 0.0;
+	if (cosAngle >= std::sqrt(0.5)) {
+		radius = light.Range / (2.0 * cosAngle);
+		distance = radius;
+	} else if (cosAngle > 0.0) {
+		radius = light.Range * std::sqrt(1.0 - cosAngle * cosAngle);
+		distance = light.Range * cosAngle;
+	}
+
+	return DirectX::XMFLOAT4(static_cast<float>(light.Position.x + light.Direction.x * distance), static_cast<float>(light.Position.y + light.Direction.y * distance),
+	                         static_cast<float>(light.Position.z + light.Direction.z * distance), static_cast<float>(radius));
+}
+
+/**
+ * Checks the structure of a BVH: the codes are sorted, the sorted indices are a permutation, every leaf
+ * bounds the bounding spheres of its lights, and every node bounds its children
+ *
+ * @return    The number of failed checks
+ */
+template <typename LightType>
+uint CheckBVH(const Scene::LightBVH &bvh, const LightType *lights, uint lightCount) {
+	uint failures = 0u;
+	if (bvh.GetLightCount() != lightCount) {
+		printf("The BVH has %u lights instead of %u\n", bvh.GetLightCount(), lightCount);
+		return 1u;
+	}
+	if (lightCount == 0u) {
+		return 0u;
+	}
+
+	const std::vector<uint32> &codes = bvh.GetSortedCodes();
+	const std::vector<uint32> &indices = bvh.GetSortedIndices();
+	std::vector<bool> seen(lightCount, false);
+	bool permutation = true;
+	bool sorted = true;
+	for (uint i = 0; i < lightCount; ++i) {
+		permutation = permutation && indices[i] < lightCount && !seen[indices[i]];
+		if (indices[i] < lightCount) {
+			seen[indices[i]] = true;
+		}
+		sorted = sorted && (i == 0u || codes[i - 1u] <= codes[i]);
+	}
+	if (!permutation || !sorted) {
+		printf("The BVH order isn't a sorted permutation of the lights\n");
+		++failures;
+	}
+
+	uint uncontained = 0u;
+	for (uint leaf = 0; leaf < bvh.GetLevelSize(0u) && permutation; ++leaf) {
+		DirectX::XMFLOAT3 aabbMin;
+		DirectX::XMFLOAT3 aabbMax;
+		bvh.GetNodeBounds(0u, leaf, &aabbMin, &aabbMax);
+
+		uint end = std::min((leaf + 1u) * Scene::LightBVH::kLeafSize, lightCount);
+		for (uint i = leaf * Scene::LightBVH::kLeafSize; i < end; ++i) {
+			// Leave a little room for the float precision of the BVH
+			DirectX::XMFLOAT4 sphere = GetBoundingSphere(lights[indices[i]]);
+			float radius = sphere.w * 0.9999f;
+			DirectX::XMFLOAT3 lightMin(sphere.x - radius, sphere.y - radius, sphere.z - radius);
+			DirectX::XMFLOAT3 lightMax(sphere.x + radius, sphere.y + radius, sphere.z + radius);
+			uncontained += Contains(aabbMin, aabbMax, lightMin, lightMax) ? 0u : 1u;
+		}
+	}
+	for (uint level = 1u; level < bvh.GetLevelCount(); ++level) {
+		uint childCount = bvh.GetLevelSize(level - 1u);
+		for (uint node = 0; node < bvh.GetLevelSize(level); ++node) {
+			DirectX::XMFLOAT3 aabbMin;
+			DirectX::XMFLOAT3 aabbMax;
+			bvh.GetNodeBounds(level, node, &aabbMin, &aabbMax);
+
+			for (uint child = 2u * node; child < std::min(2u * node + 2u, childCount); ++child) {
+				DirectX::XMFLOAT3 childMin;
+				DirectX::XMFLOAT3 childMax;
+				bvh.GetNodeBounds(level - 1u, child, &childMin, &childMax);
+				uncontained += Contains(aabbMin, aabbMax, childMin, childMax) ? 0u : 1u;
+			}
+		}
+	}
+	if (bvh.GetLevelSize(bvh.GetLevelCount() - 1u) != 1u) {
+		printf("The top level of the BVH has %u nodes\n", bvh.GetLevelSize(bvh.GetLevelCount() - 1u));
+		++failures;
+	}
+	if (uncontained != 0u) {
+		printf("%u lights or nodes aren't inside of their parent node\n", uncontained);
+		++failures;
+	}
+
+	return failures;
+}
+
+/** Returns true if two assigners have the same ranges and indices */
+bool SameAssignment(const Scene::ClusterLightAssigner &a, const Scene::ClusterLightAssigner &b) {
+	const std::vector<Scene::ClusterLightRange> &rangesA = a.GetClusterRanges();
+	const std::vector<Scene::ClusterLightRange> &rangesB = b.GetClusterRanges();
+
+	return rangesA.size() == rangesB.size() && (rangesA.empty() || memcmp(&rangesA[0], &rangesB[0], rangesA.size() * sizeof(Scene::ClusterLightRange)) == 0) &&
+	       a.GetLightIndices() == b.GetLightIndices();
+}
+
+/** Returns true if a view space sphere reaches into the frustum of the whole grid. In double precision, with a little room for the float precision of the assigner */
+bool SphereTouchesGrid(const Scene::ClusterLightAssigner &assigner, const double *center, double radius) {
+	DirectX::XMFLOAT4 right = assigner.GetPlaneX(assigner.GetClusterCountX());
+	DirectX::XMFLOAT4 bottom = assigner.GetPlaneY(assigner.GetClusterCountY());
+	double planes[6][4] = {{assigner.GetPlaneX(0u).x, assigner.GetPlaneX(0u).y, assigner.GetPlaneX(0u).z, assigner.GetPlaneX(0u).w},
+	                       {-right.x, -right.y, -right.z, -right.w},
+	                       {assigner.GetPlaneY(0u).x, assigner.GetPlaneY(0u).y, assigner.GetPlaneY(0u).z, assigner.GetPlaneY(0u).w},
+	                       {-bottom.x, -bottom.y, -bottom.z, -bottom.w},
+	                       {0.0, 0.0, 1.0, -assigner.GetSliceDepth(0u)},
+	                       {0.0, 0.0, -1.0, assigner.GetSliceDepth(assigner.GetSliceCount())}};
+
+	bool touches = true;
+	for (uint i = 0; i < 6u; ++i) {
+		touches = touches && planes[i][0] * center[0] + planes[i][1] * center[1] + planes[i][2] * center[2] + planes[i][3] >= -radius * (1.0 - 1.0e-5) + 1.0e-4;
+	}
+	return touches;
+}
+
+/**
+ * Compares the BVH assisted binning with binning every light. The binning is conservative, so binning every
+ * light can also bin lights that are just outside of the grid, which the BVH culls. Every pair of the BVH
+ * assisted binning has to be in the other, and every pair that's missing has to be a light outside of the grid
+ *
+ * @param out_culledPairs    Incremented by the number of pairs of lights outside of the grid, that the BVH culled
+ * @return                   The number of pairs that don't match
+ */
+uint CompareAssignments(const Scene::ClusterLightAssigner &bvhAssigner, const Scene::ClusterLightAssigner &flatAssigner, DirectX::CXMMATRIX view,
+                        const std::vector<Scene::ShaderPointLight> &pointLights, const std::vector<Scene::ShaderSpotLight> &spotLights, uint *out_culledPairs) {
+	const std::vector<Scene::ClusterLightRange> &bvhRanges = bvhAssigner.GetClusterRanges();
+	const std::vector<Scene::ClusterLightRange> &flatRanges = flatAssigner.GetClusterRanges();
+	const std::vector<uint> &bvhIndices = bvhAssigner.GetLightIndices();
+	const std::vector<uint> &flatIndices = flatAssigner.GetLightIndices();
+	if (bvhRanges.size() != flatRanges.size()) {
+		return 1u;
+	}
+
+	DirectX::XMFLOAT4X4 viewMatrix;
+	DirectX::XMStoreFloat4x4(&viewMatrix, view);
+
+	uint mismatches = 0u;
+	for (uint cluster = 0; cluster < bvhRanges.size(); ++cluster) {
+		for (uint type = 0; type < 2u; ++type) {
+			const Scene::ClusterLightRange &bvhRange = bvhRanges[cluster];
+			const Scene::ClusterLightRange &flatRange = flatRanges[cluster];
+			uint bvhBegin = bvhRange.Offset + (type == 0u ? 0u : bvhRange.PointLightCount);
+			uint bvhEnd = bvhBegin + (type == 0u ? bvhRange.PointLightCount : bvhRange.SpotLightCount);
+			uint flatBegin = flatRange.Offset + (type == 0u ? 0u : flatRange.PointLightCount);
+			uint flatEnd = flatBegin + (type == 0u ? flatRange.PointLightCount : flatRange.SpotLightCount);
+
+			// Both lists are in ascending order
+			uint b = bvhBegin;
+			for (uint f = flatBegin; f < flatEnd; ++f) {
+				if (b < bvhEnd && bvhIndices[b] == flatIndices[f]) {
+					++b;
+					continue;
+				}
+
+				uint light = flatIndices[f];
+				DirectX::XMFLOAT4 sphere = type == 0u ? GetBoundingSphere(pointLights[light]) : GetBoundingSphere(spotLights[light]);
+				double center[3];
+				for (uint axis = 0; axis < 3u; ++axis) {
+					center[axis] = sphere.x * viewMatrix.m[0][axis] + sphere.y * viewMatrix.m[1][axis] + sphere.z * viewMatrix.m[2][axis] + viewMatrix.m[3][axis];
+				}
+				if (SphereTouchesGrid(flatAssigner, center, sphere.w)) {
+					if (mismatches < 5u) {
+						printf("%s light %u reaches the grid, but the BVH culled it from cluster %u\n", type == 0u ? "Point" : "Spot", light, cluster);
+					}
+					++mismatches;
+				} else {
+					++*out_culledPairs;
+				}
+			}
+			// Anything left over isn't in the flat binning at all
+			mismatches += bvhEnd - b;
+		}
+	}
+
+	return mismatches;
+}
+
+/** The average number of distinct cache lines of the light buffers that the lights of each non-empty cluster are in */
+double CountCacheLines(const Scene::ClusterLightAssigner &assigner) {
+	const std::vector<Scene::ClusterLightRange> &ranges = assigner.GetClusterRanges();
+	const std::vector<uint> &indices = assigner.GetLightIndices();
+
+	uint64 lineTotal = 0u;
+	uint clusterTotal = 0u;
+	for (auto iter = ranges.begin(); iter != ranges.end(); ++iter) {
+		if (iter->PointLightCount + iter->SpotLightCount == 0u) {
+			continue;
+		}
+		++clusterTotal;
+
+		// The indices of each cluster are in ascending order, so a line is new whenever it changes
+		for (uint type = 0; type < 2u; ++type) {
+			uint begin = iter->Offset + (type == 0u ? 0u : iter->PointLightCount);
+			uint end = begin + (type == 0u ? iter->PointLightCount : iter->SpotLightCount);
+			uint lightSize = type == 0u ? sizeof(Scene::ShaderPointLight) : sizeof(Scene::ShaderSpotLight);
+
+			uint lastLine = ~0u;
+			for (uint i = begin; i < end; ++i) {
+				uint line = indices[i] * lightSize / kCacheLineSize;
+				lineTotal += line != lastLine ? 1u : 0u;
+				lastLine = line;
+			}
+		}
+	}
+
+	return clusterTotal > 0u ? static_cast<double>(lineTotal) / clusterTotal : 0.0;
+}
+
+Result RunBenchmark(uint lightCount, const BenchmarkSettings &settings, Common::ThreadPool *threadPool) {
+	std::vector<Scene::ShaderPointLight> pointLights;
+	std::vector<Scene::ShaderSpotLight> spotLights;
+	CreateLights(lightCount, settings.SpotPercent, &pointLights, &spotLights);
+	uint pointLightCount = static_cast<uint>(pointLights.size());
+	uint spotLightCount = static_cast<uint>(spotLights.size());
+	const Scene::ShaderPointLight *pointLightData = pointLightCount > 0u ? &pointLights[0] : nullptr;
+	const Scene::ShaderSpotLight *spotLightData = spotLightCount > 0u ? &spotLights[0] : nullptr;
+
+	DirectX::XMMATRIX projection = CreateProjection();
+	Scene::ClusterDepthSlicing slicing;
+	slicing.SetLogarithmic(kNearClip, kFarClip, kSliceCount, kNearSliceDepth);
+
+	Scene::ClusterLightAssigner bvhAssigner;
+	Scene::ClusterLightAssigner flatAssigner;
+	Scene::ClusterLightAssigner sortedFlatAssigner;
+	Scene::ClusterLightAssigner serialAssigner;
+	bvhAssigner.SetGrid(projection, kScreenWidth, kScreenHeight, kTileSize, slicing.GetSliceDepths(), kSliceCount);
+	flatAssigner.SetGrid(projection, kScreenWidth, kScreenHeight, kTileSize, slicing.GetSliceDepths(), kSliceCount);
+	sortedFlatAssigner.SetGrid(projection, kScreenWidth, kScreenHeight, kTileSize, slicing.GetSliceDepths(), kSliceCount);
+	serialAssigner.SetGrid(projection, kScreenWidth, kScreenHeight, kTileSize, slicing.GetSliceDepths(), kSliceCount);
+
+	Scene::LightBVH pointLightBVH;
+	Scene::LightBVH spotLightBVH;
+	Scene::LightBVH serialPointLightBVH;
+	Scene::LightBVH serialSpotLightBVH;
+	std::vector<Scene::ShaderPointLight> sortedPointLights(pointLightCount);
+	std::vector<Scene::ShaderSpotLight> sortedSpotLights(spotLightCount);
+	const Scene::ShaderPointLight *sortedPointLightData = pointLightCount > 0u ? &sortedPointLights[0] : nullptr;
+	const Scene::ShaderSpotLight *sortedSpotLightData = spotLightCount > 0u ? &sortedSpotLights[0] : nullptr;
+
+	Result result;
+	memset(&result, 0, sizeof(Result));
+	result.Lights = lightCount;
+
+	Engine::Timer timer;
+	std::vector<uint> visible;
+	for (uint frame = 0; frame < settings.Frames; ++frame) {
+		DirectX::XMMATRIX view = CreateView(frame);
+
+		// The BVHs are rebuilt from scratch every frame, like they would be with moving lights
+		timer.Start();
+		pointLightBVH.Build(pointLightData, pointLightCount, threadPool);
+		spotLightBVH.Build(spotLightData, spotLightCount, threadPool);
+		result.BuildMilliseconds += timer.GetTime();
+
+		// Put the lights in the BVH order. This is the order they're uploaded in
+		timer.Start();
+		const std::vector<uint32> &pointOrder = pointLightBVH.GetSortedIndices();
+		const std::vector<uint32> &spotOrder = spotLightBVH.GetSortedIndices();
+		for (uint i = 0; i < pointLightCount; ++i) {
+			sortedPointLights[i] = pointLights[pointOrder[i]];
+		}
+		for (uint i = 0; i < spotLightCount; ++i) {
+			sortedSpotLights[i] = spotLights[spotOrder[i]];
+		}
+		result.GatherMilliseconds += timer.GetTime();
+
+		timer.Start();
+		result.IndicesPerFrame += bvhAssigner.AssignLights(view, sortedPointLightData, pointLightCount, sortedSpotLightData, spotLightCount, threadPool, &pointLightBVH, &spotLightBVH);
+		result.BVHAssignMilliseconds += timer.GetTime();
+		result.VisibleLights += bvhAssigner.GetBinnedLightCount();
+
+		// What the assignment cost before, with the lights in the order they were created
+		timer.Start();
+		flatAssigner.AssignLights(view, pointLightData, pointLightCount, spotLightData, spotLightCount, threadPool);
+		result.FlatAssignMilliseconds += timer.GetTime();
+
+		result.InputOrderCacheLines += CountCacheLines(flatAssigner);
+		result.MortonOrderCacheLines += CountCacheLines(bvhAssigner);
+
+		// The BVH culling is only allowed to skip lights that can't reach the grid
+		sortedFlatAssigner.AssignLights(view, sortedPointLightData, pointLightCount, sortedSpotLightData, spotLightCount, threadPool);
+		result.AssignMismatches += CompareAssignments(bvhAssigner, sortedFlatAssigner, view, sortedPointLights, sortedSpotLights, &result.CulledPairs);
+
+		// The thread count can't change anything
+		serialPointLightBVH.Build(pointLightData, pointLightCount);
+		serialSpotLightBVH.Build(spotLightData, spotLightCount);
+		serialAssigner.AssignLights(view, sortedPointLightData, pointLightCount, sortedSpotLightData, spotLightCount, nullptr, &serialPointLightBVH, &serialSpotLightBVH);
+		bool sameBVHs = serialPointLightBVH.GetSortedIndices() == pointOrder && serialSpotLightBVH.GetSortedIndices() == spotOrder;
+		result.ThreadMismatches += sameBVHs && SameAssignment(bvhAssigner, serialAssigner) ? 0u : 1u;
+
+		if (frame == 0u) {
+			result.BVHFailures += CheckBVH(pointLightBVH, pointLightData, pointLightCount);
+			result.BVHFailures += CheckBVH(spotLightBVH, spotLightData, spotLightCount);
+		}
+	}
+
+	result.BuildMilliseconds /= settings.Frames;
+	result.GatherMilliseconds /= settings.Frames;
+	result.BVHAssignMilliseconds /= settings.Frames;
+	result.FlatAssignMilliseconds /= settings.Frames;
+	result.IndicesPerFrame /= settings.Frames;
+	result.VisibleLights /= settings.Frames;
+	result.InputOrderCacheLines /= settings.Frames;
+	result.MortonOrderCacheLines /= settings.Frames;
+
+	return result;
+}
+
+/**
+ * A headless benchmark and self-check of the Morton ordered light BVH in Scene::LightBVH. Scatters 100k and 1M
+ * point and spot lights over a city, and every frame sorts them by Morton code, builds the BVH, gathers them
+ * into the BVH order, and bins them into a 1920 x 1080 grid of 16 x 16 pixel tiles and 64 depth slices, with
+ * the BVH culling the lights outside of the grid. Compares that with binning every light, in the order they
+ * were created, and counts the cache lines of the light buffers each cluster's lights are in, for both orders.
+ * Exits with 1 if the radix sort doesn't match std::stable_sort, if a BVH doesn't bound its lights, if the BVH
+ * assisted binning is missing a light that reaches the grid, or if the thread count changes the result
+ */
+int main(int argc, char *argv[]) {
+	BenchmarkSettings settings;
+
+	for (int i = 1; i < argc; ++i) {
+		if (i + 1 >= argc) {
+			PrintUsage();
+			return 1;
+		}
+
+		uint value = static_cast<uint>(atoi(argv[i + 1]));
+		if (strcmp(argv[i], "-lights") == 0) {
+			settings.Lights = value;
+		} else if (strcmp(argv[i], "-spots") == 0) {
+			settings.SpotPercent = value;
+		} else if (strcmp(argv[i], "-frames") == 0) {
+			settings.Frames = value;
+		} else if (strcmp(argv[i], "-threads") == 0) {
+			settings.Threads = value;
+		} else {
+			PrintUsage();
+			return 1;
+		}
+		++i;
+	}
+
+	if (settings.SpotPercent > 100u || settings.Frames == 0u) {
+		printf("Settings out of range. Spots must be in [0, 100], and frames at least 1\n\n");
+		PrintUsage();
+		return 1;
+	}
+
+	std::vector<uint> lightCounts;
+	if (settings.Lights != 0u) {
+		lightCounts.push_back(settings.Lights);
+	} else {
+		lightCounts.push_back(100000u);
+		lightCounts.push_back(1000000u);
+	}
+
+	Common::ThreadPool threadPool(settings.Threads);
+
+	uint sortFailures = CheckRadixSort(&threadPool);
+
+	printf("Grid: %u x %u pixels in %u x %u tiles, %u slices. %u%% spot lights. Average over %u frames, %u worker threads\n\n",
+	       kScreenWidth, kScreenHeight, kTileSize, kTileSize, kSliceCount, settings.SpotPercent, settings.Frames, threadPool.GetThreadCount());
+	printf("      Lights    Sort + build (ms)    Gather (ms)    BVH assign (ms)    Flat assign (ms)    Binned lights    Light indices    Cache lines per cluster (created / Morton order)\n");
+
+	uint bvhFailures = 0u;
+	uint assignMismatches = 0u;
+	uint culledPairs = 0u;
+	uint threadMismatches = 0u;
+	for (auto iter = lightCounts.begin(); iter != lightCounts.end(); ++iter) {
+		Result result = RunBenchmark(*iter, settings, &threadPool);
+		printf("  %10u %20.3f %14.3f %18.3f %19.3f %16.0f %16.0f %25.2f / %.2f\n", result.Lights, result.BuildMilliseconds, result.GatherMilliseconds, result.BVHAssignMilliseconds,
+		       result.FlatAssignMilliseconds, result.VisibleLights, result.IndicesPerFrame, result.InputOrderCacheLines, result.MortonOrderCacheLines);
+
+		bvhFailures += result.BVHFailures;
+		assignMismatches += result.AssignMismatches;
+		culledPairs += result.CulledPairs;
+		threadMismatches += result.ThreadMismatches;
+	}
+	printf("\n  The BVH culled %u (cluster, light) pairs of lights outside of the grid, that the flat binning added conservatively\n", culledPairs);
+	printf("  %u pairs differed between the BVH assisted and the flat binning otherwise, and %u frames between 1 thread and the pool\n", assignMismatches, threadMismatches);
+
+	if (sortFailures != 0u || bvhFailures != 0u) {
+		printf("\nFAILED: %u radix sort checks and %u BVH checks failed\n", sortFailures, bvhFailures);
+		return 1;
+	}
+	if (assignMismatches != 0u || threadMismatches != 0u) {
+		printf("\nFAILED: the BVH culling dropped lights that reach the grid, or the thread count changed the result\n");
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,315 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "common/typedefs.h"
+#include "common/dirty_range_list.h"
+#include "common/thread_pool.h"
+
+#include "engine/timer.h"
+
+#include "graphics/recording_render_backend.h"
+#include "graphics/staged_structured_buffer.h"
+
+#include "scene/light_animation_system.h"
+#include "scene/light_bvh.h"
+#include "scene/lights.h"
+
+#include <DirectXMath.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+
+/** The update period of the demos, in seconds */
+static const double kUpdatePeriod = 1.0 / 30.0;
+
+enum Scenario {
+	/** Nothing moves */
+	kStatic,
+	/** One light in a hundred moves */
+	kFewMoving,
+	/** Every light moves */
+	kAllMoving,
+	/** Nothing moves, but a few random lights change color every frame */
+	kScatteredEdits,
+	kScenarioCount
+};
+
+static const char *kScenarioNames[kScenarioCount] = {"Static", "1% moving", "All moving", "Scattered edits"};
+
+/** The number of lights that are edited every frame, in the scattered edits scenario */
+static const uint kEditsPerFrame = 100u;
+
+struct BenchmarkSettings {
+	BenchmarkSettings()
+		: Lights(0u),
+		  SpotPercent(25u),
+		  Frames(60u),
+		  Threads(0u) {
+	}
+
+	/** 0 means 10000 and 100000 */
+	uint Lights;
+	uint SpotPercent;
+	uint Frames;
+	/** The number of worker threads. 0 means one less than the number of hardware threads */
+	uint Threads;
+};
+
+struct Result {
+	uint Lights;
+	Scenario Scene;
+	/** What re-uploading every light every frame would cost */
+	double FullBytesPerFrame;
+	/** Averaged over every frame but the first, which uploads everything */
+	double BytesPerFrame;
+	double CopiesPerFrame;
+	double MapsPerFrame;
+	double UpdateMilliseconds;
+	/** The frames where the GPU copy of the lights doesn't match the CPU one */
+	uint ContentMismatches;
+};
+
+void PrintUsage() {
+	printf("Usage: LightUploadBenchmark [-lights <count>] [-spots <percent>] [-frames <count>] [-threads <count>]\n\n"
+	       "    -lights     The number of lights. Defaults to running 10000 and 100000\n"
+	       "    -spots      The percentage of the lights that are spot lights. Defaults to 25\n"
+	       "    -frames     The number of frames to run each scenario for. Defaults to 60\n"
+	       "    -threads    The number of worker threads. Defaults to one less than the number of hardware threads\n");
+}
+
+/** Lights scattered over a 2000 x 2000 unit city, each in a box it can bounce around in */
+void CreateLights(uint lightCount, uint spotPercent, Scenario scenario, std::vector<Scene::ShaderPointLight> *out_pointLights, std::vector<Scene::ShaderSpotLight> *out_spotLights,
+                  Scene::LightAnimationSystem *out_animation) {
+	std::mt19937 generator(lightCount);
+	std::uniform_real_distribution<float> position(-1000.0f, 1000.0f);
+	std::uniform_real_distribution<float> height(5.0f, 100.0f);
+	std::uniform_real_distribution<float> range(2.0f, 25.0f);
+	std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+
+	uint spotLightCount = lightCount * spotPercent / 100u;
+	uint pointLightCount = lightCount - spotLightCount;
+	out_pointLights->clear();
+	out_spotLights->clear();
+	out_animation->Clear();
+
+	for (uint i = 0; i < lightCount; ++i) {
+		bool spotLight = i >= pointLightCount;
+		DirectX::XMFLOAT3 center(position(generator), height(generator), position(generator));
+		DirectX::XMFLOAT3 negativeBounds(center.x - 20.0f, center.y - 5.0f, center.z - 20.0f);
+		DirectX::XMFLOAT3 positiveBounds(center.x + 20.0f, center.y + 5.0f, center.z + 20.0f);
+		DirectX::XMFLOAT3 velocity(10.0f * unit(generator), 2.0f * unit(generator), 10.0f * unit(generator));
+		float lightRange = range(generator);
+
+		if (!spotLight) {
+			out_pointLights->push_back(Scene::ShaderPointLight(DirectX::XMFLOAT3(1.0f, 1.0f, 1.0f), center, lightRange, 1.0f / lightRange));
+		} else {
+			DirectX::XMFLOAT3 direction;
+			DirectX::XMStoreFloat3(&direction, DirectX::XMVector3Normalize(DirectX::XMVectorSet(unit(generator), unit(generator) - 1.0f, unit(generator), 0.0f)));
+			out_spotLights->push_back(Scene::ShaderSpotLight(DirectX::XMFLOAT3(1.0f, 1.0f, 1.0f), center, lightRange * 2.0f, 0.5f / lightRange, direction, 0.8f, 1.0f));
+		}
+
+		bool moving = scenario == kAllMoving || (scenario == kFewMoving && i % 100u == 0u);
+		if (!moving) {
+			continue;
+		}
+		if (!spotLight) {
+			out_animation->AddPointLight(i, center, velocity, negativeBounds, positiveBounds);
+		} else {
+			out_animation->AddSpotLight(i - pointLightCount, center, out_spotLights->back().Direction, velocity, negativeBounds, positiveBounds, DirectX::XMFLOAT3(0.0f, 0.02f, 0.0f));
+		}
+	}
+}
+
+/** Returns true if the backend's copy of a buffer matches the CPU lights */
+template <typename LightType>
+bool MatchesGPU(const Graphics::RecordingRenderBackend &backend, const Graphics::StagedStructuredBuffer *buffer, const std::vector<LightType> &lights) {
+	if (lights.empty()) {
+		return true;
+	}
+
+	size_t size = 0u;
+	const byte *data = backend.GetBufferData(buffer->GetBuffer(), &size);
+	return data != nullptr && size >= lights.size() * sizeof(LightType) && memcmp(data, &lights[0], lights.size() * sizeof(LightType)) == 0;
+}
+
+/**
+ * Runs the light half of a cluster_culling frame: animate the packed lights, rebuild the BVHs if anything
+ * changed, gather the lights into the BVH order, and upload the ones that changed
+ */
+Result RunBenchmark(uint lightCount, Scenario scenario, const BenchmarkSettings &settings, Common::ThreadPool *threadPool) {
+	std::vector<Scene::ShaderPointLight> packedPointLights;
+	std::vector<Scene::ShaderSpotLight> packedSpotLights;
+	Scene::LightAnimationSystem animation;
+	CreateLights(lightCount, settings.SpotPercent, scenario, &packedPointLights, &packedSpotLights, &animation);
+	uint pointLightCount = static_cast<uint>(packedPointLights.size());
+	uint spotLightCount = static_cast<uint>(packedSpotLights.size());
+	Scene::ShaderPointLight *packedPointData = pointLightCount > 0u ? &packedPointLights[0] : nullptr;
+	Scene::ShaderSpotLight *packedSpotData = spotLightCount > 0u ? &packedSpotLights[0] : nullptr;
+
+	Graphics::RecordingRenderBackend backend;
+	Graphics::StagedStructuredBuffer pointLightBuffer(&backend, sizeof(Scene::ShaderPointLight), pointLightCount);
+	Graphics::StagedStructuredBuffer spotLightBuffer(&backend, sizeof(Scene::ShaderSpotLight), spotLightCount);
+
+	Scene::LightBVH pointLightBVH;
+	Scene::LightBVH spotLightBVH;
+	std::vector<Scene::ShaderPointLight> shaderPointLights(pointLightCount);
+	std::vector<Scene::ShaderSpotLight> shaderSpotLights(spotLightCount);
+	Scene::ShaderPointLight *shaderPointData = pointLightCount > 0u ? &shaderPointLights[0] : nullptr;
+	Scene::ShaderSpotLight *shaderSpotData = spotLightCount > 0u ? &shaderSpotLights[0] : nullptr;
+
+	Common::DirtyRangeList dirtyPointLights;
+	Common::DirtyRangeList dirtySpotLights;
+	Common::DirtyRangeList dirtyShaderPointLights;
+	Common::DirtyRangeList dirtyShaderSpotLights;
+	dirtyPointLights.Add(0u, pointLightCount);
+	dirtySpotLights.Add(0u, spotLightCount);
+
+	Result result;
+	memset(&result, 0, sizeof(Result));
+	result.Lights = lightCount;
+	result.Scene = scenario;
+	result.FullBytesPerFrame = static_cast<double>(pointLightCount) * sizeof(Scene::ShaderPointLight) + static_cast<double>(spotLightCount) * sizeof(Scene::ShaderSpotLight);
+
+	std::mt19937 generator(lightCount + 1u);
+	std::uniform_real_distribution<float> color(0.0f, 1.0f);
+
+	Engine::Timer timer;
+	for (uint frame = 0; frame <= settings.Frames; ++frame) {
+		backend.ResetStats();
+
+		timer.Start();
+		if (frame > 0u) {
+			animation.Update(kUpdatePeriod, packedPointData, pointLightCount, packedSpotData, spotLightCount, threadPool, &dirtyPointLights, &dirtySpotLights);
+		}
+
+		// An editor changing lights here and there
+		if (scenario == kScatteredEdits && frame > 0u) {
+			for (uint i = 0; i < kEditsPerFrame; ++i) {
+				uint light = static_cast<uint>(generator() % lightCount);
+				DirectX::XMFLOAT3 irradiance(color(generator), color(generator), color(generator));
+				if (light < pointLightCount) {
+					packedPointLights[light].Irradiance = irradiance;
+					dirtyPointLights.Add(light);
+				} else {
+					packedSpotLights[light - pointLightCount].Irradiance = irradiance;
+					dirtySpotLights.Add(light - pointLightCount);
+				}
+			}
+		}
+
+		if (!dirtyPointLights.IsEmpty()) {
+			pointLightBVH.Build(packedPointData, pointLightCount, threadPool);
+		}
+		if (!dirtySpotLights.IsEmpty()) {
+			spotLightBVH.Build(packedSpotData, spotLightCount, threadPool);
+		}
+		pointLightBVH.Gather(packedPointData, dirtyPointLights, shaderPointData, &dirtyShaderPointLights);
+		spotLightBVH.Gather(packedSpotData, dirtySpotLights, shaderSpotData, &dirtyShaderSpotLights);
+		dirtyPointLights.Clear();
+		dirtySpotLights.Clear();
+
+		pointLightBuffer.Upload(shaderPointData, &dirtyShaderPointLights);
+		spotLightBuffer.Upload(shaderSpotData, &dirtyShaderSpotLights);
+		double milliseconds = timer.GetTime();
+
+		bool matches = MatchesGPU(backend, &pointLightBuffer, shaderPointLights) && MatchesGPU(backend, &spotLightBuffer, shaderSpotLights);
+		result.ContentMismatches += matches ? 0u : 1u;
+
+		// The first frame uploads every light
+		if (frame > 0u) {
+			const Graphics::RenderBackendStats &stats = backend.GetStats();
+			result.BytesPerFrame += static_cast<double>(stats.BytesUploaded);
+			result.CopiesPerFrame += stats.BufferCopies;
+			result.MapsPerFrame += stats.Maps;
+			result.UpdateMilliseconds += milliseconds;
+		}
+	}
+
+	result.BytesPerFrame /= settings.Frames;
+	result.CopiesPerFrame /= settings.Frames;
+	result.MapsPerFrame /= settings.Frames;
+	result.UpdateMilliseconds /= settings.Frames;
+
+	return result;
+}
+
+/**
+ * A headless benchmark and self-check of the dirty range light uploads in Graphics::StagedStructuredBuffer. Runs the
+ * light half of a cluster_culling frame on a RecordingRenderBackend: animate the packed lights, rebuild the light BVHs
+ * if anything changed, gather the lights into the BVH order, and upload the lights that changed. Does that for a static
+ * scene, a scene where 1% of the lights move, one where they all move, and one where 100 random lights are edited every
+ * frame, and compares the bytes uploaded per frame with re-uploading every light. Exits with 1 if the GPU copy of the
+ * lights ever differs from the CPU one, or if a static scene uploads anything after the first frame
+ */
+int main(int argc, char *argv[]) {
+	BenchmarkSettings settings;
+
+	for (int i = 1; i < argc; ++i) {
+		if (i + 1 >= argc) {
+			PrintUsage();
+			return 1;
+		}
+
+		uint value = static_cast<uint>(atoi(argv[i + 1]));
+		if (strcmp(argv[i], "-lights") == 0) {
+			settings.Lights = value;
+		} else if (strcmp(argv[i], "-spots") == 0) {
+			settings.SpotPercent = value;
+		} else if (strcmp(argv[i], "-frames") == 0) {
+			settings.Frames = value;
+		} else if (strcmp(argv[i], "-threads") == 0) {
+			settings.Threads = value;
+		} else {
+			PrintUsage();
+			return 1;
+		}
+		++i;
+	}
+
+	if (settings.SpotPercent > 100u || settings.Frames == 0u) {
+		printf("Settings out of range. Spots must be in [0, 100], and frames at least 1\n\n");
+		PrintUsage();
+		return 1;
+	}
+
+	std::vector<uint> lightCounts;
+	if (settings.Lights != 0u) {
+		lightCounts.push_back(settings.Lights);
+	} else {
+		lightCounts.push_back(10000u);
+		lightCounts.push_back(100000u);
+	}
+
+	Common::ThreadPool threadPool(settings.Threads);
+
+	printf("%u%% spot lights. Average over %u frames, after the first, %u worker threads\n\n", settings.SpotPercent, settings.Frames, threadPool.GetThreadCount());
+	printf("      Lights    Scenario           Full upload (KB)    Dirty ranges (KB)    Copies    Maps    Update + upload (ms)\n");
+
+	uint contentMismatches = 0u;
+	uint staticUploads = 0u;
+	for (auto iter = lightCounts.begin(); iter != lightCounts.end(); ++iter) {
+		for (uint scenario = 0; scenario < kScenarioCount; ++scenario) {
+			Result result = RunBenchmark(*iter, static_cast<Scenario>(scenario), settings, &threadPool);
+			printf("  %10u    %-15s %19.1f %20.1f %9.1f %7.1f %23.3f\n", result.Lights, kScenarioNames[scenario], result.FullBytesPerFrame / 1024.0, result.BytesPerFrame / 1024.0,
+			       result.CopiesPerFrame, result.MapsPerFrame, result.UpdateMilliseconds);
+
+			contentMismatches += result.ContentMismatches;
+			staticUploads += scenario == kStatic && result.BytesPerFrame != 0.0 ? 1u : 0u;
+		}
+	}
+	printf("\n  %u frames where the uploaded lights differed from the CPU lights\n", contentMismatches);
+
+	if (contentMismatches != 0u || staticUploads != 0u) {
+		printf("\nFAILED: the uploaded lights don't match the CPU lights, or a static scene uploaded lights\n");
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,436 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "common/typedefs.h"
+#include "common/thread_pool.h"
+
+#include "engine/timer.h"
+
+#include "scene/occlusion_culler.h"
+
+#include <DirectXMath.h>
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+
+struct BenchmarkSettings {
+	BenchmarkSettings()
+		: Occluders(500u),
+		  Occludees(100000u),
+		  Frames(20u),
+		  Threads(0u) {
+	}
+
+	uint Occluders;
+	uint Occludees;
+	uint Frames;
+	/** The number of worker threads for the parallel runs. 0 means one less than the number of hardware threads */
+	uint Threads;
+};
+
+/** A box shaped occluder. Each one is a rotated, scaled copy of the unit cube */
+struct Occluder {
+	DirectX::XMFLOAT4X4 World;
+};
+
+struct Occludee {
+	DirectX::XMFLOAT3 Min;
+	DirectX::XMFLOAT3 Max;
+};
+
+void PrintUsage() {
+	printf("Usage: OcclusionCullingBenchmark [-occluders <count>] [-occludees <count>] [-frames <count>] [-threads <count>]\n\n"
+	       "    -occluders    The number of box occluders. Defaults to 500\n"
+	       "    -occludees    The number of AABBs to test. Defaults to 100000\n"
+	       "    -frames       The number of frames to average over. Defaults to 20\n"
+	       "    -threads      The number of worker threads for the parallel runs. Defaults to one less than the number of hardware threads\n");
+}
+
+/** The camera of a frame. It sits at the origin and sways a little from side to side */
+DirectX::XMMATRIX FrameViewProj(uint frame) {
+	float angle = std::sin(frame * 0.1f) * 0.2f;
+	DirectX::XMMATRIX view = DirectX::XMMatrixLookToLH(DirectX::XMVectorSet(0.0f, 0.0f, 0.0f, 1.0f), DirectX::XMVectorSet(std::sin(angle), 0.0f, std::cos(angle), 0.0f), DirectX::XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f));
+	// Reversed depth, like the demos
+	DirectX::XMMATRIX proj = DirectX::XMMatrixPerspectiveFovLH(0.33f * DirectX::XM_PI, 2.0f, 1000.0f, 0.1f);
+
+	return view * proj;
+}
+
+/** The projected screen rectangle and nearest depth of an AABB, with the same float math as OcclusionCuller::IsVisible() */
+bool ProjectBox(const Occludee &box, DirectX::CXMMATRIX viewProj, uint width, uint height, int *out_rect, float *out_nearestDepth) {
+	float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX;
+	float nearestDepth = 0.0f;
+	for (uint i = 0; i < 8; ++i) {
+		DirectX::XMVECTOR corner = DirectX::XMVectorSet((i & 1u) ? box.Max.x : box.Min.x, (i & 2u) ? box.Max.y : box.Min.y, (i & 4u) ? box.Max.z : box.Min.z, 1.0f);
+		DirectX::XMFLOAT4 clip;
+		DirectX::XMStoreFloat4(&clip, DirectX::XMVector4Transform(corner, viewProj));
+		if (clip.w < Scene::OcclusionCuller::kNearClipW) {
+			return false;
+		}
+
+		float inverseW = 1.0f / clip.w;
+		float x = (clip.x * inverseW * 0.5f + 0.5f) * width;
+		float y = (0.5f - clip.y * inverseW * 0.5f) * height;
+		minX = std::min(minX, x);
+		maxX = std::max(maxX, x);
+		minY = std::min(minY, y);
+		maxY = std::max(maxY, y);
+		nearestDepth = std::max(nearestDepth, inverseW);
+	}
+
+	if (maxX < 0.0f || maxY < 0.0f || minX >= width || minY >= height) {
+		return false;
+	}
+
+	out_rect[0] = static_cast<int>(std::max(minX, 0.0f));
+	out_rect[1] = static_cast<int>(std::max(minY, 0.0f));
+	out_rect[2] = static_cast<int>(std::min(maxX, width - 1.0f));
+	out_rect[3] = static_cast<int>(std::min(maxY, height - 1.0f));
+	*out_nearestDepth = nearestDepth;
+	return true;
+}
+
+/**
+ * An independent reference. A plain per-pixel rasterizer in double precision, that keeps the
+ * nearest 1 / w of every pixel. Pixel centers within a hair of an edge count as covered, so
+ * the reference errs on the side of more occlusion
+ */
+class ReferenceRasterizer {
+public:
+	ReferenceRasterizer(uint width, uint height)
+		: m_width(width),
+		  m_height(height),
+		  m_depths(width * height, 0.0) {
+	}
+
+	void DrawTriangle(const double *clip0, const double *clip1, const double *clip2) {
+		// Clip against the near plane
+		const double *input[3] = {clip0, clip1, clip2};
+		double polygon[4][4];
+		uint count = 0u;
+		for (uint i = 0; i < 3; ++i) {
+			const double *a = input[i];
+			const double *b = input[(i + 1u) % 3u];
+			double distanceA = a[3] - Scene::OcclusionCuller::kNearClipW;
+			double distanceB = b[3] - Scene::OcclusionCuller::kNearClipW;
+			if (distanceA >= 0.0) {
+				memcpy(polygon[count++], a, sizeof(double) * 4u);
+			}
+			if ((distanceA >= 0.0) != (distanceB >= 0.0)) {
+				double t = distanceA / (distanceA - distanceB);
+				for (uint j = 0; j < 4; ++j) {
+					polygon[count][j] = a[j] + (b[j] - a[j]) * t;
+				}
+				++count;
+			}
+		}
+
+		for (uint i = 2; i < count; ++i) {
+			DrawClippedTriangle(polygon[0], polygon[i - 1u], polygon[i]);
+		}
+	}
+
+	/** True if every pixel of the rectangle has something nearer than 'depth' */
+	bool IsOccluded(const int *rect, float depth) const {
+		for (int y = rect[1]; y <= rect[3]; ++y) {
+			for (int x = rect[0]; x <= rect[2]; ++x) {
+				if (depth >= m_depths[y * m_width + x] * (1.0 + 1.0e-4)) {
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+
+private:
+	uint m_width;
+	uint m_height;
+	std::vector<double> m_depths;
+
+	void DrawClippedTriangle(const double *v0, const double *v1, const double *v2) {
+		const double *vertices[3] = {v0, v1, v2};
+		double x[3], y[3], depth[3];
+		for (uint i = 0; i < 3; ++i) {
+			depth[i] = 1.0 / vertices[i][3];
+			x[i] = (vertices[i][0] * depth[i] * 0.5 + 0.5) * m_width;
+			y[i] = (0.5 - vertices[i][1] * depth[i] * 0.5) * m_height;
+		}
+
+		double area = (x[1] - x[0]) * (y[2] - y[0]) - (y[1] - y[0]) * (x[2] - x[0]);
+		if (area == 0.0) {
+			return;
+		}
+
+		int minX = std::max(static_cast<int>(std::floor(std::min(std::min(x[0], x[1]), x[2]))) - 1, 0);
+		int maxX = std::min(static_cast<int>(std::ceil(std::max(std::max(x[0], x[1]), x[2]))) + 1, static_cast<int>(m_width) - 1);
+		int minY = std::max(static_cast<int>(std::floor(std::min(std::min(y[0], y[1]), y[2]))) - 1, 0);
+		int maxY = std::min(static_cast<int>(std::ceil(std::max(std::max(y[0], y[1]), y[2]))) + 1, static_cast<int>(m_height) - 1);
+
+		for (int py = minY; py <= maxY; ++py) {
+			for (int px = minX; px <= maxX; ++px) {
+				double cx = px + 0.5;
+				double cy = py + 0.5;
+
+				// Barycentrics
+				double w0 = ((x[1] - cx) * (y[2] - cy) - (y[1] - cy) * (x[2] - cx)) / area;
+				double w1 = ((x[2] - cx) * (y[0] - cy) - (y[2] - cy) * (x[0] - cx)) / area;
+				double w2 = 1.0 - w0 - w1;
+				const double kTolerance = -1.0e-4;
+				if (w0 < kTolerance || w1 < kTolerance || w2 < kTolerance) {
+					continue;
+				}
+
+				double pixelDepth = w0 * depth[0] + w1 * depth[1] + w2 * depth[2];
+				double &stored = m_depths[py * m_width + px];
+				stored = std::max(stored, pixelDepth);
+			}
+		}
+	}
+};
+
+static const DirectX::XMFLOAT3 kCubePositions[8] = {
+	DirectX::XMFLOAT3(-0.5f, -0.5f, -0.5f), DirectX::XMFLOAT3(0.5f, -0.5f, -0.5f), DirectX::XMFLOAT3(0.5f, 0.5f, -0.5f), DirectX::XMFLOAT3(-0.5f, 0.5f, -0.5f),
+	DirectX::XMFLOAT3(-0.5f, -0.5f, 0.5f), DirectX::XMFLOAT3(0.5f, -0.5f, 0.5f), DirectX::XMFLOAT3(0.5f, 0.5f, 0.5f), DirectX::XMFLOAT3(-0.5f, 0.5f, 0.5f)
+};
+static const uint kCubeIndices[36] = {
+	0, 2, 1, 0, 3, 2,  4, 5, 6, 4, 6, 7,
+	0, 1, 5, 0, 5, 4,  3, 7, 6, 3, 6, 2,
+	0, 4, 7, 0, 7, 3,  1, 2, 6, 1, 6, 5
+};
+
+void RenderOccluders(Scene::OcclusionCuller &culler, const std::vector<Occluder> &occluders, DirectX::CXMMATRIX viewProj, Common::ThreadPool *threadPool) {
+	culler.ClearBuffer();
+	for (auto iter = occluders.begin(); iter != occluders.end(); ++iter) {
+		culler.AddOccluder(kCubePositions, kCubeIndices, 12u, DirectX::XMLoadFloat4x4(&iter->World) * viewProj);
+	}
+	culler.Flush(threadPool);
+}
+
+/** The floor slab of the random scene. Its triangles reach behind the camera, so they're clipped by the near plane */
+DirectX::XMMATRIX FloorWorld() {
+	return DirectX::XMMatrixScaling(2000.0f, 1.0f, 2000.0f) * DirectX::XMMatrixTranslation(0.0f, -20.0f, 900.0f);
+}
+
+/**
+ * Renders the occluders with and without threads, and checks the culler against the per-pixel reference
+ *
+ * @return    The number of failures. Boxes that are culled but visible in the reference, plus differences between the threaded and single threaded results
+ */
+uint CheckScene(const char *label, const std::vector<Occluder> &occluders, const std::vector<Occludee> &occludees, DirectX::CXMMATRIX viewProj,
+                Scene::OcclusionCuller &culler, Scene::OcclusionCuller &parallelCuller, Common::ThreadPool *threadPool) {
+	uint width = culler.GetWidth();
+	uint height = culler.GetHeight();
+	uint failures = 0u;
+
+	RenderOccluders(culler, occluders, viewProj, nullptr);
+	RenderOccluders(parallelCuller, occluders, viewProj, threadPool);
+
+	if (culler.GetTileDepths() != parallelCuller.GetTileDepths()) {
+		printf("  %s: the depth buffer differs between the single threaded and the parallel run\n", label);
+		++failures;
+	}
+
+	ReferenceRasterizer reference(width, height);
+	for (auto iter = occluders.begin(); iter != occluders.end(); ++iter) {
+		DirectX::XMMATRIX worldViewProj = DirectX::XMLoadFloat4x4(&iter->World) * viewProj;
+		for (uint t = 0; t < 12; ++t) {
+			double clip[3][4];
+			for (uint v = 0; v < 3; ++v) {
+				DirectX::XMFLOAT4 position;
+				DirectX::XMStoreFloat4(&position, DirectX::XMVector3Transform(DirectX::XMLoadFloat3(&kCubePositions[kCubeIndices[t * 3u + v]]), worldViewProj));
+				clip[v][0] = position.x;
+				clip[v][1] = position.y;
+				clip[v][2] = position.z;
+				clip[v][3] = position.w;
+			}
+			reference.DrawTriangle(clip[0], clip[1], clip[2]);
+		}
+	}
+
+	uint culled = 0u;
+	uint referenceCulled = 0u;
+	uint wronglyCulled = 0u;
+	uint parallelDifferences = 0u;
+	for (auto iter = occludees.begin(); iter != occludees.end(); ++iter) {
+		bool visible = culler.IsVisible(iter->Min, iter->Max, viewProj);
+		if (visible != parallelCuller.IsVisible(iter->Min, iter->Max, viewProj)) {
+			++parallelDifferences;
+		}
+
+		int rect[4];
+		float nearestDepth;
+		bool referenceVisible = !ProjectBox(*iter, viewProj, width, height, rect, &nearestDepth) || !reference.IsOccluded(rect, nearestDepth);
+
+		culled += visible ? 0u : 1u;
+		referenceCulled += referenceVisible ? 0u : 1u;
+		if (!visible && referenceVisible) {
+			++wronglyCulled;
+		}
+	}
+
+	printf("  %s: culled %u of %u occludees. The per-pixel reference culls %u (%.1f%% found). Wrongly culled: %u. Thread differences: %u\n",
+	       label, culled, static_cast<uint>(occludees.size()), referenceCulled, referenceCulled == 0u ? 100.0 : 100.0 * culled / referenceCulled, wronglyCulled, parallelDifferences);
+
+	return failures + wronglyCulled + parallelDifferences;
+}
+
+/**
+ * A fixed scene that doesn't depend on the random number generator: the floor slab alone, seen from the camera
+ * of frame 19, with a grid of boxes standing on it. The float set up of the near clipped floor triangles used to
+ * put the floor far nearer than it is, and cull thousands of these boxes
+ */
+uint CheckClippedFloorRegression(Scene::OcclusionCuller &culler, Scene::OcclusionCuller &parallelCuller, Common::ThreadPool *threadPool) {
+	std::vector<Occluder> occluders(1u);
+	DirectX::XMStoreFloat4x4(&occluders[0].World, FloorWorld());
+
+	std::vector<Occludee> occludees;
+	for (float z = 40.0f; z <= 400.0f; z += 5.0f) {
+		for (float x = -150.0f; x <= 150.0f; x += 5.0f) {
+			Occludee box;
+			box.Min = DirectX::XMFLOAT3(x, -19.0f, z);
+			box.Max = DirectX::XMFLOAT3(x + 2.0f, -17.0f, z + 2.0f);
+			occludees.push_back(box);
+		}
+	}
+
+	return CheckScene("Clipped floor", occluders, occludees, FrameViewProj(19u), culler, parallelCuller, threadPool);
+}
+
+/**
+ * A headless benchmark and self-check of Scene::OcclusionCuller. Checks that:
+ *     - The depth buffer and the test results are the same with and without threads
+ *     - Nothing the culler calls hidden is visible in a per-pixel reference rasterization
+ * on the random scene, and on fixed scenes that used to fail. Exits with 1 if either check fails
+ */
+int main(int argc, char *argv[]) {
+	BenchmarkSettings settings;
+
+	for (int i = 1; i < argc; ++i) {
+		if (i + 1 >= argc) {
+			PrintUsage();
+			return 1;
+		}
+
+		uint value = static_cast<uint>(atoi(argv[i + 1]));
+		if (strcmp(argv[i], "-occluders") == 0) {
+			settings.Occluders = value;
+		} else if (strcmp(argv[i], "-occludees") == 0) {
+			settings.Occludees = value;
+		} else if (strcmp(argv[i], "-frames") == 0) {
+			settings.Frames = value;
+		} else if (strcmp(argv[i], "-threads") == 0) {
+			settings.Threads = value;
+		} else {
+			PrintUsage();
+			return 1;
+		}
+		++i;
+	}
+
+	if (settings.Occludees == 0u || settings.Frames == 0u) {
+		printf("Settings out of range. Occludees and frames must be at least 1\n\n");
+		PrintUsage();
+		return 1;
+	}
+
+	Common::ThreadPool threadPool(settings.Threads);
+	std::mt19937 generator(1234u);
+
+	// Walls and pillars in front of the camera, and a floor
+	std::uniform_real_distribution<float> spread(-1.0f, 1.0f);
+	std::uniform_real_distribution<float> distance(15.0f, 300.0f);
+	std::uniform_real_distribution<float> size(2.0f, 30.0f);
+	std::uniform_real_distribution<float> angle(0.0f, DirectX::XM_2PI);
+
+	std::vector<Occluder> occluders(settings.Occluders);
+	for (uint i = 0; i < occluders.size(); ++i) {
+		float z = distance(generator);
+		DirectX::XMMATRIX world = DirectX::XMMatrixScaling(size(generator), size(generator), 1.0f + size(generator) * 0.1f) *
+		                          DirectX::XMMatrixRotationY(angle(generator)) *
+		                          DirectX::XMMatrixTranslation(spread(generator) * z, spread(generator) * z * 0.3f, z);
+		if (i == 0u) {
+			world = FloorWorld();
+		}
+		DirectX::XMStoreFloat4x4(&occluders[i].World, world);
+	}
+
+	std::uniform_real_distribution<float> occludeeDistance(5.0f, 500.0f);
+	std::uniform_real_distribution<float> occludeeSize(0.2f, 4.0f);
+	std::vector<Occludee> occludees(settings.Occludees);
+	for (auto iter = occludees.begin(); iter != occludees.end(); ++iter) {
+		float z = occludeeDistance(generator);
+		DirectX::XMFLOAT3 center(spread(generator) * z, spread(generator) * z * 0.5f, z);
+		float extent = occludeeSize(generator);
+		iter->Min = DirectX::XMFLOAT3(center.x - extent, center.y - extent, center.z - extent);
+		iter->Max = DirectX::XMFLOAT3(center.x + extent, center.y + extent, center.z + extent);
+	}
+
+	Scene::OcclusionCuller culler;
+	Scene::OcclusionCuller parallelCuller;
+	uint width = culler.GetWidth();
+	uint height = culler.GetHeight();
+
+	printf("%u occluders (%u triangles). %u occludees. %ux%u depth buffer. %u worker threads\n\n", settings.Occluders, settings.Occluders * 12u, settings.Occludees, width, height, threadPool.GetThreadCount());
+
+	// Correctness, on the first and the last frame, and on the fixed regression scenes
+	uint failures = 0u;
+	uint checkFrames[2] = {0u, settings.Frames - 1u};
+	for (uint f = 0; f < 2; ++f) {
+		char label[32];
+		sprintf(label, "Frame %3u", checkFrames[f]);
+		failures += CheckScene(label, occluders, occludees, FrameViewProj(checkFrames[f]), culler, parallelCuller, &threadPool);
+	}
+	failures += CheckClippedFloorRegression(culler, parallelCuller, &threadPool);
+
+	// Timing
+	Engine::Timer timer;
+	printf("\n  %-12s %14s %16s %14s %16s\n", "", "Raster (ms)", "MTriangles / s", "Test (ms)", "MBoxes / s");
+
+	Common::ThreadPool *pools[2] = {nullptr, &threadPool};
+	const char *names[2] = {"1 thread", "Parallel"};
+	for (uint p = 0; p < 2; ++p) {
+		double rasterMilliseconds = 0.0;
+		double testMilliseconds = 0.0;
+		uint64 triangles = 0u;
+		uint visibleCount = 0u;
+
+		for (uint frame = 0; frame < settings.Frames; ++frame) {
+			DirectX::XMMATRIX viewProj = FrameViewProj(frame);
+
+			timer.Start();
+			RenderOccluders(culler, occluders, viewProj, pools[p]);
+			rasterMilliseconds += timer.GetTime();
+			triangles += culler.GetTriangleCount();
+
+			timer.Start();
+			for (auto iter = occludees.begin(); iter != occludees.end(); ++iter) {
+				visibleCount += culler.IsVisible(iter->Min, iter->Max, viewProj) ? 1u : 0u;
+			}
+			testMilliseconds += timer.GetTime();
+		}
+
+		rasterMilliseconds /= settings.Frames;
+		testMilliseconds /= settings.Frames;
+		printf("  %-12s %14.3f %16.2f %14.3f %16.2f\n", names[p], rasterMilliseconds, (triangles / settings.Frames) / (rasterMilliseconds * 1000.0),
+		       testMilliseconds, settings.Occludees / (testMilliseconds * 1000.0));
+	}
+
+	printf("\n  MTriangles / s counts the triangles left after clipping\n");
+
+	if (failures != 0u) {
+		printf("\nFAILED\n");
+		return 1;
+	}
+
+	return 0;
+}
@@ -6,11 +6,14 @@
 
 #pragma once
 
+#include "common/typedefs.h"
+
 #include "graphics/shader.h"
+#include "graphics/sort_key.h"
 
 #include "scene/materials.h"
-
-#include <unordered_map>
+#include "scene/model.h"
+#include "scene/render_proxy_store.h"
 
 
 namespace PBRDemo {
@@ -25,23 +28,174 @@ namespace PBRDemo {
 // Vertex / index buffer bind
 // cbuffer change
 
-class GBufferSortKeyGenerator {
-private:
-	std::unordered_map<Graphics::MaterialShader *, uint16> m_materialShaderMap;
-	std::unordered_map<const Scene::Material *, uint16> m_materialMap;
-	std::unordered_map<ID3D11Buffer *, uint16> m_vertexBufferMap;
-	std::unordered_map<ID3D11Buffer *, uint16> m_indexBufferMap;
+/** The layers of the GBuffer pass. Lower layers are drawn first */
+enum class GBufferLayer {
+	INSTANCED_MODELS = 0,
+	/** The big subsets that fill the depth buffer for early-z. Uses the depth first layout */
+	OCCLUDERS = 1,
+	MODELS = 2
+};
 
+class GBufferSortKeyGenerator {
 public:
 	// From MSB to LSB
-	// 12 bits - 4098 values - Material Shader
-	// 12 bits - 4098 values - Material (representing the textures)
-	// 12 bits - 4098 values - Vertex buffer
-	// 12 bits - 4098 values - Index buffer
+	//  4 bits -   16 values - Layer
+	//  8 bits -  256 values - Material Shader
+	// 12 bits - 4096 values - Material (representing the textures)
+	// 10 bits - 1024 values - Vertex buffer
+	// 10 bits - 1024 values - Index buffer
+	// 10 bits - 1024 values - Subset
+	// 10 bits - 1024 values - View depth. Front to back, so we get the most out of early-z
 	// 
-	// Total - 48 bits
-	// Material
-	uint64 GenerateKey(Graphics::MaterialShader *materialShader, const Scene::Material *material, ID3D11Buffer *vertexBuffer, ID3D11Buffer *indexBuffer);
+	// Total - 64 bits
+	//
+	// Depth sits below the geometry, so draws of the same subset stay adjacent and can still be merged
+	//
+	// The shader, material and buffer fields hold Common::DenseIdGenerator ids. Ids are recycled when
+	// their resource is released, so the field widths bound the number of resources alive at once,
+	// not the number ever created. IE. at most 1024 live vertex buffers, static batches included
+	typedef Graphics::SortKeyFirstField<4> Layer;
+	typedef Graphics::SortKeyNextField<Layer, 8> MaterialShader;
+	typedef Graphics::SortKeyNextField<MaterialShader, 12> Material;
+	typedef Graphics::SortKeyNextField<Material, 10> VertexBuffer;
+	typedef Graphics::SortKeyNextField<VertexBuffer, 10> IndexBuffer;
+	typedef Graphics::SortKeyNextField<IndexBuffer, 10> Subset;
+	typedef Graphics::SortKeyNextField<Subset, 10> Depth;
+
+	static_assert(Depth::kShift == 0u, "The GBuffer sort key layout should use all 64 bits");
+
+	// The same fields with depth moved up under the layer, for layers that are drawn strictly front to back
+	// to lay down depth for early-z. Draws in these layers almost never share state with their neighbours,
+	// so they trade state changes and merging for ordering. Only use it for a layer's worth of big occluders
+	struct DepthFirst {
+		typedef Graphics::SortKeyFirstField<4> Layer;
+		typedef Graphics::SortKeyNextField<Layer, 10> Depth;
+		typedef Graphics::SortKeyNextField<Depth, 8> MaterialShader;
+		typedef Graphics::SortKeyNextField<MaterialShader, 12> Material;
+		typedef Graphics::SortKeyNextField<Material, 10> VertexBuffer;
+		typedef Graphics::SortKeyNextField<VertexBuffer, 10> IndexBuffer;
+		typedef Graphics::SortKeyNextField<IndexBuffer, 10> Subset;
+
+		static_assert(Subset::kShift == 0u, "The depth first GBuffer sort key layout should use all 64 bits");
+	};
+
+	static_assert(DepthFirst::Layer::kMask == Layer::kMask, "Both layouts must share the layer field, so the layers order the same way");
+
+public:
+	/**
+	 * Builds the sort key for a subset of a model
+	 *
+	 * @param layer          The layer to draw the subset in
+	 * @param model          The model
+	 * @param subsetIndex    The index of the subset within the model
+	 * @param viewDepth      The view depth of the model, normalized to [0, 1] between the near and far clip planes
+	 * @return               The sort key
+	 */
+	static inline uint64 GenerateKey(GBufferLayer layer, const Scene::Model *model, uint subsetIndex, float viewDepth) {
+		return GenerateKey(layer, model->Subsets[subsetIndex].Material, model->VertexBufferId, model->IndexBufferId, subsetIndex, viewDepth);
+	}
+	/**
+	 * Builds the sort key for a subset drawn from explicit vertex / index buffers. IE. from a static batch
+	 *
+	 * @param layer             The layer to draw the subset in
+	 * @param material          The material of the subset
+	 * @param vertexBufferId    The dense id of the vertex buffer the subset is drawn from
+	 * @param indexBufferId     The dense id of the index buffer the subset is drawn from
+	 * @param subsetIndex       The index of the subset within its model
+	 * @param viewDepth         The view depth of the model, normalized to [0, 1] between the near and far clip planes
+	 * @return                  The sort key
+	 */
+	static inline uint64 GenerateKey(GBufferLayer layer, const Scene::Material *material, uint32 vertexBufferId, uint32 indexBufferId, uint subsetIndex, float viewDepth) {
+		return Layer::Encode(static_cast<uint64>(layer)) |
+		       MaterialShader::Encode(material->Shader->GetId()) |
+		       Material::Encode(material->Id) |
+		       VertexBuffer::Encode(vertexBufferId) |
+		       IndexBuffer::Encode(indexBufferId) |
+		       Subset::Encode(subsetIndex) |
+		       Depth::EncodeUnorm(viewDepth);
+	}
+	/**
+	 * Builds the sort key for a render proxy. Everything but the depth comes straight from the proxy
+	 *
+	 * NOTE: RenderProxy::ShaderId is assigned by the RenderProxyStore, so it only orders the shaders
+	 *       within the layer. Don't mix proxy keys and Model keys in the same layer
+	 *
+	 * @param layer        The layer to draw the proxy in
+	 * @param proxy        The proxy
+	 * @param viewDepth    The view depth of the proxy, normalized to [0, 1] between the near and far clip planes
+	 * @return             The sort key
+	 */
+	static inline uint64 GenerateKey(GBufferLayer layer, const Scene::RenderProxy &proxy, float viewDepth) {
+		return Layer::Encode(static_cast<uint64>(layer)) |
+		       MaterialShader::Encode(proxy.ShaderId) |
+		       Material::Encode(proxy.MaterialId) |
+		       VertexBuffer::Encode(proxy.VertexBufferId) |
+		       IndexBuffer::Encode(proxy.IndexBufferId) |
+		       Subset::Encode(proxy.SubsetIndex) |
+		       Depth::EncodeUnorm(viewDepth);
+	}
+	/**
+	 * Builds the depth first sort key for a render proxy. The keys of a layer built with this sort
+	 * the proxies front to back, whatever their state
+	 *
+	 * @param layer        The layer to draw the proxy in. IE. GBufferLayer::OCCLUDERS
+	 * @param proxy        The proxy
+	 * @param viewDepth    The view depth of the proxy, normalized to [0, 1] between the near and far clip planes
+	 * @return             The sort key
+	 */
+	static inline uint64 GenerateDepthFirstKey(GBufferLayer layer, const Scene::RenderProxy &proxy, float viewDepth) {
+		return DepthFirst::Layer::Encode(static_cast<uint64>(layer)) |
+		       DepthFirst::Depth::EncodeUnorm(viewDepth) |
+		       DepthFirst::MaterialShader::Encode(proxy.ShaderId) |
+		       DepthFirst::Material::Encode(proxy.MaterialId) |
+		       DepthFirst::VertexBuffer::Encode(proxy.VertexBufferId) |
+		       DepthFirst::IndexBuffer::Encode(proxy.IndexBufferId) |
+		       DepthFirst::Subset::Encode(proxy.SubsetIndex);
+	}
+};
+
+class ShadowSortKeyGenerator {
+public:
+	// From MSB to LSB
+	// 10 bits - 1024 values - Vertex buffer
+	// 10 bits - 1024 values - Index buffer
+	// 10 bits - 1024 values - Subset
+	// 10 bits - 1024 values - Light depth. Front to back, so the closest casters fill the shadow map first
+	// 24 bits - Unused
+	//
+	// The pass is depth only. There is no material to sort on, so draws of the same geometry
+	// end up adjacent, whatever their material, and merge into a single instanced draw
+	typedef Graphics::SortKeyFirstField<10> VertexBuffer;
+	typedef Graphics::SortKeyNextField<VertexBuffer, 10> IndexBuffer;
+	typedef Graphics::SortKeyNextField<IndexBuffer, 10> Subset;
+	typedef Graphics::SortKeyNextField<Subset, 10> Depth;
+
+public:
+	/**
+	 * Builds the shadow sort key for a subset drawn from explicit vertex / index buffers
+	 *
+	 * @param vertexBufferId    The dense id of the vertex buffer the subset is drawn from
+	 * @param indexBufferId     The dense id of the index buffer the subset is drawn from
+	 * @param subsetIndex       The index of the subset within its model
+	 * @param lightDepth        The depth of the subset in the shadow map, in [0, 1]
+	 * @return                  The sort key
+	 */
+	static inline uint64 GenerateKey(uint32 vertexBufferId, uint32 indexBufferId, uint subsetIndex, float lightDepth) {
+		return VertexBuffer::Encode(vertexBufferId) |
+		       IndexBuffer::Encode(indexBufferId) |
+		       Subset::Encode(subsetIndex) |
+		       Depth::EncodeUnorm(lightDepth);
+	}
+	/**
+	 * Builds the shadow sort key for a render proxy
+	 *
+	 * @param proxy         The proxy
+	 * @param lightDepth    The depth of the proxy in the shadow map, in [0, 1]
+	 * @return              The sort key
+	 */
+	static inline uint64 GenerateKey(const Scene::RenderProxy &proxy, float lightDepth) {
+		return GenerateKey(proxy.VertexBufferId, proxy.IndexBufferId, proxy.SubsetIndex, lightDepth);
+	}
 };
 
 } // End of namespace PBRDemo
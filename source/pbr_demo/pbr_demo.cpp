@@ -26,37 +26,71 @@ PBRDemo::PBRDemo(HINSTANCE hinstance)
 	  m_cameraPanFactor(1.0f),
 	  m_cameraScrollFactor(1.0f),
 	  m_gbufferBucket(2048ull),
+	  m_shadowBucket(2048ull),
+	  m_mergedDrawCount(0u),
+	  m_occludedSubsetCount(0u),
+	  m_shadowDistance(500.0f),
+	  m_sceneBoundsMin(0.0f, 0.0f, 0.0f),
+	  m_sceneBoundsMax(0.0f, 0.0f, 0.0f),
+	  m_pickedObject(Scene::RayPicker::kNullObject),
+	  m_pickedTriangle(0u),
 	  m_globalWorldTransform(DirectX::XMMatrixIdentity()),
 	  m_camera(0.0f, 0.45f * DirectX::XM_PI, 100.0f),
 	  m_showConsole(false),
-	  m_instanceBuffer(nullptr),
+	  m_sceneRootNode(Scene::TransformHierarchy::kNullNode),
+	  m_objectTransforms(nullptr),
+	  m_instancedModelIndices(nullptr),
+	  m_staticBatcher(nullptr),
+	  m_proxiesUseStaticBatching(false),
+	  m_mergedInstanceStream(nullptr),
+	  m_constantRingBuffer(nullptr),
+	  m_instanceOffsetRing(nullptr),
+	  m_shadowInstanceOffsetRing(nullptr),
 	  m_sceneLoaded(false),
 	  m_sceneIsSetup(false),
 	  m_sceneScaleFactor(0.0f),
 	  m_modelInstanceThreshold(100u),
 	  m_vsync(false),
 	  m_wireframe(false),
+	  m_useStaticBatching(true),
+	  m_frustumCulling(true),
+	  m_occlusionCulling(true),
 	  m_animateLights(true),
+	  m_shadows(true),
+	  m_captureNextFrame(false),
 	  m_numPointLightsToDraw(0u),
 	  m_numSpotLightsToDraw(0u),
 	  m_backbufferRTV(nullptr),
 	  m_depthStencilBuffer(nullptr),
+	  m_shadowMaps(nullptr),
 	  m_defaultInputLayout(nullptr),
 	  m_debugObjectInputLayout(nullptr),
 	  m_pointLightBuffer(nullptr),
 	  m_spotLightBuffer(nullptr),
 	  m_gbufferVertexShader(nullptr),
+	  m_shadowDepthVertexShader(nullptr),
 	  m_fullscreenTriangleVertexShader(nullptr),
 	  m_tiledCullFinalGatherComputeShader(nullptr),
-	  m_postProcessPixelShader(nullptr) {
+	  m_postProcessPixelShader(nullptr),
+	  m_renderBackend(nullptr),
+	  m_captureBackend(nullptr) {
 }
 
 void PBRDemo::Shutdown() {
 	// Release in the opposite order we initialized in
 	delete m_pointLightBuffer;
 	delete m_spotLightBuffer;
-	delete m_instanceBuffer;
+	delete m_shadowInstanceOffsetRing;
+	delete m_instanceOffsetRing;
+	delete m_mergedInstanceStream;
+	delete m_constantRingBuffer;
+	delete m_staticBatcher;
+	delete m_objectTransforms;
+	delete m_instancedModelIndices;
+	delete m_captureBackend;
+	delete m_renderBackend;
 	delete(m_instancedGBufferVertexShader);
+	delete(m_shadowDepthVertexShader);
 	delete(m_fullscreenTriangleVertexShader);
 	delete(m_tiledCullFinalGatherComputeShader);
 	delete(m_postProcessPixelShader);
@@ -67,6 +101,7 @@ void PBRDemo::Shutdown() {
 		delete *iter;
 	}
 
+	delete m_shadowMaps;
 	delete m_depthStencilBuffer;
 	ReleaseCOM(m_backbufferRTV);
 
@@ -185,6 +220,20 @@ void PBRDemo::MouseDown(WPARAM buttonState, int x, int y) {
 	m_mouseLastPos.x = x;
 	m_mouseLastPos.y = y;
 
+	// Alt + left drag rotates the camera. A plain left click picks the object under the cursor
+	if ((buttonState & MK_LBUTTON) != 0 && (GetKeyState(VK_MENU) & 0x8000) == 0 && m_sceneIsSetup) {
+		DirectX::XMFLOAT3 origin, direction;
+		Scene::RayPicker::ScreenPointToRay(static_cast<float>(x), static_cast<float>(y), static_cast<float>(m_clientWidth), static_cast<float>(m_clientHeight), m_camera.GetView(), m_camera.GetProj(), &origin, &direction);
+
+		Scene::RayHit hit;
+		if (m_rayPicker.Pick(origin, direction, m_farClip, &hit)) {
+			m_pickedObject = hit.Object;
+			m_pickedTriangle = hit.Triangle;
+		} else {
+			m_pickedObject = Scene::RayPicker::kNullObject;
+		}
+	}
+
 	SetCapture(m_hwnd);
 }
 
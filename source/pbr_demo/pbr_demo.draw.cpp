@@ -21,6 +21,14 @@
 namespace PBRDemo {
 
 void PBRDemo::DrawFrame(double deltaTime) {
+	m_renderBackend->ResetStats();
+	m_mergedDrawCount = 0u;
+
+	// Record the bind/draw stream of this frame. It can be inspected offline with the CaptureAnalyzer tool
+	if (m_captureNextFrame) {
+		m_captureBackend->BeginCapture();
+	}
+
 	if (m_sceneLoaded.load(std::memory_order_relaxed)) {
 		if (!m_sceneIsSetup) {
 			// Clean-up the thread
@@ -53,6 +61,10 @@ void PBRDemo::DrawFrame(double deltaTime) {
 			m_cameraPanFactor = range * 0.0002857f;
 			m_cameraScrollFactor = range * 0.0002857f;
 
+			SetupObjectTransforms();
+			SetupStaticBatches();
+			SetupOccluders();
+
 			m_sceneIsSetup = true;
 		}
 		RenderMainPass();
@@ -74,6 +86,14 @@ void PBRDemo::DrawFrame(double deltaTime) {
 
 		Sleep(50);
 	}
+
+	if (m_captureBackend->IsCapturing()) {
+		if (!m_captureBackend->EndCapture(L"frame_capture.hcap")) {
+			m_console.PrintText(L"Failed to write frame_capture.hcap");
+		}
+		m_captureNextFrame = false;
+	}
+
 	RenderHUD();
 
 	if (m_showConsole) {
@@ -86,6 +106,86 @@ void PBRDemo::DrawFrame(double deltaTime) {
 }
 
 void PBRDemo::RenderMainPass() {
+	// Route the submits through the capture backend if this frame is being captured
+	Graphics::RenderBackend *backend = m_renderBackend;
+	Graphics::CommandCapture *capture = m_captureBackend->GetCapture();
+	if (capture != nullptr) {
+		backend = m_captureBackend;
+	}
+
+	// Fetch the transpose matrices
+	DirectX::XMMATRIX viewMatrix = m_camera.GetView();
+	DirectX::XMMATRIX projectionMatrix = m_camera.GetProj();
+
+	// Cache the matrix multiplication
+	DirectX::XMMATRIX viewProj = viewMatrix * projectionMatrix;
+
+	// Pass on the world matrices that changed since the last frame, and upload them. For a static
+	// scene, this only does any work on the first frame
+	UpdateObjectTransforms();
+	m_objectTransforms->Upload();
+	m_instancedModelIndices->Upload();
+
+	m_mergedInstanceStream->BeginFrame();
+
+	// Point the proxies at the merged buffers, or back at the models' own buffers, if static batching was toggled
+	if (m_proxiesUseStaticBatching != m_useStaticBatching) {
+		for (uint i = 0; i < m_models.size(); ++i) {
+			m_renderProxies.SetBatchRange(m_modelFirstProxies[i], m_useStaticBatching ? m_modelBatchRanges[i] : nullptr);
+		}
+		m_proxiesUseStaticBatching = m_useStaticBatching;
+	}
+
+	// Cull the model subsets and the instanced models against the view frustum
+	if (m_frustumCulling) {
+		Scene::Frustum frustum = Scene::ExtractFrustum(viewProj);
+		m_renderProxies.Cull(frustum, &m_visibleSubsets, &m_threadPool);
+		m_instancedModelCuller.Cull(frustum, &m_visibleInstancedModels, &m_threadPool);
+	} else {
+		m_visibleSubsets.resize(m_renderProxies.GetSize());
+		for (uint i = 0; i < m_visibleSubsets.size(); ++i) {
+			m_visibleSubsets[i] = i;
+		}
+		m_visibleInstancedModels.resize(m_instancedModelCuller.GetSize());
+		for (uint i = 0; i < m_visibleInstancedModels.size(); ++i) {
+			m_visibleInstancedModels[i] = i;
+		}
+	}
+
+	// Objects outside of the view can still throw shadows into it, so the casters are culled from the whole scene
+	if (m_shadows) {
+		CullShadowCasters(viewMatrix, projectionMatrix);
+		RenderShadowMaps(backend, capture);
+	} else {
+		m_shadowViews.clear();
+		m_shadowCasterSubsets.clear();
+		m_shadowCasterInstancedModels.clear();
+	}
+
+	// Rasterize the occluders on the CPU, and drop the subsets hidden behind them
+	m_occludedSubsetCount = 0u;
+	if (m_occlusionCulling && !m_occluderSubsets.empty()) {
+		m_occlusionCuller.ClearBuffer();
+		for (auto iter = m_occluderSubsets.begin(); iter != m_occluderSubsets.end(); ++iter) {
+			const Scene::RenderProxy &proxy = m_renderProxies.Get(*iter);
+			const Scene::Model *model = m_renderProxies.GetModel(*iter);
+			const Scene::ModelSubset &subset = model->Subsets[proxy.SubsetIndex];
+
+			DirectX::XMMATRIX worldViewProj = m_transformHierarchy.GetWorldTransform(m_objectNodes[proxy.ObjectIndex]) * viewProj;
+			m_occlusionCuller.AddOccluder(&model->CPUPositions[subset.VertexStart], &model->CPUIndices[subset.IndexStart], subset.IndexCount / 3u, worldViewProj);
+		}
+		m_occlusionCuller.Flush(&m_threadPool);
+
+		uint visibleCount = 0u;
+		for (uint i = 0; i < m_visibleSubsets.size(); ++i) {
+			if (m_occlusionCuller.IsVisible(m_renderProxies.GetAABBMin(m_visibleSubsets[i]), m_renderProxies.GetAABBMax(m_visibleSubsets[i]), viewProj)) {
+				m_visibleSubsets[visibleCount++] = m_visibleSubsets[i];
+			}
+		}
+		m_occludedSubsetCount = static_cast<uint>(m_visibleSubsets.size()) - visibleCount;
+		m_visibleSubsets.resize(visibleCount);
+	}
+
 	// Bind the gbufferRTVs and depth/stencil view to the pipeline.
 	m_immediateContext->OMSetRenderTargets(3, &m_gBufferRTVs[0], m_depthStencilBuffer->GetDepthStencil());
 
@@ -106,56 +206,26 @@ void PBRDemo::RenderMainPass() {
 	m_immediateContext->OMSetDepthStencilState(m_depthStencilStateManager.ReverseDepthWriteEnabled(), 0);
 	m_immediateContext->RSSetState(m_rasterizerStateManager.BackFaceCull());
 
-	// Fetch the transpose matrices
-	DirectX::XMMATRIX viewMatrix = m_camera.GetView();
-	DirectX::XMMATRIX projectionMatrix = m_camera.GetProj();
-
-	// Cache the matrix multiplication
-	DirectX::XMMATRIX viewProj = viewMatrix * projectionMatrix;
-
 	// Draw instanced models
 	if (m_instancedModels.size() > 0) {
-		DirectX::XMVECTOR *instanceBuffer = m_instanceBuffer->MapDiscard(m_immediateContext);
-		std::vector<uint> offsets;
-		uint bufferOffset = 0;
-		for (auto iter = m_instancedModels.begin(); iter != m_instancedModels.end(); ++iter) {
-			assert(bufferOffset < static_cast<uint>(m_instanceBuffer->NumElements()));
-
-			// In the future when we support more complicated instancing, this could be something like:
-			//
-			// uint offset = bufferOffset;
-			// std::vector<DirectX::XMVECTOR, Common::AllocatorAligned16<DirectX::XMVECTOR> > instanceVectors = iter->second.InstanceVectors();
-			// for (auto vectorIter = instanceVectors.begin(); vectorIter != instanceVectors.end(); ++vectorIter) {
-			//     instanceBuffer[bufferOffset++] = *vectorIter;
-			// }
-			// 
-			// offsetAndLengths.emplace_back(offset);
-
-			uint offset = bufferOffset;
-			for (auto instanceIter = iter->second->begin(); instanceIter != iter->second->end(); ++instanceIter) {
-				DirectX::XMMATRIX columnOrderMatrix = DirectX::XMMatrixTranspose(m_globalWorldTransform * (*instanceIter));
-				instanceBuffer[bufferOffset++] = columnOrderMatrix.r[0];
-				instanceBuffer[bufferOffset++] = columnOrderMatrix.r[1];
-				instanceBuffer[bufferOffset++] = columnOrderMatrix.r[2];
-			}
-
-			offsets.emplace_back(offset);
-		}
-
-		m_instanceBuffer->Unmap(m_immediateContext);
-
-		// Set the vertex shader and bind the instance buffer to it
+		// Set the vertex shader and bind the transforms and the instanced model index list to it
 		m_instancedGBufferVertexShader->BindToPipeline(m_immediateContext);
-		ID3D11ShaderResourceView *srv = m_instanceBuffer->GetShaderResource();
-		m_immediateContext->VSSetShaderResources(0, 1, &srv);
+		ID3D11ShaderResourceView *srvs[2] = {m_objectTransforms->GetShaderResource(), m_instancedModelIndices->GetShaderResource()};
+		m_immediateContext->VSSetShaderResources(0, 2, srvs);
 
 		// Set the vertex shader frame constants
 		SetInstancedGBufferVertexShaderFrameConstants(DirectX::XMMatrixTranspose(viewProj));
-		ID3D11Buffer *instancedGBufferVertexShaderObjectConstantBuffer = m_instancedGBufferVertexShader->GetPerObjectConstantBuffer();
 
-		for (uint i = 0; i < m_instancedModels.size(); ++i) {
+		m_constantRingBuffer->BeginFrame();
+
+		for (auto iter = m_visibleInstancedModels.begin(); iter != m_visibleInstancedModels.end(); ++iter) {
+			uint i = *iter;
 			Scene::Model *model = m_instancedModels[i].first;
 
+			// All the subsets share the same object constants
+			InstancedGBufferVertexShaderObjectConstants objectConstants = {m_instancedModelStarts[i]};
+			Graphics::ConstantBufferAllocation objectConstantsAllocation = m_constantRingBuffer->Allocate(objectConstants);
+
 			ID3D11Buffer *vertexBuffer = model->VertexBuffer;
 			ID3D11Buffer *indexBuffer = model->IndexBuffer;
 			uint vertexStride = model->VertexStride;
@@ -166,17 +236,12 @@ void PBRDemo::RenderMainPass() {
 				const Scene::Material *material = subsets[j].Material;
 				Graphics::MaterialShader *materialShader = material->Shader;
 
-				uint64 sortKey = m_gbufferSortKeyGenerator.GenerateKey(materialShader, material, vertexBuffer, indexBuffer);
-
-				// Create the command to set the vertex shader constant buffer data
-				auto mapDataCommand = m_gbufferBucket.AddCommand<Graphics::Commands::MapDataToConstantBuffer<InstancedGBufferVertexShaderObjectConstants> >(sortKey);
-				mapDataCommand->SetConstantBuffer(instancedGBufferVertexShaderObjectConstantBuffer);
-				InstancedGBufferVertexShaderObjectConstants data = {offsets[i]};
-				mapDataCommand->SetData(data);
+				// The instances are spread around the scene, so there isn't a single depth to sort on
+				uint64 sortKey = GBufferSortKeyGenerator::GenerateKey(GBufferLayer::INSTANCED_MODELS, model, j, 0.0f);
 
-				// Create the command to bind the vertex shader constant buffer to the pipeline
-				auto bindBufferCommand = m_gbufferBucket.AppendCommand<Graphics::Commands::BindConstantBufferToVS>(mapDataCommand);
-				bindBufferCommand->SetConstantBuffer(instancedGBufferVertexShaderObjectConstantBuffer, 1u);
+				// Create the command to bind the object constants to the vertex shader
+				auto bindBufferCommand = m_gbufferBucket.AddCommand<Graphics::Commands::BindConstantBufferRangeToVS>(sortKey);
+				bindBufferCommand->SetAllocation(objectConstantsAllocation, 1u);
 
 				// Create the draw command
 				auto drawIndexedInstancedCommand = m_gbufferBucket.AppendCommand<Graphics::Commands::DrawIndexedInstanced>(bindBufferCommand);
@@ -199,73 +264,70 @@ void PBRDemo::RenderMainPass() {
 			}
 		}
 
+		// The ring has to be unmapped before any of the draws use it
+		m_constantRingBuffer->EndFrame();
+
 		// Flush the commands to the GPU
-		m_gbufferBucket.Submit(m_device, m_immediateContext, &m_blendStateManager, &m_rasterizerStateManager, &m_depthStencilStateManager, &currentGraphicsState);
+		m_gbufferBucket.Submit(backend, &currentGraphicsState, capture);
 
 		// Clear the bucket for the next use
 		m_gbufferBucket.Clear();
 	}
 
 	// Draw non-instanced models
+	// These are drawn with the instanced vertex shader as well. The command bucket gathers the object
+	// indices into m_mergedInstanceStream, merging repeated models into a single instanced draw.
+	// The bucket binds the stream to slot 1 itself, and the instance offset of each merged draw to
+	// constant buffer slot 1, from a window of m_instanceOffsetRing
 	if (m_models.size() > 0) {
-		m_gbufferVertexShader->BindToPipeline(m_immediateContext);
-		ID3D11Buffer *gbufferVertexShaderObjectConstantBuffer = m_gbufferVertexShader->GetPerObjectConstantBuffer();
-
-		for (auto iter = m_models.begin(); iter != m_models.end(); ++iter) {
-			DirectX::XMMATRIX combinedWorld = iter->second * m_globalWorldTransform;
-			DirectX::XMMATRIX worldMatrix = DirectX::XMMatrixTranspose(combinedWorld);
-			
-			DirectX::XMMATRIX worldViewProjection = DirectX::XMMatrixTranspose(combinedWorld * viewProj);
-
-			Scene::Model *model = iter->first;
-
-			ID3D11Buffer *vertexBuffer = model->VertexBuffer;
-			ID3D11Buffer *indexBuffer = model->IndexBuffer;
-			uint vertexStride = model->VertexStride;
-			Scene::ModelSubset *subsets = model->Subsets;
-			uint subsetCount = model->SubsetCount;
-
-			for (uint j = 0; j < subsetCount; ++j) {
-				const Scene::Material *material = subsets[j].Material;
-				Graphics::MaterialShader *materialShader = material->Shader;
-
-				uint64 sortKey = m_gbufferSortKeyGenerator.GenerateKey(materialShader, material, vertexBuffer, indexBuffer);
-
-				// Create the command to set the vertex shader constant buffer data
-				auto mapDataCommand = m_gbufferBucket.AddCommand<Graphics::Commands::MapDataToConstantBuffer<GBufferVertexShaderObjectConstants> >(sortKey);
-				mapDataCommand->SetConstantBuffer(gbufferVertexShaderObjectConstantBuffer);
-				GBufferVertexShaderObjectConstants data = {worldViewProjection, worldMatrix};
-				mapDataCommand->SetData(data);
+		m_instancedGBufferVertexShader->BindToPipeline(m_immediateContext);
+		ID3D11ShaderResourceView *transformsSRV = m_objectTransforms->GetShaderResource();
+		m_immediateContext->VSSetShaderResources(0, 1, &transformsSRV);
 
-				// Create the command to bind the vertex shader constant buffer to the pipeline
-				auto bindBufferCommand = m_gbufferBucket.AppendCommand<Graphics::Commands::BindConstantBufferToVS>(mapDataCommand);
-				bindBufferCommand->SetConstantBuffer(gbufferVertexShaderObjectConstantBuffer, 1u);
+		SetInstancedGBufferVertexShaderFrameConstants(DirectX::XMMatrixTranspose(viewProj));
 
-				// Create the draw command
-				auto drawIndexedCommand = m_gbufferBucket.AppendCommand<Graphics::Commands::DrawIndexed>(bindBufferCommand);
-				drawIndexedCommand->SetMaterialShader(materialShader);
-				drawIndexedCommand->SetVertexBuffer(vertexBuffer, vertexStride);
-				drawIndexedCommand->SetIndexBuffer(indexBuffer, DXGI_FORMAT_R32_UINT);
-				for (uint k = 0; k < material->TextureSRVs.size(); ++k) {
-					drawIndexedCommand->SetTextureSRV(material->TextureSRVs[k], k);
-				}
-				for (uint k = 0; k < material->TextureSamplers.size(); ++k) {
-					drawIndexedCommand->SetTextureSampler(material->TextureSamplers[k], k);
-				}
-				drawIndexedCommand->SetRasterizerState(m_wireframe ? Graphics::RasterizerState::WIREFRAME : Graphics::RasterizerState::CULL_BACKFACES);
-				drawIndexedCommand->SetIndexCount(subsets[j].IndexCount);
-				drawIndexedCommand->SetIndexStart(subsets[j].IndexStart);
-				drawIndexedCommand->SetVertexStart(subsets[j].VertexStart);
-			}
+		float inverseDepthRange = 1.0f / (m_farClip - m_nearClip);
+
+		Graphics::RasterizerState rasterizerState = m_wireframe ? Graphics::RasterizerState::WIREFRAME : Graphics::RasterizerState::CULL_BACKFACES;
+
+		// Everything a draw needs is in its proxy, so this streams through m_renderProxies in order,
+		// without touching the models or the materials
+		for (auto iter = m_visibleSubsets.begin(); iter != m_visibleSubsets.end(); ++iter) {
+			const Scene::RenderProxy &proxy = m_renderProxies.Get(*iter);
+			const Scene::MaterialBindings &bindings = m_renderProxies.GetMaterialBindings(proxy.MaterialId);
+
+			// Sort on the view depth of the center of the model's bounding box
+			float viewDepth = DirectX::XMVectorGetZ(DirectX::XMVector3Transform(DirectX::XMLoadFloat3(&proxy.SortCenter), viewMatrix));
+			float normalizedDepth = (viewDepth - m_nearClip) * inverseDepthRange;
+
+			// The occluders go first, strictly front to back, so they fill the depth buffer before everything they hide
+			uint64 sortKey = m_isOccluderSubset[*iter] ? GBufferSortKeyGenerator::GenerateDepthFirstKey(GBufferLayer::OCCLUDERS, proxy, normalizedDepth)
+			                                           : GBufferSortKeyGenerator::GenerateKey(GBufferLayer::MODELS, proxy, normalizedDepth);
+
+			auto drawCommand = m_gbufferBucket.AddCommand<Graphics::Commands::DrawIndexedInstanceable>(sortKey);
+			drawCommand->SetMaterialShader(bindings.Shader);
+			drawCommand->SetVertexBuffer(proxy.VertexBuffer, proxy.VertexStride);
+			drawCommand->SetIndexBuffer(proxy.IndexBuffer, DXGI_FORMAT_R32_UINT);
+			drawCommand->SetTextureSRVs(bindings.TextureSRVs);
+			drawCommand->SetTextureSamplers(bindings.TextureSamplers);
+			drawCommand->SetRasterizerState(rasterizerState);
+			drawCommand->SetIndexCount(proxy.IndexCount);
+			drawCommand->SetIndexStart(proxy.IndexStart);
+			drawCommand->SetVertexStart(proxy.VertexStart);
+			drawCommand->SetInstanceOffsetSlot(1u);
+			drawCommand->SetObjectIndex(proxy.ObjectIndex);
 		}
 
 		// Flush the commands to the GPU
-		m_gbufferBucket.Submit(m_device, m_immediateContext, &m_blendStateManager, &m_rasterizerStateManager, &m_depthStencilStateManager, &currentGraphicsState);
+		m_gbufferBucket.Submit(backend, &currentGraphicsState, capture);
+		m_mergedDrawCount += m_gbufferBucket.GetMergedDrawCount();
 
 		// Clear the bucket for the next use
 		m_gbufferBucket.Clear();
 	}
 
+	m_mergedInstanceStream->EndFrame();
+
 
 	// Final gather pass
 
@@ -309,6 +371,12 @@ void PBRDemo::RenderMainPass() {
 		m_immediateContext->CSSetShaderResources(5, 1, &srv);
 	}
 
+	// Bind the shadow maps. They're still bound when shadows are off, but none of the lights read them
+	ID3D11ShaderResourceView *shadowMapSRV = m_shadowMaps->GetShaderResource();
+	m_immediateContext->CSSetShaderResources(6, 1, &shadowMapSRV);
+	ID3D11SamplerState *shadowSampler = m_samplerStateManager.ShadowMapPCF();
+	m_immediateContext->CSSetSamplers(0, 1, &shadowSampler);
+
 	// Dispatch
 	uint dispatchWidth = (m_clientWidth + COMPUTE_SHADER_TILE_GROUP_DIM - 1) / COMPUTE_SHADER_TILE_GROUP_DIM;
 	uint dispatchHeight = (m_clientHeight + COMPUTE_SHADER_TILE_GROUP_DIM - 1) / COMPUTE_SHADER_TILE_GROUP_DIM;
@@ -317,12 +385,147 @@ void PBRDemo::RenderMainPass() {
 	// Clear gBuffer resource bindings so they can be used as render targets next frame
 	ID3D11ShaderResourceView *views[4] = {nullptr, nullptr, nullptr, nullptr};
 	m_immediateContext->CSSetShaderResources(0, 4, views);
+	// Same for the shadow maps
+	m_immediateContext->CSSetShaderResources(6, 1, views);
 
 	// Clear the HDR resource binding so it can be used in the PostProcessing
 	ID3D11UnorderedAccessView *nullUAV = nullptr;
 	m_immediateContext->CSSetUnorderedAccessViews(0, 1, &nullUAV, nullptr);
 }
 
+void PBRDemo::CullShadowCasters(DirectX::CXMMATRIX viewMatrix, DirectX::CXMMATRIX projectionMatrix) {
+	uint shadowedSpotLightCount = m_numSpotLightsToDraw < kMaxShadowedSpotLights ? m_numSpotLightsToDraw : kMaxShadowedSpotLights;
+	m_shadowViews.resize(kShadowCascadeCount + shadowedSpotLightCount);
+	m_shadowCasterSubsets.resize(m_shadowViews.size());
+	m_shadowCasterInstancedModels.resize(m_shadowViews.size());
+
+	// The lighting shader takes (x, -y, -z) as the direction toward the light, so the light travels along (-x, y, z)
+	const DirectX::XMFLOAT3 &direction = m_directionalLight.GetDirection();
+	DirectX::XMFLOAT3 lightDirection;
+	DirectX::XMStoreFloat3(&lightDirection, DirectX::XMVector3Normalize(DirectX::XMVectorSet(-direction.x, direction.y, direction.z, 0.0f)));
+
+	Scene::CalculateCascadeSplits(m_nearClip, std::min(m_shadowDistance, m_farClip), kShadowCascadeCount, 0.8f, m_cascadeSplits);
+	for (uint i = 0; i < kShadowCascadeCount; ++i) {
+		DirectX::XMFLOAT3 corners[8];
+		Scene::CalculateFrustumCorners(viewMatrix, projectionMatrix, m_cascadeSplits[i], m_cascadeSplits[i + 1u], corners);
+		m_shadowViews[i] = Scene::CalculateCascadeView(corners, lightDirection, m_sceneBoundsMin, m_sceneBoundsMax, kShadowMapSize);
+	}
+
+	DirectX::XMFLOAT3 cameraCorners[8];
+	Scene::CalculateFrustumCorners(viewMatrix, projectionMatrix, m_nearClip, m_farClip, cameraCorners);
+	for (uint i = 0; i < shadowedSpotLightCount; ++i) {
+		const Scene::SpotLight &light = m_spotLights[i];
+		DirectX::XMFLOAT3 spotDirection;
+		DirectX::XMStoreFloat3(&spotDirection, DirectX::XMVector3Normalize(DirectX::XMLoadFloat3(&light.GetDirection())));
+
+		m_shadowViews[kShadowCascadeCount + i] = Scene::CalculateSpotShadowView(cameraCorners, light.GetPosition(), spotDirection, light.GetOuterConeAngle(), light.GetRange(), m_nearClip);
+	}
+
+	for (uint i = 0; i < m_shadowViews.size(); ++i) {
+		m_renderProxies.Cull(m_shadowViews[i].CasterVolume, &m_shadowCasterSubsets[i], &m_threadPool);
+		m_instancedModelCuller.Cull(m_shadowViews[i].CasterVolume, &m_shadowCasterInstancedModels[i], &m_threadPool);
+	}
+}
+
+void PBRDemo::RenderShadowMaps(Graphics::RenderBackend *backend, Graphics::CommandCapture *capture) {
+	m_immediateContext->IASetInputLayout(m_defaultInputLayout);
+	m_immediateContext->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+	m_immediateContext->RSSetViewports(1, &m_shadowMapViewport);
+
+	// Depth only. The commands don't have a material shader, so the submits never bind a pixel shader
+	m_shadowDepthVertexShader->BindToPipeline(m_immediateContext);
+	m_immediateContext->PSSetShader(nullptr, nullptr, 0);
+
+	Graphics::GraphicsState currentGraphicsState;
+
+	float blendFactor[4] = {1.0f, 1.0f, 1.0f, 1.0f};
+	m_immediateContext->OMSetBlendState(m_blendStateManager.BlendDisabled(), blendFactor, 0xFFFFFFFF);
+	m_immediateContext->OMSetDepthStencilState(m_depthStencilStateManager.ReverseDepthWriteEnabled(), 0);
+	m_immediateContext->RSSetState(m_rasterizerStateManager.BackFaceCull());
+
+	ID3D11ShaderResourceView *srvs[2] = {m_objectTransforms->GetShaderResource(), m_instancedModelIndices->GetShaderResource()};
+
+	for (uint view = 0; view < m_shadowViews.size(); ++view) {
+		ID3D11DepthStencilView *depthStencil = m_shadowMaps->GetDepthStencil(view);
+		m_immediateContext->OMSetRenderTargets(0, nullptr, depthStencil);
+		m_immediateContext->ClearDepthStencilView(depthStencil, D3D11_CLEAR_DEPTH, 1.0f, 0);
+
+		DirectX::XMMATRIX shadowViewProj = DirectX::XMLoadFloat4x4(&m_shadowViews[view].ViewProj);
+		SetInstancedGBufferVertexShaderFrameConstants(DirectX::XMMatrixTranspose(shadowViewProj));
+
+		// Bind the transforms and the instanced model index list. The proxy submit below replaces the index list
+		// with its instance stream, so this has to be re-done for every view
+		m_immediateContext->VSSetShaderResources(0, 2, srvs);
+
+		// Draw the instanced casters
+		const std::vector<uint> &instancedCasters = m_shadowCasterInstancedModels[view];
+		if (!instancedCasters.empty()) {
+			m_constantRingBuffer->BeginFrame();
+
+			for (auto iter = instancedCasters.begin(); iter != instancedCasters.end(); ++iter) {
+				uint i = *iter;
+				Scene::Model *model = m_instancedModels[i].first;
+
+				InstancedGBufferVertexShaderObjectConstants objectConstants = {m_instancedModelStarts[i]};
+				Graphics::ConstantBufferAllocation objectConstantsAllocation = m_constantRingBuffer->Allocate(objectConstants);
+
+				for (uint j = 0; j < model->SubsetCount; ++j) {
+					const Scene::ModelSubset &subset = model->Subsets[j];
+
+					uint64 sortKey = ShadowSortKeyGenerator::GenerateKey(model->VertexBufferId, model->IndexBufferId, j, 0.0f);
+
+					auto bindBufferCommand = m_shadowBucket.AddCommand<Graphics::Commands::BindConstantBufferRangeToVS>(sortKey);
+					bindBufferCommand->SetAllocation(objectConstantsAllocation, 1u);
+
+					auto drawIndexedInstancedCommand = m_shadowBucket.AppendCommand<Graphics::Commands::DrawIndexedInstanced>(bindBufferCommand);
+					drawIndexedInstancedCommand->SetVertexBuffer(model->VertexBuffer, model->VertexStride);
+					drawIndexedInstancedCommand->SetIndexBuffer(model->IndexBuffer, DXGI_FORMAT_R32_UINT);
+					drawIndexedInstancedCommand->SetRasterizerState(Graphics::RasterizerState::SHADOW_MAP);
+					drawIndexedInstancedCommand->SetDepthStencilState(Graphics::DepthStencilState::DEPTH_WRITE_ENABLED);
+					drawIndexedInstancedCommand->SetIndexCountPerInstance(subset.IndexCount);
+					drawIndexedInstancedCommand->SetInstanceCount(static_cast<uint>(m_instancedModels[i].second->size()));
+					drawIndexedInstancedCommand->SetInstanceStart(0u);
+					drawIndexedInstancedCommand->SetIndexCount(subset.IndexCount);
+					drawIndexedInstancedCommand->SetIndexStart(subset.IndexStart);
+					drawIndexedInstancedCommand->SetVertexStart(subset.VertexStart);
+				}
+			}
+
+			m_constantRingBuffer->EndFrame();
+
+			m_shadowBucket.Submit(backend, &currentGraphicsState, capture);
+			m_shadowBucket.Clear();
+		}
+
+		// Draw the proxy casters. Without materials in the way, the casters that share a subset merge into one draw
+		const std::vector<uint> &casters = m_shadowCasterSubsets[view];
+		if (!casters.empty()) {
+			for (auto iter = casters.begin(); iter != casters.end(); ++iter) {
+				const Scene::RenderProxy &proxy = m_renderProxies.Get(*iter);
+
+				float lightDepth = DirectX::XMVectorGetZ(DirectX::XMVector3TransformCoord(DirectX::XMLoadFloat3(&proxy.SortCenter), shadowViewProj));
+
+				auto drawCommand = m_shadowBucket.AddCommand<Graphics::Commands::DrawIndexedInstanceable>(ShadowSortKeyGenerator::GenerateKey(proxy, lightDepth));
+				drawCommand->SetVertexBuffer(proxy.VertexBuffer, proxy.VertexStride);
+				drawCommand->SetIndexBuffer(proxy.IndexBuffer, DXGI_FORMAT_R32_UINT);
+				drawCommand->SetRasterizerState(Graphics::RasterizerState::SHADOW_MAP);
+				drawCommand->SetDepthStencilState(Graphics::DepthStencilState::DEPTH_WRITE_ENABLED);
+				drawCommand->SetIndexCount(proxy.IndexCount);
+				drawCommand->SetIndexStart(proxy.IndexStart);
+				drawCommand->SetVertexStart(proxy.VertexStart);
+				drawCommand->SetInstanceOffsetSlot(1u);
+				drawCommand->SetObjectIndex(proxy.ObjectIndex);
+			}
+
+			m_shadowBucket.Submit(backend, &currentGraphicsState, capture);
+			m_mergedDrawCount += m_shadowBucket.GetMergedDrawCount();
+			m_shadowBucket.Clear();
+		}
+	}
+
+	m_immediateContext->RSSetViewports(1, &m_screenViewport);
+}
+
 void PBRDemo::SetInstancedGBufferVertexShaderFrameConstants(DirectX::XMMATRIX &viewProjMatrix) {
 	InstancedGBufferVertexShaderFrameConstants vertexShaderFrameConstants;
 	vertexShaderFrameConstants.ViewProj = viewProjMatrix;
@@ -336,6 +539,9 @@ void PBRDemo::SetInstancedGBufferVertexShaderFrameConstants(DirectX::XMMATRIX &v
 	HR(m_immediateContext->Map(constantBuffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &mappedResource));
 	memcpy(mappedResource.pData, &vertexShaderFrameConstants, sizeof(InstancedGBufferVertexShaderFrameConstants));
 	m_immediateContext->Unmap(constantBuffer, 0);
+
+	// The shadow depth shader reads the same buffer, so bind it here rather than relying on whatever was left in slot 0
+	m_immediateContext->VSSetConstantBuffers(0, 1, &constantBuffer);
 }
 
 void PBRDemo::SetTiledCullFinalGatherShaderConstants(DirectX::XMMATRIX &worldViewMatrix, DirectX::XMMATRIX &projMatrix, DirectX::XMMATRIX &invViewProjMatrix) {
@@ -349,29 +555,45 @@ void PBRDemo::SetTiledCullFinalGatherShaderConstants(DirectX::XMMATRIX &worldVie
 	computeShaderFrameConstants.CameraClipPlanes.x = m_nearClip;
 	computeShaderFrameConstants.CameraClipPlanes.y = m_farClip;
 	computeShaderFrameConstants.NumSpotLightsToDraw = m_numSpotLightsToDraw;
+
+	// The cascades are empty when shadows are off, so every pixel is past the last one and the directional light is unshadowed
+	bool hasCascades = m_shadowViews.size() >= kShadowCascadeCount;
+	computeShaderFrameConstants.CascadeEnds.x = hasCascades ? m_cascadeSplits[1] : 0.0f;
+	computeShaderFrameConstants.CascadeEnds.y = hasCascades ? m_cascadeSplits[2] : 0.0f;
+	computeShaderFrameConstants.CascadeEnds.z = hasCascades ? m_cascadeSplits[3] : 0.0f;
+	computeShaderFrameConstants.CascadeEnds.w = hasCascades ? m_cascadeSplits[4] : 0.0f;
+	for (uint i = 0; i < m_shadowViews.size(); ++i) {
+		computeShaderFrameConstants.ShadowViewProj[i] = DirectX::XMMatrixTranspose(DirectX::XMLoadFloat4x4(&m_shadowViews[i].ViewProj));
+	}
+	computeShaderFrameConstants.NumShadowedSpotLights = hasCascades ? static_cast<uint>(m_shadowViews.size()) - kShadowCascadeCount : 0u;
 	
 	m_tiledCullFinalGatherComputeShader->SetPerFrameConstants(m_immediateContext, &computeShaderFrameConstants, 0u);
 }
 
 void PBRDemo::SetLightBuffers() {
+	// The animators and the setters flag the lights they change, so only those are re-packed and uploaded
 	if (m_numPointLightsToDraw > 0) {
-		assert(m_pointLightBuffer->NumElements() >= (int)m_numPointLightsToDraw);
+		assert(m_pointLightBuffer->GetCapacity() >= m_numPointLightsToDraw);
 
-		Scene::ShaderPointLight *pointLightArray = m_pointLightBuffer->MapDiscard(m_immediateContext);
-		for (unsigned int i = 0; i < m_numPointLightsToDraw; ++i) {
-			pointLightArray[i] = m_pointLights[i].GetShaderPackedLight();
+		for (uint i = 0; i < m_numPointLightsToDraw; ++i) {
+			if (m_pointLights[i].IsShaderPackedLightOutOfDate()) {
+				m_packedPointLights[i] = m_pointLights[i].GetShaderPackedLight();
+				m_dirtyPointLights.Add(i);
+			}
 		}
-		m_pointLightBuffer->Unmap(m_immediateContext);
+		m_pointLightBuffer->Upload(&m_packedPointLights.front(), &m_dirtyPointLights);
 	}
 
 	if (m_numSpotLightsToDraw > 0) {
-		assert(m_spotLightBuffer->NumElements() >= (int)m_numSpotLightsToDraw);
+		assert(m_spotLightBuffer->GetCapacity() >= m_numSpotLightsToDraw);
 
-		Scene::ShaderSpotLight *spotLightArray = m_spotLightBuffer->MapDiscard(m_immediateContext);
-		for (unsigned int i = 0; i < m_numSpotLightsToDraw; ++i) {
-			spotLightArray[i] = m_spotLights[i].GetShaderPackedLight();
+		for (uint i = 0; i < m_numSpotLightsToDraw; ++i) {
+			if (m_spotLights[i].IsShaderPackedLightOutOfDate()) {
+				m_packedSpotLights[i] = m_spotLights[i].GetShaderPackedLight();
+				m_dirtySpotLights.Add(i);
+			}
 		}
-		m_spotLightBuffer->Unmap(m_immediateContext);
+		m_spotLightBuffer->Upload(&m_packedSpotLights.front(), &m_dirtySpotLights);
 	}
 }
 
@@ -410,7 +632,18 @@ void PBRDemo::RenderHUD() {
 
 	m_spriteRenderer.Begin(m_immediateContext, Graphics::SpriteRenderer::Point);
 	std::wstring output;
-	fastformat::write(output, L"FPS: ", m_fps, L"\nFrame Time: ", m_frameTime, L" (ms)");
+	const Graphics::RenderBackendStats &stats = m_renderBackend->GetStats();
+	fastformat::write(output, L"FPS: ", m_fps, L"\nFrame Time: ", m_frameTime, L" (ms)",
+	                  L"\nDraw Calls: ", stats.DrawCalls, L" (", m_mergedDrawCount, L" merged)",
+	                  L"\nState Binds: ", stats.TotalBinds(), L"\nKB Uploaded: ", stats.BytesUploaded / 1024ull,
+	                  L"\nVisible Subsets: ", m_visibleSubsets.size(), L" / ", m_renderProxies.GetSize(), L" (", m_occludedSubsetCount, L" occluded)");
+	fastformat::write(output, L"\nShadow Casters:");
+	for (uint i = 0; i < m_shadowCasterSubsets.size(); ++i) {
+		fastformat::write(output, i == kShadowCascadeCount ? L" | " : L" ", m_shadowCasterSubsets[i].size());
+	}
+	if (m_pickedObject != Scene::RayPicker::kNullObject) {
+		fastformat::write(output, L"\nPicked Object: ", m_pickedObject, L" (triangle ", m_pickedTriangle, L")");
+	}
 	
 	DirectX::XMFLOAT4X4 transform {1, 0, 0, 0,
 	                               0, 1, 0, 0,
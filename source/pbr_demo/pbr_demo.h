@@ -9,15 +9,25 @@
 #include "engine/halfling_engine.h"
 
 #include "pbr_demo/shader_constants.h"
+#include "pbr_demo/shader_defines.h"
 #include "pbr_demo/command_sort_key_generators.h"
 
 #include "common/vector.h"
 #include "common/allocator_16_byte_aligned.h"
 #include "common/linear_allocator.h"
+#include "common/thread_pool.h"
+#include "common/dirty_range_list.h"
 
 #include "scene/camera.h"
 #include "scene/lights.h"
 #include "scene/light_animator.h"
+#include "scene/static_batcher.h"
+#include "scene/frustum_culler.h"
+#include "scene/occlusion_culler.h"
+#include "scene/render_proxy_store.h"
+#include "scene/ray_picker.h"
+#include "scene/shadow_views.h"
+#include "scene/transform_hierarchy.h"
 
 #include "engine/texture_manager.h"
 #include "engine/model_manager.h"
@@ -27,11 +37,17 @@
 
 #include "graphics/texture2d.h"
 #include "graphics/structured_buffer.h"
+#include "graphics/persistent_structured_buffer.h"
+#include "graphics/staged_structured_buffer.h"
 #include "graphics/device_states.h"
 #include "graphics/sprite_renderer.h"
 #include "graphics/sprite_font.h"
 #include "graphics/shader.h"
 #include "graphics/command_bucket.h"
+#include "graphics/d3d11_render_backend.h"
+#include "graphics/capture_render_backend.h"
+#include "graphics/constant_ring_buffer.h"
+#include "graphics/instance_stream.h"
 
 #include <vector>
 #include <AntTweakBar.h>
@@ -51,7 +67,23 @@ public:
 	PBRDemo(HINSTANCE hinstance);
 
 private:
-	static const uint kMaxInstanceVectorsPerFrame = 5000;
+	static const uint kMaxGBufferCommands = 2048;
+	/** The most subsets that are rasterized as occluders */
+	static const uint kMaxOccluders = 64u;
+	/** The most occluder triangles. Subsets that would take the total over this are skipped */
+	static const uint kMaxOccluderTriangles = 100000u;
+	static const uint kConstantRingBufferSize = 2 * 1024 * 1024;
+	/** Every merged run takes a 256 byte window, so this holds two frames of runs of the whole bucket */
+	static const uint kInstanceOffsetRingSize = kMaxGBufferCommands * 256u * 2u;
+	static const uint kShadowCascadeCount = SHADOW_CASCADE_COUNT;
+	/** The spot lights after the first kMaxShadowedSpotLights don't cast shadows */
+	static const uint kMaxShadowedSpotLights = MAX_SHADOWED_SPOT_LIGHTS;
+	/** One slice of m_shadowMaps per view */
+	static const uint kShadowViewCount = kShadowCascadeCount + kMaxShadowedSpotLights;
+	static const uint kShadowMapSize = 2048u;
+	static const uint kMaxShadowCommands = kMaxGBufferCommands;
+	/** Every merged run takes a 256 byte window, so this holds a frame of runs of every view */
+	static const uint kShadowInstanceOffsetRingSize = kShadowViewCount * kMaxShadowCommands * 256u;
 
 	float m_nearClip;
 	float m_farClip;
@@ -66,8 +98,10 @@ private:
 	Engine::MaterialShaderManager m_materialShaderManager;
 	Engine::MaterialCache m_materialCache;
 	
-	GBufferSortKeyGenerator m_gbufferSortKeyGenerator;
-	Graphics::CommandBucket<uint64, 2048> m_gbufferBucket;
+	Graphics::CommandBucket<uint64, kMaxGBufferCommands> m_gbufferBucket;
+	/** Re-used for every view of the shadow pass. Submitted and cleared once per view */
+	Graphics::CommandBucket<uint64, kMaxShadowCommands> m_shadowBucket;
+	uint m_mergedDrawCount;
 
 	Engine::Console m_console;
 	bool m_showConsole;
@@ -77,7 +111,86 @@ private:
 	std::vector<std::pair<Scene::Model *, DirectX::XMMATRIX>, Common::Allocator16ByteAligned<std::pair<Scene::Model *, DirectX::XMMATRIX> > > m_models;
 	std::vector<std::pair<Scene::Model *, std::vector<DirectX::XMMATRIX, Common::Allocator16ByteAligned<DirectX::XMMATRIX> > *> > m_instancedModels;
 
-	Graphics::StructuredBuffer<DirectX::XMVECTOR> *m_instanceBuffer;
+	/**
+	 * The transforms of every model and every instance. The models hang off a scene root node, which
+	 * applies m_globalWorldTransform. The instances apply m_globalWorldTransform in front of their own
+	 * transform (global * instance) rather than after it, so they are roots of their own
+	 */
+	Scene::TransformHierarchy m_transformHierarchy;
+	uint m_sceneRootNode;
+	/** The node of each object in m_objectTransforms */
+	std::vector<uint> m_objectNodes;
+	/** The object index of each node of m_transformHierarchy, or TransformHierarchy::kNullNode for the scene root */
+	std::vector<uint> m_nodeObjects;
+	/**
+	 * The world matrices of every model and every instance. They are uploaded once when the scene
+	 * is set up, and after that only when they change. The static models come first, followed by
+	 * a contiguous block for each instanced model
+	 */
+	Graphics::PersistentStructuredBuffer<ObjectTransform> *m_objectTransforms;
+	/** The object index list of the instanced models. Each instanced model draws from its own block of it */
+	Graphics::PersistentStructuredBuffer<uint> *m_instancedModelIndices;
+	/** The start of each instanced model's block in m_instancedModelIndices */
+	std::vector<uint> m_instancedModelStarts;
+	/** Merges the vertex / index buffers of the models in m_models */
+	Scene::StaticBatcher *m_staticBatcher;
+	/** The static batch range of each model in m_models, or nullptr if the model isn't batched */
+	std::vector<const Scene::StaticBatchRange *> m_modelBatchRanges;
+	/**
+	 * One proxy per subset of every model in m_models, with everything the GBuffer pass needs to cull,
+	 * sort and draw it. The object index of each proxy is the index of its model
+	 */
+	Scene::RenderProxyStore m_renderProxies;
+	/** The first proxy of each model in m_models */
+	std::vector<uint> m_modelFirstProxies;
+	/** Whether the proxies currently draw from the static batches. Compared against m_useStaticBatching every frame */
+	bool m_proxiesUseStaticBatching;
+	/** One world space AABB per instanced model, enclosing all of its instances */
+	Scene::FrustumCuller m_instancedModelCuller;
+	/** The indices of the proxies in m_renderProxies and the boxes in m_instancedModelCuller that passed the cull this frame */
+	std::vector<uint> m_visibleSubsets;
+	std::vector<uint> m_visibleInstancedModels;
+	Common::ThreadPool m_threadPool;
+
+	/** The proxies in m_renderProxies whose subsets are rasterized as occluders, largest first */
+	std::vector<uint> m_occluderSubsets;
+	/** One flag per proxy in m_renderProxies. True if the proxy is in m_occluderSubsets, so it's drawn front to back in GBufferLayer::OCCLUDERS */
+	std::vector<bool> m_isOccluderSubset;
+	Scene::OcclusionCuller m_occlusionCuller;
+	uint m_occludedSubsetCount;
+
+	/** Ray queries against the triangles of every model and every instance. The object ids are the object indices of m_objectTransforms */
+	Scene::RayPicker m_rayPicker;
+
+	/** How far from the camera the directional light's cascades reach */
+	float m_shadowDistance;
+	/** The view depths the cascades of this frame start and end at. Cascade i covers [m_cascadeSplits[i], m_cascadeSplits[i + 1]] */
+	float m_cascadeSplits[kShadowCascadeCount + 1u];
+	/** The bounds of every model and instance. The cascades reach back toward the light this far */
+	DirectX::XMFLOAT3 m_sceneBoundsMin;
+	DirectX::XMFLOAT3 m_sceneBoundsMax;
+	/** The cascades of the directional light, followed by the views of the shadowed spot lights. Recalculated every frame */
+	std::vector<Scene::ShadowView> m_shadowViews;
+	/**
+	 * The casters of each view of m_shadowViews, as indices into m_renderProxies and m_instancedModelCuller.
+	 * The casters that can't throw a shadow onto anything the camera sees are already culled, so the
+	 * command generation of a shadow pass only has to walk these lists
+	 */
+	std::vector<std::vector<uint> > m_shadowCasterSubsets;
+	std::vector<std::vector<uint> > m_shadowCasterInstancedModels;
+
+	/** The object and triangle under the cursor at the last left click, or RayPicker::kNullObject if the click missed */
+	uint m_pickedObject;
+	uint m_pickedTriangle;
+
+	/** The instance stream that m_gbufferBucket gathers the object indices of merged draws into */
+	Graphics::InstanceStream *m_mergedInstanceStream;
+	/** Per-object constants are sub-allocated from this, rather than mapping a separate constant buffer for every draw */
+	Graphics::ConstantRingBuffer *m_constantRingBuffer;
+	/** The instance offsets of the draws that m_gbufferBucket merges. Kept apart, so they can't use up m_constantRingBuffer */
+	Graphics::ConstantRingBuffer *m_instanceOffsetRing;
+	/** The same for m_shadowBucket. It's submitted once per view, so it gets a ring of its own */
+	Graphics::ConstantRingBuffer *m_shadowInstanceOffsetRing;
 
 	std::vector<Scene::ModelToLoad *> m_modelsToLoad;
 	std::atomic<bool> m_sceneLoaded;
@@ -92,10 +205,20 @@ private:
 	std::vector<Scene::PointLightAnimator> m_pointLightAnimators;
 	std::vector<Scene::SpotLight> m_spotLights;
 	std::vector<Scene::SpotLightAnimator> m_spotLightAnimators;
+	/** The lights, packed the way the shaders read them. A light is only re-packed and uploaded when it changes */
+	std::vector<Scene::ShaderPointLight> m_packedPointLights;
+	std::vector<Scene::ShaderSpotLight> m_packedSpotLights;
+	Common::DirtyRangeList m_dirtyPointLights;
+	Common::DirtyRangeList m_dirtySpotLights;
 
 	bool m_vsync;
 	bool m_wireframe;
+	bool m_useStaticBatching;
+	bool m_frustumCulling;
+	bool m_occlusionCulling;
 	bool m_animateLights;
+	bool m_shadows;
+	bool m_captureNextFrame;
 	uint32 m_numSpotLightsToDraw;
 	uint32 m_numPointLightsToDraw;
 
@@ -106,6 +229,10 @@ private:
 	Graphics::Depth2D *m_depthStencilBuffer;
 	D3D11_VIEWPORT m_screenViewport;
 
+	/** One slice per view of m_shadowViews. Uses normal depth, so the comparison sampler can be used as-is */
+	Graphics::Depth2D *m_shadowMaps;
+	D3D11_VIEWPORT m_shadowMapViewport;
+
 	Graphics::Texture2D *m_hdrOutput;
 
 	std::vector<Graphics::Texture2D *> m_gBuffers;
@@ -117,6 +244,8 @@ private:
 	// Shaders
 	Graphics::VertexShader<Graphics::DefaultShaderConstantType, GBufferVertexShaderObjectConstants> *m_gbufferVertexShader;
 	Graphics::VertexShader<InstancedGBufferVertexShaderFrameConstants, InstancedGBufferVertexShaderObjectConstants> *m_instancedGBufferVertexShader;
+	/** Shares the constant buffers of m_instancedGBufferVertexShader, so it doesn't have any of its own */
+	Graphics::VertexShader<> *m_shadowDepthVertexShader;
 
 	Graphics::VertexShader<> *m_fullscreenTriangleVertexShader;
 	Graphics::ComputeShader<TiledCullFinalGatherComputeShaderFrameConstants, Graphics::DefaultShaderConstantType> *m_tiledCullFinalGatherComputeShader;
@@ -125,14 +254,19 @@ private:
 
 	// Shader Buffers
 	// We assume there is only one directional light. Therefore, it is stored in a cbuffer
-	Graphics::StructuredBuffer<Scene::ShaderPointLight> *m_pointLightBuffer;
-	Graphics::StructuredBuffer<Scene::ShaderSpotLight> *m_spotLightBuffer;
+	/** Only the lights that changed are uploaded */
+	Graphics::StagedStructuredBuffer *m_pointLightBuffer;
+	Graphics::StagedStructuredBuffer *m_spotLightBuffer;
 
 	Graphics::BlendStateManager m_blendStateManager;
 	Graphics::DepthStencilStateManager m_depthStencilStateManager;
 	Graphics::RasterizerStateManager m_rasterizerStateManager;
 	Graphics::SamplerStateManager m_samplerStateManager;
 
+	Graphics::D3D11RenderBackend *m_renderBackend;
+	/** Wraps m_renderBackend. Only used for the frame being captured. See m_captureNextFrame */
+	Graphics::CaptureRenderBackend *m_captureBackend;
+
 	Graphics::SpriteRenderer m_spriteRenderer;
 	Graphics::SpriteFont m_timesNewRoman12Font;
 	Graphics::SpriteFont m_courierNew10Font;
@@ -160,10 +294,28 @@ private:
 	void LoadSceneJson();
 	void InitTweakBar();
 	void LoadShaders();
+	/** Fills the persistent object transform buffers. Has to be called after the scene has loaded */
+	void SetupObjectTransforms();
+	/**
+	 * Updates the world matrices of m_transformHierarchy, and passes the ones that changed on to
+	 * m_objectTransforms and the culling bounds
+	 */
+	void UpdateObjectTransforms();
+	/** Merges the geometry of the static models. Has to be called after the scene has loaded */
+	void SetupStaticBatches();
+	/** Picks the largest model subsets as occluders. Has to be called after SetupObjectTransforms() */
+	void SetupOccluders();
 
 	// Rendering methods
 	/** Renders the geometry */
 	void RenderMainPass();
+	/** Calculates m_shadowViews, and culls the casters of each of them into m_shadowCasterSubsets and m_shadowCasterInstancedModels */
+	void CullShadowCasters(DirectX::CXMMATRIX viewMatrix, DirectX::CXMMATRIX projectionMatrix);
+	/**
+	 * Renders the casters of each view of m_shadowViews into its slice of m_shadowMaps. Has to be called
+	 * after CullShadowCasters(), and between BeginFrame() and EndFrame() of m_mergedInstanceStream
+	 */
+	void RenderShadowMaps(Graphics::RenderBackend *backend, Graphics::CommandCapture *capture);
 	/** Renders the geometry using Deferred Shading */
 	void DeferredRenderingPass();
 	/** Does the post processing for the frame */
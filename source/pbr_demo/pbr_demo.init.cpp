@@ -8,6 +8,8 @@
 
 #include "pbr_demo/shader_constants.h"
 
+#include "graphics/commands.h"
+
 #include "common/math.h"
 #include "common/string_util.h"
 #include "common/file_io_util.h"
@@ -19,6 +21,7 @@
 #include "scene/geometry_generator.h"
 
 #include <algorithm>
+#include <cfloat>
 #include <iostream>
 #include <list>
 #include <json/reader.h>
@@ -62,20 +65,40 @@ bool PBRDemo::Initialize(LPCTSTR mainWndCaption, uint32 screenWidth, uint32 scre
 	m_rasterizerStateManager.Initialize(m_device);
 	m_samplerStateManager.Initialize(m_device);
 
+	m_renderBackend = new Graphics::D3D11RenderBackend(m_device, m_immediateContext, &m_blendStateManager, &m_rasterizerStateManager, &m_depthStencilStateManager);
+	m_captureBackend = new Graphics::CaptureRenderBackend(m_renderBackend);
+	m_constantRingBuffer = new Graphics::ConstantRingBuffer(m_renderBackend, kConstantRingBufferSize);
+
 	m_sceneLoaderThread = std::thread(LoadScene, &m_sceneLoaded, m_device, &m_textureManager, &m_modelManager, &m_materialShaderManager, &m_materialCache, &m_samplerStateManager, &m_modelsToLoad, &m_models, &m_instancedModels, m_modelInstanceThreshold);
 
 	LoadShaders();
 
-	m_instanceBuffer = new Graphics::StructuredBuffer<DirectX::XMVECTOR>(m_device, kMaxInstanceVectorsPerFrame, D3D11_BIND_SHADER_RESOURCE, true);
+	// The stream grows if a frame merges more draws than it can hold, so it's started at the size of the bucket
+	m_mergedInstanceStream = new Graphics::InstanceStream(m_renderBackend, sizeof(uint), kMaxGBufferCommands);
+	m_instanceOffsetRing = new Graphics::ConstantRingBuffer(m_renderBackend, kInstanceOffsetRingSize, sizeof(uint));
+	m_gbufferBucket.SetInstanceStream(m_mergedInstanceStream, 1u, m_instanceOffsetRing);
+	m_shadowInstanceOffsetRing = new Graphics::ConstantRingBuffer(m_renderBackend, kShadowInstanceOffsetRingSize, sizeof(uint));
+	m_shadowBucket.SetInstanceStream(m_mergedInstanceStream, 1u, m_shadowInstanceOffsetRing);
+
+	// The shadow maps don't depend on the size of the window, so unlike the gbuffers, they're only created once
+	m_shadowMaps = new Graphics::Depth2D(m_device, kShadowMapSize, kShadowMapSize, D3D11_BIND_DEPTH_STENCIL | D3D11_BIND_SHADER_RESOURCE, kShadowViewCount);
+	m_shadowMapViewport.TopLeftX = 0.0f;
+	m_shadowMapViewport.TopLeftY = 0.0f;
+	m_shadowMapViewport.Width = static_cast<float>(kShadowMapSize);
+	m_shadowMapViewport.Height = static_cast<float>(kShadowMapSize);
+	m_shadowMapViewport.MinDepth = 0.0f;
+	m_shadowMapViewport.MaxDepth = 1.0f;
 
 	// Create light buffers
 	// This has to be done after the Engine has been Initialized so we have a valid m_device
 	if (m_pointLights.size() > 0) {
-		m_pointLightBuffer = new Graphics::StructuredBuffer<Scene::ShaderPointLight>(m_device, static_cast<uint>(m_pointLights.size()), D3D11_BIND_SHADER_RESOURCE, true);
+		m_pointLightBuffer = new Graphics::StagedStructuredBuffer(m_renderBackend, sizeof(Scene::ShaderPointLight), static_cast<uint>(m_pointLights.size()));
 	}
 	if (m_spotLights.size() > 0) {
-		m_spotLightBuffer = new Graphics::StructuredBuffer<Scene::ShaderSpotLight>(m_device, static_cast<uint>(m_spotLights.size()), D3D11_BIND_SHADER_RESOURCE, true);
+		m_spotLightBuffer = new Graphics::StagedStructuredBuffer(m_renderBackend, sizeof(Scene::ShaderSpotLight), static_cast<uint>(m_spotLights.size()));
 	}
+	m_packedPointLights.resize(m_pointLights.size());
+	m_packedSpotLights.resize(m_spotLights.size());
 
 	m_spriteRenderer.Initialize(m_device);
 	m_timesNewRoman12Font.Initialize(L"Times New Roman", 12, Graphics::SpriteFont::Regular, true, m_device);
@@ -422,7 +445,12 @@ void PBRDemo::InitTweakBar() {
 	TwAddVarRW(m_settingsBar, "Show Console", TW_TYPE_BOOLCPP, &m_showConsole, "");
 	TwAddVarRW(m_settingsBar, "V-Sync", TwType::TW_TYPE_BOOLCPP, &m_vsync, "");
 	TwAddVarRW(m_settingsBar, "Wireframe", TwType::TW_TYPE_BOOLCPP, &m_wireframe, "");
+	TwAddVarRW(m_settingsBar, "Static Batching", TwType::TW_TYPE_BOOLCPP, &m_useStaticBatching, "");
+	TwAddVarRW(m_settingsBar, "Frustum Culling", TwType::TW_TYPE_BOOLCPP, &m_frustumCulling, "");
+	TwAddVarRW(m_settingsBar, "Occlusion Culling", TwType::TW_TYPE_BOOLCPP, &m_occlusionCulling, "");
 	TwAddVarRW(m_settingsBar, "Animate Lights", TW_TYPE_BOOLCPP, &m_animateLights, "");
+	TwAddVarRW(m_settingsBar, "Shadows", TW_TYPE_BOOLCPP, &m_shadows, "");
+	TwAddVarRW(m_settingsBar, "Capture Next Frame", TW_TYPE_BOOLCPP, &m_captureNextFrame, "");
 
 	TwAddVarCB(m_settingsBar, "Directional Light Color", TW_TYPE_COLOR3F, SetDirectionalLightColorCallback, GetDirectionalLightColorCallback, &m_directionalLight, "");
 	TwAddVarCB(m_settingsBar, "Directional Light Intensity", TW_TYPE_FLOAT, SetDirectionalLightIntensityCallback, GetDirectionalLightIntensityCallback, &m_directionalLight, " min=1.0 max=20.0 ");
@@ -449,6 +477,172 @@ void LoadScene(std::atomic<bool> *sceneIsLoaded,
 	sceneIsLoaded->store(true, std::memory_order_relaxed);
 }
 
+void PBRDemo::SetupObjectTransforms() {
+	uint numTransforms = static_cast<uint>(m_models.size());
+	uint numInstances = 0u;
+	for (auto iter = m_instancedModels.begin(); iter != m_instancedModels.end(); ++iter) {
+		numInstances += static_cast<uint>(iter->second->size());
+	}
+	numTransforms += numInstances;
+
+	// Buffers can't be zero sized. They upload through the capture backend, so their updates
+	// show up in frame captures. It forwards everything to m_renderBackend the rest of the time
+	m_objectTransforms = new Graphics::PersistentStructuredBuffer<ObjectTransform>(m_captureBackend, std::max(numTransforms, 1u));
+	m_instancedModelIndices = new Graphics::PersistentStructuredBuffer<uint>(m_captureBackend, std::max(numInstances, 1u));
+
+	// Everything derived from the world matrices starts out empty. UpdateObjectTransforms() fills it in below
+	ObjectTransform transform;
+	transform.Set(DirectX::XMMatrixIdentity());
+	DirectX::XMFLOAT3 emptyBounds(0.0f, 0.0f, 0.0f);
+
+	m_sceneRootNode = m_transformHierarchy.CreateNode(Scene::TransformHierarchy::kNullNode, m_globalWorldTransform);
+	m_nodeObjects.resize(m_sceneRootNode + 1u, Scene::TransformHierarchy::kNullNode);
+
+	// The static models. The object index of m_models[i] is i. The proxies draw from the models' own
+	// buffers until RenderMainPass() sees that static batching is on
+	m_modelFirstProxies.reserve(m_models.size());
+	for (auto iter = m_models.begin(); iter != m_models.end(); ++iter) {
+		uint object = m_objectTransforms->Add(transform);
+		m_rayPicker.AddObject(iter->first, DirectX::XMMatrixIdentity());
+		uint node = m_transformHierarchy.CreateNode(m_sceneRootNode, iter->second);
+		m_objectNodes.push_back(node);
+		m_nodeObjects.resize(std::max(static_cast<uint>(m_nodeObjects.size()), node + 1u), Scene::TransformHierarchy::kNullNode);
+		m_nodeObjects[node] = object;
+
+		m_modelFirstProxies.push_back(m_renderProxies.AddModel(iter->first, object, DirectX::XMMatrixIdentity()));
+	}
+
+	// The instanced models
+	m_instancedModelStarts.reserve(m_instancedModels.size());
+	for (auto iter = m_instancedModels.begin(); iter != m_instancedModels.end(); ++iter) {
+		m_instancedModelStarts.push_back(m_instancedModelIndices->GetSize());
+
+		for (auto instanceIter = iter->second->begin(); instanceIter != iter->second->end(); ++instanceIter) {
+			uint object = m_objectTransforms->Add(transform);
+			m_instancedModelIndices->Add(object);
+			m_rayPicker.AddObject(iter->first, DirectX::XMMatrixIdentity());
+
+			uint node = m_transformHierarchy.CreateNode(Scene::TransformHierarchy::kNullNode, m_globalWorldTransform * (*instanceIter));
+			m_objectNodes.push_back(node);
+			m_nodeObjects.resize(std::max(static_cast<uint>(m_nodeObjects.size()), node + 1u), Scene::TransformHierarchy::kNullNode);
+			m_nodeObjects[node] = object;
+		}
+
+		// The instances are drawn with a single draw per subset, so they're culled as a group
+		m_instancedModelCuller.Add(emptyBounds, emptyBounds);
+	}
+
+	// Every node is new, so this computes every world matrix
+	UpdateObjectTransforms();
+}
+
+void PBRDemo::UpdateObjectTransforms() {
+	if (m_transformHierarchy.Update(&m_threadPool) == 0u) {
+		return;
+	}
+
+	uint modelCount = static_cast<uint>(m_models.size());
+	std::vector<bool> dirtyInstancedModels(m_instancedModels.size(), false);
+	ObjectTransform transform;
+
+	const std::vector<uint> &changedNodes = m_transformHierarchy.GetChangedNodes();
+	for (auto iter = changedNodes.begin(); iter != changedNodes.end(); ++iter) {
+		uint object = m_nodeObjects[*iter];
+		if (object == Scene::TransformHierarchy::kNullNode) {
+			continue;
+		}
+
+		DirectX::XMMATRIX world = m_transformHierarchy.GetWorldTransform(*iter);
+		transform.Set(world);
+		m_objectTransforms->Set(object, transform);
+		m_rayPicker.SetWorldTransform(object, world);
+
+		if (object >= modelCount) {
+			// The group bounds are recomputed once, after all the instances have been seen
+			uint instance = object - modelCount;
+			uint instancedModel = static_cast<uint>(std::upper_bound(m_instancedModelStarts.begin(), m_instancedModelStarts.end(), instance) - m_instancedModelStarts.begin()) - 1u;
+			dirtyInstancedModels[instancedModel] = true;
+			continue;
+		}
+
+		m_renderProxies.SetWorldTransform(m_modelFirstProxies[object], world);
+	}
+
+	for (uint i = 0; i < dirtyInstancedModels.size(); ++i) {
+		if (!dirtyInstancedModels[i]) {
+			continue;
+		}
+
+		Scene::Model *model = m_instancedModels[i].first;
+		uint firstObject = modelCount + m_instancedModelStarts[i];
+		uint endObject = firstObject + static_cast<uint>(m_instancedModels[i].second->size());
+
+		DirectX::XMFLOAT3 boundsMin(FLT_MAX, FLT_MAX, FLT_MAX);
+		DirectX::XMFLOAT3 boundsMax(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		for (uint object = firstObject; object < endObject; ++object) {
+			DirectX::XMFLOAT3 aabbMin, aabbMax;
+			Scene::FrustumCuller::TransformAABB(m_transformHierarchy.GetWorldTransform(m_objectNodes[object]), model->AABB_min, model->AABB_max, &aabbMin, &aabbMax);
+			DirectX::XMStoreFloat3(&boundsMin, DirectX::XMVectorMin(DirectX::XMLoadFloat3(&boundsMin), DirectX::XMLoadFloat3(&aabbMin)));
+			DirectX::XMStoreFloat3(&boundsMax, DirectX::XMVectorMax(DirectX::XMLoadFloat3(&boundsMax), DirectX::XMLoadFloat3(&aabbMax)));
+		}
+
+		m_instancedModelCuller.Set(i, boundsMin, boundsMax);
+	}
+
+	DirectX::XMFLOAT3 instancedBoundsMin, instancedBoundsMax;
+	m_renderProxies.GetBounds(&m_sceneBoundsMin, &m_sceneBoundsMax);
+	m_instancedModelCuller.GetBounds(&instancedBoundsMin, &instancedBoundsMax);
+	DirectX::XMStoreFloat3(&m_sceneBoundsMin, DirectX::XMVectorMin(DirectX::XMLoadFloat3(&m_sceneBoundsMin), DirectX::XMLoadFloat3(&instancedBoundsMin)));
+	DirectX::XMStoreFloat3(&m_sceneBoundsMax, DirectX::XMVectorMax(DirectX::XMLoadFloat3(&m_sceneBoundsMax), DirectX::XMLoadFloat3(&instancedBoundsMax)));
+
+	m_rayPicker.Update();
+}
+
+void PBRDemo::SetupStaticBatches() {
+	m_staticBatcher = new Scene::StaticBatcher(m_renderBackend);
+	for (auto iter = m_models.begin(); iter != m_models.end(); ++iter) {
+		m_staticBatcher->AddModel(iter->first);
+	}
+	m_staticBatcher->Build();
+
+	m_modelBatchRanges.reserve(m_models.size());
+	for (auto iter = m_models.begin(); iter != m_models.end(); ++iter) {
+		m_modelBatchRanges.push_back(m_staticBatcher->GetRange(iter->first));
+	}
+}
+
+void PBRDemo::SetupOccluders() {
+	// Big subsets hide the most, so rank them by the surface area of their bounds
+	std::vector<std::pair<float, uint> > candidates;
+	for (uint i = 0; i < m_renderProxies.GetSize(); ++i) {
+		if (m_renderProxies.GetModel(i)->CPUPositions.empty()) {
+			continue;
+		}
+
+		const DirectX::XMFLOAT3 &aabbMin = m_renderProxies.GetAABBMin(i);
+		const DirectX::XMFLOAT3 &aabbMax = m_renderProxies.GetAABBMax(i);
+		DirectX::XMFLOAT3 size(aabbMax.x - aabbMin.x, aabbMax.y - aabbMin.y, aabbMax.z - aabbMin.z);
+		candidates.push_back(std::make_pair(size.x * size.y + size.y * size.z + size.z * size.x, i));
+	}
+	std::sort(candidates.begin(), candidates.end(), [](const std::pair<float, uint> &a, const std::pair<float, uint> &b) {
+		return a.first > b.first;
+	});
+
+	m_isOccluderSubset.assign(m_renderProxies.GetSize(), false);
+
+	uint triangleCount = 0u;
+	for (auto iter = candidates.begin(); iter != candidates.end() && m_occluderSubsets.size() < kMaxOccluders; ++iter) {
+		uint subsetTriangles = m_renderProxies.Get(iter->second).IndexCount / 3u;
+		if (triangleCount + subsetTriangles > kMaxOccluderTriangles) {
+			continue;
+		}
+
+		m_occluderSubsets.push_back(iter->second);
+		m_isOccluderSubset[iter->second] = true;
+		triangleCount += subsetTriangles;
+	}
+}
+
 void PBRDemo::LoadShaders() {
 	D3D11_INPUT_ELEMENT_DESC vertexDesc[] = {
 		{"POSITION", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 0, D3D11_INPUT_PER_VERTEX_DATA, 0},
@@ -459,6 +653,7 @@ void PBRDemo::LoadShaders() {
 
 	m_gbufferVertexShader = new Graphics::VertexShader<Graphics::DefaultShaderConstantType, GBufferVertexShaderObjectConstants>(L"gbuffer_vs.cso", m_device, false, true, &m_defaultInputLayout, vertexDesc, 4);
 	m_instancedGBufferVertexShader = new Graphics::VertexShader<InstancedGBufferVertexShaderFrameConstants, InstancedGBufferVertexShaderObjectConstants>(L"instanced_gbuffer_vs.cso", m_device, true, true);
+	m_shadowDepthVertexShader = new Graphics::VertexShader<>(L"shadow_depth_vs.cso", m_device, false, false);
 	m_fullscreenTriangleVertexShader = new Graphics::VertexShader<>(L"fullscreen_triangle_vs.cso", m_device, false, false);
 	m_tiledCullFinalGatherComputeShader = new Graphics::ComputeShader<TiledCullFinalGatherComputeShaderFrameConstants, Graphics::DefaultShaderConstantType>(L"tiled_cull_final_gather_cs.cso", m_device, true, false);
 	m_postProcessPixelShader = new Graphics::PixelShader<>(L"post_process_ps.cso", m_device, false, false);
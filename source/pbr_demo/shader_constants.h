@@ -6,6 +6,8 @@
 
 #pragma once
 
+#include "pbr_demo/shader_defines.h"
+
 #include "scene/materials.h"
 #include "scene/lights.h"
 
@@ -25,7 +27,23 @@ struct InstancedGBufferVertexShaderFrameConstants {
 };
 
 struct InstancedGBufferVertexShaderObjectConstants {
-	uint StartVector;
+	/** The offset of the draw's first instance in the bound object index list */
+	uint StartInstance;
+};
+
+/**
+ * The per-object world matrix, as stored in the persistent object transform buffer.
+ * Only the first three rows of the transposed world matrix are stored
+ */
+struct ObjectTransform {
+	DirectX::XMFLOAT4 Rows[3];
+
+	inline void Set(const DirectX::XMMATRIX &world) {
+		DirectX::XMMATRIX transposed = DirectX::XMMatrixTranspose(world);
+		DirectX::XMStoreFloat4(&Rows[0], transposed.r[0]);
+		DirectX::XMStoreFloat4(&Rows[1], transposed.r[1]);
+		DirectX::XMStoreFloat4(&Rows[2], transposed.r[2]);
+	}
 };
 
 
@@ -43,7 +61,17 @@ struct TiledCullFinalGatherComputeShaderFrameConstants {
 	DirectX::XMFLOAT2 CameraClipPlanes;
 	uint NumSpotLightsToDraw;
 	uint pad;
+
+	/** The view depth each cascade ends at. Pixels past the last one aren't shadowed by the directional light */
+	DirectX::XMFLOAT4 CascadeEnds;
+	/** World to shadow map clip space for each slice of the shadow map array */
+	DirectX::XMMATRIX ShadowViewProj[SHADOW_CASCADE_COUNT + MAX_SHADOWED_SPOT_LIGHTS];
+
+	uint NumShadowedSpotLights;
+	uint pad2[3];
 };
 
+static_assert(SHADOW_CASCADE_COUNT == 4, "CascadeEnds holds one cascade per component");
+
 
 } // End of namespace PBRDemo
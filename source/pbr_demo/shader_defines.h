@@ -14,4 +14,9 @@
 #define COMPUTE_SHADER_TILE_GROUP_DIM 16
 #define COMPUTE_SHADER_TILE_GROUP_SIZE (COMPUTE_SHADER_TILE_GROUP_DIM*COMPUTE_SHADER_TILE_GROUP_DIM)
 
+// The slices of the shadow map array. The cascades of the directional light come first,
+// followed by the first MAX_SHADOWED_SPOT_LIGHTS spot lights
+#define SHADOW_CASCADE_COUNT 4
+#define MAX_SHADOWED_SPOT_LIGHTS 4
+
 #endif
\ No newline at end of file
@@ -8,29 +8,32 @@
 #include "graphics/shaders/hlsl_util.hlsli"
 
 
-#define NUM_VECTORS_PER_INSTANCE 3u
+struct ObjectTransform {
+	float4 c0;
+	float4 c1;
+	float4 c2;
+};
 
 cbuffer cbPerFrame : register(b0) {
 	float4x4 gViewProjMatrix;
 }
 
 cbuffer cbPerObject : register(b1) {
-	uint gStartVector;
+	uint gStartInstance;
 };
 
-StructuredBuffer<float4> gInstanceBuffer : register(t0);
+// The world matrices of every object. Only re-uploaded when an object moves
+StructuredBuffer<ObjectTransform> gObjectTransforms : register(t0);
+// The index into gObjectTransforms of each instance
+StructuredBuffer<uint> gInstanceIndices : register(t1);
 
 
 GBufferShaderPixelIn InstancedGBufferVS(InstancedVertexIn input) {
 	GBufferShaderPixelIn output;
 
-	uint worldMatrixOffset = input.instanceId * NUM_VECTORS_PER_INSTANCE + gStartVector;
-
-	float4 c0 = gInstanceBuffer[worldMatrixOffset];
-	float4 c1 = gInstanceBuffer[worldMatrixOffset + 1];
-	float4 c2 = gInstanceBuffer[worldMatrixOffset + 2];
+	ObjectTransform transform = gObjectTransforms[gInstanceIndices[gStartInstance + input.instanceId]];
 
-	float4x4 world = CreateMatrixFromCols(c0, c1, c2, float4(0.0f, 0.0f, 0.0f, 1.0f));
+	float4x4 world = CreateMatrixFromCols(transform.c0, transform.c1, transform.c2, float4(0.0f, 0.0f, 0.0f, 1.0f));
 	float4x4 worldViewProj = mul(world, gViewProjMatrix);
 
 	output.positionClip = mul(float4(input.position, 1.0f), worldViewProj);
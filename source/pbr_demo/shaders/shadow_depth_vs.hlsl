@@ -0,0 +1,41 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "types.hlsli"
+#include "graphics/shaders/hlsl_util.hlsli"
+
+
+// Shares its bindings with InstancedGBufferVS, so the shadow pass submits the same
+// commands and instance streams as the GBuffer pass. Only the position is transformed
+
+struct ObjectTransform {
+	float4 c0;
+	float4 c1;
+	float4 c2;
+};
+
+cbuffer cbPerFrame : register(b0) {
+	// The view projection of the shadow map slice being rendered
+	float4x4 gViewProjMatrix;
+}
+
+cbuffer cbPerObject : register(b1) {
+	uint gStartInstance;
+};
+
+// The world matrices of every object. Only re-uploaded when an object moves
+StructuredBuffer<ObjectTransform> gObjectTransforms : register(t0);
+// The index into gObjectTransforms of each instance
+StructuredBuffer<uint> gInstanceIndices : register(t1);
+
+
+float4 ShadowDepthVS(InstancedVertexIn input) : SV_POSITION {
+	ObjectTransform transform = gObjectTransforms[gInstanceIndices[gStartInstance + input.instanceId]];
+
+	float4x4 world = CreateMatrixFromCols(transform.c0, transform.c1, transform.c2, float4(0.0f, 0.0f, 0.0f, 1.0f));
+
+	return mul(mul(float4(input.position, 1.0f), world), gViewProjMatrix);
+}
@@ -29,6 +29,12 @@ cbuffer cbPerFrame : register(b0) {
 
 	float2 gCameraClipPlanes : packoffset(c15);
 	uint gNumSpotLightsToDraw : packoffset(c15.z);
+
+	// The view depth each cascade ends at
+	float4 gCascadeEnds : packoffset(c16);
+	float4x4 gShadowViewProj[SHADOW_CASCADE_COUNT + MAX_SHADOWED_SPOT_LIGHTS] : packoffset(c17);
+
+	uint gNumShadowedSpotLights : packoffset(c49);
 }
 
 #ifdef MSAA_
@@ -46,6 +52,10 @@ cbuffer cbPerFrame : register(b0) {
 StructuredBuffer<PointLight> gPointLights : register(t4);
 StructuredBuffer<SpotLight> gSpotLights : register(t5);
 
+// The cascades of the directional light, followed by the shadowed spot lights
+Texture2DArray<float> gShadowMaps : register(t6);
+SamplerComparisonState gShadowSampler : register(s0);
+
 RWTexture2D<float4> gOutputBuffer : register(u0);
 
 groupshared uint sMinZ;
@@ -58,6 +68,21 @@ groupshared uint sTileSpotLightIndices[MAX_LIGHTS_PER_TILE];
 groupshared uint sTileNumSpotLights;
 
 
+// Returns the fraction of the light that reaches the position. Positions outside of the slice aren't shadowed
+float SampleShadowMap(uint slice, float3 positionWS) {
+	float4 positionClip = mul(float4(positionWS, 1.0f), gShadowViewProj[slice]);
+	float3 positionNDC = positionClip.xyz / positionClip.w;
+	float2 shadowUV = float2(positionNDC.x * 0.5f + 0.5f, -positionNDC.y * 0.5f + 0.5f);
+
+	[branch]
+	if (positionClip.w <= 0.0f || any(shadowUV < 0.0f) || any(shadowUV > 1.0f) || positionNDC.z > 1.0f) {
+		return 1.0f;
+	}
+
+	return gShadowMaps.SampleCmpLevelZero(gShadowSampler, float3(shadowUV, slice), positionNDC.z);
+}
+
+
 [numthreads(COMPUTE_SHADER_TILE_GROUP_DIM, COMPUTE_SHADER_TILE_GROUP_DIM, 1)]
 void ComputeShaderTileCS(uint3 groupId : SV_GroupID,
                          uint groupIndex : SV_GroupIndex,
@@ -242,7 +267,14 @@ void ComputeShaderTileCS(uint3 groupId : SV_GroupID,
 			uint lightIndex;
 
 			// Accumulate directional contribution
-			AccumulateCookTorranceDirectionalLight(gDirectionalLight, surfProps, toEye, outColor);
+			// Use the first cascade that reaches the pixel. Past the last one, the pixel is unshadowed
+			DirectionalLight directionalLight = gDirectionalLight;
+			uint cascade = (uint)dot(float4(linearZ > gCascadeEnds), (1.0f).xxxx);
+			[branch]
+			if (cascade < SHADOW_CASCADE_COUNT) {
+				directionalLight.Irradiance *= SampleShadowMap(cascade, surfProps.Position);
+			}
+			AccumulateCookTorranceDirectionalLight(directionalLight, surfProps, toEye, outColor);
 
 			for (lightIndex = 0; lightIndex < numPointLights; ++lightIndex) {
 				PointLight light = gPointLights[sTilePointLightIndices[lightIndex]];
@@ -252,7 +284,14 @@ void ComputeShaderTileCS(uint3 groupId : SV_GroupID,
 			}
 
 			for (lightIndex = 0; lightIndex < numSpotLights; ++lightIndex) {
-				SpotLight light = gSpotLights[sTileSpotLightIndices[lightIndex]];
+				uint spotLightIndex = sTileSpotLightIndices[lightIndex];
+				SpotLight light = gSpotLights[spotLightIndex];
+
+				// The first spot lights have a slice each, after the cascades
+				[branch]
+				if (spotLightIndex < gNumShadowedSpotLights) {
+					light.Irradiance *= SampleShadowMap(SHADOW_CASCADE_COUNT + spotLightIndex, surfProps.Position);
+				}
 				
 				// Accumulate point light contribution
 				AccumulateCookTorranceSpotLight(light, surfProps, toEye, outColor);
@@ -0,0 +1,410 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "common/typedefs.h"
+
+#include "engine/timer.h"
+
+#include "scene/mesh_bvh.h"
+#include "scene/model.h"
+#include "scene/ray_picker.h"
+
+#include <DirectXMath.h>
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+
+struct BenchmarkSettings {
+	BenchmarkSettings()
+		: Objects(500u),
+		  Meshes(16u),
+		  Detail(48u),
+		  Resolution(256u),
+		  Verify(128u) {
+	}
+
+	uint Objects;
+	uint Meshes;
+	uint Detail;
+	uint Resolution;
+	uint Verify;
+};
+
+/** A placed mesh. The brute force reference works from these, rather than from the RayPicker */
+struct Placement {
+	Scene::Model *Model;
+	DirectX::XMFLOAT4X4 World;
+};
+
+struct Ray {
+	DirectX::XMFLOAT3 Origin;
+	DirectX::XMFLOAT3 Direction;
+	float MaxDistance;
+};
+
+void PrintUsage() {
+	printf("Usage: RayPickingBenchmark [-objects <count>] [-meshes <count>] [-detail <count>] [-resolution <pixels>] [-verify <count>]\n\n"
+	       "    -objects       The number of placed meshes. Defaults to 500\n"
+	       "    -meshes        The number of distinct meshes. Defaults to 16\n"
+	       "    -detail        The number of slices of each mesh. A mesh has about 2 * detail^2 triangles. Defaults to 48\n"
+	       "    -resolution    The camera rays are cast through a resolution x resolution grid. Defaults to 256\n"
+	       "    -verify        The number of rays of each kind that are checked against brute force. Defaults to 128\n");
+}
+
+/**
+ * Creates a lumpy sphere sitting on a lumpy plate. Each is its own subset, with its own range of
+ * vertices, so the triangle numbering and the subset offsets get exercised
+ */
+Scene::Model *CreateMesh(std::mt19937 &random, uint detail) {
+	std::uniform_real_distribution<float> bumpDistribution(0.9f, 1.1f);
+
+	std::vector<DirectX::XMFLOAT3> positions;
+	std::vector<uint> indices;
+	Scene::ModelSubset *subsets = new Scene::ModelSubset[2];
+
+	// The sphere. Rings of 'detail' vertices from pole to pole
+	uint stackCount = detail / 2u;
+	for (uint stack = 0; stack <= stackCount; ++stack) {
+		float phi = DirectX::XM_PI * stack / stackCount;
+		for (uint slice = 0; slice < detail; ++slice) {
+			float theta = DirectX::XM_2PI * slice / detail;
+			float radius = bumpDistribution(random);
+			positions.push_back(DirectX::XMFLOAT3(radius * std::sin(phi) * std::cos(theta), 1.0f + radius * std::cos(phi), radius * std::sin(phi) * std::sin(theta)));
+		}
+	}
+	for (uint stack = 0; stack < stackCount; ++stack) {
+		for (uint slice = 0; slice < detail; ++slice) {
+			uint a = stack * detail + slice;
+			uint b = stack * detail + (slice + 1u) % detail;
+			uint c = a + detail;
+			uint d = b + detail;
+			uint quad[6] = {a, b, c, b, d, c};
+			indices.insert(indices.end(), quad, quad + 6);
+		}
+	}
+	subsets[0].VertexStart = 0u;
+	subsets[0].VertexCount = static_cast<uint>(positions.size());
+	subsets[0].IndexStart = 0u;
+	subsets[0].IndexCount = static_cast<uint>(indices.size());
+	subsets[0].AABB_min = DirectX::XMFLOAT3(-1.1f, -0.1f, -1.1f);
+	subsets[0].AABB_max = DirectX::XMFLOAT3(1.1f, 2.1f, 1.1f);
+	subsets[0].Material = nullptr;
+
+	// The plate. Its indices are relative to its own first vertex
+	uint plateStart = static_cast<uint>(positions.size());
+	uint plateIndexStart = static_cast<uint>(indices.size());
+	for (uint z = 0; z <= detail; ++z) {
+		for (uint x = 0; x <= detail; ++x) {
+			positions.push_back(DirectX::XMFLOAT3(-2.0f + 4.0f * x / detail, (bumpDistribution(random) - 1.0f), -2.0f + 4.0f * z / detail));
+		}
+	}
+	for (uint z = 0; z < detail; ++z) {
+		for (uint x = 0; x < detail; ++x) {
+			uint a = z * (detail + 1u) + x;
+			uint b = a + 1u;
+			uint c = a + detail + 1u;
+			uint d = c + 1u;
+			uint quad[6] = {a, c, b, b, c, d};
+			indices.insert(indices.end(), quad, quad + 6);
+		}
+	}
+	subsets[1].VertexStart = plateStart;
+	subsets[1].VertexCount = static_cast<uint>(positions.size()) - plateStart;
+	subsets[1].IndexStart = plateIndexStart;
+	subsets[1].IndexCount = static_cast<uint>(indices.size()) - plateIndexStart;
+	subsets[1].AABB_min = DirectX::XMFLOAT3(-2.0f, -0.1f, -2.0f);
+	subsets[1].AABB_max = DirectX::XMFLOAT3(2.0f, 0.1f, 2.0f);
+	subsets[1].Material = nullptr;
+
+	// There's no device, so only the CPU geometry is created
+	Scene::Model *model = new Scene::Model();
+	model->KeepCPUGeometry(&positions.front(), sizeof(DirectX::XMFLOAT3), static_cast<uint>(positions.size()), &indices.front(), static_cast<uint>(indices.size()));
+	model->VertexCount = static_cast<uint>(positions.size());
+	model->IndexCount = static_cast<uint>(indices.size());
+	model->CreateSubsets(subsets, 2u);
+	model->AABB_min = DirectX::XMFLOAT3(-2.0f, -0.1f, -2.0f);
+	model->AABB_max = DirectX::XMFLOAT3(2.0f, 2.1f, 2.0f);
+
+	return model;
+}
+
+/** Tests the ray against every triangle of every placement, in world space */
+bool BruteForcePick(const std::vector<Placement> &placements, const Ray &ray, bool anyHit, Scene::RayHit *out_hit) {
+	float closest = ray.MaxDistance;
+	bool hit = false;
+
+	for (uint i = 0; i < placements.size(); ++i) {
+		const Scene::Model *model = placements[i].Model;
+		DirectX::XMMATRIX world = DirectX::XMLoadFloat4x4(&placements[i].World);
+
+		for (uint j = 0; j < model->SubsetCount; ++j) {
+			const Scene::ModelSubset &subset = model->Subsets[j];
+			for (uint k = 0; k < subset.IndexCount; k += 3u) {
+				DirectX::XMFLOAT3 v[3];
+				for (uint corner = 0; corner < 3; ++corner) {
+					const DirectX::XMFLOAT3 &position = model->CPUPositions[subset.VertexStart + model->CPUIndices[subset.IndexStart + k + corner]];
+					DirectX::XMStoreFloat3(&v[corner], DirectX::XMVector3Transform(DirectX::XMLoadFloat3(&position), world));
+				}
+
+				float distance;
+				if (Scene::MeshBVH::IntersectTriangle(ray.Origin, ray.Direction, v[0], v[1], v[2], &distance) && distance < closest) {
+					closest = distance;
+					out_hit->Distance = distance;
+					out_hit->Triangle = (subset.IndexStart + k) / 3u;
+					out_hit->Object = i;
+					hit = true;
+
+					if (anyHit) {
+						return true;
+					}
+				}
+			}
+		}
+	}
+
+	return hit;
+}
+
+/**
+ * Whether two results agree. The BVH works in model space and the brute force in world space,
+ * so the distances differ by rounding, and a ray through a shared edge can pick either triangle
+ */
+bool HitsMatch(bool referenceHit, const Scene::RayHit &reference, bool hit, const Scene::RayHit &result) {
+	if (referenceHit != hit) {
+		return false;
+	}
+	if (!hit) {
+		return true;
+	}
+
+	float tolerance = 1e-3f * std::max(1.0f, reference.Distance);
+	if (std::fabs(reference.Distance - result.Distance) > tolerance) {
+		return false;
+	}
+	return true;
+}
+
+void PrintRow(const char *label, uint rays, double milliseconds) {
+	printf("  %-28s %10u %12.2f %14.2f\n", label, rays, milliseconds, rays / (milliseconds * 1000.0));
+}
+
+/**
+ * A headless benchmark and self-check of Scene::RayPicker and Scene::MeshBVH. Exits with 1 if
+ * any of the verified rays disagrees with brute force
+ */
+int main(int argc, char *argv[]) {
+	BenchmarkSettings settings;
+
+	for (int i = 1; i < argc; ++i) {
+		if (i + 1 >= argc) {
+			PrintUsage();
+			return 1;
+		}
+
+		uint value = static_cast<uint>(atoi(argv[i + 1]));
+		if (strcmp(argv[i], "-objects") == 0) {
+			settings.Objects = value;
+		} else if (strcmp(argv[i], "-meshes") == 0) {
+			settings.Meshes = value;
+		} else if (strcmp(argv[i], "-detail") == 0) {
+			settings.Detail = value;
+		} else if (strcmp(argv[i], "-resolution") == 0) {
+			settings.Resolution = value;
+		} else if (strcmp(argv[i], "-verify") == 0) {
+			settings.Verify = value;
+		} else {
+			PrintUsage();
+			return 1;
+		}
+		++i;
+	}
+
+	// The packets are 2 x 2 pixel tiles
+	if (settings.Objects == 0u || settings.Meshes == 0u || settings.Detail < 4u || settings.Detail > 1024u ||
+	    settings.Resolution < 2u || settings.Resolution % 2u != 0u || settings.Verify == 0u) {
+		printf("Settings out of range. Objects and meshes must be at least 1, detail in [4, 1024], resolution an even number of at least 2, and verify at least 1\n\n");
+		PrintUsage();
+		return 1;
+	}
+
+	std::mt19937 random(1337u);
+
+	std::vector<Scene::Model *> meshes;
+	for (uint i = 0; i < settings.Meshes; ++i) {
+		meshes.push_back(CreateMesh(random, settings.Detail));
+	}
+
+	// Scatter rotated, scaled copies over a field in front of the camera
+	float fieldSize = 10.0f * std::sqrt(static_cast<float>(settings.Objects));
+	std::uniform_int_distribution<uint> meshDistribution(0u, settings.Meshes - 1u);
+	std::uniform_real_distribution<float> positionDistribution(-fieldSize * 0.5f, fieldSize * 0.5f);
+	std::uniform_real_distribution<float> angleDistribution(0.0f, DirectX::XM_2PI);
+	std::uniform_real_distribution<float> scaleDistribution(0.5f, 3.0f);
+
+	std::vector<Placement> placements(settings.Objects);
+	Scene::RayPicker picker;
+	for (uint i = 0; i < settings.Objects; ++i) {
+		placements[i].Model = meshes[meshDistribution(random)];
+
+		DirectX::XMMATRIX world = DirectX::XMMatrixScaling(scaleDistribution(random), scaleDistribution(random), scaleDistribution(random)) *
+		                          DirectX::XMMatrixRotationRollPitchYaw(angleDistribution(random) * 0.1f, angleDistribution(random), angleDistribution(random) * 0.1f) *
+		                          DirectX::XMMatrixTranslation(positionDistribution(random), 0.0f, positionDistribution(random) + fieldSize * 0.6f);
+		DirectX::XMStoreFloat4x4(&placements[i].World, world);
+
+		// Object ids are handed out in order, so they match the placement indices
+		picker.AddObject(placements[i].Model, world);
+	}
+	picker.Update();
+
+	// The camera rays. Row major over the screen, so each 2 x 2 tile is a coherent packet
+	DirectX::XMMATRIX view = DirectX::XMMatrixLookAtLH(DirectX::XMVectorSet(0.0f, 8.0f, 0.0f, 1.0f), DirectX::XMVectorSet(0.0f, 0.0f, fieldSize * 0.6f, 1.0f), DirectX::XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f));
+	DirectX::XMMATRIX projection = DirectX::XMMatrixPerspectiveFovLH(0.33f * DirectX::XM_PI, 1.0f, 0.1f, 1000.0f);
+	uint rayCount = settings.Resolution * settings.Resolution;
+	std::vector<Ray> cameraRays(rayCount);
+	for (uint y = 0; y < settings.Resolution; ++y) {
+		for (uint x = 0; x < settings.Resolution; ++x) {
+			Ray &ray = cameraRays[y * settings.Resolution + x];
+			Scene::RayPicker::ScreenPointToRay(x + 0.5f, y + 0.5f, static_cast<float>(settings.Resolution), static_cast<float>(settings.Resolution), view, projection, &ray.Origin, &ray.Direction);
+			ray.MaxDistance = FLT_MAX;
+		}
+	}
+
+	// Line of sight rays between random points above the field. Their direction spans the whole segment, so the max distance is 1
+	std::uniform_real_distribution<float> heightDistribution(0.0f, 6.0f);
+	std::vector<Ray> sightRays(rayCount);
+	for (uint i = 0; i < rayCount; ++i) {
+		DirectX::XMFLOAT3 from(positionDistribution(random), heightDistribution(random), positionDistribution(random) + fieldSize * 0.6f);
+		DirectX::XMFLOAT3 to(positionDistribution(random), heightDistribution(random), positionDistribution(random) + fieldSize * 0.6f);
+		sightRays[i].Origin = from;
+		sightRays[i].Direction = DirectX::XMFLOAT3(to.x - from.x, to.y - from.y, to.z - from.z);
+		sightRays[i].MaxDistance = 1.0f;
+	}
+
+	Engine::Timer timer;
+
+	// The mesh BVHs are built lazily by the first query that reaches them. Build them up front, so it can be timed on its own
+	timer.Start();
+	uint triangleCount = 0u;
+	for (auto iter = meshes.begin(); iter != meshes.end(); ++iter) {
+		triangleCount += (*iter)->GetMeshBVH()->GetTriangleCount();
+	}
+	double buildMilliseconds = timer.GetTime();
+
+	// Single rays
+	std::vector<Scene::RayHit> singleHits(rayCount);
+	std::vector<uint> singleHitFlags(rayCount);
+	timer.Start();
+	for (uint i = 0; i < rayCount; ++i) {
+		singleHitFlags[i] = picker.Pick(cameraRays[i].Origin, cameraRays[i].Direction, cameraRays[i].MaxDistance, &singleHits[i]) ? 1u : 0u;
+	}
+	double singleMilliseconds = timer.GetTime();
+
+	// 2 x 2 packets
+	std::vector<Scene::RayHit> packetHits(rayCount);
+	std::vector<uint> packetHitFlags(rayCount);
+	timer.Start();
+	for (uint y = 0; y < settings.Resolution; y += 2u) {
+		for (uint x = 0; x < settings.Resolution; x += 2u) {
+			uint lanes[Scene::RayPacket::kSize] = {y * settings.Resolution + x, y * settings.Resolution + x + 1u, (y + 1u) * settings.Resolution + x, (y + 1u) * settings.Resolution + x + 1u};
+
+			Scene::RayPacket packet;
+			for (uint lane = 0; lane < Scene::RayPacket::kSize; ++lane) {
+				const Ray &ray = cameraRays[lanes[lane]];
+				packet.Set(lane, ray.Origin, ray.Direction, ray.MaxDistance);
+			}
+
+			uint hitMask = picker.Pick(&packet);
+			for (uint lane = 0; lane < Scene::RayPacket::kSize; ++lane) {
+				Scene::RayHit &hit = packetHits[lanes[lane]];
+				hit.Distance = packet.Distance[lane];
+				hit.Triangle = packet.Triangle[lane];
+				hit.Object = packet.Object[lane];
+				packetHitFlags[lanes[lane]] = (hitMask >> lane) & 1u;
+			}
+		}
+	}
+	double packetMilliseconds = timer.GetTime();
+
+	// Line of sight
+	std::vector<uint> sightFlags(rayCount);
+	timer.Start();
+	for (uint i = 0; i < rayCount; ++i) {
+		sightFlags[i] = picker.IntersectAny(sightRays[i].Origin, sightRays[i].Direction, sightRays[i].MaxDistance) ? 1u : 0u;
+	}
+	double sightMilliseconds = timer.GetTime();
+
+	// Brute force, on an even spread of the rays
+	uint verifyCount = std::min(settings.Verify, rayCount);
+	uint verifyStride = rayCount / verifyCount;
+	uint mismatches = 0u;
+	uint cameraHits = 0u;
+	uint blockedSights = 0u;
+
+	timer.Start();
+	for (uint i = 0; i < verifyCount; ++i) {
+		uint ray = i * verifyStride;
+		Scene::RayHit reference;
+		bool referenceHit = BruteForcePick(placements, cameraRays[ray], false, &reference);
+		cameraHits += referenceHit ? 1u : 0u;
+
+		if (!HitsMatch(referenceHit, reference, singleHitFlags[ray] != 0u, singleHits[ray])) {
+			if (mismatches < 10u) {
+				printf("Single ray %u: brute force %s %f, RayPicker %s %f\n", ray, referenceHit ? "hit" : "missed", reference.Distance, singleHitFlags[ray] ? "hit" : "missed", singleHits[ray].Distance);
+			}
+			++mismatches;
+		}
+		if (!HitsMatch(referenceHit, reference, packetHitFlags[ray] != 0u, packetHits[ray])) {
+			if (mismatches < 10u) {
+				printf("Packet ray %u: brute force %s %f, RayPicker %s %f\n", ray, referenceHit ? "hit" : "missed", reference.Distance, packetHitFlags[ray] ? "hit" : "missed", packetHits[ray].Distance);
+			}
+			++mismatches;
+		}
+	}
+	double bruteForceMilliseconds = timer.GetTime();
+
+	for (uint i = 0; i < verifyCount; ++i) {
+		uint ray = i * verifyStride;
+		Scene::RayHit reference;
+		bool blocked = BruteForcePick(placements, sightRays[ray], false, &reference);
+		blockedSights += blocked ? 1u : 0u;
+
+		// A segment that only grazes a triangle at its very end can go either way
+		if (blocked != (sightFlags[ray] != 0u) && !(blocked && reference.Distance > 0.999f)) {
+			if (mismatches < 10u) {
+				printf("Line of sight %u: brute force %s, RayPicker %s\n", ray, blocked ? "blocked" : "clear", sightFlags[ray] ? "blocked" : "clear");
+			}
+			++mismatches;
+		}
+	}
+
+	printf("Scene: %u objects, %u meshes, %u triangles per mesh on average, %u x %u camera rays\n\n",
+	       settings.Objects, settings.Meshes, triangleCount / settings.Meshes, settings.Resolution, settings.Resolution);
+	printf("  Mesh BVH build: %.2f ms for %u triangles\n\n", buildMilliseconds, triangleCount);
+	printf("  %-28s %10s %12s %14s\n", "", "Rays", "Time (ms)", "Mrays / sec");
+	PrintRow("Brute force (closest hit)", verifyCount, bruteForceMilliseconds);
+	PrintRow("Single rays", rayCount, singleMilliseconds);
+	PrintRow("2 x 2 packets", rayCount, packetMilliseconds);
+	PrintRow("Line of sight (any hit)", rayCount, sightMilliseconds);
+	printf("\n  Verified %u camera rays (%u hit) and %u line of sight rays (%u blocked) against brute force\n", verifyCount, cameraHits, verifyCount, blockedSights);
+
+	for (auto iter = meshes.begin(); iter != meshes.end(); ++iter) {
+		delete *iter;
+	}
+
+	if (mismatches != 0u) {
+		printf("\nFAILED: %u mismatches\n", mismatches);
+		return 1;
+	}
+
+	return 0;
+}
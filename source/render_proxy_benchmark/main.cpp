@@ -0,0 +1,559 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "common/typedefs.h"
+
+#include "engine/timer.h"
+
+#include "graphics/command_bucket.h"
+#include "graphics/commands.h"
+#include "graphics/constant_ring_buffer.h"
+#include "graphics/instance_stream.h"
+#include "graphics/recording_render_backend.h"
+#include "graphics/sort_key.h"
+
+#include "scene/frustum_culler.h"
+#include "scene/materials.h"
+#include "scene/model.h"
+#include "scene/render_proxy_store.h"
+#include "scene/static_batcher.h"
+
+#include <DirectXMath.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+
+// The same layout as PBRDemo::GBufferSortKeyGenerator, without the layer
+typedef Graphics::SortKeyFirstField<8> ShaderField;
+typedef Graphics::SortKeyNextField<ShaderField, 12> MaterialField;
+typedef Graphics::SortKeyNextField<MaterialField, 10> VertexBufferField;
+typedef Graphics::SortKeyNextField<VertexBufferField, 10> IndexBufferField;
+typedef Graphics::SortKeyNextField<IndexBufferField, 10> SubsetField;
+typedef Graphics::SortKeyNextField<SubsetField, 10> DepthField;
+
+static const uint kMaxDraws = 16384u;
+static const uint kMaxSubsetsPerMesh = 3u;
+// The size of the vertex in the demos. Position, normal, texCoord, tangent
+static const uint kVertexStride = 44u;
+static const uint kTexturesPerMaterial = 3u;
+static const uint kSamplersPerMaterial = 2u;
+static const float kNearClip = 1.0f;
+static const float kFarClip = 2000.0f;
+/**
+ * The first map of the instance offset ring and of the instance stream are discards, and so is a wrap of
+ * the stream. The merged draws themselves must not add any
+ */
+static const uint kMaxDiscardMapsPerFrame = 2u;
+/**
+ * The default budget for generating and submitting a draw of the proxy stream, in nanoseconds, on the fastest
+ * frame. It's several times what an optimized build needs. Pass -budget 0 to turn it off, IE. for Debug builds
+ */
+static const uint kDefaultFrameBudget = 2000u;
+
+typedef Graphics::CommandBucket<uint64, kMaxDraws> Bucket;
+
+struct BenchmarkSettings {
+	BenchmarkSettings()
+		: Meshes(200u),
+		  Placements(5000u),
+		  Materials(64u),
+		  Shaders(4u),
+		  Frames(50u),
+		  FrameBudget(kDefaultFrameBudget) {
+	}
+
+	uint Meshes;
+	uint Placements;
+	uint Materials;
+	uint Shaders;
+	uint Frames;
+	/** In nanoseconds per draw. 0 turns the budget off */
+	uint FrameBudget;
+};
+
+/** A placed mesh, the way PBRDemo stored its models before the proxies */
+struct Placement {
+	Scene::Model *Model;
+	DirectX::XMFLOAT4X4 World;
+	/** The world space center of the model's bounds. Used for the depth sort */
+	DirectX::XMFLOAT3 Center;
+	/** Always nullptr here. Kept so the model walk does the same work as the demo did */
+	const Scene::StaticBatchRange *BatchRange;
+};
+
+struct PathResult {
+	double GenerateMilliseconds;
+	double SubmitMilliseconds;
+	/** The generate and submit time of the fastest frame */
+	double FastestFrameMilliseconds;
+	uint Draws;
+	uint64 KeyChecksum;
+	/** The stats of the last frame */
+	Graphics::RenderBackendStats Stats;
+	/** The most WRITE_DISCARD maps of any frame */
+	uint MaxDiscardMaps;
+};
+
+/** What both paths need to submit */
+struct SubmitContext {
+	Graphics::RecordingRenderBackend *Backend;
+	Bucket *Bucket;
+	Graphics::InstanceStream *InstanceStream;
+	Graphics::ConstantRingBuffer *InstanceOffsetRing;
+};
+
+void PrintUsage() {
+	printf("Usage: RenderProxyBenchmark [-meshes <count>] [-placements <count>] [-materials <count>] [-shaders <count>] [-frames <count>] [-budget <ns>]\n\n"
+	       "    Culls and generates the GBuffer draws of a synthetic scene, once by walking Model -> Subsets -> Material\n"
+	       "    like PBRDemo used to, and once by streaming through a Scene::RenderProxyStore. Both are submitted to a\n"
+	       "    RecordingRenderBackend and checked against each other. Fails if the fastest frame of the proxy stream\n"
+	       "    takes longer than -budget nanoseconds per draw.\n");
+}
+
+Scene::Model *CreateMesh(Graphics::RenderBackend *backend, std::mt19937 &random, const std::vector<Scene::Material *> &materials) {
+	std::uniform_int_distribution<uint> vertexCountDistribution(24u, 2048u);
+	std::uniform_int_distribution<uint> subsetCountDistribution(1u, kMaxSubsetsPerMesh);
+	std::uniform_int_distribution<uint> materialDistribution(0u, static_cast<uint>(materials.size()) - 1u);
+	std::uniform_real_distribution<float> extentDistribution(0.5f, 10.0f);
+
+	uint subsetCount = subsetCountDistribution(random);
+	Scene::ModelSubset *subsets = new Scene::ModelSubset[subsetCount];
+
+	// The contents of the buffers never matter to the recording backend, so only their sizes are real
+	uint vertexCount = 0u;
+	uint indexCount = 0u;
+	DirectX::XMFLOAT3 modelMin(0.0f, 0.0f, 0.0f);
+	DirectX::XMFLOAT3 modelMax(0.0f, 0.0f, 0.0f);
+	for (uint i = 0; i < subsetCount; ++i) {
+		uint subsetVertexCount = vertexCountDistribution(random);
+		float extent = extentDistribution(random);
+
+		subsets[i].VertexStart = vertexCount;
+		subsets[i].VertexCount = subsetVertexCount;
+		subsets[i].IndexStart = indexCount;
+		subsets[i].IndexCount = (subsetVertexCount / 3u) * 3u;
+		subsets[i].AABB_min = DirectX::XMFLOAT3(-extent, -extent, -extent);
+		subsets[i].AABB_max = DirectX::XMFLOAT3(extent, extent, extent);
+		subsets[i].Material = materials[materialDistribution(random)];
+
+		modelMin = DirectX::XMFLOAT3(std::min(modelMin.x, -extent), std::min(modelMin.y, -extent), std::min(modelMin.z, -extent));
+		modelMax = DirectX::XMFLOAT3(std::max(modelMax.x, extent), std::max(modelMax.y, extent), std::max(modelMax.z, extent));
+		vertexCount += subsetVertexCount;
+		indexCount += subsets[i].IndexCount;
+	}
+
+	D3D11_BUFFER_DESC vbd;
+	vbd.Usage = D3D11_USAGE_IMMUTABLE;
+	vbd.ByteWidth = vertexCount * kVertexStride;
+	vbd.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+	vbd.CPUAccessFlags = 0;
+	vbd.MiscFlags = 0;
+	vbd.StructureByteStride = 0;
+
+	D3D11_BUFFER_DESC ibd = vbd;
+	ibd.ByteWidth = indexCount * sizeof(uint);
+	ibd.BindFlags = D3D11_BIND_INDEX_BUFFER;
+
+	// The buffers are created through the backend rather than Model::Create*Buffer(), since there is no device
+	Scene::Model *model = new Scene::Model();
+	model->VertexBuffer = backend->CreateBuffer(vbd, nullptr);
+	model->IndexBuffer = backend->CreateBuffer(ibd, nullptr);
+	model->VertexBufferId = Common::DenseIdGenerator<Scene::VertexBufferIdTag>::Next();
+	model->IndexBufferId = Common::DenseIdGenerator<Scene::IndexBufferIdTag>::Next();
+	model->VertexStride = kVertexStride;
+	model->VertexCount = vertexCount;
+	model->IndexCount = indexCount;
+	model->AABB_min = modelMin;
+	model->AABB_max = modelMax;
+	model->CreateSubsets(subsets, subsetCount);
+
+	return model;
+}
+
+void DestroyMesh(Graphics::RenderBackend *backend, Scene::Model *model) {
+	// The buffers belong to the backend, so they can't be released by the Model destructor. Nor can their ids
+	backend->ReleaseBuffer(model->VertexBuffer);
+	backend->ReleaseBuffer(model->IndexBuffer);
+	Common::DenseIdGenerator<Scene::VertexBufferIdTag>::Release(model->VertexBufferId);
+	Common::DenseIdGenerator<Scene::IndexBufferIdTag>::Release(model->IndexBufferId);
+	model->VertexBuffer = nullptr;
+	model->IndexBuffer = nullptr;
+
+	delete model;
+}
+
+inline uint64 AddToChecksum(uint64 checksum, uint64 value) {
+	return (checksum ^ value) * 1099511628211ull;
+}
+
+/** Sorts, merges and submits the bucket, and returns the time it took */
+double Submit(const SubmitContext &context, Graphics::RenderBackendStats *out_stats) {
+	Engine::Timer timer;
+	timer.Start();
+
+	context.InstanceStream->BeginFrame();
+	Graphics::GraphicsState state;
+	context.Backend->ResetStats();
+	context.Bucket->Submit(context.Backend, &state);
+	context.Bucket->Clear();
+	context.InstanceStream->EndFrame();
+
+	double milliseconds = timer.GetTime();
+	*out_stats = context.Backend->GetStats();
+	return milliseconds;
+}
+
+/**
+ * The GBuffer model loop of PBRDemo before the proxies. Every visible (placement, subset) walks the
+ * model, the subset, the material and the material's texture / sampler vectors
+ *
+ * 'shaderIds' stands in for MaterialShader::GetId(). The shaders in this benchmark are fake handles
+ */
+PathResult RunModelWalk(const SubmitContext &context, const std::vector<Placement> &placements, const std::vector<uint32> &shaderIds,
+                        DirectX::CXMMATRIX view, const Scene::Frustum &frustum, uint frames) {
+	// The culling data, laid out the way the demo had it
+	Scene::FrustumCuller subsetCuller;
+	std::vector<std::pair<uint, uint> > subsetCullEntries;
+	for (uint i = 0; i < placements.size(); ++i) {
+		Scene::Model *model = placements[i].Model;
+		DirectX::XMMATRIX world = DirectX::XMLoadFloat4x4(&placements[i].World);
+		for (uint j = 0; j < model->SubsetCount; ++j) {
+			DirectX::XMFLOAT3 aabbMin, aabbMax;
+			Scene::FrustumCuller::TransformAABB(world, model->Subsets[j].AABB_min, model->Subsets[j].AABB_max, &aabbMin, &aabbMax);
+			subsetCuller.Add(aabbMin, aabbMax);
+			subsetCullEntries.push_back(std::make_pair(i, j));
+		}
+	}
+
+	PathResult result;
+	result.GenerateMilliseconds = 0.0;
+	result.SubmitMilliseconds = 0.0;
+	result.FastestFrameMilliseconds = 0.0;
+	result.MaxDiscardMaps = 0u;
+
+	std::vector<uint> visibleSubsets;
+	float inverseDepthRange = 1.0f / (kFarClip - kNearClip);
+	Engine::Timer timer;
+
+	for (uint frame = 0; frame < frames; ++frame) {
+		uint64 checksum = 14695981039346656037ull;
+		timer.Start();
+
+		subsetCuller.Cull(frustum, &visibleSubsets);
+
+		uint currentModel = ~0u;
+		float normalizedDepth = 0.0f;
+		ID3D11Buffer *vertexBuffer = nullptr;
+		ID3D11Buffer *indexBuffer = nullptr;
+		uint32 vertexBufferId = 0u;
+		uint32 indexBufferId = 0u;
+		uint baseVertex = 0u;
+		uint baseIndex = 0u;
+
+		for (auto iter = visibleSubsets.begin(); iter != visibleSubsets.end(); ++iter) {
+			uint i = subsetCullEntries[*iter].first;
+			uint j = subsetCullEntries[*iter].second;
+			Scene::Model *model = placements[i].Model;
+
+			if (i != currentModel) {
+				currentModel = i;
+
+				float viewDepth = DirectX::XMVectorGetZ(DirectX::XMVector3Transform(DirectX::XMLoadFloat3(&placements[i].Center), view));
+				normalizedDepth = (viewDepth - kNearClip) * inverseDepthRange;
+
+				vertexBuffer = model->VertexBuffer;
+				indexBuffer = model->IndexBuffer;
+				vertexBufferId = model->VertexBufferId;
+				indexBufferId = model->IndexBufferId;
+				baseVertex = 0u;
+				baseIndex = 0u;
+
+				const Scene::StaticBatchRange *batchRange = placements[i].BatchRange;
+				if (batchRange != nullptr) {
+					vertexBuffer = batchRange->VertexBuffer;
+					indexBuffer = batchRange->IndexBuffer;
+					vertexBufferId = batchRange->VertexBufferId;
+					indexBufferId = batchRange->IndexBufferId;
+					baseVertex = batchRange->BaseVertex;
+					baseIndex = batchRange->BaseIndex;
+				}
+			}
+
+			const Scene::ModelSubset &subset = model->Subsets[j];
+			const Scene::Material *material = subset.Material;
+
+			uint64 key = ShaderField::Encode(shaderIds[reinterpret_cast<uintptr_t>(material->Shader)]) |
+			             MaterialField::Encode(material->Id) |
+			             VertexBufferField::Encode(vertexBufferId) |
+			             IndexBufferField::Encode(indexBufferId) |
+			             SubsetField::Encode(j) |
+			             DepthField::EncodeUnorm(normalizedDepth);
+
+			auto command = context.Bucket->AddCommand<Graphics::Commands::DrawIndexedInstanceable>(key);
+			command->SetMaterialShader(material->Shader);
+			command->SetVertexBuffer(vertexBuffer, model->VertexStride);
+			command->SetIndexBuffer(indexBuffer, DXGI_FORMAT_R32_UINT);
+			for (uint k = 0; k < material->TextureSRVs.size(); ++k) {
+				command->SetTextureSRV(material->TextureSRVs[k], k);
+			}
+			for (uint k = 0; k < material->TextureSamplers.size(); ++k) {
+				command->SetTextureSampler(material->TextureSamplers[k], k);
+			}
+			command->SetRasterizerState(Graphics::RasterizerState::CULL_BACKFACES);
+			command->SetIndexCount(subset.IndexCount);
+			command->SetIndexStart(subset.IndexStart + baseIndex);
+			command->SetVertexStart(subset.VertexStart + baseVertex);
+			command->SetInstanceOffsetSlot(1u);
+			command->SetObjectIndex(i);
+
+			checksum = AddToChecksum(AddToChecksum(checksum, key), i);
+		}
+
+		double generateMilliseconds = timer.GetTime();
+		double submitMilliseconds = Submit(context, &result.Stats);
+		result.GenerateMilliseconds += generateMilliseconds;
+		result.SubmitMilliseconds += submitMilliseconds;
+		result.FastestFrameMilliseconds = frame == 0u ? generateMilliseconds + submitMilliseconds : std::min(result.FastestFrameMilliseconds, generateMilliseconds + submitMilliseconds);
+		result.MaxDiscardMaps = std::max(result.MaxDiscardMaps, result.Stats.DiscardMaps);
+		result.Draws = static_cast<uint>(visibleSubsets.size());
+		result.KeyChecksum = checksum;
+	}
+
+	result.GenerateMilliseconds /= frames;
+	result.SubmitMilliseconds /= frames;
+	return result;
+}
+
+/** The same draws, streamed from a RenderProxyStore */
+PathResult RunProxyStream(const SubmitContext &context, const Scene::RenderProxyStore &constProxies, DirectX::CXMMATRIX view, const Scene::Frustum &frustum, uint frames) {
+	Scene::RenderProxyStore &proxies = const_cast<Scene::RenderProxyStore &>(constProxies);
+
+	PathResult result;
+	result.GenerateMilliseconds = 0.0;
+	result.SubmitMilliseconds = 0.0;
+	result.FastestFrameMilliseconds = 0.0;
+	result.MaxDiscardMaps = 0u;
+
+	std::vector<uint> visibleProxies;
+	float inverseDepthRange = 1.0f / (kFarClip - kNearClip);
+	Engine::Timer timer;
+
+	for (uint frame = 0; frame < frames; ++frame) {
+		uint64 checksum = 14695981039346656037ull;
+		timer.Start();
+
+		proxies.Cull(frustum, &visibleProxies);
+
+		for (auto iter = visibleProxies.begin(); iter != visibleProxies.end(); ++iter) {
+			const Scene::RenderProxy &proxy = proxies.Get(*iter);
+			const Scene::MaterialBindings &bindings = proxies.GetMaterialBindings(proxy.MaterialId);
+
+			float viewDepth = DirectX::XMVectorGetZ(DirectX::XMVector3Transform(DirectX::XMLoadFloat3(&proxy.SortCenter), view));
+			float normalizedDepth = (viewDepth - kNearClip) * inverseDepthRange;
+
+			uint64 key = ShaderField::Encode(proxy.ShaderId) |
+			             MaterialField::Encode(proxy.MaterialId) |
+			             VertexBufferField::Encode(proxy.VertexBufferId) |
+			             IndexBufferField::Encode(proxy.IndexBufferId) |
+			             SubsetField::Encode(proxy.SubsetIndex) |
+			             DepthField::EncodeUnorm(normalizedDepth);
+
+			auto command = context.Bucket->AddCommand<Graphics::Commands::DrawIndexedInstanceable>(key);
+			command->SetMaterialShader(bindings.Shader);
+			command->SetVertexBuffer(proxy.VertexBuffer, proxy.VertexStride);
+			command->SetIndexBuffer(proxy.IndexBuffer, DXGI_FORMAT_R32_UINT);
+			command->SetTextureSRVs(bindings.TextureSRVs);
+			command->SetTextureSamplers(bindings.TextureSamplers);
+			command->SetRasterizerState(Graphics::RasterizerState::CULL_BACKFACES);
+			command->SetIndexCount(proxy.IndexCount);
+			command->SetIndexStart(proxy.IndexStart);
+			command->SetVertexStart(proxy.VertexStart);
+			command->SetInstanceOffsetSlot(1u);
+			command->SetObjectIndex(proxy.ObjectIndex);
+
+			checksum = AddToChecksum(AddToChecksum(checksum, key), proxy.ObjectIndex);
+		}
+
+		double generateMilliseconds = timer.GetTime();
+		double submitMilliseconds = Submit(context, &result.Stats);
+		result.GenerateMilliseconds += generateMilliseconds;
+		result.SubmitMilliseconds += submitMilliseconds;
+		result.FastestFrameMilliseconds = frame == 0u ? generateMilliseconds + submitMilliseconds : std::min(result.FastestFrameMilliseconds, generateMilliseconds + submitMilliseconds);
+		result.MaxDiscardMaps = std::max(result.MaxDiscardMaps, result.Stats.DiscardMaps);
+		result.Draws = static_cast<uint>(visibleProxies.size());
+		result.KeyChecksum = checksum;
+	}
+
+	result.GenerateMilliseconds /= frames;
+	result.SubmitMilliseconds /= frames;
+	return result;
+}
+
+void PrintRow(const char *label, const PathResult &result) {
+	double draws = std::max(result.Draws, 1u);
+	printf("  %-16s %8u %14.3f %14.1f %14.3f %14.1f\n", label, result.Draws,
+	       result.GenerateMilliseconds, result.GenerateMilliseconds * 1.0e6 / draws,
+	       result.SubmitMilliseconds, result.SubmitMilliseconds * 1.0e6 / draws);
+}
+
+/**
+ * A headless benchmark of Scene::RenderProxyStore. Exits with 1 if the two paths don't produce the same draws,
+ * if a frame makes more than kMaxDiscardMapsPerFrame WRITE_DISCARD maps,
+ * or if the proxy stream takes longer than the budget
+ */
+int main(int argc, char *argv[]) {
+	BenchmarkSettings settings;
+
+	for (int i = 1; i < argc; ++i) {
+		if (i + 1 >= argc) {
+			PrintUsage();
+			return 1;
+		}
+
+		uint value = static_cast<uint>(atoi(argv[i + 1]));
+		if (strcmp(argv[i], "-meshes") == 0) {
+			settings.Meshes = value;
+		} else if (strcmp(argv[i], "-placements") == 0) {
+			settings.Placements = value;
+		} else if (strcmp(argv[i], "-materials") == 0) {
+			settings.Materials = value;
+		} else if (strcmp(argv[i], "-shaders") == 0) {
+			settings.Shaders = value;
+		} else if (strcmp(argv[i], "-frames") == 0) {
+			settings.Frames = value;
+		} else if (strcmp(argv[i], "-budget") == 0) {
+			settings.FrameBudget = value;
+		} else {
+			PrintUsage();
+			return 1;
+		}
+		++i;
+	}
+
+	// The sort key fields limit the meshes, materials and shaders, and the bucket the draws
+	if (settings.Meshes == 0u || settings.Meshes > 900u || settings.Placements == 0u || settings.Placements * kMaxSubsetsPerMesh > kMaxDraws ||
+	    settings.Materials == 0u || settings.Materials > 4096u || settings.Shaders == 0u || settings.Shaders > 255u || settings.Frames == 0u) {
+		printf("Settings out of range. Meshes must be in [1, 900], placements in [1, %u], materials in [1, 4096], shaders in [1, 255], and frames at least 1\n\n", kMaxDraws / kMaxSubsetsPerMesh);
+		PrintUsage();
+		return 1;
+	}
+
+	Graphics::RecordingRenderBackend backend;
+	std::mt19937 random(1337u);
+
+	// The shaders and textures are never dereferenced by the recording backend, so fake handles are enough.
+	// The shader ids are handed out in the order the proxy store will see the shaders, so both paths build the same keys
+	std::vector<ID3D11ShaderResourceView *> textures(kTexturesPerMaterial);
+	std::vector<ID3D11SamplerState *> samplers(kSamplersPerMaterial);
+	std::vector<Scene::Material *> materials;
+	for (uint i = 0; i < settings.Materials; ++i) {
+		Graphics::MaterialShader *shader = reinterpret_cast<Graphics::MaterialShader *>(static_cast<uintptr_t>(1u + i % settings.Shaders));
+		for (uint j = 0; j < kTexturesPerMaterial; ++j) {
+			textures[j] = reinterpret_cast<ID3D11ShaderResourceView *>(static_cast<uintptr_t>(0x1000u + (i * kTexturesPerMaterial + j) * 16u));
+		}
+		for (uint j = 0; j < kSamplersPerMaterial; ++j) {
+			samplers[j] = reinterpret_cast<ID3D11SamplerState *>(static_cast<uintptr_t>(0x100000u + (i % 4u + j) * 16u));
+		}
+
+		Scene::Material *material = new Scene::Material(shader, textures, samplers);
+		material->Id = i;
+		materials.push_back(material);
+	}
+
+	std::vector<Scene::Model *> meshes;
+	for (uint i = 0; i < settings.Meshes; ++i) {
+		meshes.push_back(CreateMesh(&backend, random, materials));
+	}
+
+	// Scatter the placements around the camera, so about a quarter of them are in view
+	std::uniform_int_distribution<uint> meshDistribution(0u, settings.Meshes - 1u);
+	std::uniform_real_distribution<float> positionDistribution(-1000.0f, 1000.0f);
+	std::uniform_real_distribution<float> angleDistribution(0.0f, DirectX::XM_2PI);
+	std::vector<Placement> placements(settings.Placements);
+	Scene::RenderProxyStore proxies;
+	std::vector<uint32> shaderIds(settings.Shaders + 1u, 0u);
+	for (uint i = 0; i < settings.Placements; ++i) {
+		Placement &placement = placements[i];
+		placement.Model = meshes[meshDistribution(random)];
+		placement.BatchRange = nullptr;
+
+		DirectX::XMMATRIX world = DirectX::XMMatrixRotationY(angleDistribution(random)) *
+		                          DirectX::XMMatrixTranslation(positionDistribution(random), positionDistribution(random), positionDistribution(random));
+		DirectX::XMStoreFloat4x4(&placement.World, world);
+
+		DirectX::XMVECTOR center = DirectX::XMVectorScale(DirectX::XMVectorAdd(placement.Model->GetAABBMin_XM(), placement.Model->GetAABBMax_XM()), 0.5f);
+		DirectX::XMStoreFloat3(&placement.Center, DirectX::XMVector3Transform(center, world));
+
+		uint firstProxy = proxies.AddModel(placement.Model, i, world);
+		for (uint j = 0; j < placement.Model->SubsetCount; ++j) {
+			const Scene::RenderProxy &proxy = proxies.Get(firstProxy + j);
+			shaderIds[reinterpret_cast<uintptr_t>(placement.Model->Subsets[j].Material->Shader)] = proxy.ShaderId;
+		}
+	}
+
+	DirectX::XMMATRIX view = DirectX::XMMatrixLookAtLH(DirectX::XMVectorSet(0.0f, 0.0f, 0.0f, 1.0f), DirectX::XMVectorSet(0.0f, 0.0f, 1.0f, 1.0f), DirectX::XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f));
+	DirectX::XMMATRIX projection = DirectX::XMMatrixPerspectiveFovLH(DirectX::XM_PIDIV2, 16.0f / 9.0f, kNearClip, kFarClip);
+	Scene::Frustum frustum = Scene::ExtractFrustum(view * projection);
+
+	SubmitContext context;
+	context.Backend = &backend;
+	context.Bucket = new Bucket(64u * 1024u);
+	context.InstanceStream = new Graphics::InstanceStream(&backend, sizeof(uint));
+	// Each merged draw takes a 256 byte window of the ring
+	context.InstanceOffsetRing = new Graphics::ConstantRingBuffer(&backend, kMaxDraws * 256u);
+	context.Bucket->SetInstanceStream(context.InstanceStream, 1u, context.InstanceOffsetRing);
+
+	PathResult modelWalk = RunModelWalk(context, placements, shaderIds, view, frustum, settings.Frames);
+	PathResult proxyStream = RunProxyStream(context, proxies, view, frustum, settings.Frames);
+
+	printf("Scene: %u meshes, %u placements, %u proxies, %u materials, %u shaders. Average over %u frames\n\n",
+	       settings.Meshes, settings.Placements, proxies.GetSize(), settings.Materials, settings.Shaders, settings.Frames);
+	printf("  %-16s %8s %14s %14s %14s %14s\n", "", "Draws", "Generate (ms)", "Per draw (ns)", "Submit (ms)", "Per draw (ns)");
+	PrintRow("Model walk", modelWalk);
+	PrintRow("Proxy stream", proxyStream);
+	printf("\n  Generate: Culling, and building the sort key and the command of every visible subset\n"
+	       "  Submit:   Sorting, merging and executing the commands on a RecordingRenderBackend. The same for both\n");
+	printf("\n  Most WRITE_DISCARD maps in a frame: %u (model walk), %u (proxy stream)\n", modelWalk.MaxDiscardMaps, proxyStream.MaxDiscardMaps);
+
+	double fastestFrame = proxyStream.FastestFrameMilliseconds * 1.0e6 / std::max(proxyStream.Draws, 1u);
+	if (settings.FrameBudget > 0u) {
+		printf("  Fastest proxy stream frame: %.1f ns per draw. Budget: %u ns per draw\n", fastestFrame, settings.FrameBudget);
+	}
+
+	bool matches = modelWalk.Draws == proxyStream.Draws &&
+	               modelWalk.KeyChecksum == proxyStream.KeyChecksum &&
+	               memcmp(&modelWalk.Stats, &proxyStream.Stats, sizeof(Graphics::RenderBackendStats)) == 0;
+
+	delete context.InstanceOffsetRing;
+	delete context.InstanceStream;
+	delete context.Bucket;
+	for (auto iter = meshes.begin(); iter != meshes.end(); ++iter) {
+		DestroyMesh(&backend, *iter);
+	}
+	for (auto iter = materials.begin(); iter != materials.end(); ++iter) {
+		delete *iter;
+	}
+
+	if (!matches) {
+		printf("\nFAILED: The two paths produced different draws\n");
+		return 1;
+	}
+	if (modelWalk.MaxDiscardMaps > kMaxDiscardMapsPerFrame || proxyStream.MaxDiscardMaps > kMaxDiscardMapsPerFrame) {
+		printf("\nFAILED: A frame made more than %u WRITE_DISCARD maps\n", kMaxDiscardMapsPerFrame);
+		return 1;
+	}
+	if (settings.FrameBudget > 0u && fastestFrame > settings.FrameBudget) {
+		printf("\nFAILED: Generating and submitting the proxy stream took longer than the budget of %u ns per draw\n", settings.FrameBudget);
+		return 1;
+	}
+
+	return 0;
+}
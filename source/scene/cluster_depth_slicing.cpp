@@ -0,0 +1,334 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "scene/cluster_depth_slicing.h"
+
+#include "common/halfling_sys.h"
+
+#include "scene/lights.h"
+
+
+namespace Scene {
+
+ClusterDepthSlicing::ClusterDepthSlicing()
+	: m_nearClip(1.0f),
+	  m_farClip(1.0f),
+	  m_sliceCount(0u),
+	  m_nearSliceDepth(1.0f),
+	  m_farSliceDepth(1.0f),
+	  m_scale(0.0f),
+	  m_bias(0.0f),
+	  m_totalSamples(0.0f) {
+}
+
+void ClusterDepthSlicing::SetLogarithmic(float nearClip, float farClip, uint sliceCount, float nearSliceDepth, float farSliceDepth) {
+	AssertMsg(nearClip > 0.0f && farClip > nearClip, "The depth range has to be in front of the camera, and not empty");
+	AssertMsg(sliceCount > 0u, "There has to be at least one slice");
+
+	m_nearClip = nearClip;
+	m_farClip = farClip;
+	m_sliceCount = sliceCount;
+
+	if (farSliceDepth <= 0.0f) {
+		farSliceDepth = farClip;
+	}
+	m_nearSliceDepth = std::min(std::max(nearSliceDepth, nearClip), farClip);
+	m_farSliceDepth = std::min(std::max(farSliceDepth, m_nearSliceDepth), farClip);
+	if (m_farSliceDepth <= m_nearSliceDepth) {
+		// The logarithmic slices need some range to cover. Give them the end of the depth range
+		m_nearSliceDepth = std::min(m_nearSliceDepth, farClip * 0.5f);
+		m_farSliceDepth = farClip;
+	}
+
+	CalculateScaleAndBias(m_nearSliceDepth, m_farSliceDepth, &m_scale, &m_bias);
+
+	// Use the same pow() for every bound, rather than inverting the scale and bias, so the bounds are exact at the ends
+	m_sliceDepths.resize(sliceCount + 1u);
+	m_sliceDepths[0] = nearClip;
+	float logRange = std::log2(m_farSliceDepth / m_nearSliceDepth);
+	for (uint i = 1u; i < sliceCount; ++i) {
+		m_sliceDepths[i] = m_nearSliceDepth * std::exp2(logRange * static_cast<float>(i - 1u) / static_cast<float>(sliceCount - 1u));
+	}
+	m_sliceDepths[sliceCount] = farClip;
+}
+
+void ClusterDepthSlicing::CalculateScaleAndBias(float nearSliceDepth, float farSliceDepth, float *out_scale, float *out_bias) const {
+	if (m_sliceCount < 2u) {
+		// Everything is in slice 0
+		*out_scale = 0.0f;
+		*out_bias = 0.0f;
+		return;
+	}
+
+	// Slice 1 starts at nearSliceDepth, and slice m_sliceCount would start at farSliceDepth
+	*out_scale = static_cast<float>(m_sliceCount - 1u) / std::log2(farSliceDepth / nearSliceDepth);
+	*out_bias = 1.0f - std::log2(nearSliceDepth) * *out_scale;
+}
+
+uint ClusterDepthSlicing::GetHistogramBin(float depth) const {
+	float bin = std::log2(depth / m_nearClip) / std::log2(m_farClip / m_nearClip) * static_cast<float>(kHistogramBinCount);
+	return bin > 0.0f ? std::min(static_cast<uint>(bin), kHistogramBinCount - 1u) : 0u;
+}
+
+uint ClusterDepthSlicing::GetScreenRegion(float ndcX, float ndcY) {
+	return GetRegionCell(ndcY) * kScreenRegionCount + GetRegionCell(ndcX);
+}
+
+float ClusterDepthSlicing::GetRegionCoverage(const DepthInterval &light, uint x, uint y) {
+	// The regions are 2 / kScreenRegionCount NDC wide
+	float regionSize = 2.0f / static_cast<float>(kScreenRegionCount);
+	float regionMinX = static_cast<float>(x) * regionSize - 1.0f;
+	float regionMinY = static_cast<float>(y) * regionSize - 1.0f;
+
+	float width = std::min(light.NdcMaxX, regionMinX + regionSize) - std::max(light.NdcMinX, regionMinX);
+	float height = std::min(light.NdcMaxY, regionMinY + regionSize) - std::max(light.NdcMinY, regionMinY);
+	if (width <= 0.0f || height <= 0.0f) {
+		return 0.0f;
+	}
+
+	return (width * height) / (regionSize * regionSize);
+}
+
+bool ClusterDepthSlicing::AutoTune(const DepthSample *samples, uint sampleCount, const DepthInterval *lights, uint lightCount, float minImprovement) {
+	if (m_sliceCount < 2u || sampleCount == 0u) {
+		return false;
+	}
+
+	const uint regionCount = kScreenRegionCount * kScreenRegionCount;
+	const uint stride = kHistogramBinCount + 1u;
+
+	// Build the sample histograms, then turn them into running sums. The samples in bins [first, last]
+	// of a region are then m_samplesBelow[last + 1] - m_samplesBelow[first]
+	m_samplesBelow.assign(regionCount * stride, 0.0f);
+	m_totalSamples = 0.0f;
+	for (uint i = 0; i < sampleCount; ++i) {
+		if (samples[i].Depth >= m_nearClip && samples[i].Depth <= m_farClip) {
+			m_samplesBelow[GetScreenRegion(samples[i].NdcX, samples[i].NdcY) * stride + GetHistogramBin(samples[i].Depth) + 1u] += 1.0f;
+			m_totalSamples += 1.0f;
+		}
+	}
+	if (m_totalSamples == 0.0f) {
+		return false;
+	}
+
+	m_sampledRegions.clear();
+	for (uint region = 0; region < regionCount; ++region) {
+		float *samplesBelow = &m_samplesBelow[region * stride];
+		for (uint i = 1u; i <= kHistogramBinCount; ++i) {
+			samplesBelow[i] += samplesBelow[i - 1u];
+		}
+		if (samplesBelow[kHistogramBinCount] > 0.0f) {
+			m_sampledRegions.push_back(region);
+		}
+	}
+
+	// Count the lights by the bin they end in, and the bin they start in, then turn the counts into
+	// the running sums. The weight of the lights that reach bins [first, last] of a region is then
+	// total - m_weightEndingBelow[first] - m_weightStartingAbove[last]
+	m_weightEndingBelow.assign(regionCount * stride, 0.0f);
+	m_weightStartingAbove.assign(regionCount * stride, 0.0f);
+	for (uint i = 0; i < lightCount; ++i) {
+		const DepthInterval &light = lights[i];
+		if (light.Max < m_nearClip || light.Min > m_farClip || light.NdcMinX > light.NdcMaxX || light.NdcMinY > light.NdcMaxY) {
+			continue;
+		}
+
+		uint endBin = GetHistogramBin(light.Max) + 1u;
+		uint startBin = GetHistogramBin(light.Min);
+		for (uint y = GetRegionCell(light.NdcMinY); y <= GetRegionCell(light.NdcMaxY); ++y) {
+			for (uint x = GetRegionCell(light.NdcMinX); x <= GetRegionCell(light.NdcMaxX); ++x) {
+				uint region = y * kScreenRegionCount + x;
+				float weight = GetRegionCoverage(light, x, y);
+				m_weightEndingBelow[region * stride + endBin] += weight;
+				m_weightStartingAbove[region * stride + startBin] += weight;
+			}
+		}
+	}
+	for (auto iter = m_sampledRegions.begin(); iter != m_sampledRegions.end(); ++iter) {
+		float *endingBelow = &m_weightEndingBelow[*iter * stride];
+		for (uint i = 1u; i <= kHistogramBinCount; ++i) {
+			endingBelow[i] += endingBelow[i - 1u];
+		}
+
+		// startingAbove[i] currently holds the lights starting in bin i. Shift it to the lights starting past bin i
+		float *startingAbove = &m_weightStartingAbove[*iter * stride];
+		float weightAbove = 0.0f;
+		for (uint i = kHistogramBinCount; i-- > 0u;) {
+			float startingInBin = startingAbove[i];
+			startingAbove[i] = weightAbove;
+			weightAbove += startingInBin;
+		}
+		startingAbove[kHistogramBinCount] = 0.0f;
+	}
+
+	// Try the candidates. Both ends of the logarithmic slices are picked from the same set of depths,
+	// spaced logarithmically over the depth range
+	float bestCost = EstimateCost(m_nearSliceDepth, m_farSliceDepth);
+	float currentCost = bestCost;
+	float bestNear = m_nearSliceDepth;
+	float bestFar = m_farSliceDepth;
+
+	float depthRatio = m_farClip / m_nearClip;
+	for (uint i = 0; i < kAutoTuneCandidateCount; ++i) {
+		float nearSliceDepth = m_nearClip * std::pow(depthRatio, static_cast<float>(i) / static_cast<float>(kAutoTuneCandidateCount));
+		for (uint j = i + 1u; j <= kAutoTuneCandidateCount; ++j) {
+			float farSliceDepth = j == kAutoTuneCandidateCount ? m_farClip : m_nearClip * std::pow(depthRatio, static_cast<float>(j) / static_cast<float>(kAutoTuneCandidateCount));
+
+			float cost = EstimateCost(nearSliceDepth, farSliceDepth);
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestNear = nearSliceDepth;
+				bestFar = farSliceDepth;
+			}
+		}
+	}
+
+	if (bestCost >= currentCost * (1.0f - minImprovement)) {
+		return false;
+	}
+
+	SetLogarithmic(m_nearClip, m_farClip, m_sliceCount, bestNear, bestFar);
+	return true;
+}
+
+float ClusterDepthSlicing::EstimateCost(float nearSliceDepth, float farSliceDepth) const {
+	float scale;
+	float bias;
+	CalculateScaleAndBias(nearSliceDepth, farSliceDepth, &scale, &bias);
+
+	const uint stride = kHistogramBinCount + 1u;
+	float binDepthScale = std::log2(m_farClip / m_nearClip) / static_cast<float>(kHistogramBinCount);
+	float logNear = std::log2(m_nearClip);
+
+	// Each bin goes in the slice of its center. The bins of a slice are contiguous, so walk the bins,
+	// and add up each run of bins in the same slice, in each region
+	float cost = 0.0f;
+	uint runStart = 0u;
+	uint runSlice = 0u;
+	for (uint bin = 0; bin <= kHistogramBinCount; ++bin) {
+		uint slice = m_sliceCount;
+		if (bin < kHistogramBinCount) {
+			float sliceValue = (logNear + (static_cast<float>(bin) + 0.5f) * binDepthScale) * scale + bias;
+			slice = sliceValue > 0.0f ? std::min(static_cast<uint>(sliceValue), m_sliceCount - 1u) : 0u;
+		}
+
+		if (bin > 0u && slice != runSlice) {
+			for (auto iter = m_sampledRegions.begin(); iter != m_sampledRegions.end(); ++iter) {
+				const float *samplesBelow = &m_samplesBelow[*iter * stride];
+				float runPixels = samplesBelow[bin] - samplesBelow[runStart];
+				if (runPixels > 0.0f) {
+					const float *endingBelow = &m_weightEndingBelow[*iter * stride];
+					float lightWeight = endingBelow[kHistogramBinCount] - endingBelow[runStart] - m_weightStartingAbove[*iter * stride + bin - 1u];
+					cost += runPixels * lightWeight;
+				}
+			}
+
+			runStart = bin;
+		}
+
+		runSlice = slice;
+	}
+
+	return cost / m_totalSamples;
+}
+
+float ClusterDepthSlicing::CalculateCost(const DepthSample *samples, uint sampleCount, const DepthInterval *lights, uint lightCount) const {
+	const uint regionCount = kScreenRegionCount * kScreenRegionCount;
+	std::vector<float> slicePixels(regionCount * m_sliceCount, 0.0f);
+	std::vector<float> sliceWeightDeltas(regionCount * (m_sliceCount + 1u), 0.0f);
+
+	float totalPixels = 0.0f;
+	for (uint i = 0; i < sampleCount; ++i) {
+		if (samples[i].Depth >= m_nearClip && samples[i].Depth <= m_farClip) {
+			slicePixels[GetScreenRegion(samples[i].NdcX, samples[i].NdcY) * m_sliceCount + GetSlice(samples[i].Depth)] += 1.0f;
+			totalPixels += 1.0f;
+		}
+	}
+
+	for (uint i = 0; i < lightCount; ++i) {
+		const DepthInterval &light = lights[i];
+		if (light.Max < m_nearClip || light.Min > m_farClip || light.NdcMinX > light.NdcMaxX || light.NdcMinY > light.NdcMaxY) {
+			continue;
+		}
+
+		uint firstSlice = GetSlice(std::max(light.Min, m_nearClip));
+		uint lastSlice = GetSlice(light.Max);
+		for (uint y = GetRegionCell(light.NdcMinY); y <= GetRegionCell(light.NdcMaxY); ++y) {
+			for (uint x = GetRegionCell(light.NdcMinX); x <= GetRegionCell(light.NdcMaxX); ++x) {
+				uint region = y * kScreenRegionCount + x;
+				float weight = GetRegionCoverage(light, x, y);
+				sliceWeightDeltas[region * (m_sliceCount + 1u) + firstSlice] += weight;
+				sliceWeightDeltas[region * (m_sliceCount + 1u) + lastSlice + 1u] -= weight;
+			}
+		}
+	}
+
+	float cost = 0.0f;
+	for (uint region = 0; region < regionCount; ++region) {
+		float sliceWeight = 0.0f;
+		for (uint i = 0; i < m_sliceCount; ++i) {
+			sliceWeight += sliceWeightDeltas[region * (m_sliceCount + 1u) + i];
+			cost += slicePixels[region * m_sliceCount + i] * sliceWeight;
+		}
+	}
+
+	return totalPixels > 0.0f ? cost / totalPixels : 0.0f;
+}
+
+void ClusterDepthSlicing::CalculateLightIntervals(DirectX::CXMMATRIX view, DirectX::CXMMATRIX projection, const ShaderPointLight *pointLights, uint pointLightCount,
+                                                  const ShaderSpotLight *spotLights, uint spotLightCount, uint clusterCountX, uint clusterCountY, std::vector<DepthInterval> *out_intervals) const {
+	DirectX::XMFLOAT4X4 projMatrix;
+	DirectX::XMStoreFloat4x4(&projMatrix, projection);
+
+	// Half the screen, in tiles
+	float halfTilesX = 0.5f * static_cast<float>(clusterCountX);
+	float halfTilesY = 0.5f * static_cast<float>(clusterCountY);
+
+	out_intervals->resize(pointLightCount + spotLightCount);
+	for (uint i = 0; i < pointLightCount + spotLightCount; ++i) {
+		const DirectX::XMFLOAT3 &position = i < pointLightCount ? pointLights[i].Position : spotLights[i - pointLightCount].Position;
+		float range = i < pointLightCount ? pointLights[i].Range : spotLights[i - pointLightCount].Range;
+
+		DirectX::XMFLOAT3 center;
+		DirectX::XMStoreFloat3(&center, DirectX::XMVector3TransformCoord(DirectX::XMLoadFloat3(&position), view));
+
+		DepthInterval &interval = (*out_intervals)[i];
+		interval.Min = center.z - range;
+		interval.Max = center.z + range;
+		interval.NdcMinX = 1.0f;
+		interval.NdcMaxX = -1.0f;
+		interval.NdcMinY = 1.0f;
+		interval.NdcMaxY = -1.0f;
+
+		// Only the part of the sphere past the near plane can be seen
+		float nearDepth = std::max(interval.Min, m_nearClip);
+		float farDepth = interval.Max;
+		if (farDepth <= nearDepth) {
+			continue;
+		}
+
+		// The extremes of x / z and y / z over the bounding box of the visible part of the sphere
+		float lowX = center.x - range;
+		float highX = center.x + range;
+		float lowY = center.y - range;
+		float highY = center.y + range;
+		float minX = std::max(lowX / (lowX < 0.0f ? nearDepth : farDepth) * projMatrix.m[0][0], -1.0f);
+		float maxX = std::min(highX / (highX > 0.0f ? nearDepth : farDepth) * projMatrix.m[0][0], 1.0f);
+		float minY = std::max(lowY / (lowY < 0.0f ? nearDepth : farDepth) * projMatrix.m[1][1], -1.0f);
+		float maxY = std::min(highY / (highY > 0.0f ? nearDepth : farDepth) * projMatrix.m[1][1], 1.0f);
+		if (minX > maxX || minY > maxY) {
+			continue;
+		}
+
+		// Small lights still cover whole tiles
+		interval.NdcMinX = std::floor((minX + 1.0f) * halfTilesX) / halfTilesX - 1.0f;
+		interval.NdcMaxX = std::min(std::floor((maxX + 1.0f) * halfTilesX + 1.0f) / halfTilesX - 1.0f, 1.0f);
+		interval.NdcMinY = std::floor((minY + 1.0f) * halfTilesY) / halfTilesY - 1.0f;
+		interval.NdcMaxY = std::min(std::floor((maxY + 1.0f) * halfTilesY + 1.0f) / halfTilesY - 1.0f, 1.0f);
+	}
+}
+
+} // End of namespace Scene
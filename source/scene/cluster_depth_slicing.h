@@ -0,0 +1,179 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "common/typedefs.h"
+
+#include <DirectXMath.h>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+
+namespace Scene {
+
+struct ShaderPointLight;
+struct ShaderSpotLight;
+
+/** The view depth of a visible surface, and where it is on screen */
+struct DepthSample {
+	float NdcX;
+	float NdcY;
+	float Depth;
+};
+
+/** The range of view depths a light reaches, and the part of the screen it covers */
+struct DepthInterval {
+	float Min;
+	float Max;
+	/** The NDC bounds of the light, rounded out to whole tiles. NdcMinX > NdcMaxX if the light is off screen */
+	float NdcMinX;
+	float NdcMinY;
+	float NdcMaxX;
+	float NdcMaxY;
+};
+
+/**
+ * Splits the view depth range of a camera into the depth slices of a cluster grid
+ *
+ * Slice 0 covers [nearClip, nearSliceDepth]. Slicing logarithmically all the way to the near plane
+ * wastes most of the slices on the few units in front of the camera, so the first slice is clamped to
+ * cover all of them. Slices 1 to sliceCount - 1 are logarithmic between nearSliceDepth and
+ * farSliceDepth, and anything past farSliceDepth is clamped into the last slice. That makes the slice
+ * of a depth
+ *
+ *     min(max(log2(depth) * scale + bias, 0), sliceCount - 1)
+ *
+ * which is cheap enough for a shader. GetScale() and GetBias() give the constants, and GetSliceDepths()
+ * gives the matching depth bounds of each slice, for building the clusters.
+ *
+ * AutoTune() moves nearSliceDepth and farSliceDepth to where the lights and the visible surfaces
+ * actually are. The cost it minimizes is the average number of lights in the cluster of a pixel.
+ * Lights and surfaces are far from evenly spread over the screen, so the screen is split into
+ * kScreenRegionCount x kScreenRegionCount regions. In each region and slice, the cost is the number
+ * of pixels in the slice times the fraction of the region covered by each light that reaches into
+ * it. It's estimated from per region histograms of the depths, so it's cheap enough to run every frame.
+ */
+class ClusterDepthSlicing {
+public:
+	ClusterDepthSlicing();
+
+	/** The number of bins of the log depth histograms used by AutoTune() */
+	static const uint kHistogramBinCount = 512u;
+	/** The number of depths tried for nearSliceDepth, and for farSliceDepth, by AutoTune() */
+	static const uint kAutoTuneCandidateCount = 32u;
+	/** The number of columns, and of rows, of screen regions that AutoTune() keeps separate histograms for */
+	static const uint kScreenRegionCount = 8u;
+
+private:
+	float m_nearClip;
+	float m_farClip;
+	uint m_sliceCount;
+	float m_nearSliceDepth;
+	float m_farSliceDepth;
+
+	float m_scale;
+	float m_bias;
+	/** The m_sliceCount + 1 depths between the slices */
+	std::vector<float> m_sliceDepths;
+
+	// AutoTune() scratch memory. Each region has kHistogramBinCount + 1 entries in each of the histograms
+	/** Entry i is the number of samples in a bin below i */
+	std::vector<float> m_samplesBelow;
+	/** Entry i is the total weight of the lights whose Max is in a bin below i */
+	std::vector<float> m_weightEndingBelow;
+	/** Entry i is the total weight of the lights whose Min is in a bin above i */
+	std::vector<float> m_weightStartingAbove;
+	/** The regions with at least one sample in them */
+	std::vector<uint> m_sampledRegions;
+	float m_totalSamples;
+
+public:
+	/**
+	 * Sets up logarithmic slicing
+	 *
+	 * @param nearClip          The distance to the near plane of the camera
+	 * @param farClip           The distance to the far plane of the camera
+	 * @param sliceCount        The number of slices
+	 * @param nearSliceDepth    The far end of slice 0. Clamped to [nearClip, farClip]
+	 * @param farSliceDepth     [Optional] Where the logarithmic slices end. Depths past it are all in the last slice. If 0, the far plane is used
+	 */
+	void SetLogarithmic(float nearClip, float farClip, uint sliceCount, float nearSliceDepth, float farSliceDepth = 0.0f);
+
+	/**
+	 * Chooses nearSliceDepth and farSliceDepth to minimize the average number of lights per pixel's cluster.
+	 * The near and far plane and the slice count stay the same
+	 *
+	 * @param samples           Samples of the visible surfaces
+	 * @param sampleCount       The number of samples
+	 * @param lights            The depth ranges and screen bounds of the lights
+	 * @param lightCount        The number of lights
+	 * @param minImprovement    [Optional] The slicing only changes if the estimated cost drops by more than this fraction. Keeps the slicing from flickering between similar choices
+	 * @return                  True if the slicing changed
+	 */
+	bool AutoTune(const DepthSample *samples, uint sampleCount, const DepthInterval *lights, uint lightCount, float minImprovement = 0.05f);
+
+	/**
+	 * Calculates the average number of lights in the cluster of a sample, with the current slicing,
+	 * assuming every light covers an even share of each screen region it overlaps, in each slice it
+	 * reaches. This is the cost AutoTune() minimizes, calculated exactly instead of from histograms
+	 */
+	float CalculateCost(const DepthSample *samples, uint sampleCount, const DepthInterval *lights, uint lightCount) const;
+
+	/**
+	 * Calculates the depth ranges and screen bounds of lights, for AutoTune(). Spot lights use the sphere
+	 * around their apex. The screen bounds are the bounding box of the part of the sphere past the near
+	 * plane, so lights beside the camera only cover the side of the screen they are on
+	 *
+	 * @param view               The view matrix
+	 * @param projection         The projection matrix
+	 * @param pointLights        The point lights
+	 * @param pointLightCount    The number of point lights
+	 * @param spotLights         The spot lights
+	 * @param spotLightCount     The number of spot lights
+	 * @param clusterCountX      The number of columns of tiles
+	 * @param clusterCountY      The number of rows of tiles
+	 * @param out_intervals      Will be filled with the point lights' intervals, followed by the spot lights'
+	 */
+	void CalculateLightIntervals(DirectX::CXMMATRIX view, DirectX::CXMMATRIX projection, const ShaderPointLight *pointLights, uint pointLightCount,
+	                             const ShaderSpotLight *spotLights, uint spotLightCount, uint clusterCountX, uint clusterCountY, std::vector<DepthInterval> *out_intervals) const;
+
+	inline uint GetSliceCount() const { return m_sliceCount; }
+	inline float GetNearSliceDepth() const { return m_nearSliceDepth; }
+	inline float GetFarSliceDepth() const { return m_farSliceDepth; }
+	inline float GetScale() const { return m_scale; }
+	inline float GetBias() const { return m_bias; }
+	/** The sliceCount + 1 depths between the slices. Slice i covers [depths[i], depths[i + 1]] */
+	inline const float *GetSliceDepths() const { return &m_sliceDepths.front(); }
+	inline float GetSliceDepth(uint i) const { return m_sliceDepths[i]; }
+
+	/** Returns the slice of a view depth, the same way the shaders calculate it */
+	inline uint GetSlice(float depth) const {
+		float slice = std::log2(depth) * m_scale + m_bias;
+		return slice > 0.0f ? std::min(static_cast<uint>(slice), m_sliceCount - 1u) : 0u;
+	}
+
+private:
+	/** Calculates the scale and bias of logarithmic slicing between nearSliceDepth and farSliceDepth */
+	void CalculateScaleAndBias(float nearSliceDepth, float farSliceDepth, float *out_scale, float *out_bias) const;
+	/** Estimates the cost of a slicing from the histograms filled by AutoTune() */
+	float EstimateCost(float nearSliceDepth, float farSliceDepth) const;
+	/** Returns the histogram bin of a depth */
+	uint GetHistogramBin(float depth) const;
+	/** Returns the screen region of a sample */
+	static uint GetScreenRegion(float ndcX, float ndcY);
+	/** Returns the fraction of screen region (x, y) that a light covers */
+	static float GetRegionCoverage(const DepthInterval &light, uint x, uint y);
+	/** Returns the column, or row, of screen regions that an NDC coordinate is in */
+	static inline uint GetRegionCell(float ndc) {
+		float cell = (ndc * 0.5f + 0.5f) * static_cast<float>(kScreenRegionCount);
+		return cell > 0.0f ? std::min(static_cast<uint>(cell), kScreenRegionCount - 1u) : 0u;
+	}
+};
+
+} // End of namespace Scene
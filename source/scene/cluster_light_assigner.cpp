@@ -0,0 +1,455 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "scene/cluster_light_assigner.h"
+
+#include "common/halfling_sys.h"
+#include "common/thread_pool.h"
+
+#include "scene/frustum_culler.h"
+#include "scene/light_bvh.h"
+#include "scene/lights.h"
+
+#include <algorithm>
+#include <cmath>
+
+
+namespace Scene {
+
+namespace {
+
+const uint kSpotLightBit = 0x80000000u;
+
+inline float PlaneDistance(const DirectX::XMFLOAT4 &plane, const DirectX::XMFLOAT3 &point) {
+	return plane.x * point.x + plane.y * point.y + plane.z * point.z + plane.w;
+}
+
+/**
+ * Moves a sphere onto a plane, and shrinks it to the circle where the two intersect. If the center
+ * is on the other side of the plane from a region, the part of the sphere inside the region is
+ * inside the new sphere
+ */
+inline void ProjectSphereToPlane(const DirectX::XMFLOAT4 &plane, DirectX::XMFLOAT3 *center, float *radius) {
+	float distance = PlaneDistance(plane, *center);
+	center->x -= plane.x * distance;
+	center->y -= plane.y * distance;
+	center->z -= plane.z * distance;
+	*radius = std::sqrt(std::max(*radius * *radius - distance * distance, 0.0f));
+}
+
+/**
+ * Returns how many of the leading planes are more than 'threshold' below the point. IE. the point is on the
+ * positive side of them. The planes have to be ordered so that these planes are a prefix of the array
+ */
+inline uint CountPlanesBelow(const DirectX::XMFLOAT4 *planes, uint planeCount, const DirectX::XMFLOAT3 &point, float threshold) {
+	uint low = 0u;
+	uint high = planeCount;
+	while (low < high) {
+		uint middle = (low + high) / 2u;
+		if (PlaneDistance(planes[middle], point) > threshold) {
+			low = middle + 1u;
+		} else {
+			high = middle;
+		}
+	}
+
+	return low;
+}
+
+/**
+ * Finds the cells that a sphere touches, out of [firstCell, lastCell]. Cell i is between plane i and
+ * plane i + 1, and is on the positive side of plane i and the negative side of plane i + 1
+ *
+ * The planes all go through the camera, and are sorted, and the cells are only ever in front of the
+ * camera. In front of the camera, a point that is past plane i is past every plane before it, so
+ * the planes the sphere is past are a prefix, and can be binary searched. If the sphere reaches behind
+ * the camera, the tests against the planes aren't a clean prefix anymore. But the search still only
+ * ever skips a cell if the sphere is completely past one of its planes, so the range is conservative
+ *
+ * @return    False if the sphere doesn't touch any of the cells
+ */
+bool FindCellRange(const std::vector<DirectX::XMFLOAT4> &planes, uint firstCell, uint lastCell, const DirectX::XMFLOAT3 &center, float radius, uint *out_first, uint *out_last) {
+	uint planeCount = lastCell - firstCell + 2u;
+	uint planesPast = CountPlanesBelow(&planes[firstCell], planeCount, center, radius);
+	uint planesReached = CountPlanesBelow(&planes[firstCell], planeCount, center, -radius);
+
+	*out_first = firstCell + (planesPast > 0u ? planesPast - 1u : 0u);
+	if (planesReached == 0u || *out_first > lastCell) {
+		return false;
+	}
+	*out_last = std::min(firstCell + planesReached - 1u, lastCell);
+
+	return *out_first <= *out_last;
+}
+
+} // End of anonymous namespace
+
+
+ClusterLightAssigner::ClusterLightAssigner()
+		: m_clusterCountX(0u),
+		  m_clusterCountY(0u),
+		  m_sliceCount(0u),
+		  m_tileScaleX(0.0f),
+		  m_tileBiasX(0.0f),
+		  m_tileScaleY(0.0f),
+		  m_tileBiasY(0.0f),
+		  m_binnedLightCount(0u) {
+}
+
+void ClusterLightAssigner::SetGrid(DirectX::CXMMATRIX projection, uint screenWidth, uint screenHeight, uint tileSize, const float *sliceDepths, uint sliceCount) {
+	AssertMsg(sliceCount > 0u && sliceDepths[0] > 0.0f, "The grid needs at least one slice, in front of the camera");
+
+	m_clusterCountX = (screenWidth + tileSize - 1u) / tileSize;
+	m_clusterCountY = (screenHeight + tileSize - 1u) / tileSize;
+	m_sliceCount = sliceCount;
+
+	DirectX::XMFLOAT4X4 proj;
+	DirectX::XMStoreFloat4x4(&proj, projection);
+
+	// A point is on tile boundary i if its clip space x / w is (2 * i * tileSize / screenWidth) - 1.
+	// For a symmetric projection, that's (view x / view z) * proj._11
+	m_planesX.resize(m_clusterCountX + 1u);
+	m_slopesX.resize(m_clusterCountX + 1u);
+	for (uint i = 0; i <= m_clusterCountX; ++i) {
+		float ndc = 2.0f * float(i * tileSize) / float(screenWidth) - 1.0f;
+		float slope = ndc / proj.m[0][0];
+		float invLength = 1.0f / std::sqrt(1.0f + slope * slope);
+
+		m_slopesX[i] = slope;
+		m_planesX[i] = DirectX::XMFLOAT4(invLength, 0.0f, -slope * invLength, 0.0f);
+	}
+
+	// Rows go down the screen, so the slopes decrease
+	m_planesY.resize(m_clusterCountY + 1u);
+	m_slopesY.resize(m_clusterCountY + 1u);
+	for (uint i = 0; i <= m_clusterCountY; ++i) {
+		float ndc = 1.0f - 2.0f * float(i * tileSize) / float(screenHeight);
+		float slope = ndc / proj.m[1][1];
+		float invLength = 1.0f / std::sqrt(1.0f + slope * slope);
+
+		m_slopesY[i] = slope;
+		m_planesY[i] = DirectX::XMFLOAT4(0.0f, -invLength, slope * invLength, 0.0f);
+	}
+
+	// Tile = (x / z) * scale + bias. Rows go down the screen, so their scale is negative
+	m_tileScaleX = proj.m[0][0] * 0.5f * float(screenWidth) / float(tileSize);
+	m_tileBiasX = 0.5f * float(screenWidth) / float(tileSize);
+	m_tileScaleY = -proj.m[1][1] * 0.5f * float(screenHeight) / float(tileSize);
+	m_tileBiasY = 0.5f * float(screenHeight) / float(tileSize);
+
+	m_sliceDepths.assign(sliceDepths, sliceDepths + sliceCount + 1u);
+}
+
+bool ClusterLightAssigner::FindScreenRange(const DirectX::XMFLOAT3 &center, float radius, uint *out_firstColumn, uint *out_lastColumn, uint *out_firstRow, uint *out_lastRow) const {
+	*out_firstColumn = 0u;
+	*out_lastColumn = m_clusterCountX - 1u;
+	*out_firstRow = 0u;
+	*out_lastRow = m_clusterCountY - 1u;
+
+	// Spheres that reach behind the camera can cover any tile
+	float nearDepth = center.z - radius;
+	float farDepth = center.z + radius;
+	if (nearDepth <= 0.0f) {
+		return true;
+	}
+
+	// The extremes of x / z and y / z over the bounding box of the sphere, in tiles. Padded a little,
+	// so tiles that the sphere only just touches aren't lost to rounding
+	float lowX = center.x - radius;
+	float highX = center.x + radius;
+	float lowY = center.y - radius;
+	float highY = center.y + radius;
+	float left = (lowX / (lowX < 0.0f ? nearDepth : farDepth)) * m_tileScaleX + m_tileBiasX - 0.01f;
+	float right = (highX / (highX > 0.0f ? nearDepth : farDepth)) * m_tileScaleX + m_tileBiasX + 0.01f;
+	float top = (highY / (highY > 0.0f ? nearDepth : farDepth)) * m_tileScaleY + m_tileBiasY - 0.01f;
+	float bottom = (lowY / (lowY < 0.0f ? nearDepth : farDepth)) * m_tileScaleY + m_tileBiasY + 0.01f;
+	if (right < 0.0f || left >= float(m_clusterCountX) || bottom < 0.0f || top >= float(m_clusterCountY)) {
+		return false;
+	}
+
+	*out_firstColumn = left > 0.0f ? static_cast<uint>(left) : 0u;
+	*out_lastColumn = std::min(static_cast<uint>(right), m_clusterCountX - 1u);
+	*out_firstRow = top > 0.0f ? static_cast<uint>(top) : 0u;
+	*out_lastRow = std::min(static_cast<uint>(bottom), m_clusterCountY - 1u);
+
+	return true;
+}
+
+uint ClusterLightAssigner::GetSlice(float depth) const {
+	uint slice = static_cast<uint>(std::upper_bound(m_sliceDepths.begin(), m_sliceDepths.end(), depth) - m_sliceDepths.begin());
+
+	return slice == 0u ? 0u : std::min(slice - 1u, m_sliceCount - 1u);
+}
+
+float ClusterLightAssigner::GetClusterBoundingSphere(uint x, uint y, uint slice, DirectX::XMFLOAT3 *out_center) const {
+	float nearDepth = m_sliceDepths[slice];
+	float farDepth = m_sliceDepths[slice + 1u];
+
+	// The sides of the cluster are planes through the camera, so its extremes are on the near or far plane
+	float minX = std::min(m_slopesX[x] * nearDepth, m_slopesX[x] * farDepth);
+	float maxX = std::max(m_slopesX[x + 1u] * nearDepth, m_slopesX[x + 1u] * farDepth);
+	float minY = std::min(m_slopesY[y + 1u] * nearDepth, m_slopesY[y + 1u] * farDepth);
+	float maxY = std::max(m_slopesY[y] * nearDepth, m_slopesY[y] * farDepth);
+
+	*out_center = DirectX::XMFLOAT3((minX + maxX) * 0.5f, (minY + maxY) * 0.5f, (nearDepth + farDepth) * 0.5f);
+
+	float extentX = (maxX - minX) * 0.5f;
+	float extentY = (maxY - minY) * 0.5f;
+	float extentZ = (farDepth - nearDepth) * 0.5f;
+	return std::sqrt(extentX * extentX + extentY * extentY + extentZ * extentZ);
+}
+
+uint ClusterLightAssigner::AssignLights(DirectX::CXMMATRIX view, const ShaderPointLight *pointLights, uint pointLightCount, const ShaderSpotLight *spotLights, uint spotLightCount, Common::ThreadPool *threadPool,
+                                        const LightBVH *pointLightBVH, const LightBVH *spotLightBVH) {
+	const uint *lightList = nullptr;
+	uint lightCount = pointLightCount + spotLightCount;
+	if (pointLightBVH != nullptr || spotLightBVH != nullptr) {
+		CullLights(view, pointLightCount, spotLightCount, pointLightBVH, spotLightBVH);
+		lightList = m_visibleLights.empty() ? nullptr : &m_visibleLights.front();
+		lightCount = static_cast<uint>(m_visibleLights.size());
+	}
+	m_binnedLightCount = lightCount;
+
+	uint chunkCount = (lightCount + kChunkSize - 1u) / kChunkSize;
+	if (m_chunkLists.size() < chunkCount) {
+		m_chunkLists.resize(chunkCount);
+	}
+
+	// Each chunk of lights writes its own list of pairs
+	if (threadPool != nullptr && chunkCount > 1u) {
+		threadPool->ParallelFor(lightCount, kChunkSize, [&](uint begin, uint end) {
+			AssignRange(view, pointLights, pointLightCount, spotLights, lightList, begin, end, &m_chunkLists[begin / kChunkSize]);
+		});
+	} else {
+		for (uint begin = 0; begin < lightCount; begin += kChunkSize) {
+			AssignRange(view, pointLights, pointLightCount, spotLights, lightList, begin, std::min(begin + kChunkSize, lightCount), &m_chunkLists[begin / kChunkSize]);
+		}
+	}
+
+	// Count the lights in each cluster
+	ClusterLightRange empty = {0u, 0u, 0u};
+	m_clusterRanges.assign(GetClusterCount(), empty);
+	for (uint i = 0; i < chunkCount; ++i) {
+		const std::vector<ClusterLight> &list = m_chunkLists[i];
+		for (auto iter = list.begin(); iter != list.end(); ++iter) {
+			if ((iter->Light & kSpotLightBit) != 0u) {
+				++m_clusterRanges[iter->Cluster].SpotLightCount;
+			} else {
+				++m_clusterRanges[iter->Cluster].PointLightCount;
+			}
+		}
+	}
+
+	// Give each cluster its range of the index list. The point light counts are rebuilt by the scatter
+	m_spotCursors.resize(m_clusterRanges.size());
+	uint indexCount = 0u;
+	for (uint i = 0; i < m_clusterRanges.size(); ++i) {
+		ClusterLightRange &range = m_clusterRanges[i];
+		range.Offset = indexCount;
+		m_spotCursors[i] = indexCount + range.PointLightCount;
+		indexCount += range.PointLightCount + range.SpotLightCount;
+		range.PointLightCount = 0u;
+	}
+
+	// The chunks are in light order, so the lights of each cluster end up sorted
+	m_lightIndices.resize(indexCount);
+	for (uint i = 0; i < chunkCount; ++i) {
+		const std::vector<ClusterLight> &list = m_chunkLists[i];
+		for (auto iter = list.begin(); iter != list.end(); ++iter) {
+			if ((iter->Light & kSpotLightBit) != 0u) {
+				m_lightIndices[m_spotCursors[iter->Cluster]++] = iter->Light & ~kSpotLightBit;
+			} else {
+				ClusterLightRange &range = m_clusterRanges[iter->Cluster];
+				m_lightIndices[range.Offset + range.PointLightCount++] = iter->Light;
+			}
+		}
+	}
+
+	return indexCount;
+}
+
+void ClusterLightAssigner::CullLights(DirectX::CXMMATRIX view, uint pointLightCount, uint spotLightCount, const LightBVH *pointLightBVH, const LightBVH *spotLightBVH) {
+	// The frustum of the whole grid, in view space. The slices are already clipped to the near and far depths
+	// of the grid, so those are the near and far planes
+	DirectX::XMFLOAT4 right = m_planesX[m_clusterCountX];
+	DirectX::XMFLOAT4 bottom = m_planesY[m_clusterCountY];
+	DirectX::XMFLOAT4 viewPlanes[6] = {
+		m_planesX[0],
+		DirectX::XMFLOAT4(-right.x, -right.y, -right.z, -right.w),
+		m_planesY[0],
+		DirectX::XMFLOAT4(-bottom.x, -bottom.y, -bottom.z, -bottom.w),
+		DirectX::XMFLOAT4(0.0f, 0.0f, 1.0f, -m_sliceDepths.front()),
+		DirectX::XMFLOAT4(0.0f, 0.0f, -1.0f, m_sliceDepths.back())
+	};
+
+	// Take the planes back to the space the lights are in. A plane transforms by the inverse transpose,
+	// so going backwards is the transpose. The binning is padded against rounding, so the planes are too
+	DirectX::XMMATRIX viewTranspose = DirectX::XMMatrixTranspose(view);
+	float margin = m_sliceDepths.back() * 1.0e-4f;
+	Frustum frustum;
+	for (uint i = 0; i < 6u; ++i) {
+		DirectX::XMVECTOR plane = DirectX::XMPlaneNormalize(DirectX::XMPlaneTransform(DirectX::XMLoadFloat4(&viewPlanes[i]), viewTranspose));
+		DirectX::XMStoreFloat4(&frustum.Planes[i], plane);
+		frustum.Planes[i].w += margin;
+	}
+
+	m_visibleLights.clear();
+	if (pointLightBVH != nullptr) {
+		AssertMsg(pointLightBVH->GetLightCount() == pointLightCount, "The BVH has to be built from the same lights");
+		pointLightBVH->Cull(frustum, &m_visibleLights);
+	} else {
+		for (uint i = 0; i < pointLightCount; ++i) {
+			m_visibleLights.push_back(i);
+		}
+	}
+
+	if (spotLightBVH != nullptr) {
+		AssertMsg(spotLightBVH->GetLightCount() == spotLightCount, "The BVH has to be built from the same lights");
+		spotLightBVH->Cull(frustum, &m_visibleSpotLights);
+		for (auto iter = m_visibleSpotLights.begin(); iter != m_visibleSpotLights.end(); ++iter) {
+			m_visibleLights.push_back(pointLightCount + *iter);
+		}
+	} else {
+		for (uint i = 0; i < spotLightCount; ++i) {
+			m_visibleLights.push_back(pointLightCount + i);
+		}
+	}
+}
+
+void ClusterLightAssigner::AssignRange(DirectX::CXMMATRIX view, const ShaderPointLight *pointLights, uint pointLightCount, const ShaderSpotLight *spotLights,
+                                       const uint *lightList, uint begin, uint end, std::vector<ClusterLight> *out_list) const {
+	out_list->clear();
+
+	for (uint entry = begin; entry < end; ++entry) {
+		uint i = lightList != nullptr ? lightList[entry] : entry;
+		if (i < pointLightCount) {
+			const ShaderPointLight &light = pointLights[i];
+
+			DirectX::XMFLOAT3 center;
+			DirectX::XMStoreFloat3(&center, DirectX::XMVector3TransformCoord(DirectX::XMLoadFloat3(&light.Position), view));
+
+			AssignSphere(center, light.Range, i, nullptr, out_list);
+		} else {
+			uint spotIndex = i - pointLightCount;
+			const ShaderSpotLight &light = spotLights[spotIndex];
+
+			SpotCone cone;
+			DirectX::XMStoreFloat3(&cone.Apex, DirectX::XMVector3TransformCoord(DirectX::XMLoadFloat3(&light.Position), view));
+			DirectX::XMStoreFloat3(&cone.Direction, DirectX::XMVector3Normalize(DirectX::XMVector3TransformNormal(DirectX::XMLoadFloat3(&light.Direction), view)));
+			cone.Range = light.Range;
+			cone.CosAngle = light.CosOuterConeAngle;
+			cone.SinAngle = std::sqrt(std::max(1.0f - cone.CosAngle * cone.CosAngle, 0.0f));
+
+			// The bounding sphere of the cone, capped by the range. Narrow cones are bounded by the sphere through
+			// the apex and the rim of the cap, wide ones by the sphere around the rim
+			DirectX::XMFLOAT3 center = cone.Apex;
+			float radius = cone.Range;
+			if (cone.CosAngle >= 0.70710678f) {
+				radius = cone.Range / (2.0f * cone.CosAngle);
+			} else if (cone.CosAngle > 0.0f) {
+				radius = cone.Range * cone.SinAngle;
+			}
+			if (cone.CosAngle > 0.0f) {
+				float distance = cone.CosAngle >= 0.70710678f ? radius : cone.Range * cone.CosAngle;
+				center.x += cone.Direction.x * distance;
+				center.y += cone.Direction.y * distance;
+				center.z += cone.Direction.z * distance;
+			}
+
+			AssignSphere(center, radius, spotIndex | kSpotLightBit, cone.CosAngle > 0.0f ? &cone : nullptr, out_list);
+		}
+	}
+}
+
+void ClusterLightAssigner::AssignSphere(const DirectX::XMFLOAT3 &center, float radius, uint light, const SpotCone *cone, std::vector<ClusterLight> *out_list) const {
+	float gridNear = m_sliceDepths.front();
+	float gridFar = m_sliceDepths.back();
+	if (center.z + radius <= gridNear || center.z - radius >= gridFar) {
+		return;
+	}
+
+	// Most lights only cover a few tiles. Finding them up front keeps the searches below short
+	uint lightFirstRow;
+	uint lightLastRow;
+	uint lightFirstColumn;
+	uint lightLastColumn;
+	if (!FindScreenRange(center, radius, &lightFirstColumn, &lightLastColumn, &lightFirstRow, &lightLastRow)) {
+		return;
+	}
+
+	uint firstSlice = GetSlice(std::max(center.z - radius, gridNear));
+	uint lastSlice = GetSlice(std::min(center.z + radius, gridFar));
+
+	for (uint slice = firstSlice; slice <= lastSlice; ++slice) {
+		// Outside of the slice the center is in, only the cross section on the nearest slice plane matters
+		DirectX::XMFLOAT3 sliceCenter = center;
+		float sliceRadius = radius;
+		if (center.z < m_sliceDepths[slice]) {
+			ProjectSphereToPlane(DirectX::XMFLOAT4(0.0f, 0.0f, 1.0f, -m_sliceDepths[slice]), &sliceCenter, &sliceRadius);
+		} else if (center.z > m_sliceDepths[slice + 1u]) {
+			ProjectSphereToPlane(DirectX::XMFLOAT4(0.0f, 0.0f, 1.0f, -m_sliceDepths[slice + 1u]), &sliceCenter, &sliceRadius);
+		}
+
+		uint firstRow;
+		uint lastRow;
+		uint sliceFirstColumn;
+		uint sliceLastColumn;
+		if (!FindCellRange(m_planesY, lightFirstRow, lightLastRow, sliceCenter, sliceRadius, &firstRow, &lastRow) ||
+		    !FindCellRange(m_planesX, lightFirstColumn, lightLastColumn, sliceCenter, sliceRadius, &sliceFirstColumn, &sliceLastColumn)) {
+			continue;
+		}
+
+		for (uint y = firstRow; y <= lastRow; ++y) {
+			uint firstColumn = sliceFirstColumn;
+			uint lastColumn = sliceLastColumn;
+
+			// Same again for the rows. Row y is below plane y, and above plane y + 1
+			if (firstColumn != lastColumn) {
+				DirectX::XMFLOAT3 rowCenter = sliceCenter;
+				float rowRadius = sliceRadius;
+				if (PlaneDistance(m_planesY[y], sliceCenter) < 0.0f) {
+					ProjectSphereToPlane(m_planesY[y], &rowCenter, &rowRadius);
+				} else if (PlaneDistance(m_planesY[y + 1u], sliceCenter) > 0.0f) {
+					ProjectSphereToPlane(m_planesY[y + 1u], &rowCenter, &rowRadius);
+				}
+
+				if (!FindCellRange(m_planesX, sliceFirstColumn, sliceLastColumn, rowCenter, rowRadius, &firstColumn, &lastColumn)) {
+					continue;
+				}
+			}
+
+			uint baseCluster = GetClusterIndex(0u, y, slice);
+			for (uint x = firstColumn; x <= lastColumn; ++x) {
+				if (cone != nullptr && !ConeIntersectsCluster(*cone, x, y, slice)) {
+					continue;
+				}
+
+				ClusterLight pair = {baseCluster + x, light};
+				out_list->push_back(pair);
+			}
+		}
+	}
+}
+
+bool ClusterLightAssigner::ConeIntersectsCluster(const SpotCone &cone, uint x, uint y, uint slice) const {
+	// Tests the cone against the bounding sphere of the cluster. From Bart Wronski's "Cull that cone!"
+	DirectX::XMFLOAT3 sphereCenter;
+	float sphereRadius = GetClusterBoundingSphere(x, y, slice, &sphereCenter);
+
+	float vx = sphereCenter.x - cone.Apex.x;
+	float vy = sphereCenter.y - cone.Apex.y;
+	float vz = sphereCenter.z - cone.Apex.z;
+	float lengthSquared = vx * vx + vy * vy + vz * vz;
+	float alongAxis = vx * cone.Direction.x + vy * cone.Direction.y + vz * cone.Direction.z;
+	float fromAxis = std::sqrt(std::max(lengthSquared - alongAxis * alongAxis, 0.0f));
+
+	// The distance from the center of the sphere to the side of the cone
+	float toSide = cone.CosAngle * fromAxis - alongAxis * cone.SinAngle;
+
+	return toSide <= sphereRadius && alongAxis <= sphereRadius + cone.Range && alongAxis >= -sphereRadius;
+}
+
+} // End of namespace Scene
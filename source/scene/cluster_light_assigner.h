@@ -0,0 +1,199 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "common/typedefs.h"
+
+#include <DirectXMath.h>
+
+#include <vector>
+
+
+namespace Common {
+class ThreadPool;
+}
+
+namespace Scene {
+
+class LightBVH;
+struct ShaderPointLight;
+struct ShaderSpotLight;
+
+/**
+ * The lights of one cluster. The point lights are LightIndices[Offset, Offset + PointLightCount),
+ * and the spot lights follow them. Matches the layout of the shader structure
+ */
+struct ClusterLightRange {
+	uint Offset;
+	uint PointLightCount;
+	uint SpotLightCount;
+};
+
+/**
+ * Bins point and spot lights into a grid of view space clusters, on the CPU
+ *
+ * The grid is made of screen space tiles in x and y, and depth slices in z. Each light's bounding
+ * sphere is first clipped to the slices it touches. Within a slice, the part of the sphere that is
+ * past a slice plane is bounded by a smaller sphere, centered on the plane. The same is done for the
+ * rows of tiles, so each row only gets the columns that the light actually reaches. Spot lights use
+ * the bounding sphere of their cone, and then test the cone against every cluster the sphere touches.
+ *
+ * The result is a compact list of light indices, and a grid of ClusterLightRange, one per cluster,
+ * indexed by GetClusterIndex(). Within a cluster, the indices are in ascending order.
+ *
+ * If a ThreadPool is given, the lights are binned in parallel chunks. Each chunk writes its own list
+ * of (cluster, light) pairs, and the lists are then counted and scattered into the grid, so the
+ * result doesn't depend on the number of threads.
+ *
+ * If LightBVHs are given, the lights are first culled against the frustum of the whole grid with
+ * them, and only the lights that survive are binned. The lights have to be in the BVH order then.
+ */
+class ClusterLightAssigner {
+public:
+	ClusterLightAssigner();
+
+	/** The number of lights binned by each parallel chunk */
+	static const uint kChunkSize = 64u;
+
+private:
+	struct ClusterLight {
+		uint Cluster;
+		/** The index of the light. The high bit is set for spot lights */
+		uint Light;
+	};
+
+	/** A spot light in view space */
+	struct SpotCone {
+		DirectX::XMFLOAT3 Apex;
+		DirectX::XMFLOAT3 Direction;
+		float Range;
+		float CosAngle;
+		float SinAngle;
+	};
+
+	uint m_clusterCountX;
+	uint m_clusterCountY;
+	uint m_sliceCount;
+
+	/** The planes between the columns of tiles. Plane i is the left side of column i. Points to the right of it are on the positive side */
+	std::vector<DirectX::XMFLOAT4> m_planesX;
+	/** The planes between the rows of tiles. Plane i is the top of row i. Points below it are on the positive side */
+	std::vector<DirectX::XMFLOAT4> m_planesY;
+	/** x / z of plane i of m_planesX. Used for the bounds of the clusters */
+	std::vector<float> m_slopesX;
+	/** y / z of plane i of m_planesY */
+	std::vector<float> m_slopesY;
+	/** Maps (view x / view z) to a column of tiles, as x / z * m_tileScaleX + m_tileBiasX */
+	float m_tileScaleX;
+	float m_tileBiasX;
+	/** Maps (view y / view z) to a row of tiles */
+	float m_tileScaleY;
+	float m_tileBiasY;
+	/** The view depths between the slices. Slice i covers [m_sliceDepths[i], m_sliceDepths[i + 1]] */
+	std::vector<float> m_sliceDepths;
+
+	std::vector<std::vector<ClusterLight> > m_chunkLists;
+	std::vector<ClusterLightRange> m_clusterRanges;
+	std::vector<uint> m_lightIndices;
+	/** Where the next spot light of each cluster is written, while the pairs are scattered */
+	std::vector<uint> m_spotCursors;
+	/** The lights that survived the BVH culling. Spot lights are offset by the point light count */
+	std::vector<uint> m_visibleLights;
+	std::vector<uint> m_visibleSpotLights;
+	uint m_binnedLightCount;
+
+public:
+	/**
+	 * Sets up the grid. Has to be called whenever the projection or the screen size changes
+	 *
+	 * @param projection      The perspective projection of the camera. Only the field of view is used, so normal or reversed depth both work
+	 * @param screenWidth     The width of the screen, in pixels
+	 * @param screenHeight    The height of the screen, in pixels
+	 * @param tileSize        The width and height of the tiles, in pixels. The last column and row can reach past the screen
+	 * @param sliceDepths     The sliceCount + 1 view depths between the slices, in ascending order. The first has to be greater than 0
+	 * @param sliceCount      The number of depth slices
+	 */
+	void SetGrid(DirectX::CXMMATRIX projection, uint screenWidth, uint screenHeight, uint tileSize, const float *sliceDepths, uint sliceCount);
+
+	/**
+	 * Bins the lights into the clusters
+	 *
+	 * @param view               The view matrix. The light positions and directions are transformed by it
+	 * @param pointLights        The point lights
+	 * @param pointLightCount    The number of point lights
+	 * @param spotLights         The spot lights. Their directions have to be normalized
+	 * @param spotLightCount     The number of spot lights
+	 * @param threadPool         [Optional] If not nullptr, the lights are binned in parallel chunks
+	 * @param pointLightBVH      [Optional] If not nullptr, a BVH built from pointLights, which have to be in its sorted order.
+	 *                           The lights outside of the grid are culled with it before they're binned
+	 * @param spotLightBVH       [Optional] Same as above, for the spot lights
+	 * @return                   The number of light indices. IE. the number of (cluster, light) pairs
+	 */
+	uint AssignLights(DirectX::CXMMATRIX view, const ShaderPointLight *pointLights, uint pointLightCount, const ShaderSpotLight *spotLights, uint spotLightCount, Common::ThreadPool *threadPool = nullptr,
+	                  const LightBVH *pointLightBVH = nullptr, const LightBVH *spotLightBVH = nullptr);
+
+	inline uint GetClusterCountX() const { return m_clusterCountX; }
+	inline uint GetClusterCountY() const { return m_clusterCountY; }
+	inline uint GetSliceCount() const { return m_sliceCount; }
+	inline uint GetClusterCount() const { return m_clusterCountX * m_clusterCountY * m_sliceCount; }
+	inline uint GetClusterIndex(uint x, uint y, uint slice) const { return x + m_clusterCountX * (y + m_clusterCountY * slice); }
+
+	inline const DirectX::XMFLOAT4 &GetPlaneX(uint i) const { return m_planesX[i]; }
+	inline const DirectX::XMFLOAT4 &GetPlaneY(uint i) const { return m_planesY[i]; }
+	inline float GetSliceDepth(uint i) const { return m_sliceDepths[i]; }
+	/** Returns the slice a view depth is in. Depths outside of the grid are clamped to the first or last slice */
+	uint GetSlice(float depth) const;
+
+	/** The result of the last AssignLights(). Indexed by GetClusterIndex() */
+	inline const std::vector<ClusterLightRange> &GetClusterRanges() const { return m_clusterRanges; }
+	/** The result of the last AssignLights() */
+	inline const std::vector<uint> &GetLightIndices() const { return m_lightIndices; }
+	/** The number of lights the last AssignLights() binned. IE. the lights that survived the BVH culling, if there was any */
+	inline uint GetBinnedLightCount() const { return m_binnedLightCount; }
+
+	/**
+	 * Calculates the view space bounding sphere of a cluster
+	 *
+	 * @param x             The column of the cluster
+	 * @param y             The row of the cluster
+	 * @param slice         The depth slice of the cluster
+	 * @param out_center    Will be filled with the center of the sphere
+	 * @return              The radius of the sphere
+	 */
+	float GetClusterBoundingSphere(uint x, uint y, uint slice, DirectX::XMFLOAT3 *out_center) const;
+
+private:
+	/**
+	 * Bins the point lights and spot lights in [begin, end). Spot lights come after the point lights
+	 *
+	 * @param lightList    [Optional] If not nullptr, entries [begin, end) of it are binned, instead of the lights themselves
+	 */
+	void AssignRange(DirectX::CXMMATRIX view, const ShaderPointLight *pointLights, uint pointLightCount, const ShaderSpotLight *spotLights,
+	                 const uint *lightList, uint begin, uint end, std::vector<ClusterLight> *out_list) const;
+	/** Fills m_visibleLights with the lights that might touch the grid */
+	void CullLights(DirectX::CXMMATRIX view, uint pointLightCount, uint spotLightCount, const LightBVH *pointLightBVH, const LightBVH *spotLightBVH);
+	/**
+	 * Finds a conservative range of tiles that a sphere covers on screen, from the bounding box of the sphere
+	 *
+	 * @return    False if the sphere is completely off screen
+	 */
+	bool FindScreenRange(const DirectX::XMFLOAT3 &center, float radius, uint *out_firstColumn, uint *out_lastColumn, uint *out_firstRow, uint *out_lastRow) const;
+	/**
+	 * Adds every cluster a sphere touches to the list
+	 *
+	 * @param center      The view space center of the sphere
+	 * @param radius      The radius of the sphere
+	 * @param light       The value of ClusterLight::Light
+	 * @param cone        [Optional] If not nullptr, only the clusters that the cone touches are added
+	 * @param out_list    The list to add to
+	 */
+	void AssignSphere(const DirectX::XMFLOAT3 &center, float radius, uint light, const SpotCone *cone, std::vector<ClusterLight> *out_list) const;
+	/** Tests if a cone can reach any point in a cluster */
+	bool ConeIntersectsCluster(const SpotCone &cone, uint x, uint y, uint slice) const;
+};
+
+} // End of namespace Scene
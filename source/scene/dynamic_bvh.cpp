@@ -0,0 +1,866 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "scene/dynamic_bvh.h"
+
+#include "common/halfling_sys.h"
+#include "common/thread_pool.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <thread>
+
+
+namespace Scene {
+
+// The containers and std::min / std::max take it by reference, so it needs a definition
+const int DynamicBVH::kNullNode;
+const uint DynamicBVH::kSAHBinCount;
+
+namespace {
+
+inline float SurfaceArea(const DirectX::XMFLOAT3 &aabbMin, const DirectX::XMFLOAT3 &aabbMax) {
+	float x = aabbMax.x - aabbMin.x;
+	float y = aabbMax.y - aabbMin.y;
+	float z = aabbMax.z - aabbMin.z;
+	return 2.0f * (x * y + y * z + z * x);
+}
+
+inline void Union(const DirectX::XMFLOAT3 &aMin, const DirectX::XMFLOAT3 &aMax, const DirectX::XMFLOAT3 &bMin, const DirectX::XMFLOAT3 &bMax, DirectX::XMFLOAT3 *out_min, DirectX::XMFLOAT3 *out_max) {
+	*out_min = DirectX::XMFLOAT3(std::min(aMin.x, bMin.x), std::min(aMin.y, bMin.y), std::min(aMin.z, bMin.z));
+	*out_max = DirectX::XMFLOAT3(std::max(aMax.x, bMax.x), std::max(aMax.y, bMax.y), std::max(aMax.z, bMax.z));
+}
+
+inline float UnionSurfaceArea(const DirectX::XMFLOAT3 &aMin, const DirectX::XMFLOAT3 &aMax, const DirectX::XMFLOAT3 &bMin, const DirectX::XMFLOAT3 &bMax) {
+	DirectX::XMFLOAT3 unionMin, unionMax;
+	Union(aMin, aMax, bMin, bMax, &unionMin, &unionMax);
+	return SurfaceArea(unionMin, unionMax);
+}
+
+inline float Component(const DirectX::XMFLOAT3 &vector, uint axis) {
+	return (&vector.x)[axis];
+}
+
+/**
+ * The traversal stack of the queries. A depth first traversal never has more than
+ * height + 1 nodes on the stack, so the common case doesn't touch the heap
+ */
+class NodeStack {
+public:
+	struct Entry {
+		int Node;
+		/** The frustum planes the node still has to be tested against */
+		uint PlaneMask;
+	};
+
+	NodeStack(int treeHeight)
+			: m_data(m_local),
+			  m_size(0u) {
+		uint capacity = static_cast<uint>(treeHeight) + 2u;
+		if (capacity > kLocalSize) {
+			m_heap.resize(capacity);
+			m_data = &m_heap[0];
+		}
+	}
+
+private:
+	static const uint kLocalSize = 64u;
+
+	Entry m_local[kLocalSize];
+	std::vector<Entry> m_heap;
+	Entry *m_data;
+	uint m_size;
+
+public:
+	inline void Push(int node, uint planeMask = 0u) {
+		Entry &entry = m_data[m_size++];
+		entry.Node = node;
+		entry.PlaneMask = planeMask;
+	}
+	inline Entry Pop() { return m_data[--m_size]; }
+	inline bool IsEmpty() const { return m_size == 0u; }
+};
+
+} // End of anonymous namespace
+
+
+DynamicBVH::DynamicBVH()
+		: m_root(kNullNode),
+		  m_proxyCount(0u),
+		  m_rotationCount(0u) {
+}
+
+uint DynamicBVH::CreateProxy(const DirectX::XMFLOAT3 &aabbMin, const DirectX::XMFLOAT3 &aabbMax, uint userData) {
+	uint proxyId;
+	if (m_freeProxies.empty()) {
+		proxyId = static_cast<uint>(m_proxies.size());
+		m_proxies.push_back(Proxy());
+	} else {
+		proxyId = m_freeProxies.back();
+		m_freeProxies.pop_back();
+	}
+
+	int leaf = AllocateNode();
+	Node &node = m_nodes[leaf];
+	node.AABBMin = aabbMin;
+	node.AABBMax = aabbMax;
+	node.Proxy = proxyId;
+
+	Proxy &proxy = m_proxies[proxyId];
+	proxy.AABBMin = aabbMin;
+	proxy.AABBMax = aabbMax;
+	proxy.UserData = userData;
+	proxy.Node = leaf;
+
+	InsertLeaf(leaf);
+	++m_proxyCount;
+
+	return proxyId;
+}
+
+void DynamicBVH::DestroyProxy(uint proxyId) {
+	AssertMsg(proxyId < m_proxies.size() && m_proxies[proxyId].Node != kNullNode, "Proxy " << proxyId << " doesn't exist");
+
+	int leaf = m_proxies[proxyId].Node;
+	RemoveLeaf(leaf);
+	FreeNode(leaf);
+
+	m_proxies[proxyId].Node = kNullNode;
+	if (m_rebuildJob) {
+		// The rebuild still has a leaf for this id. Reusing it now would confuse the two
+		m_pendingFreeProxies.push_back(proxyId);
+	} else {
+		m_freeProxies.push_back(proxyId);
+	}
+	--m_proxyCount;
+}
+
+void DynamicBVH::MoveProxy(uint proxyId, const DirectX::XMFLOAT3 &aabbMin, const DirectX::XMFLOAT3 &aabbMax) {
+	AssertMsg(proxyId < m_proxies.size() && m_proxies[proxyId].Node != kNullNode, "Proxy " << proxyId << " doesn't exist");
+
+	Proxy &proxy = m_proxies[proxyId];
+	proxy.AABBMin = aabbMin;
+	proxy.AABBMax = aabbMax;
+
+	Node &leaf = m_nodes[proxy.Node];
+	leaf.AABBMin = aabbMin;
+	leaf.AABBMax = aabbMax;
+	MarkDirty(leaf.Parent);
+}
+
+void DynamicBVH::Clear() {
+	FinishRebuild(true);
+
+	m_nodes.clear();
+	m_freeNodes.clear();
+	m_root = kNullNode;
+	m_proxies.clear();
+	m_freeProxies.clear();
+	m_pendingFreeProxies.clear();
+	m_proxyCount = 0u;
+	m_dirtyNodes.clear();
+}
+
+float DynamicBVH::GetSurfaceAreaRatio() const {
+	if (m_root == kNullNode) {
+		return 0.0f;
+	}
+
+	float rootArea = SurfaceArea(m_nodes[m_root].AABBMin, m_nodes[m_root].AABBMax);
+	if (rootArea <= 0.0f) {
+		return 0.0f;
+	}
+
+	float totalArea = 0.0f;
+	for (auto iter = m_nodes.begin(); iter != m_nodes.end(); ++iter) {
+		if (iter->Height > 0) {
+			totalArea += SurfaceArea(iter->AABBMin, iter->AABBMax);
+		}
+	}
+
+	return totalArea / rootArea;
+}
+
+void DynamicBVH::Refit() {
+	// Children are always lower than their parents, so refitting in order of height
+	// means both children of a node are up to date by the time we get to it
+	std::sort(m_dirtyNodes.begin(), m_dirtyNodes.end(), [this](int a, int b) {
+		return m_nodes[a].Height < m_nodes[b].Height;
+	});
+
+	for (auto iter = m_dirtyNodes.begin(); iter != m_dirtyNodes.end(); ++iter) {
+		// Nodes can be freed, or listed twice, after being flagged
+		Node &node = m_nodes[*iter];
+		if (!node.Dirty || node.Height < 0) {
+			continue;
+		}
+		node.Dirty = false;
+
+		UpdateNode(*iter);
+		Rotate(*iter);
+	}
+
+	m_dirtyNodes.clear();
+}
+
+void DynamicBVH::Rebuild() {
+	FinishRebuild(true);
+
+	std::vector<BuildPrimitive> primitives;
+	SnapshotPrimitives(&primitives);
+
+	std::vector<Node> nodes;
+	int root = BuildSAH(primitives, &nodes);
+	InstallTree(nodes, root);
+}
+
+void DynamicBVH::RebuildAsync(Common::ThreadPool *threadPool) {
+	if (m_rebuildJob) {
+		return;
+	}
+
+	std::shared_ptr<RebuildJob> job = std::make_shared<RebuildJob>();
+	SnapshotPrimitives(&job->Primitives);
+	job->Root = kNullNode;
+	job->Finished.store(false, std::memory_order_relaxed);
+	m_rebuildJob = job;
+
+	// The job only touches its own copy of the proxies, so the tree is free to change in the meantime
+	threadPool->Enqueue([job]() {
+		job->Root = BuildSAH(job->Primitives, &job->Nodes);
+		job->Finished.store(true, std::memory_order_release);
+	});
+}
+
+bool DynamicBVH::FinishRebuild(bool wait) {
+	if (!m_rebuildJob) {
+		return false;
+	}
+
+	if (!m_rebuildJob->Finished.load(std::memory_order_acquire)) {
+		if (!wait) {
+			return false;
+		}
+		while (!m_rebuildJob->Finished.load(std::memory_order_acquire)) {
+			std::this_thread::yield();
+		}
+	}
+
+	std::shared_ptr<RebuildJob> job = m_rebuildJob;
+	m_rebuildJob.reset();
+
+	InstallTree(job->Nodes, job->Root);
+
+	m_freeProxies.insert(m_freeProxies.end(), m_pendingFreeProxies.begin(), m_pendingFreeProxies.end());
+	m_pendingFreeProxies.clear();
+
+	return true;
+}
+
+void DynamicBVH::QueryFrustum(const Frustum &frustum, std::vector<uint> *out_userData) const {
+	AssertMsg(m_dirtyNodes.empty(), "Refit() has to be called after moving proxies, before querying");
+	if (m_root == kNullNode) {
+		return;
+	}
+
+	static const uint kAllPlanes = (1u << 6) - 1u;
+
+	NodeStack stack(GetHeight());
+	stack.Push(m_root, kAllPlanes);
+
+	while (!stack.IsEmpty()) {
+		NodeStack::Entry entry = stack.Pop();
+		const Node &node = m_nodes[entry.Node];
+
+		// Test against the planes the node isn't known to be inside of yet
+		uint planeMask = entry.PlaneMask;
+		if (planeMask != 0u) {
+			float centerX = (node.AABBMin.x + node.AABBMax.x) * 0.5f;
+			float centerY = (node.AABBMin.y + node.AABBMax.y) * 0.5f;
+			float centerZ = (node.AABBMin.z + node.AABBMax.z) * 0.5f;
+			float extentX = (node.AABBMax.x - node.AABBMin.x) * 0.5f;
+			float extentY = (node.AABBMax.y - node.AABBMin.y) * 0.5f;
+			float extentZ = (node.AABBMax.z - node.AABBMin.z) * 0.5f;
+
+			bool outside = false;
+			for (uint i = 0; i < 6; ++i) {
+				if ((planeMask & (1u << i)) == 0u) {
+					continue;
+				}
+
+				const DirectX::XMFLOAT4 &plane = frustum.Planes[i];
+				float distance = plane.x * centerX + plane.y * centerY + plane.z * centerZ + plane.w;
+				float radius = std::fabs(plane.x) * extentX + std::fabs(plane.y) * extentY + std::fabs(plane.z) * extentZ;
+
+				if (distance + radius < 0.0f) {
+					outside = true;
+					break;
+				}
+				if (distance - radius >= 0.0f) {
+					// The whole subtree is inside this plane
+					planeMask &= ~(1u << i);
+				}
+			}
+
+			if (outside) {
+				continue;
+			}
+		}
+
+		if (node.IsLeaf()) {
+			out_userData->push_back(m_proxies[node.Proxy].UserData);
+		} else {
+			stack.Push(node.Child1, planeMask);
+			stack.Push(node.Child2, planeMask);
+		}
+	}
+}
+
+void DynamicBVH::QuerySphere(const DirectX::XMFLOAT3 &center, float radius, std::vector<uint> *out_userData) const {
+	AssertMsg(m_dirtyNodes.empty(), "Refit() has to be called after moving proxies, before querying");
+	if (m_root == kNullNode) {
+		return;
+	}
+
+	float radiusSquared = radius * radius;
+
+	NodeStack stack(GetHeight());
+	stack.Push(m_root);
+
+	while (!stack.IsEmpty()) {
+		const Node &node = m_nodes[stack.Pop().Node];
+
+		// The squared distance from the center to the closest point of the box
+		float x = std::max(std::max(node.AABBMin.x - center.x, center.x - node.AABBMax.x), 0.0f);
+		float y = std::max(std::max(node.AABBMin.y - center.y, center.y - node.AABBMax.y), 0.0f);
+		float z = std::max(std::max(node.AABBMin.z - center.z, center.z - node.AABBMax.z), 0.0f);
+		if (x * x + y * y + z * z > radiusSquared) {
+			continue;
+		}
+
+		if (node.IsLeaf()) {
+			out_userData->push_back(m_proxies[node.Proxy].UserData);
+		} else {
+			stack.Push(node.Child1);
+			stack.Push(node.Child2);
+		}
+	}
+}
+
+void DynamicBVH::QueryAABB(const DirectX::XMFLOAT3 &aabbMin, const DirectX::XMFLOAT3 &aabbMax, std::vector<uint> *out_userData) const {
+	AssertMsg(m_dirtyNodes.empty(), "Refit() has to be called after moving proxies, before querying");
+	if (m_root == kNullNode) {
+		return;
+	}
+
+	NodeStack stack(GetHeight());
+	stack.Push(m_root);
+
+	while (!stack.IsEmpty()) {
+		const Node &node = m_nodes[stack.Pop().Node];
+
+		if (node.AABBMin.x > aabbMax.x || node.AABBMax.x < aabbMin.x ||
+		    node.AABBMin.y > aabbMax.y || node.AABBMax.y < aabbMin.y ||
+		    node.AABBMin.z > aabbMax.z || node.AABBMax.z < aabbMin.z) {
+			continue;
+		}
+
+		if (node.IsLeaf()) {
+			out_userData->push_back(m_proxies[node.Proxy].UserData);
+		} else {
+			stack.Push(node.Child1);
+			stack.Push(node.Child2);
+		}
+	}
+}
+
+void DynamicBVH::QueryRay(const DirectX::XMFLOAT3 &origin, const DirectX::XMFLOAT3 &direction, float maxDistance, std::vector<uint> *out_userData) const {
+	AssertMsg(m_dirtyNodes.empty(), "Refit() has to be called after moving proxies, before querying");
+	if (m_root == kNullNode) {
+		return;
+	}
+
+	DirectX::XMFLOAT3 inverseDirection(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+
+	NodeStack stack(GetHeight());
+	stack.Push(m_root);
+
+	while (!stack.IsEmpty()) {
+		const Node &node = m_nodes[stack.Pop().Node];
+
+		if (!RayIntersectsAABB(origin, inverseDirection, maxDistance, node.AABBMin, node.AABBMax)) {
+			continue;
+		}
+
+		if (node.IsLeaf()) {
+			out_userData->push_back(m_proxies[node.Proxy].UserData);
+		} else {
+			stack.Push(node.Child1);
+			stack.Push(node.Child2);
+		}
+	}
+}
+
+bool DynamicBVH::RayIntersectsAABB(const DirectX::XMFLOAT3 &origin, const DirectX::XMFLOAT3 &inverseDirection, float maxDistance, const DirectX::XMFLOAT3 &aabbMin, const DirectX::XMFLOAT3 &aabbMax, float *out_distance) {
+	// Slab test
+	float tx1 = (aabbMin.x - origin.x) * inverseDirection.x;
+	float tx2 = (aabbMax.x - origin.x) * inverseDirection.x;
+	float ty1 = (aabbMin.y - origin.y) * inverseDirection.y;
+	float ty2 = (aabbMax.y - origin.y) * inverseDirection.y;
+	float tz1 = (aabbMin.z - origin.z) * inverseDirection.z;
+	float tz2 = (aabbMax.z - origin.z) * inverseDirection.z;
+
+	float tEnter = std::max(std::max(std::min(tx1, tx2), std::min(ty1, ty2)), std::min(tz1, tz2));
+	float tExit = std::min(std::min(std::max(tx1, tx2), std::max(ty1, ty2)), std::max(tz1, tz2));
+
+	if (tExit < std::max(tEnter, 0.0f) || tEnter > maxDistance) {
+		return false;
+	}
+
+	if (out_distance != nullptr) {
+		*out_distance = std::max(tEnter, 0.0f);
+	}
+	return true;
+}
+
+int DynamicBVH::AllocateNode() {
+	int index;
+	if (m_freeNodes.empty()) {
+		index = static_cast<int>(m_nodes.size());
+		m_nodes.push_back(Node());
+	} else {
+		index = m_freeNodes.back();
+		m_freeNodes.pop_back();
+	}
+
+	Node &node = m_nodes[index];
+	node.Parent = kNullNode;
+	node.Child1 = kNullNode;
+	node.Child2 = kNullNode;
+	node.Height = 0;
+	node.Proxy = 0u;
+	node.Dirty = false;
+
+	return index;
+}
+
+void DynamicBVH::FreeNode(int node) {
+	m_nodes[node].Height = -1;
+	m_nodes[node].Dirty = false;
+	m_freeNodes.push_back(node);
+}
+
+void DynamicBVH::InsertLeaf(int leaf) {
+	if (m_root == kNullNode) {
+		m_root = leaf;
+		m_nodes[leaf].Parent = kNullNode;
+		return;
+	}
+
+	DirectX::XMFLOAT3 leafMin = m_nodes[leaf].AABBMin;
+	DirectX::XMFLOAT3 leafMax = m_nodes[leaf].AABBMax;
+
+	// Walk down to the cheapest sibling. The cost of making a node the sibling is the area of the new
+	// parent, plus the area that every ancestor grows by. So we stop once descending costs more than that
+	int index = m_root;
+	while (!m_nodes[index].IsLeaf()) {
+		const Node &node = m_nodes[index];
+
+		float area = SurfaceArea(node.AABBMin, node.AABBMax);
+		float combinedArea = UnionSurfaceArea(node.AABBMin, node.AABBMax, leafMin, leafMax);
+
+		float siblingCost = 2.0f * combinedArea;
+		float inheritanceCost = 2.0f * (combinedArea - area);
+
+		float childCosts[2];
+		int children[2] = {node.Child1, node.Child2};
+		for (uint i = 0; i < 2; ++i) {
+			const Node &child = m_nodes[children[i]];
+			float childCombinedArea = UnionSurfaceArea(child.AABBMin, child.AABBMax, leafMin, leafMax);
+			if (child.IsLeaf()) {
+				childCosts[i] = childCombinedArea + inheritanceCost;
+			} else {
+				childCosts[i] = childCombinedArea - SurfaceArea(child.AABBMin, child.AABBMax) + inheritanceCost;
+			}
+		}
+
+		if (siblingCost < childCosts[0] && siblingCost < childCosts[1]) {
+			break;
+		}
+
+		index = childCosts[0] < childCosts[1] ? children[0] : children[1];
+	}
+
+	int sibling = index;
+	int oldParent = m_nodes[sibling].Parent;
+
+	int newParent = AllocateNode();
+	Node &parentNode = m_nodes[newParent];
+	parentNode.Parent = oldParent;
+	Union(leafMin, leafMax, m_nodes[sibling].AABBMin, m_nodes[sibling].AABBMax, &parentNode.AABBMin, &parentNode.AABBMax);
+	parentNode.Height = m_nodes[sibling].Height + 1;
+	parentNode.Child1 = sibling;
+	parentNode.Child2 = leaf;
+	m_nodes[sibling].Parent = newParent;
+	m_nodes[leaf].Parent = newParent;
+
+	if (oldParent == kNullNode) {
+		m_root = newParent;
+	} else if (m_nodes[oldParent].Child1 == sibling) {
+		m_nodes[oldParent].Child1 = newParent;
+	} else {
+		m_nodes[oldParent].Child2 = newParent;
+	}
+
+	// Keep the 'dirty nodes have dirty ancestors' rule
+	if (m_nodes[sibling].Dirty) {
+		MarkDirty(newParent);
+	}
+
+	for (index = m_nodes[leaf].Parent; index != kNullNode; index = m_nodes[index].Parent) {
+		UpdateNode(index);
+		Rotate(index);
+	}
+}
+
+void DynamicBVH::RemoveLeaf(int leaf) {
+	if (leaf == m_root) {
+		m_root = kNullNode;
+		return;
+	}
+
+	int parent = m_nodes[leaf].Parent;
+	int grandParent = m_nodes[parent].Parent;
+	int sibling = m_nodes[parent].Child1 == leaf ? m_nodes[parent].Child2 : m_nodes[parent].Child1;
+
+	// The sibling takes the place of the parent
+	m_nodes[sibling].Parent = grandParent;
+	FreeNode(parent);
+
+	if (grandParent == kNullNode) {
+		m_root = sibling;
+		return;
+	}
+
+	if (m_nodes[grandParent].Child1 == parent) {
+		m_nodes[grandParent].Child1 = sibling;
+	} else {
+		m_nodes[grandParent].Child2 = sibling;
+	}
+
+	for (int index = grandParent; index != kNullNode; index = m_nodes[index].Parent) {
+		UpdateNode(index);
+		Rotate(index);
+	}
+}
+
+void DynamicBVH::UpdateNode(int index) {
+	Node &node = m_nodes[index];
+	const Node &child1 = m_nodes[node.Child1];
+	const Node &child2 = m_nodes[node.Child2];
+
+	Union(child1.AABBMin, child1.AABBMax, child2.AABBMin, child2.AABBMax, &node.AABBMin, &node.AABBMax);
+	node.Height = 1 + std::max(child1.Height, child2.Height);
+}
+
+void DynamicBVH::Rotate(int index) {
+	const Node &node = m_nodes[index];
+	int children[2] = {node.Child1, node.Child2};
+
+	// Each candidate swaps a child of 'node' with a child of its sibling. That changes the
+	// bounds of the sibling, and nothing else, so we pick the swap that shrinks it the most
+	float bestSaving = 0.0f;
+	int bestChild = kNullNode;
+	int bestGrandChild = kNullNode;
+
+	for (uint i = 0; i < 2; ++i) {
+		const Node &child = m_nodes[children[i]];
+		const Node &sibling = m_nodes[children[1 - i]];
+		if (sibling.IsLeaf()) {
+			continue;
+		}
+
+		float siblingArea = SurfaceArea(sibling.AABBMin, sibling.AABBMax);
+		int grandChildren[2] = {sibling.Child1, sibling.Child2};
+		for (uint j = 0; j < 2; ++j) {
+			// 'child' moves down next to the grandchild that stays
+			const Node &remaining = m_nodes[grandChildren[1 - j]];
+			float saving = siblingArea - UnionSurfaceArea(child.AABBMin, child.AABBMax, remaining.AABBMin, remaining.AABBMax);
+			if (saving > bestSaving) {
+				bestSaving = saving;
+				bestChild = children[i];
+				bestGrandChild = grandChildren[j];
+			}
+		}
+	}
+
+	if (bestChild == kNullNode) {
+		return;
+	}
+
+	int sibling = m_nodes[index].Child1 == bestChild ? m_nodes[index].Child2 : m_nodes[index].Child1;
+
+	// The grandchild moves up
+	if (m_nodes[index].Child1 == bestChild) {
+		m_nodes[index].Child1 = bestGrandChild;
+	} else {
+		m_nodes[index].Child2 = bestGrandChild;
+	}
+	m_nodes[bestGrandChild].Parent = index;
+
+	// And the child moves down
+	if (m_nodes[sibling].Child1 == bestGrandChild) {
+		m_nodes[sibling].Child1 = bestChild;
+	} else {
+		m_nodes[sibling].Child2 = bestChild;
+	}
+	m_nodes[bestChild].Parent = sibling;
+
+	UpdateNode(sibling);
+	UpdateNode(index);
+	if (m_nodes[bestChild].Dirty) {
+		MarkDirty(sibling);
+	}
+
+	++m_rotationCount;
+}
+
+void DynamicBVH::MarkDirty(int node) {
+	while (node != kNullNode && !m_nodes[node].Dirty) {
+		m_nodes[node].Dirty = true;
+		m_dirtyNodes.push_back(node);
+		node = m_nodes[node].Parent;
+	}
+}
+
+int DynamicBVH::BuildSAH(std::vector<BuildPrimitive> &primitives, std::vector<Node> *out_nodes) {
+	out_nodes->clear();
+	if (primitives.empty()) {
+		return kNullNode;
+	}
+	out_nodes->reserve(primitives.size() * 2u - 1u);
+
+	struct BuildTask {
+		uint Begin;
+		uint End;
+		int Parent;
+	};
+	struct Bin {
+		DirectX::XMFLOAT3 AABBMin;
+		DirectX::XMFLOAT3 AABBMax;
+		uint Count;
+	};
+
+	std::vector<BuildTask> tasks;
+	BuildTask rootTask = {0u, static_cast<uint>(primitives.size()), kNullNode};
+	tasks.push_back(rootTask);
+
+	while (!tasks.empty()) {
+		BuildTask task = tasks.back();
+		tasks.pop_back();
+
+		int index = static_cast<int>(out_nodes->size());
+		out_nodes->push_back(Node());
+		if (task.Parent != kNullNode) {
+			Node &parent = (*out_nodes)[task.Parent];
+			if (parent.Child1 == kNullNode) {
+				parent.Child1 = index;
+			} else {
+				parent.Child2 = index;
+			}
+		}
+
+		// The bounds of the primitives, and of their centroids
+		DirectX::XMFLOAT3 aabbMin(FLT_MAX, FLT_MAX, FLT_MAX);
+		DirectX::XMFLOAT3 aabbMax(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		DirectX::XMFLOAT3 centroidMin(FLT_MAX, FLT_MAX, FLT_MAX);
+		DirectX::XMFLOAT3 centroidMax(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		for (uint i = task.Begin; i < task.End; ++i) {
+			const BuildPrimitive &primitive = primitives[i];
+			Union(aabbMin, aabbMax, primitive.AABBMin, primitive.AABBMax, &aabbMin, &aabbMax);
+			Union(centroidMin, centroidMax, primitive.Centroid, primitive.Centroid, &centroidMin, &centroidMax);
+		}
+
+		Node &node = (*out_nodes)[index];
+		node.AABBMin = aabbMin;
+		node.AABBMax = aabbMax;
+		node.Parent = task.Parent;
+		node.Height = 0;
+		node.Child1 = kNullNode;
+		node.Child2 = kNullNode;
+		node.Proxy = 0u;
+		node.Dirty = false;
+
+		uint count = task.End - task.Begin;
+		if (count == 1u) {
+			node.Proxy = primitives[task.Begin].Proxy;
+			continue;
+		}
+
+		// Find the cheapest split plane between the bins, on any axis
+		float bestCost = FLT_MAX;
+		uint bestAxis = 0u;
+		uint bestSplit = 0u;
+		for (uint axis = 0; axis < 3; ++axis) {
+			float axisMin = Component(centroidMin, axis);
+			float extent = Component(centroidMax, axis) - axisMin;
+			if (extent <= 0.0f) {
+				continue;
+			}
+			float binScale = kSAHBinCount / extent;
+
+			Bin bins[kSAHBinCount];
+			for (uint i = 0; i < kSAHBinCount; ++i) {
+				bins[i].AABBMin = DirectX::XMFLOAT3(FLT_MAX, FLT_MAX, FLT_MAX);
+				bins[i].AABBMax = DirectX::XMFLOAT3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+				bins[i].Count = 0u;
+			}
+			for (uint i = task.Begin; i < task.End; ++i) {
+				const BuildPrimitive &primitive = primitives[i];
+				uint bin = std::min(static_cast<uint>((Component(primitive.Centroid, axis) - axisMin) * binScale), kSAHBinCount - 1u);
+				Union(bins[bin].AABBMin, bins[bin].AABBMax, primitive.AABBMin, primitive.AABBMax, &bins[bin].AABBMin, &bins[bin].AABBMax);
+				++bins[bin].Count;
+			}
+
+			// Sweep from the right to get the cost of everything after each split
+			float rightCosts[kSAHBinCount];
+			DirectX::XMFLOAT3 rightMin(FLT_MAX, FLT_MAX, FLT_MAX);
+			DirectX::XMFLOAT3 rightMax(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+			uint rightCount = 0u;
+			for (uint i = kSAHBinCount - 1u; i > 0u; --i) {
+				Union(rightMin, rightMax, bins[i].AABBMin, bins[i].AABBMax, &rightMin, &rightMax);
+				rightCount += bins[i].Count;
+				rightCosts[i - 1u] = rightCount == 0u ? 0.0f : SurfaceArea(rightMin, rightMax) * rightCount;
+			}
+
+			// Then from the left, splitting after bin i
+			DirectX::XMFLOAT3 leftMin(FLT_MAX, FLT_MAX, FLT_MAX);
+			DirectX::XMFLOAT3 leftMax(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+			uint leftCount = 0u;
+			for (uint i = 0; i < kSAHBinCount - 1u; ++i) {
+				Union(leftMin, leftMax, bins[i].AABBMin, bins[i].AABBMax, &leftMin, &leftMax);
+				leftCount += bins[i].Count;
+				if (leftCount == 0u || leftCount == count) {
+					continue;
+				}
+
+				float cost = SurfaceArea(leftMin, leftMax) * leftCount + rightCosts[i];
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = i;
+				}
+			}
+		}
+
+		uint middle;
+		if (bestCost < FLT_MAX) {
+			float axisMin = Component(centroidMin, bestAxis);
+			float binScale = kSAHBinCount / (Component(centroidMax, bestAxis) - axisMin);
+			auto middleIter = std::partition(primitives.begin() + task.Begin, primitives.begin() + task.End, [=](const BuildPrimitive &primitive) {
+				return std::min(static_cast<uint>((Component(primitive.Centroid, bestAxis) - axisMin) * binScale), kSAHBinCount - 1u) <= bestSplit;
+			});
+			middle = static_cast<uint>(middleIter - primitives.begin());
+		} else {
+			// All the centroids are in the same place, so any split is as good as any other
+			middle = task.Begin + count / 2u;
+		}
+
+		BuildTask right = {middle, task.End, index};
+		BuildTask left = {task.Begin, middle, index};
+		tasks.push_back(right);
+		tasks.push_back(left);
+	}
+
+	// Children are always created after their parents, so a backwards pass sees the children first
+	for (auto iter = out_nodes->rbegin(); iter != out_nodes->rend(); ++iter) {
+		if (!iter->IsLeaf()) {
+			iter->Height = 1 + std::max((*out_nodes)[iter->Child1].Height, (*out_nodes)[iter->Child2].Height);
+		}
+	}
+
+	return 0;
+}
+
+void DynamicBVH::SnapshotPrimitives(std::vector<BuildPrimitive> *out_primitives) const {
+	out_primitives->clear();
+	out_primitives->reserve(m_proxyCount);
+
+	for (uint i = 0; i < m_proxies.size(); ++i) {
+		const Proxy &proxy = m_proxies[i];
+		if (proxy.Node == kNullNode) {
+			continue;
+		}
+
+		BuildPrimitive primitive;
+		primitive.AABBMin = proxy.AABBMin;
+		primitive.AABBMax = proxy.AABBMax;
+		primitive.Centroid = DirectX::XMFLOAT3((proxy.AABBMin.x + proxy.AABBMax.x) * 0.5f, (proxy.AABBMin.y + proxy.AABBMax.y) * 0.5f, (proxy.AABBMin.z + proxy.AABBMax.z) * 0.5f);
+		primitive.Proxy = i;
+		out_primitives->push_back(primitive);
+	}
+}
+
+void DynamicBVH::InstallTree(std::vector<Node> &nodes, int root) {
+	m_nodes.swap(nodes);
+	m_root = root;
+	m_freeNodes.clear();
+	m_dirtyNodes.clear();
+
+	// The proxies may have moved since the snapshot. Give the leaves the current bounds of
+	// their proxies, and note which leaves belong to proxies that were destroyed meanwhile
+	std::vector<int> newLeaves(m_proxies.size(), kNullNode);
+	std::vector<int> orphanedLeaves;
+	for (uint i = 0; i < m_nodes.size(); ++i) {
+		Node &node = m_nodes[i];
+		if (!node.IsLeaf()) {
+			continue;
+		}
+
+		const Proxy &proxy = m_proxies[node.Proxy];
+		if (proxy.Node == kNullNode) {
+			orphanedLeaves.push_back(static_cast<int>(i));
+		} else {
+			node.AABBMin = proxy.AABBMin;
+			node.AABBMax = proxy.AABBMax;
+			newLeaves[node.Proxy] = static_cast<int>(i);
+		}
+	}
+
+	// A fresh build has its children after its parents, so a backwards pass refits the whole tree
+	for (int i = static_cast<int>(m_nodes.size()) - 1; i >= 0; --i) {
+		if (!m_nodes[i].IsLeaf()) {
+			UpdateNode(i);
+		}
+	}
+
+	for (auto iter = orphanedLeaves.begin(); iter != orphanedLeaves.end(); ++iter) {
+		RemoveLeaf(*iter);
+		FreeNode(*iter);
+	}
+
+	// Then add the proxies that were created meanwhile
+	for (uint i = 0; i < m_proxies.size(); ++i) {
+		Proxy &proxy = m_proxies[i];
+		if (proxy.Node == kNullNode) {
+			continue;
+		}
+
+		if (newLeaves[i] == kNullNode) {
+			int leaf = AllocateNode();
+			m_nodes[leaf].AABBMin = proxy.AABBMin;
+			m_nodes[leaf].AABBMax = proxy.AABBMax;
+			m_nodes[leaf].Proxy = i;
+			InsertLeaf(leaf);
+			proxy.Node = leaf;
+		} else {
+			proxy.Node = newLeaves[i];
+		}
+	}
+}
+
+} // End of namespace Scene
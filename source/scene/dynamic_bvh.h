@@ -0,0 +1,204 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "common/typedefs.h"
+
+#include "scene/frustum_culler.h"
+
+#include <DirectXMath.h>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+
+namespace Common {
+class ThreadPool;
+}
+
+namespace Scene {
+
+/**
+ * A bounding volume hierarchy over a changing set of world space AABBs. IE. the bounds of the
+ * models and instances of a scene
+ *
+ * Each box is a 'proxy'. A proxy keeps its id for as long as it exists, no matter how the tree
+ * is restructured, and carries a piece of user data (IE. an object index) that the queries return.
+ *
+ * The tree can be built from scratch with a binned SAH build, or grown incrementally with
+ * CreateProxy(). Moving a proxy only flags the path to the root as dirty. Refit() then updates
+ * the dirty nodes bottom-up, and applies tree rotations to keep the surface area in check. When
+ * the objects have moved so much that rotations can't keep up, RebuildAsync() builds a new tree
+ * on a worker thread while the old one keeps answering queries.
+ */
+class DynamicBVH {
+public:
+	DynamicBVH();
+
+	static const int kNullNode = -1;
+	/** The number of bins the SAH build sorts the centroids into, per axis */
+	static const uint kSAHBinCount = 16u;
+
+private:
+	struct Node {
+		DirectX::XMFLOAT3 AABBMin;
+		int Parent;
+		DirectX::XMFLOAT3 AABBMax;
+		/** 0 for a leaf. Otherwise, 1 + the height of the taller child */
+		int Height;
+		/** kNullNode for a leaf */
+		int Child1;
+		int Child2;
+		/** The proxy of a leaf */
+		uint Proxy;
+		/** Set when the bounds of a descendant changed. Cleared by Refit() */
+		bool Dirty;
+
+		inline bool IsLeaf() const { return Child1 == kNullNode; }
+	};
+
+	struct Proxy {
+		DirectX::XMFLOAT3 AABBMin;
+		DirectX::XMFLOAT3 AABBMax;
+		uint UserData;
+		/** The leaf of the proxy, or kNullNode if the proxy was destroyed */
+		int Node;
+	};
+
+	struct BuildPrimitive {
+		DirectX::XMFLOAT3 AABBMin;
+		DirectX::XMFLOAT3 AABBMax;
+		DirectX::XMFLOAT3 Centroid;
+		uint Proxy;
+	};
+
+	/** The state shared between the tree and a rebuild running on a worker thread */
+	struct RebuildJob {
+		std::vector<BuildPrimitive> Primitives;
+		std::vector<Node> Nodes;
+		int Root;
+		std::atomic<bool> Finished;
+	};
+
+	std::vector<Node> m_nodes;
+	std::vector<int> m_freeNodes;
+	int m_root;
+
+	std::vector<Proxy> m_proxies;
+	std::vector<uint> m_freeProxies;
+	/** Proxies destroyed while a rebuild is running. Their ids are only reused once it finishes */
+	std::vector<uint> m_pendingFreeProxies;
+	uint m_proxyCount;
+
+	/** The nodes flagged dirty since the last Refit() */
+	std::vector<int> m_dirtyNodes;
+
+	std::shared_ptr<RebuildJob> m_rebuildJob;
+
+	uint m_rotationCount;
+
+public:
+	/**
+	 * Adds a box to the tree
+	 *
+	 * @param aabbMin     The world space minimum of the box
+	 * @param aabbMax     The world space maximum of the box
+	 * @param userData    Returned by the queries for this box
+	 * @return            The id of the proxy
+	 */
+	uint CreateProxy(const DirectX::XMFLOAT3 &aabbMin, const DirectX::XMFLOAT3 &aabbMax, uint userData);
+	void DestroyProxy(uint proxyId);
+	/** Changes the bounds of a proxy. The tree isn't valid for queries until the next Refit() */
+	void MoveProxy(uint proxyId, const DirectX::XMFLOAT3 &aabbMin, const DirectX::XMFLOAT3 &aabbMax);
+	/** Removes every proxy. Waits for a running rebuild to finish first */
+	void Clear();
+
+	inline uint GetUserData(uint proxyId) const { return m_proxies[proxyId].UserData; }
+	inline uint GetProxyCount() const { return m_proxyCount; }
+	inline uint GetNodeCount() const { return static_cast<uint>(m_nodes.size() - m_freeNodes.size()); }
+	/** Returns the height of the tree. A single leaf has a height of 0 */
+	inline int GetHeight() const { return m_root == kNullNode ? 0 : m_nodes[m_root].Height; }
+	/** Returns the number of rotations Refit() and CreateProxy() have applied so far */
+	inline uint GetRotationCount() const { return m_rotationCount; }
+	/** Returns the sum of the surface areas of the internal nodes, divided by the surface area of the root. Lower is better */
+	float GetSurfaceAreaRatio() const;
+
+	/** Updates the bounds of the nodes above the proxies moved since the last Refit(), and rotates them where it helps */
+	void Refit();
+	/** Replaces the tree with a binned SAH build of the current proxies */
+	void Rebuild();
+	/**
+	 * Starts a binned SAH build of the current proxies on a worker thread. The current tree stays
+	 * usable in the meantime. Proxies can still be created, destroyed and moved, and are patched
+	 * into the new tree when it's swapped in
+	 *
+	 * Does nothing if a rebuild is already running
+	 */
+	void RebuildAsync(Common::ThreadPool *threadPool);
+	inline bool IsRebuilding() const { return m_rebuildJob != nullptr; }
+	/**
+	 * Swaps in the tree of a finished RebuildAsync()
+	 *
+	 * @param wait    If true, waits for the rebuild to finish. Otherwise, returns false if it's still running
+	 * @return        True if a new tree was swapped in
+	 */
+	bool FinishRebuild(bool wait = false);
+
+	/** Appends the user data of every proxy whose box intersects the frustum */
+	void QueryFrustum(const Frustum &frustum, std::vector<uint> *out_userData) const;
+	/** Appends the user data of every proxy whose box intersects the sphere */
+	void QuerySphere(const DirectX::XMFLOAT3 &center, float radius, std::vector<uint> *out_userData) const;
+	/** Appends the user data of every proxy whose box intersects the box */
+	void QueryAABB(const DirectX::XMFLOAT3 &aabbMin, const DirectX::XMFLOAT3 &aabbMax, std::vector<uint> *out_userData) const;
+	/**
+	 * Appends the user data of every proxy whose box the ray hits
+	 *
+	 * @param origin         The start of the ray
+	 * @param direction      The direction of the ray. Doesn't need to be normalized
+	 * @param maxDistance    Boxes further along the ray than this, in multiples of 'direction', are ignored
+	 */
+	void QueryRay(const DirectX::XMFLOAT3 &origin, const DirectX::XMFLOAT3 &direction, float maxDistance, std::vector<uint> *out_userData) const;
+
+	/**
+	 * Tests a single box against a ray, with the same math as QueryRay()
+	 *
+	 * @param out_distance    [Optional] Will be filled with the distance along the ray where it enters the box
+	 */
+	static bool RayIntersectsAABB(const DirectX::XMFLOAT3 &origin, const DirectX::XMFLOAT3 &inverseDirection, float maxDistance, const DirectX::XMFLOAT3 &aabbMin, const DirectX::XMFLOAT3 &aabbMax, float *out_distance = nullptr);
+
+private:
+	int AllocateNode();
+	void FreeNode(int node);
+
+	void InsertLeaf(int leaf);
+	void RemoveLeaf(int leaf);
+	/** Recalculates the bounds and the height of an internal node from its children */
+	void UpdateNode(int node);
+	/** Tries swapping a child of 'node' with a grandchild, if it lowers the surface area of the other child */
+	void Rotate(int node);
+	/** Flags 'node' and its ancestors dirty, stopping at the first one that already is */
+	void MarkDirty(int node);
+
+	/**
+	 * A top down binned SAH build. Every primitive becomes a leaf
+	 *
+	 * @param primitives    The primitives to build from. They're reordered
+	 * @param out_nodes     Will be filled with the nodes
+	 * @return              The root node, or kNullNode if there were no primitives
+	 */
+	static int BuildSAH(std::vector<BuildPrimitive> &primitives, std::vector<Node> *out_nodes);
+	void SnapshotPrimitives(std::vector<BuildPrimitive> *out_primitives) const;
+	/** Installs a freshly built tree, and patches in the proxy changes made while it was built */
+	void InstallTree(std::vector<Node> &nodes, int root);
+
+	// Not implemented
+	DynamicBVH(const DynamicBVH &);
+	DynamicBVH &operator=(const DynamicBVH &);
+};
+
+} // End of namespace Scene
@@ -0,0 +1,352 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "scene/frustum_culler.h"
+
+#include "common/halfling_sys.h"
+#include "common/thread_pool.h"
+
+#include <immintrin.h>
+#include <intrin.h>
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+
+namespace Scene {
+
+Frustum ExtractFrustum(DirectX::CXMMATRIX viewProj) {
+	// Clip space x = dot(position, column 0), etc. So the planes are sums of the columns
+	DirectX::XMMATRIX columns = DirectX::XMMatrixTranspose(viewProj);
+
+	DirectX::XMVECTOR planes[6];
+	planes[0] = DirectX::XMVectorAdd(columns.r[3], columns.r[0]);      // Left:   -w <= x
+	planes[1] = DirectX::XMVectorSubtract(columns.r[3], columns.r[0]); // Right:   x <= w
+	planes[2] = DirectX::XMVectorAdd(columns.r[3], columns.r[1]);      // Bottom: -w <= y
+	planes[3] = DirectX::XMVectorSubtract(columns.r[3], columns.r[1]); // Top:     y <= w
+	planes[4] = columns.r[2];                                          // 0 <= z
+	planes[5] = DirectX::XMVectorSubtract(columns.r[3], columns.r[2]); // z <= w
+
+	Frustum frustum;
+	for (uint i = 0; i < 6; ++i) {
+		float length = DirectX::XMVectorGetX(DirectX::XMVector3Length(planes[i]));
+
+		// An infinite far plane degenerates to (0, 0, 0, w)
+		if (length < 1.0e-6f) {
+			frustum.Planes[i] = DirectX::XMFLOAT4(0.0f, 0.0f, 0.0f, 1.0f);
+		} else {
+			DirectX::XMStoreFloat4(&frustum.Planes[i], DirectX::XMVectorScale(planes[i], 1.0f / length));
+		}
+	}
+
+	return frustum;
+}
+
+const char *GetCullingPathName(CullingPath path) {
+	switch (path) {
+	case CullingPath::SSE:
+		return "sse";
+	case CullingPath::AVX:
+		return "avx";
+	default:
+		return "scalar";
+	}
+}
+
+CullingPath ParseCullingPathFromString(const std::string &inputString, CullingPath defaultPath) {
+	if (_stricmp(inputString.c_str(), "scalar") == 0) {
+		return CullingPath::SCALAR;
+	} else if (_stricmp(inputString.c_str(), "sse") == 0) {
+		return CullingPath::SSE;
+	} else if (_stricmp(inputString.c_str(), "avx") == 0) {
+		return CullingPath::AVX;
+	} else {
+		return defaultPath;
+	}
+}
+
+
+FrustumCuller::FrustumCuller(uint initialCapacity)
+		: m_count(0u),
+		  m_path(GetFastestSupportedPath()) {
+	uint paddedCapacity = (initialCapacity + kPadding - 1u) & ~(kPadding - 1u);
+	m_centerX.reserve(paddedCapacity);
+	m_centerY.reserve(paddedCapacity);
+	m_centerZ.reserve(paddedCapacity);
+	m_extentX.reserve(paddedCapacity);
+	m_extentY.reserve(paddedCapacity);
+	m_extentZ.reserve(paddedCapacity);
+}
+
+uint FrustumCuller::Add(const DirectX::XMFLOAT3 &aabbMin, const DirectX::XMFLOAT3 &aabbMax) {
+	uint index = m_count++;
+
+	if (index % kPadding == 0u) {
+		// NaN fails every comparison, so the padding is never visible
+		float nan = std::numeric_limits<float>::quiet_NaN();
+		size_t paddedSize = m_centerX.size() + kPadding;
+		m_centerX.resize(paddedSize, nan);
+		m_centerY.resize(paddedSize, nan);
+		m_centerZ.resize(paddedSize, nan);
+		m_extentX.resize(paddedSize, nan);
+		m_extentY.resize(paddedSize, nan);
+		m_extentZ.resize(paddedSize, nan);
+	}
+
+	Set(index, aabbMin, aabbMax);
+
+	return index;
+}
+
+void FrustumCuller::Set(uint index, const DirectX::XMFLOAT3 &aabbMin, const DirectX::XMFLOAT3 &aabbMax) {
+	AssertMsg(index < m_count, "Box " << index << " hasn't been added to the FrustumCuller");
+
+	m_centerX[index] = (aabbMin.x + aabbMax.x) * 0.5f;
+	m_centerY[index] = (aabbMin.y + aabbMax.y) * 0.5f;
+	m_centerZ[index] = (aabbMin.z + aabbMax.z) * 0.5f;
+	m_extentX[index] = (aabbMax.x - aabbMin.x) * 0.5f;
+	m_extentY[index] = (aabbMax.y - aabbMin.y) * 0.5f;
+	m_extentZ[index] = (aabbMax.z - aabbMin.z) * 0.5f;
+}
+
+void FrustumCuller::Clear() {
+	m_centerX.clear();
+	m_centerY.clear();
+	m_centerZ.clear();
+	m_extentX.clear();
+	m_extentY.clear();
+	m_extentZ.clear();
+	m_count = 0u;
+}
+
+void FrustumCuller::GetBounds(DirectX::XMFLOAT3 *out_min, DirectX::XMFLOAT3 *out_max) const {
+	*out_min = DirectX::XMFLOAT3(FLT_MAX, FLT_MAX, FLT_MAX);
+	*out_max = DirectX::XMFLOAT3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	for (uint i = 0; i < m_count; ++i) {
+		out_min->x = std::min(out_min->x, m_centerX[i] - m_extentX[i]);
+		out_min->y = std::min(out_min->y, m_centerY[i] - m_extentY[i]);
+		out_min->z = std::min(out_min->z, m_centerZ[i] - m_extentZ[i]);
+		out_max->x = std::max(out_max->x, m_centerX[i] + m_extentX[i]);
+		out_max->y = std::max(out_max->y, m_centerY[i] + m_extentY[i]);
+		out_max->z = std::max(out_max->z, m_centerZ[i] + m_extentZ[i]);
+	}
+}
+
+void FrustumCuller::SetPath(CullingPath path) {
+	if (path == CullingPath::AVX && GetFastestSupportedPath() != CullingPath::AVX) {
+		path = GetFastestSupportedPath();
+	}
+
+	m_path = path;
+}
+
+uint FrustumCuller::Cull(const Frustum &frustum, std::vector<uint> *out_visible, Common::ThreadPool *threadPool) {
+	return Cull(frustum.Planes, 6u, out_visible, threadPool);
+}
+
+uint FrustumCuller::Cull(const ConvexVolume &volume, std::vector<uint> *out_visible, Common::ThreadPool *threadPool) {
+	AssertMsg(volume.PlaneCount <= ConvexVolume::kMaxPlanes, "The volume has too many planes");
+	return Cull(volume.Planes, volume.PlaneCount, out_visible, threadPool);
+}
+
+uint FrustumCuller::Cull(const DirectX::XMFLOAT4 *planes, uint planeCount, std::vector<uint> *out_visible, Common::ThreadPool *threadPool) {
+	// The SIMD paths run into the padding, rather than handling a remainder
+	uint end = m_path == CullingPath::SCALAR ? m_count : static_cast<uint>(m_centerX.size());
+
+	if (threadPool == nullptr || end <= kChunkSize) {
+		out_visible->resize(std::max(end, 1u));
+		uint visibleCount = CullRange(planes, planeCount, 0u, end, &(*out_visible)[0]);
+		out_visible->resize(visibleCount);
+
+		return visibleCount;
+	}
+
+	// Each chunk writes into its own region, then the regions are packed together
+	uint chunkCount = (end + kChunkSize - 1u) / kChunkSize;
+	m_chunkVisible.resize(end);
+	m_chunkVisibleCounts.resize(chunkCount);
+
+	threadPool->ParallelFor(end, kChunkSize, [&](uint begin, uint chunkEnd) {
+		m_chunkVisibleCounts[begin / kChunkSize] = CullRange(planes, planeCount, begin, chunkEnd, &m_chunkVisible[begin]);
+	});
+
+	uint visibleCount = 0u;
+	for (uint i = 0; i < chunkCount; ++i) {
+		visibleCount += m_chunkVisibleCounts[i];
+	}
+
+	out_visible->resize(std::max(visibleCount, 1u));
+	uint *output = &(*out_visible)[0];
+	for (uint i = 0; i < chunkCount; ++i) {
+		memcpy(output, &m_chunkVisible[i * kChunkSize], m_chunkVisibleCounts[i] * sizeof(uint));
+		output += m_chunkVisibleCounts[i];
+	}
+	out_visible->resize(visibleCount);
+
+	return visibleCount;
+}
+
+CullingPath FrustumCuller::GetFastestSupportedPath() {
+	int cpuInfo[4];
+	__cpuid(cpuInfo, 1);
+
+	// AVX needs the CPU to support it, *and* the OS to save the YMM registers on a context switch
+	bool osSavesYmm = false;
+	bool cpuSupportsAvx = (cpuInfo[2] & (1 << 28)) != 0;
+	bool cpuSupportsXsave = (cpuInfo[2] & (1 << 27)) != 0;
+	if (cpuSupportsAvx && cpuSupportsXsave) {
+		osSavesYmm = (_xgetbv(0) & 0x6) == 0x6;
+	}
+
+	return osSavesYmm ? CullingPath::AVX : CullingPath::SSE;
+}
+
+void FrustumCuller::TransformAABB(DirectX::CXMMATRIX world, const DirectX::XMFLOAT3 &localMin, const DirectX::XMFLOAT3 &localMax, DirectX::XMFLOAT3 *out_min, DirectX::XMFLOAT3 *out_max) {
+	DirectX::XMVECTOR min = DirectX::XMLoadFloat3(&localMin);
+	DirectX::XMVECTOR max = DirectX::XMLoadFloat3(&localMax);
+	DirectX::XMVECTOR center = DirectX::XMVectorScale(DirectX::XMVectorAdd(min, max), 0.5f);
+	DirectX::XMVECTOR extent = DirectX::XMVectorScale(DirectX::XMVectorSubtract(max, min), 0.5f);
+
+	// The world extent is the local extent transformed by the absolute value of the rotation / scale
+	DirectX::XMVECTOR worldCenter = DirectX::XMVector3Transform(center, world);
+	DirectX::XMVECTOR worldExtent = DirectX::XMVectorMultiply(DirectX::XMVectorSplatX(extent), DirectX::XMVectorAbs(world.r[0]));
+	worldExtent = DirectX::XMVectorMultiplyAdd(DirectX::XMVectorSplatY(extent), DirectX::XMVectorAbs(world.r[1]), worldExtent);
+	worldExtent = DirectX::XMVectorMultiplyAdd(DirectX::XMVectorSplatZ(extent), DirectX::XMVectorAbs(world.r[2]), worldExtent);
+
+	DirectX::XMStoreFloat3(out_min, DirectX::XMVectorSubtract(worldCenter, worldExtent));
+	DirectX::XMStoreFloat3(out_max, DirectX::XMVectorAdd(worldCenter, worldExtent));
+}
+
+uint FrustumCuller::CullRange(const DirectX::XMFLOAT4 *planes, uint planeCount, uint begin, uint end, uint *out_visible) const {
+	switch (m_path) {
+	case CullingPath::AVX:
+		return CullRangeAVX(planes, planeCount, begin, end, out_visible);
+	case CullingPath::SSE:
+		return CullRangeSSE(planes, planeCount, begin, end, out_visible);
+	default:
+		return CullRangeScalar(planes, planeCount, begin, std::min(end, m_count), out_visible);
+	}
+}
+
+uint FrustumCuller::CullRangeScalar(const DirectX::XMFLOAT4 *planes, uint planeCount, uint begin, uint end, uint *out_visible) const {
+	uint visibleCount = 0u;
+	for (uint i = begin; i < end; ++i) {
+		bool visible = true;
+		for (uint p = 0; p < planeCount; ++p) {
+			const DirectX::XMFLOAT4 &plane = planes[p];
+
+			// The distance of the center from the plane, and the 'radius' of the box along the plane normal
+			// Summed in the same order as the SIMD paths, so all the paths give the same result
+			float distance = (plane.x * m_centerX[i] + plane.y * m_centerY[i]) + (plane.z * m_centerZ[i] + plane.w);
+			float radius = std::fabs(plane.x) * m_extentX[i] + std::fabs(plane.y) * m_extentY[i] + std::fabs(plane.z) * m_extentZ[i];
+			if (distance + radius < 0.0f) {
+				visible = false;
+				break;
+			}
+		}
+
+		if (visible) {
+			out_visible[visibleCount++] = i;
+		}
+	}
+
+	return visibleCount;
+}
+
+uint FrustumCuller::CullRangeSSE(const DirectX::XMFLOAT4 *planes, uint planeCount, uint begin, uint end, uint *out_visible) const {
+	// Splat the planes once
+	__m128 planeX[ConvexVolume::kMaxPlanes], planeY[ConvexVolume::kMaxPlanes], planeZ[ConvexVolume::kMaxPlanes], planeW[ConvexVolume::kMaxPlanes];
+	__m128 absPlaneX[ConvexVolume::kMaxPlanes], absPlaneY[ConvexVolume::kMaxPlanes], absPlaneZ[ConvexVolume::kMaxPlanes];
+	for (uint p = 0; p < planeCount; ++p) {
+		planeX[p] = _mm_set1_ps(planes[p].x);
+		planeY[p] = _mm_set1_ps(planes[p].y);
+		planeZ[p] = _mm_set1_ps(planes[p].z);
+		planeW[p] = _mm_set1_ps(planes[p].w);
+		absPlaneX[p] = _mm_set1_ps(std::fabs(planes[p].x));
+		absPlaneY[p] = _mm_set1_ps(std::fabs(planes[p].y));
+		absPlaneZ[p] = _mm_set1_ps(std::fabs(planes[p].z));
+	}
+	const __m128 zero = _mm_setzero_ps();
+
+	uint visibleCount = 0u;
+	for (uint i = begin; i < end; i += 4u) {
+		__m128 centerX = _mm_load_ps(&m_centerX[i]);
+		__m128 centerY = _mm_load_ps(&m_centerY[i]);
+		__m128 centerZ = _mm_load_ps(&m_centerZ[i]);
+		__m128 extentX = _mm_load_ps(&m_extentX[i]);
+		__m128 extentY = _mm_load_ps(&m_extentY[i]);
+		__m128 extentZ = _mm_load_ps(&m_extentZ[i]);
+
+		__m128 visible = _mm_cmpeq_ps(zero, zero);
+		for (uint p = 0; p < planeCount; ++p) {
+			__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(planeX[p], centerX), _mm_mul_ps(planeY[p], centerY)), _mm_add_ps(_mm_mul_ps(planeZ[p], centerZ), planeW[p]));
+			__m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(absPlaneX[p], extentX), _mm_mul_ps(absPlaneY[p], extentY)), _mm_mul_ps(absPlaneZ[p], extentZ));
+			visible = _mm_and_ps(visible, _mm_cmpge_ps(_mm_add_ps(distance, radius), zero));
+		}
+
+		// Write every index, but only advance past the visible ones
+		int mask = _mm_movemask_ps(visible);
+		out_visible[visibleCount] = i;
+		visibleCount += mask & 1;
+		out_visible[visibleCount] = i + 1u;
+		visibleCount += (mask >> 1) & 1;
+		out_visible[visibleCount] = i + 2u;
+		visibleCount += (mask >> 2) & 1;
+		out_visible[visibleCount] = i + 3u;
+		visibleCount += (mask >> 3) & 1;
+	}
+
+	return visibleCount;
+}
+
+uint FrustumCuller::CullRangeAVX(const DirectX::XMFLOAT4 *planes, uint planeCount, uint begin, uint end, uint *out_visible) const {
+	__m256 planeX[ConvexVolume::kMaxPlanes], planeY[ConvexVolume::kMaxPlanes], planeZ[ConvexVolume::kMaxPlanes], planeW[ConvexVolume::kMaxPlanes];
+	__m256 absPlaneX[ConvexVolume::kMaxPlanes], absPlaneY[ConvexVolume::kMaxPlanes], absPlaneZ[ConvexVolume::kMaxPlanes];
+	for (uint p = 0; p < planeCount; ++p) {
+		planeX[p] = _mm256_set1_ps(planes[p].x);
+		planeY[p] = _mm256_set1_ps(planes[p].y);
+		planeZ[p] = _mm256_set1_ps(planes[p].z);
+		planeW[p] = _mm256_set1_ps(planes[p].w);
+		absPlaneX[p] = _mm256_set1_ps(std::fabs(planes[p].x));
+		absPlaneY[p] = _mm256_set1_ps(std::fabs(planes[p].y));
+		absPlaneZ[p] = _mm256_set1_ps(std::fabs(planes[p].z));
+	}
+	const __m256 zero = _mm256_setzero_ps();
+
+	uint visibleCount = 0u;
+	for (uint i = begin; i < end; i += 8u) {
+		// The arrays are only 16 byte aligned
+		__m256 centerX = _mm256_loadu_ps(&m_centerX[i]);
+		__m256 centerY = _mm256_loadu_ps(&m_centerY[i]);
+		__m256 centerZ = _mm256_loadu_ps(&m_centerZ[i]);
+		__m256 extentX = _mm256_loadu_ps(&m_extentX[i]);
+		__m256 extentY = _mm256_loadu_ps(&m_extentY[i]);
+		__m256 extentZ = _mm256_loadu_ps(&m_extentZ[i]);
+
+		__m256 visible = _mm256_cmp_ps(zero, zero, _CMP_EQ_OQ);
+		for (uint p = 0; p < planeCount; ++p) {
+			__m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(planeX[p], centerX), _mm256_mul_ps(planeY[p], centerY)), _mm256_add_ps(_mm256_mul_ps(planeZ[p], centerZ), planeW[p]));
+			__m256 radius = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(absPlaneX[p], extentX), _mm256_mul_ps(absPlaneY[p], extentY)), _mm256_mul_ps(absPlaneZ[p], extentZ));
+			visible = _mm256_and_ps(visible, _mm256_cmp_ps(_mm256_add_ps(distance, radius), zero, _CMP_GE_OQ));
+		}
+
+		int mask = _mm256_movemask_ps(visible);
+		for (uint lane = 0; lane < 8u; ++lane) {
+			out_visible[visibleCount] = i + lane;
+			visibleCount += (mask >> lane) & 1;
+		}
+	}
+
+	// Leave the upper halves of the YMM registers clean, so the SSE code after us doesn't pay for a transition
+	_mm256_zeroupper();
+
+	return visibleCount;
+}
+
+} // End of namespace Scene
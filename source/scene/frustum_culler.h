@@ -0,0 +1,166 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "common/typedefs.h"
+#include "common/allocator_16_byte_aligned.h"
+
+#include <DirectXMath.h>
+
+#include <string>
+#include <vector>
+
+
+namespace Common {
+class ThreadPool;
+}
+
+namespace Scene {
+
+/** The six planes of a view frustum */
+struct Frustum {
+	/**
+	 * Each plane is (normal.xyz, distance). The normals point into the frustum, and are normalized,
+	 * so a point is on the inside of a plane if dot(normal, point) + distance >= 0
+	 */
+	DirectX::XMFLOAT4 Planes[6];
+};
+
+/**
+ * Extracts the frustum planes of a view-projection matrix. Works for both normal and reversed depth.
+ * If the far plane is at infinity, it's replaced by a plane that everything is inside of
+ */
+Frustum ExtractFrustum(DirectX::CXMMATRIX viewProj);
+
+/**
+ * A convex volume bounded by up to kMaxPlanes planes, with the same plane conventions as Frustum.
+ * For volumes that aren't a view frustum, IE. a frustum extruded toward a light
+ */
+struct ConvexVolume {
+	static const uint kMaxPlanes = 20u;
+
+	DirectX::XMFLOAT4 Planes[kMaxPlanes];
+	uint PlaneCount;
+};
+
+/** Which instruction set FrustumCuller tests the boxes with */
+enum class CullingPath {
+	SCALAR = 0,
+	/** 4 boxes at a time */
+	SSE = 1,
+	/** 8 boxes at a time. Only used if the CPU and the OS support AVX */
+	AVX = 2
+};
+
+const char *GetCullingPathName(CullingPath path);
+CullingPath ParseCullingPathFromString(const std::string &inputString, CullingPath defaultPath);
+
+/**
+ * Tests a set of world space AABBs against a view frustum, or any other convex volume
+ *
+ * The boxes are stored as centers and extents in SoA form, so the SIMD paths can test 4 or 8
+ * boxes against a plane with a handful of multiply-adds. The arrays are padded to a multiple
+ * of 8 with NaNs, which always fail the test, so the SIMD loops never need a remainder.
+ *
+ * Cull() writes the indices of the visible boxes into a compact list, in ascending order. If a
+ * ThreadPool is given, the boxes are split into chunks that are culled in parallel.
+ */
+class FrustumCuller {
+public:
+	/**
+	 * @param initialCapacity    The number of boxes to reserve memory for
+	 */
+	FrustumCuller(uint initialCapacity = 0u);
+
+	/** The arrays are padded to a multiple of this, so the widest path never has a remainder */
+	static const uint kPadding = 8u;
+	/** The number of boxes in each chunk of a parallel cull. Must be a multiple of kPadding */
+	static const uint kChunkSize = 4096u;
+
+private:
+	typedef std::vector<float, Common::Allocator16ByteAligned<float> > FloatList;
+
+	FloatList m_centerX;
+	FloatList m_centerY;
+	FloatList m_centerZ;
+	FloatList m_extentX;
+	FloatList m_extentY;
+	FloatList m_extentZ;
+	uint m_count;
+
+	CullingPath m_path;
+
+	/** Each chunk of a parallel cull writes its visible indices here, at the offset of the chunk */
+	std::vector<uint> m_chunkVisible;
+	std::vector<uint> m_chunkVisibleCounts;
+
+public:
+	/**
+	 * Adds a box
+	 *
+	 * @param aabbMin    The world space minimum of the box
+	 * @param aabbMax    The world space maximum of the box
+	 * @return           The index of the box. Indices are handed out in order, starting from 0
+	 */
+	uint Add(const DirectX::XMFLOAT3 &aabbMin, const DirectX::XMFLOAT3 &aabbMax);
+	/** Moves a box that was added earlier */
+	void Set(uint index, const DirectX::XMFLOAT3 &aabbMin, const DirectX::XMFLOAT3 &aabbMax);
+	/** Removes every box */
+	void Clear();
+
+	inline uint GetSize() const { return m_count; }
+	/** Calculates the bounds of every box. Returns an inverted box (FLT_MAX, -FLT_MAX) if there aren't any */
+	void GetBounds(DirectX::XMFLOAT3 *out_min, DirectX::XMFLOAT3 *out_max) const;
+
+	/** Sets the path used by Cull(). Falls back to the fastest supported path if 'path' isn't supported */
+	void SetPath(CullingPath path);
+	inline CullingPath GetPath() const { return m_path; }
+
+	/**
+	 * Finds the boxes that intersect the frustum
+	 *
+	 * @param frustum        The frustum to test against
+	 * @param out_visible    Will be filled with the indices of the visible boxes, in ascending order
+	 * @param threadPool     [Optional] If not nullptr, the boxes are culled in parallel chunks
+	 * @return               The number of visible boxes
+	 */
+	uint Cull(const Frustum &frustum, std::vector<uint> *out_visible, Common::ThreadPool *threadPool = nullptr);
+	/** Same as above, for the boxes that intersect a convex volume */
+	uint Cull(const ConvexVolume &volume, std::vector<uint> *out_visible, Common::ThreadPool *threadPool = nullptr);
+
+	/** Returns the widest path the CPU and the OS support */
+	static CullingPath GetFastestSupportedPath();
+	/**
+	 * Transforms a local space AABB into a world space AABB that encloses it
+	 *
+	 * @param world       The local to world transform
+	 * @param localMin    The local space minimum of the box
+	 * @param localMax    The local space maximum of the box
+	 * @param out_min     Will be filled with the world space minimum
+	 * @param out_max     Will be filled with the world space maximum
+	 */
+	static void TransformAABB(DirectX::CXMMATRIX world, const DirectX::XMFLOAT3 &localMin, const DirectX::XMFLOAT3 &localMax, DirectX::XMFLOAT3 *out_min, DirectX::XMFLOAT3 *out_max);
+
+private:
+	uint Cull(const DirectX::XMFLOAT4 *planes, uint planeCount, std::vector<uint> *out_visible, Common::ThreadPool *threadPool);
+
+	/**
+	 * Culls the boxes in [begin, end). For the SIMD paths, 'begin' must be a multiple of the
+	 * SIMD width and 'end' may run into the padding
+	 *
+	 * @param planes         The planes to test against. At most ConvexVolume::kMaxPlanes
+	 * @param planeCount     The number of planes
+	 * @param out_visible    Receives the visible indices. Must have room for (end - begin) indices
+	 * @return               The number of visible boxes
+	 */
+	uint CullRangeScalar(const DirectX::XMFLOAT4 *planes, uint planeCount, uint begin, uint end, uint *out_visible) const;
+	uint CullRangeSSE(const DirectX::XMFLOAT4 *planes, uint planeCount, uint begin, uint end, uint *out_visible) const;
+	uint CullRangeAVX(const DirectX::XMFLOAT4 *planes, uint planeCount, uint begin, uint end, uint *out_visible) const;
+	uint CullRange(const DirectX::XMFLOAT4 *planes, uint planeCount, uint begin, uint end, uint *out_visible) const;
+};
+
+} // End of namespace Scene
@@ -163,6 +163,7 @@ Model *HalflingModelFile::Load(ID3D11Device *device, Engine::TextureManager *tex
 	// Create the model with the read data
 	Model *model = new Model();
 
+	model->KeepCPUGeometry(vertexData, vertexBufferDesc.ByteWidth / numVertices, numVertices, (uint *)indexData, numIndices);
 	model->CreateVertexBuffer(device, vertexData, numVertices, vertexBufferDesc);
 	model->CreateIndexBuffer(device, (uint *)indexData, numIndices, indexBufferDesc);
 	model->CreateSubsets(modelSubsets, numSubsets);
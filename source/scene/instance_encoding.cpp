@@ -0,0 +1,224 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "scene/instance_encoding.h"
+
+#include "common/halfling_sys.h"
+
+#include <DirectXPackedVector.h>
+
+
+namespace Scene {
+
+/**
+ * Converts the rotation part of 4 world matrices to quaternions, and pulls out their scale and translation
+ *
+ * The quaternions are found with Shepperd's method. Each lane picks whichever of w, x, y, or z
+ * is largest to divide by, so the result stays accurate for every rotation. All 4 cases are
+ * calculated for all 4 lanes, and the right one is selected per lane, so there are no branches.
+ *
+ * @param world                The world matrices, SoA. See PackInstanceTransforms()
+ * @param quaternions          Receives x, y, z, w of the 4 quaternions, SoA. w is always positive
+ * @param translationScale     Receives the translation x, y, z and the uniform scale of the 4 instances, SoA
+ */
+static void ExtractQuatScaleTranslation(const DirectX::XMVECTOR world[12], DirectX::XMVECTOR quaternions[4], DirectX::XMVECTOR translationScale[4]) {
+	const DirectX::XMVECTOR one = DirectX::XMVectorReplicate(1.0f);
+	const DirectX::XMVECTOR quarter = DirectX::XMVectorReplicate(0.25f);
+	const DirectX::XMVECTOR half = DirectX::XMVectorReplicate(0.5f);
+	const DirectX::XMVECTOR epsilon = DirectX::XMVectorReplicate(1.0e-12f);
+
+	// The rows of the upper 3x3 are the scaled basis vectors. Normalize them to get the rotation
+	DirectX::XMVECTOR rotation[9];
+	DirectX::XMVECTOR scale = DirectX::XMVectorZero();
+	for (uint row = 0; row < 3; ++row) {
+		DirectX::XMVECTOR lengthSq = DirectX::XMVectorMultiply(world[row * 3u + 0u], world[row * 3u + 0u]);
+		lengthSq = DirectX::XMVectorMultiplyAdd(world[row * 3u + 1u], world[row * 3u + 1u], lengthSq);
+		lengthSq = DirectX::XMVectorMultiplyAdd(world[row * 3u + 2u], world[row * 3u + 2u], lengthSq);
+		DirectX::XMVECTOR length = DirectX::XMVectorSqrt(DirectX::XMVectorMax(lengthSq, epsilon));
+
+		DirectX::XMVECTOR invLength = DirectX::XMVectorReciprocal(length);
+		for (uint column = 0; column < 3; ++column) {
+			rotation[row * 3u + column] = DirectX::XMVectorMultiply(world[row * 3u + column], invLength);
+		}
+		scale = DirectX::XMVectorAdd(scale, length);
+	}
+	scale = DirectX::XMVectorMultiply(scale, DirectX::XMVectorReplicate(1.0f / 3.0f));
+
+	const DirectX::XMVECTOR &m00 = rotation[0];
+	const DirectX::XMVECTOR &m01 = rotation[1];
+	const DirectX::XMVECTOR &m02 = rotation[2];
+	const DirectX::XMVECTOR &m10 = rotation[3];
+	const DirectX::XMVECTOR &m11 = rotation[4];
+	const DirectX::XMVECTOR &m12 = rotation[5];
+	const DirectX::XMVECTOR &m20 = rotation[6];
+	const DirectX::XMVECTOR &m21 = rotation[7];
+	const DirectX::XMVECTOR &m22 = rotation[8];
+
+	// 4 * component^2 for each of the cases
+	DirectX::XMVECTOR traceW = DirectX::XMVectorAdd(one, DirectX::XMVectorAdd(m00, DirectX::XMVectorAdd(m11, m22)));
+	DirectX::XMVECTOR traceX = DirectX::XMVectorAdd(one, DirectX::XMVectorSubtract(m00, DirectX::XMVectorAdd(m11, m22)));
+	DirectX::XMVECTOR traceY = DirectX::XMVectorAdd(one, DirectX::XMVectorSubtract(m11, DirectX::XMVectorAdd(m00, m22)));
+	DirectX::XMVECTOR traceZ = DirectX::XMVectorAdd(one, DirectX::XMVectorSubtract(m22, DirectX::XMVectorAdd(m00, m11)));
+
+	DirectX::XMVECTOR sum01 = DirectX::XMVectorAdd(m01, m10);
+	DirectX::XMVECTOR sum02 = DirectX::XMVectorAdd(m02, m20);
+	DirectX::XMVECTOR sum12 = DirectX::XMVectorAdd(m12, m21);
+	DirectX::XMVECTOR difference01 = DirectX::XMVectorSubtract(m01, m10);
+	DirectX::XMVECTOR difference20 = DirectX::XMVectorSubtract(m20, m02);
+	DirectX::XMVECTOR difference12 = DirectX::XMVectorSubtract(m12, m21);
+
+	// W is largest
+	DirectX::XMVECTOR largest = DirectX::XMVectorMultiply(half, DirectX::XMVectorSqrt(DirectX::XMVectorMax(traceW, epsilon)));
+	DirectX::XMVECTOR factor = DirectX::XMVectorDivide(quarter, largest);
+	DirectX::XMVECTOR x = DirectX::XMVectorMultiply(difference12, factor);
+	DirectX::XMVECTOR y = DirectX::XMVectorMultiply(difference20, factor);
+	DirectX::XMVECTOR z = DirectX::XMVectorMultiply(difference01, factor);
+	DirectX::XMVECTOR w = largest;
+	DirectX::XMVECTOR bestTrace = traceW;
+
+	// X is largest
+	DirectX::XMVECTOR select = DirectX::XMVectorGreater(traceX, bestTrace);
+	largest = DirectX::XMVectorMultiply(half, DirectX::XMVectorSqrt(DirectX::XMVectorMax(traceX, epsilon)));
+	factor = DirectX::XMVectorDivide(quarter, largest);
+	x = DirectX::XMVectorSelect(x, largest, select);
+	y = DirectX::XMVectorSelect(y, DirectX::XMVectorMultiply(sum01, factor), select);
+	z = DirectX::XMVectorSelect(z, DirectX::XMVectorMultiply(sum02, factor), select);
+	w = DirectX::XMVectorSelect(w, DirectX::XMVectorMultiply(difference12, factor), select);
+	bestTrace = DirectX::XMVectorMax(bestTrace, traceX);
+
+	// Y is largest
+	select = DirectX::XMVectorGreater(traceY, bestTrace);
+	largest = DirectX::XMVectorMultiply(half, DirectX::XMVectorSqrt(DirectX::XMVectorMax(traceY, epsilon)));
+	factor = DirectX::XMVectorDivide(quarter, largest);
+	x = DirectX::XMVectorSelect(x, DirectX::XMVectorMultiply(sum01, factor), select);
+	y = DirectX::XMVectorSelect(y, largest, select);
+	z = DirectX::XMVectorSelect(z, DirectX::XMVectorMultiply(sum12, factor), select);
+	w = DirectX::XMVectorSelect(w, DirectX::XMVectorMultiply(difference20, factor), select);
+	bestTrace = DirectX::XMVectorMax(bestTrace, traceY);
+
+	// Z is largest
+	select = DirectX::XMVectorGreater(traceZ, bestTrace);
+	largest = DirectX::XMVectorMultiply(half, DirectX::XMVectorSqrt(DirectX::XMVectorMax(traceZ, epsilon)));
+	factor = DirectX::XMVectorDivide(quarter, largest);
+	x = DirectX::XMVectorSelect(x, DirectX::XMVectorMultiply(sum02, factor), select);
+	y = DirectX::XMVectorSelect(y, DirectX::XMVectorMultiply(sum12, factor), select);
+	z = DirectX::XMVectorSelect(z, largest, select);
+	w = DirectX::XMVectorSelect(w, DirectX::XMVectorMultiply(difference01, factor), select);
+
+	// Renormalize to clean up any scale / shear that was left in the rotation
+	// and flip to the hemisphere with positive w, so the encoding is unique
+	DirectX::XMVECTOR lengthSq = DirectX::XMVectorMultiply(x, x);
+	lengthSq = DirectX::XMVectorMultiplyAdd(y, y, lengthSq);
+	lengthSq = DirectX::XMVectorMultiplyAdd(z, z, lengthSq);
+	lengthSq = DirectX::XMVectorMultiplyAdd(w, w, lengthSq);
+	DirectX::XMVECTOR invLength = DirectX::XMVectorReciprocal(DirectX::XMVectorSqrt(lengthSq));
+	invLength = DirectX::XMVectorSelect(invLength, DirectX::XMVectorNegate(invLength), DirectX::XMVectorLess(w, DirectX::XMVectorZero()));
+
+	quaternions[0] = DirectX::XMVectorMultiply(x, invLength);
+	quaternions[1] = DirectX::XMVectorMultiply(y, invLength);
+	quaternions[2] = DirectX::XMVectorMultiply(z, invLength);
+	quaternions[3] = DirectX::XMVectorMultiply(w, invLength);
+
+	translationScale[0] = world[9];
+	translationScale[1] = world[10];
+	translationScale[2] = world[11];
+	translationScale[3] = scale;
+}
+
+void PackInstanceTransforms(InstanceEncoding encoding, const DirectX::XMVECTOR world[12], DirectX::XMVECTOR *output) {
+	if (encoding == InstanceEncoding::AFFINE_3X4) {
+		for (uint column = 0; column < 3; ++column) {
+			// Transpose from one element of 4 instances per vector, to one column of 1 instance per vector
+			DirectX::XMMATRIX worldColumn;
+			for (uint row = 0; row < 4; ++row) {
+				worldColumn.r[row] = world[row * 3u + column];
+			}
+			worldColumn = DirectX::XMMatrixTranspose(worldColumn);
+
+			for (uint lane = 0; lane < 4; ++lane) {
+				output[lane * 3u + column] = worldColumn.r[lane];
+			}
+		}
+
+		return;
+	}
+
+	DirectX::XMMATRIX quaternions;
+	DirectX::XMMATRIX translationScale;
+	ExtractQuatScaleTranslation(world, quaternions.r, translationScale.r);
+	quaternions = DirectX::XMMatrixTranspose(quaternions);
+	translationScale = DirectX::XMMatrixTranspose(translationScale);
+
+	if (encoding == InstanceEncoding::QUAT_SCALE_TRANSLATION) {
+		for (uint lane = 0; lane < 4; ++lane) {
+			output[lane * 2u] = quaternions.r[lane];
+			output[lane * 2u + 1u] = translationScale.r[lane];
+		}
+	} else {
+		for (uint lane = 0; lane < 4; ++lane) {
+			DirectX::PackedVector::XMHALF4 *halfs = reinterpret_cast<DirectX::PackedVector::XMHALF4 *>(&output[lane]);
+			DirectX::PackedVector::XMStoreHalf4(&halfs[0], quaternions.r[lane]);
+			DirectX::PackedVector::XMStoreHalf4(&halfs[1], translationScale.r[lane]);
+		}
+	}
+}
+
+DirectX::XMMATRIX UnpackInstanceTransform(InstanceEncoding encoding, const DirectX::XMVECTOR *input) {
+	if (encoding == InstanceEncoding::AFFINE_3X4) {
+		DirectX::XMMATRIX columns;
+		columns.r[0] = input[0];
+		columns.r[1] = input[1];
+		columns.r[2] = input[2];
+		columns.r[3] = DirectX::XMVectorSet(0.0f, 0.0f, 0.0f, 1.0f);
+
+		return DirectX::XMMatrixTranspose(columns);
+	}
+
+	DirectX::XMVECTOR quaternion;
+	DirectX::XMVECTOR translationScale;
+	if (encoding == InstanceEncoding::QUAT_SCALE_TRANSLATION) {
+		quaternion = input[0];
+		translationScale = input[1];
+	} else {
+		const DirectX::PackedVector::XMHALF4 *halfs = reinterpret_cast<const DirectX::PackedVector::XMHALF4 *>(input);
+		quaternion = DirectX::PackedVector::XMLoadHalf4(&halfs[0]);
+		translationScale = DirectX::PackedVector::XMLoadHalf4(&halfs[1]);
+	}
+
+	DirectX::XMMATRIX world = DirectX::XMMatrixRotationQuaternion(quaternion);
+	float scale = DirectX::XMVectorGetW(translationScale);
+	world.r[0] = DirectX::XMVectorScale(world.r[0], scale);
+	world.r[1] = DirectX::XMVectorScale(world.r[1], scale);
+	world.r[2] = DirectX::XMVectorScale(world.r[2], scale);
+	world.r[3] = DirectX::XMVectorSetW(translationScale, 1.0f);
+
+	return world;
+}
+
+const char *GetInstanceEncodingName(InstanceEncoding encoding) {
+	switch (encoding) {
+	case InstanceEncoding::QUAT_SCALE_TRANSLATION:
+		return "quat_scale_translation";
+	case InstanceEncoding::QUAT_SCALE_TRANSLATION_HALF:
+		return "quat_scale_translation_half";
+	default:
+		return "affine_3x4";
+	}
+}
+
+InstanceEncoding ParseInstanceEncodingFromString(const std::string &inputString, InstanceEncoding defaultEncoding) {
+	if (_stricmp(inputString.c_str(), "affine_3x4") == 0) {
+		return InstanceEncoding::AFFINE_3X4;
+	} else if (_stricmp(inputString.c_str(), "quat_scale_translation") == 0) {
+		return InstanceEncoding::QUAT_SCALE_TRANSLATION;
+	} else if (_stricmp(inputString.c_str(), "quat_scale_translation_half") == 0) {
+		return InstanceEncoding::QUAT_SCALE_TRANSLATION_HALF;
+	} else {
+		return defaultEncoding;
+	}
+}
+
+} // End of namespace Scene
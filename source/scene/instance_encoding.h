@@ -0,0 +1,73 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "common/typedefs.h"
+
+#include <DirectXMath.h>
+
+#include <string>
+
+
+namespace Scene {
+
+/**
+ * How an instance transform is laid out in the instance buffer. Every encoding is made of
+ * whole float4, so they can all be read from a StructuredBuffer<float4>.
+ * The matching HLSL decode functions are in graphics/shaders/instance_encoding.hlsli
+ */
+enum class InstanceEncoding {
+	/** The first three columns of the world matrix. 3 float4, 48 bytes. Exact */
+	AFFINE_3X4 = 0,
+	/**
+	 * A rotation quaternion, then the translation and a uniform scale. 2 float4, 32 bytes.
+	 * Only valid for transforms without shear or non-uniform scale
+	 */
+	QUAT_SCALE_TRANSLATION = 1,
+	/**
+	 * Same as QUAT_SCALE_TRANSLATION, stored as half floats. 1 float4, 16 bytes.
+	 * Halfs have 11 bits of precision, so translations are only accurate to about 1/2048 of
+	 * their magnitude. Best used for instances that live close to the origin of their model
+	 */
+	QUAT_SCALE_TRANSLATION_HALF = 2
+};
+
+/** Returns the number of float4 one instance takes in the given encoding */
+inline uint GetInstanceEncodingVectorCount(InstanceEncoding encoding) {
+	switch (encoding) {
+	case InstanceEncoding::QUAT_SCALE_TRANSLATION:
+		return 2u;
+	case InstanceEncoding::QUAT_SCALE_TRANSLATION_HALF:
+		return 1u;
+	default:
+		return 3u;
+	}
+}
+
+/**
+ * Packs the world transforms of 4 instances at once
+ *
+ * @param encoding    The encoding to pack to
+ * @param world       The world matrices of the 4 instances, SoA. Element (row * 3 + column) holds
+ *                    that element of all 4 matrices. The fourth column is assumed to be (0, 0, 0, 1)
+ * @param output      Receives 4 * GetInstanceEncodingVectorCount(encoding) vectors. The instances are written one after the other
+ */
+void PackInstanceTransforms(InstanceEncoding encoding, const DirectX::XMVECTOR world[12], DirectX::XMVECTOR *output);
+/**
+ * Decodes one packed instance back into a world matrix. The CPU side of the HLSL decode functions
+ *
+ * @param encoding    The encoding the instance was packed with
+ * @param input       The first vector of the instance
+ * @return            The world matrix
+ */
+DirectX::XMMATRIX UnpackInstanceTransform(InstanceEncoding encoding, const DirectX::XMVECTOR *input);
+
+/** Returns the name of the encoding, as accepted by ParseInstanceEncodingFromString() */
+const char *GetInstanceEncodingName(InstanceEncoding encoding);
+InstanceEncoding ParseInstanceEncodingFromString(const std::string &inputString, InstanceEncoding defaultEncoding);
+
+} // End of namespace Scene
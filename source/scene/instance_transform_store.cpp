@@ -0,0 +1,233 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "scene/instance_transform_store.h"
+
+#include "common/halfling_sys.h"
+
+#include "graphics/d3d_util.h"
+
+#include <algorithm>
+
+
+namespace Scene {
+
+InstanceTransformStore::InstanceTransformStore(ID3D11Device *device, uint initialCapacity, InstanceEncoding encoding)
+		: m_encoding(encoding),
+		  m_vectorsPerInstance(GetInstanceEncodingVectorCount(encoding)),
+		  m_device(device),
+		  m_buffer(nullptr),
+		  m_shaderResource(nullptr),
+		  m_bufferCapacity(0u),
+		  m_instanceCount(0u),
+		  m_allDirty(false) {
+	DirectX::XMStoreFloat4x4(&m_globalTransform, DirectX::XMMatrixIdentity());
+	memset(&m_lastUpdateStats, 0, sizeof(UpdateStats));
+
+	uint blockCapacity = (initialCapacity + 3u) / 4u;
+	m_localBlocks.reserve(blockCapacity * kVectorsPerBlock);
+	m_shaderVectors.reserve(blockCapacity * 4u * m_vectorsPerInstance);
+	m_dirtyBits.reserve((initialCapacity + kInstancesPerDirtyWord - 1u) / kInstancesPerDirtyWord);
+
+	if (m_device != nullptr) {
+		CreateBuffer(std::max(initialCapacity, 1u));
+	}
+}
+
+InstanceTransformStore::~InstanceTransformStore() {
+	ReleaseCOM(m_shaderResource);
+	ReleaseCOM(m_buffer);
+}
+
+uint InstanceTransformStore::Add(DirectX::CXMMATRIX transform) {
+	uint index = m_instanceCount++;
+
+	if (index % 4u == 0u) {
+		m_localBlocks.resize(m_localBlocks.size() + kVectorsPerBlock, DirectX::XMVectorZero());
+		m_shaderVectors.resize(m_shaderVectors.size() + 4u * m_vectorsPerInstance, DirectX::XMVectorZero());
+	}
+	if (index % kInstancesPerDirtyWord == 0u) {
+		m_dirtyBits.push_back(0u);
+	}
+
+	Set(index, transform);
+
+	return index;
+}
+
+void InstanceTransformStore::Set(uint index, DirectX::CXMMATRIX transform) {
+	AssertMsg(index < m_instanceCount, "Instance " << index << " hasn't been added to the InstanceTransformStore");
+
+	DirectX::XMFLOAT4X4 matrix;
+	DirectX::XMStoreFloat4x4(&matrix, transform);
+
+	// Scatter the matrix into its lane of the block
+	float *block = reinterpret_cast<float *>(&m_localBlocks[(index / 4u) * kVectorsPerBlock]);
+	uint lane = index % 4u;
+	for (uint row = 0; row < 4; ++row) {
+		for (uint column = 0; column < 3; ++column) {
+			block[(row * 3u + column) * 4u + lane] = matrix.m[row][column];
+		}
+	}
+
+	MarkDirty(index);
+}
+
+DirectX::XMMATRIX InstanceTransformStore::Get(uint index) const {
+	const float *block = reinterpret_cast<const float *>(&m_localBlocks[(index / 4u) * kVectorsPerBlock]);
+	uint lane = index % 4u;
+
+	DirectX::XMFLOAT4X4 matrix;
+	for (uint row = 0; row < 4; ++row) {
+		for (uint column = 0; column < 3; ++column) {
+			matrix.m[row][column] = block[(row * 3u + column) * 4u + lane];
+		}
+		matrix.m[row][3] = row == 3 ? 1.0f : 0.0f;
+	}
+
+	return DirectX::XMLoadFloat4x4(&matrix);
+}
+
+void InstanceTransformStore::SetGlobalTransform(DirectX::CXMMATRIX globalTransform) {
+	DirectX::XMStoreFloat4x4(&m_globalTransform, globalTransform);
+	m_allDirty = true;
+}
+
+uint InstanceTransformStore::Update(ID3D11DeviceContext *context) {
+	memset(&m_lastUpdateStats, 0, sizeof(UpdateStats));
+
+	if (!m_allDirty && m_dirtyWords.empty()) {
+		return 0u;
+	}
+
+	// Splat every element of the global transform once, so TransformBlock() only has to do multiply-adds
+	DirectX::XMMATRIX globalTransform = DirectX::XMLoadFloat4x4(&m_globalTransform);
+	DirectX::XMVECTOR globalSplats[16];
+	for (uint row = 0; row < 4; ++row) {
+		globalSplats[row * 4u + 0u] = DirectX::XMVectorSplatX(globalTransform.r[row]);
+		globalSplats[row * 4u + 1u] = DirectX::XMVectorSplatY(globalTransform.r[row]);
+		globalSplats[row * 4u + 2u] = DirectX::XMVectorSplatZ(globalTransform.r[row]);
+		globalSplats[row * 4u + 3u] = DirectX::XMVectorSplatW(globalTransform.r[row]);
+	}
+
+	uint instancesTransformed = 0u;
+	if (m_allDirty) {
+		uint blockCount = (m_instanceCount + 3u) / 4u;
+		for (uint block = 0; block < blockCount; ++block) {
+			TransformBlock(block, globalSplats);
+		}
+		instancesTransformed = blockCount * 4u;
+
+		for (auto iter = m_dirtyWords.begin(); iter != m_dirtyWords.end(); ++iter) {
+			m_dirtyBits[*iter] = 0u;
+		}
+		m_uploadRanges.Clear();
+		m_uploadRanges.Add(0u, m_instanceCount);
+	} else {
+		// Sorting keeps the upload ranges in order, so Coalesce() doesn't have to sort them
+		std::sort(m_dirtyWords.begin(), m_dirtyWords.end());
+
+		for (auto iter = m_dirtyWords.begin(); iter != m_dirtyWords.end(); ++iter) {
+			uint word = *iter;
+			uint32 bits = m_dirtyBits[word];
+			m_dirtyBits[word] = 0u;
+
+			uint firstInstance = word * kInstancesPerDirtyWord;
+			for (uint i = 0; i < kInstancesPerDirtyWord; i += 4u) {
+				if (((bits >> i) & 0xFu) != 0u) {
+					TransformBlock((firstInstance + i) / 4u, globalSplats);
+					instancesTransformed += 4u;
+				}
+			}
+
+			// Only the instances that actually changed are uploaded
+			uint i = 0u;
+			while (i < kInstancesPerDirtyWord) {
+				if ((bits & (1u << i)) == 0u) {
+					++i;
+					continue;
+				}
+
+				uint runStart = i;
+				while (i < kInstancesPerDirtyWord && (bits & (1u << i)) != 0u) {
+					++i;
+				}
+				m_uploadRanges.Add(firstInstance + runStart, firstInstance + i);
+			}
+		}
+	}
+	m_dirtyWords.clear();
+	m_allDirty = false;
+
+	m_uploadRanges.Coalesce(kMaxCoalesceGap);
+
+	if (context != nullptr && m_device != nullptr) {
+		Upload(context);
+	}
+
+	m_lastUpdateStats.InstancesTransformed = instancesTransformed;
+	m_lastUpdateStats.UploadCalls = m_uploadRanges.GetRangeCount();
+	m_lastUpdateStats.BytesUploaded = m_uploadRanges.GetElementCount() * m_vectorsPerInstance * sizeof(DirectX::XMVECTOR);
+	m_uploadRanges.Clear();
+
+	return instancesTransformed;
+}
+
+void InstanceTransformStore::TransformBlock(uint block, const DirectX::XMVECTOR globalSplats[16]) {
+	const DirectX::XMVECTOR *local = &m_localBlocks[block * kVectorsPerBlock];
+
+	// world[row][column] = sum over k of global[row][k] * local[k][column], for all 4 instances at once
+	DirectX::XMVECTOR world[kVectorsPerBlock];
+	for (uint row = 0; row < 4; ++row) {
+		for (uint column = 0; column < 3; ++column) {
+			DirectX::XMVECTOR element = DirectX::XMVectorMultiply(globalSplats[row * 4u + 0u], local[0u * 3u + column]);
+			element = DirectX::XMVectorMultiplyAdd(globalSplats[row * 4u + 1u], local[1u * 3u + column], element);
+			element = DirectX::XMVectorMultiplyAdd(globalSplats[row * 4u + 2u], local[2u * 3u + column], element);
+			element = DirectX::XMVectorMultiplyAdd(globalSplats[row * 4u + 3u], local[3u * 3u + column], element);
+			world[row * 3u + column] = element;
+		}
+	}
+
+	PackInstanceTransforms(m_encoding, world, &m_shaderVectors[block * 4u * m_vectorsPerInstance]);
+}
+
+void InstanceTransformStore::Upload(ID3D11DeviceContext *context) {
+	if (m_instanceCount > m_bufferCapacity) {
+		CreateBuffer(std::max(m_instanceCount, m_bufferCapacity * 2u));
+
+		// The new buffer is empty, so everything has to be uploaded
+		m_uploadRanges.Clear();
+		m_uploadRanges.Add(0u, m_instanceCount);
+		m_lastUpdateStats.BufferGrown = true;
+	}
+
+	const uint instanceSize = m_vectorsPerInstance * sizeof(DirectX::XMVECTOR);
+	const std::vector<Common::DirtyRange> &ranges = m_uploadRanges.GetRanges();
+	for (auto iter = ranges.begin(); iter != ranges.end(); ++iter) {
+		D3D11_BOX box;
+		box.left = iter->Begin * instanceSize;
+		box.right = iter->End * instanceSize;
+		box.top = 0;
+		box.bottom = 1;
+		box.front = 0;
+		box.back = 1;
+
+		context->UpdateSubresource(m_buffer, 0, &box, &m_shaderVectors[iter->Begin * m_vectorsPerInstance], 0, 0);
+	}
+}
+
+void InstanceTransformStore::CreateBuffer(uint capacity) {
+	ReleaseCOM(m_shaderResource);
+	ReleaseCOM(m_buffer);
+
+	CD3D11_BUFFER_DESC desc(sizeof(DirectX::XMVECTOR) * m_vectorsPerInstance * capacity, D3D11_BIND_SHADER_RESOURCE, D3D11_USAGE_DEFAULT, 0, D3D11_RESOURCE_MISC_BUFFER_STRUCTURED, sizeof(DirectX::XMVECTOR));
+	HR(m_device->CreateBuffer(&desc, nullptr, &m_buffer));
+	HR(m_device->CreateShaderResourceView(m_buffer, nullptr, &m_shaderResource));
+
+	m_bufferCapacity = capacity;
+}
+
+} // End of namespace Scene
@@ -0,0 +1,159 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "common/typedefs.h"
+#include "common/allocator_16_byte_aligned.h"
+#include "common/dirty_range_list.h"
+
+#include "scene/instance_encoding.h"
+
+#include <d3d11.h>
+#include <DirectXMath.h>
+
+#include <vector>
+
+
+namespace Scene {
+
+/**
+ * Stores the world transforms of instanced geometry, and keeps a GPU copy of them
+ * in the layout the instanced shaders expect. IE. (globalTransform * instanceTransform),
+ * packed with one of the InstanceEncodings
+ *
+ * The instance transforms are stored SoA, in blocks of 4 instances, so Update()
+ * can transform 4 instances at a time with SIMD. Every instance has a dirty bit, and
+ * Update() only recomputes and uploads the blocks that changed. Once the transforms
+ * stop changing, Update() costs nothing, no matter how many instances there are.
+ *
+ * The store isn't capped. The CPU storage grows like a std::vector, and the GPU buffer
+ * is re-created at twice the size whenever it runs out of room.
+ */
+class InstanceTransformStore {
+public:
+	/**
+	 * @param device             The device to create the GPU buffer with. If nullptr, only the
+	 *                           CPU side is kept up to date. IE. for headless benchmarks
+	 * @param initialCapacity    The number of instances to reserve room for
+	 * @param encoding           How the transforms are packed in the GPU buffer
+	 */
+	InstanceTransformStore(ID3D11Device *device, uint initialCapacity = kDefaultInitialCapacity, InstanceEncoding encoding = InstanceEncoding::AFFINE_3X4);
+	~InstanceTransformStore();
+
+	static const uint kDefaultInitialCapacity = 1024u;
+	/**
+	 * Dirty ranges separated by at most this many clean instances are uploaded as one range.
+	 * Re-uploading a few clean instances is cheaper than another UpdateSubresource() call
+	 */
+	static const uint kMaxCoalesceGap = 8u;
+
+	struct UpdateStats {
+		/** The number of instances whose transform was recomputed. Always a multiple of 4 */
+		uint InstancesTransformed;
+		/** The number of UpdateSubresource() calls. Counted even when there is no GPU buffer */
+		uint UploadCalls;
+		uint BytesUploaded;
+		/** True if the GPU buffer had to be re-created to make room */
+		bool BufferGrown;
+	};
+
+private:
+	/** Each block holds 4 instances. Element (row * 3 + column) holds that matrix element of all 4 instances */
+	static const uint kVectorsPerBlock = 12u;
+	static const uint kInstancesPerDirtyWord = 32u;
+
+	InstanceEncoding m_encoding;
+	uint m_vectorsPerInstance;
+
+	ID3D11Device *m_device;
+	ID3D11Buffer *m_buffer;
+	ID3D11ShaderResourceView *m_shaderResource;
+	uint m_bufferCapacity;
+
+	uint m_instanceCount;
+	// Stored unaligned, so the store can be new'ed on 32 bit
+	DirectX::XMFLOAT4X4 m_globalTransform;
+	bool m_allDirty;
+
+	std::vector<DirectX::XMVECTOR, Common::Allocator16ByteAligned<DirectX::XMVECTOR> > m_localBlocks;
+	/** The CPU copy of the GPU buffer. m_vectorsPerInstance per instance, padded to a whole block */
+	std::vector<DirectX::XMVECTOR, Common::Allocator16ByteAligned<DirectX::XMVECTOR> > m_shaderVectors;
+
+	std::vector<uint32> m_dirtyBits;
+	/** The indices of the non-zero words of m_dirtyBits */
+	std::vector<uint> m_dirtyWords;
+
+	/** The instances to upload. Built and consumed by Update() */
+	Common::DirtyRangeList m_uploadRanges;
+
+	UpdateStats m_lastUpdateStats;
+
+public:
+	inline uint GetSize() const { return m_instanceCount; }
+	inline InstanceEncoding GetEncoding() const { return m_encoding; }
+	/** Returns the number of float4 each instance takes in the GPU buffer */
+	inline uint GetVectorsPerInstance() const { return m_vectorsPerInstance; }
+	/** Returns the index of the first float4 of an instance in the GPU buffer. Pass it to the shader as the start vector */
+	inline uint GetStartVector(uint index) const { return index * m_vectorsPerInstance; }
+
+	inline ID3D11Buffer *GetBuffer() { return m_buffer; }
+	inline ID3D11ShaderResourceView *GetShaderResource() { return m_shaderResource; }
+	inline const UpdateStats &GetLastUpdateStats() const { return m_lastUpdateStats; }
+
+	/**
+	 * Appends a new instance. It will be transformed and uploaded by the next Update()
+	 *
+	 * @param transform    The transform of the instance. Only the first three columns are used
+	 * @return             The index of the new instance
+	 */
+	uint Add(DirectX::CXMMATRIX transform);
+	/**
+	 * Changes the transform of an instance. It will be transformed and uploaded by the next Update()
+	 *
+	 * @param index        The index of the instance, as returned by Add()
+	 * @param transform    The new transform. Only the first three columns are used
+	 */
+	void Set(uint index, DirectX::CXMMATRIX transform);
+	/** Returns the transform of an instance, as given to Add() / Set(). The fourth column is always (0, 0, 0, 1) */
+	DirectX::XMMATRIX Get(uint index) const;
+
+	/** Sets the transform that is applied in front of every instance transform. This dirties every instance */
+	void SetGlobalTransform(DirectX::CXMMATRIX globalTransform);
+	/**
+	 * Returns the first vector of an instance in the CPU copy of the GPU buffer. Only valid after Update()
+	 * Use UnpackInstanceTransform() to decode it
+	 */
+	inline const DirectX::XMVECTOR *GetShaderVectors(uint index) const { return &m_shaderVectors[index * m_vectorsPerInstance]; }
+
+	/**
+	 * Recomputes the dirty instances and uploads them to the GPU buffer
+	 *
+	 * @param context    The context to upload with. If nullptr, or the store doesn't have a device,
+	 *                   only the CPU copy is updated
+	 * @return           The number of instances that were recomputed
+	 */
+	uint Update(ID3D11DeviceContext *context);
+
+private:
+	inline void MarkDirty(uint index) {
+		uint word = index / kInstancesPerDirtyWord;
+		if (m_dirtyBits[word] == 0u) {
+			m_dirtyWords.push_back(word);
+		}
+		m_dirtyBits[word] |= 1u << (index % kInstancesPerDirtyWord);
+	}
+
+	void TransformBlock(uint block, const DirectX::XMVECTOR globalSplats[16]);
+	void Upload(ID3D11DeviceContext *context);
+	void CreateBuffer(uint capacity);
+
+	// Not implemented
+	InstanceTransformStore(const InstanceTransformStore &);
+	InstanceTransformStore &operator=(const InstanceTransformStore &);
+};
+
+} // End of namespace Scene
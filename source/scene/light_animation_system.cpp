@@ -0,0 +1,252 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "scene/light_animation_system.h"
+
+#include "common/thread_pool.h"
+
+#include "scene/lights.h"
+
+#include <xmmintrin.h>
+
+#include <algorithm>
+#include <cfloat>
+
+
+namespace Scene {
+
+namespace {
+
+/**
+ * Moves 4 coordinates along one axis, and bounces the ones that went past the bounds back inside,
+ * flipping their velocity. The same operations as PointLightAnimator, in the same order
+ */
+inline void MoveAxis(float *position, float *velocity, const float *negativeBounds, const float *positiveBounds, __m128 deltaTime, __m128 signMask) {
+	__m128 speed = _mm_load_ps(velocity);
+	__m128 negative = _mm_load_ps(negativeBounds);
+	__m128 positive = _mm_load_ps(positiveBounds);
+	__m128 moved = _mm_add_ps(_mm_mul_ps(speed, deltaTime), _mm_load_ps(position));
+
+	__m128 above = _mm_cmpgt_ps(moved, positive);
+	__m128 below = _mm_cmplt_ps(moved, negative);
+	__m128 reflectedAbove = _mm_sub_ps(positive, _mm_sub_ps(moved, positive));
+	__m128 reflectedBelow = _mm_add_ps(negative, _mm_sub_ps(negative, moved));
+
+	// A light can't be past both sides, so the masks don't overlap
+	moved = _mm_or_ps(_mm_andnot_ps(_mm_or_ps(above, below), moved), _mm_or_ps(_mm_and_ps(above, reflectedAbove), _mm_and_ps(below, reflectedBelow)));
+	speed = _mm_xor_ps(speed, _mm_and_ps(_mm_or_ps(above, below), signMask));
+
+	_mm_store_ps(position, moved);
+	_mm_store_ps(velocity, speed);
+}
+
+/** Adds the parts of the ranges that are below the shader light count. The rest aren't written */
+void AddWrittenRanges(Common::DirtyRangeList &movingLights, uint shaderLightCount, Common::DirtyRangeList *out_dirtyLights) {
+	movingLights.Coalesce();
+
+	const std::vector<Common::DirtyRange> &ranges = movingLights.GetRanges();
+	for (auto iter = ranges.begin(); iter != ranges.end() && iter->Begin < shaderLightCount; ++iter) {
+		out_dirtyLights->Add(iter->Begin, std::min(iter->End, shaderLightCount));
+	}
+}
+
+} // End of anonymous namespace
+
+
+LightAnimationSystem::LightAnimationSystem() {
+	m_pointLights.Count = 0u;
+	m_spotLights.Count = 0u;
+}
+
+uint LightAnimationSystem::AddPointLight(uint shaderIndex, const DirectX::XMFLOAT3 &position, const DirectX::XMFLOAT3 &velocity, const DirectX::XMFLOAT3 &negativeBounds, const DirectX::XMFLOAT3 &positiveBounds) {
+	AddMotion(&m_pointLights, shaderIndex, position, velocity, negativeBounds, positiveBounds);
+	if (velocity.x != 0.0f || velocity.y != 0.0f || velocity.z != 0.0f) {
+		m_movingPointLights.Add(shaderIndex);
+	}
+
+	return m_pointLights.Count - 1u;
+}
+
+uint LightAnimationSystem::AddSpotLight(uint shaderIndex, const DirectX::XMFLOAT3 &position, const DirectX::XMFLOAT3 &direction, const DirectX::XMFLOAT3 &velocity,
+                                        const DirectX::XMFLOAT3 &negativeBounds, const DirectX::XMFLOAT3 &positiveBounds, const DirectX::XMFLOAT3 &angularVelocity) {
+	uint index = m_spotLights.Count;
+	AddMotion(&m_spotLights, shaderIndex, position, velocity, negativeBounds, positiveBounds);
+	if (velocity.x != 0.0f || velocity.y != 0.0f || velocity.z != 0.0f || angularVelocity.x != 0.0f || angularVelocity.y != 0.0f || angularVelocity.z != 0.0f) {
+		m_movingSpotLights.Add(shaderIndex);
+	}
+
+	// Padding lights don't rotate
+	if (m_spotDirectionX.size() < m_spotLights.PositionX.size()) {
+		m_spotDirectionX.resize(m_spotLights.PositionX.size(), 0.0f);
+		m_spotDirectionY.resize(m_spotLights.PositionX.size(), 0.0f);
+		m_spotDirectionZ.resize(m_spotLights.PositionX.size(), 0.0f);
+		for (uint i = 0; i < 9u; ++i) {
+			m_spotRotation[i].resize(m_spotLights.PositionX.size(), i % 4u == 0u ? 1.0f : 0.0f);
+		}
+	}
+
+	m_spotDirectionX[index] = direction.x;
+	m_spotDirectionY[index] = direction.y;
+	m_spotDirectionZ[index] = direction.z;
+
+	DirectX::XMFLOAT4X4 rotation;
+	DirectX::XMStoreFloat4x4(&rotation, DirectX::XMMatrixRotationRollPitchYaw(angularVelocity.x, angularVelocity.y, angularVelocity.z));
+	for (uint row = 0; row < 3u; ++row) {
+		for (uint column = 0; column < 3u; ++column) {
+			m_spotRotation[row * 3u + column][index] = rotation.m[row][column];
+		}
+	}
+
+	return index;
+}
+
+void LightAnimationSystem::AddMotion(MotionList *list, uint shaderIndex, const DirectX::XMFLOAT3 &position, const DirectX::XMFLOAT3 &velocity, const DirectX::XMFLOAT3 &negativeBounds, const DirectX::XMFLOAT3 &positiveBounds) {
+	// Start a new group of padding lights. They sit at the origin, and can't reach their infinite bounds
+	if (list->Count % kPadding == 0u) {
+		uint size = list->Count + kPadding;
+		list->PositionX.resize(size, 0.0f);
+		list->PositionY.resize(size, 0.0f);
+		list->PositionZ.resize(size, 0.0f);
+		list->VelocityX.resize(size, 0.0f);
+		list->VelocityY.resize(size, 0.0f);
+		list->VelocityZ.resize(size, 0.0f);
+		list->NegativeBoundsX.resize(size, -FLT_MAX);
+		list->NegativeBoundsY.resize(size, -FLT_MAX);
+		list->NegativeBoundsZ.resize(size, -FLT_MAX);
+		list->PositiveBoundsX.resize(size, FLT_MAX);
+		list->PositiveBoundsY.resize(size, FLT_MAX);
+		list->PositiveBoundsZ.resize(size, FLT_MAX);
+		list->ShaderIndices.resize(size, ~0u);
+	}
+
+	uint index = list->Count++;
+	list->PositionX[index] = position.x;
+	list->PositionY[index] = position.y;
+	list->PositionZ[index] = position.z;
+	list->VelocityX[index] = velocity.x;
+	list->VelocityY[index] = velocity.y;
+	list->VelocityZ[index] = velocity.z;
+	list->ShaderIndices[index] = shaderIndex;
+
+	// Lights that don't move don't bounce either, even if they start outside of their box
+	if (velocity.x != 0.0f || velocity.y != 0.0f || velocity.z != 0.0f) {
+		list->NegativeBoundsX[index] = negativeBounds.x;
+		list->NegativeBoundsY[index] = negativeBounds.y;
+		list->NegativeBoundsZ[index] = negativeBounds.z;
+		list->PositiveBoundsX[index] = positiveBounds.x;
+		list->PositiveBoundsY[index] = positiveBounds.y;
+		list->PositiveBoundsZ[index] = positiveBounds.z;
+	}
+}
+
+void LightAnimationSystem::Clear() {
+	MotionList *lists[2] = {&m_pointLights, &m_spotLights};
+	for (uint i = 0; i < 2u; ++i) {
+		lists[i]->PositionX.clear();
+		lists[i]->PositionY.clear();
+		lists[i]->PositionZ.clear();
+		lists[i]->VelocityX.clear();
+		lists[i]->VelocityY.clear();
+		lists[i]->VelocityZ.clear();
+		lists[i]->NegativeBoundsX.clear();
+		lists[i]->NegativeBoundsY.clear();
+		lists[i]->NegativeBoundsZ.clear();
+		lists[i]->PositiveBoundsX.clear();
+		lists[i]->PositiveBoundsY.clear();
+		lists[i]->PositiveBoundsZ.clear();
+		lists[i]->ShaderIndices.clear();
+		lists[i]->Count = 0u;
+	}
+
+	m_movingPointLights.Clear();
+	m_movingSpotLights.Clear();
+
+	m_spotDirectionX.clear();
+	m_spotDirectionY.clear();
+	m_spotDirectionZ.clear();
+	for (uint i = 0; i < 9u; ++i) {
+		m_spotRotation[i].clear();
+	}
+}
+
+void LightAnimationSystem::Update(double deltaTime, ShaderPointLight *pointLights, uint pointLightCount, ShaderSpotLight *spotLights, uint spotLightCount, Common::ThreadPool *threadPool,
+                                  Common::DirtyRangeList *out_dirtyPointLights, Common::DirtyRangeList *out_dirtySpotLights) {
+	float frameTime = static_cast<float>(deltaTime);
+
+	auto updatePointLights = [&](uint begin, uint end) {
+		MoveRange(&m_pointLights, frameTime, begin, end);
+
+		// Write the new positions into the shader lights
+		for (uint i = begin; i < std::min(end, m_pointLights.Count); ++i) {
+			uint shaderIndex = m_pointLights.ShaderIndices[i];
+			if (shaderIndex < pointLightCount) {
+				pointLights[shaderIndex].Position = DirectX::XMFLOAT3(m_pointLights.PositionX[i], m_pointLights.PositionY[i], m_pointLights.PositionZ[i]);
+			}
+		}
+	};
+	auto updateSpotLights = [&](uint begin, uint end) {
+		MoveRange(&m_spotLights, frameTime, begin, end);
+		RotateRange(begin, end);
+
+		for (uint i = begin; i < std::min(end, m_spotLights.Count); ++i) {
+			uint shaderIndex = m_spotLights.ShaderIndices[i];
+			if (shaderIndex < spotLightCount) {
+				spotLights[shaderIndex].Position = DirectX::XMFLOAT3(m_spotLights.PositionX[i], m_spotLights.PositionY[i], m_spotLights.PositionZ[i]);
+				spotLights[shaderIndex].Direction = DirectX::XMFLOAT3(m_spotDirectionX[i], m_spotDirectionY[i], m_spotDirectionZ[i]);
+			}
+		}
+	};
+
+	uint paddedPointLightCount = static_cast<uint>(m_pointLights.PositionX.size());
+	uint paddedSpotLightCount = static_cast<uint>(m_spotLights.PositionX.size());
+	if (threadPool != nullptr) {
+		threadPool->ParallelFor(paddedPointLightCount, kChunkSize, updatePointLights);
+		threadPool->ParallelFor(paddedSpotLightCount, kChunkSize, updateSpotLights);
+	} else {
+		updatePointLights(0u, paddedPointLightCount);
+		updateSpotLights(0u, paddedSpotLightCount);
+	}
+
+	// The lights are usually added in shader order, so these are only a few ranges
+	if (out_dirtyPointLights != nullptr) {
+		AddWrittenRanges(m_movingPointLights, pointLightCount, out_dirtyPointLights);
+	}
+	if (out_dirtySpotLights != nullptr) {
+		AddWrittenRanges(m_movingSpotLights, spotLightCount, out_dirtySpotLights);
+	}
+}
+
+void LightAnimationSystem::MoveRange(MotionList *list, float deltaTime, uint begin, uint end) {
+	__m128 frameTime = _mm_set1_ps(deltaTime);
+	__m128 signMask = _mm_set1_ps(-0.0f);
+
+	for (uint i = begin; i < end; i += 4u) {
+		MoveAxis(&list->PositionX[i], &list->VelocityX[i], &list->NegativeBoundsX[i], &list->PositiveBoundsX[i], frameTime, signMask);
+		MoveAxis(&list->PositionY[i], &list->VelocityY[i], &list->NegativeBoundsY[i], &list->PositiveBoundsY[i], frameTime, signMask);
+		MoveAxis(&list->PositionZ[i], &list->VelocityZ[i], &list->NegativeBoundsZ[i], &list->PositiveBoundsZ[i], frameTime, signMask);
+	}
+}
+
+void LightAnimationSystem::RotateRange(uint begin, uint end) {
+	for (uint i = begin; i < end; i += 4u) {
+		__m128 x = _mm_load_ps(&m_spotDirectionX[i]);
+		__m128 y = _mm_load_ps(&m_spotDirectionY[i]);
+		__m128 z = _mm_load_ps(&m_spotDirectionZ[i]);
+
+		// direction * rotation, summed in the same order as XMVector3Transform()
+		__m128 rotated[3];
+		for (uint column = 0; column < 3u; ++column) {
+			rotated[column] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_load_ps(&m_spotRotation[column][i])), _mm_mul_ps(y, _mm_load_ps(&m_spotRotation[3u + column][i]))),
+			                             _mm_mul_ps(z, _mm_load_ps(&m_spotRotation[6u + column][i])));
+		}
+
+		_mm_store_ps(&m_spotDirectionX[i], rotated[0]);
+		_mm_store_ps(&m_spotDirectionY[i], rotated[1]);
+		_mm_store_ps(&m_spotDirectionZ[i], rotated[2]);
+	}
+}
+
+} // End of namespace Scene
@@ -0,0 +1,151 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "common/typedefs.h"
+#include "common/allocator_16_byte_aligned.h"
+#include "common/dirty_range_list.h"
+
+#include <DirectXMath.h>
+
+#include <vector>
+
+
+namespace Common {
+class ThreadPool;
+}
+
+namespace Scene {
+
+struct ShaderPointLight;
+struct ShaderSpotLight;
+
+/**
+ * Animates point and spot lights, and writes the results straight into the arrays that are uploaded to the shaders
+ *
+ * The lights move in a straight line, and bounce off the sides of a box. Spot lights can also spin, by
+ * a fixed rotation every update. It's the same motion as PointLightAnimator and SpotLightAnimator, to
+ * the bit, but the state is stored in SoA form, so Update() moves 4 lights at a time with SSE, and
+ * nothing goes through a pointer per light. The arrays are padded to a multiple of 4 with lights that
+ * never move, so the SIMD loop never has a remainder.
+ *
+ * The system owns the positions and directions of the lights it animates. Each animated light has the
+ * index of the shader light it drives. The rest of the shader light is left alone.
+ *
+ * If a ThreadPool is given, the lights are updated in parallel chunks. Every light is updated the same
+ * way no matter which chunk it's in, so the result doesn't depend on the number of threads.
+ *
+ * Update() can also report the shader lights it changed, so only those have to be uploaded. Lights
+ * that don't move or spin are never reported.
+ */
+class LightAnimationSystem {
+public:
+	LightAnimationSystem();
+
+	/** The arrays are padded to a multiple of this */
+	static const uint kPadding = 4u;
+	/** The number of lights in each chunk of a parallel update. Must be a multiple of kPadding */
+	static const uint kChunkSize = 2048u;
+
+private:
+	typedef std::vector<float, Common::Allocator16ByteAligned<float> > FloatList;
+
+	/** The state every animated light has */
+	struct MotionList {
+		FloatList PositionX;
+		FloatList PositionY;
+		FloatList PositionZ;
+		FloatList VelocityX;
+		FloatList VelocityY;
+		FloatList VelocityZ;
+		FloatList NegativeBoundsX;
+		FloatList NegativeBoundsY;
+		FloatList NegativeBoundsZ;
+		FloatList PositiveBoundsX;
+		FloatList PositiveBoundsY;
+		FloatList PositiveBoundsZ;
+		/** The index of the shader light that each light writes to */
+		std::vector<uint> ShaderIndices;
+		uint Count;
+	};
+
+	MotionList m_pointLights;
+	MotionList m_spotLights;
+
+	FloatList m_spotDirectionX;
+	FloatList m_spotDirectionY;
+	FloatList m_spotDirectionZ;
+	/** The rotation applied to the direction every update. Row major, m_spotRotation[row * 3 + column] */
+	FloatList m_spotRotation[9];
+
+	/** The shader indices of the lights that move or spin */
+	Common::DirtyRangeList m_movingPointLights;
+	Common::DirtyRangeList m_movingSpotLights;
+
+public:
+	/**
+	 * Adds a point light
+	 *
+	 * @param shaderIndex       The index of the shader light that the animation is written to
+	 * @param position          The starting position of the light
+	 * @param velocity          The distance the light moves per second
+	 * @param negativeBounds    The minimum of the box the light bounces around in
+	 * @param positiveBounds    The maximum of the box. If the velocity is zero, the light doesn't move, and the box is ignored
+	 * @return                  The index of the animated light. Indices are handed out in order, starting from 0
+	 */
+	uint AddPointLight(uint shaderIndex, const DirectX::XMFLOAT3 &position, const DirectX::XMFLOAT3 &velocity, const DirectX::XMFLOAT3 &negativeBounds, const DirectX::XMFLOAT3 &positiveBounds);
+	/**
+	 * Adds a spot light
+	 *
+	 * @param shaderIndex        The index of the shader light that the animation is written to
+	 * @param position           The starting position of the light
+	 * @param direction          The starting direction of the light
+	 * @param velocity           The distance the light moves per second
+	 * @param negativeBounds     The minimum of the box the light bounces around in
+	 * @param positiveBounds     The maximum of the box. If the velocity is zero, the light doesn't move, and the box is ignored
+	 * @param angularVelocity    The pitch, yaw, and roll that the direction is rotated by, every update
+	 * @return                   The index of the animated light. Indices are handed out in order, starting from 0
+	 */
+	uint AddSpotLight(uint shaderIndex, const DirectX::XMFLOAT3 &position, const DirectX::XMFLOAT3 &direction, const DirectX::XMFLOAT3 &velocity,
+	                  const DirectX::XMFLOAT3 &negativeBounds, const DirectX::XMFLOAT3 &positiveBounds, const DirectX::XMFLOAT3 &angularVelocity);
+	/** Removes every light */
+	void Clear();
+
+	inline uint GetPointLightCount() const { return m_pointLights.Count; }
+	inline uint GetSpotLightCount() const { return m_spotLights.Count; }
+	inline DirectX::XMFLOAT3 GetPointLightPosition(uint index) const { return DirectX::XMFLOAT3(m_pointLights.PositionX[index], m_pointLights.PositionY[index], m_pointLights.PositionZ[index]); }
+	inline DirectX::XMFLOAT3 GetSpotLightPosition(uint index) const { return DirectX::XMFLOAT3(m_spotLights.PositionX[index], m_spotLights.PositionY[index], m_spotLights.PositionZ[index]); }
+	inline DirectX::XMFLOAT3 GetSpotLightDirection(uint index) const { return DirectX::XMFLOAT3(m_spotDirectionX[index], m_spotDirectionY[index], m_spotDirectionZ[index]); }
+
+	/**
+	 * Moves every light by one update, and writes the positions and directions into the shader lights
+	 *
+	 * @param deltaTime               The time since the last update, in seconds
+	 * @param pointLights             The shader point lights. Lights with a shader index past pointLightCount are animated, but not written
+	 * @param pointLightCount         The number of shader point lights
+	 * @param spotLights              The shader spot lights
+	 * @param spotLightCount          The number of shader spot lights
+	 * @param threadPool              [Optional] If not nullptr, the lights are updated in parallel chunks
+	 * @param out_dirtyPointLights    [Optional] If not nullptr, the shader point lights that moved are added to it
+	 * @param out_dirtySpotLights     [Optional] If not nullptr, the shader spot lights that moved or spun are added to it
+	 */
+	void Update(double deltaTime, ShaderPointLight *pointLights, uint pointLightCount, ShaderSpotLight *spotLights, uint spotLightCount, Common::ThreadPool *threadPool = nullptr,
+	            Common::DirtyRangeList *out_dirtyPointLights = nullptr, Common::DirtyRangeList *out_dirtySpotLights = nullptr);
+
+private:
+	/** Adds a light to a motion list, and pads the list with a light that never moves */
+	static void AddMotion(MotionList *list, uint shaderIndex, const DirectX::XMFLOAT3 &position, const DirectX::XMFLOAT3 &velocity, const DirectX::XMFLOAT3 &negativeBounds, const DirectX::XMFLOAT3 &positiveBounds);
+	/** Moves the lights in [begin, end) of a motion list. begin and end have to be multiples of kPadding */
+	static void MoveRange(MotionList *list, float deltaTime, uint begin, uint end);
+	/** Rotates the spot lights in [begin, end). begin and end have to be multiples of kPadding */
+	void RotateRange(uint begin, uint end);
+
+	LightAnimationSystem(const LightAnimationSystem &);               // Not implemented
+	LightAnimationSystem &operator=(const LightAnimationSystem &);    // Not implemented
+};
+
+} // End of namespace Scene
@@ -49,7 +49,7 @@ void PointLightAnimator::AnimateLight(double deltaTime) {
 
 void SpotLightAnimator::AnimateLight(double deltaTime) {
 	// Move the light
-	if (m_velocity.x != 0.0f || m_velocity.y != 0.0f || m_velocity.z == 0.0f) {
+	if (m_velocity.x != 0.0f || m_velocity.y != 0.0f || m_velocity.z != 0.0f) {
 		DirectX::XMFLOAT3 position((*m_lightList)[m_index].GetPosition());
 
 		float xPosition = m_velocity.x * static_cast<float>(deltaTime) + position.x;
@@ -87,7 +87,7 @@ void SpotLightAnimator::AnimateLight(double deltaTime) {
 	}
 
 	// Rotate the light
-	if (m_angularVelocity.x != 0.0f || m_angularVelocity.y != 0.0f || m_angularVelocity.z == 0.0f) {
+	if (m_angularVelocity.x != 0.0f || m_angularVelocity.y != 0.0f || m_angularVelocity.z != 0.0f) {
 		DirectX::XMFLOAT3 direction((*m_lightList)[m_index].GetDirection());
 
 		DirectX::XMVECTOR temp = DirectX::XMVector3Transform(DirectX::XMLoadFloat3(&direction), DirectX::XMMatrixRotationRollPitchYaw(m_angularVelocity.x, m_angularVelocity.y, m_angularVelocity.z));
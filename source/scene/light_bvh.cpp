@@ -0,0 +1,310 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "scene/light_bvh.h"
+
+#include "common/dirty_range_list.h"
+#include "common/thread_pool.h"
+
+#include "scene/frustum_culler.h"
+#include "scene/lights.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+
+namespace Scene {
+
+namespace {
+
+/** Runs function(begin, end) over [0, count) in chunks. On the thread pool, if there is one and more than one chunk */
+template <typename Function>
+void RunChunks(uint count, uint chunkSize, Common::ThreadPool *threadPool, const Function &function) {
+	if (threadPool != nullptr && count > chunkSize) {
+		threadPool->ParallelFor(count, chunkSize, function);
+	} else {
+		for (uint begin = 0; begin < count; begin += chunkSize) {
+			function(begin, std::min(begin + chunkSize, count));
+		}
+	}
+}
+
+/** Spreads the low 10 bits of a value out to every third bit */
+inline uint32 SpreadBits(uint32 value) {
+	value &= 0x3FFu;
+	value = (value | (value << 16u)) & 0x030000FFu;
+	value = (value | (value << 8u)) & 0x0300F00Fu;
+	value = (value | (value << 4u)) & 0x030C30C3u;
+	value = (value | (value << 2u)) & 0x09249249u;
+	return value;
+}
+
+/**
+ * Returns how far a box is inside of a plane, at its furthest point. IE. the distance of the corner
+ * that's furthest along the plane normal. If it's negative, the box is completely outside
+ */
+inline float MaxPlaneDistance(const DirectX::XMFLOAT4 &plane, const DirectX::XMFLOAT3 &aabbMin, const DirectX::XMFLOAT3 &aabbMax) {
+	return plane.x * (plane.x > 0.0f ? aabbMax.x : aabbMin.x) +
+	       plane.y * (plane.y > 0.0f ? aabbMax.y : aabbMin.y) +
+	       plane.z * (plane.z > 0.0f ? aabbMax.z : aabbMin.z) + plane.w;
+}
+
+/** Same as above, for the corner that's least far along the normal. If it's positive, the box is completely inside */
+inline float MinPlaneDistance(const DirectX::XMFLOAT4 &plane, const DirectX::XMFLOAT3 &aabbMin, const DirectX::XMFLOAT3 &aabbMax) {
+	return plane.x * (plane.x > 0.0f ? aabbMin.x : aabbMax.x) +
+	       plane.y * (plane.y > 0.0f ? aabbMin.y : aabbMax.y) +
+	       plane.z * (plane.z > 0.0f ? aabbMin.z : aabbMax.z) + plane.w;
+}
+
+/** Writes the sorted lights that moved in the order, or that are dirty, and records the order */
+template <typename LightType>
+uint GatherChanged(const LightType *lights, const std::vector<uint32> &sortedIndices, const Common::DirtyRangeList &dirtyLights, std::vector<byte> *dirtyFlags,
+                   std::vector<uint32> *gatheredIndices, LightType *out_sortedLights, Common::DirtyRangeList *out_dirtySortedLights) {
+	uint lightCount = static_cast<uint>(sortedIndices.size());
+
+	// The caller's array doesn't hold a previous order, so every light is new
+	bool rewriteAll = gatheredIndices->size() != lightCount;
+	if (!rewriteAll && dirtyLights.IsEmpty() && *gatheredIndices == sortedIndices) {
+		return 0u;
+	}
+
+	dirtyFlags->assign(lightCount, 0u);
+	const std::vector<Common::DirtyRange> &ranges = dirtyLights.GetRanges();
+	for (auto iter = ranges.begin(); iter != ranges.end(); ++iter) {
+		std::fill(dirtyFlags->begin() + std::min(iter->Begin, lightCount), dirtyFlags->begin() + std::min(iter->End, lightCount), 1u);
+	}
+
+	uint writeCount = 0u;
+	for (uint i = 0; i < lightCount; ++i) {
+		uint32 index = sortedIndices[i];
+		if (rewriteAll || (*gatheredIndices)[i] != index || (*dirtyFlags)[index] != 0u) {
+			out_sortedLights[i] = lights[index];
+			out_dirtySortedLights->Add(i);
+			++writeCount;
+		}
+	}
+
+	*gatheredIndices = sortedIndices;
+	return writeCount;
+}
+
+} // End of anonymous namespace
+
+
+LightBVH::LightBVH()
+	: m_lightCount(0u) {
+}
+
+void LightBVH::Build(const ShaderPointLight *lights, uint lightCount, Common::ThreadPool *threadPool, float radiusScale) {
+	m_lightCount = lightCount;
+	m_spheres.resize(lightCount);
+	RunChunks(lightCount, kChunkSize, threadPool, [&](uint begin, uint end) {
+		for (uint i = begin; i < end; ++i) {
+			m_spheres[i] = DirectX::XMFLOAT4(lights[i].Position.x, lights[i].Position.y, lights[i].Position.z, lights[i].Range * radiusScale);
+		}
+	});
+
+	BuildFromSpheres(threadPool);
+}
+
+void LightBVH::Build(const ShaderSpotLight *lights, uint lightCount, Common::ThreadPool *threadPool, float radiusScale) {
+	m_lightCount = lightCount;
+	m_spheres.resize(lightCount);
+	RunChunks(lightCount, kChunkSize, threadPool, [&](uint begin, uint end) {
+		for (uint i = begin; i < end; ++i) {
+			const ShaderSpotLight &light = lights[i];
+
+			// The same bounding sphere of the cone that ClusterLightAssigner bins. Narrow cones are bounded by the
+			// sphere through the apex and the rim of the cap, wide ones by the sphere around the rim
+			float cosAngle = light.CosOuterConeAngle;
+			float radius = light.Range;
+			float distance = 0.0f;
+			if (cosAngle >= 0.70710678f) {
+				radius = light.Range / (2.0f * cosAngle);
+				distance = radius;
+			} else if (cosAngle > 0.0f) {
+				radius = light.Range * std::sqrt(1.0f - cosAngle * cosAngle);
+				distance = light.Range * cosAngle;
+			}
+			distance *= radiusScale;
+
+			m_spheres[i] = DirectX::XMFLOAT4(light.Position.x + light.Direction.x * distance,
+			                                 light.Position.y + light.Direction.y * distance,
+			                                 light.Position.z + light.Direction.z * distance,
+			                                 radius * radiusScale);
+		}
+	});
+
+	BuildFromSpheres(threadPool);
+}
+
+void LightBVH::BuildFromSpheres(Common::ThreadPool *threadPool) {
+	m_codes.resize(m_lightCount);
+	m_sortedIndices.resize(m_lightCount);
+	m_nodes.clear();
+	m_levelOffsets.clear();
+	if (m_lightCount == 0u) {
+		return;
+	}
+
+	// The bounds of the centers, so the codes use the whole range of each axis
+	uint chunkCount = (m_lightCount + kChunkSize - 1u) / kChunkSize;
+	m_chunkBounds.resize(chunkCount);
+	RunChunks(m_lightCount, kChunkSize, threadPool, [&](uint begin, uint end) {
+		Node &bounds = m_chunkBounds[begin / kChunkSize];
+		bounds.AABBMin = DirectX::XMFLOAT3(FLT_MAX, FLT_MAX, FLT_MAX);
+		bounds.AABBMax = DirectX::XMFLOAT3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		for (uint i = begin; i < end; ++i) {
+			const DirectX::XMFLOAT4 &sphere = m_spheres[i];
+			bounds.AABBMin = DirectX::XMFLOAT3(std::min(bounds.AABBMin.x, sphere.x), std::min(bounds.AABBMin.y, sphere.y), std::min(bounds.AABBMin.z, sphere.z));
+			bounds.AABBMax = DirectX::XMFLOAT3(std::max(bounds.AABBMax.x, sphere.x), std::max(bounds.AABBMax.y, sphere.y), std::max(bounds.AABBMax.z, sphere.z));
+		}
+	});
+	Node bounds = m_chunkBounds[0];
+	for (uint i = 1u; i < chunkCount; ++i) {
+		const Node &chunk = m_chunkBounds[i];
+		bounds.AABBMin = DirectX::XMFLOAT3(std::min(bounds.AABBMin.x, chunk.AABBMin.x), std::min(bounds.AABBMin.y, chunk.AABBMin.y), std::min(bounds.AABBMin.z, chunk.AABBMin.z));
+		bounds.AABBMax = DirectX::XMFLOAT3(std::max(bounds.AABBMax.x, chunk.AABBMax.x), std::max(bounds.AABBMax.y, chunk.AABBMax.y), std::max(bounds.AABBMax.z, chunk.AABBMax.z));
+	}
+
+	// Quantize the centers, and interleave the bits of the axes. The cells are cubes, so a flat scene doesn't
+	// spend as many bits on its thin axis as on the others
+	float maxCell = static_cast<float>((1u << kMortonAxisBits) - 1u);
+	float extent = std::max(std::max(bounds.AABBMax.x - bounds.AABBMin.x, bounds.AABBMax.y - bounds.AABBMin.y), bounds.AABBMax.z - bounds.AABBMin.z);
+	float cellScale = maxCell / std::max(extent, FLT_MIN);
+	DirectX::XMFLOAT3 scale(cellScale, cellScale, cellScale);
+	RunChunks(m_lightCount, kChunkSize, threadPool, [&](uint begin, uint end) {
+		for (uint i = begin; i < end; ++i) {
+			const DirectX::XMFLOAT4 &sphere = m_spheres[i];
+			uint32 x = static_cast<uint32>(std::min((sphere.x - bounds.AABBMin.x) * scale.x, maxCell));
+			uint32 y = static_cast<uint32>(std::min((sphere.y - bounds.AABBMin.y) * scale.y, maxCell));
+			uint32 z = static_cast<uint32>(std::min((sphere.z - bounds.AABBMin.z) * scale.z, maxCell));
+
+			m_codes[i] = SpreadBits(x) | (SpreadBits(y) << 1u) | (SpreadBits(z) << 2u);
+			m_sortedIndices[i] = i;
+		}
+	});
+
+	m_sorter.SortPairs(&m_codes[0], &m_sortedIndices[0], m_lightCount, 3u * kMortonAxisBits, threadPool);
+
+	// Size the levels. Each level has half the nodes of the one below, rounded up
+	uint leafCount = (m_lightCount + kLeafSize - 1u) / kLeafSize;
+	m_levelOffsets.push_back(0u);
+	uint levelSize = leafCount;
+	for (;;) {
+		m_levelOffsets.push_back(m_levelOffsets.back() + levelSize);
+		if (levelSize == 1u) {
+			break;
+		}
+		levelSize = (levelSize + 1u) / 2u;
+	}
+	m_nodes.resize(m_levelOffsets.back());
+
+	// The leaves bound their lights
+	RunChunks(leafCount, kChunkSize / kLeafSize, threadPool, [&](uint begin, uint end) {
+		for (uint leaf = begin; leaf < end; ++leaf) {
+			Node &node = m_nodes[leaf];
+			node.AABBMin = DirectX::XMFLOAT3(FLT_MAX, FLT_MAX, FLT_MAX);
+			node.AABBMax = DirectX::XMFLOAT3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+
+			uint lightEnd = std::min((leaf + 1u) * kLeafSize, m_lightCount);
+			for (uint i = leaf * kLeafSize; i < lightEnd; ++i) {
+				const DirectX::XMFLOAT4 &sphere = m_spheres[m_sortedIndices[i]];
+				node.AABBMin = DirectX::XMFLOAT3(std::min(node.AABBMin.x, sphere.x - sphere.w), std::min(node.AABBMin.y, sphere.y - sphere.w), std::min(node.AABBMin.z, sphere.z - sphere.w));
+				node.AABBMax = DirectX::XMFLOAT3(std::max(node.AABBMax.x, sphere.x + sphere.w), std::max(node.AABBMax.y, sphere.y + sphere.w), std::max(node.AABBMax.z, sphere.z + sphere.w));
+			}
+		}
+	});
+
+	// Then each level bounds the pairs of nodes below it
+	for (uint level = 1u; level + 1u < m_levelOffsets.size(); ++level) {
+		uint childOffset = m_levelOffsets[level - 1u];
+		uint childCount = m_levelOffsets[level] - childOffset;
+		uint offset = m_levelOffsets[level];
+
+		RunChunks(m_levelOffsets[level + 1u] - offset, kChunkSize, threadPool, [&](uint begin, uint end) {
+			for (uint i = begin; i < end; ++i) {
+				Node &node = m_nodes[offset + i];
+				node = m_nodes[childOffset + 2u * i];
+				if (2u * i + 1u < childCount) {
+					const Node &right = m_nodes[childOffset + 2u * i + 1u];
+					node.AABBMin = DirectX::XMFLOAT3(std::min(node.AABBMin.x, right.AABBMin.x), std::min(node.AABBMin.y, right.AABBMin.y), std::min(node.AABBMin.z, right.AABBMin.z));
+					node.AABBMax = DirectX::XMFLOAT3(std::max(node.AABBMax.x, right.AABBMax.x), std::max(node.AABBMax.y, right.AABBMax.y), std::max(node.AABBMax.z, right.AABBMax.z));
+				}
+			}
+		});
+	}
+}
+
+void LightBVH::GetNodeBounds(uint level, uint node, DirectX::XMFLOAT3 *out_min, DirectX::XMFLOAT3 *out_max) const {
+	const Node &bounds = m_nodes[m_levelOffsets[level] + node];
+	*out_min = bounds.AABBMin;
+	*out_max = bounds.AABBMax;
+}
+
+uint LightBVH::Cull(const Frustum &frustum, std::vector<uint> *out_visible) const {
+	out_visible->clear();
+	if (m_lightCount == 0u) {
+		return 0u;
+	}
+
+	struct StackEntry {
+		uint Level;
+		uint Node;
+	};
+	// The stack never holds more than one entry per level, plus the sibling of each
+	StackEntry stack[64];
+	uint stackSize = 0u;
+	StackEntry root = {GetLevelCount() - 1u, 0u};
+	stack[stackSize++] = root;
+
+	while (stackSize > 0u) {
+		StackEntry entry = stack[--stackSize];
+		const Node &node = m_nodes[m_levelOffsets[entry.Level] + entry.Node];
+
+		bool inside = true;
+		bool outside = false;
+		for (uint i = 0; i < 6u && !outside; ++i) {
+			outside = MaxPlaneDistance(frustum.Planes[i], node.AABBMin, node.AABBMax) < 0.0f;
+			inside = inside && MinPlaneDistance(frustum.Planes[i], node.AABBMin, node.AABBMax) >= 0.0f;
+		}
+		if (outside) {
+			continue;
+		}
+
+		if (inside || entry.Level == 0u) {
+			// Node n of level l covers the leaves [n << l, (n + 1) << l)
+			uint begin = (entry.Node << entry.Level) * kLeafSize;
+			uint end = std::min(((entry.Node + 1u) << entry.Level) * kLeafSize, m_lightCount);
+			for (uint i = begin; i < end; ++i) {
+				out_visible->push_back(i);
+			}
+			continue;
+		}
+
+		// Push the right child first, so the left one is visited first, and the lights come out in order
+		uint childLevelSize = GetLevelSize(entry.Level - 1u);
+		if (2u * entry.Node + 1u < childLevelSize) {
+			StackEntry right = {entry.Level - 1u, 2u * entry.Node + 1u};
+			stack[stackSize++] = right;
+		}
+		StackEntry left = {entry.Level - 1u, 2u * entry.Node};
+		stack[stackSize++] = left;
+	}
+
+	return static_cast<uint>(out_visible->size());
+}
+
+uint LightBVH::Gather(const ShaderPointLight *lights, const Common::DirtyRangeList &dirtyLights, ShaderPointLight *out_sortedLights, Common::DirtyRangeList *out_dirtySortedLights) {
+	return GatherChanged(lights, m_sortedIndices, dirtyLights, &m_dirtyFlags, &m_gatheredIndices, out_sortedLights, out_dirtySortedLights);
+}
+
+uint LightBVH::Gather(const ShaderSpotLight *lights, const Common::DirtyRangeList &dirtyLights, ShaderSpotLight *out_sortedLights, Common::DirtyRangeList *out_dirtySortedLights) {
+	return GatherChanged(lights, m_sortedIndices, dirtyLights, &m_dirtyFlags, &m_gatheredIndices, out_sortedLights, out_dirtySortedLights);
+}
+
+} // End of namespace Scene
@@ -0,0 +1,142 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "common/typedefs.h"
+#include "common/radix_sort.h"
+
+#include <DirectXMath.h>
+
+#include <vector>
+
+
+namespace Common {
+class ThreadPool;
+class DirtyRangeList;
+}
+
+namespace Scene {
+
+struct Frustum;
+struct ShaderPointLight;
+struct ShaderSpotLight;
+
+/**
+ * A bounding volume hierarchy over a set of lights, rebuilt from scratch every frame
+ *
+ * The lights are sorted by the Morton code of their position, with a parallel radix sort, so
+ * lights that are close in the sorted order are close in space. The BVH is then implicit in the
+ * sorted order: each leaf is the next kLeafSize lights, and each node above is the next two nodes
+ * of the level below. Building it is a couple of linear passes, with no splitting decisions.
+ *
+ * Point lights are bounded by the sphere around their position, out to their range. Spot lights
+ * are bounded by the same sphere around their cone that ClusterLightAssigner uses, so culling with
+ * the BVH never drops a light that the assigner would have binned.
+ *
+ * The caller is expected to put the lights in the sorted order, with GetSortedIndices(), and keep
+ * them that way for the frame. Then Cull() can hand back the lights in the BVH order, and the
+ * lights that end up next to each other in the GPU buffers are near each other in space as well.
+ * Gather() does that, and only rewrites the sorted lights that changed since the last Gather(), so
+ * a scene where nothing moves doesn't have to upload anything.
+ */
+class LightBVH {
+public:
+	LightBVH();
+
+	/** The number of lights in each leaf */
+	static const uint kLeafSize = 8u;
+	/** The number of lights in each chunk of the parallel passes */
+	static const uint kChunkSize = 4096u;
+	/** The number of bits of each axis of the Morton codes */
+	static const uint kMortonAxisBits = 10u;
+
+private:
+	struct Node {
+		DirectX::XMFLOAT3 AABBMin;
+		DirectX::XMFLOAT3 AABBMax;
+	};
+
+	uint m_lightCount;
+
+	/** The (center, radius) of each light, in the order they were given */
+	std::vector<DirectX::XMFLOAT4> m_spheres;
+	std::vector<uint32> m_codes;
+	std::vector<uint32> m_sortedIndices;
+	Common::RadixSorter m_sorter;
+
+	/** The nodes of every level, starting with the leaves. The root is the last node */
+	std::vector<Node> m_nodes;
+	/** The index of the first node of each level. The last entry is the number of nodes */
+	std::vector<uint> m_levelOffsets;
+
+	/** The bounds of the centers of each chunk, for the Morton code quantization */
+	std::vector<Node> m_chunkBounds;
+
+	/** The sorted indices as of the last Gather(). IE. the order the caller's sorted lights are in */
+	std::vector<uint32> m_gatheredIndices;
+	/** Scratch space for Gather(). One flag per light, set if the light is dirty */
+	std::vector<byte> m_dirtyFlags;
+
+public:
+	/**
+	 * Sorts the lights, and builds the BVH over them
+	 *
+	 * @param lights         The lights
+	 * @param lightCount     The number of lights
+	 * @param threadPool     [Optional] If not nullptr, the passes over the lights are run in parallel chunks
+	 * @param radiusScale    [Optional] The ranges are multiplied by it. If the positions are later transformed by a scaled
+	 *                       matrix, and the ranges aren't, this should be one over the scale
+	 */
+	void Build(const ShaderPointLight *lights, uint lightCount, Common::ThreadPool *threadPool = nullptr, float radiusScale = 1.0f);
+	/** Same as above, for spot lights */
+	void Build(const ShaderSpotLight *lights, uint lightCount, Common::ThreadPool *threadPool = nullptr, float radiusScale = 1.0f);
+
+	inline uint GetLightCount() const { return m_lightCount; }
+	inline uint GetNodeCount() const { return static_cast<uint>(m_nodes.size()); }
+	inline uint GetLevelCount() const { return m_levelOffsets.empty() ? 0u : static_cast<uint>(m_levelOffsets.size()) - 1u; }
+	/** Entry i is the index, in the order the lights were given to Build(), of the i'th light in the BVH order */
+	inline const std::vector<uint32> &GetSortedIndices() const { return m_sortedIndices; }
+	/** The Morton codes of the lights, in the BVH order */
+	inline const std::vector<uint32> &GetSortedCodes() const { return m_codes; }
+	/** Returns the bounds of a node. Level 0 is the leaves */
+	void GetNodeBounds(uint level, uint node, DirectX::XMFLOAT3 *out_min, DirectX::XMFLOAT3 *out_max) const;
+	/** Returns the number of nodes of a level */
+	inline uint GetLevelSize(uint level) const { return m_levelOffsets[level + 1u] - m_levelOffsets[level]; }
+
+	/**
+	 * Finds the lights whose bounds might touch a frustum. Nodes that are completely inside of the
+	 * frustum add all of their lights without testing the children
+	 *
+	 * @param frustum        The frustum to test against
+	 * @param out_visible    Will be filled with the BVH order indices of the lights, in ascending order
+	 * @return               The number of lights
+	 */
+	uint Cull(const Frustum &frustum, std::vector<uint> *out_visible) const;
+
+	/**
+	 * Puts the lights into the BVH order. A sorted light is only written if a different light was in its
+	 * place after the last Gather(), or if the light was marked as dirty
+	 *
+	 * @param lights                   The lights, in the order they were given to Build()
+	 * @param dirtyLights              The lights that changed since the last Gather(), in the order they were given to Build()
+	 * @param out_sortedLights         The lights in the BVH order. Has to still hold what the last Gather() wrote
+	 * @param out_dirtySortedLights    The sorted lights that were written are added to it
+	 * @return                         The number of sorted lights that were written
+	 */
+	uint Gather(const ShaderPointLight *lights, const Common::DirtyRangeList &dirtyLights, ShaderPointLight *out_sortedLights, Common::DirtyRangeList *out_dirtySortedLights);
+	/** Same as above, for spot lights */
+	uint Gather(const ShaderSpotLight *lights, const Common::DirtyRangeList &dirtyLights, ShaderSpotLight *out_sortedLights, Common::DirtyRangeList *out_dirtySortedLights);
+
+private:
+	/** Sorts m_spheres, and builds the nodes */
+	void BuildFromSpheres(Common::ThreadPool *threadPool);
+
+	LightBVH(const LightBVH &);               // Not implemented
+	LightBVH &operator=(const LightBVH &);    // Not implemented
+};
+
+} // End of namespace Scene
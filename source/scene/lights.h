@@ -148,6 +148,8 @@ public:
 	inline float GetRange() const { return m_range; }
 	inline void SetRange(float range) { m_range = range; m_shaderPackedIsOutOfDate = true; }
 
+	/** Returns true if the light changed since the last GetShaderPackedLight() */
+	inline bool IsShaderPackedLightOutOfDate() const { return m_shaderPackedIsOutOfDate; }
 	const ShaderPointLight &GetShaderPackedLight();
 };
 
@@ -161,7 +163,8 @@ public:
 		  m_range(range),
 		  m_direction(direction),
 		  m_outerConeAngle(outerConeAngle),
-		  m_coneDifference(coneDifference) {
+		  m_coneDifference(coneDifference),
+		  m_shaderPackedIsOutOfDate(true) {
 	}
 
 private:
@@ -201,6 +204,8 @@ public:
 	inline float GetConeDifference() const { return m_coneDifference; }
 	inline void SetConeDifference(float coneDifference) { m_coneDifference = coneDifference; m_shaderPackedIsOutOfDate = true; }
 
+	/** Returns true if the light changed since the last GetShaderPackedLight() */
+	inline bool IsShaderPackedLightOutOfDate() const { return m_shaderPackedIsOutOfDate; }
 	const ShaderSpotLight &GetShaderPackedLight();
 };
 
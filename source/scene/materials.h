@@ -20,12 +20,18 @@ struct Material {
 	Material(Graphics::MaterialShader *shader, std::vector<ID3D11ShaderResourceView *> &textureSRVs, std::vector<ID3D11SamplerState *> &textureSamplers)
 		: Shader(shader),
 		  TextureSRVs(textureSRVs),
-		  TextureSamplers(textureSamplers) {
+		  TextureSamplers(textureSamplers),
+		  Id(0u) {
 	}
 
 	Graphics::MaterialShader *Shader;
 	std::vector<ID3D11ShaderResourceView *> TextureSRVs;
 	std::vector<ID3D11SamplerState *> TextureSamplers;
+	/** 
+	 * A dense id, unique among all materials. Assigned by Engine::MaterialCache. 
+	 * It isn't part of the material's identity, so operator==() and MaterialHasher ignore it
+	 */
+	uint32 Id;
 
 	bool operator==(const Material &rhs) const {
 		return Shader == rhs.Shader && Common::CompareVectors(TextureSRVs, rhs.TextureSRVs) && Common::CompareVectors(TextureSamplers, rhs.TextureSamplers);
@@ -0,0 +1,609 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "scene/mesh_bvh.h"
+
+#include "common/halfling_sys.h"
+
+#include "scene/model.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <xmmintrin.h>
+
+
+namespace Scene {
+
+namespace {
+
+struct BuildTriangle {
+	DirectX::XMFLOAT3 AABBMin;
+	DirectX::XMFLOAT3 AABBMax;
+	DirectX::XMFLOAT3 Centroid;
+	DirectX::XMFLOAT3 V0;
+	DirectX::XMFLOAT3 V1;
+	DirectX::XMFLOAT3 V2;
+	uint Triangle;
+};
+
+inline float SurfaceArea(const DirectX::XMFLOAT3 &aabbMin, const DirectX::XMFLOAT3 &aabbMax) {
+	float x = aabbMax.x - aabbMin.x;
+	float y = aabbMax.y - aabbMin.y;
+	float z = aabbMax.z - aabbMin.z;
+	return 2.0f * (x * y + y * z + z * x);
+}
+
+inline void Union(const DirectX::XMFLOAT3 &aMin, const DirectX::XMFLOAT3 &aMax, const DirectX::XMFLOAT3 &bMin, const DirectX::XMFLOAT3 &bMax, DirectX::XMFLOAT3 *out_min, DirectX::XMFLOAT3 *out_max) {
+	*out_min = DirectX::XMFLOAT3(std::min(aMin.x, bMin.x), std::min(aMin.y, bMin.y), std::min(aMin.z, bMin.z));
+	*out_max = DirectX::XMFLOAT3(std::max(aMax.x, bMax.x), std::max(aMax.y, bMax.y), std::max(aMax.z, bMax.z));
+}
+
+inline float Component(const DirectX::XMFLOAT3 &vector, uint axis) {
+	return (&vector.x)[axis];
+}
+
+/**
+ * Direction components of exactly 0 would give an infinite inverse, and (0 * infinity) is a NaN
+ * in the slab test. Nudging them keeps the inverse finite, without changing which boxes are hit
+ */
+inline float SafeInverse(float value) {
+	static const float kMinMagnitude = 1e-20f;
+	if (std::fabs(value) < kMinMagnitude) {
+		value = value < 0.0f ? -kMinMagnitude : kMinMagnitude;
+	}
+	return 1.0f / value;
+}
+
+/**
+ * The traversal stack of the queries. Both children are pushed when a node is visited, so a depth
+ * first traversal never has more than height + 1 nodes on the stack
+ */
+class TraversalStack {
+public:
+	TraversalStack(uint treeHeight)
+			: m_data(m_local),
+			  m_size(0u) {
+		uint capacity = treeHeight + 2u;
+		if (capacity > kLocalSize) {
+			m_heap.resize(capacity);
+			m_data = &m_heap[0];
+		}
+	}
+
+private:
+	static const uint kLocalSize = 64u;
+
+	uint m_local[kLocalSize];
+	std::vector<uint> m_heap;
+	uint *m_data;
+	uint m_size;
+
+public:
+	inline void Push(uint node) { m_data[m_size++] = node; }
+	inline uint Pop() { return m_data[--m_size]; }
+	inline bool IsEmpty() const { return m_size == 0u; }
+};
+
+/** A ray splatted across all 4 lanes, for testing it against a TrianglePack */
+struct SplatRay {
+	__m128 OriginX, OriginY, OriginZ;
+	__m128 DirectionX, DirectionY, DirectionZ;
+};
+
+/**
+ * The Moller-Trumbore test of 4 rays against 4 triangles, one pair per lane. Either side can be splatted
+ *
+ * @param maxDistance     Hits at or beyond this distance are ignored
+ * @param out_distance    Will be filled with the distance of each lane. Only valid for the lanes that hit
+ * @return                The lanes that hit
+ */
+inline __m128 IntersectTriangles(const __m128 &originX, const __m128 &originY, const __m128 &originZ,
+                                 const __m128 &directionX, const __m128 &directionY, const __m128 &directionZ,
+                                 const __m128 &v0X, const __m128 &v0Y, const __m128 &v0Z,
+                                 const __m128 &edge1X, const __m128 &edge1Y, const __m128 &edge1Z,
+                                 const __m128 &edge2X, const __m128 &edge2Y, const __m128 &edge2Z,
+                                 const __m128 &maxDistance, __m128 *out_distance) {
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+
+	// p = cross(direction, edge2)
+	__m128 pX = _mm_sub_ps(_mm_mul_ps(directionY, edge2Z), _mm_mul_ps(directionZ, edge2Y));
+	__m128 pY = _mm_sub_ps(_mm_mul_ps(directionZ, edge2X), _mm_mul_ps(directionX, edge2Z));
+	__m128 pZ = _mm_sub_ps(_mm_mul_ps(directionX, edge2Y), _mm_mul_ps(directionY, edge2X));
+	__m128 determinant = _mm_add_ps(_mm_add_ps(_mm_mul_ps(edge1X, pX), _mm_mul_ps(edge1Y, pY)), _mm_mul_ps(edge1Z, pZ));
+	// A division rather than _mm_rcp_ps(), so the result matches IntersectTriangle() exactly
+	__m128 inverseDeterminant = _mm_div_ps(one, determinant);
+
+	__m128 tX = _mm_sub_ps(originX, v0X);
+	__m128 tY = _mm_sub_ps(originY, v0Y);
+	__m128 tZ = _mm_sub_ps(originZ, v0Z);
+	__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tX, pX), _mm_mul_ps(tY, pY)), _mm_mul_ps(tZ, pZ)), inverseDeterminant);
+
+	// q = cross(t, edge1)
+	__m128 qX = _mm_sub_ps(_mm_mul_ps(tY, edge1Z), _mm_mul_ps(tZ, edge1Y));
+	__m128 qY = _mm_sub_ps(_mm_mul_ps(tZ, edge1X), _mm_mul_ps(tX, edge1Z));
+	__m128 qZ = _mm_sub_ps(_mm_mul_ps(tX, edge1Y), _mm_mul_ps(tY, edge1X));
+	__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(directionX, qX), _mm_mul_ps(directionY, qY)), _mm_mul_ps(directionZ, qZ)), inverseDeterminant);
+	__m128 distance = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(edge2X, qX), _mm_mul_ps(edge2Y, qY)), _mm_mul_ps(edge2Z, qZ)), inverseDeterminant);
+
+	// Every comparison is false for a NaN, so degenerate triangles and the empty lanes of a pack never hit
+	__m128 hit = _mm_cmpneq_ps(determinant, zero);
+	hit = _mm_and_ps(hit, _mm_cmpge_ps(u, zero));
+	hit = _mm_and_ps(hit, _mm_cmpge_ps(v, zero));
+	hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(u, v), one));
+	hit = _mm_and_ps(hit, _mm_cmpge_ps(distance, zero));
+	hit = _mm_and_ps(hit, _mm_cmplt_ps(distance, maxDistance));
+
+	*out_distance = distance;
+	return hit;
+}
+
+/**
+ * The slab test of one ray against one box, using 3 lanes. The 4th lane holds the [0, maxDistance]
+ * range of the ray, so the result is clamped to it for free
+ *
+ * @param origin              (x, y, z, 0)
+ * @param inverseDirection    (1 / x, 1 / y, 1 / z, 1)
+ */
+inline bool IntersectBox(const DirectX::XMFLOAT3 &aabbMin, const DirectX::XMFLOAT3 &aabbMax, const __m128 &origin, const __m128 &inverseDirection, float maxDistance) {
+	__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_setr_ps(aabbMin.x, aabbMin.y, aabbMin.z, 0.0f), origin), inverseDirection);
+	__m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_setr_ps(aabbMax.x, aabbMax.y, aabbMax.z, maxDistance), origin), inverseDirection);
+	__m128 tNear = _mm_min_ps(t1, t2);
+	__m128 tFar = _mm_max_ps(t1, t2);
+
+	// Horizontal max of the near distances, and min of the far ones
+	tNear = _mm_max_ps(tNear, _mm_shuffle_ps(tNear, tNear, _MM_SHUFFLE(2, 3, 0, 1)));
+	tNear = _mm_max_ps(tNear, _mm_shuffle_ps(tNear, tNear, _MM_SHUFFLE(1, 0, 3, 2)));
+	tFar = _mm_min_ps(tFar, _mm_shuffle_ps(tFar, tFar, _MM_SHUFFLE(2, 3, 0, 1)));
+	tFar = _mm_min_ps(tFar, _mm_shuffle_ps(tFar, tFar, _MM_SHUFFLE(1, 0, 3, 2)));
+
+	return _mm_comile_ss(tNear, tFar) != 0;
+}
+
+} // End of anonymous namespace
+
+
+void RayPacket::Set(uint lane, const DirectX::XMFLOAT3 &origin, const DirectX::XMFLOAT3 &direction, float maxDistance) {
+	OriginX[lane] = origin.x;
+	OriginY[lane] = origin.y;
+	OriginZ[lane] = origin.z;
+	DirectionX[lane] = direction.x;
+	DirectionY[lane] = direction.y;
+	DirectionZ[lane] = direction.z;
+	Distance[lane] = maxDistance;
+	Triangle[lane] = kNoHit;
+	Object[lane] = kNoHit;
+}
+
+
+MeshBVH::MeshBVH(const Model *model)
+		: m_triangleCount(0u),
+		  m_height(0u) {
+	Build(model);
+}
+
+void MeshBVH::Build(const Model *model) {
+	AssertMsg(!model->CPUPositions.empty() || model->IndexCount == 0u, "The model has no CPU geometry. Model::KeepCPUGeometry() has to be called when it's created");
+
+	std::vector<BuildTriangle> triangles;
+	for (uint i = 0; i < model->SubsetCount; ++i) {
+		const ModelSubset &subset = model->Subsets[i];
+		AssertMsg(subset.IndexStart % 3u == 0u, "Subset " << i << " doesn't start on a triangle");
+
+		const DirectX::XMFLOAT3 *positions = &model->CPUPositions[subset.VertexStart];
+		const uint *indices = &model->CPUIndices[subset.IndexStart];
+		for (uint j = 0; j + 2u < subset.IndexCount; j += 3u) {
+			BuildTriangle triangle;
+			triangle.V0 = positions[indices[j]];
+			triangle.V1 = positions[indices[j + 1u]];
+			triangle.V2 = positions[indices[j + 2u]];
+			triangle.Triangle = (subset.IndexStart + j) / 3u;
+
+			Union(triangle.V0, triangle.V0, triangle.V1, triangle.V1, &triangle.AABBMin, &triangle.AABBMax);
+			Union(triangle.AABBMin, triangle.AABBMax, triangle.V2, triangle.V2, &triangle.AABBMin, &triangle.AABBMax);
+			triangle.Centroid = DirectX::XMFLOAT3((triangle.AABBMin.x + triangle.AABBMax.x) * 0.5f,
+			                                      (triangle.AABBMin.y + triangle.AABBMax.y) * 0.5f,
+			                                      (triangle.AABBMin.z + triangle.AABBMax.z) * 0.5f);
+			triangles.push_back(triangle);
+		}
+	}
+
+	m_triangleCount = static_cast<uint>(triangles.size());
+	m_nodes.clear();
+	m_packs.clear();
+	m_height = 0u;
+	if (triangles.empty()) {
+		return;
+	}
+	m_nodes.reserve((m_triangleCount / kMaxLeafTriangles) * 2u + 1u);
+
+	struct BuildTask {
+		uint Begin;
+		uint End;
+		/** The parent, if this is the second child. Its Offset is pointed at this node */
+		uint SecondChildOf;
+		uint Depth;
+	};
+	struct Bin {
+		DirectX::XMFLOAT3 AABBMin;
+		DirectX::XMFLOAT3 AABBMax;
+		uint Count;
+	};
+	static const uint kNoParent = 0xFFFFFFFF;
+
+	std::vector<BuildTask> tasks;
+	BuildTask rootTask = {0u, m_triangleCount, kNoParent, 0u};
+	tasks.push_back(rootTask);
+
+	// The first child is always pushed last, so it's built right after its parent. That gives the depth first layout
+	while (!tasks.empty()) {
+		BuildTask task = tasks.back();
+		tasks.pop_back();
+
+		uint index = static_cast<uint>(m_nodes.size());
+		m_nodes.push_back(Node());
+		if (task.SecondChildOf != kNoParent) {
+			m_nodes[task.SecondChildOf].Offset = index;
+		}
+		m_height = std::max(m_height, task.Depth);
+
+		DirectX::XMFLOAT3 aabbMin(FLT_MAX, FLT_MAX, FLT_MAX);
+		DirectX::XMFLOAT3 aabbMax(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		DirectX::XMFLOAT3 centroidMin(FLT_MAX, FLT_MAX, FLT_MAX);
+		DirectX::XMFLOAT3 centroidMax(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		for (uint i = task.Begin; i < task.End; ++i) {
+			Union(aabbMin, aabbMax, triangles[i].AABBMin, triangles[i].AABBMax, &aabbMin, &aabbMax);
+			Union(centroidMin, centroidMax, triangles[i].Centroid, triangles[i].Centroid, &centroidMin, &centroidMax);
+		}
+
+		Node &node = m_nodes[index];
+		node.AABBMin = aabbMin;
+		node.AABBMax = aabbMax;
+		node.Offset = 0u;
+		node.TriangleCount = 0u;
+		node.Axis = 0u;
+
+		uint count = task.End - task.Begin;
+		if (count <= kMaxLeafTriangles) {
+			TrianglePack pack;
+			memset(&pack, 0, sizeof(TrianglePack));
+			for (uint i = 0; i < count; ++i) {
+				const BuildTriangle &triangle = triangles[task.Begin + i];
+				pack.V0X[i] = triangle.V0.x;
+				pack.V0Y[i] = triangle.V0.y;
+				pack.V0Z[i] = triangle.V0.z;
+				pack.Edge1X[i] = triangle.V1.x - triangle.V0.x;
+				pack.Edge1Y[i] = triangle.V1.y - triangle.V0.y;
+				pack.Edge1Z[i] = triangle.V1.z - triangle.V0.z;
+				pack.Edge2X[i] = triangle.V2.x - triangle.V0.x;
+				pack.Edge2Y[i] = triangle.V2.y - triangle.V0.y;
+				pack.Edge2Z[i] = triangle.V2.z - triangle.V0.z;
+				pack.Triangle[i] = triangle.Triangle;
+			}
+
+			node.Offset = static_cast<uint>(m_packs.size());
+			node.TriangleCount = static_cast<uint16>(count);
+			m_packs.push_back(pack);
+			continue;
+		}
+
+		// Find the cheapest split plane between the bins, on any axis
+		float bestCost = FLT_MAX;
+		uint bestAxis = 0u;
+		uint bestSplit = 0u;
+		for (uint axis = 0; axis < 3; ++axis) {
+			float axisMin = Component(centroidMin, axis);
+			float extent = Component(centroidMax, axis) - axisMin;
+			if (extent <= 0.0f) {
+				continue;
+			}
+			float binScale = kSAHBinCount / extent;
+
+			Bin bins[kSAHBinCount];
+			for (uint i = 0; i < kSAHBinCount; ++i) {
+				bins[i].AABBMin = DirectX::XMFLOAT3(FLT_MAX, FLT_MAX, FLT_MAX);
+				bins[i].AABBMax = DirectX::XMFLOAT3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+				bins[i].Count = 0u;
+			}
+			for (uint i = task.Begin; i < task.End; ++i) {
+				const BuildTriangle &triangle = triangles[i];
+				uint bin = std::min(static_cast<uint>((Component(triangle.Centroid, axis) - axisMin) * binScale), kSAHBinCount - 1u);
+				Union(bins[bin].AABBMin, bins[bin].AABBMax, triangle.AABBMin, triangle.AABBMax, &bins[bin].AABBMin, &bins[bin].AABBMax);
+				++bins[bin].Count;
+			}
+
+			// Sweep from the right to get the cost of everything after each split
+			float rightCosts[kSAHBinCount];
+			DirectX::XMFLOAT3 rightMin(FLT_MAX, FLT_MAX, FLT_MAX);
+			DirectX::XMFLOAT3 rightMax(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+			uint rightCount = 0u;
+			for (uint i = kSAHBinCount - 1u; i > 0u; --i) {
+				Union(rightMin, rightMax, bins[i].AABBMin, bins[i].AABBMax, &rightMin, &rightMax);
+				rightCount += bins[i].Count;
+				rightCosts[i - 1u] = rightCount == 0u ? 0.0f : SurfaceArea(rightMin, rightMax) * rightCount;
+			}
+
+			// Then from the left, splitting after bin i
+			DirectX::XMFLOAT3 leftMin(FLT_MAX, FLT_MAX, FLT_MAX);
+			DirectX::XMFLOAT3 leftMax(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+			uint leftCount = 0u;
+			for (uint i = 0; i < kSAHBinCount - 1u; ++i) {
+				Union(leftMin, leftMax, bins[i].AABBMin, bins[i].AABBMax, &leftMin, &leftMax);
+				leftCount += bins[i].Count;
+				if (leftCount == 0u || leftCount == count) {
+					continue;
+				}
+
+				float cost = SurfaceArea(leftMin, leftMax) * leftCount + rightCosts[i];
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = i;
+				}
+			}
+		}
+
+		uint middle;
+		if (bestCost < FLT_MAX) {
+			float axisMin = Component(centroidMin, bestAxis);
+			float binScale = kSAHBinCount / (Component(centroidMax, bestAxis) - axisMin);
+			auto middleIter = std::partition(triangles.begin() + task.Begin, triangles.begin() + task.End, [=](const BuildTriangle &triangle) {
+				return std::min(static_cast<uint>((Component(triangle.Centroid, bestAxis) - axisMin) * binScale), kSAHBinCount - 1u) <= bestSplit;
+			});
+			middle = static_cast<uint>(middleIter - triangles.begin());
+		} else {
+			// All the centroids are in the same place, so any split is as good as any other
+			middle = task.Begin + count / 2u;
+		}
+		node.Axis = static_cast<uint16>(bestAxis);
+
+		BuildTask second = {middle, task.End, index, task.Depth + 1u};
+		BuildTask first = {task.Begin, middle, kNoParent, task.Depth + 1u};
+		tasks.push_back(second);
+		tasks.push_back(first);
+	}
+}
+
+bool MeshBVH::Intersect(const DirectX::XMFLOAT3 &origin, const DirectX::XMFLOAT3 &direction, float maxDistance, RayHit *out_hit) const {
+	if (m_nodes.empty()) {
+		return false;
+	}
+
+	__m128 boxOrigin = _mm_setr_ps(origin.x, origin.y, origin.z, 0.0f);
+	__m128 inverseDirection = _mm_setr_ps(SafeInverse(direction.x), SafeInverse(direction.y), SafeInverse(direction.z), 1.0f);
+	SplatRay ray = {_mm_set1_ps(origin.x), _mm_set1_ps(origin.y), _mm_set1_ps(origin.z),
+	                _mm_set1_ps(direction.x), _mm_set1_ps(direction.y), _mm_set1_ps(direction.z)};
+	bool negative[3] = {direction.x < 0.0f, direction.y < 0.0f, direction.z < 0.0f};
+
+	float closest = maxDistance;
+	uint closestTriangle = RayPacket::kNoHit;
+
+	TraversalStack stack(m_height);
+	stack.Push(0u);
+	while (!stack.IsEmpty()) {
+		uint index = stack.Pop();
+		const Node &node = m_nodes[index];
+
+		// Tested against the closest hit so far, so anything behind it is skipped
+		if (!IntersectBox(node.AABBMin, node.AABBMax, boxOrigin, inverseDirection, closest)) {
+			continue;
+		}
+
+		if (node.TriangleCount == 0u) {
+			// Visit the nearer child first, so the closest hit shrinks as soon as possible
+			if (negative[node.Axis]) {
+				stack.Push(index + 1u);
+				stack.Push(node.Offset);
+			} else {
+				stack.Push(node.Offset);
+				stack.Push(index + 1u);
+			}
+			continue;
+		}
+
+		const TrianglePack &pack = m_packs[node.Offset];
+		__m128 distance;
+		__m128 hit = IntersectTriangles(ray.OriginX, ray.OriginY, ray.OriginZ, ray.DirectionX, ray.DirectionY, ray.DirectionZ,
+		                                _mm_loadu_ps(pack.V0X), _mm_loadu_ps(pack.V0Y), _mm_loadu_ps(pack.V0Z),
+		                                _mm_loadu_ps(pack.Edge1X), _mm_loadu_ps(pack.Edge1Y), _mm_loadu_ps(pack.Edge1Z),
+		                                _mm_loadu_ps(pack.Edge2X), _mm_loadu_ps(pack.Edge2Y), _mm_loadu_ps(pack.Edge2Z),
+		                                _mm_set1_ps(closest), &distance);
+		uint hitMask = static_cast<uint>(_mm_movemask_ps(hit));
+		if (hitMask == 0u) {
+			continue;
+		}
+
+		float distances[kMaxLeafTriangles];
+		_mm_storeu_ps(distances, distance);
+		for (uint i = 0; i < kMaxLeafTriangles; ++i) {
+			if ((hitMask & (1u << i)) != 0u && distances[i] < closest) {
+				closest = distances[i];
+				closestTriangle = pack.Triangle[i];
+			}
+		}
+	}
+
+	if (closestTriangle == RayPacket::kNoHit) {
+		return false;
+	}
+
+	out_hit->Distance = closest;
+	out_hit->Triangle = closestTriangle;
+	return true;
+}
+
+bool MeshBVH::IntersectAny(const DirectX::XMFLOAT3 &origin, const DirectX::XMFLOAT3 &direction, float maxDistance) const {
+	if (m_nodes.empty()) {
+		return false;
+	}
+
+	__m128 boxOrigin = _mm_setr_ps(origin.x, origin.y, origin.z, 0.0f);
+	__m128 inverseDirection = _mm_setr_ps(SafeInverse(direction.x), SafeInverse(direction.y), SafeInverse(direction.z), 1.0f);
+	SplatRay ray = {_mm_set1_ps(origin.x), _mm_set1_ps(origin.y), _mm_set1_ps(origin.z),
+	                _mm_set1_ps(direction.x), _mm_set1_ps(direction.y), _mm_set1_ps(direction.z)};
+	__m128 maxDistances = _mm_set1_ps(maxDistance);
+
+	TraversalStack stack(m_height);
+	stack.Push(0u);
+	while (!stack.IsEmpty()) {
+		uint index = stack.Pop();
+		const Node &node = m_nodes[index];
+
+		if (!IntersectBox(node.AABBMin, node.AABBMax, boxOrigin, inverseDirection, maxDistance)) {
+			continue;
+		}
+
+		if (node.TriangleCount == 0u) {
+			stack.Push(node.Offset);
+			stack.Push(index + 1u);
+			continue;
+		}
+
+		const TrianglePack &pack = m_packs[node.Offset];
+		__m128 distance;
+		__m128 hit = IntersectTriangles(ray.OriginX, ray.OriginY, ray.OriginZ, ray.DirectionX, ray.DirectionY, ray.DirectionZ,
+		                                _mm_loadu_ps(pack.V0X), _mm_loadu_ps(pack.V0Y), _mm_loadu_ps(pack.V0Z),
+		                                _mm_loadu_ps(pack.Edge1X), _mm_loadu_ps(pack.Edge1Y), _mm_loadu_ps(pack.Edge1Z),
+		                                _mm_loadu_ps(pack.Edge2X), _mm_loadu_ps(pack.Edge2Y), _mm_loadu_ps(pack.Edge2Z),
+		                                maxDistances, &distance);
+		if (_mm_movemask_ps(hit) != 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+uint MeshBVH::Intersect(RayPacket *packet) const {
+	if (m_nodes.empty()) {
+		return 0u;
+	}
+
+	__m128 originX = _mm_loadu_ps(packet->OriginX);
+	__m128 originY = _mm_loadu_ps(packet->OriginY);
+	__m128 originZ = _mm_loadu_ps(packet->OriginZ);
+	__m128 directionX = _mm_loadu_ps(packet->DirectionX);
+	__m128 directionY = _mm_loadu_ps(packet->DirectionY);
+	__m128 directionZ = _mm_loadu_ps(packet->DirectionZ);
+	__m128 closest = _mm_loadu_ps(packet->Distance);
+
+	float inverseDirections[3][RayPacket::kSize];
+	for (uint i = 0; i < RayPacket::kSize; ++i) {
+		inverseDirections[0][i] = SafeInverse(packet->DirectionX[i]);
+		inverseDirections[1][i] = SafeInverse(packet->DirectionY[i]);
+		inverseDirections[2][i] = SafeInverse(packet->DirectionZ[i]);
+	}
+	__m128 inverseDirectionX = _mm_loadu_ps(inverseDirections[0]);
+	__m128 inverseDirectionY = _mm_loadu_ps(inverseDirections[1]);
+	__m128 inverseDirectionZ = _mm_loadu_ps(inverseDirections[2]);
+	const __m128 zero = _mm_setzero_ps();
+
+	// The traversal order follows the first ray. For a coherent packet, that's right for all of them
+	bool negative[3] = {packet->DirectionX[0] < 0.0f, packet->DirectionY[0] < 0.0f, packet->DirectionZ[0] < 0.0f};
+	uint hitMask = 0u;
+
+	TraversalStack stack(m_height);
+	stack.Push(0u);
+	while (!stack.IsEmpty()) {
+		uint index = stack.Pop();
+		const Node &node = m_nodes[index];
+
+		// The slab test, with one ray per lane
+		__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.AABBMin.x), originX), inverseDirectionX);
+		__m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.AABBMax.x), originX), inverseDirectionX);
+		__m128 tNear = _mm_min_ps(t1, t2);
+		__m128 tFar = _mm_max_ps(t1, t2);
+		t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.AABBMin.y), originY), inverseDirectionY);
+		t2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.AABBMax.y), originY), inverseDirectionY);
+		tNear = _mm_max_ps(tNear, _mm_min_ps(t1, t2));
+		tFar = _mm_min_ps(tFar, _mm_max_ps(t1, t2));
+		t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.AABBMin.z), originZ), inverseDirectionZ);
+		t2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.AABBMax.z), originZ), inverseDirectionZ);
+		tNear = _mm_max_ps(_mm_max_ps(tNear, _mm_min_ps(t1, t2)), zero);
+		tFar = _mm_min_ps(_mm_min_ps(tFar, _mm_max_ps(t1, t2)), closest);
+
+		if (_mm_movemask_ps(_mm_cmple_ps(tNear, tFar)) == 0) {
+			continue;
+		}
+
+		if (node.TriangleCount == 0u) {
+			if (negative[node.Axis]) {
+				stack.Push(index + 1u);
+				stack.Push(node.Offset);
+			} else {
+				stack.Push(node.Offset);
+				stack.Push(index + 1u);
+			}
+			continue;
+		}
+
+		// Each triangle of the leaf against all the rays
+		const TrianglePack &pack = m_packs[node.Offset];
+		for (uint i = 0; i < node.TriangleCount; ++i) {
+			__m128 distance;
+			__m128 hit = IntersectTriangles(originX, originY, originZ, directionX, directionY, directionZ,
+			                                _mm_set1_ps(pack.V0X[i]), _mm_set1_ps(pack.V0Y[i]), _mm_set1_ps(pack.V0Z[i]),
+			                                _mm_set1_ps(pack.Edge1X[i]), _mm_set1_ps(pack.Edge1Y[i]), _mm_set1_ps(pack.Edge1Z[i]),
+			                                _mm_set1_ps(pack.Edge2X[i]), _mm_set1_ps(pack.Edge2Y[i]), _mm_set1_ps(pack.Edge2Z[i]),
+			                                closest, &distance);
+			uint laneMask = static_cast<uint>(_mm_movemask_ps(hit));
+			if (laneMask == 0u) {
+				continue;
+			}
+
+			closest = _mm_or_ps(_mm_and_ps(hit, distance), _mm_andnot_ps(hit, closest));
+			for (uint lane = 0; lane < RayPacket::kSize; ++lane) {
+				if ((laneMask & (1u << lane)) != 0u) {
+					packet->Triangle[lane] = pack.Triangle[i];
+				}
+			}
+			hitMask |= laneMask;
+		}
+	}
+
+	_mm_storeu_ps(packet->Distance, closest);
+	return hitMask;
+}
+
+bool MeshBVH::IntersectTriangle(const DirectX::XMFLOAT3 &origin, const DirectX::XMFLOAT3 &direction, const DirectX::XMFLOAT3 &v0, const DirectX::XMFLOAT3 &v1, const DirectX::XMFLOAT3 &v2, float *out_distance) {
+	float edge1X = v1.x - v0.x;
+	float edge1Y = v1.y - v0.y;
+	float edge1Z = v1.z - v0.z;
+	float edge2X = v2.x - v0.x;
+	float edge2Y = v2.y - v0.y;
+	float edge2Z = v2.z - v0.z;
+
+	float pX = direction.y * edge2Z - direction.z * edge2Y;
+	float pY = direction.z * edge2X - direction.x * edge2Z;
+	float pZ = direction.x * edge2Y - direction.y * edge2X;
+	float determinant = edge1X * pX + edge1Y * pY + edge1Z * pZ;
+	if (determinant == 0.0f) {
+		return false;
+	}
+	float inverseDeterminant = 1.0f / determinant;
+
+	float tX = origin.x - v0.x;
+	float tY = origin.y - v0.y;
+	float tZ = origin.z - v0.z;
+	float u = (tX * pX + tY * pY + tZ * pZ) * inverseDeterminant;
+
+	float qX = tY * edge1Z - tZ * edge1Y;
+	float qY = tZ * edge1X - tX * edge1Z;
+	float qZ = tX * edge1Y - tY * edge1X;
+	float v = (direction.x * qX + direction.y * qY + direction.z * qZ) * inverseDeterminant;
+	float distance = (edge2X * qX + edge2Y * qY + edge2Z * qZ) * inverseDeterminant;
+
+	if (!(u >= 0.0f && v >= 0.0f && u + v <= 1.0f && distance >= 0.0f)) {
+		return false;
+	}
+
+	*out_distance = distance;
+	return true;
+}
+
+} // End of namespace Scene
@@ -0,0 +1,166 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "common/typedefs.h"
+
+#include <DirectXMath.h>
+
+#include <vector>
+
+
+namespace Scene {
+
+class Model;
+
+/** The result of a ray query */
+struct RayHit {
+	RayHit()
+		: Distance(0.0f),
+		  Triangle(0xFFFFFFFF),
+		  Object(0xFFFFFFFF) {
+	}
+
+	/** The distance along the ray, in multiples of the ray direction */
+	float Distance;
+	/** The index of the triangle that was hit. IE. its indices start at Model::CPUIndices[Triangle * 3] */
+	uint Triangle;
+	/** The object that was hit. Only filled in by RayPicker */
+	uint Object;
+};
+
+/**
+ * 4 rays in SoA form, so they can be traced together with one SIMD lane per ray
+ *
+ * Distance is both the input and the output. Going in, it's the furthest distance a hit is
+ * accepted at. Coming out, it's the distance of the closest hit, with Triangle (and Object)
+ * filled in. Lanes that didn't hit anything closer are left as they were
+ */
+struct RayPacket {
+	static const uint kSize = 4u;
+	static const uint kNoHit = 0xFFFFFFFF;
+
+	float OriginX[kSize];
+	float OriginY[kSize];
+	float OriginZ[kSize];
+	float DirectionX[kSize];
+	float DirectionY[kSize];
+	float DirectionZ[kSize];
+
+	float Distance[kSize];
+	uint Triangle[kSize];
+	uint Object[kSize];
+
+	/**
+	 * Sets one ray of the packet, and resets its hit
+	 *
+	 * @param lane           The ray to set. In [0, kSize)
+	 * @param origin         The start of the ray
+	 * @param direction      The direction of the ray. Doesn't need to be normalized
+	 * @param maxDistance    Hits further along the ray than this, in multiples of 'direction', are ignored
+	 */
+	void Set(uint lane, const DirectX::XMFLOAT3 &origin, const DirectX::XMFLOAT3 &direction, float maxDistance);
+};
+
+/**
+ * A static bounding volume hierarchy over the triangles of a Model, for ray queries on the CPU
+ *
+ * It's built from Model::CPUPositions and Model::CPUIndices with a binned SAH build, and flattened
+ * in depth first order, so the first child of a node is always the next node. The triangles of a
+ * leaf are pre-transformed into (vertex, edge, edge) form and stored 4 to a pack, in SoA. So a
+ * single ray tests a whole leaf with one SIMD Moller-Trumbore. A RayPacket flips that around, and
+ * tests one triangle against all 4 rays at once.
+ *
+ * Everything is in model space. Use Model::GetMeshBVH() to get the lazily built BVH of a model.
+ */
+class MeshBVH {
+public:
+	/**
+	 * @param model    The model to build from. Its CPU geometry has to have been kept. See Model::KeepCPUGeometry()
+	 */
+	MeshBVH(const Model *model);
+
+	/** The most triangles a leaf can hold. Also the SIMD width of the single ray triangle test */
+	static const uint kMaxLeafTriangles = 4u;
+	/** The number of bins the SAH build sorts the centroids into, per axis */
+	static const uint kSAHBinCount = 16u;
+
+private:
+	struct Node {
+		DirectX::XMFLOAT3 AABBMin;
+		/** For a leaf, the index of its TrianglePack. Otherwise, the index of the second child */
+		uint Offset;
+		DirectX::XMFLOAT3 AABBMax;
+		/** 0 for an internal node */
+		uint16 TriangleCount;
+		/** The axis the children were split on. Used to visit the nearer child first */
+		uint16 Axis;
+	};
+
+	/** Up to 4 triangles, as a vertex and two edges. Unused lanes have zero edges, which never hit */
+	struct TrianglePack {
+		float V0X[kMaxLeafTriangles];
+		float V0Y[kMaxLeafTriangles];
+		float V0Z[kMaxLeafTriangles];
+		float Edge1X[kMaxLeafTriangles];
+		float Edge1Y[kMaxLeafTriangles];
+		float Edge1Z[kMaxLeafTriangles];
+		float Edge2X[kMaxLeafTriangles];
+		float Edge2Y[kMaxLeafTriangles];
+		float Edge2Z[kMaxLeafTriangles];
+		uint Triangle[kMaxLeafTriangles];
+	};
+
+	std::vector<Node> m_nodes;
+	std::vector<TrianglePack> m_packs;
+	uint m_triangleCount;
+	uint m_height;
+
+public:
+	inline uint GetTriangleCount() const { return m_triangleCount; }
+	inline uint GetNodeCount() const { return static_cast<uint>(m_nodes.size()); }
+	/** Returns the number of edges on the longest path from the root to a leaf */
+	inline uint GetHeight() const { return m_height; }
+
+	/**
+	 * Finds the closest triangle along a ray
+	 *
+	 * @param origin         The model space start of the ray
+	 * @param direction      The model space direction of the ray. Doesn't need to be normalized
+	 * @param maxDistance    Hits further along the ray than this, in multiples of 'direction', are ignored
+	 * @param out_hit        Will be filled with the closest hit, if there is one. Object isn't touched
+	 * @return               True if the ray hit a triangle
+	 */
+	bool Intersect(const DirectX::XMFLOAT3 &origin, const DirectX::XMFLOAT3 &direction, float maxDistance, RayHit *out_hit) const;
+	/** Returns true if the ray hits any triangle closer than 'maxDistance'. Stops at the first hit it finds */
+	bool IntersectAny(const DirectX::XMFLOAT3 &origin, const DirectX::XMFLOAT3 &direction, float maxDistance) const;
+	/**
+	 * Finds the closest triangle along each ray of a packet. The rays should be coherent (IE. from
+	 * neighbouring pixels), or the packet will visit the union of the nodes every ray visits
+	 *
+	 * @param packet    The model space rays. See RayPacket for how the hits are returned. Object isn't touched
+	 * @return          A mask of the lanes that found a closer hit. Bit i is lane i
+	 */
+	uint Intersect(RayPacket *packet) const;
+
+	/**
+	 * Tests a single triangle against a ray, with the same math as the BVH queries
+	 *
+	 * @param out_distance    Will be filled with the distance along the ray, if it hits
+	 * @return                True if the ray hits the front or the back of the triangle at a distance >= 0
+	 */
+	static bool IntersectTriangle(const DirectX::XMFLOAT3 &origin, const DirectX::XMFLOAT3 &direction, const DirectX::XMFLOAT3 &v0, const DirectX::XMFLOAT3 &v1, const DirectX::XMFLOAT3 &v2, float *out_distance);
+
+private:
+	void Build(const Model *model);
+
+	// Not implemented
+	MeshBVH(const MeshBVH &);
+	MeshBVH &operator=(const MeshBVH &);
+};
+
+} // End of namespace Scene
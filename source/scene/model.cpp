@@ -8,9 +8,30 @@
 
 #include "engine/material_shader_manager.h"
 
+#include "scene/mesh_bvh.h"
+
+#include <cstring>
+
 
 namespace Scene {
 
+Model::~Model() {
+	// Give the ids back, so they can be re-used by the buffers of later models
+	if (VertexBuffer != nullptr) {
+		Common::DenseIdGenerator<VertexBufferIdTag>::Release(VertexBufferId);
+	}
+	if (IndexBuffer != nullptr) {
+		Common::DenseIdGenerator<IndexBufferIdTag>::Release(IndexBufferId);
+	}
+
+	ReleaseCOM(VertexBuffer);
+	ReleaseCOM(IndexBuffer);
+	if (m_disposeSubsetArray == DisposeAfterUse::YES) {
+		delete[] Subsets;
+	}
+	delete m_meshBVH;
+}
+
 void Model::CreateVertexBuffer(ID3D11Device *device, void *vertices, size_t vertexStride, uint vertexCount, DisposeAfterUse disposeAfterUse) {
 	D3D11_BUFFER_DESC vbd;
 	vbd.Usage = D3D11_USAGE_IMMUTABLE;
@@ -25,11 +46,13 @@ void Model::CreateVertexBuffer(ID3D11Device *device, void *vertices, size_t vert
 
 void Model::CreateVertexBuffer(ID3D11Device *device, void *vertices, uint vertexCount, D3D11_BUFFER_DESC vertexBufferDesc, DisposeAfterUse disposeAfterUse) {
 	VertexStride = vertexBufferDesc.ByteWidth / vertexCount;
+	VertexCount = vertexCount;
 	
 	D3D11_SUBRESOURCE_DATA vInitData;
 	vInitData.pSysMem = vertices;
 
 	HR(device->CreateBuffer(&vertexBufferDesc, &vInitData, &VertexBuffer));
+	VertexBufferId = Common::DenseIdGenerator<VertexBufferIdTag>::Next();
 
 	if (disposeAfterUse == DisposeAfterUse::YES) {
 		delete[] vertices;
@@ -53,6 +76,8 @@ void Model::CreateIndexBuffer(ID3D11Device *device, uint *indices, uint indexCou
 	iInitData.pSysMem = indices;
 	
 	HR(device->CreateBuffer(&indexBufferDesc, &iInitData, &IndexBuffer));
+	IndexCount = indexCount;
+	IndexBufferId = Common::DenseIdGenerator<IndexBufferIdTag>::Next();
 
 	if (disposeAfterUse == DisposeAfterUse::YES) {
 		delete[] indices;
@@ -76,6 +101,24 @@ void Model::CreateSubsets(ModelSubset *subsetArray, uint subsetCount, DisposeAft
 	DirectX::XMStoreFloat3(&AABB_max, tempAABB_max);
 }
 
+void Model::KeepCPUGeometry(const void *vertices, uint vertexStride, uint vertexCount, const uint *indices, uint indexCount) {
+	CPUPositions.resize(vertexCount);
+	const byte *vertex = static_cast<const byte *>(vertices);
+	for (uint i = 0; i < vertexCount; ++i, vertex += vertexStride) {
+		memcpy(&CPUPositions[i], vertex, sizeof(DirectX::XMFLOAT3));
+	}
+
+	CPUIndices.assign(indices, indices + indexCount);
+}
+
+const MeshBVH *Model::GetMeshBVH() {
+	if (m_meshBVH == nullptr) {
+		m_meshBVH = new MeshBVH(this);
+	}
+
+	return m_meshBVH;
+}
+
 void InstancedModel::CreateInstanceBuffer(ID3D11Device *device, size_t instanceStride, uint maxInstanceCount, void *instanceData, DisposeAfterUse disposeAfterUse) {
 	InstanceStride = static_cast<uint>(instanceStride);
 	MaxInstanceCount = maxInstanceCount;
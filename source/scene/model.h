@@ -7,6 +7,7 @@
 #pragma once
 
 #include "common/typedefs.h"
+#include "common/dense_id_generator.h"
 
 #include "graphics/d3d_util.h"
 #include "graphics/shader.h"
@@ -20,6 +21,12 @@
 
 namespace Scene {
 
+class MeshBVH;
+
+/** Tag types for the dense id counters of model vertex and index buffers */
+struct VertexBufferIdTag {};
+struct IndexBufferIdTag {};
+
 /** A struct to hold all the data needed to describe a subset of the model */
 struct ModelSubset {
 	uint VertexStart;
@@ -45,27 +52,34 @@ public:
 	Model()
 		: VertexBuffer(nullptr),
 		  IndexBuffer(nullptr),
+		  VertexBufferId(0u),
+		  IndexBufferId(0u),
 		  VertexStride(0u),
+		  VertexCount(0u),
+		  IndexCount(0u),
 		  Subsets(nullptr),
 		  SubsetCount(0u),
 		  AABB_min(0.0f, 0.0f, 0.0f),
 		  AABB_max(0.0f, 0.0f, 0.0f),
-		  m_disposeSubsetArray(DisposeAfterUse::YES) {
+		  m_disposeSubsetArray(DisposeAfterUse::YES),
+		  m_meshBVH(nullptr) {
 	}
 
-	virtual ~Model() {
-		ReleaseCOM(VertexBuffer);
-		ReleaseCOM(IndexBuffer);
-		if (m_disposeSubsetArray == DisposeAfterUse::YES) {
-			delete[] Subsets;
-		}
-	}
+	virtual ~Model();
 
 public:
 	ID3D11Buffer *VertexBuffer;
 	ID3D11Buffer *IndexBuffer;
+	/**
+	 * Dense ids of the vertex and index buffers. Assigned when the buffers are created, and released
+	 * by the destructor if the buffers are still set. Code that creates the buffers itself owns the ids
+	 */
+	uint32 VertexBufferId;
+	uint32 IndexBufferId;
 
 	uint VertexStride;
+	uint VertexCount;
+	uint IndexCount;
 
 	ModelSubset *Subsets;
 	uint SubsetCount;
@@ -73,8 +87,17 @@ public:
 	DirectX::XMFLOAT3 AABB_min;
 	DirectX::XMFLOAT3 AABB_max;
 
+	/**
+	 * A CPU copy of the vertex positions and the indices, for CPU side work like software
+	 * occlusion culling. Empty unless KeepCPUGeometry() was called
+	 */
+	std::vector<DirectX::XMFLOAT3> CPUPositions;
+	std::vector<uint> CPUIndices;
+
 private:
 	DisposeAfterUse m_disposeSubsetArray;
+	/** Built by the first call to GetMeshBVH() */
+	MeshBVH *m_meshBVH;
 
 public:
 	inline DirectX::XMVECTOR GetAABBMin_XM() { return DirectX::XMLoadFloat3(&AABB_min); }
@@ -145,6 +168,24 @@ public:
 	 * @param disposeAfterUse    If YES, the function will call delete[] on 'indices' in the Model destructor
 	 */
 	void CreateSubsets(ModelSubset *subsetArray, uint subsetCount, DisposeAfterUse disposeAfterUse = DisposeAfterUse::YES);
+	/**
+	 * Copies the positions and the indices into CPUPositions and CPUIndices.
+	 * Has to be called before the vertex and index buffers dispose of the data
+	 *
+	 * @param vertices        An array holding the vertex data. The position has to be the first element of a vertex
+	 * @param vertexStride    The stride of a single vertex
+	 * @param vertexCount     The number of vertices
+	 * @param indices         An array holding the index data
+	 * @param indexCount      The number of indices
+	 */
+	void KeepCPUGeometry(const void *vertices, uint vertexStride, uint vertexCount, const uint *indices, uint indexCount);
+	/**
+	 * Returns a triangle BVH over CPUPositions and CPUIndices, for ray queries. It's built by the
+	 * first call, and cached for the lifetime of the model
+	 *
+	 * NOTE: The first call isn't thread safe. Call it once up front if the model will be picked from several threads
+	 */
+	const MeshBVH *GetMeshBVH();
 };
 
 
@@ -154,6 +195,10 @@ public:
  *
  * Provides methods to render the whole model or a specific subset. Use
  * these instead of ID3D11Context::Draw*()
+ *
+ * NOTE: The instance buffer has a fixed size, and is re-written with a discard map every time.
+ *       For instance data that changes every frame, stream it through a Graphics::InstanceStream
+ *       instead. That grows as needed, and lets many models share one buffer
  */
 class InstancedModel : public Model {
 public:
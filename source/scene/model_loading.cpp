@@ -105,6 +105,7 @@ Model *PlaneModelToLoad::CreateModel(ID3D11Device *device, Engine::TextureManage
 	}
 
 	Model *newModel = modelManager->CreateUnnamedModel();
+	newModel->KeepCPUGeometry(vertices, sizeof(Vertex), static_cast<uint>(meshData.Vertices.size()), &meshData.Indices[0], static_cast<uint>(meshData.Indices.size()));
 	newModel->CreateVertexBuffer(device, vertices, sizeof(Vertex), static_cast<uint>(meshData.Vertices.size()));
 	newModel->CreateIndexBuffer(device, &meshData.Indices[0], static_cast<uint>(meshData.Indices.size()), DisposeAfterUse::NO);
 	newModel->CreateSubsets(subset, 1);
@@ -144,6 +145,7 @@ Model *BoxModelToLoad::CreateModel(ID3D11Device *device, Engine::TextureManager
 	}
 
 	Model *newModel = modelManager->CreateUnnamedModel();
+	newModel->KeepCPUGeometry(vertices, sizeof(Vertex), static_cast<uint>(meshData.Vertices.size()), &meshData.Indices[0], static_cast<uint>(meshData.Indices.size()));
 	newModel->CreateVertexBuffer(device, vertices, sizeof(Vertex), static_cast<uint>(meshData.Vertices.size()));
 	newModel->CreateIndexBuffer(device, &meshData.Indices[0], static_cast<uint>(meshData.Indices.size()), DisposeAfterUse::NO);
 	newModel->CreateSubsets(subset, 1);
@@ -183,6 +185,7 @@ Model *SphereModelToLoad::CreateModel(ID3D11Device *device, Engine::TextureManag
 	}
 
 	Model *newModel = modelManager->CreateUnnamedModel();
+	newModel->KeepCPUGeometry(vertices, sizeof(Vertex), static_cast<uint>(meshData.Vertices.size()), &meshData.Indices[0], static_cast<uint>(meshData.Indices.size()));
 	newModel->CreateVertexBuffer(device, vertices, sizeof(Vertex), static_cast<uint>(meshData.Vertices.size()));
 	newModel->CreateIndexBuffer(device, &meshData.Indices[0], static_cast<uint>(meshData.Indices.size()), DisposeAfterUse::NO);
 	newModel->CreateSubsets(subset, 1);
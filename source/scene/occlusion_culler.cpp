@@ -0,0 +1,530 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "scene/occlusion_culler.h"
+
+#include "common/thread_pool.h"
+
+#include <emmintrin.h>
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+
+namespace Scene {
+
+const float OcclusionCuller::kNearClipW = 1.0e-3f;
+
+namespace {
+
+/** The 'nothing here yet' depth of a working layer. Further away than anything */
+const float kEmptyLayerDepth = FLT_MAX;
+const uint32 kFullRow = 0xFFFFFFFFu;
+/**
+ * How far, in pixels, the edges of occluder triangles are pulled in. Covers the float error of
+ * evaluating the edges, so pixel centers on an edge never count as covered
+ */
+const double kEdgeMargin = 1.0 / 256.0;
+
+/** Clips a polygon against w >= kNearClipW. Returns the number of output vertices */
+uint ClipNear(const DirectX::XMFLOAT4 *input, uint inputCount, DirectX::XMFLOAT4 *output) {
+	uint outputCount = 0u;
+	for (uint i = 0; i < inputCount; ++i) {
+		const DirectX::XMFLOAT4 &a = input[i];
+		const DirectX::XMFLOAT4 &b = input[(i + 1u) % inputCount];
+		float distanceA = a.w - OcclusionCuller::kNearClipW;
+		float distanceB = b.w - OcclusionCuller::kNearClipW;
+
+		if (distanceA >= 0.0f) {
+			output[outputCount++] = a;
+		}
+		if ((distanceA >= 0.0f) != (distanceB >= 0.0f)) {
+			float t = distanceA / (distanceA - distanceB);
+			output[outputCount++] = DirectX::XMFLOAT4(a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, a.z + (b.z - a.z) * t, OcclusionCuller::kNearClipW);
+		}
+	}
+
+	return outputCount;
+}
+
+} // End of anonymous namespace
+
+
+OcclusionCuller::OcclusionCuller(uint width, uint height)
+		: m_triangleCount(0u) {
+	m_tilesX = std::max((width + kTileWidth - 1u) / kTileWidth, 1u);
+	m_tilesY = std::max((height + kTileHeight - 1u) / kTileHeight, 1u);
+	m_width = m_tilesX * kTileWidth;
+	m_height = m_tilesY * kTileHeight;
+	m_binsX = (m_tilesX + kBinWidth - 1u) / kBinWidth;
+	m_binsY = (m_tilesY + kBinHeight - 1u) / kBinHeight;
+	m_coarseBlocksX = (m_tilesX + kCoarseBlockSize - 1u) / kCoarseBlockSize;
+	m_coarseBlocksY = (m_tilesY + kCoarseBlockSize - 1u) / kCoarseBlockSize;
+
+	m_tileDepths.resize(m_tilesX * m_tilesY);
+	m_tileLayerDepths.resize(m_tilesX * m_tilesY);
+	m_tileMasks.resize(m_tilesX * m_tilesY * kTileHeight);
+	m_coarseDepths.resize(m_coarseBlocksX * m_coarseBlocksY);
+	m_binTriangles.resize(m_binsX * m_binsY);
+
+	ClearBuffer();
+}
+
+void OcclusionCuller::ClearBuffer() {
+	// A depth of 0 is infinitely far away
+	std::fill(m_tileDepths.begin(), m_tileDepths.end(), 0.0f);
+	std::fill(m_tileLayerDepths.begin(), m_tileLayerDepths.end(), kEmptyLayerDepth);
+	std::fill(m_tileMasks.begin(), m_tileMasks.end(), 0u);
+	std::fill(m_coarseDepths.begin(), m_coarseDepths.end(), 0.0f);
+
+	m_occluders.clear();
+	m_triangleCount = 0u;
+	m_triangleAllocator.Reset();
+}
+
+void OcclusionCuller::AddOccluder(const DirectX::XMFLOAT3 *positions, const uint *indices, uint triangleCount, DirectX::CXMMATRIX worldViewProj) {
+	Occluder occluder;
+	occluder.Positions = positions;
+	occluder.Indices = indices;
+	occluder.TriangleCount = triangleCount;
+	DirectX::XMStoreFloat4x4(&occluder.WorldViewProj, worldViewProj);
+
+	m_occluders.push_back(occluder);
+}
+
+void OcclusionCuller::Flush(Common::ThreadPool *threadPool) {
+	uint occluderCount = static_cast<uint>(m_occluders.size());
+	if (m_occluderTriangles.size() < occluderCount) {
+		m_occluderTriangles.resize(occluderCount);
+	}
+
+	// Set up the triangles of each occluder
+	if (threadPool != nullptr) {
+		threadPool->ParallelFor(occluderCount, 1u, [this](uint begin, uint end) {
+			for (uint i = begin; i < end; ++i) {
+				SetupOccluder(i);
+			}
+		});
+	} else {
+		for (uint i = 0; i < occluderCount; ++i) {
+			SetupOccluder(i);
+		}
+	}
+
+	// Bin them, keeping the order they were added in
+	for (auto iter = m_binTriangles.begin(); iter != m_binTriangles.end(); ++iter) {
+		iter->clear();
+	}
+	for (uint i = 0; i < occluderCount; ++i) {
+		const TriangleList &triangles = m_occluderTriangles[i];
+		m_triangleCount += triangles.Count;
+
+		for (const Triangle *iter = triangles.Triangles; iter != triangles.Triangles + triangles.Count; ++iter) {
+			uint maxBinX = iter->MaxTileX / kBinWidth;
+			uint maxBinY = iter->MaxTileY / kBinHeight;
+			for (uint binY = iter->MinTileY / kBinHeight; binY <= maxBinY; ++binY) {
+				for (uint binX = iter->MinTileX / kBinWidth; binX <= maxBinX; ++binX) {
+					m_binTriangles[binY * m_binsX + binX].push_back(iter);
+				}
+			}
+		}
+	}
+
+	// Each bin only touches its own tiles, so they can be rasterized in any order
+	uint binCount = m_binsX * m_binsY;
+	if (threadPool != nullptr) {
+		threadPool->ParallelFor(binCount, 1u, [this](uint begin, uint end) {
+			for (uint i = begin; i < end; ++i) {
+				RasterizeBin(i);
+			}
+		});
+	} else {
+		for (uint i = 0; i < binCount; ++i) {
+			RasterizeBin(i);
+		}
+	}
+
+	UpdateCoarseDepths();
+	m_occluders.clear();
+}
+
+bool OcclusionCuller::IsVisible(const DirectX::XMFLOAT3 &aabbMin, const DirectX::XMFLOAT3 &aabbMax, DirectX::CXMMATRIX viewProj) const {
+	// Project the corners, and find the screen rectangle and the nearest depth of the box
+	float minX = FLT_MAX;
+	float minY = FLT_MAX;
+	float maxX = -FLT_MAX;
+	float maxY = -FLT_MAX;
+	float nearestDepth = 0.0f;
+
+	for (uint i = 0; i < 8; ++i) {
+		DirectX::XMVECTOR corner = DirectX::XMVectorSet((i & 1u) ? aabbMax.x : aabbMin.x, (i & 2u) ? aabbMax.y : aabbMin.y, (i & 4u) ? aabbMax.z : aabbMin.z, 1.0f);
+		DirectX::XMFLOAT4 clip;
+		DirectX::XMStoreFloat4(&clip, DirectX::XMVector4Transform(corner, viewProj));
+
+		if (clip.w < kNearClipW) {
+			// Crosses the near plane
+			return true;
+		}
+
+		float inverseW = 1.0f / clip.w;
+		float x = (clip.x * inverseW * 0.5f + 0.5f) * m_width;
+		float y = (0.5f - clip.y * inverseW * 0.5f) * m_height;
+		minX = std::min(minX, x);
+		maxX = std::max(maxX, x);
+		minY = std::min(minY, y);
+		maxY = std::max(maxY, y);
+		nearestDepth = std::max(nearestDepth, inverseW);
+	}
+
+	if (maxX < 0.0f || maxY < 0.0f || minX >= m_width || minY >= m_height) {
+		return true;
+	}
+
+	// Occluders only cover pixel centers, so test out to the nearest pixel center outside the rectangle on
+	// each side. Otherwise the sliver of the box between its edge and the first pixel center inside is never tested
+	uint pixelMinX = static_cast<uint>(std::max(minX - 0.5f, 0.0f));
+	uint pixelMinY = static_cast<uint>(std::max(minY - 0.5f, 0.0f));
+	uint pixelMaxX = static_cast<uint>(std::min(maxX + 0.5f, m_width - 1.0f));
+	uint pixelMaxY = static_cast<uint>(std::min(maxY + 0.5f, m_height - 1.0f));
+
+	uint minTileX = pixelMinX / kTileWidth;
+	uint minTileY = pixelMinY / kTileHeight;
+	uint maxTileX = pixelMaxX / kTileWidth;
+	uint maxTileY = pixelMaxY / kTileHeight;
+
+	for (uint blockY = minTileY / kCoarseBlockSize; blockY <= maxTileY / kCoarseBlockSize; ++blockY) {
+		for (uint blockX = minTileX / kCoarseBlockSize; blockX <= maxTileX / kCoarseBlockSize; ++blockX) {
+			// The whole block is in front of the box
+			if (nearestDepth < m_coarseDepths[blockY * m_coarseBlocksX + blockX]) {
+				continue;
+			}
+
+			uint tileYBegin = std::max(blockY * kCoarseBlockSize, minTileY);
+			uint tileYEnd = std::min((blockY + 1u) * kCoarseBlockSize - 1u, maxTileY);
+			uint tileXBegin = std::max(blockX * kCoarseBlockSize, minTileX);
+			uint tileXEnd = std::min((blockX + 1u) * kCoarseBlockSize - 1u, maxTileX);
+
+			for (uint tileY = tileYBegin; tileY <= tileYEnd; ++tileY) {
+				for (uint tileX = tileXBegin; tileX <= tileXEnd; ++tileX) {
+					uint tile = tileY * m_tilesX + tileX;
+					if (nearestDepth < m_tileDepths[tile]) {
+						continue;
+					}
+					if (nearestDepth >= m_tileLayerDepths[tile]) {
+						return true;
+					}
+
+					// The box is behind the working layer. It's hidden if the layer covers every pixel of the box in this tile
+					uint firstColumn = tileX == minTileX ? pixelMinX - tileX * kTileWidth : 0u;
+					uint lastColumn = tileX == maxTileX ? pixelMaxX - tileX * kTileWidth : kTileWidth - 1u;
+					uint32 columnMask = (kFullRow >> (31u - lastColumn)) & (kFullRow << firstColumn);
+
+					uint firstRow = tileY == minTileY ? pixelMinY - tileY * kTileHeight : 0u;
+					uint lastRow = tileY == maxTileY ? pixelMaxY - tileY * kTileHeight : kTileHeight - 1u;
+					const uint32 *masks = &m_tileMasks[tile * kTileHeight];
+					for (uint row = firstRow; row <= lastRow; ++row) {
+						if ((columnMask & ~masks[row]) != 0u) {
+							return true;
+						}
+					}
+				}
+			}
+		}
+	}
+
+	return false;
+}
+
+void OcclusionCuller::SetupOccluder(uint index) {
+	const Occluder &occluder = m_occluders[index];
+	TriangleList &triangles = m_occluderTriangles[index];
+	triangles.Count = 0u;
+	if (occluder.TriangleCount == 0u) {
+		triangles.Triangles = nullptr;
+		return;
+	}
+
+	// Clipping against the near plane can split a triangle in two
+	triangles.Triangles = m_triangleAllocator.Allocate<Triangle>(occluder.TriangleCount * 2u);
+
+	DirectX::XMMATRIX worldViewProj = DirectX::XMLoadFloat4x4(&occluder.WorldViewProj);
+
+	for (uint i = 0; i < occluder.TriangleCount; ++i) {
+		DirectX::XMFLOAT4 vertices[3];
+		uint behindCount = 0u;
+		for (uint j = 0; j < 3; ++j) {
+			DirectX::XMVECTOR position = DirectX::XMLoadFloat3(&occluder.Positions[occluder.Indices[i * 3u + j]]);
+			DirectX::XMStoreFloat4(&vertices[j], DirectX::XMVector3Transform(position, worldViewProj));
+			if (vertices[j].w < kNearClipW) {
+				++behindCount;
+			}
+		}
+
+		// Trivially reject triangles entirely outside one of the side planes
+		if ((vertices[0].x > vertices[0].w && vertices[1].x > vertices[1].w && vertices[2].x > vertices[2].w) ||
+		    (vertices[0].x < -vertices[0].w && vertices[1].x < -vertices[1].w && vertices[2].x < -vertices[2].w) ||
+		    (vertices[0].y > vertices[0].w && vertices[1].y > vertices[1].w && vertices[2].y > vertices[2].w) ||
+		    (vertices[0].y < -vertices[0].w && vertices[1].y < -vertices[1].w && vertices[2].y < -vertices[2].w)) {
+			continue;
+		}
+
+		Triangle triangle;
+		if (behindCount == 0u) {
+			if (SetupTriangle(vertices[0], vertices[1], vertices[2], &triangle)) {
+				triangles.Triangles[triangles.Count++] = triangle;
+			}
+		} else if (behindCount < 3u) {
+			// Clipping a triangle against one plane leaves 3 or 4 vertices
+			DirectX::XMFLOAT4 clipped[4];
+			uint clippedCount = ClipNear(vertices, 3u, clipped);
+			for (uint j = 2; j < clippedCount; ++j) {
+				if (SetupTriangle(clipped[0], clipped[j - 1u], clipped[j], &triangle)) {
+					triangles.Triangles[triangles.Count++] = triangle;
+				}
+			}
+		}
+	}
+}
+
+bool OcclusionCuller::SetupTriangle(const DirectX::XMFLOAT4 &v0, const DirectX::XMFLOAT4 &v1, const DirectX::XMFLOAT4 &v2, Triangle *out_triangle) const {
+	// Triangles clipped by the near plane have vertices far off the screen, where float can't hold the edge
+	// and depth equations accurately. So the set up is done in double, and the results are rounded so they
+	// can only under-estimate coverage and depth
+	const DirectX::XMFLOAT4 *clip[3] = {&v0, &v1, &v2};
+	double x[3], y[3], depth[3];
+	for (uint i = 0; i < 3; ++i) {
+		depth[i] = 1.0 / clip[i]->w;
+		x[i] = (clip[i]->x * depth[i] * 0.5 + 0.5) * m_width;
+		y[i] = (0.5 - clip[i]->y * depth[i] * 0.5) * m_height;
+	}
+
+	double area = (x[1] - x[0]) * (y[2] - y[0]) - (y[1] - y[0]) * (x[2] - x[0]);
+	if (area == 0.0 || !(std::fabs(area) < DBL_MAX)) {
+		return false;
+	}
+
+	double minX = std::min(std::min(x[0], x[1]), x[2]);
+	double maxX = std::max(std::max(x[0], x[1]), x[2]);
+	double minY = std::min(std::min(y[0], y[1]), y[2]);
+	double maxY = std::max(std::max(y[0], y[1]), y[2]);
+	if (maxX < 0.0 || maxY < 0.0 || minX >= m_width || minY >= m_height) {
+		return false;
+	}
+
+	out_triangle->MinTileX = static_cast<uint16>(static_cast<uint>(std::max(minX, 0.0)) / kTileWidth);
+	out_triangle->MinTileY = static_cast<uint16>(static_cast<uint>(std::max(minY, 0.0)) / kTileHeight);
+	out_triangle->MaxTileX = static_cast<uint16>(static_cast<uint>(std::min(maxX, m_width - 1.0)) / kTileWidth);
+	out_triangle->MaxTileY = static_cast<uint16>(static_cast<uint>(std::min(maxY, m_height - 1.0)) / kTileHeight);
+
+	// Orient the edges so the inside is positive, whatever the winding
+	double sign = area > 0.0 ? 1.0 : -1.0;
+	for (uint i = 0; i < 3; ++i) {
+		uint next = (i + 1u) % 3u;
+		double a = (y[i] - y[next]) * sign;
+		double b = (x[next] - x[i]) * sign;
+
+		// Scale the edge so the equation is a distance in pixels, and pull it in by the margin
+		double inverseLength = 1.0 / std::max(std::fabs(a), std::fabs(b));
+		a *= inverseLength;
+		b *= inverseLength;
+		double c = -(a * x[i] + b * y[i]) - kEdgeMargin;
+
+		// Treat nearly horizontal edges as horizontal, so 1 / a can't blow up. The margin covers the difference
+		if (std::fabs(a) < 1.0e-6) {
+			a = 0.0;
+		}
+		out_triangle->EdgeA[i] = static_cast<float>(a);
+		out_triangle->EdgeB[i] = static_cast<float>(b);
+		out_triangle->EdgeC[i] = static_cast<float>(c);
+		out_triangle->EdgeInverseA[i] = a != 0.0 ? static_cast<float>(1.0 / a) : 0.0f;
+	}
+
+	// The plane through the three depths
+	double inverseArea = 1.0 / area;
+	double depth10 = depth[1] - depth[0];
+	double depth20 = depth[2] - depth[0];
+	double depthA = (depth10 * (y[2] - y[0]) - depth20 * (y[1] - y[0])) * inverseArea;
+	double depthB = (depth20 * (x[1] - x[0]) - depth10 * (x[2] - x[0])) * inverseArea;
+	double depthC = depth[0] - depthA * x[0] - depthB * y[0];
+	out_triangle->DepthA = static_cast<float>(depthA);
+	out_triangle->DepthB = static_cast<float>(depthB);
+	out_triangle->DepthC = static_cast<float>(depthC);
+	// A bound on the error of evaluating the float plane anywhere on the screen
+	out_triangle->DepthError = static_cast<float>((std::fabs(depthA) * m_width + std::fabs(depthB) * m_height + std::fabs(depthC)) * 8.0 * FLT_EPSILON);
+
+	// Rounded away from the viewer
+	double minDepth = std::min(std::min(depth[0], depth[1]), depth[2]);
+	out_triangle->MinDepth = static_cast<float>(minDepth * (1.0 - 4.0 * FLT_EPSILON));
+
+	return true;
+}
+
+void OcclusionCuller::RasterizeBin(uint bin) {
+	uint binX = bin % m_binsX;
+	uint binY = bin / m_binsX;
+	uint binMinTileX = binX * kBinWidth;
+	uint binMinTileY = binY * kBinHeight;
+	uint binMaxTileX = std::min(binMinTileX + kBinWidth, m_tilesX) - 1u;
+	uint binMaxTileY = std::min(binMinTileY + kBinHeight, m_tilesY) - 1u;
+
+	const std::vector<const Triangle *> &triangles = m_binTriangles[bin];
+	for (auto iter = triangles.begin(); iter != triangles.end(); ++iter) {
+		const Triangle &triangle = **iter;
+		RasterizeTriangle(triangle,
+		                  std::max<uint>(triangle.MinTileX, binMinTileX), std::max<uint>(triangle.MinTileY, binMinTileY),
+		                  std::min<uint>(triangle.MaxTileX, binMaxTileX), std::min<uint>(triangle.MaxTileY, binMaxTileY));
+	}
+}
+
+void OcclusionCuller::RasterizeTriangle(const Triangle &triangle, uint minTileX, uint minTileY, uint maxTileX, uint maxTileY) {
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 lastColumn = _mm_set1_ps(static_cast<float>(kTileWidth - 1u));
+	const __m128 pastLastColumn = _mm_set1_ps(static_cast<float>(kTileWidth));
+	const __m128 minusOne = _mm_set1_ps(-1.0f);
+
+	for (uint tileY = minTileY; tileY <= maxTileY; ++tileY) {
+		float tileTop = static_cast<float>(tileY * kTileHeight);
+
+		// The pixel centers of the 8 rows of the tile, 4 rows per vector
+		__m128 rowY[2];
+		rowY[0] = _mm_add_ps(_mm_set1_ps(tileTop), _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f));
+		rowY[1] = _mm_add_ps(_mm_set1_ps(tileTop), _mm_setr_ps(4.5f, 5.5f, 6.5f, 7.5f));
+
+		// For each edge and row, the pixel x where the edge crosses the row. Left edges bound the span
+		// from below, and right edges from above. Horizontal edges either keep or drop the whole row
+		__m128 spanStart[2] = {_mm_set1_ps(-FLT_MAX), _mm_set1_ps(-FLT_MAX)};
+		__m128 spanEnd[2] = {_mm_set1_ps(FLT_MAX), _mm_set1_ps(FLT_MAX)};
+		for (uint edge = 0; edge < 3; ++edge) {
+			__m128 a = _mm_set1_ps(triangle.EdgeA[edge]);
+			__m128 b = _mm_set1_ps(triangle.EdgeB[edge]);
+			__m128 c = _mm_set1_ps(triangle.EdgeC[edge]);
+			__m128 inverseA = _mm_set1_ps(triangle.EdgeInverseA[edge]);
+
+			for (uint i = 0; i < 2; ++i) {
+				__m128 rowTerm = _mm_add_ps(_mm_mul_ps(b, rowY[i]), c);
+				if (triangle.EdgeA[edge] > 0.0f) {
+					// a * (x + 0.5) + rowTerm >= 0
+					__m128 crossing = _mm_sub_ps(_mm_mul_ps(_mm_sub_ps(zero, rowTerm), inverseA), _mm_set1_ps(0.5f));
+					spanStart[i] = _mm_max_ps(spanStart[i], crossing);
+				} else if (triangle.EdgeA[edge] < 0.0f) {
+					__m128 crossing = _mm_sub_ps(_mm_mul_ps(_mm_sub_ps(zero, rowTerm), inverseA), _mm_set1_ps(0.5f));
+					spanEnd[i] = _mm_min_ps(spanEnd[i], crossing);
+				} else {
+					__m128 outside = _mm_cmplt_ps(rowTerm, zero);
+					spanStart[i] = _mm_max_ps(spanStart[i], _mm_and_ps(outside, _mm_set1_ps(FLT_MAX)));
+				}
+			}
+		}
+
+		for (uint tileX = minTileX; tileX <= maxTileX; ++tileX) {
+			__m128 tileLeft = _mm_set1_ps(static_cast<float>(tileX * kTileWidth));
+
+			uint32 rowMasks[kTileHeight];
+			uint32 anyCovered = 0u;
+			for (uint i = 0; i < 2; ++i) {
+				// Into tile columns, clamped so the conversions can't overflow
+				__m128 start = _mm_min_ps(_mm_max_ps(_mm_sub_ps(spanStart[i], tileLeft), zero), pastLastColumn);
+				__m128 end = _mm_min_ps(_mm_max_ps(_mm_sub_ps(spanEnd[i], tileLeft), minusOne), lastColumn);
+
+				// First column = ceil(start), last column = floor(end). Both are non-negative after the
+				// clamps (end is shifted by one), so truncation is a floor
+				__m128i startColumn = _mm_cvttps_epi32(start);
+				startColumn = _mm_sub_epi32(startColumn, _mm_castps_si128(_mm_cmplt_ps(_mm_cvtepi32_ps(startColumn), start)));
+				__m128i endColumn = _mm_sub_epi32(_mm_cvttps_epi32(_mm_add_ps(end, one)), _mm_set1_epi32(1));
+
+				int32 starts[4];
+				int32 ends[4];
+				_mm_storeu_si128(reinterpret_cast<__m128i *>(starts), startColumn);
+				_mm_storeu_si128(reinterpret_cast<__m128i *>(ends), endColumn);
+				for (uint j = 0; j < 4; ++j) {
+					uint32 mask = 0u;
+					if (ends[j] >= starts[j]) {
+						mask = (kFullRow >> (31 - ends[j])) & (kFullRow << starts[j]);
+					}
+					rowMasks[i * 4u + j] = mask;
+					anyCovered |= mask;
+				}
+			}
+
+			if (anyCovered == 0u) {
+				continue;
+			}
+
+			// The furthest the triangle can be in this tile. The plane is linear, so its minimum over the tile is at a corner
+			float left = tileX * static_cast<float>(kTileWidth);
+			float right = left + kTileWidth;
+			float bottom = tileTop + kTileHeight;
+			float planeMin = std::min(std::min(triangle.DepthA * left + triangle.DepthB * tileTop, triangle.DepthA * right + triangle.DepthB * tileTop),
+			                          std::min(triangle.DepthA * left + triangle.DepthB * bottom, triangle.DepthA * right + triangle.DepthB * bottom)) + triangle.DepthC;
+
+			UpdateTile(tileY * m_tilesX + tileX, rowMasks, std::max(planeMin - triangle.DepthError, triangle.MinDepth));
+		}
+	}
+}
+
+void OcclusionCuller::UpdateTile(uint tile, const uint32 *rowMasks, float depth) {
+	float &committedDepth = m_tileDepths[tile];
+	float &layerDepth = m_tileLayerDepths[tile];
+	uint32 *masks = &m_tileMasks[tile * kTileHeight];
+
+	uint32 triangleCoverage = kFullRow;
+	for (uint i = 0; i < kTileHeight; ++i) {
+		triangleCoverage &= rowMasks[i];
+	}
+
+	if (triangleCoverage == kFullRow) {
+		// Covers the whole tile by itself
+		committedDepth = std::max(committedDepth, depth);
+	} else {
+		// If the triangle is much nearer than the working layer, the layer is probably something in the
+		// background. Throw it away and start a new one, rather than dragging the new one back to it
+		if (depth - layerDepth > layerDepth - committedDepth) {
+			layerDepth = kEmptyLayerDepth;
+			std::fill(masks, masks + kTileHeight, 0u);
+		}
+
+		uint32 layerCoverage = kFullRow;
+		for (uint i = 0; i < kTileHeight; ++i) {
+			masks[i] |= rowMasks[i];
+			layerCoverage &= masks[i];
+		}
+		layerDepth = std::min(layerDepth, depth);
+
+		if (layerCoverage == kFullRow) {
+			// Every pixel is in front of both depths, so it's in front of the nearer of the two
+			committedDepth = std::max(committedDepth, layerDepth);
+			layerDepth = kEmptyLayerDepth;
+			std::fill(masks, masks + kTileHeight, 0u);
+			return;
+		}
+	}
+
+	// A layer behind the committed depth doesn't tell us anything
+	if (layerDepth <= committedDepth) {
+		layerDepth = kEmptyLayerDepth;
+		std::fill(masks, masks + kTileHeight, 0u);
+	}
+}
+
+void OcclusionCuller::UpdateCoarseDepths() {
+	for (uint blockY = 0; blockY < m_coarseBlocksY; ++blockY) {
+		for (uint blockX = 0; blockX < m_coarseBlocksX; ++blockX) {
+			float depth = FLT_MAX;
+			uint tileYEnd = std::min((blockY + 1u) * kCoarseBlockSize, m_tilesY);
+			uint tileXEnd = std::min((blockX + 1u) * kCoarseBlockSize, m_tilesX);
+			for (uint tileY = blockY * kCoarseBlockSize; tileY < tileYEnd; ++tileY) {
+				for (uint tileX = blockX * kCoarseBlockSize; tileX < tileXEnd; ++tileX) {
+					depth = std::min(depth, m_tileDepths[tileY * m_tilesX + tileX]);
+				}
+			}
+			m_coarseDepths[blockY * m_coarseBlocksX + blockX] = depth;
+		}
+	}
+}
+
+} // End of namespace Scene
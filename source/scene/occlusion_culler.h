@@ -0,0 +1,187 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "common/typedefs.h"
+#include "common/frame_allocator.h"
+
+#include <DirectXMath.h>
+
+#include <vector>
+
+
+namespace Common {
+class ThreadPool;
+}
+
+namespace Scene {
+
+/**
+ * A low resolution software rasterizer for occluders, and a test for whether an AABB is hidden behind them
+ *
+ * The depth buffer is split into 32 x 8 pixel tiles. Rather than a depth per pixel, each tile stores
+ * a coverage mask (one bit per pixel) and two depths, in the spirit of 'masked software occlusion culling':
+ *     - A committed depth that the whole tile is known to be in front of
+ *     - A working layer. The pixels in the mask are in front of the working depth
+ * Once the working layer covers the whole tile, it's folded into the committed depth. Depths are 1 / w,
+ * so they don't depend on whether the projection uses normal or reversed depth. Larger is nearer.
+ *
+ * The committed depths of 4 x 4 tile blocks are kept as a second, coarser level, so a big occludee
+ * can be rejected without visiting every tile.
+ *
+ * Usage per frame:
+ *     ClearBuffer()
+ *     AddOccluder() for each occluder, ideally front to back
+ *     Flush()
+ *     IsVisible() for each occludee
+ *
+ * Flush() transforms and sets up the occluders, bins their triangles into screen regions, and rasterizes
+ * the regions. With a ThreadPool, both the setup and the regions run in parallel. Triangles are always
+ * rasterized in the order they were added, so the result doesn't depend on the number of threads.
+ * The set up triangles only live until the next ClearBuffer(), so the setup threads allocate them
+ * from a Common::FrameAllocator.
+ */
+class OcclusionCuller {
+public:
+	/**
+	 * @param width     The width of the depth buffer. Rounded up to a multiple of kTileWidth
+	 * @param height    The height of the depth buffer. Rounded up to a multiple of kTileHeight
+	 */
+	OcclusionCuller(uint width = kDefaultWidth, uint height = kDefaultHeight);
+
+	static const uint kDefaultWidth = 512u;
+	static const uint kDefaultHeight = 256u;
+
+	static const uint kTileWidth = 32u;
+	static const uint kTileHeight = 8u;
+	/** The width and height, in tiles, of a block of the coarse depth level */
+	static const uint kCoarseBlockSize = 4u;
+	/** The width and height, in tiles, of the screen regions that Flush() rasterizes in parallel */
+	static const uint kBinWidth = 4u;
+	static const uint kBinHeight = 8u;
+	/** Vertices closer to the camera than this are clipped */
+	static const float kNearClipW;
+
+private:
+	/** A triangle, set up for rasterizing. All the equations are in pixel coordinates */
+	struct Triangle {
+		/** Edge i covers pixel (x, y) if EdgeA[i] * x + EdgeB[i] * y + EdgeC[i] >= 0. The edges are in pixels */
+		float EdgeA[3];
+		float EdgeB[3];
+		float EdgeC[3];
+		/** 1 / EdgeA[i], or 0 if EdgeA[i] is 0 */
+		float EdgeInverseA[3];
+		/** The plane of 1 / w. depth = DepthA * x + DepthB * y + DepthC */
+		float DepthA;
+		float DepthB;
+		float DepthC;
+		/** The most the plane can be off by, evaluated in float anywhere on the screen */
+		float DepthError;
+		/** The smallest 1 / w of the vertices. The triangle is nowhere further away than this */
+		float MinDepth;
+		/** The tiles the triangle touches, inclusive */
+		uint16 MinTileX;
+		uint16 MinTileY;
+		uint16 MaxTileX;
+		uint16 MaxTileY;
+	};
+
+	struct TriangleList {
+		Triangle *Triangles;
+		uint Count;
+	};
+
+	struct Occluder {
+		const DirectX::XMFLOAT3 *Positions;
+		const uint *Indices;
+		uint TriangleCount;
+		DirectX::XMFLOAT4X4 WorldViewProj;
+	};
+
+	uint m_width;
+	uint m_height;
+	uint m_tilesX;
+	uint m_tilesY;
+	uint m_binsX;
+	uint m_binsY;
+	uint m_coarseBlocksX;
+	uint m_coarseBlocksY;
+
+	/** The committed depth of each tile */
+	std::vector<float> m_tileDepths;
+	/** The depth of the working layer of each tile */
+	std::vector<float> m_tileLayerDepths;
+	/** The coverage mask of the working layer of each tile. One uint32 per row of pixels */
+	std::vector<uint32> m_tileMasks;
+	/** The smallest committed depth of each block of tiles */
+	std::vector<float> m_coarseDepths;
+
+	std::vector<Occluder> m_occluders;
+	/** The set up triangles of each occluder */
+	std::vector<TriangleList> m_occluderTriangles;
+	/** Where m_occluderTriangles live. Reset by ClearBuffer() */
+	Common::FrameAllocator m_triangleAllocator;
+	/** The triangles touching each bin, in the order they were added */
+	std::vector<std::vector<const Triangle *> > m_binTriangles;
+
+	uint m_triangleCount;
+
+public:
+	/**
+	 * Resets the depth buffer to empty, and forgets the occluders
+	 *
+	 * NOTE: Frees the triangles of the last Flush(), so it must not run at the same time as Flush()
+	 */
+	void ClearBuffer();
+	/**
+	 * Queues an occluder. The data has to stay alive until Flush() returns
+	 *
+	 * @param positions        The vertex positions
+	 * @param indices          The index list. Three indices per triangle. Both windings are rasterized
+	 * @param triangleCount    The number of triangles
+	 * @param worldViewProj    The transform from the positions to clip space
+	 */
+	void AddOccluder(const DirectX::XMFLOAT3 *positions, const uint *indices, uint triangleCount, DirectX::CXMMATRIX worldViewProj);
+	/**
+	 * Rasterizes the queued occluders into the depth buffer
+	 *
+	 * @param threadPool    [Optional] If not nullptr, the occluders are set up, and the bins rasterized, in parallel
+	 */
+	void Flush(Common::ThreadPool *threadPool = nullptr);
+
+	/**
+	 * Tests whether an AABB is hidden by the occluders. Boxes that are partly behind the camera, or off
+	 * the screen, count as visible. Leave those to frustum culling
+	 *
+	 * @param aabbMin     The world space minimum of the box
+	 * @param aabbMax     The world space maximum of the box
+	 * @param viewProj    The view-projection the occluders were rendered with
+	 * @return            False if the box is definitely hidden
+	 */
+	bool IsVisible(const DirectX::XMFLOAT3 &aabbMin, const DirectX::XMFLOAT3 &aabbMax, DirectX::CXMMATRIX viewProj) const;
+
+	inline uint GetWidth() const { return m_width; }
+	inline uint GetHeight() const { return m_height; }
+	inline uint GetTilesX() const { return m_tilesX; }
+	inline uint GetTilesY() const { return m_tilesY; }
+	/** Returns the number of triangles that survived clipping in the last Flush() */
+	inline uint GetTriangleCount() const { return m_triangleCount; }
+	/** Returns the committed depth of each tile, row by row. For debug views and for checking results */
+	inline const std::vector<float> &GetTileDepths() const { return m_tileDepths; }
+
+private:
+	/** Transforms, clips and sets up the triangles of m_occluders[index] */
+	void SetupOccluder(uint index);
+	/** Sets up a screen space triangle. Returns false if it doesn't cover anything */
+	bool SetupTriangle(const DirectX::XMFLOAT4 &v0, const DirectX::XMFLOAT4 &v1, const DirectX::XMFLOAT4 &v2, Triangle *out_triangle) const;
+	void RasterizeBin(uint bin);
+	void RasterizeTriangle(const Triangle &triangle, uint minTileX, uint minTileY, uint maxTileX, uint maxTileY);
+	void UpdateTile(uint tile, const uint32 *rowMasks, float depth);
+	void UpdateCoarseDepths();
+};
+
+} // End of namespace Scene
@@ -0,0 +1,224 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "scene/ray_picker.h"
+
+#include "common/halfling_sys.h"
+
+#include "scene/frustum_culler.h"
+#include "scene/model.h"
+
+#include <algorithm>
+
+
+namespace Scene {
+
+namespace {
+
+/** Transforms a ray into the model space of an object. The distances along the ray don't change, since the transform is affine */
+inline void TransformRay(const DirectX::XMFLOAT4X4 &inverseWorld, const DirectX::XMFLOAT3 &origin, const DirectX::XMFLOAT3 &direction, DirectX::XMFLOAT3 *out_origin, DirectX::XMFLOAT3 *out_direction) {
+	DirectX::XMMATRIX matrix = DirectX::XMLoadFloat4x4(&inverseWorld);
+	DirectX::XMStoreFloat3(out_origin, DirectX::XMVector3TransformCoord(DirectX::XMLoadFloat3(&origin), matrix));
+	DirectX::XMStoreFloat3(out_direction, DirectX::XMVector3TransformNormal(DirectX::XMLoadFloat3(&direction), matrix));
+}
+
+} // End of anonymous namespace
+
+
+RayPicker::RayPicker()
+	: m_dirty(false) {
+}
+
+uint RayPicker::AddObject(Model *model, DirectX::CXMMATRIX world) {
+	uint object;
+	if (!m_freeObjects.empty()) {
+		object = m_freeObjects.back();
+		m_freeObjects.pop_back();
+	} else {
+		object = static_cast<uint>(m_objects.size());
+		m_objects.push_back(Object());
+	}
+
+	Object &newObject = m_objects[object];
+	newObject.Model = model;
+	DirectX::XMStoreFloat4x4(&newObject.InverseWorld, DirectX::XMMatrixInverse(nullptr, world));
+	FrustumCuller::TransformAABB(world, model->AABB_min, model->AABB_max, &newObject.AABBMin, &newObject.AABBMax);
+	newObject.Proxy = m_bvh.CreateProxy(newObject.AABBMin, newObject.AABBMax, object);
+
+	return object;
+}
+
+void RayPicker::SetWorldTransform(uint object, DirectX::CXMMATRIX world) {
+	AssertMsg(object < m_objects.size() && m_objects[object].Proxy != kNullObject, "Object " << object << " doesn't exist");
+
+	Object &movedObject = m_objects[object];
+	DirectX::XMStoreFloat4x4(&movedObject.InverseWorld, DirectX::XMMatrixInverse(nullptr, world));
+	FrustumCuller::TransformAABB(world, movedObject.Model->AABB_min, movedObject.Model->AABB_max, &movedObject.AABBMin, &movedObject.AABBMax);
+	m_bvh.MoveProxy(movedObject.Proxy, movedObject.AABBMin, movedObject.AABBMax);
+	m_dirty = true;
+}
+
+void RayPicker::RemoveObject(uint object) {
+	AssertMsg(object < m_objects.size() && m_objects[object].Proxy != kNullObject, "Object " << object << " doesn't exist");
+
+	m_bvh.DestroyProxy(m_objects[object].Proxy);
+	m_objects[object].Proxy = kNullObject;
+	m_objects[object].Model = nullptr;
+	m_freeObjects.push_back(object);
+}
+
+void RayPicker::Clear() {
+	m_bvh.Clear();
+	m_objects.clear();
+	m_freeObjects.clear();
+	m_dirty = false;
+}
+
+void RayPicker::Update() {
+	if (m_dirty) {
+		m_bvh.Refit();
+		m_dirty = false;
+	}
+}
+
+void RayPicker::GatherCandidates(const DirectX::XMFLOAT3 &origin, const DirectX::XMFLOAT3 &direction, float maxDistance) {
+	AssertMsg(!m_dirty, "Update() has to be called after moving objects, before querying");
+
+	m_queryObjects.clear();
+	m_bvh.QueryRay(origin, direction, maxDistance, &m_queryObjects);
+
+	DirectX::XMFLOAT3 inverseDirection(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+	m_candidates.clear();
+	for (auto iter = m_queryObjects.begin(); iter != m_queryObjects.end(); ++iter) {
+		Candidate candidate;
+		candidate.Object = *iter;
+		if (DynamicBVH::RayIntersectsAABB(origin, inverseDirection, maxDistance, m_objects[*iter].AABBMin, m_objects[*iter].AABBMax, &candidate.Distance)) {
+			m_candidates.push_back(candidate);
+		}
+	}
+
+	std::sort(m_candidates.begin(), m_candidates.end());
+}
+
+bool RayPicker::Pick(const DirectX::XMFLOAT3 &origin, const DirectX::XMFLOAT3 &direction, float maxDistance, RayHit *out_hit) {
+	GatherCandidates(origin, direction, maxDistance);
+
+	float closest = maxDistance;
+	bool hit = false;
+	for (auto iter = m_candidates.begin(); iter != m_candidates.end(); ++iter) {
+		// The rest of the objects start further along the ray than what we've already hit
+		if (iter->Distance > closest) {
+			break;
+		}
+
+		Object &object = m_objects[iter->Object];
+		DirectX::XMFLOAT3 localOrigin, localDirection;
+		TransformRay(object.InverseWorld, origin, direction, &localOrigin, &localDirection);
+
+		RayHit objectHit;
+		if (object.Model->GetMeshBVH()->Intersect(localOrigin, localDirection, closest, &objectHit)) {
+			closest = objectHit.Distance;
+			out_hit->Distance = objectHit.Distance;
+			out_hit->Triangle = objectHit.Triangle;
+			out_hit->Object = iter->Object;
+			hit = true;
+		}
+	}
+
+	return hit;
+}
+
+bool RayPicker::IntersectAny(const DirectX::XMFLOAT3 &origin, const DirectX::XMFLOAT3 &direction, float maxDistance) {
+	GatherCandidates(origin, direction, maxDistance);
+
+	for (auto iter = m_candidates.begin(); iter != m_candidates.end(); ++iter) {
+		Object &object = m_objects[iter->Object];
+		DirectX::XMFLOAT3 localOrigin, localDirection;
+		TransformRay(object.InverseWorld, origin, direction, &localOrigin, &localDirection);
+
+		if (object.Model->GetMeshBVH()->IntersectAny(localOrigin, localDirection, maxDistance)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+uint RayPicker::Pick(RayPacket *packet) {
+	AssertMsg(!m_dirty, "Update() has to be called after moving objects, before querying");
+
+	// The union of the objects each ray's bounds query finds
+	m_queryObjects.clear();
+	for (uint lane = 0; lane < RayPacket::kSize; ++lane) {
+		DirectX::XMFLOAT3 origin(packet->OriginX[lane], packet->OriginY[lane], packet->OriginZ[lane]);
+		DirectX::XMFLOAT3 direction(packet->DirectionX[lane], packet->DirectionY[lane], packet->DirectionZ[lane]);
+		m_bvh.QueryRay(origin, direction, packet->Distance[lane], &m_queryObjects);
+	}
+	std::sort(m_queryObjects.begin(), m_queryObjects.end());
+	m_queryObjects.erase(std::unique(m_queryObjects.begin(), m_queryObjects.end()), m_queryObjects.end());
+
+	uint hitMask = 0u;
+	for (auto iter = m_queryObjects.begin(); iter != m_queryObjects.end(); ++iter) {
+		Object &object = m_objects[*iter];
+
+		// Skip the object if every ray that reaches its bounds has already hit something in front of them
+		bool reachable = false;
+		for (uint lane = 0; lane < RayPacket::kSize && !reachable; ++lane) {
+			DirectX::XMFLOAT3 origin(packet->OriginX[lane], packet->OriginY[lane], packet->OriginZ[lane]);
+			DirectX::XMFLOAT3 inverseDirection(1.0f / packet->DirectionX[lane], 1.0f / packet->DirectionY[lane], 1.0f / packet->DirectionZ[lane]);
+			reachable = DynamicBVH::RayIntersectsAABB(origin, inverseDirection, packet->Distance[lane], object.AABBMin, object.AABBMax);
+		}
+		if (!reachable) {
+			continue;
+		}
+
+		// Take the whole packet into model space, one ray per lane
+		const DirectX::XMFLOAT4X4 &inverseWorld = object.InverseWorld;
+		RayPacket localPacket;
+		for (uint lane = 0; lane < RayPacket::kSize; ++lane) {
+			float x = packet->OriginX[lane];
+			float y = packet->OriginY[lane];
+			float z = packet->OriginZ[lane];
+			localPacket.OriginX[lane] = x * inverseWorld.m[0][0] + y * inverseWorld.m[1][0] + z * inverseWorld.m[2][0] + inverseWorld.m[3][0];
+			localPacket.OriginY[lane] = x * inverseWorld.m[0][1] + y * inverseWorld.m[1][1] + z * inverseWorld.m[2][1] + inverseWorld.m[3][1];
+			localPacket.OriginZ[lane] = x * inverseWorld.m[0][2] + y * inverseWorld.m[1][2] + z * inverseWorld.m[2][2] + inverseWorld.m[3][2];
+
+			x = packet->DirectionX[lane];
+			y = packet->DirectionY[lane];
+			z = packet->DirectionZ[lane];
+			localPacket.DirectionX[lane] = x * inverseWorld.m[0][0] + y * inverseWorld.m[1][0] + z * inverseWorld.m[2][0];
+			localPacket.DirectionY[lane] = x * inverseWorld.m[0][1] + y * inverseWorld.m[1][1] + z * inverseWorld.m[2][1];
+			localPacket.DirectionZ[lane] = x * inverseWorld.m[0][2] + y * inverseWorld.m[1][2] + z * inverseWorld.m[2][2];
+
+			localPacket.Distance[lane] = packet->Distance[lane];
+		}
+
+		uint objectHitMask = object.Model->GetMeshBVH()->Intersect(&localPacket);
+		for (uint lane = 0; lane < RayPacket::kSize; ++lane) {
+			if ((objectHitMask & (1u << lane)) != 0u) {
+				packet->Distance[lane] = localPacket.Distance[lane];
+				packet->Triangle[lane] = localPacket.Triangle[lane];
+				packet->Object[lane] = *iter;
+			}
+		}
+		hitMask |= objectHitMask;
+	}
+
+	return hitMask;
+}
+
+void RayPicker::ScreenPointToRay(float x, float y, float screenWidth, float screenHeight, DirectX::CXMMATRIX view, DirectX::CXMMATRIX projection, DirectX::XMFLOAT3 *out_origin, DirectX::XMFLOAT3 *out_direction) {
+	// The view space direction through the point, scaled so its z is 1
+	float ndcX = 2.0f * x / screenWidth - 1.0f;
+	float ndcY = 1.0f - 2.0f * y / screenHeight;
+	DirectX::XMVECTOR viewDirection = DirectX::XMVectorSet(ndcX / DirectX::XMVectorGetX(projection.r[0]), ndcY / DirectX::XMVectorGetY(projection.r[1]), 1.0f, 0.0f);
+
+	DirectX::XMMATRIX inverseView = DirectX::XMMatrixInverse(nullptr, view);
+	DirectX::XMStoreFloat3(out_origin, inverseView.r[3]);
+	DirectX::XMStoreFloat3(out_direction, DirectX::XMVector3TransformNormal(viewDirection, inverseView));
+}
+
+} // End of namespace Scene
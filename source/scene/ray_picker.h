@@ -0,0 +1,130 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "common/typedefs.h"
+
+#include "scene/dynamic_bvh.h"
+#include "scene/mesh_bvh.h"
+
+#include <DirectXMath.h>
+
+#include <vector>
+
+
+namespace Scene {
+
+class Model;
+
+/**
+ * Ray queries against the triangles of a set of placed models. IE. picking objects with the
+ * mouse, or line of sight tests
+ *
+ * The world space bounds of the objects go into a DynamicBVH. A query gathers the objects whose
+ * bounds the ray hits, visits them in order of where the ray enters their bounds, and stops once
+ * the next one starts beyond the closest hit. Each visited object takes the ray into model space
+ * and traces it through the model's MeshBVH, which is built the first time the model is hit.
+ *
+ * Moving objects only updates their bounds. Update() has to be called before the next query.
+ */
+class RayPicker {
+public:
+	RayPicker();
+
+	static const uint kNullObject = 0xFFFFFFFF;
+
+private:
+	struct Object {
+		Scene::Model *Model;
+		/** World to model space */
+		DirectX::XMFLOAT4X4 InverseWorld;
+		DirectX::XMFLOAT3 AABBMin;
+		DirectX::XMFLOAT3 AABBMax;
+		/** The proxy in m_bvh, or kNullObject if the object was removed */
+		uint Proxy;
+	};
+
+	struct Candidate {
+		float Distance;
+		uint Object;
+
+		inline bool operator<(const Candidate &other) const { return Distance < other.Distance; }
+	};
+
+	DynamicBVH m_bvh;
+	std::vector<Object> m_objects;
+	std::vector<uint> m_freeObjects;
+	bool m_dirty;
+
+	// Scratch space for the queries, so they don't allocate
+	std::vector<uint> m_queryObjects;
+	std::vector<Candidate> m_candidates;
+
+public:
+	/**
+	 * Adds a placed model
+	 *
+	 * @param model    The model. Has to outlive the picker, and have its CPU geometry. See Model::KeepCPUGeometry()
+	 * @param world    The model to world transform
+	 * @return         The id of the object. Ids are handed out in order, starting from 0, until an object is removed
+	 */
+	uint AddObject(Model *model, DirectX::CXMMATRIX world);
+	void SetWorldTransform(uint object, DirectX::CXMMATRIX world);
+	void RemoveObject(uint object);
+	/** Removes every object */
+	void Clear();
+	/** Brings the BVH up to date with the objects added, moved and removed since the last call */
+	void Update();
+
+	inline uint GetObjectCount() const { return m_bvh.GetProxyCount(); }
+	inline Model *GetModel(uint object) const { return m_objects[object].Model; }
+
+	/**
+	 * Finds the closest triangle along a ray
+	 *
+	 * @param origin         The world space start of the ray
+	 * @param direction      The world space direction of the ray. Doesn't need to be normalized
+	 * @param maxDistance    Hits further along the ray than this, in multiples of 'direction', are ignored
+	 * @param out_hit        Will be filled with the closest hit, if there is one
+	 * @return               True if the ray hit a triangle
+	 */
+	bool Pick(const DirectX::XMFLOAT3 &origin, const DirectX::XMFLOAT3 &direction, float maxDistance, RayHit *out_hit);
+	/** Returns true if the ray hits any triangle closer than 'maxDistance'. IE. false if there's a line of sight */
+	bool IntersectAny(const DirectX::XMFLOAT3 &origin, const DirectX::XMFLOAT3 &direction, float maxDistance);
+	/**
+	 * Finds the closest triangle along each ray of a packet. See RayPacket for how the hits are returned
+	 *
+	 * @param packet    The world space rays. They should be coherent, IE. from neighbouring pixels
+	 * @return          A mask of the lanes that found a closer hit. Bit i is lane i
+	 */
+	uint Pick(RayPacket *packet);
+
+	/**
+	 * Calculates the world space ray through a point on the screen. Doesn't depend on the depth
+	 * range of the projection, so it works for reversed and infinite projections
+	 *
+	 * @param x                The x coordinate of the point, in pixels
+	 * @param y                The y coordinate of the point, in pixels
+	 * @param screenWidth      The width of the screen, in pixels
+	 * @param screenHeight     The height of the screen, in pixels
+	 * @param view             The view matrix
+	 * @param projection       The perspective projection matrix
+	 * @param out_origin       Will be filled with the position of the camera
+	 * @param out_direction    Will be filled with the direction of the ray. Its view space z is 1, so distances along it are view depths
+	 */
+	static void ScreenPointToRay(float x, float y, float screenWidth, float screenHeight, DirectX::CXMMATRIX view, DirectX::CXMMATRIX projection, DirectX::XMFLOAT3 *out_origin, DirectX::XMFLOAT3 *out_direction);
+
+private:
+	/** Fills m_candidates with the objects whose bounds the ray enters before 'maxDistance', nearest first */
+	void GatherCandidates(const DirectX::XMFLOAT3 &origin, const DirectX::XMFLOAT3 &direction, float maxDistance);
+
+	// Not implemented
+	RayPicker(const RayPicker &);
+	RayPicker &operator=(const RayPicker &);
+};
+
+} // End of namespace Scene
@@ -0,0 +1,136 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "scene/render_proxy_store.h"
+
+#include "common/halfling_sys.h"
+
+#include "scene/materials.h"
+#include "scene/model.h"
+#include "scene/static_batcher.h"
+
+#include <algorithm>
+
+
+namespace Scene {
+
+RenderProxyStore::RenderProxyStore(uint initialCapacity)
+		: m_culler(initialCapacity) {
+	m_proxies.reserve(initialCapacity);
+	m_proxyModels.reserve(initialCapacity);
+	m_aabbMins.reserve(initialCapacity);
+	m_aabbMaxs.reserve(initialCapacity);
+}
+
+uint RenderProxyStore::AddModel(const Model *model, uint objectIndex, DirectX::CXMMATRIX world, const StaticBatchRange *batchRange) {
+	uint firstProxy = static_cast<uint>(m_proxies.size());
+
+	for (uint i = 0; i < model->SubsetCount; ++i) {
+		const ModelSubset &subset = model->Subsets[i];
+
+		RenderProxy proxy;
+		proxy.ShaderId = RegisterMaterial(subset.Material);
+		proxy.MaterialId = subset.Material->Id;
+		proxy.SubsetIndex = i;
+		proxy.ObjectIndex = objectIndex;
+		proxy.VertexStride = model->VertexStride;
+		proxy.IndexCount = subset.IndexCount;
+		m_proxies.push_back(proxy);
+
+		m_proxyModels.push_back(model);
+		m_aabbMins.push_back(subset.AABB_min);
+		m_aabbMaxs.push_back(subset.AABB_max);
+		m_culler.Add(subset.AABB_min, subset.AABB_max);
+	}
+
+	SetBatchRange(firstProxy, batchRange);
+	SetWorldTransform(firstProxy, world);
+
+	return firstProxy;
+}
+
+void RenderProxyStore::SetWorldTransform(uint firstProxy, DirectX::CXMMATRIX world) {
+	AssertMsg(firstProxy < m_proxies.size(), "Proxy " << firstProxy << " doesn't exist");
+
+	const Model *model = m_proxyModels[firstProxy];
+	DirectX::XMFLOAT3 sortCenter;
+	DirectX::XMVECTOR center = DirectX::XMVectorScale(DirectX::XMVectorAdd(DirectX::XMLoadFloat3(&model->AABB_min), DirectX::XMLoadFloat3(&model->AABB_max)), 0.5f);
+	DirectX::XMStoreFloat3(&sortCenter, DirectX::XMVector3Transform(center, world));
+
+	for (uint i = 0; i < model->SubsetCount; ++i) {
+		uint proxy = firstProxy + i;
+		const ModelSubset &subset = model->Subsets[i];
+
+		FrustumCuller::TransformAABB(world, subset.AABB_min, subset.AABB_max, &m_aabbMins[proxy], &m_aabbMaxs[proxy]);
+		m_culler.Set(proxy, m_aabbMins[proxy], m_aabbMaxs[proxy]);
+		m_proxies[proxy].SortCenter = sortCenter;
+	}
+}
+
+void RenderProxyStore::SetBatchRange(uint firstProxy, const StaticBatchRange *batchRange) {
+	AssertMsg(firstProxy < m_proxies.size(), "Proxy " << firstProxy << " doesn't exist");
+
+	const Model *model = m_proxyModels[firstProxy];
+	for (uint i = 0; i < model->SubsetCount; ++i) {
+		RenderProxy &proxy = m_proxies[firstProxy + i];
+		const ModelSubset &subset = model->Subsets[i];
+
+		if (batchRange != nullptr) {
+			proxy.VertexBuffer = batchRange->VertexBuffer;
+			proxy.IndexBuffer = batchRange->IndexBuffer;
+			proxy.VertexBufferId = batchRange->VertexBufferId;
+			proxy.IndexBufferId = batchRange->IndexBufferId;
+			proxy.IndexStart = subset.IndexStart + batchRange->BaseIndex;
+			proxy.VertexStart = subset.VertexStart + batchRange->BaseVertex;
+		} else {
+			proxy.VertexBuffer = model->VertexBuffer;
+			proxy.IndexBuffer = model->IndexBuffer;
+			proxy.VertexBufferId = model->VertexBufferId;
+			proxy.IndexBufferId = model->IndexBufferId;
+			proxy.IndexStart = subset.IndexStart;
+			proxy.VertexStart = subset.VertexStart;
+		}
+	}
+}
+
+void RenderProxyStore::Clear() {
+	m_proxies.clear();
+	m_culler.Clear();
+	m_proxyModels.clear();
+	m_aabbMins.clear();
+	m_aabbMaxs.clear();
+	m_materialBindings.clear();
+	m_shaders.clear();
+}
+
+uint32 RenderProxyStore::RegisterMaterial(const Material *material) {
+	uint32 shaderId = static_cast<uint32>(std::find(m_shaders.begin(), m_shaders.end(), material->Shader) - m_shaders.begin());
+	if (shaderId == m_shaders.size()) {
+		m_shaders.push_back(material->Shader);
+	}
+
+	if (material->Id >= m_materialBindings.size()) {
+		m_materialBindings.resize(material->Id + 1u);
+	}
+
+	MaterialBindings &bindings = m_materialBindings[material->Id];
+	if (bindings.Shader == nullptr) {
+		AssertMsg(material->TextureSRVs.size() <= Graphics::kMaxTextureSlots && material->TextureSamplers.size() <= Graphics::kMaxTextureSlots,
+		          "Material " << material->Id << " uses more than " << Graphics::kMaxTextureSlots << " texture slots");
+
+		bindings.Shader = material->Shader;
+		for (uint i = 0; i < material->TextureSRVs.size(); ++i) {
+			bindings.TextureSRVs.Set(material->TextureSRVs[i], i);
+		}
+		for (uint i = 0; i < material->TextureSamplers.size(); ++i) {
+			bindings.TextureSamplers.Set(material->TextureSamplers[i], i);
+		}
+	}
+
+	return shaderId;
+}
+
+} // End of namespace Scene
@@ -0,0 +1,163 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "common/typedefs.h"
+
+#include "graphics/graphics_state.h"
+#include "graphics/shader.h"
+
+#include "scene/frustum_culler.h"
+
+#include <d3d11.h>
+#include <DirectXMath.h>
+
+#include <vector>
+
+
+namespace Common {
+class ThreadPool;
+}
+
+namespace Scene {
+
+struct Material;
+class Model;
+struct StaticBatchRange;
+
+/**
+ * Everything needed to sort and draw one subset of one placed model, without going
+ * through the Model, its subsets, or the Material
+ */
+struct RenderProxy {
+	// The sort key fields
+	/** A dense id of the material shader. Assigned by the RenderProxyStore, in the order the shaders are first seen */
+	uint32 ShaderId;
+	/** Material::Id. Also the index of the material's bindings. See RenderProxyStore::GetMaterialBindings() */
+	uint32 MaterialId;
+	uint32 VertexBufferId;
+	uint32 IndexBufferId;
+	uint32 SubsetIndex;
+
+	/** The index of the object's data (IE. its world matrix) in the persistent per-object buffer */
+	uint32 ObjectIndex;
+
+	// The draw. If the model is in a static batch, these already point into the merged buffers
+	ID3D11Buffer *VertexBuffer;
+	ID3D11Buffer *IndexBuffer;
+	uint VertexStride;
+	uint IndexCount;
+	uint IndexStart;
+	uint VertexStart;
+
+	/** The world space point the proxy is depth sorted on. The center of the model's bounds, so the subsets of a model sort together */
+	DirectX::XMFLOAT3 SortCenter;
+};
+
+/** What a material binds, in the form the draw commands store it, so it can be copied into a command as a whole */
+struct MaterialBindings {
+	MaterialBindings()
+		: Shader(nullptr) {
+	}
+
+	Graphics::MaterialShader *Shader;
+	Graphics::TextureSRVSlots TextureSRVs;
+	Graphics::TextureSamplerSlots TextureSamplers;
+};
+
+/**
+ * A flat array of RenderProxy, one per subset of every model that was added
+ *
+ * Drawing a model the usual way walks Model -> Subsets -> Material -> texture / sampler vectors for
+ * every draw, and every step is a pointer into a different heap allocation. The store does that walk
+ * once, when the model is added, and keeps the result in a contiguous array, along with a
+ * FrustumCuller over the world space bounds of the proxies. Per frame, Cull() gives the visible
+ * proxies in ascending order, and command generation streams through them in that order.
+ *
+ * The proxies of a model are contiguous. Scene changes (moving a model, moving it in or out of a
+ * static batch) only rewrite the proxies of that model.
+ *
+ * The Model pointers and the bounds are kept in separate, cold arrays, since they're only needed
+ * when the scene changes, or for things like picking occluders.
+ */
+class RenderProxyStore {
+public:
+	/**
+	 * @param initialCapacity    The number of proxies to reserve memory for
+	 */
+	RenderProxyStore(uint initialCapacity = 0u);
+
+private:
+	std::vector<RenderProxy> m_proxies;
+	FrustumCuller m_culler;
+
+	// Cold data
+	std::vector<const Model *> m_proxyModels;
+	std::vector<DirectX::XMFLOAT3> m_aabbMins;
+	std::vector<DirectX::XMFLOAT3> m_aabbMaxs;
+
+	/** Indexed by Material::Id. Materials that haven't been seen have a null Shader */
+	std::vector<MaterialBindings> m_materialBindings;
+	/** Indexed by RenderProxy::ShaderId */
+	std::vector<Graphics::MaterialShader *> m_shaders;
+
+public:
+	/**
+	 * Adds a proxy for every subset of a model
+	 *
+	 * @param model          The model. Has to outlive the store
+	 * @param objectIndex    The index of the model's data in the persistent per-object buffer
+	 * @param world          The world transform of the model
+	 * @param batchRange     [Optional] Where the model lives in a static batch. If nullptr, the proxies draw from the model's own buffers
+	 * @return               The index of the first proxy. The rest of the subsets follow it, in order
+	 */
+	uint AddModel(const Model *model, uint objectIndex, DirectX::CXMMATRIX world, const StaticBatchRange *batchRange = nullptr);
+	/** Moves the proxies of a model. 'firstProxy' is the index returned by AddModel() */
+	void SetWorldTransform(uint firstProxy, DirectX::CXMMATRIX world);
+	/**
+	 * Changes the buffers the proxies of a model draw from
+	 *
+	 * @param firstProxy    The index returned by AddModel()
+	 * @param batchRange    Where the model lives in a static batch, or nullptr to draw from the model's own buffers
+	 */
+	void SetBatchRange(uint firstProxy, const StaticBatchRange *batchRange);
+	/** Removes every proxy */
+	void Clear();
+
+	inline uint GetSize() const { return static_cast<uint>(m_proxies.size()); }
+	inline const RenderProxy &Get(uint proxy) const { return m_proxies[proxy]; }
+	inline const Model *GetModel(uint proxy) const { return m_proxyModels[proxy]; }
+	inline const DirectX::XMFLOAT3 &GetAABBMin(uint proxy) const { return m_aabbMins[proxy]; }
+	inline const DirectX::XMFLOAT3 &GetAABBMax(uint proxy) const { return m_aabbMaxs[proxy]; }
+	inline const MaterialBindings &GetMaterialBindings(uint32 materialId) const { return m_materialBindings[materialId]; }
+	/** Returns the number of distinct material shaders. RenderProxy::ShaderId is always less than this */
+	inline uint GetShaderCount() const { return static_cast<uint>(m_shaders.size()); }
+
+	/** Calculates the bounds of every proxy */
+	inline void GetBounds(DirectX::XMFLOAT3 *out_min, DirectX::XMFLOAT3 *out_max) const { m_culler.GetBounds(out_min, out_max); }
+	/**
+	 * Finds the proxies whose bounds intersect the frustum
+	 *
+	 * @param frustum        The frustum to test against
+	 * @param out_visible    Will be filled with the indices of the visible proxies, in ascending order
+	 * @param threadPool     [Optional] If not nullptr, the proxies are culled in parallel chunks
+	 * @return               The number of visible proxies
+	 */
+	inline uint Cull(const Frustum &frustum, std::vector<uint> *out_visible, Common::ThreadPool *threadPool = nullptr) {
+		return m_culler.Cull(frustum, out_visible, threadPool);
+	}
+	/** Same as above, for the proxies whose bounds intersect a convex volume. IE. the shadow casters of a ShadowView */
+	inline uint Cull(const ConvexVolume &volume, std::vector<uint> *out_visible, Common::ThreadPool *threadPool = nullptr) {
+		return m_culler.Cull(volume, out_visible, threadPool);
+	}
+
+private:
+	/** Returns the dense shader id of the material, and fills in its bindings if it hasn't been seen before */
+	uint32 RegisterMaterial(const Material *material);
+};
+
+} // End of namespace Scene
@@ -0,0 +1,233 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "scene/shadow_views.h"
+
+#include "common/halfling_sys.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+
+namespace Scene {
+
+namespace {
+
+/**
+ * Three corners of each face of a frustum, in the corner order of CalculateFrustumCorners().
+ * Face 2 * axis is the face where that axis' bit of the corner index is 0, and face 2 * axis + 1
+ * is the one where it's 1. IE. left, right, bottom, top, near, far
+ */
+const uint kFaceCorners[6][3] = {
+	{0u, 2u, 4u},
+	{1u, 3u, 5u},
+	{0u, 1u, 4u},
+	{2u, 3u, 6u},
+	{0u, 1u, 2u},
+	{4u, 5u, 6u}
+};
+
+/** The maximum field of view of a spot light's shadow view. 160 degrees */
+const float kMaxSpotFieldOfView = DirectX::XM_PI * (160.0f / 180.0f);
+
+/**
+ * Makes a plane with the given normal through a point, facing 'inside'
+ *
+ * @return    False if the normal is degenerate
+ */
+bool MakePlane(DirectX::FXMVECTOR normal, DirectX::FXMVECTOR point, DirectX::FXMVECTOR inside, DirectX::XMFLOAT4 *out_plane) {
+	float length = DirectX::XMVectorGetX(DirectX::XMVector3Length(normal));
+	if (length < 1.0e-12f) {
+		return false;
+	}
+
+	DirectX::XMVECTOR unitNormal = DirectX::XMVectorScale(normal, 1.0f / length);
+	float distance = -DirectX::XMVectorGetX(DirectX::XMVector3Dot(unitNormal, point));
+	if (DirectX::XMVectorGetX(DirectX::XMVector3Dot(unitNormal, inside)) + distance < 0.0f) {
+		unitNormal = DirectX::XMVectorNegate(unitNormal);
+		distance = -distance;
+	}
+
+	*out_plane = DirectX::XMFLOAT4(DirectX::XMVectorGetX(unitNormal), DirectX::XMVectorGetY(unitNormal), DirectX::XMVectorGetZ(unitNormal), distance);
+	return true;
+}
+
+/** An up vector for a view looking along 'direction' that's never parallel to it */
+DirectX::XMVECTOR ChooseUpVector(const DirectX::XMFLOAT3 &direction) {
+	return std::fabs(direction.y) > 0.99f ? DirectX::XMVectorSet(1.0f, 0.0f, 0.0f, 0.0f) : DirectX::XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f);
+}
+
+} // End of anonymous namespace
+
+
+void CalculateCascadeSplits(float nearClip, float farClip, uint cascadeCount, float lambda, float *out_splits) {
+	AssertMsg(nearClip > 0.0f && farClip > nearClip, "The depth range has to be in front of the camera");
+
+	out_splits[0] = nearClip;
+	for (uint i = 1; i < cascadeCount; ++i) {
+		float fraction = static_cast<float>(i) / static_cast<float>(cascadeCount);
+		float logarithmic = nearClip * std::pow(farClip / nearClip, fraction);
+		float uniform = nearClip + (farClip - nearClip) * fraction;
+		out_splits[i] = lambda * logarithmic + (1.0f - lambda) * uniform;
+	}
+	out_splits[cascadeCount] = farClip;
+}
+
+void CalculateFrustumCorners(DirectX::CXMMATRIX view, DirectX::CXMMATRIX projection, float nearDepth, float farDepth, DirectX::XMFLOAT3 *out_corners) {
+	AssertMsg(nearDepth > 0.0f, "The near plane has to be in front of the camera");
+
+	// The projection scales x and y by the inverse of the tangent of the half field of view
+	float tanHalfFovX = 1.0f / DirectX::XMVectorGetX(projection.r[0]);
+	float tanHalfFovY = 1.0f / DirectX::XMVectorGetY(projection.r[1]);
+	DirectX::XMMATRIX inverseView = DirectX::XMMatrixInverse(nullptr, view);
+
+	for (uint i = 0; i < 8u; ++i) {
+		float depth = (i & 4u) != 0u ? farDepth : nearDepth;
+		float x = (i & 1u) != 0u ? depth * tanHalfFovX : -depth * tanHalfFovX;
+		float y = (i & 2u) != 0u ? depth * tanHalfFovY : -depth * tanHalfFovY;
+
+		DirectX::XMStoreFloat3(&out_corners[i], DirectX::XMVector3TransformCoord(DirectX::XMVectorSet(x, y, depth, 1.0f), inverseView));
+	}
+}
+
+ConvexVolume ExtrudeTowardLight(const DirectX::XMFLOAT3 *corners, const DirectX::XMFLOAT4 &light) {
+	DirectX::XMVECTOR points[8];
+	DirectX::XMVECTOR centroid = DirectX::XMVectorZero();
+	for (uint i = 0; i < 8u; ++i) {
+		points[i] = DirectX::XMLoadFloat3(&corners[i]);
+		centroid = DirectX::XMVectorAdd(centroid, points[i]);
+	}
+	centroid = DirectX::XMVectorScale(centroid, 1.0f / 8.0f);
+
+	DirectX::XMVECTOR lightVector = DirectX::XMLoadFloat4(&light);
+
+	ConvexVolume volume;
+	volume.PlaneCount = 0u;
+
+	// Keep the faces that have the light on their inside. Extruding toward the light never crosses them
+	DirectX::XMFLOAT4 facePlanes[6];
+	bool faceKept[6];
+	for (uint f = 0; f < 6u; ++f) {
+		DirectX::XMVECTOR a = points[kFaceCorners[f][0]];
+		DirectX::XMVECTOR b = points[kFaceCorners[f][1]];
+		DirectX::XMVECTOR c = points[kFaceCorners[f][2]];
+		DirectX::XMVECTOR normal = DirectX::XMVector3Cross(DirectX::XMVectorSubtract(b, a), DirectX::XMVectorSubtract(c, a));
+
+		if (!MakePlane(normal, a, centroid, &facePlanes[f])) {
+			// A degenerate face doesn't bound anything
+			faceKept[f] = false;
+			continue;
+		}
+
+		// Works for both points (w = 1) and directions (w = 0)
+		float lightDistance = DirectX::XMVectorGetX(DirectX::XMVector4Dot(DirectX::XMLoadFloat4(&facePlanes[f]), lightVector));
+		faceKept[f] = lightDistance >= 0.0f;
+		if (faceKept[f]) {
+			volume.Planes[volume.PlaneCount++] = facePlanes[f];
+		}
+	}
+
+	// Each edge between a kept face and a dropped face is on the silhouette of the frustum, as seen
+	// from the light. The hull gets a plane through the edge and the light
+	for (uint corner = 0; corner < 8u; ++corner) {
+		for (uint axis = 0; axis < 3u; ++axis) {
+			if ((corner & (1u << axis)) != 0u) {
+				continue;
+			}
+
+			// The edge runs along 'axis'. It's shared by one face of each of the other two axes
+			uint otherAxis0 = (axis + 1u) % 3u;
+			uint otherAxis1 = (axis + 2u) % 3u;
+			uint face0 = 2u * otherAxis0 + ((corner >> otherAxis0) & 1u);
+			uint face1 = 2u * otherAxis1 + ((corner >> otherAxis1) & 1u);
+			if (faceKept[face0] == faceKept[face1]) {
+				continue;
+			}
+
+			DirectX::XMVECTOR start = points[corner];
+			DirectX::XMVECTOR end = points[corner | (1u << axis)];
+			// The vector from the start of the edge toward the light
+			DirectX::XMVECTOR towardLight = DirectX::XMVectorSubtract(lightVector, DirectX::XMVectorScale(start, light.w));
+			DirectX::XMVECTOR normal = DirectX::XMVector3Cross(DirectX::XMVectorSubtract(end, start), towardLight);
+
+			DirectX::XMFLOAT4 plane;
+			if (MakePlane(normal, start, centroid, &plane)) {
+				AssertMsg(volume.PlaneCount < ConvexVolume::kMaxPlanes, "The caster volume has too many planes");
+				volume.Planes[volume.PlaneCount++] = plane;
+			}
+		}
+	}
+
+	return volume;
+}
+
+ShadowView CalculateCascadeView(const DirectX::XMFLOAT3 *corners, const DirectX::XMFLOAT3 &lightDirection, const DirectX::XMFLOAT3 &sceneMin, const DirectX::XMFLOAT3 &sceneMax, uint shadowMapSize) {
+	// The bounding sphere of the slice. Its radius only depends on the slice, not on which way the camera faces
+	DirectX::XMVECTOR center = DirectX::XMVectorZero();
+	for (uint i = 0; i < 8u; ++i) {
+		center = DirectX::XMVectorAdd(center, DirectX::XMLoadFloat3(&corners[i]));
+	}
+	center = DirectX::XMVectorScale(center, 1.0f / 8.0f);
+
+	float radius = 0.0f;
+	for (uint i = 0; i < 8u; ++i) {
+		radius = std::max(radius, DirectX::XMVectorGetX(DirectX::XMVector3Length(DirectX::XMVectorSubtract(DirectX::XMLoadFloat3(&corners[i]), center))));
+	}
+	// Round up, so float noise in the corners doesn't change the texel size from frame to frame
+	radius = std::ceil(radius * 16.0f) / 16.0f;
+
+	// The light's view is anchored at the world origin, so a texel is always the same patch of the world
+	DirectX::XMMATRIX lightView = DirectX::XMMatrixLookToLH(DirectX::XMVectorZero(), DirectX::XMLoadFloat3(&lightDirection), ChooseUpVector(lightDirection));
+	DirectX::XMFLOAT3 lightSpaceCenter;
+	DirectX::XMStoreFloat3(&lightSpaceCenter, DirectX::XMVector3TransformCoord(center, lightView));
+
+	float texelSize = 2.0f * radius / static_cast<float>(shadowMapSize);
+	lightSpaceCenter.x = std::floor(lightSpaceCenter.x / texelSize) * texelSize;
+	lightSpaceCenter.y = std::floor(lightSpaceCenter.y / texelSize) * texelSize;
+
+	// Reach back toward the light as far as the scene goes, so every caster in front of the slice fits
+	float nearZ = lightSpaceCenter.z - radius;
+	float farZ = lightSpaceCenter.z + radius;
+	for (uint i = 0; i < 8u; ++i) {
+		DirectX::XMVECTOR sceneCorner = DirectX::XMVectorSet((i & 1u) != 0u ? sceneMax.x : sceneMin.x, (i & 2u) != 0u ? sceneMax.y : sceneMin.y, (i & 4u) != 0u ? sceneMax.z : sceneMin.z, 1.0f);
+		nearZ = std::min(nearZ, DirectX::XMVectorGetZ(DirectX::XMVector3TransformCoord(sceneCorner, lightView)));
+	}
+
+	DirectX::XMMATRIX projection = DirectX::XMMatrixOrthographicOffCenterLH(lightSpaceCenter.x - radius, lightSpaceCenter.x + radius,
+	                                                                        lightSpaceCenter.y - radius, lightSpaceCenter.y + radius,
+	                                                                        nearZ, farZ);
+
+	ShadowView view;
+	DirectX::XMStoreFloat4x4(&view.ViewProj, lightView * projection);
+	view.CasterVolume = ExtrudeTowardLight(corners, DirectX::XMFLOAT4(-lightDirection.x, -lightDirection.y, -lightDirection.z, 0.0f));
+
+	return view;
+}
+
+ShadowView CalculateSpotShadowView(const DirectX::XMFLOAT3 *cameraCorners, const DirectX::XMFLOAT3 &position, const DirectX::XMFLOAT3 &direction, float outerConeAngle, float range, float nearClip) {
+	// The square frustum with a half field of view of the cone angle encloses the cone
+	float fieldOfView = std::min(2.0f * outerConeAngle, kMaxSpotFieldOfView);
+
+	DirectX::XMMATRIX lightView = DirectX::XMMatrixLookToLH(DirectX::XMLoadFloat3(&position), DirectX::XMLoadFloat3(&direction), ChooseUpVector(direction));
+	DirectX::XMMATRIX projection = DirectX::XMMatrixPerspectiveFovLH(fieldOfView, 1.0f, nearClip, range);
+	DirectX::XMMATRIX viewProj = lightView * projection;
+
+	ShadowView view;
+	DirectX::XMStoreFloat4x4(&view.ViewProj, viewProj);
+	view.CasterVolume = ExtrudeTowardLight(cameraCorners, DirectX::XMFLOAT4(position.x, position.y, position.z, 1.0f));
+
+	// A caster also has to be inside the light's own frustum, or it isn't in the shadow map at all
+	Frustum lightFrustum = ExtractFrustum(viewProj);
+	for (uint i = 0; i < 6u; ++i) {
+		AssertMsg(view.CasterVolume.PlaneCount < ConvexVolume::kMaxPlanes, "The caster volume has too many planes");
+		view.CasterVolume.Planes[view.CasterVolume.PlaneCount++] = lightFrustum.Planes[i];
+	}
+
+	return view;
+}
+
+} // End of namespace Scene
@@ -0,0 +1,98 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "common/typedefs.h"
+
+#include "scene/frustum_culler.h"
+
+#include <DirectXMath.h>
+
+
+namespace Scene {
+
+/**
+ * The view a shadow map is rendered from, and the volume its casters have to intersect
+ *
+ * The caster volume is the receiver volume (the part of the camera frustum that the shadow map
+ * covers) extruded toward the light. IE. the convex hull of the receivers and the light. Anything
+ * outside of it can't throw a shadow onto a visible receiver, even if it's inside the light's
+ * view, so it doesn't have to be drawn into the shadow map.
+ */
+struct ShadowView {
+	/** World to shadow map clip space. Uses normal depth, not reversed depth */
+	DirectX::XMFLOAT4X4 ViewProj;
+	ConvexVolume CasterVolume;
+};
+
+/**
+ * Splits a depth range into cascades, blending between a logarithmic and a uniform split
+ *
+ * @param nearClip      The view depth the first cascade starts at. Must be greater than 0
+ * @param farClip       The view depth the last cascade ends at. IE. the shadow distance
+ * @param cascadeCount  The number of cascades
+ * @param lambda        0 gives uniform splits, 1 gives logarithmic splits. Around 0.8 suits most scenes
+ * @param out_splits    Will be filled with the cascadeCount + 1 split depths. Cascade i covers [out_splits[i], out_splits[i + 1]]
+ */
+void CalculateCascadeSplits(float nearClip, float farClip, uint cascadeCount, float lambda, float *out_splits);
+
+/**
+ * Calculates the world space corners of a depth slice of a perspective view. Corner i has its x at
+ * the right if bit 0 of i is set, its y at the top if bit 1 is set, and is on the far plane of the slice
+ * if bit 2 is set. Only uses the field of view of the projection, so the depth range of the projection
+ * doesn't matter
+ *
+ * @param view           The view matrix
+ * @param projection     The perspective projection matrix
+ * @param nearDepth      The view depth of the near plane of the slice. Must be greater than 0
+ * @param farDepth       The view depth of the far plane of the slice
+ * @param out_corners    Will be filled with the 8 corners
+ */
+void CalculateFrustumCorners(DirectX::CXMMATRIX view, DirectX::CXMMATRIX projection, float nearDepth, float farDepth, DirectX::XMFLOAT3 *out_corners);
+
+/**
+ * Calculates the convex hull of a frustum and a light. The faces of the frustum that the light is
+ * behind are kept, and every silhouette edge of the frustum, as seen from the light, adds a plane
+ * through the edge and the light. If the light is inside the frustum, the hull is the frustum itself
+ *
+ * @param corners     The 8 corners of the frustum, in the order of CalculateFrustumCorners()
+ * @param light       (position, 1) for a point or spot light, or (direction toward the light, 0) for a directional light
+ * @return            The hull. Has at most 11 planes
+ */
+ConvexVolume ExtrudeTowardLight(const DirectX::XMFLOAT3 *corners, const DirectX::XMFLOAT4 &light);
+
+/**
+ * Calculates the view of one cascade of a directional light's shadow map
+ *
+ * The shadow map covers the bounding sphere of the cascade's slice of the camera frustum, so its
+ * size doesn't change as the camera turns. Its position is snapped to whole texels, so the shadow
+ * edges don't shimmer as the camera moves. The depth range reaches back toward the light as far
+ * as the scene goes, so casters outside of the slice aren't clipped
+ *
+ * @param corners           The 8 corners of the slice, in the order of CalculateFrustumCorners()
+ * @param lightDirection    The direction the light travels in. Must be normalized
+ * @param sceneMin          The minimum of the world space bounds of every caster
+ * @param sceneMax          The maximum of the world space bounds of every caster
+ * @param shadowMapSize     The width and height of the shadow map, in texels
+ */
+ShadowView CalculateCascadeView(const DirectX::XMFLOAT3 *corners, const DirectX::XMFLOAT3 &lightDirection, const DirectX::XMFLOAT3 &sceneMin, const DirectX::XMFLOAT3 &sceneMax, uint shadowMapSize);
+
+/**
+ * Calculates the view of a spot light's shadow map. The caster volume is the hull of the camera
+ * frustum and the light, clipped to the light's own frustum
+ *
+ * @param cameraCorners     The 8 corners of the camera frustum, in the order of CalculateFrustumCorners()
+ * @param position          The position of the light
+ * @param direction         The direction the light points in. Must be normalized
+ * @param outerConeAngle    The angle between the direction and the edge of the cone, in radians. The view is
+ *                          clamped to a field of view of 160 degrees, so very wide cones lose their edges
+ * @param range             The range of the light. Used as the far plane
+ * @param nearClip          The near plane of the view
+ */
+ShadowView CalculateSpotShadowView(const DirectX::XMFLOAT3 *cameraCorners, const DirectX::XMFLOAT3 &position, const DirectX::XMFLOAT3 &direction, float outerConeAngle, float range, float nearClip);
+
+} // End of namespace Scene
@@ -0,0 +1,153 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "scene/static_batcher.h"
+
+#include "common/dense_id_generator.h"
+
+#include <map>
+#include <unordered_set>
+
+
+namespace Scene {
+
+StaticBatcher::StaticBatcher(Graphics::RenderBackend *backend, uint maxBatchBytes)
+	: m_backend(backend),
+	  m_maxBatchBytes(maxBatchBytes) {
+}
+
+StaticBatcher::~StaticBatcher() {
+	Clear();
+}
+
+void StaticBatcher::AddModel(Model *model) {
+	m_models.push_back(model);
+}
+
+void StaticBatcher::Build() {
+	Clear();
+
+	// Group the models by vertex stride. Each model is only batched once, no matter how many times it was added
+	// std::map keeps the batch order stable from run to run
+	std::map<uint, std::vector<Model *> > groups;
+	std::unordered_set<const Model *> seen;
+	for (auto iter = m_models.begin(); iter != m_models.end(); ++iter) {
+		Model *model = *iter;
+		if (model->VertexBuffer == nullptr || model->IndexBuffer == nullptr || model->VertexCount == 0u || model->IndexCount == 0u) {
+			continue;
+		}
+		if (!seen.insert(model).second) {
+			continue;
+		}
+
+		groups[model->VertexStride].push_back(model);
+	}
+
+	std::vector<Model *> batchModels;
+	for (auto groupIter = groups.begin(); groupIter != groups.end(); ++groupIter) {
+		uint vertexStride = groupIter->first;
+		uint64 vertexCount = 0u;
+		uint64 indexCount = 0u;
+
+		for (auto iter = groupIter->second.begin(); iter != groupIter->second.end(); ++iter) {
+			Model *model = *iter;
+
+			// Models that fill a whole batch by themselves gain nothing from batching
+			if (static_cast<uint64>(model->VertexCount) * vertexStride > m_maxBatchBytes || static_cast<uint64>(model->IndexCount) * sizeof(uint) > m_maxBatchBytes) {
+				continue;
+			}
+
+			// Start a new batch if this model doesn't fit
+			if ((vertexCount + model->VertexCount) * vertexStride > m_maxBatchBytes || (indexCount + model->IndexCount) * sizeof(uint) > m_maxBatchBytes) {
+				if (batchModels.size() > 1u) {
+					CreateBatch(batchModels, vertexStride, static_cast<uint>(vertexCount), static_cast<uint>(indexCount));
+				}
+				batchModels.clear();
+				vertexCount = 0u;
+				indexCount = 0u;
+			}
+
+			batchModels.push_back(model);
+			vertexCount += model->VertexCount;
+			indexCount += model->IndexCount;
+		}
+
+		if (batchModels.size() > 1u) {
+			CreateBatch(batchModels, vertexStride, static_cast<uint>(vertexCount), static_cast<uint>(indexCount));
+		}
+		batchModels.clear();
+	}
+}
+
+void StaticBatcher::Clear() {
+	for (auto iter = m_batches.begin(); iter != m_batches.end(); ++iter) {
+		m_backend->ReleaseBuffer(iter->VertexBuffer);
+		m_backend->ReleaseBuffer(iter->IndexBuffer);
+		Common::DenseIdGenerator<VertexBufferIdTag>::Release(iter->VertexBufferId);
+		Common::DenseIdGenerator<IndexBufferIdTag>::Release(iter->IndexBufferId);
+	}
+	m_batches.clear();
+	m_ranges.clear();
+}
+
+const StaticBatchRange *StaticBatcher::GetRange(const Model *model) const {
+	auto iter = m_ranges.find(model);
+	if (iter == m_ranges.end()) {
+		return nullptr;
+	}
+
+	return &iter->second;
+}
+
+void StaticBatcher::CreateBatch(const std::vector<Model *> &models, uint vertexStride, uint vertexCount, uint indexCount) {
+	Batch batch;
+	batch.VertexStride = vertexStride;
+	batch.VertexCount = vertexCount;
+	batch.IndexCount = indexCount;
+
+	D3D11_BUFFER_DESC vbd;
+	vbd.Usage = D3D11_USAGE_DEFAULT;
+	vbd.ByteWidth = vertexStride * vertexCount;
+	vbd.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+	vbd.CPUAccessFlags = 0;
+	vbd.MiscFlags = 0;
+	vbd.StructureByteStride = 0;
+	batch.VertexBuffer = m_backend->CreateBuffer(vbd, nullptr);
+
+	D3D11_BUFFER_DESC ibd;
+	ibd.Usage = D3D11_USAGE_DEFAULT;
+	ibd.ByteWidth = sizeof(uint) * indexCount;
+	ibd.BindFlags = D3D11_BIND_INDEX_BUFFER;
+	ibd.CPUAccessFlags = 0;
+	ibd.MiscFlags = 0;
+	ibd.StructureByteStride = 0;
+	batch.IndexBuffer = m_backend->CreateBuffer(ibd, nullptr);
+	batch.VertexBufferId = Common::DenseIdGenerator<VertexBufferIdTag>::Next();
+	batch.IndexBufferId = Common::DenseIdGenerator<IndexBufferIdTag>::Next();
+
+	StaticBatchRange range;
+	range.VertexBuffer = batch.VertexBuffer;
+	range.IndexBuffer = batch.IndexBuffer;
+	range.VertexBufferId = batch.VertexBufferId;
+	range.IndexBufferId = batch.IndexBufferId;
+	range.BaseVertex = 0u;
+	range.BaseIndex = 0u;
+
+	for (auto iter = models.begin(); iter != models.end(); ++iter) {
+		Model *model = *iter;
+
+		m_backend->CopyBuffer(batch.VertexBuffer, range.BaseVertex * vertexStride, model->VertexBuffer, 0u, model->VertexCount * vertexStride);
+		m_backend->CopyBuffer(batch.IndexBuffer, range.BaseIndex * sizeof(uint), model->IndexBuffer, 0u, model->IndexCount * sizeof(uint));
+		m_ranges[model] = range;
+
+		range.BaseVertex += model->VertexCount;
+		range.BaseIndex += model->IndexCount;
+	}
+
+	m_batches.push_back(batch);
+}
+
+} // End of namespace Scene
@@ -0,0 +1,115 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "common/typedefs.h"
+
+#include "graphics/render_backend.h"
+
+#include "scene/model.h"
+
+#include <unordered_map>
+#include <vector>
+
+
+namespace Scene {
+
+/** Where the geometry of a batched model lives inside the merged buffers of its batch */
+struct StaticBatchRange {
+	ID3D11Buffer *VertexBuffer;
+	ID3D11Buffer *IndexBuffer;
+	/** Dense ids of the merged buffers. Use these instead of Model::VertexBufferId / IndexBufferId in sort keys */
+	uint32 VertexBufferId;
+	uint32 IndexBufferId;
+
+	/** Add to ModelSubset::VertexStart to get the base vertex of a subset in the merged vertex buffer */
+	uint BaseVertex;
+	/** Add to ModelSubset::IndexStart to get the start of a subset in the merged index buffer */
+	uint BaseIndex;
+};
+
+/**
+ * Merges the geometry of static models into a few large vertex / index buffers
+ *
+ * Models are grouped by vertex stride, and each group is packed into batches of at most
+ * 'maxBatchBytes' of vertex data (and the same of index data). The copies are done on the
+ * GPU with RenderBackend::CopyBuffer(), so the models don't need to keep a CPU copy of
+ * their geometry. Indices aren't rewritten. Instead, every batched model gets a base vertex
+ * and base index that are added to the ranges of its subsets.
+ *
+ * Draws of models in the same batch bind the same vertex / index buffers, so they sort next
+ * to each other and CommandBucket filters the buffer binds between them.
+ *
+ * The models keep their own buffers, so anything that isn't batch aware can keep drawing
+ * them as usual. Subset ranges and bounds are untouched.
+ *
+ * NOTE: The models are assumed to use DXGI_FORMAT_R32_UINT indices, like everything created through Scene::Model
+ */
+class StaticBatcher {
+public:
+	/**
+	 * @param backend          The backend to create the merged buffers and do the copies with
+	 * @param maxBatchBytes    The maximum size of the vertex buffer and of the index buffer of a single batch
+	 */
+	StaticBatcher(Graphics::RenderBackend *backend, uint maxBatchBytes = kDefaultMaxBatchBytes);
+	~StaticBatcher();
+
+	static const uint kDefaultMaxBatchBytes = 32u * 1024u * 1024u;
+
+private:
+	struct Batch {
+		ID3D11Buffer *VertexBuffer;
+		ID3D11Buffer *IndexBuffer;
+		uint32 VertexBufferId;
+		uint32 IndexBufferId;
+		uint VertexStride;
+		uint VertexCount;
+		uint IndexCount;
+	};
+
+	Graphics::RenderBackend *m_backend;
+	uint m_maxBatchBytes;
+
+	std::vector<Model *> m_models;
+	std::unordered_map<const Model *, StaticBatchRange> m_ranges;
+	std::vector<Batch> m_batches;
+
+public:
+	/**
+	 * Queues a model to be batched by Build(). Adding the same model more than once is
+	 * allowed. IE. once for every placement of the model in the scene
+	 *
+	 * @param model    The model. It must outlive the StaticBatcher
+	 */
+	void AddModel(Model *model);
+	/**
+	 * Creates the merged buffers and copies the geometry of all the queued models into them
+	 *
+	 * Models that would be alone in their batch, or that are bigger than a whole batch, are
+	 * left unbatched. Calling Build() again throws away the old batches and rebuilds them
+	 * from all the models added so far
+	 */
+	void Build();
+	/** Releases the merged buffers and their dense ids */
+	void Clear();
+
+	/**
+	 * Returns where a model's geometry lives in the merged buffers
+	 *
+	 * @param model    The model
+	 * @return         The range, or nullptr if the model isn't batched
+	 */
+	const StaticBatchRange *GetRange(const Model *model) const;
+
+	inline uint GetBatchCount() const { return static_cast<uint>(m_batches.size()); }
+	inline uint GetBatchedModelCount() const { return static_cast<uint>(m_ranges.size()); }
+
+private:
+	void CreateBatch(const std::vector<Model *> &models, uint vertexStride, uint vertexCount, uint indexCount);
+};
+
+} // End of namespace Scene
@@ -0,0 +1,312 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "scene/transform_hierarchy.h"
+
+#include "common/halfling_sys.h"
+#include "common/thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+
+
+namespace Scene {
+
+// The containers take it by reference, so it needs a definition
+const uint TransformHierarchy::kNullNode;
+
+TransformHierarchy::TransformHierarchy(uint initialCapacity)
+		: m_firstRoot(kNullNode),
+		  m_lastRoot(kNullNode),
+		  m_nodeCount(0u),
+		  m_layoutDirty(false) {
+	m_nodes.reserve(initialCapacity);
+	m_localTransforms.reserve(initialCapacity);
+	m_worldTransforms.reserve(initialCapacity);
+	m_parentSlots.reserve(initialCapacity);
+	m_slotNodes.reserve(initialCapacity);
+	m_dirty.reserve(initialCapacity);
+	m_changed.reserve(initialCapacity);
+}
+
+uint TransformHierarchy::CreateNode(uint parent, DirectX::CXMMATRIX localTransform) {
+	AssertMsg(parent == kNullNode || IsValid(parent), "Invalid parent node " << parent);
+
+	uint node;
+	if (!m_freeNodes.empty()) {
+		node = m_freeNodes.back();
+		m_freeNodes.pop_back();
+	} else {
+		node = static_cast<uint>(m_nodes.size());
+		m_nodes.push_back(Node());
+	}
+
+	// The new slot goes on the end, out of order. The next Update() sorts it into place
+	uint slot = static_cast<uint>(m_slotNodes.size());
+	m_localTransforms.push_back(localTransform);
+	m_worldTransforms.push_back(DirectX::XMMatrixIdentity());
+	m_parentSlots.push_back(kNullNode);
+	m_slotNodes.push_back(node);
+	m_dirty.push_back(0u);
+	m_changed.push_back(0u);
+
+	Node &newNode = m_nodes[node];
+	newNode.FirstChild = kNullNode;
+	newNode.LastChild = kNullNode;
+	newNode.Slot = slot;
+	newNode.Depth = parent == kNullNode ? 0u : m_nodes[parent].Depth + 1u;
+	LinkNode(node, parent);
+
+	MarkDirty(slot);
+	m_layoutDirty = true;
+	++m_nodeCount;
+
+	return node;
+}
+
+void TransformHierarchy::DestroyNode(uint node) {
+	AssertMsg(IsValid(node), "Invalid node " << node);
+
+	UnlinkNode(node);
+
+	// Free the subtree. It's walked depth first, using the child / sibling links, so it needs no stack
+	uint current = node;
+	while (current != kNullNode) {
+		Node &currentNode = m_nodes[current];
+		if (currentNode.FirstChild != kNullNode) {
+			// Detach the first child, so we don't walk into it again when we come back up
+			uint child = currentNode.FirstChild;
+			currentNode.FirstChild = m_nodes[child].NextSibling;
+			current = child;
+			continue;
+		}
+
+		uint parent = current == node ? kNullNode : currentNode.Parent;
+		m_slotNodes[currentNode.Slot] = kNullNode;
+		currentNode.Slot = kNullNode;
+		m_freeNodes.push_back(current);
+		--m_nodeCount;
+
+		current = parent;
+	}
+
+	m_layoutDirty = true;
+}
+
+void TransformHierarchy::SetParent(uint node, uint parent) {
+	AssertMsg(IsValid(node), "Invalid node " << node);
+	AssertMsg(parent == kNullNode || IsValid(parent), "Invalid parent node " << parent);
+
+	if (m_nodes[node].Parent == parent) {
+		return;
+	}
+	for (uint ancestor = parent; ancestor != kNullNode; ancestor = m_nodes[ancestor].Parent) {
+		AssertMsg(ancestor != node, "Node " << node << " can't be moved under its own descendant " << parent);
+	}
+
+	UnlinkNode(node);
+	LinkNode(node, parent);
+
+	// The world transform of the node changes, and that drags the subtree along with it
+	MarkDirty(m_nodes[node].Slot);
+	m_layoutDirty = true;
+}
+
+void TransformHierarchy::SetLocalTransform(uint node, DirectX::CXMMATRIX localTransform) {
+	AssertMsg(IsValid(node), "Invalid node " << node);
+
+	uint slot = m_nodes[node].Slot;
+	m_localTransforms[slot] = localTransform;
+	MarkDirty(slot);
+}
+
+void TransformHierarchy::LinkNode(uint node, uint parent) {
+	uint *first = parent == kNullNode ? &m_firstRoot : &m_nodes[parent].FirstChild;
+	uint *last = parent == kNullNode ? &m_lastRoot : &m_nodes[parent].LastChild;
+
+	Node &linkedNode = m_nodes[node];
+	linkedNode.Parent = parent;
+	linkedNode.PrevSibling = *last;
+	linkedNode.NextSibling = kNullNode;
+
+	if (*last != kNullNode) {
+		m_nodes[*last].NextSibling = node;
+	} else {
+		*first = node;
+	}
+	*last = node;
+}
+
+void TransformHierarchy::UnlinkNode(uint node) {
+	Node &unlinkedNode = m_nodes[node];
+	uint *first = unlinkedNode.Parent == kNullNode ? &m_firstRoot : &m_nodes[unlinkedNode.Parent].FirstChild;
+	uint *last = unlinkedNode.Parent == kNullNode ? &m_lastRoot : &m_nodes[unlinkedNode.Parent].LastChild;
+
+	if (unlinkedNode.PrevSibling != kNullNode) {
+		m_nodes[unlinkedNode.PrevSibling].NextSibling = unlinkedNode.NextSibling;
+	} else {
+		*first = unlinkedNode.NextSibling;
+	}
+	if (unlinkedNode.NextSibling != kNullNode) {
+		m_nodes[unlinkedNode.NextSibling].PrevSibling = unlinkedNode.PrevSibling;
+	} else {
+		*last = unlinkedNode.PrevSibling;
+	}
+
+	unlinkedNode.Parent = kNullNode;
+	unlinkedNode.PrevSibling = kNullNode;
+	unlinkedNode.NextSibling = kNullNode;
+}
+
+void TransformHierarchy::SortSlots() {
+	// Breadth first order. Each level is appended while the one above it is walked
+	m_layoutOrder.clear();
+	m_levelStarts.clear();
+	for (uint root = m_firstRoot; root != kNullNode; root = m_nodes[root].NextSibling) {
+		m_layoutOrder.push_back(root);
+	}
+
+	uint levelBegin = 0u;
+	for (uint depth = 0u; levelBegin < m_layoutOrder.size(); ++depth) {
+		uint levelEnd = static_cast<uint>(m_layoutOrder.size());
+		m_levelStarts.push_back(levelBegin);
+
+		for (uint i = levelBegin; i < levelEnd; ++i) {
+			Node &node = m_nodes[m_layoutOrder[i]];
+			node.Depth = depth;
+			for (uint child = node.FirstChild; child != kNullNode; child = m_nodes[child].NextSibling) {
+				m_layoutOrder.push_back(child);
+			}
+		}
+
+		levelBegin = levelEnd;
+	}
+	m_levelStarts.push_back(static_cast<uint>(m_layoutOrder.size()));
+
+	uint count = static_cast<uint>(m_layoutOrder.size());
+	AssertMsg(count == m_nodeCount, "The hierarchy has " << m_nodeCount << " nodes, but only " << count << " can be reached from the roots");
+
+	// Gather every array into the new order
+	m_scratchMatrices.resize(count);
+	for (uint i = 0; i < count; ++i) {
+		m_scratchMatrices[i] = m_localTransforms[m_nodes[m_layoutOrder[i]].Slot];
+	}
+	m_localTransforms.swap(m_scratchMatrices);
+
+	m_scratchMatrices.resize(count);
+	for (uint i = 0; i < count; ++i) {
+		m_scratchMatrices[i] = m_worldTransforms[m_nodes[m_layoutOrder[i]].Slot];
+	}
+	m_worldTransforms.swap(m_scratchMatrices);
+
+	m_scratchFlags.resize(count);
+	for (uint i = 0; i < count; ++i) {
+		m_scratchFlags[i] = m_dirty[m_nodes[m_layoutOrder[i]].Slot];
+	}
+	m_dirty.swap(m_scratchFlags);
+
+	for (uint i = 0; i < count; ++i) {
+		m_nodes[m_layoutOrder[i]].Slot = i;
+	}
+
+	m_parentSlots.resize(count);
+	for (uint i = 0; i < count; ++i) {
+		uint parent = m_nodes[m_layoutOrder[i]].Parent;
+		m_parentSlots[i] = parent == kNullNode ? kNullNode : m_nodes[parent].Slot;
+	}
+
+	m_slotNodes.assign(m_layoutOrder.begin(), m_layoutOrder.end());
+	m_changed.assign(count, 0u);
+
+	m_layoutDirty = false;
+}
+
+uint TransformHierarchy::Update(Common::ThreadPool *threadPool) {
+	// Forget the changes of the last update
+	for (auto iter = m_changedNodes.begin(); iter != m_changedNodes.end(); ++iter) {
+		if (IsValid(*iter)) {
+			m_changed[m_nodes[*iter].Slot] = 0u;
+		}
+	}
+	m_changedNodes.clear();
+
+	if (m_layoutDirty) {
+		SortSlots();
+	}
+	if (m_dirtyNodes.empty()) {
+		return 0u;
+	}
+
+	// Find the levels with dirty nodes. The levels in between are only visited if the level above them changed
+	uint levelCount = GetLevelCount();
+	m_dirtyLevels.assign(levelCount, 0u);
+	uint firstLevel = levelCount;
+	for (auto iter = m_dirtyNodes.begin(); iter != m_dirtyNodes.end(); ++iter) {
+		if (IsValid(*iter)) {
+			uint depth = m_nodes[*iter].Depth;
+			m_dirtyLevels[depth] = 1u;
+			firstLevel = std::min(firstLevel, depth);
+		}
+	}
+	m_dirtyNodes.clear();
+
+	uint changedAbove = 0u;
+	for (uint level = firstLevel; level < levelCount; ++level) {
+		if (changedAbove == 0u && m_dirtyLevels[level] == 0u) {
+			continue;
+		}
+
+		uint begin = m_levelStarts[level];
+		uint end = m_levelStarts[level + 1u];
+
+		uint changed;
+		if (threadPool != nullptr && end - begin > kChunkSize) {
+			std::atomic<uint> changedCount(0u);
+			threadPool->ParallelFor(end - begin, kChunkSize, [this, begin, &changedCount](uint chunkBegin, uint chunkEnd) {
+				changedCount.fetch_add(UpdateRange(begin + chunkBegin, begin + chunkEnd), std::memory_order_relaxed);
+			});
+			changed = changedCount.load(std::memory_order_relaxed);
+		} else {
+			changed = UpdateRange(begin, end);
+		}
+
+		if (changed != 0u) {
+			for (uint slot = begin; slot < end; ++slot) {
+				if (m_changed[slot] != 0u) {
+					m_changedNodes.push_back(m_slotNodes[slot]);
+				}
+			}
+		}
+		changedAbove = changed;
+	}
+
+	return static_cast<uint>(m_changedNodes.size());
+}
+
+uint TransformHierarchy::UpdateRange(uint begin, uint end) {
+	uint changed = 0u;
+	for (uint slot = begin; slot < end; ++slot) {
+		uint parentSlot = m_parentSlots[slot];
+
+		if (parentSlot == kNullNode) {
+			if (m_dirty[slot] != 0u) {
+				m_worldTransforms[slot] = m_localTransforms[slot];
+				m_dirty[slot] = 0u;
+				m_changed[slot] = 1u;
+				++changed;
+			}
+		} else if (m_dirty[slot] != 0u || m_changed[parentSlot] != 0u) {
+			m_worldTransforms[slot] = DirectX::XMMatrixMultiply(m_localTransforms[slot], m_worldTransforms[parentSlot]);
+			m_dirty[slot] = 0u;
+			m_changed[slot] = 1u;
+			++changed;
+		}
+	}
+
+	return changed;
+}
+
+} // End of namespace Scene
@@ -0,0 +1,174 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#pragma once
+
+#include "common/typedefs.h"
+#include "common/allocator_16_byte_aligned.h"
+
+#include <DirectXMath.h>
+
+#include <vector>
+
+
+namespace Common {
+class ThreadPool;
+}
+
+namespace Scene {
+
+/**
+ * A parent / child hierarchy of transforms. IE. the transform part of a scene graph
+ *
+ * Nodes are referred to by handles, which stay the same for the life of the node. The transforms
+ * themselves are stored SoA (local transforms, world transforms, parent indices and dirty flags
+ * each in their own array), in breadth first order. So every level of the hierarchy is a
+ * contiguous range, every parent comes before its children, and siblings are next to each other.
+ *
+ * Update() walks the levels from the top down. The world transforms of a level only depend on
+ * the level above, so each level is split into chunks that are updated in parallel. A node is
+ * only recomputed if its local transform changed, or its parent's world transform did, so the
+ * cost of Update() scales with the size of the dirty subtrees rather than the size of the hierarchy.
+ * Levels with nothing to do are skipped without touching their nodes.
+ *
+ * After Update(), GetChangedNodes() lists every node whose world transform was recomputed. Use it
+ * to update whatever is derived from the world transforms. IE. culling bounds and GPU transform buffers
+ *
+ * World transforms follow the DirectXMath row vector convention: world = local * parentWorld
+ *
+ * Creating, destroying and re-parenting nodes is cheap, but the next Update() has to re-sort the
+ * arrays, which touches every node. Do structural changes in batches, rather than every frame
+ */
+class TransformHierarchy {
+public:
+	/**
+	 * @param initialCapacity    The number of nodes to reserve memory for
+	 */
+	TransformHierarchy(uint initialCapacity = 0u);
+
+	static const uint kNullNode = 0xFFFFFFFF;
+	/** The number of nodes in each chunk of a parallel update */
+	static const uint kChunkSize = 1024u;
+
+private:
+	typedef std::vector<DirectX::XMMATRIX, Common::Allocator16ByteAligned<DirectX::XMMATRIX> > MatrixList;
+
+	struct Node {
+		uint Parent;
+		uint FirstChild;
+		uint LastChild;
+		uint PrevSibling;
+		uint NextSibling;
+		/** The index of the node in the SoA arrays, or kNullNode if the node is free */
+		uint Slot;
+		/** The level the node is on. Only valid after Update() */
+		uint Depth;
+	};
+
+	/** Indexed by handle */
+	std::vector<Node> m_nodes;
+	std::vector<uint> m_freeNodes;
+	uint m_firstRoot;
+	uint m_lastRoot;
+	uint m_nodeCount;
+
+	// Indexed by slot
+	MatrixList m_localTransforms;
+	MatrixList m_worldTransforms;
+	/** The slot of the parent of each slot, or kNullNode for roots */
+	std::vector<uint> m_parentSlots;
+	/** The node in each slot, or kNullNode if the node was destroyed since the last Update() */
+	std::vector<uint> m_slotNodes;
+	/** Set if the local transform changed since the last Update() */
+	std::vector<uint8> m_dirty;
+	/** Set if the world transform was recomputed by the last Update() */
+	std::vector<uint8> m_changed;
+
+	/** The first slot of each level, followed by the end of the last level. Only valid after Update() */
+	std::vector<uint> m_levelStarts;
+	/** Set if nodes were created, destroyed or re-parented since the last Update() */
+	bool m_layoutDirty;
+
+	/** The nodes that were marked dirty since the last Update(). Can contain nodes that have since been destroyed */
+	std::vector<uint> m_dirtyNodes;
+	std::vector<uint> m_changedNodes;
+
+	// Scratch space for sorting the arrays
+	std::vector<uint> m_layoutOrder;
+	MatrixList m_scratchMatrices;
+	std::vector<uint8> m_scratchFlags;
+	std::vector<uint8> m_dirtyLevels;
+
+public:
+	/**
+	 * Creates a node. Its world transform will be computed by the next Update()
+	 *
+	 * @param parent            The parent of the node, or kNullNode to create a root
+	 * @param localTransform    The transform of the node, relative to its parent
+	 * @return                  The handle of the new node. Handles of destroyed nodes are re-used
+	 */
+	uint CreateNode(uint parent, DirectX::CXMMATRIX localTransform);
+	/** Destroys a node, and all of its descendants */
+	void DestroyNode(uint node);
+	/**
+	 * Moves a node, along with all of its descendants, under a new parent. The local transform is
+	 * kept as it is, so the world transforms of the subtree will change
+	 *
+	 * @param node      The node to move
+	 * @param parent    The new parent, or kNullNode to make the node a root. Can't be a descendant of 'node'
+	 */
+	void SetParent(uint node, uint parent);
+
+	void SetLocalTransform(uint node, DirectX::CXMMATRIX localTransform);
+	inline DirectX::XMMATRIX GetLocalTransform(uint node) const { return m_localTransforms[m_nodes[node].Slot]; }
+	/** Returns the world transform of a node, as of the last Update() */
+	inline DirectX::XMMATRIX GetWorldTransform(uint node) const { return m_worldTransforms[m_nodes[node].Slot]; }
+
+	inline uint GetParent(uint node) const { return m_nodes[node].Parent; }
+	inline uint GetFirstChild(uint node) const { return m_nodes[node].FirstChild; }
+	inline uint GetNextSibling(uint node) const { return m_nodes[node].NextSibling; }
+	/** Returns the level of a node. Roots are on level 0. Only valid after Update() */
+	inline uint GetDepth(uint node) const { return m_nodes[node].Depth; }
+	inline bool IsValid(uint node) const { return node < m_nodes.size() && m_nodes[node].Slot != kNullNode; }
+
+	/** Returns the number of live nodes */
+	inline uint GetSize() const { return m_nodeCount; }
+	/** Returns the number of levels, as of the last Update() */
+	inline uint GetLevelCount() const { return m_levelStarts.empty() ? 0u : static_cast<uint>(m_levelStarts.size()) - 1u; }
+
+	/**
+	 * Recomputes the world transforms of the dirty nodes and their descendants
+	 *
+	 * @param threadPool    [Optional] If not nullptr, big levels are split into chunks that are updated in parallel
+	 * @return              The number of world transforms that were recomputed
+	 */
+	uint Update(Common::ThreadPool *threadPool = nullptr);
+	/** Returns the nodes whose world transform was recomputed by the last Update(), parents before children */
+	inline const std::vector<uint> &GetChangedNodes() const { return m_changedNodes; }
+
+private:
+	inline void MarkDirty(uint slot) {
+		if (m_dirty[slot] == 0u) {
+			m_dirty[slot] = 1u;
+			m_dirtyNodes.push_back(m_slotNodes[slot]);
+		}
+	}
+
+	/** Adds a node to the end of the child list of 'parent', or the root list if 'parent' is kNullNode */
+	void LinkNode(uint node, uint parent);
+	/** Removes a node from the child list of its parent */
+	void UnlinkNode(uint node);
+	/** Sorts the SoA arrays breadth first, and drops the slots of destroyed nodes */
+	void SortSlots();
+	/**
+	 * Updates the slots in [begin, end). They have to be on the same level
+	 *
+	 * @return    The number of world transforms that were recomputed
+	 */
+	uint UpdateRange(uint begin, uint end);
+};
+
+} // End of namespace Scene
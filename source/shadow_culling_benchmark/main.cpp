@@ -0,0 +1,439 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "common/typedefs.h"
+#include "common/thread_pool.h"
+
+#include "engine/timer.h"
+
+#include "scene/frustum_culler.h"
+#include "scene/shadow_views.h"
+
+#include <DirectXMath.h>
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+
+static const uint kMaxCascades = 8u;
+static const float kCameraNearClip = 0.1f;
+static const float kCameraFarClip = 1500.0f;
+static const float kShadowDistance = 500.0f;
+static const uint kShadowMapSize = 2048u;
+
+struct BenchmarkSettings {
+	BenchmarkSettings()
+		: Boxes(20000u),
+		  Frames(50u),
+		  Cascades(4u),
+		  SpotLights(8u),
+		  Samples(256u),
+		  Threads(0u) {
+	}
+
+	uint Boxes;
+	uint Frames;
+	uint Cascades;
+	uint SpotLights;
+	/** The number of receiver points checked against brute force, per shadow view per frame */
+	uint Samples;
+	/** The number of worker threads for the parallel runs. 0 means one less than the number of hardware threads */
+	uint Threads;
+};
+
+struct Box {
+	DirectX::XMFLOAT3 Min;
+	DirectX::XMFLOAT3 Max;
+};
+
+/** Everything that changes from frame to frame */
+struct Frame {
+	DirectX::XMFLOAT4X4 CameraViewProj;
+	float Splits[kMaxCascades + 1u];
+	DirectX::XMFLOAT3 LightDirection;
+	/** The cascades, followed by the spot lights */
+	std::vector<Scene::ShadowView> Views;
+	/** The light each view is seen from. (direction toward the light, 0) or (position, 1) */
+	std::vector<DirectX::XMFLOAT4> Lights;
+};
+
+void PrintUsage() {
+	printf("Usage: ShadowCullingBenchmark [-boxes <count>] [-frames <count>] [-cascades <count>] [-spots <count>] [-samples <count>] [-threads <count>]\n\n"
+	       "    -boxes       The number of boxes, on top of the ground. Defaults to 20000\n"
+	       "    -frames      The number of frames to average over. The camera and the lights move every frame. Defaults to 50\n"
+	       "    -cascades    The number of cascades of the directional light. Defaults to 4\n"
+	       "    -spots       The number of shadowed spot lights. Defaults to 8\n"
+	       "    -samples     The number of receiver points checked against brute force, per shadow view and frame. Defaults to 256\n"
+	       "    -threads     The number of worker threads for the parallel runs. Defaults to one less than the number of hardware threads\n");
+}
+
+/**
+ * A model-sized box standing somewhere on a 2000 x 2000 unit ground. A few of them are huge, like
+ * the buildings of a real scene
+ */
+Box RandomBox(std::mt19937 &generator) {
+	std::uniform_real_distribution<float> position(-1000.0f, 1000.0f);
+	std::uniform_real_distribution<float> height(0.0f, 60.0f);
+	std::uniform_real_distribution<float> size(0.5f, 10.0f);
+	std::uniform_int_distribution<uint> huge(0u, 999u);
+
+	float scale = huge(generator) == 0u ? 10.0f : 1.0f;
+	DirectX::XMFLOAT3 center(position(generator), height(generator), position(generator));
+	DirectX::XMFLOAT3 extent(size(generator) * scale, size(generator) * scale, size(generator) * scale);
+
+	Box box;
+	box.Min = DirectX::XMFLOAT3(center.x - extent.x, std::max(center.y - extent.y, 0.0f), center.z - extent.z);
+	box.Max = DirectX::XMFLOAT3(center.x + extent.x, center.y + extent.y, center.z + extent.z);
+	return box;
+}
+
+/** A random point inside a frustum, given its 8 corners in the order of Scene::CalculateFrustumCorners() */
+DirectX::XMVECTOR RandomPointInFrustum(const DirectX::XMFLOAT3 *corners, std::mt19937 &generator) {
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	float weights[3] = {unit(generator), unit(generator), unit(generator)};
+
+	DirectX::XMVECTOR point = DirectX::XMVectorZero();
+	for (uint i = 0; i < 8u; ++i) {
+		float weight = 1.0f;
+		for (uint axis = 0; axis < 3u; ++axis) {
+			weight *= (i & (1u << axis)) != 0u ? weights[axis] : 1.0f - weights[axis];
+		}
+		point = DirectX::XMVectorMultiplyAdd(DirectX::XMLoadFloat3(&corners[i]), DirectX::XMVectorReplicate(weight), point);
+	}
+
+	return point;
+}
+
+/** Returns true if the segment [origin, origin + maxT * direction] touches the box. Double precision slab test */
+bool SegmentHitsBox(DirectX::FXMVECTOR origin, DirectX::FXMVECTOR direction, double maxT, const Box &box) {
+	double start[3] = {DirectX::XMVectorGetX(origin), DirectX::XMVectorGetY(origin), DirectX::XMVectorGetZ(origin)};
+	double delta[3] = {DirectX::XMVectorGetX(direction), DirectX::XMVectorGetY(direction), DirectX::XMVectorGetZ(direction)};
+	double boxMin[3] = {box.Min.x, box.Min.y, box.Min.z};
+	double boxMax[3] = {box.Max.x, box.Max.y, box.Max.z};
+
+	double tMin = 0.0;
+	double tMax = maxT;
+	for (uint axis = 0; axis < 3u; ++axis) {
+		if (std::fabs(delta[axis]) < 1.0e-12) {
+			if (start[axis] < boxMin[axis] || start[axis] > boxMax[axis]) {
+				return false;
+			}
+			continue;
+		}
+
+		double t0 = (boxMin[axis] - start[axis]) / delta[axis];
+		double t1 = (boxMax[axis] - start[axis]) / delta[axis];
+		tMin = std::max(tMin, std::min(t0, t1));
+		tMax = std::min(tMax, std::max(t0, t1));
+	}
+
+	return tMin <= tMax;
+}
+
+/** Transforms a point to the clip space of a view, and returns (x / w, y / w, z / w) */
+DirectX::XMFLOAT3 ProjectPoint(DirectX::FXMVECTOR point, const DirectX::XMFLOAT4X4 &viewProj) {
+	DirectX::XMFLOAT3 projected;
+	DirectX::XMStoreFloat3(&projected, DirectX::XMVector3TransformCoord(point, DirectX::XMLoadFloat4x4(&viewProj)));
+	return projected;
+}
+
+/** The camera and the lights of a frame. The camera wanders around the middle of the scene and turns */
+Frame CreateFrame(uint frame, const BenchmarkSettings &settings, const DirectX::XMFLOAT3 &sceneMin, const DirectX::XMFLOAT3 &sceneMax) {
+	Frame newFrame;
+
+	float angle = frame * 0.05f;
+	DirectX::XMVECTOR eye = DirectX::XMVectorSet(200.0f * std::sin(frame * 0.13f), 30.0f, 200.0f * std::cos(frame * 0.07f), 1.0f);
+	DirectX::XMVECTOR forward = DirectX::XMVector3Normalize(DirectX::XMVectorSet(std::sin(angle), -0.15f, std::cos(angle), 0.0f));
+	DirectX::XMMATRIX view = DirectX::XMMatrixLookToLH(eye, forward, DirectX::XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f));
+	// Reversed depth, like the demos
+	DirectX::XMMATRIX proj = DirectX::XMMatrixPerspectiveFovLH(0.25f * DirectX::XM_PI, 16.0f / 9.0f, kCameraFarClip, kCameraNearClip);
+	DirectX::XMStoreFloat4x4(&newFrame.CameraViewProj, view * proj);
+
+	// The sun moves around the sky, between low and high
+	float elevation = 0.35f + 0.5f * static_cast<float>(frame % 7u) / 7.0f;
+	float azimuth = frame * 0.3f;
+	newFrame.LightDirection = DirectX::XMFLOAT3(std::cos(elevation) * std::sin(azimuth), -std::sin(elevation), std::cos(elevation) * std::cos(azimuth));
+	DirectX::XMFLOAT4 towardSun(-newFrame.LightDirection.x, -newFrame.LightDirection.y, -newFrame.LightDirection.z, 0.0f);
+
+	Scene::CalculateCascadeSplits(kCameraNearClip, kShadowDistance, settings.Cascades, 0.8f, newFrame.Splits);
+	for (uint i = 0; i < settings.Cascades; ++i) {
+		DirectX::XMFLOAT3 corners[8];
+		Scene::CalculateFrustumCorners(view, proj, newFrame.Splits[i], newFrame.Splits[i + 1u], corners);
+		newFrame.Views.push_back(Scene::CalculateCascadeView(corners, newFrame.LightDirection, sceneMin, sceneMax, kShadowMapSize));
+		newFrame.Lights.push_back(towardSun);
+	}
+
+	// Spot lights hanging above the ground in front of the camera, pointing down at it
+	std::mt19937 generator(frame);
+	std::uniform_real_distribution<float> offset(-150.0f, 150.0f);
+	std::uniform_real_distribution<float> distance(20.0f, 300.0f);
+	std::uniform_real_distribution<float> height(15.0f, 80.0f);
+	std::uniform_real_distribution<float> coneAngle(0.3f, 0.9f);
+	std::uniform_real_distribution<float> range(100.0f, 300.0f);
+
+	DirectX::XMFLOAT3 cameraCorners[8];
+	Scene::CalculateFrustumCorners(view, proj, kCameraNearClip, kCameraFarClip, cameraCorners);
+	for (uint i = 0; i < settings.SpotLights; ++i) {
+		DirectX::XMFLOAT3 position;
+		DirectX::XMStoreFloat3(&position, DirectX::XMVectorAdd(eye, DirectX::XMVectorScale(forward, distance(generator))));
+		position.x += offset(generator);
+		position.y = height(generator);
+		position.z += offset(generator);
+
+		DirectX::XMFLOAT3 direction;
+		DirectX::XMStoreFloat3(&direction, DirectX::XMVector3Normalize(DirectX::XMVectorSet(offset(generator), -150.0f, offset(generator), 0.0f)));
+
+		newFrame.Views.push_back(Scene::CalculateSpotShadowView(cameraCorners, position, direction, coneAngle(generator), range(generator), 0.5f));
+		newFrame.Lights.push_back(DirectX::XMFLOAT4(position.x, position.y, position.z, 1.0f));
+	}
+
+	return newFrame;
+}
+
+/**
+ * Checks the caster list of a view against brute force. Picks random receiver points that the view
+ * has to shadow, and traces a segment from each of them to the light. Every box the segment touches
+ * has to be in the caster list, and in front of the shadow map's near plane
+ *
+ * @param receiverCorners    The corners of the volume to pick the points from
+ * @param cameraFrustum      The points also have to be inside this
+ * @param out_checked        Incremented by the number of points checked
+ * @return                   The number of boxes missing from the list, or clipped by the near plane, plus the
+ *                           points that fall outside of the shadow map
+ */
+uint CountDroppedShadows(const Scene::ShadowView &view, const DirectX::XMFLOAT4 &light, const DirectX::XMFLOAT3 *receiverCorners, const Scene::Frustum &cameraFrustum,
+                         const std::vector<Box> &boxes, const std::vector<uint> &casters, uint samples, std::mt19937 &generator, uint *out_checked) {
+	std::vector<bool> isCaster(boxes.size(), false);
+	for (auto iter = casters.begin(); iter != casters.end(); ++iter) {
+		isCaster[*iter] = true;
+	}
+
+	uint mismatches = 0u;
+	uint checked = 0u;
+	for (uint attempt = 0; attempt < samples * 8u && checked < samples; ++attempt) {
+		DirectX::XMVECTOR point = RandomPointInFrustum(receiverCorners, generator);
+
+		bool inCamera = true;
+		for (uint p = 0; p < 6u; ++p) {
+			inCamera = inCamera && DirectX::XMVectorGetX(DirectX::XMVector4Dot(DirectX::XMLoadFloat4(&cameraFrustum.Planes[p]), DirectX::XMVectorSetW(point, 1.0f))) >= 0.0f;
+		}
+		if (!inCamera) {
+			continue;
+		}
+		++checked;
+
+		// The point has to land inside the shadow map
+		DirectX::XMFLOAT3 projected = ProjectPoint(point, view.ViewProj);
+		if (std::fabs(projected.x) > 1.0001f || std::fabs(projected.y) > 1.0001f || projected.z < -0.0001f || projected.z > 1.0001f) {
+			if (mismatches < 10u) {
+				printf("Receiver (%f, %f, %f) is outside of the shadow map: (%f, %f, %f)\n", DirectX::XMVectorGetX(point), DirectX::XMVectorGetY(point), DirectX::XMVectorGetZ(point), projected.x, projected.y, projected.z);
+			}
+			++mismatches;
+			continue;
+		}
+
+		// A directional light is infinitely far away. The scene is a lot smaller than 1e5
+		DirectX::XMVECTOR direction;
+		double maxT;
+		if (light.w == 0.0f) {
+			direction = DirectX::XMVectorSet(light.x, light.y, light.z, 0.0f);
+			maxT = 1.0e5;
+		} else {
+			direction = DirectX::XMVectorSubtract(DirectX::XMVectorSet(light.x, light.y, light.z, 1.0f), point);
+			maxT = 1.0;
+		}
+
+		for (uint i = 0; i < boxes.size(); ++i) {
+			if (!SegmentHitsBox(point, direction, maxT, boxes[i])) {
+				continue;
+			}
+
+			if (!isCaster[i]) {
+				if (mismatches < 10u) {
+					printf("Box %u shadows (%f, %f, %f), but isn't in the caster list\n", i, DirectX::XMVectorGetX(point), DirectX::XMVectorGetY(point), DirectX::XMVectorGetZ(point));
+				}
+				++mismatches;
+				continue;
+			}
+
+			// Casters can be outside of the shadow map sideways, but not in front of its near plane
+			float nearestZ = FLT_MAX;
+			for (uint corner = 0; corner < 8u; ++corner) {
+				const Box &box = boxes[i];
+				DirectX::XMVECTOR cornerPoint = DirectX::XMVectorSet((corner & 1u) != 0u ? box.Max.x : box.Min.x, (corner & 2u) != 0u ? box.Max.y : box.Min.y, (corner & 4u) != 0u ? box.Max.z : box.Min.z, 1.0f);
+				nearestZ = std::min(nearestZ, ProjectPoint(cornerPoint, view.ViewProj).z);
+			}
+			if (light.w == 0.0f && nearestZ < -0.0001f) {
+				if (mismatches < 10u) {
+					printf("Box %u is clipped by the near plane of the shadow map\n", i);
+				}
+				++mismatches;
+			}
+		}
+	}
+
+	*out_checked += checked;
+	return mismatches;
+}
+
+/**
+ * A headless benchmark and self-check of the shadow caster culling in Scene::ExtrudeTowardLight() and
+ * friends. Compares the casters found by the extruded receiver volumes with the casters found by the
+ * lights' own frustums, and checks random receiver points against a brute force shadow ray. Exits
+ * with 1 if a caster that throws a visible shadow is culled
+ */
+int main(int argc, char *argv[]) {
+	BenchmarkSettings settings;
+
+	for (int i = 1; i < argc; ++i) {
+		if (i + 1 >= argc) {
+			PrintUsage();
+			return 1;
+		}
+
+		uint value = static_cast<uint>(atoi(argv[i + 1]));
+		if (strcmp(argv[i], "-boxes") == 0) {
+			settings.Boxes = value;
+		} else if (strcmp(argv[i], "-frames") == 0) {
+			settings.Frames = value;
+		} else if (strcmp(argv[i], "-cascades") == 0) {
+			settings.Cascades = value;
+		} else if (strcmp(argv[i], "-spots") == 0) {
+			settings.SpotLights = value;
+		} else if (strcmp(argv[i], "-samples") == 0) {
+			settings.Samples = value;
+		} else if (strcmp(argv[i], "-threads") == 0) {
+			settings.Threads = value;
+		} else {
+			PrintUsage();
+			return 1;
+		}
+		++i;
+	}
+
+	if (settings.Boxes == 0u || settings.Frames == 0u || settings.Cascades == 0u || settings.Cascades > kMaxCascades) {
+		printf("Settings out of range. Boxes and frames must be at least 1, and cascades in [1, %u]\n\n", kMaxCascades);
+		PrintUsage();
+		return 1;
+	}
+
+	// The boxes, and the ground they stand on
+	std::mt19937 generator(1234u);
+	std::vector<Box> boxes(settings.Boxes + 1u);
+	boxes[0].Min = DirectX::XMFLOAT3(-1000.0f, -1.0f, -1000.0f);
+	boxes[0].Max = DirectX::XMFLOAT3(1000.0f, 0.0f, 1000.0f);
+	for (uint i = 1; i < boxes.size(); ++i) {
+		boxes[i] = RandomBox(generator);
+	}
+
+	Scene::FrustumCuller culler(static_cast<uint>(boxes.size()));
+	DirectX::XMFLOAT3 sceneMin(FLT_MAX, FLT_MAX, FLT_MAX);
+	DirectX::XMFLOAT3 sceneMax(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	for (auto iter = boxes.begin(); iter != boxes.end(); ++iter) {
+		culler.Add(iter->Min, iter->Max);
+		DirectX::XMStoreFloat3(&sceneMin, DirectX::XMVectorMin(DirectX::XMLoadFloat3(&sceneMin), DirectX::XMLoadFloat3(&iter->Min)));
+		DirectX::XMStoreFloat3(&sceneMax, DirectX::XMVectorMax(DirectX::XMLoadFloat3(&sceneMax), DirectX::XMLoadFloat3(&iter->Max)));
+	}
+
+	std::vector<Frame> frames;
+	for (uint frame = 0; frame < settings.Frames; ++frame) {
+		frames.push_back(CreateFrame(frame, settings, sceneMin, sceneMax));
+	}
+	uint viewCount = settings.Cascades + settings.SpotLights;
+
+	Common::ThreadPool threadPool(settings.Threads);
+	Engine::Timer timer;
+	std::vector<uint> casters;
+
+	// The lights' own frustums. What the casters would be without the extrusion
+	std::vector<uint64> frustumCasterTotals(viewCount, 0u);
+	timer.Start();
+	for (auto iter = frames.begin(); iter != frames.end(); ++iter) {
+		for (uint view = 0; view < viewCount; ++view) {
+			frustumCasterTotals[view] += culler.Cull(Scene::ExtractFrustum(DirectX::XMLoadFloat4x4(&iter->Views[view].ViewProj)), &casters, &threadPool);
+		}
+	}
+	double frustumMilliseconds = timer.GetTime() / settings.Frames;
+
+	// The extruded receiver volumes
+	std::vector<uint64> volumeCasterTotals(viewCount, 0u);
+	timer.Start();
+	for (auto iter = frames.begin(); iter != frames.end(); ++iter) {
+		for (uint view = 0; view < viewCount; ++view) {
+			volumeCasterTotals[view] += culler.Cull(iter->Views[view].CasterVolume, &casters, &threadPool);
+		}
+	}
+	double volumeMilliseconds = timer.GetTime() / settings.Frames;
+
+	// Check every frame against brute force, and against the scalar path
+	uint mismatches = 0u;
+	uint pathMismatches = 0u;
+	uint checkedPoints = 0u;
+	std::vector<uint> scalarCasters;
+	for (uint frame = 0; frame < settings.Frames; ++frame) {
+		const Frame &currentFrame = frames[frame];
+		DirectX::XMMATRIX cameraViewProj = DirectX::XMLoadFloat4x4(&currentFrame.CameraViewProj);
+		Scene::Frustum cameraFrustum = Scene::ExtractFrustum(cameraViewProj);
+
+		for (uint view = 0; view < viewCount; ++view) {
+			const Scene::ShadowView &shadowView = currentFrame.Views[view];
+			culler.SetPath(Scene::FrustumCuller::GetFastestSupportedPath());
+			culler.Cull(shadowView.CasterVolume, &casters, &threadPool);
+			culler.SetPath(Scene::CullingPath::SCALAR);
+			culler.Cull(shadowView.CasterVolume, &scalarCasters);
+			pathMismatches += casters != scalarCasters ? 1u : 0u;
+
+			// Cascades pick their receivers from their slice. Spot lights pick them from their own frustum, and keep the ones the camera sees
+			DirectX::XMFLOAT3 receiverCorners[8];
+			if (view < settings.Cascades) {
+				DirectX::XMMATRIX inverseViewProj = DirectX::XMMatrixInverse(nullptr, cameraViewProj);
+				for (uint corner = 0; corner < 8u; ++corner) {
+					// Reversed depth, so map the view depth of the split to the clip space depth
+					float depth = (corner & 4u) != 0u ? currentFrame.Splits[view + 1u] : currentFrame.Splits[view];
+					float clipZ = (kCameraNearClip / depth - kCameraNearClip / kCameraFarClip) / (1.0f - kCameraNearClip / kCameraFarClip);
+					DirectX::XMVECTOR clip = DirectX::XMVectorSet((corner & 1u) != 0u ? 1.0f : -1.0f, (corner & 2u) != 0u ? 1.0f : -1.0f, clipZ, 1.0f);
+					DirectX::XMStoreFloat3(&receiverCorners[corner], DirectX::XMVector3TransformCoord(clip, inverseViewProj));
+				}
+			} else {
+				DirectX::XMMATRIX inverseLightViewProj = DirectX::XMMatrixInverse(nullptr, DirectX::XMLoadFloat4x4(&shadowView.ViewProj));
+				for (uint corner = 0; corner < 8u; ++corner) {
+					DirectX::XMVECTOR clip = DirectX::XMVectorSet((corner & 1u) != 0u ? 1.0f : -1.0f, (corner & 2u) != 0u ? 1.0f : -1.0f, (corner & 4u) != 0u ? 1.0f : 0.0f, 1.0f);
+					DirectX::XMStoreFloat3(&receiverCorners[corner], DirectX::XMVector3TransformCoord(clip, inverseLightViewProj));
+				}
+			}
+
+			std::mt19937 sampleGenerator(frame * 64u + view);
+			mismatches += CountDroppedShadows(shadowView, currentFrame.Lights[view], receiverCorners, cameraFrustum, boxes, casters, settings.Samples, sampleGenerator, &checkedPoints);
+		}
+	}
+
+	printf("Scene: %u boxes on a 2000 x 2000 ground, %u cascades up to %.0f units, %u spot lights. Average over %u frames, %u worker threads\n\n",
+	       settings.Boxes, settings.Cascades, kShadowDistance, settings.SpotLights, settings.Frames, threadPool.GetThreadCount());
+	printf("                       Light frustum    Extruded receivers\n");
+	printf("  Casters per view\n");
+	for (uint view = 0; view < viewCount; ++view) {
+		if (view < settings.Cascades) {
+			printf("    Cascade %u       %16.1f %21.1f\n", view, static_cast<double>(frustumCasterTotals[view]) / settings.Frames, static_cast<double>(volumeCasterTotals[view]) / settings.Frames);
+		} else {
+			printf("    Spot light %-4u %16.1f %21.1f\n", view - settings.Cascades, static_cast<double>(frustumCasterTotals[view]) / settings.Frames, static_cast<double>(volumeCasterTotals[view]) / settings.Frames);
+		}
+	}
+	printf("  Cull time (ms)    %16.3f %21.3f\n", frustumMilliseconds, volumeMilliseconds);
+	printf("\n  Checked %u receiver points against brute force shadow rays. %u of %u caster lists differed from the scalar path\n", checkedPoints, pathMismatches, settings.Frames * viewCount);
+
+	if (mismatches != 0u || pathMismatches != 0u) {
+		printf("\nFAILED: %u dropped shadows\n", mismatches);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,336 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "common/typedefs.h"
+
+#include "engine/timer.h"
+
+#include "graphics/sort_key.h"
+
+#include "pbr_demo/command_sort_key_generators.h"
+
+#include "scene/render_proxy_store.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+
+typedef PBRDemo::GBufferSortKeyGenerator Generator;
+
+// A layout with odd widths, so fields straddle the 32 bit halves of the key
+typedef Graphics::SortKeyFirstField<1> OddField0;
+typedef Graphics::SortKeyNextField<OddField0, 7> OddField1;
+typedef Graphics::SortKeyNextField<OddField1, 13> OddField2;
+typedef Graphics::SortKeyNextField<OddField2, 31> OddField3;
+typedef Graphics::SortKeyNextField<OddField3, 12> OddField4;
+
+static_assert(OddField4::kShift == 0u, "The odd layout should use all 64 bits");
+
+// Fields too wide for a float to hold their max value, so EncodeUnorm() can't scale them in float
+typedef Graphics::SortKeyFirstField<24> WideDepth24;
+typedef Graphics::SortKeyNextField<WideDepth24, 40> WideDepth40;
+typedef Graphics::SortKeyFirstField<64> WideDepth64;
+
+/** The number of fields of the GBuffer layout */
+static const uint kGBufferFieldCount = 7u;
+
+struct BenchmarkSettings {
+	BenchmarkSettings()
+		: Keys(1000000u) {
+	}
+
+	uint Keys;
+};
+
+/** The fields of a GBuffer key, most significant first */
+struct GBufferFields {
+	uint64 Values[kGBufferFieldCount];
+};
+
+void PrintUsage() {
+	printf("Usage: SortKeyBenchmark [-keys <count>]\n\n"
+	       "    Packs random values into the sort key layouts, and checks that they unpack to the same values,\n"
+	       "    that the fields don't overlap, and that the keys order the same way as their fields.\n");
+}
+
+/** Unpacks a GBuffer key */
+GBufferFields DecodeGBufferKey(uint64 key) {
+	GBufferFields fields;
+	fields.Values[0] = Generator::Layer::Decode(key);
+	fields.Values[1] = Generator::MaterialShader::Decode(key);
+	fields.Values[2] = Generator::Material::Decode(key);
+	fields.Values[3] = Generator::VertexBuffer::Decode(key);
+	fields.Values[4] = Generator::IndexBuffer::Decode(key);
+	fields.Values[5] = Generator::Subset::Decode(key);
+	fields.Values[6] = Generator::Depth::Decode(key);
+
+	return fields;
+}
+
+/** Unpacks a depth first GBuffer key, into the same order as DecodeGBufferKey() */
+GBufferFields DecodeDepthFirstGBufferKey(uint64 key) {
+	GBufferFields fields;
+	fields.Values[0] = Generator::DepthFirst::Layer::Decode(key);
+	fields.Values[1] = Generator::DepthFirst::MaterialShader::Decode(key);
+	fields.Values[2] = Generator::DepthFirst::Material::Decode(key);
+	fields.Values[3] = Generator::DepthFirst::VertexBuffer::Decode(key);
+	fields.Values[4] = Generator::DepthFirst::IndexBuffer::Decode(key);
+	fields.Values[5] = Generator::DepthFirst::Subset::Decode(key);
+	fields.Values[6] = Generator::DepthFirst::Depth::Decode(key);
+
+	return fields;
+}
+
+/** Returns true if the masks of the fields are disjoint and cover all 64 bits */
+bool CheckMasks(const uint64 *masks, uint count) {
+	uint64 covered = 0ull;
+	for (uint i = 0; i < count; ++i) {
+		if ((covered & masks[i]) != 0ull) {
+			return false;
+		}
+		covered |= masks[i];
+	}
+
+	return covered == ~0ull;
+}
+
+/** Returns true if a quantized value is the nearest step to a value in [0, 1], give or take float rounding */
+template <typename Field>
+bool IsNearestUnormStep(uint64 quantized, float value) {
+	double clamped = std::min(std::max(static_cast<double>(value), 0.0), 1.0);
+	return std::abs(static_cast<double>(quantized) - clamped * static_cast<double>(Field::kMaxValue)) <= 0.5 + 1.0e-4;
+}
+
+/**
+ * Checks that EncodeUnorm() clamps, hits both ends of the field, and never reorders depths
+ *
+ * @param sortedDepths    Depths in ascending order. Some should be outside [0, 1]
+ * @return                The number of failed checks
+ */
+template <typename Field>
+uint CheckUnormQuantization(const std::vector<float> &sortedDepths) {
+	uint failures = 0u;
+	failures += Field::EncodeUnorm(0.0f) == 0ull && Field::EncodeUnorm(-1.0f) == 0ull ? 0u : 1u;
+	failures += Field::EncodeUnorm(1.0f) == Field::kMask && Field::EncodeUnorm(2.0f) == Field::kMask ? 0u : 1u;
+	// The largest float below 1.0 must land on one of the top steps, not wrap around
+	failures += Field::Decode(Field::EncodeUnorm(0.99999994f)) >= Field::kMaxValue - (Field::kMaxValue >> 23u) - 1ull ? 0u : 1u;
+	for (uint i = 1; i < sortedDepths.size(); ++i) {
+		failures += Field::EncodeUnorm(sortedDepths[i - 1u]) <= Field::EncodeUnorm(sortedDepths[i]) ? 0u : 1u;
+	}
+
+	return failures;
+}
+
+/**
+ * A headless check of the sort key packing. Exits with 1 if a field doesn't round-trip, if the fields of
+ * a layout overlap, if two keys order differently than their fields, if the GBuffer layers sort out of order
+ * or the depth first layer isn't front to back, or if depth quantization isn't monotonic or wraps around.
+ * Quantization is checked for the 10 bit depth field, and for fields of 24 to 64 bits
+ */
+int main(int argc, char *argv[]) {
+	BenchmarkSettings settings;
+
+	for (int i = 1; i < argc; ++i) {
+		if (i + 1 >= argc) {
+			PrintUsage();
+			return 1;
+		}
+
+		uint value = static_cast<uint>(atoi(argv[i + 1]));
+		if (strcmp(argv[i], "-keys") == 0) {
+			settings.Keys = value;
+		} else {
+			PrintUsage();
+			return 1;
+		}
+		++i;
+	}
+
+	if (settings.Keys < 2u) {
+		printf("Settings out of range. Keys must be at least 2\n\n");
+		PrintUsage();
+		return 1;
+	}
+
+	uint failures = 0u;
+
+	// The fields of each layout must tile the key
+	uint64 gbufferMasks[kGBufferFieldCount] = {Generator::Layer::kMask, Generator::MaterialShader::kMask, Generator::Material::kMask, Generator::VertexBuffer::kMask,
+	                                           Generator::IndexBuffer::kMask, Generator::Subset::kMask, Generator::Depth::kMask};
+	uint64 depthFirstMasks[kGBufferFieldCount] = {Generator::DepthFirst::Layer::kMask, Generator::DepthFirst::Depth::kMask, Generator::DepthFirst::MaterialShader::kMask, Generator::DepthFirst::Material::kMask,
+	                                              Generator::DepthFirst::VertexBuffer::kMask, Generator::DepthFirst::IndexBuffer::kMask, Generator::DepthFirst::Subset::kMask};
+	uint64 oddMasks[5] = {OddField0::kMask, OddField1::kMask, OddField2::kMask, OddField3::kMask, OddField4::kMask};
+	bool masksTile = CheckMasks(gbufferMasks, kGBufferFieldCount) && CheckMasks(depthFirstMasks, kGBufferFieldCount) && CheckMasks(oddMasks, 5u);
+	failures += masksTile ? 0u : 1u;
+
+	std::mt19937_64 random(1337u);
+	std::uniform_real_distribution<float> depthDistribution(-0.1f, 1.1f);
+
+	// Round-trip random proxies through the GBuffer layout
+	std::vector<uint64> keys(settings.Keys);
+	std::vector<GBufferFields> fields(settings.Keys);
+	uint gbufferRoundTripFailures = 0u;
+	uint depthFirstRoundTripFailures = 0u;
+	for (uint i = 0; i < settings.Keys; ++i) {
+		Scene::RenderProxy proxy;
+		memset(&proxy, 0, sizeof(proxy));
+		GBufferFields &expected = fields[i];
+
+		expected.Values[0] = random() % 3u;
+		proxy.ShaderId = static_cast<uint32>(random() & Generator::MaterialShader::kMaxValue);
+		proxy.MaterialId = static_cast<uint32>(random() & Generator::Material::kMaxValue);
+		proxy.VertexBufferId = static_cast<uint32>(random() & Generator::VertexBuffer::kMaxValue);
+		proxy.IndexBufferId = static_cast<uint32>(random() & Generator::IndexBuffer::kMaxValue);
+		proxy.SubsetIndex = static_cast<uint32>(random() & Generator::Subset::kMaxValue);
+		float depth = depthDistribution(random);
+
+		expected.Values[1] = proxy.ShaderId;
+		expected.Values[2] = proxy.MaterialId;
+		expected.Values[3] = proxy.VertexBufferId;
+		expected.Values[4] = proxy.IndexBufferId;
+		expected.Values[5] = proxy.SubsetIndex;
+
+		keys[i] = Generator::GenerateKey(static_cast<PBRDemo::GBufferLayer>(expected.Values[0]), proxy, depth);
+		GBufferFields decoded = DecodeGBufferKey(keys[i]);
+
+		// Depth is quantized, so it only has to land on the nearest step
+		bool depthMatches = IsNearestUnormStep<Generator::Depth>(decoded.Values[6], depth);
+		expected.Values[6] = decoded.Values[6];
+		gbufferRoundTripFailures += depthMatches && memcmp(&decoded, &expected, sizeof(GBufferFields)) == 0 ? 0u : 1u;
+
+		// Both layouts quantize depth to 10 bits, so they must unpack to exactly the same fields
+		GBufferFields depthFirstDecoded = DecodeDepthFirstGBufferKey(Generator::GenerateDepthFirstKey(static_cast<PBRDemo::GBufferLayer>(expected.Values[0]), proxy, depth));
+		depthFirstRoundTripFailures += memcmp(&depthFirstDecoded, &expected, sizeof(GBufferFields)) == 0 ? 0u : 1u;
+	}
+	failures += gbufferRoundTripFailures + depthFirstRoundTripFailures;
+
+	// Neighbouring keys must order the same way as their fields, most significant first
+	uint orderFailures = 0u;
+	for (uint i = 1; i < settings.Keys; ++i) {
+		bool keyLess = keys[i - 1u] < keys[i];
+		bool fieldsLess = std::lexicographical_compare(fields[i - 1u].Values, fields[i - 1u].Values + kGBufferFieldCount, fields[i].Values, fields[i].Values + kGBufferFieldCount);
+		orderFailures += keyLess == fieldsLess ? 0u : 1u;
+	}
+	failures += orderFailures;
+
+	// Mix the layers like the demo does. Once sorted, the layers must come out in order, and the depth first
+	// OCCLUDERS layer must come out front to back, whatever the state of its draws. Each key is paired
+	// with its quantized depth, so the order is checked against the input rather than the key's own bits
+	std::vector<std::pair<uint64, uint64> > layeredKeys(settings.Keys);
+	for (uint i = 0; i < settings.Keys; ++i) {
+		Scene::RenderProxy proxy;
+		memset(&proxy, 0, sizeof(proxy));
+		proxy.ShaderId = static_cast<uint32>(fields[i].Values[1]);
+		proxy.MaterialId = static_cast<uint32>(fields[i].Values[2]);
+		proxy.VertexBufferId = static_cast<uint32>(fields[i].Values[3]);
+		proxy.IndexBufferId = static_cast<uint32>(fields[i].Values[4]);
+		proxy.SubsetIndex = static_cast<uint32>(fields[i].Values[5]);
+		float depth = depthDistribution(random);
+		layeredKeys[i].second = Generator::Depth::EncodeUnorm(depth);
+
+		switch (i % 4u) {
+		case 0u:
+			layeredKeys[i].first = Generator::GenerateKey(PBRDemo::GBufferLayer::INSTANCED_MODELS, proxy, depth);
+			break;
+		case 1u:
+			layeredKeys[i].first = Generator::GenerateDepthFirstKey(PBRDemo::GBufferLayer::OCCLUDERS, proxy, depth);
+			break;
+		default:
+			layeredKeys[i].first = Generator::GenerateKey(PBRDemo::GBufferLayer::MODELS, proxy, depth);
+			break;
+		}
+	}
+	std::sort(layeredKeys.begin(), layeredKeys.end());
+	uint layerOrderFailures = 0u;
+	for (uint i = 1; i < settings.Keys; ++i) {
+		uint64 previousLayer = Generator::Layer::Decode(layeredKeys[i - 1u].first);
+		uint64 layer = Generator::Layer::Decode(layeredKeys[i].first);
+		bool inOrder = previousLayer < layer ||
+		               (previousLayer == layer && (layer != static_cast<uint64>(PBRDemo::GBufferLayer::OCCLUDERS) || layeredKeys[i - 1u].second <= layeredKeys[i].second));
+		layerOrderFailures += inOrder ? 0u : 1u;
+	}
+	failures += layerOrderFailures;
+
+	// Round-trip the odd layout, with each field at its extremes as well as random values
+	uint oddRoundTripFailures = 0u;
+	for (uint i = 0; i < settings.Keys; ++i) {
+		uint64 values[5];
+		uint64 maxValues[5] = {OddField0::kMaxValue, OddField1::kMaxValue, OddField2::kMaxValue, OddField3::kMaxValue, OddField4::kMaxValue};
+		for (uint j = 0; j < 5u; ++j) {
+			uint pattern = (i + j) % 4u;
+			values[j] = pattern == 0u ? 0ull : (pattern == 1u ? maxValues[j] : random() & maxValues[j]);
+		}
+
+		uint64 key = OddField0::Encode(values[0]) | OddField1::Encode(values[1]) | OddField2::Encode(values[2]) | OddField3::Encode(values[3]) | OddField4::Encode(values[4]);
+		bool matches = OddField0::Decode(key) == values[0] && OddField1::Decode(key) == values[1] && OddField2::Decode(key) == values[2] &&
+		               OddField3::Decode(key) == values[3] && OddField4::Decode(key) == values[4];
+		oddRoundTripFailures += matches ? 0u : 1u;
+	}
+	failures += oddRoundTripFailures;
+
+	// Depth quantization must clamp, hit both ends of the field, and never reorder depths
+	std::vector<float> depths(settings.Keys);
+	for (uint i = 0; i < settings.Keys; ++i) {
+		depths[i] = depthDistribution(random);
+	}
+	std::sort(depths.begin(), depths.end());
+	uint unormFailures = CheckUnormQuantization<Generator::Depth>(depths);
+	uint wideUnormFailures = CheckUnormQuantization<WideDepth24>(depths) + CheckUnormQuantization<WideDepth40>(depths) + CheckUnormQuantization<WideDepth64>(depths) +
+	                         CheckUnormQuantization<OddField3>(depths);
+	failures += unormFailures + wideUnormFailures;
+
+	// Time building the keys of the proxies, and sorting them
+	std::vector<Scene::RenderProxy> proxies(std::min(settings.Keys, 65536u));
+	for (uint i = 0; i < proxies.size(); ++i) {
+		memset(&proxies[i], 0, sizeof(Scene::RenderProxy));
+		proxies[i].ShaderId = static_cast<uint32>(fields[i].Values[1]);
+		proxies[i].MaterialId = static_cast<uint32>(fields[i].Values[2]);
+		proxies[i].VertexBufferId = static_cast<uint32>(fields[i].Values[3]);
+		proxies[i].IndexBufferId = static_cast<uint32>(fields[i].Values[4]);
+		proxies[i].SubsetIndex = static_cast<uint32>(fields[i].Values[5]);
+	}
+	std::vector<uint64> sortedKeys(proxies.size());
+	uint passes = std::max(settings.Keys / static_cast<uint>(proxies.size()), 1u);
+
+	Engine::Timer timer;
+	timer.Start();
+	uint64 checksum = 0ull;
+	for (uint pass = 0; pass < passes; ++pass) {
+		for (uint i = 0; i < proxies.size(); ++i) {
+			sortedKeys[i] = Generator::GenerateKey(PBRDemo::GBufferLayer::MODELS, proxies[i], depths[i]);
+		}
+		checksum += sortedKeys[pass % sortedKeys.size()];
+	}
+	double generateMilliseconds = timer.GetTime();
+
+	timer.Start();
+	std::sort(sortedKeys.begin(), sortedKeys.end());
+	double sortMilliseconds = timer.GetTime();
+
+	printf("%u keys\n\n", settings.Keys);
+	printf("  Fields tile the key:             %s\n", masksTile ? "yes" : "NO");
+	printf("  GBuffer round-trip failures:     %u\n", gbufferRoundTripFailures);
+	printf("  Depth first round-trip failures: %u\n", depthFirstRoundTripFailures);
+	printf("  GBuffer ordering failures:       %u\n", orderFailures);
+	printf("  Layer order failures:            %u\n", layerOrderFailures);
+	printf("  Odd layout round-trip failures:  %u\n", oddRoundTripFailures);
+	printf("  Depth quantization failures:     %u\n", unormFailures);
+	printf("  Wide quantization failures:      %u\n", wideUnormFailures);
+	printf("\n  Generate: %.2f ns per key (checksum %llx)\n", generateMilliseconds * 1.0e6 / (static_cast<double>(passes) * proxies.size()), checksum);
+	printf("  Sort:     %.2f ns per key, %u keys\n", sortMilliseconds * 1.0e6 / proxies.size(), static_cast<uint>(proxies.size()));
+
+	if (failures > 0u) {
+		printf("\nFAILED: %u sort key checks failed\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,498 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "common/typedefs.h"
+
+#include "engine/timer.h"
+
+#include "graphics/command_bucket.h"
+#include "graphics/commands.h"
+#include "graphics/graphics_state.h"
+#include "graphics/recording_render_backend.h"
+#include "graphics/sort_key.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+
+// Most costly state first, the same as the GBuffer keys. The draw index keeps every key unique
+typedef Graphics::SortKeyFirstField<8> ShaderField;
+typedef Graphics::SortKeyNextField<ShaderField, 12> MaterialField;
+typedef Graphics::SortKeyNextField<MaterialField, 12> MeshField;
+typedef Graphics::SortKeyNextField<MeshField, 16> DrawField;
+
+static const uint kMaxDraws = 65536u;
+/** The number of textures that several materials share, so material changes only change some of the slots */
+static const uint kSharedTextureCount = 16u;
+static const uint kSamplerCount = 4u;
+/**
+ * The default budget for submitting a draw, in nanoseconds, on the fastest frame. It's several times what an
+ * optimized build needs, so only real regressions trip it. Pass -budget 0 to turn it off, IE. for Debug builds
+ */
+static const uint kDefaultSubmitBudget = 2000u;
+
+typedef Graphics::CommandBucket<uint64, kMaxDraws> Bucket;
+
+struct BenchmarkSettings {
+	BenchmarkSettings()
+		: Draws(20000u),
+		  Materials(64u),
+		  Shaders(8u),
+		  Meshes(200u),
+		  Frames(20u),
+		  SubmitBudget(kDefaultSubmitBudget) {
+	}
+
+	uint Draws;
+	uint Materials;
+	uint Shaders;
+	uint Meshes;
+	uint Frames;
+	/** In nanoseconds per draw. 0 turns the budget off */
+	uint SubmitBudget;
+};
+
+struct Material {
+	Graphics::MaterialShader *Shader;
+	Graphics::TextureSRVSlots TextureSRVs;
+	Graphics::TextureSamplerSlots TextureSamplers;
+};
+
+/** Everything a draw binds */
+struct DrawState {
+	Graphics::MaterialShader *Shader;
+	ID3D11Buffer *VertexBuffer;
+	ID3D11Buffer *IndexBuffer;
+	Graphics::TextureSRVSlots TextureSRVs;
+	Graphics::TextureSamplerSlots TextureSamplers;
+	Graphics::RasterizerState RasterizerState;
+	/** The key that groups the draws by state */
+	uint64 SortedKey;
+};
+
+struct OrderResult {
+	Graphics::RenderBackendStats Stats;
+	Graphics::RenderBackendStats ExpectedStats;
+	uint WrongDraws;
+	double SubmitMilliseconds;
+	double FastestSubmitMilliseconds;
+};
+
+/**
+ * A RecordingRenderBackend that also keeps track of what is bound. At every DrawIndexed() it checks
+ * the bindings against the state of the draw. The draws pass their index as the index start
+ */
+class StateCheckingBackend : public Graphics::RecordingRenderBackend {
+public:
+	StateCheckingBackend(const std::vector<DrawState> &draws)
+		: m_draws(draws),
+		  m_wrongDraws(0u) {
+		ResetBindings();
+	}
+
+private:
+	const std::vector<DrawState> &m_draws;
+
+	Graphics::MaterialShader *m_shader;
+	ID3D11Buffer *m_vertexBuffer;
+	ID3D11Buffer *m_indexBuffer;
+	ID3D11ShaderResourceView *m_textureSRVs[Graphics::kMaxTextureSlots];
+	ID3D11SamplerState *m_textureSamplers[Graphics::kMaxTextureSlots];
+	Graphics::RasterizerState m_rasterizerState;
+
+	uint m_wrongDraws;
+
+public:
+	/** Forgets the bindings, the same as a default constructed GraphicsState */
+	void ResetBindings() {
+		Graphics::GraphicsState state;
+		m_shader = state.MaterialShader;
+		m_vertexBuffer = state.VertexBuffers[0];
+		m_indexBuffer = state.IndexBuffer;
+		memset(m_textureSRVs, 0, sizeof(m_textureSRVs));
+		memset(m_textureSamplers, 0, sizeof(m_textureSamplers));
+		m_rasterizerState = state.RasterizerState;
+		m_wrongDraws = 0u;
+	}
+	/** Returns the number of draws that found something other than their own state bound */
+	inline uint GetWrongDrawCount() const { return m_wrongDraws; }
+
+	void SetMaterialShader(Graphics::MaterialShader *shader) {
+		RecordingRenderBackend::SetMaterialShader(shader);
+		m_shader = shader;
+	}
+	void SetVertexBuffers(uint startSlot, uint count, ID3D11Buffer * const *buffers, const uint *strides, const uint *offsets) {
+		RecordingRenderBackend::SetVertexBuffers(startSlot, count, buffers, strides, offsets);
+		m_vertexBuffer = buffers[0];
+	}
+	void SetIndexBuffer(ID3D11Buffer *buffer, DXGI_FORMAT format, uint offset) {
+		RecordingRenderBackend::SetIndexBuffer(buffer, format, offset);
+		m_indexBuffer = buffer;
+	}
+	void SetPSShaderResources(uint startSlot, uint count, ID3D11ShaderResourceView * const *srvs) {
+		RecordingRenderBackend::SetPSShaderResources(startSlot, count, srvs);
+		memcpy(&m_textureSRVs[startSlot], srvs, sizeof(ID3D11ShaderResourceView *) * count);
+	}
+	void SetPSSamplers(uint startSlot, uint count, ID3D11SamplerState * const *samplers) {
+		RecordingRenderBackend::SetPSSamplers(startSlot, count, samplers);
+		memcpy(&m_textureSamplers[startSlot], samplers, sizeof(ID3D11SamplerState *) * count);
+	}
+	void SetRasterizerState(Graphics::RasterizerState state) {
+		RecordingRenderBackend::SetRasterizerState(state);
+		m_rasterizerState = state;
+	}
+
+	void DrawIndexed(uint indexCount, uint indexStart, int vertexStart) {
+		RecordingRenderBackend::DrawIndexed(indexCount, indexStart, vertexStart);
+
+		const DrawState &draw = m_draws[indexStart];
+		bool correct = m_shader == draw.Shader && m_vertexBuffer == draw.VertexBuffer && m_indexBuffer == draw.IndexBuffer && m_rasterizerState == draw.RasterizerState;
+		for (uint slot = 0; slot < Graphics::kMaxTextureSlots; ++slot) {
+			if ((draw.TextureSRVs.Mask & (1u << slot)) != 0u && m_textureSRVs[slot] != draw.TextureSRVs.Slots[slot]) {
+				correct = false;
+			}
+			if ((draw.TextureSamplers.Mask & (1u << slot)) != 0u && m_textureSamplers[slot] != draw.TextureSamplers.Slots[slot]) {
+				correct = false;
+			}
+		}
+
+		m_wrongDraws += correct ? 0u : 1u;
+	}
+
+private:
+	// Not implemented
+	StateCheckingBackend(const StateCheckingBackend &other);
+};
+
+void PrintUsage() {
+	printf("Usage: StateChangeBenchmark [-draws <count>] [-materials <count>] [-shaders <count>] [-meshes <count>] [-frames <count>] [-budget <ns>]\n\n"
+	       "    Submits draws with random materials, meshes and rasterizer states to a RecordingRenderBackend, once sorted\n"
+	       "    by state and once in submission order, and counts the state changes DrawCommandBase makes per draw.\n"
+	       "    Fails if the fastest frame of either order takes longer than -budget nanoseconds per draw to submit.\n");
+}
+
+/** Returns the number of runs of contiguous set bits in a slot mask. IE. the number of calls it takes to bind the slots */
+uint CountSlotRuns(uint32 mask) {
+	uint runs = 0u;
+	bool inRun = false;
+	for (uint slot = 0; slot < 32u; ++slot) {
+		bool set = (mask & (1u << slot)) != 0u;
+		runs += set && !inRun ? 1u : 0u;
+		inRun = set;
+	}
+
+	return runs;
+}
+
+/**
+ * Counts the binds a perfect state filter makes for the draws, in the given order. Works slot by slot, without
+ * the masks of ResourceSlots. A slot is bound if it was never bound, or if it holds a different resource.
+ * Each run of contiguous slots that need binding is one call
+ *
+ * @param draws        The draws
+ * @param order        The order the draws are executed in
+ * @param out_stats    Will be filled with the expected bind counts
+ */
+void CountExpectedBinds(const std::vector<DrawState> &draws, const std::vector<uint> &order, Graphics::RenderBackendStats *out_stats) {
+	Graphics::GraphicsState initial;
+	Graphics::MaterialShader *shader = initial.MaterialShader;
+	ID3D11Buffer *vertexBuffer = initial.VertexBuffers[0];
+	ID3D11Buffer *indexBuffer = initial.IndexBuffer;
+	Graphics::RasterizerState rasterizerState = initial.RasterizerState;
+	ID3D11ShaderResourceView *srvs[Graphics::kMaxTextureSlots];
+	ID3D11SamplerState *samplers[Graphics::kMaxTextureSlots];
+	bool srvBound[Graphics::kMaxTextureSlots];
+	bool samplerBound[Graphics::kMaxTextureSlots];
+	for (uint slot = 0; slot < Graphics::kMaxTextureSlots; ++slot) {
+		srvs[slot] = nullptr;
+		samplers[slot] = nullptr;
+		srvBound[slot] = false;
+		samplerBound[slot] = false;
+	}
+
+	out_stats->Reset();
+	for (auto iter = order.begin(); iter != order.end(); ++iter) {
+		const DrawState &draw = draws[*iter];
+
+		if (draw.Shader != shader) {
+			++out_stats->ShaderBinds;
+			shader = draw.Shader;
+		}
+		if (draw.VertexBuffer != vertexBuffer) {
+			++out_stats->VertexBufferBinds;
+			vertexBuffer = draw.VertexBuffer;
+		}
+		if (draw.IndexBuffer != indexBuffer) {
+			++out_stats->IndexBufferBinds;
+			indexBuffer = draw.IndexBuffer;
+		}
+		if (draw.RasterizerState != rasterizerState) {
+			++out_stats->RasterizerStateChanges;
+			rasterizerState = draw.RasterizerState;
+		}
+
+		uint32 changedSRVs = 0u;
+		uint32 changedSamplers = 0u;
+		for (uint slot = 0; slot < Graphics::kMaxTextureSlots; ++slot) {
+			if ((draw.TextureSRVs.Mask & (1u << slot)) != 0u && (!srvBound[slot] || srvs[slot] != draw.TextureSRVs.Slots[slot])) {
+				changedSRVs |= 1u << slot;
+				srvs[slot] = draw.TextureSRVs.Slots[slot];
+				srvBound[slot] = true;
+			}
+			if ((draw.TextureSamplers.Mask & (1u << slot)) != 0u && (!samplerBound[slot] || samplers[slot] != draw.TextureSamplers.Slots[slot])) {
+				changedSamplers |= 1u << slot;
+				samplers[slot] = draw.TextureSamplers.Slots[slot];
+				samplerBound[slot] = true;
+			}
+		}
+		out_stats->ShaderResourceBinds += CountSlotRuns(changedSRVs);
+		out_stats->SamplerBinds += CountSlotRuns(changedSamplers);
+
+		++out_stats->DrawCalls;
+	}
+}
+
+/**
+ * Submits the draws through a CommandBucket every frame, and checks the binds of the last frame
+ *
+ * @param backend    The backend to submit to
+ * @param bucket     The bucket to submit through
+ * @param draws      The draws
+ * @param sorted     If true, the draws are keyed by their state. Otherwise they are keyed by their index, so they execute in the order they were generated
+ * @param frames     The number of frames to submit
+ * @return           The bind counts, the expected bind counts, and the average submit time
+ */
+OrderResult RunOrder(StateCheckingBackend *backend, Bucket *bucket, const std::vector<DrawState> &draws, bool sorted, uint frames) {
+	std::vector<std::pair<uint64, uint> > keys(draws.size());
+	for (uint i = 0; i < draws.size(); ++i) {
+		keys[i] = std::make_pair(sorted ? draws[i].SortedKey : DrawField::Encode(i), i);
+	}
+	std::sort(keys.begin(), keys.end());
+	std::vector<uint> order(draws.size());
+	for (uint i = 0; i < keys.size(); ++i) {
+		order[i] = keys[i].second;
+	}
+
+	OrderResult result;
+	CountExpectedBinds(draws, order, &result.ExpectedStats);
+	result.SubmitMilliseconds = 0.0;
+	result.FastestSubmitMilliseconds = 0.0;
+	result.WrongDraws = 0u;
+
+	Engine::Timer timer;
+	for (uint frame = 0; frame < frames; ++frame) {
+		for (uint i = 0; i < draws.size(); ++i) {
+			const DrawState &draw = draws[i];
+
+			auto command = bucket->AddCommand<Graphics::Commands::DrawIndexed>(sorted ? draw.SortedKey : DrawField::Encode(i));
+			command->SetMaterialShader(draw.Shader);
+			command->SetVertexBuffer(draw.VertexBuffer, 44u);
+			command->SetIndexBuffer(draw.IndexBuffer, DXGI_FORMAT_R32_UINT);
+			command->SetTextureSRVs(draw.TextureSRVs);
+			command->SetTextureSamplers(draw.TextureSamplers);
+			command->SetRasterizerState(draw.RasterizerState);
+			command->SetIndexCount(3u);
+			command->SetIndexStart(i);
+		}
+
+		// Every frame starts from nothing bound, so each frame makes the same binds
+		Graphics::GraphicsState state;
+		backend->ResetStats();
+		backend->ResetBindings();
+
+		timer.Start();
+		bucket->Submit(backend, &state);
+		double milliseconds = timer.GetTime();
+		result.SubmitMilliseconds += milliseconds;
+		result.FastestSubmitMilliseconds = frame == 0u ? milliseconds : std::min(result.FastestSubmitMilliseconds, milliseconds);
+
+		bucket->Clear();
+		result.WrongDraws = std::max(result.WrongDraws, backend->GetWrongDrawCount());
+	}
+
+	result.Stats = backend->GetStats();
+	result.SubmitMilliseconds /= frames;
+	return result;
+}
+
+/** Returns true if the binds that were made are exactly the expected ones */
+bool MatchesExpected(const OrderResult &result) {
+	const Graphics::RenderBackendStats &stats = result.Stats;
+	const Graphics::RenderBackendStats &expected = result.ExpectedStats;
+
+	return stats.ShaderBinds == expected.ShaderBinds &&
+	       stats.VertexBufferBinds == expected.VertexBufferBinds &&
+	       stats.IndexBufferBinds == expected.IndexBufferBinds &&
+	       stats.ShaderResourceBinds == expected.ShaderResourceBinds &&
+	       stats.SamplerBinds == expected.SamplerBinds &&
+	       stats.RasterizerStateChanges == expected.RasterizerStateChanges &&
+	       stats.BlendStateChanges == 0u &&
+	       stats.DepthStencilStateChanges == 0u &&
+	       stats.DrawCalls == expected.DrawCalls;
+}
+
+void PrintRow(const char *label, const Graphics::RenderBackendStats &stats, double submitMilliseconds) {
+	double draws = std::max(stats.DrawCalls, 1u);
+	printf("  %-14s %8u %8u %8u %8u %8u %8u %12.2f", label, stats.ShaderBinds, stats.VertexBufferBinds, stats.IndexBufferBinds,
+	       stats.ShaderResourceBinds, stats.SamplerBinds, stats.RasterizerStateChanges, stats.TotalBinds() / draws);
+	if (submitMilliseconds > 0.0) {
+		printf(" %14.1f", submitMilliseconds * 1.0e6 / draws);
+	}
+	printf("\n");
+}
+
+/**
+ * A headless benchmark of the per-draw state filtering of DrawCommandBase. At every draw, the bindings
+ * the backend received are checked against the state of the draw, and the number of binds of each type
+ * is checked against a slot by slot count of the binds a perfect filter would make. Exits with 1 if a
+ * draw found the wrong state bound, if the filter made more or fewer binds than expected, or if submitting
+ * took longer than the budget
+ */
+int main(int argc, char *argv[]) {
+	BenchmarkSettings settings;
+
+	for (int i = 1; i < argc; ++i) {
+		if (i + 1 >= argc) {
+			PrintUsage();
+			return 1;
+		}
+
+		uint value = static_cast<uint>(atoi(argv[i + 1]));
+		if (strcmp(argv[i], "-draws") == 0) {
+			settings.Draws = value;
+		} else if (strcmp(argv[i], "-materials") == 0) {
+			settings.Materials = value;
+		} else if (strcmp(argv[i], "-shaders") == 0) {
+			settings.Shaders = value;
+		} else if (strcmp(argv[i], "-meshes") == 0) {
+			settings.Meshes = value;
+		} else if (strcmp(argv[i], "-frames") == 0) {
+			settings.Frames = value;
+		} else if (strcmp(argv[i], "-budget") == 0) {
+			settings.SubmitBudget = value;
+		} else {
+			PrintUsage();
+			return 1;
+		}
+		++i;
+	}
+
+	// The sort key fields limit the shaders, materials and meshes, and the bucket the draws
+	if (settings.Draws == 0u || settings.Draws > kMaxDraws || settings.Materials == 0u || settings.Materials > 4096u ||
+	    settings.Shaders == 0u || settings.Shaders > 256u || settings.Meshes == 0u || settings.Meshes > 4096u || settings.Frames == 0u) {
+		printf("Settings out of range. Draws must be in [1, %u], materials in [1, 4096], shaders in [1, 256], meshes in [1, 4096], and frames at least 1\n\n", kMaxDraws);
+		PrintUsage();
+		return 1;
+	}
+
+	std::mt19937 random(1337u);
+
+	// Nothing is ever dereferenced by the backend, so fake handles are enough
+	std::vector<Material> materials(settings.Materials);
+	std::uniform_int_distribution<uint> textureCountDistribution(1u, 6u);
+	std::uniform_int_distribution<uint> sharedTextureDistribution(0u, kSharedTextureCount - 1u);
+	std::uniform_int_distribution<uint> samplerDistribution(0u, kSamplerCount - 1u);
+	std::uniform_int_distribution<uint32> sparseMaskDistribution(1u, (1u << Graphics::kMaxTextureSlots) - 1u);
+	for (uint i = 0; i < settings.Materials; ++i) {
+		Material &material = materials[i];
+		material.Shader = reinterpret_cast<Graphics::MaterialShader *>(static_cast<uintptr_t>(16u + (i % settings.Shaders) * 16u));
+
+		// Most materials fill the low slots, like the demos do. The rest use a random set of slots
+		uint32 slots = (random() % 4u) != 0u ? (1u << textureCountDistribution(random)) - 1u : sparseMaskDistribution(random);
+		for (uint slot = 0; slot < Graphics::kMaxTextureSlots; ++slot) {
+			if ((slots & (1u << slot)) == 0u) {
+				continue;
+			}
+
+			// Slot 0 is one of a few shared textures, IE. a detail map. The others are the material's own
+			uintptr_t texture = slot == 0u ? 0x10000u + sharedTextureDistribution(random) * 16u : 0x100000u + (i * Graphics::kMaxTextureSlots + slot) * 16u;
+			material.TextureSRVs.Set(reinterpret_cast<ID3D11ShaderResourceView *>(texture), slot);
+			if (slot < 2u) {
+				material.TextureSamplers.Set(reinterpret_cast<ID3D11SamplerState *>(static_cast<uintptr_t>(0x1000u + samplerDistribution(random) * 16u)), slot);
+			}
+		}
+	}
+
+	std::uniform_int_distribution<uint> materialDistribution(0u, settings.Materials - 1u);
+	std::uniform_int_distribution<uint> meshDistribution(0u, settings.Meshes - 1u);
+	std::vector<DrawState> draws(settings.Draws);
+	for (uint i = 0; i < settings.Draws; ++i) {
+		DrawState &draw = draws[i];
+		uint materialIndex = materialDistribution(random);
+		uint mesh = meshDistribution(random);
+		const Material &material = materials[materialIndex];
+
+		draw.Shader = material.Shader;
+		draw.VertexBuffer = reinterpret_cast<ID3D11Buffer *>(static_cast<uintptr_t>(0x1000000u + mesh * 32u));
+		draw.IndexBuffer = reinterpret_cast<ID3D11Buffer *>(static_cast<uintptr_t>(0x1000000u + mesh * 32u + 16u));
+		draw.TextureSRVs = material.TextureSRVs;
+		draw.TextureSamplers = material.TextureSamplers;
+		// Some meshes are double sided
+		draw.RasterizerState = mesh % 8u == 0u ? Graphics::RasterizerState::NO_CULL : Graphics::RasterizerState::CULL_BACKFACES;
+		draw.SortedKey = ShaderField::Encode(materialIndex % settings.Shaders) | MaterialField::Encode(materialIndex) | MeshField::Encode(mesh) | DrawField::Encode(i);
+	}
+
+	// Without filtering, every draw binds all of its state
+	Graphics::RenderBackendStats unfilteredStats;
+	for (auto iter = draws.begin(); iter != draws.end(); ++iter) {
+		++unfilteredStats.ShaderBinds;
+		++unfilteredStats.VertexBufferBinds;
+		++unfilteredStats.IndexBufferBinds;
+		unfilteredStats.ShaderResourceBinds += CountSlotRuns(iter->TextureSRVs.Mask);
+		unfilteredStats.SamplerBinds += CountSlotRuns(iter->TextureSamplers.Mask);
+		++unfilteredStats.RasterizerStateChanges;
+		++unfilteredStats.DrawCalls;
+	}
+
+	StateCheckingBackend backend(draws);
+	Bucket *bucket = new Bucket(64u * 1024u);
+
+	OrderResult sortedResult = RunOrder(&backend, bucket, draws, true, settings.Frames);
+	OrderResult unsortedResult = RunOrder(&backend, bucket, draws, false, settings.Frames);
+
+	delete bucket;
+
+	printf("Scene: %u draws, %u materials, %u shaders, %u meshes. Average over %u frames\n\n",
+	       settings.Draws, settings.Materials, settings.Shaders, settings.Meshes, settings.Frames);
+	printf("  %-14s %8s %8s %8s %8s %8s %8s %12s %14s\n", "", "Shader", "VB", "IB", "SRV", "Sampler", "Raster", "Binds/draw", "Submit (ns)");
+	PrintRow("Sorted", sortedResult.Stats, sortedResult.SubmitMilliseconds);
+	PrintRow("Unsorted", unsortedResult.Stats, unsortedResult.SubmitMilliseconds);
+	PrintRow("No filtering", unfilteredStats, 0.0);
+	printf("\n  Submit: Sorting and executing the commands on a RecordingRenderBackend, per draw\n"
+	       "  No filtering: The binds if every draw bound all of its state. Not submitted\n");
+
+	double fastestSubmit = std::max(sortedResult.FastestSubmitMilliseconds, unsortedResult.FastestSubmitMilliseconds) * 1.0e6 / settings.Draws;
+	if (settings.SubmitBudget > 0u) {
+		printf("\n  Slowest order's fastest frame: %.1f ns per draw. Budget: %u ns per draw\n", fastestSubmit, settings.SubmitBudget);
+	}
+
+	bool countsMatch = MatchesExpected(sortedResult) && MatchesExpected(unsortedResult);
+	uint wrongDraws = sortedResult.WrongDraws + unsortedResult.WrongDraws;
+	if (!countsMatch) {
+		printf("\n  Expected:\n");
+		PrintRow("Sorted", sortedResult.ExpectedStats, 0.0);
+		PrintRow("Unsorted", unsortedResult.ExpectedStats, 0.0);
+	}
+
+	if (wrongDraws > 0u) {
+		printf("\nFAILED: %u draws found the wrong state bound\n", wrongDraws);
+		return 1;
+	}
+	if (!countsMatch) {
+		printf("\nFAILED: The state filter made different binds than expected\n");
+		return 1;
+	}
+	if (settings.SubmitBudget > 0u && fastestSubmit > settings.SubmitBudget) {
+		printf("\nFAILED: Submitting took longer than the budget of %u ns per draw\n", settings.SubmitBudget);
+		return 1;
+	}
+
+	return 0;
+}
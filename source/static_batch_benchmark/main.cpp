@@ -0,0 +1,391 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "common/typedefs.h"
+
+#include "graphics/command_bucket.h"
+#include "graphics/commands.h"
+#include "graphics/recording_render_backend.h"
+#include "graphics/sort_key.h"
+
+#include "scene/materials.h"
+#include "scene/model.h"
+#include "scene/static_batcher.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+
+// The same layout as PBRDemo::GBufferSortKeyGenerator, without the layer
+typedef Graphics::SortKeyFirstField<8> ShaderField;
+typedef Graphics::SortKeyNextField<ShaderField, 12> MaterialField;
+typedef Graphics::SortKeyNextField<MaterialField, 10> VertexBufferField;
+typedef Graphics::SortKeyNextField<VertexBufferField, 10> IndexBufferField;
+typedef Graphics::SortKeyNextField<IndexBufferField, 10> SubsetField;
+typedef Graphics::SortKeyNextField<SubsetField, 10> DepthField;
+
+static const uint kMaxDraws = 16384u;
+// The size of the vertex in the demos. Position, normal, texCoord, tangent
+static const uint kVertexStride = 44u;
+
+struct BenchmarkSettings {
+	BenchmarkSettings()
+		: Meshes(200u),
+		  Placements(2000u),
+		  Materials(32u),
+		  Shaders(4u),
+		  Rebuilds(500u) {
+	}
+
+	uint Meshes;
+	uint Placements;
+	uint Materials;
+	uint Shaders;
+	uint Rebuilds;
+};
+
+struct Placement {
+	Scene::Model *Model;
+	float Depth;
+};
+
+struct SubmitResult {
+	Graphics::RenderBackendStats Stats;
+	uint Draws;
+};
+
+void PrintUsage() {
+	printf("Usage: StaticBatchBenchmark [-meshes <count>] [-placements <count>] [-materials <count>] [-shaders <count>] [-rebuilds <count>]\n\n"
+	       "    Builds a synthetic scene of small static props on a RecordingRenderBackend and submits it\n"
+	       "    through a CommandBucket with and without Scene::StaticBatcher, then reports the binds saved.\n"
+	       "    Then rebuilds the batches, swapping out a mesh each time, and checks the buffer ids are re-used.\n");
+}
+
+Scene::Model *CreateMesh(Graphics::RenderBackend *backend, std::mt19937 &random, const std::vector<Scene::Material *> &materials) {
+	std::uniform_int_distribution<uint> vertexCountDistribution(24u, 2048u);
+	std::uniform_int_distribution<uint> subsetCountDistribution(1u, 3u);
+	std::uniform_int_distribution<uint> materialDistribution(0u, static_cast<uint>(materials.size()) - 1u);
+
+	uint subsetCount = subsetCountDistribution(random);
+	Scene::ModelSubset *subsets = new Scene::ModelSubset[subsetCount];
+
+	// Every subset is a triangle list over its own range of vertices. The contents don't
+	// matter to the backend, but they are filled so the merged buffers can be verified
+	std::vector<byte> vertices;
+	std::vector<uint> indices;
+	uint vertexCount = 0u;
+	for (uint i = 0; i < subsetCount; ++i) {
+		uint subsetVertexCount = vertexCountDistribution(random);
+
+		subsets[i].VertexStart = vertexCount;
+		subsets[i].VertexCount = subsetVertexCount;
+		subsets[i].IndexStart = static_cast<uint>(indices.size());
+		subsets[i].IndexCount = (subsetVertexCount / 3u) * 3u;
+		subsets[i].AABB_min = DirectX::XMFLOAT3(-1.0f, -1.0f, -1.0f);
+		subsets[i].AABB_max = DirectX::XMFLOAT3(1.0f, 1.0f, 1.0f);
+		subsets[i].Material = materials[materialDistribution(random)];
+
+		for (uint j = 0; j < subsets[i].IndexCount; ++j) {
+			indices.push_back(j);
+		}
+		vertexCount += subsetVertexCount;
+	}
+
+	vertices.resize(vertexCount * kVertexStride);
+	for (uint i = 0; i < vertices.size(); ++i) {
+		vertices[i] = static_cast<byte>(random());
+	}
+
+	D3D11_BUFFER_DESC vbd;
+	vbd.Usage = D3D11_USAGE_IMMUTABLE;
+	vbd.ByteWidth = static_cast<uint>(vertices.size());
+	vbd.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+	vbd.CPUAccessFlags = 0;
+	vbd.MiscFlags = 0;
+	vbd.StructureByteStride = 0;
+
+	D3D11_BUFFER_DESC ibd = vbd;
+	ibd.ByteWidth = static_cast<uint>(indices.size() * sizeof(uint));
+	ibd.BindFlags = D3D11_BIND_INDEX_BUFFER;
+
+	// The buffers are created through the backend rather than Model::Create*Buffer(), since there is no device
+	Scene::Model *model = new Scene::Model();
+	model->VertexBuffer = backend->CreateBuffer(vbd, &vertices.front());
+	model->IndexBuffer = backend->CreateBuffer(ibd, &indices.front());
+	model->VertexBufferId = Common::DenseIdGenerator<Scene::VertexBufferIdTag>::Next();
+	model->IndexBufferId = Common::DenseIdGenerator<Scene::IndexBufferIdTag>::Next();
+	model->VertexStride = kVertexStride;
+	model->VertexCount = vertexCount;
+	model->IndexCount = static_cast<uint>(indices.size());
+	model->CreateSubsets(subsets, subsetCount);
+
+	return model;
+}
+
+void DestroyMesh(Graphics::RenderBackend *backend, Scene::Model *model) {
+	// The buffers belong to the backend, so they can't be released by the Model destructor. Nor can their ids
+	backend->ReleaseBuffer(model->VertexBuffer);
+	backend->ReleaseBuffer(model->IndexBuffer);
+	Common::DenseIdGenerator<Scene::VertexBufferIdTag>::Release(model->VertexBufferId);
+	Common::DenseIdGenerator<Scene::IndexBufferIdTag>::Release(model->IndexBufferId);
+	model->VertexBuffer = nullptr;
+	model->IndexBuffer = nullptr;
+
+	delete model;
+}
+
+SubmitResult SubmitScene(Graphics::RecordingRenderBackend *backend, Graphics::CommandBucket<uint64, kMaxDraws> *bucket, const std::vector<Placement> &placements, const Scene::StaticBatcher *batcher) {
+	SubmitResult result;
+	result.Draws = 0u;
+
+	for (auto iter = placements.begin(); iter != placements.end(); ++iter) {
+		Scene::Model *model = iter->Model;
+
+		ID3D11Buffer *vertexBuffer = model->VertexBuffer;
+		ID3D11Buffer *indexBuffer = model->IndexBuffer;
+		uint32 vertexBufferId = model->VertexBufferId;
+		uint32 indexBufferId = model->IndexBufferId;
+		uint baseVertex = 0u;
+		uint baseIndex = 0u;
+
+		const Scene::StaticBatchRange *batchRange = batcher != nullptr ? batcher->GetRange(model) : nullptr;
+		if (batchRange != nullptr) {
+			vertexBuffer = batchRange->VertexBuffer;
+			indexBuffer = batchRange->IndexBuffer;
+			vertexBufferId = batchRange->VertexBufferId;
+			indexBufferId = batchRange->IndexBufferId;
+			baseVertex = batchRange->BaseVertex;
+			baseIndex = batchRange->BaseIndex;
+		}
+
+		for (uint i = 0; i < model->SubsetCount; ++i) {
+			const Scene::ModelSubset &subset = model->Subsets[i];
+			const Scene::Material *material = subset.Material;
+
+			uint64 key = ShaderField::Encode(reinterpret_cast<uintptr_t>(material->Shader)) |
+			             MaterialField::Encode(material->Id) |
+			             VertexBufferField::Encode(vertexBufferId) |
+			             IndexBufferField::Encode(indexBufferId) |
+			             SubsetField::Encode(i) |
+			             DepthField::EncodeUnorm(iter->Depth);
+
+			auto command = bucket->AddCommand<Graphics::Commands::DrawIndexed>(key);
+			command->SetMaterialShader(material->Shader);
+			command->SetVertexBuffer(vertexBuffer, model->VertexStride);
+			command->SetIndexBuffer(indexBuffer, DXGI_FORMAT_R32_UINT);
+			for (uint k = 0; k < material->TextureSRVs.size(); ++k) {
+				command->SetTextureSRV(material->TextureSRVs[k], k);
+			}
+			command->SetIndexCount(subset.IndexCount);
+			command->SetIndexStart(subset.IndexStart + baseIndex);
+			command->SetVertexStart(subset.VertexStart + baseVertex);
+			++result.Draws;
+		}
+	}
+
+	Graphics::GraphicsState state;
+	backend->ResetStats();
+	bucket->Submit(backend, &state);
+	bucket->Clear();
+
+	result.Stats = backend->GetStats();
+	return result;
+}
+
+/** Checks that every batched model's vertices and indices were copied to its range of the merged buffers */
+bool VerifyBatches(Graphics::RecordingRenderBackend *backend, const std::vector<Scene::Model *> &meshes, const Scene::StaticBatcher &batcher) {
+	for (auto iter = meshes.begin(); iter != meshes.end(); ++iter) {
+		const Scene::Model *model = *iter;
+		const Scene::StaticBatchRange *range = batcher.GetRange(model);
+		if (range == nullptr) {
+			continue;
+		}
+
+		const byte *sourceVertices = backend->GetBufferData(model->VertexBuffer);
+		const byte *sourceIndices = backend->GetBufferData(model->IndexBuffer);
+		const byte *mergedVertices = backend->GetBufferData(range->VertexBuffer);
+		const byte *mergedIndices = backend->GetBufferData(range->IndexBuffer);
+
+		if (memcmp(sourceVertices, mergedVertices + range->BaseVertex * model->VertexStride, model->VertexCount * model->VertexStride) != 0 ||
+		    memcmp(sourceIndices, mergedIndices + range->BaseIndex * sizeof(uint), model->IndexCount * sizeof(uint)) != 0) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void PrintRow(const char *label, uint withoutBatching, uint withBatching) {
+	double reduction = withoutBatching > 0u ? 100.0 * (static_cast<double>(withoutBatching) - withBatching) / withoutBatching : 0.0;
+	printf("  %-22s %12u %12u %9.1f%%\n", label, withoutBatching, withBatching, reduction);
+}
+
+/**
+ * Returns the largest vertex or index buffer id in use by the meshes or the batches
+ */
+uint32 GetLargestBufferId(const std::vector<Scene::Model *> &meshes, const Scene::StaticBatcher &batcher) {
+	uint32 largestId = 0u;
+	for (auto iter = meshes.begin(); iter != meshes.end(); ++iter) {
+		largestId = std::max(largestId, std::max((*iter)->VertexBufferId, (*iter)->IndexBufferId));
+
+		const Scene::StaticBatchRange *range = batcher.GetRange(*iter);
+		if (range != nullptr) {
+			largestId = std::max(largestId, std::max(range->VertexBufferId, range->IndexBufferId));
+		}
+	}
+
+	return largestId;
+}
+
+/**
+ * A headless benchmark of Scene::StaticBatcher. Exits with 1 if the merged buffers don't hold the geometry
+ * of their models, or if rebuilding the batches pushes the buffer ids past the sort key fields
+ */
+int main(int argc, char *argv[]) {
+	BenchmarkSettings settings;
+
+	for (int i = 1; i < argc; ++i) {
+		if (i + 1 >= argc) {
+			PrintUsage();
+			return 1;
+		}
+
+		uint value = static_cast<uint>(atoi(argv[i + 1]));
+		if (strcmp(argv[i], "-meshes") == 0) {
+			settings.Meshes = value;
+		} else if (strcmp(argv[i], "-placements") == 0) {
+			settings.Placements = value;
+		} else if (strcmp(argv[i], "-materials") == 0) {
+			settings.Materials = value;
+		} else if (strcmp(argv[i], "-shaders") == 0) {
+			settings.Shaders = value;
+		} else if (strcmp(argv[i], "-rebuilds") == 0) {
+			settings.Rebuilds = value;
+		} else {
+			PrintUsage();
+			return 1;
+		}
+		++i;
+	}
+
+	// Every placement has at most 3 subsets. The sort key fields limit the rest
+	if (settings.Meshes == 0u || settings.Meshes > 900u || settings.Placements * 3u > kMaxDraws ||
+	    settings.Materials == 0u || settings.Materials > 4096u || settings.Shaders == 0u || settings.Shaders > 255u) {
+		printf("Settings out of range. Meshes must be in [1, 900], placements in [0, %u], materials in [1, 4096], and shaders in [1, 255]\n\n", kMaxDraws / 3u);
+		PrintUsage();
+		return 1;
+	}
+
+	Graphics::RecordingRenderBackend backend;
+	std::mt19937 random(1337u);
+
+	// The shaders and textures are never dereferenced by the recording backend, so fake handles are enough
+	std::vector<ID3D11ShaderResourceView *> noTextures;
+	std::vector<ID3D11SamplerState *> noSamplers;
+	std::vector<Scene::Material *> materials;
+	for (uint i = 0; i < settings.Materials; ++i) {
+		Graphics::MaterialShader *shader = reinterpret_cast<Graphics::MaterialShader *>(static_cast<uintptr_t>(1u + i % settings.Shaders));
+		std::vector<ID3D11ShaderResourceView *> textures(1u, reinterpret_cast<ID3D11ShaderResourceView *>(static_cast<uintptr_t>(0x1000u + i * 16u)));
+
+		Scene::Material *material = new Scene::Material(shader, textures, noSamplers);
+		material->Id = i;
+		materials.push_back(material);
+	}
+
+	std::vector<Scene::Model *> meshes;
+	for (uint i = 0; i < settings.Meshes; ++i) {
+		meshes.push_back(CreateMesh(&backend, random, materials));
+	}
+
+	std::uniform_int_distribution<uint> meshDistribution(0u, settings.Meshes - 1u);
+	std::uniform_real_distribution<float> depthDistribution(0.0f, 1.0f);
+	std::vector<Placement> placements;
+	for (uint i = 0; i < settings.Placements; ++i) {
+		Placement placement = {meshes[meshDistribution(random)], depthDistribution(random)};
+		placements.push_back(placement);
+	}
+
+	Graphics::CommandBucket<uint64, kMaxDraws> *bucket = new Graphics::CommandBucket<uint64, kMaxDraws>(64u * 1024u);
+
+	SubmitResult unbatched = SubmitScene(&backend, bucket, placements, nullptr);
+
+	Scene::StaticBatcher batcher(&backend);
+	for (auto iter = placements.begin(); iter != placements.end(); ++iter) {
+		batcher.AddModel(iter->Model);
+	}
+	backend.ResetStats();
+	batcher.Build();
+	uint bufferCopies = backend.GetStats().BufferCopies;
+
+	SubmitResult batched = SubmitScene(&backend, bucket, placements, &batcher);
+
+	printf("Scene: %u meshes, %u placements, %u materials, %u shaders, %u draws\n", settings.Meshes, settings.Placements, settings.Materials, settings.Shaders, unbatched.Draws);
+	printf("Batches: %u, holding %u of the meshes. %u buffer copies\n", batcher.GetBatchCount(), batcher.GetBatchedModelCount(), bufferCopies);
+	bool batchesVerified = VerifyBatches(&backend, meshes, batcher);
+	printf("Merged geometry: %s\n\n", batchesVerified ? "verified" : "MISMATCH");
+
+	printf("  %-22s %12s %12s %10s\n", "", "Unbatched", "Batched", "Reduction");
+	PrintRow("Vertex buffer binds", unbatched.Stats.VertexBufferBinds, batched.Stats.VertexBufferBinds);
+	PrintRow("Index buffer binds", unbatched.Stats.IndexBufferBinds, batched.Stats.IndexBufferBinds);
+	PrintRow("Total binds", unbatched.Stats.TotalBinds(), batched.Stats.TotalBinds());
+	PrintRow("Draw calls", unbatched.Stats.DrawCalls, batched.Stats.DrawCalls);
+
+	// Streaming a level in and out swaps meshes and rebuilds the batches. The ids of the released
+	// buffers must be handed out again, or the sort key fields overflow after enough rebuilds
+	batcher.Clear();
+	uint32 liveVertexBufferIds = Common::DenseIdGenerator<Scene::VertexBufferIdTag>::LiveCount();
+	uint32 largestIdBeforeRebuilds = GetLargestBufferId(meshes, batcher);
+	uint32 largestIdDuringRebuilds = largestIdBeforeRebuilds;
+	for (uint i = 0; i < settings.Rebuilds; ++i) {
+		uint replaced = i % settings.Meshes;
+		Scene::Model *oldMesh = meshes[replaced];
+		meshes[replaced] = CreateMesh(&backend, random, materials);
+		for (auto iter = placements.begin(); iter != placements.end(); ++iter) {
+			if (iter->Model == oldMesh) {
+				iter->Model = meshes[replaced];
+			}
+		}
+		DestroyMesh(&backend, oldMesh);
+
+		// The batcher keeps pointers to its models, so a new one is needed once a mesh is gone.
+		// Building it twice covers Build() throwing away its own batches
+		Scene::StaticBatcher levelBatcher(&backend);
+		for (auto iter = placements.begin(); iter != placements.end(); ++iter) {
+			levelBatcher.AddModel(iter->Model);
+		}
+		levelBatcher.Build();
+		levelBatcher.Build();
+		largestIdDuringRebuilds = std::max(largestIdDuringRebuilds, GetLargestBufferId(meshes, levelBatcher));
+	}
+	bool idsRecycled = largestIdDuringRebuilds <= VertexBufferField::kMaxValue && Common::DenseIdGenerator<Scene::VertexBufferIdTag>::LiveCount() == liveVertexBufferIds;
+
+	printf("\nRebuilds: %u. Largest buffer id %u before, %u during. %u live vertex buffer ids before, %u after\n", settings.Rebuilds,
+	       largestIdBeforeRebuilds, largestIdDuringRebuilds, liveVertexBufferIds, Common::DenseIdGenerator<Scene::VertexBufferIdTag>::LiveCount());
+
+	delete bucket;
+	batcher.Clear();
+	for (auto iter = meshes.begin(); iter != meshes.end(); ++iter) {
+		DestroyMesh(&backend, *iter);
+	}
+	for (auto iter = materials.begin(); iter != materials.end(); ++iter) {
+		delete *iter;
+	}
+
+	if (!batchesVerified) {
+		printf("\nFAILED: The merged buffers don't match the geometry of their models\n");
+		return 1;
+	}
+	if (!idsRecycled) {
+		printf("\nFAILED: Rebuilding the batches leaked buffer ids\n");
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,418 @@
+/* The Halfling Project - A Graphics Engine and Projects
+ *
+ * The Halfling Project is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2013 - 2014
+ */
+
+#include "common/typedefs.h"
+#include "common/allocator_16_byte_aligned.h"
+#include "common/thread_pool.h"
+
+#include "engine/timer.h"
+
+#include "scene/transform_hierarchy.h"
+
+#include <DirectXMath.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+
+typedef std::vector<DirectX::XMMATRIX, Common::Allocator16ByteAligned<DirectX::XMMATRIX> > MatrixList;
+
+/** The largest difference of a world matrix element, relative to the size of the element, that still counts as a match */
+static const float kMaxError = 1.0e-4f;
+
+struct BenchmarkSettings {
+	BenchmarkSettings()
+		: Nodes(100000u),
+		  Frames(20u),
+		  ChangedPerMille(10u),
+		  Threads(0u) {
+	}
+
+	uint Nodes;
+	uint Frames;
+	/** How many nodes out of every 1000 move each frame in the dynamic run */
+	uint ChangedPerMille;
+	/** The number of worker threads. 0 means one less than the number of hardware threads */
+	uint Threads;
+};
+
+/**
+ * The same hierarchy as the one in Scene::TransformHierarchy, the way a demo would store it
+ * without one. A parent index per node, and a recursive walk to find the world transforms.
+ * Indexed by the handles the hierarchy hands out
+ */
+struct ReferenceHierarchy {
+	MatrixList LocalTransforms;
+	MatrixList WorldTransforms;
+	std::vector<uint> Parents;
+	std::vector<bool> Alive;
+	std::vector<std::vector<uint> > Children;
+	std::vector<uint> Roots;
+};
+
+void PrintUsage() {
+	printf("Usage: TransformHierarchyBenchmark [-nodes <count>] [-frames <count>] [-changed <per mille>] [-threads <count>]\n\n"
+	       "    -nodes      The number of nodes in the hierarchy. Defaults to 100000\n"
+	       "    -frames     The number of frames to average over. Defaults to 20\n"
+	       "    -changed    How many nodes out of every 1000 move each frame in the dynamic run. Defaults to 10\n"
+	       "    -threads    The number of worker threads. Defaults to one less than the number of hardware threads\n");
+}
+
+DirectX::XMMATRIX RandomLocalTransform(std::mt19937 &generator) {
+	std::uniform_real_distribution<float> angle(0.0f, DirectX::XM_2PI);
+	std::uniform_real_distribution<float> scale(0.9f, 1.1f);
+	std::uniform_real_distribution<float> position(-10.0f, 10.0f);
+
+	float uniformScale = scale(generator);
+	return DirectX::XMMatrixScaling(uniformScale, uniformScale, uniformScale) *
+	       DirectX::XMMatrixRotationRollPitchYaw(angle(generator), angle(generator), angle(generator)) *
+	       DirectX::XMMatrixTranslation(position(generator), position(generator), position(generator));
+}
+
+void ResizeReference(ReferenceHierarchy *reference, uint size) {
+	if (reference->Parents.size() < size) {
+		reference->LocalTransforms.resize(size);
+		reference->WorldTransforms.resize(size);
+		reference->Parents.resize(size, Scene::TransformHierarchy::kNullNode);
+		reference->Alive.resize(size, false);
+	}
+}
+
+void EvaluateRecursive(ReferenceHierarchy *reference, uint node, DirectX::CXMMATRIX parentWorld) {
+	DirectX::XMMATRIX world = reference->LocalTransforms[node] * parentWorld;
+	reference->WorldTransforms[node] = world;
+
+	const std::vector<uint> &children = reference->Children[node];
+	for (auto iter = children.begin(); iter != children.end(); ++iter) {
+		EvaluateRecursive(reference, *iter, world);
+	}
+}
+
+/** Rebuilds the child lists from the parent indices, then finds every world transform recursively */
+void EvaluateReference(ReferenceHierarchy *reference) {
+	uint size = static_cast<uint>(reference->Parents.size());
+	reference->Children.resize(size);
+	for (uint i = 0; i < size; ++i) {
+		reference->Children[i].clear();
+	}
+	reference->Roots.clear();
+
+	for (uint i = 0; i < size; ++i) {
+		if (!reference->Alive[i]) {
+			continue;
+		}
+		if (reference->Parents[i] == Scene::TransformHierarchy::kNullNode) {
+			reference->Roots.push_back(i);
+		} else {
+			reference->Children[reference->Parents[i]].push_back(i);
+		}
+	}
+
+	for (auto iter = reference->Roots.begin(); iter != reference->Roots.end(); ++iter) {
+		EvaluateRecursive(reference, *iter, DirectX::XMMatrixIdentity());
+	}
+}
+
+/** Returns the largest relative difference between the world transforms of the hierarchy and the reference */
+float MaxDifference(const Scene::TransformHierarchy &hierarchy, const ReferenceHierarchy &reference, uint *out_mismatches) {
+	float maxError = 0.0f;
+	uint liveNodes = 0u;
+
+	for (uint i = 0; i < reference.Parents.size(); ++i) {
+		if (!reference.Alive[i]) {
+			continue;
+		}
+		++liveNodes;
+
+		if (!hierarchy.IsValid(i) || hierarchy.GetParent(i) != reference.Parents[i]) {
+			++(*out_mismatches);
+			continue;
+		}
+
+		DirectX::XMFLOAT4X4 actual;
+		DirectX::XMFLOAT4X4 expected;
+		DirectX::XMStoreFloat4x4(&actual, hierarchy.GetWorldTransform(i));
+		DirectX::XMStoreFloat4x4(&expected, reference.WorldTransforms[i]);
+
+		float nodeError = 0.0f;
+		for (uint row = 0; row < 4; ++row) {
+			for (uint column = 0; column < 4; ++column) {
+				float error = std::fabs(actual.m[row][column] - expected.m[row][column]) / std::max(1.0f, std::fabs(expected.m[row][column]));
+				nodeError = std::max(nodeError, error);
+			}
+		}
+		if (!(nodeError <= kMaxError)) {
+			++(*out_mismatches);
+		}
+		maxError = std::max(maxError, nodeError);
+	}
+
+	if (liveNodes != hierarchy.GetSize()) {
+		++(*out_mismatches);
+	}
+
+	return maxError;
+}
+
+/** Returns true if 'node' or one of its ancestors is marked in 'moved' */
+bool HasMovedAncestor(const ReferenceHierarchy &reference, const std::vector<bool> &moved, uint node) {
+	for (; node != Scene::TransformHierarchy::kNullNode; node = reference.Parents[node]) {
+		if (moved[node]) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Checks that the changed node list of the last Update() holds exactly the moved nodes and their
+ * descendants, and that every parent is listed before its children
+ */
+uint CheckChangedNodes(const Scene::TransformHierarchy &hierarchy, const ReferenceHierarchy &reference, const std::vector<bool> &moved) {
+	uint mismatches = 0u;
+
+	std::vector<bool> listed(reference.Parents.size(), false);
+	const std::vector<uint> &changed = hierarchy.GetChangedNodes();
+	for (auto iter = changed.begin(); iter != changed.end(); ++iter) {
+		if (*iter >= listed.size() || listed[*iter] || !HasMovedAncestor(reference, moved, *iter)) {
+			++mismatches;
+			continue;
+		}
+
+		uint parent = reference.Parents[*iter];
+		if (parent != Scene::TransformHierarchy::kNullNode && moved[*iter] == false && !listed[parent]) {
+			++mismatches;
+		}
+		listed[*iter] = true;
+	}
+
+	for (uint i = 0; i < reference.Parents.size(); ++i) {
+		if (reference.Alive[i] && !listed[i] && HasMovedAncestor(reference, moved, i)) {
+			++mismatches;
+		}
+	}
+
+	return mismatches;
+}
+
+void PrintResult(const char *name, double milliseconds, uint recomputed, float maxError) {
+	printf("  %-32s %12.3f %12u %12g\n", name, milliseconds, recomputed, maxError);
+}
+
+/**
+ * A headless benchmark and self-check of Scene::TransformHierarchy. After each kind of change, the
+ * world transforms are checked against a recursive walk of the same hierarchy, and the changed node
+ * list against the subtrees that were moved. Exits with 1 if any of them disagree
+ */
+int main(int argc, char *argv[]) {
+	BenchmarkSettings settings;
+
+	for (int i = 1; i < argc; ++i) {
+		if (i + 1 >= argc) {
+			PrintUsage();
+			return 1;
+		}
+
+		uint value = static_cast<uint>(atoi(argv[i + 1]));
+		if (strcmp(argv[i], "-nodes") == 0) {
+			settings.Nodes = value;
+		} else if (strcmp(argv[i], "-frames") == 0) {
+			settings.Frames = value;
+		} else if (strcmp(argv[i], "-changed") == 0) {
+			settings.ChangedPerMille = value;
+		} else if (strcmp(argv[i], "-threads") == 0) {
+			settings.Threads = value;
+		} else {
+			PrintUsage();
+			return 1;
+		}
+		++i;
+	}
+
+	if (settings.Nodes == 0u || settings.Frames == 0u || settings.ChangedPerMille > 1000u) {
+		printf("Settings out of range. Nodes and frames must be at least 1, and changed must be in [0, 1000]\n\n");
+		PrintUsage();
+		return 1;
+	}
+
+	Common::ThreadPool threadPool(settings.Threads);
+	std::mt19937 generator(1234u);
+	Engine::Timer timer;
+	uint mismatches = 0u;
+
+	// A wide, shallow hierarchy, like a scene. Each node hangs off a random earlier node, and one in a thousand is a root
+	Scene::TransformHierarchy hierarchy(settings.Nodes);
+	ReferenceHierarchy reference;
+	ResizeReference(&reference, settings.Nodes);
+
+	std::uniform_int_distribution<uint> rootDistribution(0u, 999u);
+	for (uint i = 0; i < settings.Nodes; ++i) {
+		uint parent = Scene::TransformHierarchy::kNullNode;
+		if (i != 0u && rootDistribution(generator) != 0u) {
+			parent = std::uniform_int_distribution<uint>(0u, i - 1u)(generator);
+		}
+
+		DirectX::XMMATRIX local = RandomLocalTransform(generator);
+		uint node = hierarchy.CreateNode(parent, local);
+		reference.LocalTransforms[node] = local;
+		reference.Parents[node] = parent;
+		reference.Alive[node] = true;
+	}
+
+	timer.Start();
+	uint recomputed = hierarchy.Update(&threadPool);
+	double firstUpdateMilliseconds = timer.GetTime();
+
+	printf("%u nodes on %u levels. Average over %u frames. %u worker threads\n\n", hierarchy.GetSize(), hierarchy.GetLevelCount(), settings.Frames, threadPool.GetThreadCount());
+	printf("  %-32s %12s %12s %12s\n", "Update", "Time (ms)", "Recomputed", "Max error");
+
+	// The recursive walk. This is also the reference every result is checked against
+	timer.Start();
+	for (uint frame = 0; frame < settings.Frames; ++frame) {
+		EvaluateReference(&reference);
+	}
+	PrintResult("Recursive walk, every node", timer.GetTime() / settings.Frames, settings.Nodes, 0.0f);
+
+	PrintResult("First update (+ sort)", firstUpdateMilliseconds, recomputed, MaxDifference(hierarchy, reference, &mismatches));
+
+	// Moving the roots drags every node along
+	std::vector<uint> roots = reference.Roots;
+	Common::ThreadPool *threadPools[2] = {nullptr, &threadPool};
+	const char *fullUpdateNames[2] = {"Every node, 1 thread", "Every node, thread pool"};
+	for (uint i = 0; i < 2; ++i) {
+		timer.Start();
+		for (uint frame = 0; frame < settings.Frames; ++frame) {
+			for (auto iter = roots.begin(); iter != roots.end(); ++iter) {
+				hierarchy.SetLocalTransform(*iter, reference.LocalTransforms[*iter]);
+			}
+			recomputed = hierarchy.Update(threadPools[i]);
+		}
+		PrintResult(fullUpdateNames[i], timer.GetTime() / settings.Frames, recomputed, MaxDifference(hierarchy, reference, &mismatches));
+	}
+
+	// Nothing moves
+	timer.Start();
+	for (uint frame = 0; frame < settings.Frames; ++frame) {
+		recomputed = hierarchy.Update(&threadPool);
+	}
+	PrintResult("Static frame", timer.GetTime() / settings.Frames, recomputed, 0.0f);
+	if (recomputed != 0u || !hierarchy.GetChangedNodes().empty()) {
+		++mismatches;
+	}
+
+	// A few random nodes move every frame. Only the last frame's changes are checked, so the moves are recorded per frame
+	uint changedPerFrame = static_cast<uint>(static_cast<uint64>(settings.Nodes) * settings.ChangedPerMille / 1000u);
+	std::uniform_int_distribution<uint> nodeDistribution(0u, settings.Nodes - 1u);
+	std::vector<uint> movedNodes(changedPerFrame * settings.Frames);
+	MatrixList movedTransforms(movedNodes.size());
+	for (uint i = 0; i < movedNodes.size(); ++i) {
+		movedNodes[i] = nodeDistribution(generator);
+		movedTransforms[i] = RandomLocalTransform(generator);
+	}
+
+	uint64 totalRecomputed = 0u;
+	timer.Start();
+	for (uint frame = 0; frame < settings.Frames; ++frame) {
+		for (uint i = frame * changedPerFrame; i < (frame + 1u) * changedPerFrame; ++i) {
+			hierarchy.SetLocalTransform(movedNodes[i], movedTransforms[i]);
+		}
+		totalRecomputed += hierarchy.Update(&threadPool);
+	}
+	double dynamicMilliseconds = timer.GetTime() / settings.Frames;
+
+	std::vector<bool> moved(settings.Nodes, false);
+	for (uint i = 0; i < movedNodes.size(); ++i) {
+		reference.LocalTransforms[movedNodes[i]] = movedTransforms[i];
+		if (i >= (settings.Frames - 1u) * changedPerFrame) {
+			moved[movedNodes[i]] = true;
+		}
+	}
+	EvaluateReference(&reference);
+
+	char dynamicName[64];
+	sprintf(dynamicName, "%.1f%% moved per frame", settings.ChangedPerMille / 10.0f);
+	PrintResult(dynamicName, dynamicMilliseconds, static_cast<uint>(totalRecomputed / settings.Frames), MaxDifference(hierarchy, reference, &mismatches));
+	mismatches += CheckChangedNodes(hierarchy, reference, moved);
+
+	// Change the structure. Re-parent some nodes, destroy some subtrees and add some new nodes
+	moved.assign(settings.Nodes, false);
+	for (uint i = 0; i < settings.Nodes / 100u; ++i) {
+		uint node = nodeDistribution(generator);
+		uint parent = nodeDistribution(generator);
+		if (!reference.Alive[node] || !reference.Alive[parent] || reference.Parents[node] == parent) {
+			continue;
+		}
+
+		// The new parent can't be below the node
+		bool isDescendant = false;
+		for (uint ancestor = parent; ancestor != Scene::TransformHierarchy::kNullNode; ancestor = reference.Parents[ancestor]) {
+			isDescendant = isDescendant || ancestor == node;
+		}
+		if (isDescendant) {
+			continue;
+		}
+
+		hierarchy.SetParent(node, parent);
+		reference.Parents[node] = parent;
+		moved[node] = true;
+	}
+
+	for (uint i = 0; i < settings.Nodes / 1000u + 1u; ++i) {
+		uint node = nodeDistribution(generator);
+		if (!reference.Alive[node]) {
+			continue;
+		}
+
+		hierarchy.DestroyNode(node);
+
+		// Kill the subtree in the reference. Whatever the hierarchy freed, the reference has to have lost
+		for (uint j = 0; j < reference.Parents.size(); ++j) {
+			if (reference.Alive[j] && !hierarchy.IsValid(j)) {
+				reference.Alive[j] = false;
+				moved[j] = false;
+			}
+		}
+	}
+
+	for (uint i = 0; i < settings.Nodes / 100u; ++i) {
+		uint parent = nodeDistribution(generator);
+		if (!reference.Alive[parent]) {
+			parent = Scene::TransformHierarchy::kNullNode;
+		}
+
+		DirectX::XMMATRIX local = RandomLocalTransform(generator);
+		uint node = hierarchy.CreateNode(parent, local);
+		ResizeReference(&reference, node + 1u);
+		moved.resize(reference.Parents.size(), false);
+		reference.LocalTransforms[node] = local;
+		reference.Parents[node] = parent;
+		reference.Alive[node] = true;
+		moved[node] = true;
+	}
+
+	timer.Start();
+	recomputed = hierarchy.Update(&threadPool);
+	double structureMilliseconds = timer.GetTime();
+	EvaluateReference(&reference);
+	PrintResult("Structure changes (+ sort)", structureMilliseconds, recomputed, MaxDifference(hierarchy, reference, &mismatches));
+	mismatches += CheckChangedNodes(hierarchy, reference, moved);
+
+	printf("\n  Recursive walk: What a demo would do without the hierarchy. Every world transform, every frame\n"
+	       "  Recomputed:     The number of world transforms recomputed by the last frame, or the average for the dynamic run\n"
+	       "  Errors are the largest difference of a world matrix element from the recursive walk, relative to the element\n");
+
+	if (mismatches != 0u) {
+		printf("\nFAILED: %u mismatches\n", mismatches);
+		return 1;
+	}
+
+	return 0;
+}